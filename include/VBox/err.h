@@ -1595,6 +1595,8 @@
 #define VERR_VD_DMG_XML_PARSE_ERROR                 (-3284)
 /** Unable to locate a usable DMG file within the XAR archive. */
 #define VERR_VD_DMG_NOT_FOUND_INSIDE_XAR            (-3285)
+/** The cache has no space left for the data and nothing can be evicted. */
+#define VERR_VD_CACHE_FULL                          (-3286)
 /** @} */
 
 
@@ -111,6 +111,8 @@ typedef enum LOGGROUP
     LOG_GROUP_DEV_LSILOGICSCSI,
     /** NE2000 Device group. */
     LOG_GROUP_DEV_NE2000,
+    /** NVMe Device group. */
+    LOG_GROUP_DEV_NVME,
     /** USB OHCI Device group. */
     LOG_GROUP_DEV_OHCI,
     /** Parallel Device group */
@@ -703,6 +705,8 @@ typedef enum LOGGROUP
     LOG_GROUP_VBGL,
     /** Generic virtual disk layer. */
     LOG_GROUP_VD,
+    /** DDI (deduplicating) virtual disk backend. */
+    LOG_GROUP_VD_DDI,
     /** DMG virtual disk backend. */
     LOG_GROUP_VD_DMG,
     /** iSCSI virtual disk backend. */
@@ -782,6 +786,7 @@ typedef enum LOGGROUP
     "DEV_LPC",      \
     "DEV_LSILOGICSCSI", \
     "DEV_NE2000",   \
+    "DEV_NVME",     \
     "DEV_OHCI",     \
     "DEV_PARALLEL", \
     "DEV_PC",       \
@@ -1078,6 +1083,7 @@ typedef enum LOGGROUP
     "VBGD",         \
     "VBGL",         \
     "VD",           \
+    "VD_DDI",       \
     "VD_DMG",       \
     "VD_ISCSI",     \
     "VD_PARALLELS", \
@@ -29,6 +29,16 @@
 #include <VBox/vd.h>
 #include <VBox/vd-ifs-internal.h>
 
+/** @name VBox HDD cache backend write flags
+ * @{
+ */
+/** The written data is not in the image yet and must be kept in the cache
+ * until it is marked clean. */
+#define VD_CACHE_WRITE_DIRTY    RT_BIT(0)
+/** Mask of valid flags. */
+#define VD_CACHE_WRITE_FLAGS_MASK (VD_CACHE_WRITE_DIRTY)
+/** @}*/
+
 /**
  * Cache format backend interface used by VBox HDD Container implementation.
  */
@@ -157,9 +167,10 @@ typedef struct VDCACHEBACKEND
      *                          that could be written in a full block write,
      *                          when prefixed/postfixed by the appropriate
      *                          amount of (previously read) padding data.
+     * @param   fWrite          Write flags, combination of VD_CACHE_WRITE_* flags.
      */
     DECLR3CALLBACKMEMBER(int, pfnWrite, (void *pBackendData, uint64_t uOffset, size_t cbWrite,
-                                         PVDIOCTX pIoCtx, size_t *pcbWriteProcess));
+                                         PVDIOCTX pIoCtx, size_t *pcbWriteProcess, unsigned fWrite));
 
     /**
      * Flush data to disk.
@@ -189,6 +200,29 @@ typedef struct VDCACHEBACKEND
                                            void   **ppbmAllocationBitmap,
                                            unsigned fDiscard));
 
+    /**
+     * Returns the first range of dirty data at or after the given offset.
+     *
+     * @returns VBox status code.
+     * @retval  VERR_NOT_FOUND if there is no dirty data after the given offset.
+     * @param   pBackendData    Opaque state data for this image.
+     * @param   uOffset         The offset of the virtual disk to start searching at.
+     * @param   puOffsetDirty   Where to store the start of the dirty range.
+     * @param   pcbDirty        Where to store the size of the dirty range.
+     */
+    DECLR3CALLBACKMEMBER(int, pfnQueryDirty, (void *pBackendData, uint64_t uOffset,
+                                              uint64_t *puOffsetDirty, size_t *pcbDirty));
+
+    /**
+     * Marks the given range as written back to the image.
+     *
+     * @returns VBox status code.
+     * @param   pBackendData    Opaque state data for this image.
+     * @param   uOffset         The offset of the first byte to mark clean.
+     * @param   cbClean         How many bytes to mark clean.
+     */
+    DECLR3CALLBACKMEMBER(int, pfnMarkClean, (void *pBackendData, uint64_t uOffset, size_t cbClean));
+
     /**
      * Get the version of a cache image.
      *
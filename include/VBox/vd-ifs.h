@@ -67,6 +67,8 @@ typedef enum VDINTERFACETYPE
     VDINTERFACETYPE_IOINT,
     /** Interface to query the use of block ranges on the disk. Per-operation. */
     VDINTERFACETYPE_QUERYRANGEUSE,
+    /** Interface to report request latencies of the I/O path. Per-disk. */
+    VDINTERFACETYPE_LATENCY,
     /** invalid interface. */
     VDINTERFACETYPE_INVALID
 } VDINTERFACETYPE;
@@ -1321,6 +1323,78 @@ DECLINLINE(int) vdIfQueryRangeUse(PVDINTERFACEQUERYRANGEUSE pIfQueryRangeUse, ui
     return pIfQueryRangeUse->pfnQueryRangeUse(pIfQueryRangeUse->Core.pvUser, off, cb, pfUsed);
 }
 
+/**
+ * Stages of the I/O path a latency is reported for.
+ */
+typedef enum VDLATENCYSTAGE
+{
+    /** Whole request from the submission until the completion callback is called. */
+    VDLATENCYSTAGE_REQUEST = 0,
+    /** Time a request was queued waiting for the disk lock or a blocking request. */
+    VDLATENCYSTAGE_LOCK_WAIT,
+    /** Metadata read issued by the image backend. */
+    VDLATENCYSTAGE_META_READ,
+    /** User data transfer issued to the I/O interface. */
+    VDLATENCYSTAGE_HOST_IO,
+    /** End of valid values. */
+    VDLATENCYSTAGE_END,
+    /** 32bit hack. */
+    VDLATENCYSTAGE_32BIT_HACK = 0x7fffffff
+} VDLATENCYSTAGE;
+
+/**
+ * Interface to report latencies of the different stages of asynchronous I/O.
+ *
+ * Per-disk interface. Optional. The callback can be called from any thread
+ * doing I/O on the disk and should therefore be cheap.
+ */
+typedef struct VDINTERFACELATENCY
+{
+    /**
+     * Common interface header.
+     */
+    VDINTERFACE    Core;
+
+    /**
+     * Record the latency of a finished stage.
+     *
+     * @returns nothing.
+     * @param   pvUser          The opaque data passed on container creation.
+     * @param   enmStage        The stage the latency is for.
+     * @param   fWrite          Flag whether the stage was part of a write (or flush/discard)
+     *                          or a read.
+     * @param   cNsLatency      The latency in nanoseconds.
+     */
+    DECLR3CALLBACKMEMBER(void, pfnLatencyRecord, (void *pvUser, VDLATENCYSTAGE enmStage, bool fWrite,
+                                                  uint64_t cNsLatency));
+
+} VDINTERFACELATENCY, *PVDINTERFACELATENCY;
+
+/**
+ * Get latency interface from interface list.
+ *
+ * @return Pointer to the first latency interface in the list.
+ * @param  pVDIfs    Pointer to the interface list.
+ */
+DECLINLINE(PVDINTERFACELATENCY) VDIfLatencyGet(PVDINTERFACE pVDIfs)
+{
+    PVDINTERFACE pIf = VDInterfaceGet(pVDIfs, VDINTERFACETYPE_LATENCY);
+
+    /* Check that the interface descriptor is a latency interface. */
+    AssertMsgReturn(   !pIf
+                    || (   (pIf->enmInterface == VDINTERFACETYPE_LATENCY)
+                        && (pIf->cbSize == sizeof(VDINTERFACELATENCY))),
+                    ("Not a latency interface"), NULL);
+
+    return (PVDINTERFACELATENCY)pIf;
+}
+
+DECLINLINE(void) vdIfLatencyRecord(PVDINTERFACELATENCY pIfLatency, VDLATENCYSTAGE enmStage, bool fWrite,
+                                   uint64_t cNsLatency)
+{
+    pIfLatency->pfnLatencyRecord(pIfLatency->Core.pvUser, enmStage, fWrite, cNsLatency);
+}
+
 RT_C_DECLS_END
 
 /** @} */
@@ -565,6 +565,55 @@ typedef struct VBOXHDDBACKEND
     DECLR3CALLBACKMEMBER(int, pfnRepair, (const char *pszFilename, PVDINTERFACE pVDIfsDisk,
                                           PVDINTERFACE pVDIfsImage, uint32_t fFlags));
 
+    /**
+     * Queries the ranges of the given disk range which are allocated in this image.
+     * The ranges are sorted by offset and adjacent ranges are merged. A backend
+     * may report allocation at a coarser granularity than it really tracks, but
+     * every byte for which a read would not return VERR_VD_BLOCK_FREE must be
+     * covered by a returned range. NULL if not supported, in which case the whole
+     * range is treated as allocated.
+     *
+     * @returns VBox status code.
+     * @returns VERR_BUFFER_OVERFLOW if the array was filled up and more allocated
+     *          ranges follow. The caller can continue after the end of the last range.
+     * @param   pBackendData    Opaque state data for this image.
+     * @param   uOffset         Start offset of the range to query.
+     * @param   cbRange         Size of the range to query in bytes.
+     * @param   paRanges        Where to store the allocated ranges.
+     * @param   cRanges         Number of entries in the array.
+     * @param   pcRanges        Where to store the number of ranges returned.
+     */
+    DECLR3CALLBACKMEMBER(int, pfnQueryAllocatedRanges, (void *pBackendData, uint64_t uOffset,
+                                                        uint64_t cbRange, PRTRANGE paRanges,
+                                                        unsigned cRanges, unsigned *pcRanges));
+
+    /**
+     * Rearranges the allocated blocks of the image so they are stored in the
+     * order of their disk offsets, starting at the given disk offset. Only a
+     * limited amount of data is moved per call so the caller can release its
+     * locks in between. The image must stay consistent if the operation is
+     * interrupted at any point. NULL if not supported.
+     *
+     * @returns VBox status code.
+     * @returns VERR_NOT_SUPPORTED if this image cannot be defragmented.
+     * @param   pBackendData    Opaque state data for this image.
+     * @param   uOffset         Disk offset to continue at, 0 on the first call.
+     * @param   cbMoveMax       Number of bytes to move before returning. The
+     *                          limit can be exceeded by the size of a few blocks.
+     * @param   puOffsetNext    Where to store the offset to continue at on the
+     *                          next call. The disk size when done.
+     * @param   pcbMoved        Where to store the number of bytes moved.
+     * @param   pVDIfsDisk      Pointer to the per-disk VD interface list.
+     * @param   pVDIfsImage     Pointer to the per-image VD interface list.
+     * @param   pVDIfsOperation Pointer to the per-operation VD interface list.
+     */
+    DECLR3CALLBACKMEMBER(int, pfnDefragment, (void *pBackendData, uint64_t uOffset,
+                                              uint64_t cbMoveMax, uint64_t *puOffsetNext,
+                                              uint64_t *pcbMoved,
+                                              PVDINTERFACE pVDIfsDisk,
+                                              PVDINTERFACE pVDIfsImage,
+                                              PVDINTERFACE pVDIfsOperation));
+
 } VBOXHDDBACKEND;
 
 /** Pointer to VD backend. */
@@ -586,6 +635,39 @@ DECLINLINE(int) genericFileComposeName(PVDINTERFACE pConfig, char **pszName)
     return VINF_SUCCESS;
 }
 
+/**
+ * Appends a range to a range array as used by VBOXHDDBACKEND::pfnQueryAllocatedRanges,
+ * merging it with the last entry if both are adjacent.
+ *
+ * @returns true if the range was added, false if the array is full.
+ * @param   paRanges        The range array.
+ * @param   cRanges         Number of entries in the array.
+ * @param   pcRangesUsed    Number of entries used so far, updated on success.
+ * @param   offStart        Start offset of the range to add.
+ * @param   cbRange         Size of the range to add.
+ */
+DECLINLINE(bool) vdPluginRangeAppend(PRTRANGE paRanges, unsigned cRanges, unsigned *pcRangesUsed,
+                                     uint64_t offStart, size_t cbRange)
+{
+    unsigned cRangesUsed = *pcRangesUsed;
+
+    if (   cRangesUsed
+        && paRanges[cRangesUsed - 1].offStart + paRanges[cRangesUsed - 1].cbRange == offStart
+        && cbRange <= ~(size_t)0 - paRanges[cRangesUsed - 1].cbRange)
+    {
+        paRanges[cRangesUsed - 1].cbRange += cbRange;
+        return true;
+    }
+
+    if (cRangesUsed == cRanges)
+        return false;
+
+    paRanges[cRangesUsed].offStart = offStart;
+    paRanges[cRangesUsed].cbRange  = cbRange;
+    *pcRangesUsed = cRangesUsed + 1;
+    return true;
+}
+
 /** Initialization entry point. */
 typedef DECLCALLBACK(int) VBOXHDDFORMATLOAD(PVBOXHDDBACKEND *ppBackendTable);
 typedef VBOXHDDFORMATLOAD *PFNVBOXHDDFORMATLOAD;
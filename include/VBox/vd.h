@@ -89,6 +89,8 @@ RT_C_DECLS_BEGIN
 /** VDI: Fill new blocks with zeroes while expanding image file. Only valid
  * for newly created images, never set for opened existing images. */
 #define VD_VDI_IMAGE_FLAGS_ZERO_EXPAND          (0x0100)
+/** VDI: Store blocks compressed, only valid for dynamic base images. */
+#define VD_VDI_IMAGE_FLAGS_COMPRESSED           (0x0200)
 
 /** Mask of valid image flags for VMDK. */
 #define VD_VMDK_IMAGE_FLAGS_MASK            (   VD_IMAGE_FLAGS_FIXED | VD_IMAGE_FLAGS_DIFF | VD_IMAGE_FLAGS_NONE \
@@ -96,7 +98,8 @@ RT_C_DECLS_BEGIN
                                              | VD_VMDK_IMAGE_FLAGS_STREAM_OPTIMIZED | VD_VMDK_IMAGE_FLAGS_ESX)
 
 /** Mask of valid image flags for VDI. */
-#define VD_VDI_IMAGE_FLAGS_MASK             (VD_IMAGE_FLAGS_FIXED | VD_IMAGE_FLAGS_DIFF | VD_IMAGE_FLAGS_NONE | VD_VDI_IMAGE_FLAGS_ZERO_EXPAND)
+#define VD_VDI_IMAGE_FLAGS_MASK             (  VD_IMAGE_FLAGS_FIXED | VD_IMAGE_FLAGS_DIFF | VD_IMAGE_FLAGS_NONE | VD_VDI_IMAGE_FLAGS_ZERO_EXPAND \
+                                             | VD_VDI_IMAGE_FLAGS_COMPRESSED)
 
 /** Mask of all valid image flags for all formats. */
 #define VD_IMAGE_FLAGS_MASK                 (VD_VMDK_IMAGE_FLAGS_MASK | VD_VDI_IMAGE_FLAGS_MASK)
@@ -236,8 +239,15 @@ typedef struct VBOXHDDRAW
  * can lead to corrupted images in read-write mode.
  */
 #define VD_OPEN_FLAGS_SKIP_CONSISTENCY_CHECKS  RT_BIT(10)
+/**
+ * Operate the cache in write-back mode. Only valid for VDCacheOpen. Guest writes
+ * to the last image are stored in the cache only and written to the image when
+ * the cache is closed or the image chain is modified. The cache must not be
+ * detached from the disk without going through VDCacheClose.
+ */
+#define VD_OPEN_FLAGS_CACHE_WRITE_BACK         RT_BIT(11)
 /** Mask of valid flags. */
-#define VD_OPEN_FLAGS_MASK          (VD_OPEN_FLAGS_NORMAL | VD_OPEN_FLAGS_READONLY | VD_OPEN_FLAGS_HONOR_ZEROES | VD_OPEN_FLAGS_HONOR_SAME | VD_OPEN_FLAGS_INFO | VD_OPEN_FLAGS_ASYNC_IO | VD_OPEN_FLAGS_SHAREABLE | VD_OPEN_FLAGS_SEQUENTIAL | VD_OPEN_FLAGS_DISCARD | VD_OPEN_FLAGS_IGNORE_FLUSH | VD_OPEN_FLAGS_INFORM_ABOUT_ZERO_BLOCKS | VD_OPEN_FLAGS_SKIP_CONSISTENCY_CHECKS)
+#define VD_OPEN_FLAGS_MASK          (VD_OPEN_FLAGS_NORMAL | VD_OPEN_FLAGS_READONLY | VD_OPEN_FLAGS_HONOR_ZEROES | VD_OPEN_FLAGS_HONOR_SAME | VD_OPEN_FLAGS_INFO | VD_OPEN_FLAGS_ASYNC_IO | VD_OPEN_FLAGS_SHAREABLE | VD_OPEN_FLAGS_SEQUENTIAL | VD_OPEN_FLAGS_DISCARD | VD_OPEN_FLAGS_IGNORE_FLUSH | VD_OPEN_FLAGS_INFORM_ABOUT_ZERO_BLOCKS | VD_OPEN_FLAGS_SKIP_CONSISTENCY_CHECKS | VD_OPEN_FLAGS_CACHE_WRITE_BACK)
 /** @}*/
 
 /**
@@ -685,6 +695,9 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
  *                          image in the source chain given by nImageSameFrom or
  *                          VD_IMAGE_CONTENT_UNKNOWN to indicate that the content of both containers is unknown.
  *                          See the notes for further information.
+ * @param   cCopyBufs       Number of buffers in flight between the reader and the writer
+ *                          of the copy pipeline (0 selects the default).
+ * @param   cbCopyBuf       Size of one copy buffer in bytes (0 selects the default).
  * @param   uImageFlags     Flags specifying special destination image features.
  * @param   pDstUuid        New UUID of the destination image. If NULL, a new UUID is created.
  *                          This parameter is used if and only if a true copy is created.
@@ -720,6 +733,7 @@ VBOXDDU_DECL(int) VDCopyEx(PVBOXHDD pDiskFrom, unsigned nImage, PVBOXHDD pDiskTo
                            const char *pszBackend, const char *pszFilename,
                            bool fMoveByRename, uint64_t cbSize,
                            unsigned nImageFromSame, unsigned nImageToSame,
+                           unsigned cCopyBufs, size_t cbCopyBuf,
                            unsigned uImageFlags, PCRTUUID pDstUuid,
                            unsigned uOpenFlags, PVDINTERFACE pVDIfsOperation,
                            PVDINTERFACE pDstVDIfsImage,
@@ -794,6 +808,28 @@ VBOXDDU_DECL(int) VDCopy(PVBOXHDD pDiskFrom, unsigned nImage, PVBOXHDD pDiskTo,
 VBOXDDU_DECL(int) VDCompact(PVBOXHDD pDisk, unsigned nImage,
                             PVDINTERFACE pVDIfsOperation);
 
+/**
+ * Rearranges the blocks of an image so they are stored in the order of their
+ * disk offsets, which turns sequential reads of the disk into sequential reads
+ * of the image file again.
+ *
+ * @note In contrast to VDCompact() the work is split into small steps and the
+ * disk is only locked for one step at a time, so the image can be defragmented
+ * while it is used through the synchronous I/O interface. The image stays
+ * consistent if the operation is cancelled through the progress interface.
+ *
+ * @return  VBox status code.
+ * @return  VERR_VD_IMAGE_NOT_FOUND if image with specified number was not opened.
+ * @return  VERR_VD_IMAGE_READ_ONLY if image is not writable.
+ * @return  VERR_NOT_SUPPORTED if this kind of image can't be defragmented.
+ * @param   pDisk           Pointer to HDD container.
+ * @param   nImage          Image number, counts from 0. 0 is always base image of container.
+ * @param   cbPerSecMax     Maximum number of bytes to move per second, 0 for no limit.
+ * @param   pVDIfsOperation Pointer to the per-operation VD interface list.
+ */
+VBOXDDU_DECL(int) VDDefragment(PVBOXHDD pDisk, unsigned nImage, uint64_t cbPerSecMax,
+                               PVDINTERFACE pVDIfsOperation);
+
 /**
  * Resizes the given disk image to the given size. It is OK if there are
  * multiple images open in the container. In this case the last disk image
@@ -1160,6 +1196,28 @@ VBOXDDU_DECL(int) VDSetParentUuid(PVBOXHDD pDisk, unsigned nImage,
 VBOXDDU_DECL(void) VDDumpImages(PVBOXHDD pDisk);
 
 
+/**
+ * Queries the ranges of the disk which are allocated in the given image or
+ * one of its parents. The ranges of all images in the chain are merged, sorted
+ * by offset and coalesced. The result may cover more than what is really
+ * allocated if a backend tracks allocation at a coarser granularity.
+ *
+ * @return  VBox status code.
+ * @return  VERR_VD_IMAGE_NOT_FOUND if image with specified number was not opened.
+ * @return  VERR_BUFFER_OVERFLOW if the array was filled up and more allocated ranges
+ *          follow. The query can be continued after the end of the last returned range.
+ * @param   pDisk           Pointer to HDD container.
+ * @param   nImage          Image number, counts from 0. 0 is always base image of container.
+ * @param   uOffset         Start offset of the range to query.
+ * @param   cbRange         Size of the range to query in bytes.
+ * @param   paRanges        Where to store the allocated ranges.
+ * @param   cRanges         Number of entries in the array.
+ * @param   pcRanges        Where to store the number of ranges returned.
+ */
+VBOXDDU_DECL(int) VDQueryAllocatedRanges(PVBOXHDD pDisk, unsigned nImage, uint64_t uOffset,
+                                         uint64_t cbRange, PRTRANGE paRanges, unsigned cRanges,
+                                         unsigned *pcRanges);
+
 /**
  * Discards unused ranges given as a list.
  *
@@ -1230,10 +1230,19 @@ typedef struct RTFILEAIOLIMITS
     /** The alignment data buffers need to have.
      * 0 means no alignment restrictions. */
     uint32_t cbBufferAlignment;
+    /** Flags, see RTFILEAIOLIMITS_F_XXX. */
+    uint32_t fFlags;
 } RTFILEAIOLIMITS;
 /** A pointer to a AIO limits structure. */
 typedef RTFILEAIOLIMITS *PRTFILEAIOLIMITS;
 
+/** @name RTFILEAIOLIMITS flags
+ * @{ */
+/** Requests are processed asynchronously for files opened without
+ *  RTFILE_O_NO_CACHE too. */
+#define RTFILEAIOLIMITS_F_BUFFERED_IO           RT_BIT_32(0)
+/** @} */
+
 /**
  * Returns the global limits for the AIO API.
  *
@@ -64,9 +64,11 @@
  * E1K_ITR_ENABLED reduces the number of interrupts generated by E1000 if a
  * guest driver requested it by writing non-zero value to the Interrupt
  * Throttling Register (see section 13.4.18 in "8254x Family of Gigabit
- * Ethernet Controllers Software Developer’s Manual").
+ * Ethernet Controllers Software Developer’s Manual"). Interrupts requested
+ * too early are postponed with the late interrupt timer. Can be switched off
+ * at runtime with the ItrEnabled/ItrRxEnabled configuration keys.
  */
-//#define E1K_ITR_ENABLED
+#define E1K_ITR_ENABLED
 /** @def E1K_TX_DELAY
  * E1K_TX_DELAY aims to improve guest-host transfer rate for TCP streams by
  * preventing packets to be sent immediately. It allows to send several
@@ -77,12 +79,13 @@
 /** @def E1K_USE_TX_TIMERS
  * E1K_USE_TX_TIMERS aims to reduce the number of generated TX interrupts if a
  * guest driver set the delays via the Transmit Interrupt Delay Value (TIDV)
- * register. Enabling it showed no positive effects on existing guests so it
- * stays disabled. See sections 3.2.7.1 and 3.4.3.1 in "8254x Family of Gigabit
- * Ethernet Controllers Software Developer’s Manual" for more detailed
- * explanation.
+ * register. The delay only applies to descriptors with IDE bit set, so guests
+ * that do not ask for it are not affected. Can be switched off at runtime with
+ * the TidEnabled configuration key. See sections 3.2.7.1 and 3.4.3.1 in "8254x
+ * Family of Gigabit Ethernet Controllers Software Developer’s Manual" for more
+ * detailed explanation.
  */
-//#define E1K_USE_TX_TIMERS
+#define E1K_USE_TX_TIMERS
 /** @def E1K_NO_TAD
  * E1K_NO_TAD disables one of two timers enabled by E1K_USE_TX_TIMERS, the
  * Transmit Absolute Delay time. This timer sets the maximum time interval
@@ -90,6 +93,15 @@
  * if E1K_USE_TX_TIMERS is not defined.
  */
 //#define E1K_NO_TAD
+/** @def E1K_USE_RX_TIMERS
+ * E1K_USE_RX_TIMERS makes E1000 honor the Receive Delay Timer (RDTR) and the
+ * Receive Interrupt Absolute Delay Timer (RADV) registers, postponing RXT0
+ * interrupts so that several received packets are signalled at once. Can be
+ * switched off at runtime with the RidEnabled configuration key. See section
+ * 3.2.7 in "8254x Family of Gigabit Ethernet Controllers Software Developer’s
+ * Manual".
+ */
+#define E1K_USE_RX_TIMERS
 /** @def E1K_REL_DEBUG
  * E1K_REL_DEBUG enables debug logging of l1, l2, l3 in release build.
  */
@@ -1083,8 +1095,16 @@ struct E1kState_st
     bool        fRCEnabled;
     /** EMT: Compute Ethernet CRC for RX packets. */
     bool        fEthernetCRC;
-
-    bool        Alignment2[3];
+    /** EMT: Throttle interrupts according to ITR. */
+    bool        fItrEnabled;
+    /** EMT: Throttle RXT0 interrupts as well (requires fItrEnabled). */
+    bool        fItrRxEnabled;
+    /** EMT: Honor TIDV/TADV for TX descriptors with IDE bit set. */
+    bool        fTidEnabled;
+    /** EMT: Honor RDTR/RADV for received packets. */
+    bool        fRidEnabled;
+
+    bool        Alignment2[7];
     /** Link up delay (in milliseconds). */
     uint32_t    cMsLinkUpDelay;
 
@@ -1207,6 +1227,10 @@ struct E1kState_st
     STAMCOUNTER                         StatLateInts;
     STAMCOUNTER                         StatIntsRaised;
     STAMCOUNTER                         StatIntsPrevented;
+    STAMCOUNTER                         StatIntsSaved;
+    STAMCOUNTER                         StatIntsThrottled;
+    STAMCOUNTER                         StatRxIntsDelayed;
+    STAMCOUNTER                         StatTxIntsDelayed;
     STAMPROFILEADV                      StatReceive;
     STAMPROFILEADV                      StatReceiveCRC;
     STAMPROFILEADV                      StatReceiveFilter;
@@ -1899,6 +1923,7 @@ static int e1kRaiseInterrupt(PE1KSTATE pThis, int rcBusy, uint32_t u32IntCause =
         if (pThis->fIntRaised)
         {
             E1K_INC_ISTAT_CNT(pThis->uStatIntSkip);
+            STAM_COUNTER_INC(&pThis->StatIntsSaved);
             E1kLog2(("%s e1kRaiseInterrupt: Already raised, skipped. ICR&IMS=%08x\n",
                     pThis->szPrf, ICR & IMS));
         }
@@ -1907,14 +1932,28 @@ static int e1kRaiseInterrupt(PE1KSTATE pThis, int rcBusy, uint32_t u32IntCause =
 #ifdef E1K_ITR_ENABLED
             uint64_t tstamp = TMTimerGet(pThis->CTX_SUFF(pIntTimer));
             /* interrupts/sec = 1 / (256 * 10E-9 * ITR) */
+            uint64_t cTicksItr = TMTimerFromNano(pThis->CTX_SUFF(pIntTimer), ITR * 256);
             E1kLog2(("%s e1kRaiseInterrupt: tstamp - pThis->u64AckedAt = %d, ITR * 256 = %d\n",
                         pThis->szPrf, (uint32_t)(tstamp - pThis->u64AckedAt), ITR * 256));
-            //if (!!ITR && pThis->fIntMaskUsed && tstamp - pThis->u64AckedAt < ITR * 256)
-            if (!!ITR && tstamp - pThis->u64AckedAt < ITR * 256 && !(ICR & ICR_RXT0))
+            if (   ITR
+                && pThis->fItrEnabled
+                && (pThis->fItrRxEnabled || !(ICR & ICR_RXT0))
+                && tstamp - pThis->u64AckedAt < cTicksItr)
             {
                 E1K_INC_ISTAT_CNT(pThis->uStatIntEarly);
                 E1kLog2(("%s e1kRaiseInterrupt: Too early to raise again: %d ns < %d ns.\n",
                         pThis->szPrf, (uint32_t)(tstamp - pThis->u64AckedAt), ITR * 256));
+                /*
+                 * Deliver all causes accumulated so far with a single interrupt
+                 * as soon as the throttling interval is over.
+                 */
+                if (TMTimerIsActive(pThis->CTX_SUFF(pIntTimer)))
+                    STAM_COUNTER_INC(&pThis->StatIntsSaved);
+                else
+                {
+                    STAM_COUNTER_INC(&pThis->StatIntsThrottled);
+                    TMTimerSet(pThis->CTX_SUFF(pIntTimer), pThis->u64AckedAt + cTicksItr);
+                }
             }
             else
 #endif
@@ -1946,6 +1985,35 @@ static int e1kRaiseInterrupt(PE1KSTATE pThis, int rcBusy, uint32_t u32IntCause =
     return VINF_SUCCESS;
 }
 
+/**
+ * Signal the guest that a complete packet has been received.
+ *
+ * If the guest driver set up receive delay timers via RDTR/RADV the RXT0
+ * interrupt is postponed, otherwise it is raised immediately.
+ *
+ * @param   pThis       The device state structure.
+ */
+DECLINLINE(void) e1kRaiseRxInterrupt(PE1KSTATE pThis)
+{
+#ifdef E1K_USE_RX_TIMERS
+    if (RDTR && pThis->fRidEnabled)
+    {
+        /* Every packet restarts the packet timer (discard .024) */
+        if (TMTimerIsActive(pThis->CTX_SUFF(pRIDTimer)))
+            STAM_COUNTER_INC(&pThis->StatIntsSaved);
+        e1kArmTimer(pThis, pThis->CTX_SUFF(pRIDTimer), RDTR);
+        /* If absolute timer delay is enabled and the timer is not running yet, arm it. */
+        if (RADV != 0 && !TMTimerIsActive(pThis->CTX_SUFF(pRADTimer)))
+            e1kArmTimer(pThis, pThis->CTX_SUFF(pRADTimer), RADV);
+        STAM_COUNTER_INC(&pThis->StatRxIntsDelayed);
+        return;
+    }
+#endif /* E1K_USE_RX_TIMERS */
+    /* 0 delay means immediate interrupt */
+    E1K_INC_ISTAT_CNT(pThis->uStatIntRx);
+    e1kRaiseInterrupt(pThis, VERR_SEM_BUSY, ICR_RXT0);
+}
+
 /**
  * Compute the physical address of the descriptor.
  *
@@ -2190,24 +2258,7 @@ static DECLCALLBACK(void) e1kStoreRxFragment(PE1KSTATE pThis, E1KRXDESC *pDesc,
     if (pDesc->status.fEOP)
     {
         /* Complete packet has been stored -- it is time to let the guest know. */
-#ifdef E1K_USE_RX_TIMERS
-        if (RDTR)
-        {
-            /* Arm the timer to fire in RDTR usec (discard .024) */
-            e1kArmTimer(pThis, pThis->CTX_SUFF(pRIDTimer), RDTR);
-            /* If absolute timer delay is enabled and the timer is not running yet, arm it. */
-            if (RADV != 0 && !TMTimerIsActive(pThis->CTX_SUFF(pRADTimer)))
-                e1kArmTimer(pThis, pThis->CTX_SUFF(pRADTimer), RADV);
-        }
-        else
-        {
-#endif
-            /* 0 delay means immediate interrupt */
-            E1K_INC_ISTAT_CNT(pThis->uStatIntRx);
-            e1kRaiseInterrupt(pThis, VERR_SEM_BUSY, ICR_RXT0);
-#ifdef E1K_USE_RX_TIMERS
-        }
-#endif
+        e1kRaiseRxInterrupt(pThis);
     }
     STAM_PROFILE_ADV_STOP(&pThis->StatReceiveStore, a);
 }
@@ -2479,24 +2530,7 @@ static int e1kHandleRxPacket(PE1KSTATE pThis, const void *pvBuf, size_t cb, E1KR
     e1kCsRxLeave(pThis);
 #ifdef E1K_WITH_RXD_CACHE
     /* Complete packet has been stored -- it is time to let the guest know. */
-# ifdef E1K_USE_RX_TIMERS
-    if (RDTR)
-    {
-        /* Arm the timer to fire in RDTR usec (discard .024) */
-        e1kArmTimer(pThis, pThis->CTX_SUFF(pRIDTimer), RDTR);
-        /* If absolute timer delay is enabled and the timer is not running yet, arm it. */
-        if (RADV != 0 && !TMTimerIsActive(pThis->CTX_SUFF(pRADTimer)))
-            e1kArmTimer(pThis, pThis->CTX_SUFF(pRADTimer), RADV);
-    }
-    else
-    {
-# endif /* E1K_USE_RX_TIMERS */
-        /* 0 delay means immediate interrupt */
-        E1K_INC_ISTAT_CNT(pThis->uStatIntRx);
-        e1kRaiseInterrupt(pThis, VERR_SEM_BUSY, ICR_RXT0);
-# ifdef E1K_USE_RX_TIMERS
-    }
-# endif /* E1K_USE_RX_TIMERS */
+    e1kRaiseRxInterrupt(pThis);
 #endif /* E1K_WITH_RXD_CACHE */
 
     return VINF_SUCCESS;
@@ -3222,7 +3256,7 @@ static DECLCALLBACK(void) e1kTxIntDelayTimer(PPDMDEVINS pDevIns, PTMTIMER pTimer
 #ifndef E1K_NO_TAD
     e1kCancelTimer(pThis, pThis->CTX_SUFF(pTADTimer));
 #endif /* E1K_NO_TAD */
-    e1kRaiseInterrupt(pThis, ICR_TXDW);
+    e1kRaiseInterrupt(pThis, VERR_SEM_BUSY, ICR_TXDW);
 }
 
 /**
@@ -3242,7 +3276,7 @@ static DECLCALLBACK(void) e1kTxAbsDelayTimer(PPDMDEVINS pDevIns, PTMTIMER pTimer
     E1K_INC_ISTAT_CNT(pThis->uStatTAD);
     /* Cancel interrupt delay timer as we have already got attention */
     e1kCancelTimer(pThis, pThis->CTX_SUFF(pTIDTimer));
-    e1kRaiseInterrupt(pThis, ICR_TXDW);
+    e1kRaiseInterrupt(pThis, VERR_SEM_BUSY, ICR_TXDW);
 }
 
 #endif /* E1K_USE_TX_TIMERS */
@@ -3265,7 +3299,7 @@ static DECLCALLBACK(void) e1kRxIntDelayTimer(PPDMDEVINS pDevIns, PTMTIMER pTimer
     E1K_INC_ISTAT_CNT(pThis->uStatRID);
     /* Cancel absolute delay timer as we have already got attention */
     e1kCancelTimer(pThis, pThis->CTX_SUFF(pRADTimer));
-    e1kRaiseInterrupt(pThis, ICR_RXT0);
+    e1kRaiseInterrupt(pThis, VERR_SEM_BUSY, ICR_RXT0);
 }
 
 /**
@@ -3285,7 +3319,7 @@ static DECLCALLBACK(void) e1kRxAbsDelayTimer(PPDMDEVINS pDevIns, PTMTIMER pTimer
     E1K_INC_ISTAT_CNT(pThis->uStatRAD);
     /* Cancel interrupt delay timer as we have already got attention */
     e1kCancelTimer(pThis, pThis->CTX_SUFF(pRIDTimer));
-    e1kRaiseInterrupt(pThis, ICR_RXT0);
+    e1kRaiseInterrupt(pThis, VERR_SEM_BUSY, ICR_RXT0);
 }
 
 #endif /* E1K_USE_RX_TIMERS */
@@ -4396,16 +4430,12 @@ static void e1kDescReport(PE1KSTATE pThis, E1KTXDESC* pDesc, RTGCPHYS addr)
         if (pDesc->legacy.cmd.fEOP)
         {
 #ifdef E1K_USE_TX_TIMERS
-            if (pDesc->legacy.cmd.fIDE)
+            if (pDesc->legacy.cmd.fIDE && TIDV && pThis->fTidEnabled)
             {
                 E1K_INC_ISTAT_CNT(pThis->uStatTxIDE);
-                //if (pThis->fIntRaised)
-                //{
-                //    /* Interrupt is already pending, no need for timers */
-                //    ICR |= ICR_TXDW;
-                //}
-                //else {
-                /* Arm the timer to fire in TIVD usec (discard .024) */
+                /* Every packet restarts the timer to fire in TIDV usec (discard .024) */
+                if (TMTimerIsActive(pThis->CTX_SUFF(pTIDTimer)))
+                    STAM_COUNTER_INC(&pThis->StatIntsSaved);
                 e1kArmTimer(pThis, pThis->CTX_SUFF(pTIDTimer), TIDV);
 # ifndef E1K_NO_TAD
                 /* If absolute timer delay is enabled and the timer is not running yet, arm it. */
@@ -4414,13 +4444,15 @@ static void e1kDescReport(PE1KSTATE pThis, E1KTXDESC* pDesc, RTGCPHYS addr)
                 if (TADV != 0 && !TMTimerIsActive(pThis->CTX_SUFF(pTADTimer)))
                     e1kArmTimer(pThis, pThis->CTX_SUFF(pTADTimer), TADV);
 # endif /* E1K_NO_TAD */
+                STAM_COUNTER_INC(&pThis->StatTxIntsDelayed);
             }
             else
             {
-                E1kLog2(("%s No IDE set, cancel TAD timer and raise interrupt\n",
+                E1kLog2(("%s No IDE set, cancel TX delay timers and raise interrupt\n",
                         pThis->szPrf));
-# ifndef E1K_NO_TAD
                 /* Cancel both timers if armed and fire immediately. */
+                e1kCancelTimer(pThis, pThis->CTX_SUFF(pTIDTimer));
+# ifndef E1K_NO_TAD
                 e1kCancelTimer(pThis, pThis->CTX_SUFF(pTADTimer));
 # endif /* E1K_NO_TAD */
 #endif /* E1K_USE_TX_TIMERS */
@@ -4460,10 +4492,6 @@ static int e1kXmitDesc(PE1KSTATE pThis, E1KTXDESC* pDesc, RTGCPHYS addr, bool fO
 
     e1kPrintTDesc(pThis, pDesc, "vvv");
 
-#ifdef E1K_USE_TX_TIMERS
-    e1kCancelTimer(pThis, pThis->CTX_SUFF(pTIDTimer));
-#endif /* E1K_USE_TX_TIMERS */
-
     switch (e1kGetDescType(pDesc))
     {
         case E1K_DTYP_CONTEXT:
@@ -4721,10 +4749,6 @@ static int e1kXmitDesc(PE1KSTATE pThis, E1KTXDESC* pDesc, RTGCPHYS addr,
 
     e1kPrintTDesc(pThis, pDesc, "vvv");
 
-#ifdef E1K_USE_TX_TIMERS
-    e1kCancelTimer(pThis, pThis->CTX_SUFF(pTIDTimer));
-#endif /* E1K_USE_TX_TIMERS */
-
     switch (e1kGetDescType(pDesc))
     {
         case E1K_DTYP_CONTEXT:
@@ -6530,6 +6554,50 @@ static DECLCALLBACK(void *) e1kR3QueryInterface(struct PDMIBASE *pInterface, con
 
 /* -=-=-=-=- Saved State -=-=-=-=- */
 
+/**
+ * Turns interrupts held back by the delay timers into pending causes.
+ *
+ * The delay timers are not part of the saved state. Rather than losing the
+ * interrupts they postpone, set the corresponding causes in ICR right away
+ * and let the late interrupt timer deliver them.
+ *
+ * @param   pThis      The E1K state.
+ */
+static void e1kR3FlushDelayedInts(PE1KSTATE pThis)
+{
+    uint32_t fCauses = 0;
+#ifdef E1K_USE_RX_TIMERS
+    if (   TMTimerIsActive(pThis->pRIDTimerR3)
+        || TMTimerIsActive(pThis->pRADTimerR3))
+    {
+        e1kCancelTimer(pThis, pThis->pRIDTimerR3);
+        e1kCancelTimer(pThis, pThis->pRADTimerR3);
+        fCauses |= ICR_RXT0;
+    }
+#endif /* E1K_USE_RX_TIMERS */
+#ifdef E1K_USE_TX_TIMERS
+    if (TMTimerIsActive(pThis->pTIDTimerR3))
+    {
+        e1kCancelTimer(pThis, pThis->pTIDTimerR3);
+        fCauses |= ICR_TXDW;
+    }
+# ifndef E1K_NO_TAD
+    if (TMTimerIsActive(pThis->pTADTimerR3))
+    {
+        e1kCancelTimer(pThis, pThis->pTADTimerR3);
+        fCauses |= ICR_TXDW;
+    }
+# endif /* E1K_NO_TAD */
+#endif /* E1K_USE_TX_TIMERS */
+    if (fCauses)
+    {
+        E1kLog(("%s e1kR3FlushDelayedInts: ICR |= %08x\n", pThis->szPrf, fCauses));
+        ICR |= fCauses;
+        if ((ICR & IMS) && !pThis->fIntRaised && !TMTimerIsActive(pThis->pIntTimerR3))
+            TMTimerSetMicro(pThis->pIntTimerR3, 0);
+    }
+}
+
 /**
  * Saves the configuration.
  *
@@ -6562,6 +6630,7 @@ static DECLCALLBACK(int) e1kSavePrep(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
     int rc = e1kCsEnter(pThis, VERR_SEM_BUSY);
     if (RT_UNLIKELY(rc != VINF_SUCCESS))
         return rc;
+    e1kR3FlushDelayedInts(pThis);
     e1kCsLeave(pThis);
     return VINF_SUCCESS;
 #if 0
@@ -6786,6 +6855,14 @@ static DECLCALLBACK(int) e1kLoadDone(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
         pThis->pDrvR3->pfnSetPromiscuousMode(pThis->pDrvR3,
                                              !!(RCTL & (RCTL_UPE | RCTL_MPE)));
 
+    /*
+     * Interrupts postponed by ITR or the delay timers were folded into ICR
+     * before saving. Make sure they get delivered once we are running again.
+     */
+    if ((ICR & IMS) && !pThis->fIntRaised)
+        TMTimerSet(pThis->pIntTimerR3, TMTimerFromNano(pThis->pIntTimerR3, ITR * 256) +
+                   TMTimerGet(pThis->pIntTimerR3));
+
     /*
     * Force the link down here, since PDMNETWORKLINKSTATE_DOWN_RESUME is never
     * passed to us. We go through all this stuff if the link was up and we
@@ -7223,6 +7300,16 @@ static DECLCALLBACK(void) e1kR3Reset(PPDMDEVINS pDevIns)
 #ifdef E1K_TX_DELAY
     e1kCancelTimer(pThis, pThis->CTX_SUFF(pTXDTimer));
 #endif /* E1K_TX_DELAY */
+#ifdef E1K_USE_TX_TIMERS
+    e1kCancelTimer(pThis, pThis->CTX_SUFF(pTIDTimer));
+# ifndef E1K_NO_TAD
+    e1kCancelTimer(pThis, pThis->CTX_SUFF(pTADTimer));
+# endif /* E1K_NO_TAD */
+#endif /* E1K_USE_TX_TIMERS */
+#ifdef E1K_USE_RX_TIMERS
+    e1kCancelTimer(pThis, pThis->CTX_SUFF(pRIDTimer));
+    e1kCancelTimer(pThis, pThis->CTX_SUFF(pRADTimer));
+#endif /* E1K_USE_RX_TIMERS */
     e1kCancelTimer(pThis, pThis->CTX_SUFF(pIntTimer));
     e1kCancelTimer(pThis, pThis->CTX_SUFF(pLUTimer));
     e1kXmitFreeBuf(pThis);
@@ -7450,7 +7537,8 @@ static DECLCALLBACK(int) e1kR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGM
      */
     if (!CFGMR3AreValuesValid(pCfg, "MAC\0" "CableConnected\0" "AdapterType\0"
                                     "LineSpeed\0" "GCEnabled\0" "R0Enabled\0"
-                                    "EthernetCRC\0" "GSOEnabled\0" "LinkUpDelay\0"))
+                                    "EthernetCRC\0" "GSOEnabled\0" "LinkUpDelay\0"
+                                    "ItrEnabled\0" "ItrRxEnabled\0" "TidEnabled\0" "RidEnabled\0"))
         return PDMDEV_SET_ERROR(pDevIns, VERR_PDM_DEVINS_UNKNOWN_CFG_VALUES,
                                 N_("Invalid configuration for E1000 device"));
 
@@ -7499,16 +7587,40 @@ static DECLCALLBACK(int) e1kR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGM
     if (RT_FAILURE(rc))
         return PDMDEV_SET_ERROR(pDevIns, rc,
                                 N_("Configuration error: Failed to get the value of 'LinkUpDelay'"));
+    rc = CFGMR3QueryBoolDef(pCfg, "ItrEnabled", &pThis->fItrEnabled, true);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("Configuration error: Failed to get the value of 'ItrEnabled'"));
+
+    rc = CFGMR3QueryBoolDef(pCfg, "ItrRxEnabled", &pThis->fItrRxEnabled, true);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("Configuration error: Failed to get the value of 'ItrRxEnabled'"));
+
+    rc = CFGMR3QueryBoolDef(pCfg, "TidEnabled", &pThis->fTidEnabled, true);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("Configuration error: Failed to get the value of 'TidEnabled'"));
+
+    rc = CFGMR3QueryBoolDef(pCfg, "RidEnabled", &pThis->fRidEnabled, true);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("Configuration error: Failed to get the value of 'RidEnabled'"));
+
     Assert(pThis->cMsLinkUpDelay <= 300000); /* less than 5 minutes */
     if (pThis->cMsLinkUpDelay > 5000)
         LogRel(("%s WARNING! Link up delay is set to %u seconds!\n", pThis->szPrf, pThis->cMsLinkUpDelay / 1000));
     else if (pThis->cMsLinkUpDelay == 0)
         LogRel(("%s WARNING! Link up delay is disabled!\n", pThis->szPrf));
 
-    E1kLog(("%s Chip=%s LinkUpDelay=%ums EthernetCRC=%s GSO=%s R0=%s GC=%s\n", pThis->szPrf,
+    E1kLog(("%s Chip=%s LinkUpDelay=%ums EthernetCRC=%s GSO=%s ITR=%s(RX %s) TID=%s RID=%s R0=%s GC=%s\n", pThis->szPrf,
             g_Chips[pThis->eChip].pcszName, pThis->cMsLinkUpDelay,
             pThis->fEthernetCRC ? "on" : "off",
             pThis->fGSOEnabled ? "enabled" : "disabled",
+            pThis->fItrEnabled ? "enabled" : "disabled",
+            pThis->fItrRxEnabled ? "on" : "off",
+            pThis->fTidEnabled ? "enabled" : "disabled",
+            pThis->fRidEnabled ? "enabled" : "disabled",
             pThis->fR0Enabled ? "enabled" : "disabled",
             pThis->fRCEnabled ? "enabled" : "disabled"));
 
@@ -7723,6 +7835,10 @@ static DECLCALLBACK(int) e1kR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGM
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatLateInts,           STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Number of late interrupts",          "/Devices/E1k%d/LateInt/Occured", iInstance);
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatIntsRaised,         STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Number of raised interrupts",        "/Devices/E1k%d/Interrupts/Raised", iInstance);
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatIntsPrevented,      STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Number of prevented interrupts",     "/Devices/E1k%d/Interrupts/Prevented", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatIntsSaved,          STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Number of interrupts merged into a pending one", "/Devices/E1k%d/Interrupts/Saved", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatIntsThrottled,      STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Number of interrupts postponed by ITR", "/Devices/E1k%d/Interrupts/Throttled", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatRxIntsDelayed,      STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Number of RX interrupts delayed by RDTR", "/Devices/E1k%d/Interrupts/DelayedRx", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatTxIntsDelayed,      STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Number of TX interrupts delayed by TIDV", "/Devices/E1k%d/Interrupts/DelayedTx", iInstance);
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReceive,            STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_CALL, "Profiling receive",                  "/Devices/E1k%d/Receive/Total", iInstance);
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReceiveCRC,         STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_CALL, "Profiling receive checksumming",     "/Devices/E1k%d/Receive/CRC", iInstance);
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReceiveFilter,      STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_CALL, "Profiling receive filtering",        "/Devices/E1k%d/Receive/Filter", iInstance);
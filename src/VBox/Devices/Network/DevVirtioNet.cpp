@@ -49,7 +49,8 @@
 
 #define VNET_PCI_SUBSYSTEM_ID        1 + VIRTIO_NET_ID
 #define VNET_PCI_CLASS               0x0200
-#define VNET_N_QUEUES                3
+/** Number of virtqueues for the given number of queue pairs: RX/TX per pair plus control. */
+#define VNET_N_QUEUES(a_cQueuePairs) ((a_cQueuePairs) * 2 + 1)
 #define VNET_NAME_FMT                "VNet%d"
 
 #if 0
@@ -69,6 +70,9 @@
 #define VNET_MAX_FRAME_SIZE     65535 + 18  /**< Max IP packet size + Ethernet header with VLAN tag */
 #define VNET_MAC_FILTER_LEN     32
 #define VNET_MAX_VID            (1 << 12)
+#define VNET_MAX_QUEUE_PAIRS    8     /**< Max number of RX/TX queue pairs (VNET_F_MQ). */
+#define VNET_FLOW_TABLE_SIZE    256   /**< Number of entries in the RX steering table. */
+#define VNET_RX_USED_BATCH      64    /**< Used ring entries written at once on receive. */
 
 /** @name Virtio net features
  * @{  */
@@ -89,6 +93,7 @@
 #define VNET_F_CTRL_VQ    0x00020000  /**< Control channel available */
 #define VNET_F_CTRL_RX    0x00040000  /**< Control channel RX mode support */
 #define VNET_F_CTRL_VLAN  0x00080000  /**< Control channel VLAN filtering */
+#define VNET_F_MQ         0x00400000  /**< Multiple RX/TX queue pairs with RX steering */
 /** @} */
 
 #define VNET_S_LINK_UP    1
@@ -105,8 +110,49 @@ struct __attribute__ ((__packed__)) VNetPCIConfig /** @todo r=bird: Use #pragma
 {
     RTMAC    mac;
     uint16_t uStatus;
+    uint16_t uMaxVirtqueuePairs;
 };
 AssertCompileMemberOffset(struct VNetPCIConfig, uStatus, 6);
+AssertCompileMemberOffset(struct VNetPCIConfig, uMaxVirtqueuePairs, 8);
+
+/**
+ * A receive/transmit virtqueue pair.
+ *
+ * Each pair is transmitted independently, so several vCPUs kicking different
+ * TX queues do not serialize on a single transmit flag and delay timer.
+ */
+typedef struct VNetQueuePair
+{
+    /** The receive queue. */
+    R3PTRTYPE(PVQUEUE)      pRxQueue;
+    /** The transmit queue. */
+    R3PTRTYPE(PVQUEUE)      pTxQueue;
+#ifdef VNET_TX_DELAY
+    /** Transmit Delay Timer - R3. */
+    PTMTIMERR3              pTxTimerR3;
+    /** Transmit Delay Timer - R0. */
+    PTMTIMERR0              pTxTimerR0;
+    /** Transmit Delay Timer - GC. */
+    PTMTIMERRC              pTxTimerRC;
+#else
+    uint32_t                padding;
+#endif /* VNET_TX_DELAY */
+    /** Indicates transmission in progress -- only one thread is allowed per pair. */
+    uint32_t volatile       uIsTransmitting;
+    /** Time the transmit delay timer was armed. */
+    uint64_t                u64NanoTS;
+    /** Receive notification coalescing timer - R3 only. */
+    PTMTIMERR3              pRxTimerR3;
+    /** Set if the guest has not been notified about received packets yet. */
+    bool volatile           fRxNotifyPending;
+    bool                    afPadding[7];
+    /** Number of frames delivered on this pair. */
+    STAMCOUNTER             StatReceivePackets;
+    /** Number of frames sent from this pair. */
+    STAMCOUNTER             StatTransmitPackets;
+} VNETQUEUEPAIR;
+/** Pointer to a receive/transmit virtqueue pair. */
+typedef VNETQUEUEPAIR *PVNETQUEUEPAIR;
 
 /**
  * Device state structure. Holds the current state of device.
@@ -138,27 +184,12 @@ typedef struct VNetState_st
     PTMTIMERR3              pLinkUpTimer;
 
 #ifdef VNET_TX_DELAY
-    /**< Transmit Delay Timer - R3. */
-    PTMTIMERR3              pTxTimerR3;
-    /**< Transmit Delay Timer - R0. */
-    PTMTIMERR0              pTxTimerR0;
-    /**< Transmit Delay Timer - GC. */
-    PTMTIMERRC              pTxTimerRC;
-
-# if HC_ARCH_BITS == 64
-    uint32_t                padding2;
-# endif
-
     uint32_t                u32i;
     uint32_t                u32AvgDiff;
     uint32_t                u32MinDiff;
     uint32_t                u32MaxDiff;
-    uint64_t                u64NanoTS;
 #endif /* VNET_TX_DELAY */
 
-    /** Indicates transmission in progress -- only one thread is allowed. */
-    uint32_t                uIsTransmitting;
-
     /** PCI config area holding MAC address as well as TBD. */
     struct VNetPCIConfig    config;
     /** MAC address obtained from the configuration. */
@@ -167,8 +198,8 @@ typedef struct VNetState_st
     bool                    fCableConnected;
     /** Link up delay (in milliseconds). */
     uint32_t                cMsLinkUpDelay;
-
-    uint32_t                alignment;
+    /** Receive notification delay (in microseconds), 0 notifies on every packet. */
+    uint32_t                cUsRxNotifyDelay;
 
     /** Number of packet being sent/received to show in debug log. */
     uint32_t                u32PktNo;
@@ -187,9 +218,16 @@ typedef struct VNetState_st
     /** Bit array of VLAN filter, one bit per VLAN ID. */
     uint8_t                 aVlanFilter[VNET_MAX_VID / sizeof(uint8_t)];
 
-    R3PTRTYPE(PVQUEUE)      pRxQueue;
-    R3PTRTYPE(PVQUEUE)      pTxQueue;
     R3PTRTYPE(PVQUEUE)      pCtlQueue;
+    /** RX/TX queue pairs, the first cQueuePairsMax ones are backed by virtqueues. */
+    VNETQUEUEPAIR           aQueuePairs[VNET_MAX_QUEUE_PAIRS];
+    /** Number of queue pairs the device was configured with. */
+    uint32_t                cQueuePairsMax;
+    /** Number of queue pairs enabled by the guest (VNET_CTRL_CMD_MQ_VQ_PAIRS_SET). */
+    uint32_t volatile       cQueuePairs;
+    /** RX steering table indexed by flow hash, holds the index of the queue pair
+     * the flow was last transmitted on plus one (0 means no entry). */
+    uint8_t                 abFlowTable[VNET_FLOW_TABLE_SIZE];
     /* Receive-blocking-related fields ***************************************/
 
     /** EMT: Gets signalled when more RX descriptors become available. */
@@ -203,6 +241,7 @@ typedef struct VNetState_st
     STAMCOUNTER             StatTransmitPackets;
     STAMCOUNTER             StatTransmitGSO;
     STAMCOUNTER             StatTransmitCSum;
+    STAMCOUNTER             StatReceiveNotifyCoalesced;
 #if defined(VBOX_WITH_STATISTICS)
     STAMPROFILE             StatReceive;
     STAMPROFILE             StatReceiveStore;
@@ -249,6 +288,8 @@ typedef VNETHDRMRX *PVNETHDRMRX;
 AssertCompileSize(VNETHDRMRX, 12);
 
 AssertCompileMemberOffset(VNETSTATE, VPCI, 0);
+AssertCompile(VNET_MAX_QUEUE_PAIRS * 2 + 1 <= VIRTIO_MAX_NQUEUES);
+AssertCompile(VNET_MAX_QUEUE_PAIRS < 0xff);
 
 #define VNET_OK                    0
 #define VNET_ERROR                 1
@@ -265,6 +306,9 @@ typedef uint8_t VNETCTLACK;
 #define VNET_CTRL_CMD_VLAN_ADD         0
 #define VNET_CTRL_CMD_VLAN_DEL         1
 
+#define VNET_CTRL_CLS_MQ               4
+#define VNET_CTRL_CMD_MQ_VQ_PAIRS_SET  0
+
 
 struct VNetCtlHdr
 {
@@ -281,6 +325,19 @@ DECLINLINE(bool) vnetMergeableRxBuffers(PVNETSTATE pThis)
     return !!(pThis->VPCI.uGuestFeatures & VNET_F_MRG_RXBUF);
 }
 
+/**
+ * Returns the queue pair a RX or TX virtqueue belongs to.
+ *
+ * @param   pThis       The device state structure.
+ * @param   pQueue      The RX or TX queue.
+ */
+DECLINLINE(PVNETQUEUEPAIR) vnetQueuePairFromQueue(PVNETSTATE pThis, PVQUEUE pQueue)
+{
+    unsigned iQueue = (unsigned)(pQueue - &pThis->VPCI.Queues[0]);
+    Assert(iQueue < pThis->cQueuePairsMax * 2);
+    return &pThis->aQueuePairs[iQueue / 2];
+}
+
 DECLINLINE(int) vnetCsEnter(PVNETSTATE pThis, int rcBusy)
 {
     return vpciCsEnter(&pThis->VPCI, rcBusy);
@@ -354,7 +411,8 @@ DECLINLINE(void) vnetPrintFeatures(PVNETSTATE pThis, uint32_t fFeatures, const c
         { VNET_F_STATUS,     "virtio_net_config.status available" },
         { VNET_F_CTRL_VQ,    "control channel available" },
         { VNET_F_CTRL_RX,    "control channel RX mode support" },
-        { VNET_F_CTRL_VLAN,  "control channel VLAN filtering" }
+        { VNET_F_CTRL_VLAN,  "control channel VLAN filtering" },
+        { VNET_F_MQ,         "multiple RX/TX queue pairs" }
     };
 
     Log3(("%s %s:\n", INSTANCE(pThis), pcszText));
@@ -368,6 +426,7 @@ DECLINLINE(void) vnetPrintFeatures(PVNETSTATE pThis, uint32_t fFeatures, const c
 
 static DECLCALLBACK(uint32_t) vnetIoCb_GetHostFeatures(void *pvState)
 {
+    PVNETSTATE pThis = (PVNETSTATE)pvState;
     /* We support:
      * - Host-provided MAC address
      * - Link status reporting in config space
@@ -375,8 +434,10 @@ static DECLCALLBACK(uint32_t) vnetIoCb_GetHostFeatures(void *pvState)
      * - RX mode setting
      * - MAC filter table
      * - VLAN filter
+     * - Multiple queue pairs if configured
      */
     return VNET_F_MAC
+        | (pThis->cQueuePairsMax > 1 ? VNET_F_MQ : 0)
         | VNET_F_STATUS
         | VNET_F_CTRL_VQ
         | VNET_F_CTRL_RX
@@ -472,7 +533,14 @@ static DECLCALLBACK(int) vnetIoCb_Reset(void *pvState)
     pThis->nMacFilterEntries = 0;
     memset(pThis->aMacFilter,  0, VNET_MAC_FILTER_LEN * sizeof(RTMAC));
     memset(pThis->aVlanFilter, 0, sizeof(pThis->aVlanFilter));
-    pThis->uIsTransmitting   = 0;
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aQueuePairs); i++)
+    {
+        pThis->aQueuePairs[i].uIsTransmitting  = 0;
+        pThis->aQueuePairs[i].fRxNotifyPending = false;
+    }
+    /* Only the first pair is used until the guest enables more. */
+    pThis->cQueuePairs       = 1;
+    memset(pThis->abFlowTable, 0, sizeof(pThis->abFlowTable));
 #ifndef IN_RING3
     return VINF_IOM_R3_IOPORT_WRITE;
 #else
@@ -611,7 +679,7 @@ PDMBOTHCBDECL(int) vnetIOPortOut(PPDMDEVINS pDevIns, void *pvUser, RTIOPORT port
 #ifdef IN_RING3
 
 /**
- * Check if the device can receive data now.
+ * Check if the device can receive data on the given queue now.
  * This must be called before the pfnRecieve() method is called.
  *
  * @remarks As a side effect this function enables queue notification
@@ -619,10 +687,11 @@ PDMBOTHCBDECL(int) vnetIOPortOut(PPDMDEVINS pDevIns, void *pvUser, RTIOPORT port
  *          It disables notification if it can receive.
  *
  * @returns VERR_NET_NO_BUFFER_SPACE if it cannot.
- * @param   pInterface      Pointer to the interface structure containing the called function pointer.
+ * @param   pThis           The device state structure.
+ * @param   pRxQueue        The receive queue to check.
  * @thread  RX
  */
-static int vnetCanReceive(PVNETSTATE pThis)
+static int vnetCanReceive(PVNETSTATE pThis, PVQUEUE pRxQueue)
 {
     int rc = vnetCsRxEnter(pThis, VERR_SEM_BUSY);
     AssertRCReturn(rc, rc);
@@ -630,16 +699,16 @@ static int vnetCanReceive(PVNETSTATE pThis)
     LogFlow(("%s vnetCanReceive\n", INSTANCE(pThis)));
     if (!(pThis->VPCI.uStatus & VPCI_STATUS_DRV_OK))
         rc = VERR_NET_NO_BUFFER_SPACE;
-    else if (!vqueueIsReady(&pThis->VPCI, pThis->pRxQueue))
+    else if (!vqueueIsReady(&pThis->VPCI, pRxQueue))
         rc = VERR_NET_NO_BUFFER_SPACE;
-    else if (vqueueIsEmpty(&pThis->VPCI, pThis->pRxQueue))
+    else if (vqueueIsEmpty(&pThis->VPCI, pRxQueue))
     {
-        vringSetNotification(&pThis->VPCI, &pThis->pRxQueue->VRing, true);
+        vringSetNotification(&pThis->VPCI, &pRxQueue->VRing, true);
         rc = VERR_NET_NO_BUFFER_SPACE;
     }
     else
     {
-        vringSetNotification(&pThis->VPCI, &pThis->pRxQueue->VRing, false);
+        vringSetNotification(&pThis->VPCI, &pRxQueue->VRing, false);
         rc = VINF_SUCCESS;
     }
 
@@ -648,6 +717,34 @@ static int vnetCanReceive(PVNETSTATE pThis)
     return rc;
 }
 
+/**
+ * Check if any of the enabled receive queues can take a packet now.
+ *
+ * @returns VERR_NET_NO_BUFFER_SPACE if none can.
+ * @param   pThis           The device state structure.
+ * @param   ppPair          Where to return the first queue pair with receive
+ *                          buffers available. Optional.
+ * @thread  RX
+ */
+static int vnetCanReceiveAny(PVNETSTATE pThis, PVNETQUEUEPAIR *ppPair)
+{
+    uint32_t cQueuePairs = ASMAtomicReadU32(&pThis->cQueuePairs);
+    int      rc = VERR_NET_NO_BUFFER_SPACE;
+
+    for (unsigned i = 0; i < cQueuePairs; i++)
+    {
+        rc = vnetCanReceive(pThis, pThis->aQueuePairs[i].pRxQueue);
+        if (RT_SUCCESS(rc))
+        {
+            if (ppPair)
+                *ppPair = &pThis->aQueuePairs[i];
+            break;
+        }
+    }
+
+    return rc;
+}
+
 /**
  * @interface_method_impl{PDMINETWORKDOWN,pfnWaitReceiveAvail}
  */
@@ -655,7 +752,7 @@ static DECLCALLBACK(int) vnetNetworkDown_WaitReceiveAvail(PPDMINETWORKDOWN pInte
 {
     PVNETSTATE pThis = RT_FROM_MEMBER(pInterface, VNETSTATE, INetworkDown);
     LogFlow(("%s vnetNetworkDown_WaitReceiveAvail(cMillies=%u)\n", INSTANCE(pThis), cMillies));
-    int rc = vnetCanReceive(pThis);
+    int rc = vnetCanReceiveAny(pThis, NULL);
 
     if (RT_SUCCESS(rc))
         return VINF_SUCCESS;
@@ -670,7 +767,7 @@ static DECLCALLBACK(int) vnetNetworkDown_WaitReceiveAvail(PPDMINETWORKDOWN pInte
     while (RT_LIKELY(   (enmVMState = PDMDevHlpVMState(pThis->VPCI.CTX_SUFF(pDevIns))) == VMSTATE_RUNNING
                      ||  enmVMState == VMSTATE_RUNNING_LS))
     {
-        int rc2 = vnetCanReceive(pThis);
+        int rc2 = vnetCanReceiveAny(pThis, NULL);
         if (RT_SUCCESS(rc2))
         {
             rc = VINF_SUCCESS;
@@ -769,6 +866,198 @@ static bool vnetAddressFilter(PVNETSTATE pThis, const void *pvBuf, size_t cb)
     return false;
 }
 
+/**
+ * Computes the hash of the flow an ethernet frame belongs to.
+ *
+ * The source and destination addresses and ports are combined symmetrically,
+ * so both directions of a connection get the same hash.
+ *
+ * @returns true if the frame is IPv4 or IPv6 and @a puHash is valid.
+ * @param   pbFrame         The ethernet frame.
+ * @param   cbFrame         The size of the frame.
+ * @param   puHash          Where to store the flow hash.
+ */
+static bool vnetFlowHash(const uint8_t *pbFrame, size_t cbFrame, uint32_t *puHash)
+{
+    size_t   offL3 = sizeof(RTNETETHERHDR);
+    size_t   offL4;
+    uint32_t uHash = 0;
+    uint8_t  bProto;
+
+    if (cbFrame < sizeof(RTNETETHERHDR))
+        return false;
+    uint16_t uEtherType = RT_BE2H_U16(((PCRTNETETHERHDR)pbFrame)->EtherType);
+    if (uEtherType == RTNET_ETHERTYPE_VLAN)
+    {
+        if (cbFrame < offL3 + 4)
+            return false;
+        uEtherType = RT_BE2H_U16(*(const uint16_t *)(pbFrame + offL3 + 2));
+        offL3 += 4;
+    }
+
+    if (uEtherType == RTNET_ETHERTYPE_IPV4)
+    {
+        if (cbFrame < offL3 + RTNETIPV4_MIN_LEN)
+            return false;
+        PCRTNETIPV4 pIpHdr = (PCRTNETIPV4)(pbFrame + offL3);
+        uHash  = pIpHdr->ip_src.u ^ pIpHdr->ip_dst.u;
+        bProto = pIpHdr->ip_p;
+        offL4  = offL3 + pIpHdr->ip_hl * 4;
+        /* Only the first fragment carries the ports. */
+        if (RT_BE2H_U16(pIpHdr->ip_off) & (RTNETIPV4_FLAGS_MF | 0x1fff))
+            bProto = 0;
+    }
+    else if (uEtherType == RTNET_ETHERTYPE_IPV6)
+    {
+        if (cbFrame < offL3 + sizeof(RTNETIPV6))
+            return false;
+        PCRTNETIPV6 pIpHdr = (PCRTNETIPV6)(pbFrame + offL3);
+        for (unsigned i = 0; i < RT_ELEMENTS(pIpHdr->ip6_src.au32); i++)
+            uHash ^= pIpHdr->ip6_src.au32[i] ^ pIpHdr->ip6_dst.au32[i];
+        bProto = pIpHdr->ip6_nxt;
+        offL4  = offL3 + sizeof(RTNETIPV6);
+    }
+    else
+        return false;
+
+    uHash = uHash * UINT32_C(0x9e3779b1) + bProto;
+    if (   (bProto == RTNETIPV4_PROT_TCP || bProto == RTNETIPV4_PROT_UDP)
+        && cbFrame >= offL4 + 2 * sizeof(uint16_t))
+    {
+        /* Both TCP and UDP headers start with the source and destination ports. */
+        const uint16_t *pu16Ports = (const uint16_t *)(pbFrame + offL4);
+        uHash ^= (uint32_t)(pu16Ports[0] ^ pu16Ports[1]) << 8;
+    }
+
+    /* Final avalanche so that all bits depend on all inputs. */
+    uHash ^= uHash >> 16;
+    uHash *= UINT32_C(0x85ebca6b);
+    uHash ^= uHash >> 13;
+    uHash *= UINT32_C(0xc2b2ae35);
+    uHash ^= uHash >> 16;
+    *puHash = uHash;
+    return true;
+}
+
+/**
+ * Remembers the queue pair a flow is transmitted on, so that the receive
+ * traffic of the flow is delivered on the same pair.
+ *
+ * @param   pThis           The device state structure.
+ * @param   pPair           The queue pair the frame is sent from.
+ * @param   pvFrame         The outgoing ethernet frame.
+ * @param   cbFrame         The size of the frame.
+ */
+DECLINLINE(void) vnetFlowLearn(PVNETSTATE pThis, PVNETQUEUEPAIR pPair, const void *pvFrame, size_t cbFrame)
+{
+    uint32_t uHash;
+    if (   pThis->cQueuePairs > 1
+        && vnetFlowHash((const uint8_t *)pvFrame, cbFrame, &uHash))
+        pThis->abFlowTable[uHash % VNET_FLOW_TABLE_SIZE] = (uint8_t)(pPair - &pThis->aQueuePairs[0] + 1);
+}
+
+/**
+ * Selects the queue pair an incoming frame is delivered on.
+ *
+ * Flows the guest has transmitted on stay on the same pair, the others are
+ * spread over the enabled pairs by their hash.
+ *
+ * @returns The queue pair.
+ * @param   pThis           The device state structure.
+ * @param   pvFrame         The incoming ethernet frame.
+ * @param   cbFrame         The size of the frame.
+ * @thread  RX
+ */
+static PVNETQUEUEPAIR vnetSelectRxQueuePair(PVNETSTATE pThis, const void *pvFrame, size_t cbFrame)
+{
+    uint32_t cQueuePairs = ASMAtomicReadU32(&pThis->cQueuePairs);
+    uint32_t uHash;
+
+    if (   cQueuePairs <= 1
+        || !vnetFlowHash((const uint8_t *)pvFrame, cbFrame, &uHash))
+        return &pThis->aQueuePairs[0];
+
+    unsigned iPair = pThis->abFlowTable[uHash % VNET_FLOW_TABLE_SIZE];
+    if (iPair == 0 || iPair > cQueuePairs)
+        return &pThis->aQueuePairs[(uHash >> 16) % cQueuePairs];
+    return &pThis->aQueuePairs[iPair - 1];
+}
+
+/**
+ * Publishes the packets stored in a receive queue and notifies the guest.
+ *
+ * If a notification delay is configured, the notification is deferred to the
+ * queue pair's timer so that a burst of packets raises a single interrupt.
+ *
+ * @param   pThis           The device state structure.
+ * @param   pPair           The queue pair the packets were stored on.
+ * @thread  RX
+ */
+static void vnetRxNotify(PVNETSTATE pThis, PVNETQUEUEPAIR pPair)
+{
+    PVQUEUE pRxQueue = pPair->pRxQueue;
+
+    if (!pThis->cUsRxNotifyDelay)
+    {
+        vqueueSync(&pThis->VPCI, pRxQueue);
+        return;
+    }
+
+    vqueueSync(&pThis->VPCI, pRxQueue, false /*fNotify*/);
+    if (vqueueIsEmpty(&pThis->VPCI, pRxQueue))
+    {
+        /* Don't keep the guest waiting when it has to post new buffers. */
+        ASMAtomicWriteBool(&pPair->fRxNotifyPending, false);
+        vqueueNotify(&pThis->VPCI, pRxQueue);
+    }
+    else if (!ASMAtomicXchgBool(&pPair->fRxNotifyPending, true))
+        TMTimerSetMicro(pPair->pRxTimerR3, pThis->cUsRxNotifyDelay);
+    else
+        STAM_REL_COUNTER_INC(&pThis->StatReceiveNotifyCoalesced);
+}
+
+/**
+ * @callback_method_impl{FNTMTIMERDEV, Receive notification timer handler.}
+ */
+static DECLCALLBACK(void) vnetRxNotifyTimer(PPDMDEVINS pDevIns, PTMTIMER pTimer, void *pvUser)
+{
+    PVNETSTATE pThis = (PVNETSTATE)pvUser;
+
+    for (unsigned i = 0; i < pThis->cQueuePairsMax; i++)
+    {
+        PVNETQUEUEPAIR pPair = &pThis->aQueuePairs[i];
+        if (pPair->pRxTimerR3 == pTimer)
+        {
+            if (   ASMAtomicXchgBool(&pPair->fRxNotifyPending, false)
+                && (pThis->VPCI.uStatus & VPCI_STATUS_DRV_OK))
+                vqueueNotify(&pThis->VPCI, pPair->pRxQueue);
+            break;
+        }
+    }
+}
+
+/**
+ * Delivers receive notifications still held back by the notification timers.
+ *
+ * The timers are not part of the saved state, so this must be done before
+ * the VM is saved or suspended.
+ *
+ * @param   pThis           The device state structure.
+ */
+static void vnetRxNotifyFlush(PVNETSTATE pThis)
+{
+    for (unsigned i = 0; i < pThis->cQueuePairsMax; i++)
+    {
+        PVNETQUEUEPAIR pPair = &pThis->aQueuePairs[i];
+        if (ASMAtomicXchgBool(&pPair->fRxNotifyPending, false))
+        {
+            TMTimerStop(pPair->pRxTimerR3);
+            if (pThis->VPCI.uStatus & VPCI_STATUS_DRV_OK)
+                vqueueNotify(&pThis->VPCI, pPair->pRxQueue);
+        }
+    }
+}
+
 /**
  * Pad and store received packet.
  *
@@ -776,17 +1065,28 @@ static bool vnetAddressFilter(PVNETSTATE pThis, const void *pvBuf, size_t cb)
  *          from real Ethernet: pad it and insert FCS.
  *
  * @returns VBox status code.
+ * @remarks The data is copied straight from @a pvBuf into the guest buffers,
+ *          large packets are spread over several buffers if the guest
+ *          negotiated VNET_F_MRG_RXBUF. The used ring entries are written in
+ *          batches and the guest is notified once per packet, or less often
+ *          with a notification delay.
+ *
  * @param   pThis          The device state structure.
+ * @param   pPair           The queue pair to store the packet in.
  * @param   pvBuf           The available data.
  * @param   cb              Number of bytes available in the buffer.
  * @thread  RX
  */
-static int vnetHandleRxPacket(PVNETSTATE pThis, const void *pvBuf, size_t cb,
+static int vnetHandleRxPacket(PVNETSTATE pThis, PVNETQUEUEPAIR pPair, const void *pvBuf, size_t cb,
                               PCPDMNETWORKGSO pGso)
 {
+    PVQUEUE      pRxQueue = pPair->pRxQueue;
     VNETHDRMRX   Hdr;
     unsigned    uHdrLen;
     RTGCPHYS     addrHdrMrx = 0;
+    VRINGUSEDELEM aUsed[VNET_RX_USED_BATCH];
+    unsigned     cUsed = 0;
+    int          rc = VINF_SUCCESS;
 
     if (pGso)
     {
@@ -836,20 +1136,22 @@ static int vnetHandleRxPacket(PVNETSTATE pThis, const void *pvBuf, size_t cb,
         VQUEUEELEM elem;
         unsigned int nSeg = 0, uElemSize = 0, cbReserved = 0;
 
-        if (!vqueueGet(&pThis->VPCI, pThis->pRxQueue, &elem))
+        if (!vqueueGet(&pThis->VPCI, pRxQueue, &elem))
         {
             /*
              * @todo: It is possible to run out of RX buffers if only a few
              * were added and we received a big packet.
              */
             Log(("%s vnetHandleRxPacket: Suddenly there is no space in receive queue!\n", INSTANCE(pThis)));
-            return VERR_INTERNAL_ERROR;
+            rc = VERR_INTERNAL_ERROR;
+            break;
         }
 
         if (elem.nIn < 1)
         {
             Log(("%s vnetHandleRxPacket: No writable descriptors in receive queue!\n", INSTANCE(pThis)));
-            return VERR_INTERNAL_ERROR;
+            rc = VERR_INTERNAL_ERROR;
+            break;
         }
 
         if (nElem == 0)
@@ -865,7 +1167,8 @@ static int vnetHandleRxPacket(PVNETSTATE pThis, const void *pvBuf, size_t cb,
                 if (elem.aSegsIn[nSeg].cb != sizeof(VNETHDR))
                 {
                     Log(("%s vnetHandleRxPacket: The first descriptor does match the header size!\n", INSTANCE(pThis)));
-                    return VERR_INTERNAL_ERROR;
+                    rc = VERR_INTERNAL_ERROR;
+                    break;
                 }
                 elem.aSegsIn[nSeg++].pv = &Hdr;
             }
@@ -880,17 +1183,26 @@ static int vnetHandleRxPacket(PVNETSTATE pThis, const void *pvBuf, size_t cb,
             uElemSize += uSize;
         }
         STAM_PROFILE_START(&pThis->StatReceiveStore, a);
-        vqueuePut(&pThis->VPCI, pThis->pRxQueue, &elem, uElemSize, cbReserved);
+        vqueueFill(&pThis->VPCI, pRxQueue, &elem, uElemSize, cbReserved, &aUsed[cUsed++]);
         STAM_PROFILE_STOP(&pThis->StatReceiveStore, a);
+        if (cUsed == RT_ELEMENTS(aUsed))
+        {
+            vqueueFlush(&pThis->VPCI, pRxQueue, aUsed, cUsed);
+            cUsed = 0;
+        }
         if (!vnetMergeableRxBuffers(pThis))
             break;
         cbReserved = 0;
     }
+    if (cUsed)
+        vqueueFlush(&pThis->VPCI, pRxQueue, aUsed, cUsed);
+    if (RT_FAILURE(rc))
+        return rc;
     if (vnetMergeableRxBuffers(pThis))
     {
         Hdr.u16NumBufs = nElem;
-        int rc = PDMDevHlpPCIPhysWrite(pThis->VPCI.CTX_SUFF(pDevIns), addrHdrMrx,
-                                       &Hdr, sizeof(Hdr));
+        rc = PDMDevHlpPCIPhysWrite(pThis->VPCI.CTX_SUFF(pDevIns), addrHdrMrx,
+                                   &Hdr, sizeof(Hdr));
         if (RT_FAILURE(rc))
         {
             Log(("%s vnetHandleRxPacket: Failed to write merged RX buf header: %Rrc\n",
@@ -898,7 +1210,7 @@ static int vnetHandleRxPacket(PVNETSTATE pThis, const void *pvBuf, size_t cb,
             return rc;
         }
     }
-    vqueueSync(&pThis->VPCI, pThis->pRxQueue);
+    vnetRxNotify(pThis, pPair);
     if (uOffset < cb)
     {
         Log(("%s vnetHandleRxPacket: Packet did not fit into RX queue (packet size=%u)!\n",
@@ -948,7 +1260,11 @@ static DECLCALLBACK(int) vnetNetworkDown_ReceiveGso(PPDMINETWORKDOWN pInterface,
 
     Log2(("%s vnetNetworkDown_ReceiveGso: pvBuf=%p cb=%u pGso=%p\n",
           INSTANCE(pThis), pvBuf, cb, pGso));
-    int rc = vnetCanReceive(pThis);
+    PVNETQUEUEPAIR pPair = vnetSelectRxQueuePair(pThis, pvBuf, cb);
+    int rc = vnetCanReceive(pThis, pPair->pRxQueue);
+    /* Rather deliver on another pair than drop if the guest hasn't refilled this one yet. */
+    if (RT_FAILURE(rc) && pThis->cQueuePairs > 1)
+        rc = vnetCanReceiveAny(pThis, &pPair);
     if (RT_FAILURE(rc))
         return rc;
 
@@ -966,8 +1282,9 @@ static DECLCALLBACK(int) vnetNetworkDown_ReceiveGso(PPDMINETWORKDOWN pInterface,
         rc = vnetCsRxEnter(pThis, VERR_SEM_BUSY);
         if (RT_SUCCESS(rc))
         {
-            rc = vnetHandleRxPacket(pThis, pvBuf, cb, pGso);
+            rc = vnetHandleRxPacket(pThis, pPair, pvBuf, cb, pGso);
             STAM_REL_COUNTER_ADD(&pThis->StatReceiveBytes, cb);
+            STAM_REL_COUNTER_INC(&pPair->StatReceivePackets);
             vnetCsRxLeave(pThis);
         }
     }
@@ -1064,9 +1381,18 @@ static DECLCALLBACK(int) vnetSetLinkState(PPDMINETWORKCONFIG pInterface, PDMNETW
     return VINF_SUCCESS;
 }
 
+static DECLCALLBACK(void) vnetQueueControl(void *pvState, PVQUEUE pQueue);
+
 static DECLCALLBACK(void) vnetQueueReceive(void *pvState, PVQUEUE pQueue)
 {
     PVNETSTATE pThis = (PVNETSTATE)pvState;
+    if (   pQueue == &pThis->VPCI.Queues[VNET_N_QUEUES(1) - 1]
+        && !(pThis->VPCI.uGuestFeatures & VNET_F_MQ))
+    {
+        /* Without VNET_F_MQ the guest uses the queue after the first pair for control. */
+        vnetQueueControl(pvState, pQueue);
+        return;
+    }
     Log(("%s Receive buffers has been added, waking up receive thread.\n", INSTANCE(pThis)));
     vnetWakeupReceive(pThis->VPCI.CTX_SUFF(pDevIns));
 }
@@ -1138,14 +1464,16 @@ DECLINLINE(void) vnetCompleteChecksum(uint8_t *pBuf, unsigned cbSize, uint16_t u
     *(uint16_t*)(pBuf + uStart + uOffset) = vnetCSum16(pBuf + uStart, cbSize - uStart);
 }
 
-static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVQUEUE pQueue, bool fOnWorkerThread)
+static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVNETQUEUEPAIR pPair, bool fOnWorkerThread)
 {
+    PVQUEUE pQueue = pPair->pTxQueue;
+
     /*
-     * Only one thread is allowed to transmit at a time, others should skip
-     * transmission as the packets will be picked up by the transmitting
-     * thread.
+     * Only one thread is allowed to transmit from a queue at a time, others
+     * should skip transmission as the packets will be picked up by the
+     * transmitting thread.
      */
-    if (!ASMAtomicCmpXchgU32(&pThis->uIsTransmitting, 1, 0))
+    if (!ASMAtomicCmpXchgU32(&pPair->uIsTransmitting, 1, 0))
         return;
 
     if ((pThis->VPCI.uStatus & VPCI_STATUS_DRV_OK) == 0)
@@ -1162,7 +1490,13 @@ static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVQUEUE pQueue, bool fO
         Assert(rc == VINF_SUCCESS || rc == VERR_TRY_AGAIN);
         if (rc == VERR_TRY_AGAIN)
         {
-            ASMAtomicWriteU32(&pThis->uIsTransmitting, 0);
+            ASMAtomicWriteU32(&pPair->uIsTransmitting, 0);
+#ifdef VNET_TX_DELAY
+            /* Another pair is transmitting, retry later or the packets may get stuck. */
+            if (   pThis->cQueuePairs > 1
+                && !TMTimerIsActive(pPair->CTX_SUFF(pTxTimer)))
+                TMTimerSetMicro(pPair->CTX_SUFF(pTxTimer), VNET_TX_DELAY);
+#endif /* VNET_TX_DELAY */
             return;
         }
     }
@@ -1174,7 +1508,7 @@ static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVQUEUE pQueue, bool fO
         uHdrLen = sizeof(VNETHDR);
 
     Log3(("%s vnetTransmitPendingPackets: About to transmit %d pending packets\n", INSTANCE(pThis),
-          vringReadAvailIndex(&pThis->VPCI, &pThis->pTxQueue->VRing) - pThis->pTxQueue->uNextAvailIndex));
+          vringReadAvailIndex(&pThis->VPCI, &pQueue->VRing) - pQueue->uNextAvailIndex));
 
     vpciSetWriteLed(&pThis->VPCI, true);
 
@@ -1211,6 +1545,7 @@ static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVQUEUE pQueue, bool fO
                                   &Hdr, sizeof(Hdr));
 
                 STAM_REL_COUNTER_INC(&pThis->StatTransmitPackets);
+                STAM_REL_COUNTER_INC(&pPair->StatTransmitPackets);
 
                 STAM_PROFILE_START(&pThis->StatTransmitSend, a);
 
@@ -1231,6 +1566,7 @@ static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVQUEUE pQueue, bool fO
                     }
                     pSgBuf->cbUsed = uSize;
                     vnetPacketDump(pThis, (uint8_t*)pSgBuf->aSegs[0].pvSeg, uSize, "--> Outgoing");
+                    vnetFlowLearn(pThis, pPair, pSgBuf->aSegs[0].pvSeg, uSize);
                     if (pGso)
                     {
                         /* Some guests (RHEL) may report HdrLen excluding transport layer header! */
@@ -1301,7 +1637,7 @@ static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVQUEUE pQueue, bool fO
 
     if (pDrv)
         pDrv->pfnEndXmit(pDrv);
-    ASMAtomicWriteU32(&pThis->uIsTransmitting, 0);
+    ASMAtomicWriteU32(&pPair->uIsTransmitting, 0);
 }
 
 /**
@@ -1310,26 +1646,29 @@ static void vnetTransmitPendingPackets(PVNETSTATE pThis, PVQUEUE pQueue, bool fO
 static DECLCALLBACK(void) vnetNetworkDown_XmitPending(PPDMINETWORKDOWN pInterface)
 {
     PVNETSTATE pThis = RT_FROM_MEMBER(pInterface, VNETSTATE, INetworkDown);
-    vnetTransmitPendingPackets(pThis, pThis->pTxQueue, false /*fOnWorkerThread*/);
+    uint32_t cQueuePairs = ASMAtomicReadU32(&pThis->cQueuePairs);
+    for (unsigned i = 0; i < cQueuePairs; i++)
+        vnetTransmitPendingPackets(pThis, &pThis->aQueuePairs[i], false /*fOnWorkerThread*/);
 }
 
 #ifdef VNET_TX_DELAY
 
 static DECLCALLBACK(void) vnetQueueTransmit(void *pvState, PVQUEUE pQueue)
 {
-    PVNETSTATE pThis = (PVNETSTATE)pvState;
+    PVNETSTATE     pThis = (PVNETSTATE)pvState;
+    PVNETQUEUEPAIR pPair = vnetQueuePairFromQueue(pThis, pQueue);
 
-    if (TMTimerIsActive(pThis->CTX_SUFF(pTxTimer)))
+    if (TMTimerIsActive(pPair->CTX_SUFF(pTxTimer)))
     {
-        int rc = TMTimerStop(pThis->CTX_SUFF(pTxTimer));
+        int rc = TMTimerStop(pPair->CTX_SUFF(pTxTimer));
         Log3(("%s vnetQueueTransmit: Got kicked with notification disabled, "
               "re-enable notification and flush TX queue\n", INSTANCE(pThis)));
-        vnetTransmitPendingPackets(pThis, pQueue, false /*fOnWorkerThread*/);
+        vnetTransmitPendingPackets(pThis, pPair, false /*fOnWorkerThread*/);
         if (RT_FAILURE(vnetCsEnter(pThis, VERR_SEM_BUSY)))
             LogRel(("vnetQueueTransmit: Failed to enter critical section!/n"));
         else
         {
-            vringSetNotification(&pThis->VPCI, &pThis->pTxQueue->VRing, true);
+            vringSetNotification(&pThis->VPCI, &pQueue->VRing, true);
             vnetCsLeave(pThis);
         }
     }
@@ -1339,9 +1678,9 @@ static DECLCALLBACK(void) vnetQueueTransmit(void *pvState, PVQUEUE pQueue)
             LogRel(("vnetQueueTransmit: Failed to enter critical section!/n"));
         else
         {
-            vringSetNotification(&pThis->VPCI, &pThis->pTxQueue->VRing, false);
-            TMTimerSetMicro(pThis->CTX_SUFF(pTxTimer), VNET_TX_DELAY);
-            pThis->u64NanoTS = RTTimeNanoTS();
+            vringSetNotification(&pThis->VPCI, &pQueue->VRing, false);
+            TMTimerSetMicro(pPair->CTX_SUFF(pTxTimer), VNET_TX_DELAY);
+            pPair->u64NanoTS = RTTimeNanoTS();
             vnetCsLeave(pThis);
         }
     }
@@ -1352,9 +1691,18 @@ static DECLCALLBACK(void) vnetQueueTransmit(void *pvState, PVQUEUE pQueue)
  */
 static DECLCALLBACK(void) vnetTxTimer(PPDMDEVINS pDevIns, PTMTIMER pTimer, void *pvUser)
 {
-    PVNETSTATE pThis = (PVNETSTATE)pvUser;
+    PVNETSTATE     pThis = (PVNETSTATE)pvUser;
+    PVNETQUEUEPAIR pPair = NULL;
 
-    uint32_t u32MicroDiff = (uint32_t)((RTTimeNanoTS() - pThis->u64NanoTS)/1000);
+    for (unsigned i = 0; i < pThis->cQueuePairsMax; i++)
+        if (pThis->aQueuePairs[i].pTxTimerR3 == pTimer)
+        {
+            pPair = &pThis->aQueuePairs[i];
+            break;
+        }
+    AssertReturnVoid(pPair);
+
+    uint32_t u32MicroDiff = (uint32_t)((RTTimeNanoTS() - pPair->u64NanoTS)/1000);
     if (u32MicroDiff < pThis->u32MinDiff)
         pThis->u32MinDiff = u32MicroDiff;
     if (u32MicroDiff > pThis->u32MaxDiff)
@@ -1365,13 +1713,13 @@ static DECLCALLBACK(void) vnetTxTimer(PPDMDEVINS pDevIns, PTMTIMER pTimer, void
             u32MicroDiff, pThis->u32AvgDiff, pThis->u32MinDiff, pThis->u32MaxDiff));
 
 //    Log3(("%s vnetTxTimer: Expired\n", INSTANCE(pThis)));
-    vnetTransmitPendingPackets(pThis, pThis->pTxQueue, false /*fOnWorkerThread*/);
+    vnetTransmitPendingPackets(pThis, pPair, false /*fOnWorkerThread*/);
     if (RT_FAILURE(vnetCsEnter(pThis, VERR_SEM_BUSY)))
     {
         LogRel(("vnetTxTimer: Failed to enter critical section!/n"));
         return;
     }
-    vringSetNotification(&pThis->VPCI, &pThis->pTxQueue->VRing, true);
+    vringSetNotification(&pThis->VPCI, &pPair->pTxQueue->VRing, true);
     vnetCsLeave(pThis);
 }
 
@@ -1381,7 +1729,7 @@ static DECLCALLBACK(void) vnetQueueTransmit(void *pvState, PVQUEUE pQueue)
 {
     PVNETSTATE pThis = (PVNETSTATE)pvState;
 
-    vnetTransmitPendingPackets(pThis, pQueue, false /*fOnWorkerThread*/);
+    vnetTransmitPendingPackets(pThis, vnetQueuePairFromQueue(pThis, pQueue), false /*fOnWorkerThread*/);
 }
 
 #endif /* !VNET_TX_DELAY */
@@ -1539,6 +1887,41 @@ static uint8_t vnetControlVlan(PVNETSTATE pThis, PVNETCTLHDR pCtlHdr, PVQUEUEELE
     return u8Ack;
 }
 
+static uint8_t vnetControlMq(PVNETSTATE pThis, PVNETCTLHDR pCtlHdr, PVQUEUEELEM pElem)
+{
+    uint16_t cQueuePairs;
+
+    if (   pCtlHdr->u8Command != VNET_CTRL_CMD_MQ_VQ_PAIRS_SET
+        || !(pThis->VPCI.uGuestFeatures & VNET_F_MQ)
+        || pElem->nOut != 2
+        || pElem->aSegsOut[1].cb != sizeof(cQueuePairs))
+    {
+        Log(("%s vnetControlMq: Unsupported command or wrong segment layout "
+             "(u8Command=%u nOut=%u cb=%u)\n", INSTANCE(pThis),
+             pCtlHdr->u8Command, pElem->nOut, pElem->aSegsOut[1].cb));
+        return VNET_ERROR;
+    }
+
+    PDMDevHlpPhysRead(pThis->VPCI.CTX_SUFF(pDevIns),
+                      pElem->aSegsOut[1].addr,
+                      &cQueuePairs, sizeof(cQueuePairs));
+
+    if (cQueuePairs < 1 || cQueuePairs > pThis->cQueuePairsMax)
+    {
+        Log(("%s vnetControlMq: Number of queue pairs is out of range "
+             "(cQueuePairs=%u)\n", INSTANCE(pThis), cQueuePairs));
+        return VNET_ERROR;
+    }
+
+    Log(("%s vnetControlMq: Using %u queue pairs\n", INSTANCE(pThis), cQueuePairs));
+    ASMAtomicWriteU32(&pThis->cQueuePairs, cQueuePairs);
+    memset(pThis->abFlowTable, 0, sizeof(pThis->abFlowTable));
+    /* Let the receive thread re-check the queues it is waiting for. */
+    vnetWakeupReceive(pThis->VPCI.CTX_SUFF(pDevIns));
+
+    return VNET_OK;
+}
+
 
 static DECLCALLBACK(void) vnetQueueControl(void *pvState, PVQUEUE pQueue)
 {
@@ -1581,6 +1964,9 @@ static DECLCALLBACK(void) vnetQueueControl(void *pvState, PVQUEUE pQueue)
                 case VNET_CTRL_CLS_VLAN:
                     u8Ack = vnetControlVlan(pThis, &CtlHdr, &elem);
                     break;
+                case VNET_CTRL_CLS_MQ:
+                    u8Ack = vnetControlMq(pThis, &CtlHdr, &elem);
+                    break;
                 default:
                     u8Ack = VNET_ERROR;
             }
@@ -1607,6 +1993,7 @@ static DECLCALLBACK(void) vnetQueueControl(void *pvState, PVQUEUE pQueue)
 static void vnetSaveConfig(PVNETSTATE pThis, PSSMHANDLE pSSM)
 {
     SSMR3PutMem(pSSM, &pThis->macConfigured, sizeof(pThis->macConfigured));
+    SSMR3PutU32(pSSM, pThis->cQueuePairsMax);
 }
 
 
@@ -1631,6 +2018,7 @@ static DECLCALLBACK(int) vnetSavePrep(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
     int rc = vnetCsRxEnter(pThis, VERR_SEM_BUSY);
     if (RT_UNLIKELY(rc != VINF_SUCCESS))
         return rc;
+    vnetRxNotifyFlush(pThis);
     vnetCsRxLeave(pThis);
     return VINF_SUCCESS;
 }
@@ -1663,6 +2051,8 @@ static DECLCALLBACK(int) vnetSaveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
     AssertRCReturn(rc, rc);
     rc = SSMR3PutMem( pSSM, pThis->aVlanFilter, sizeof(pThis->aVlanFilter));
     AssertRCReturn(rc, rc);
+    rc = SSMR3PutU32( pSSM, pThis->cQueuePairs);
+    AssertRCReturn(rc, rc);
     Log(("%s State has been saved\n", INSTANCE(pThis)));
     return VINF_SUCCESS;
 }
@@ -1699,8 +2089,17 @@ static DECLCALLBACK(int) vnetLoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint3
     if (memcmp(&macConfigured, &pThis->macConfigured, sizeof(macConfigured))
         && (uPass == 0 || !PDMDevHlpVMTeleportedAndNotFullyResumedYet(pDevIns)))
         LogRel(("%s: The mac address differs: config=%RTmac saved=%RTmac\n", INSTANCE(pThis), &pThis->macConfigured, &macConfigured));
+    uint32_t cQueuePairsMax = 1;
+    if (uVersion > VIRTIO_SAVEDSTATE_VERSION_PRE_MQ)
+    {
+        rc = SSMR3GetU32(pSSM, &cQueuePairsMax);
+        AssertRCReturn(rc, rc);
+    }
+    if (cQueuePairsMax != pThis->cQueuePairsMax)
+        return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("Config mismatch - saved NumQueuePairs=%u; configured NumQueuePairs=%u"),
+                                cQueuePairsMax, pThis->cQueuePairsMax);
 
-    rc = vpciLoadExec(&pThis->VPCI, pSSM, uVersion, uPass, VNET_N_QUEUES);
+    rc = vpciLoadExec(&pThis->VPCI, pSSM, uVersion, uPass, VNET_N_QUEUES(pThis->cQueuePairsMax));
     AssertRCReturn(rc, rc);
 
     if (uPass == SSM_PASS_FINAL)
@@ -1740,6 +2139,17 @@ static DECLCALLBACK(int) vnetLoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint3
             if (pThis->pDrv)
                 pThis->pDrv->pfnSetPromiscuousMode(pThis->pDrv, true);
         }
+
+        uint32_t cQueuePairs = 1;
+        if (uVersion > VIRTIO_SAVEDSTATE_VERSION_PRE_MQ)
+        {
+            rc = SSMR3GetU32(pSSM, &cQueuePairs);
+            AssertRCReturn(rc, rc);
+            AssertLogRelMsgReturn(cQueuePairs >= 1 && cQueuePairs <= pThis->cQueuePairsMax,
+                                  ("cQueuePairs=%u\n", cQueuePairs), VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+        }
+        pThis->cQueuePairs = cQueuePairs;
+        memset(pThis->abFlowTable, 0, sizeof(pThis->abFlowTable));
     }
 
     return rc;
@@ -1898,6 +2308,11 @@ static DECLCALLBACK(int) vnetAttach(PPDMDEVINS pDevIns, unsigned iLUN, uint32_t
  */
 static DECLCALLBACK(void) vnetSuspend(PPDMDEVINS pDevIns)
 {
+    PVNETSTATE pThis = PDMINS_2_DATA(pDevIns, PVNETSTATE);
+
+    /* Don't leave the guest without the notifications for received packets. */
+    vnetRxNotifyFlush(pThis);
+
     /* Poke thread waiting for buffer space. */
     vnetWakeupReceive(pDevIns);
 }
@@ -1922,7 +2337,8 @@ static DECLCALLBACK(void) vnetRelocate(PPDMDEVINS pDevIns, RTGCINTPTR offDelta)
     vpciRelocate(pDevIns, offDelta);
     pThis->pCanRxQueueRC = PDMQueueRCPtr(pThis->pCanRxQueueR3);
 #ifdef VNET_TX_DELAY
-    pThis->pTxTimerRC    = TMTimerRCPtr(pThis->pTxTimerR3);
+    for (unsigned i = 0; i < pThis->cQueuePairsMax; i++)
+        pThis->aQueuePairs[i].pTxTimerRC = TMTimerRCPtr(pThis->aQueuePairs[i].pTxTimerR3);
 #endif /* VNET_TX_DELAY */
     // TBD
 }
@@ -1969,13 +2385,27 @@ static DECLCALLBACK(int) vnetConstruct(PPDMDEVINS pDevIns, int iInstance, PCFGMN
     rc = PDMDevHlpSetDeviceCritSect(pDevIns, PDMDevHlpCritSectGetNop(pDevIns));
     AssertRCReturn(rc, rc);
 
+    /* The number of queue pairs determines the virtqueue layout, so get it first. */
+    rc = CFGMR3QueryU32Def(pCfg, "NumQueuePairs", &pThis->cQueuePairsMax, 1);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("Configuration error: Failed to get the value of 'NumQueuePairs'"));
+    if (pThis->cQueuePairsMax < 1 || pThis->cQueuePairsMax > VNET_MAX_QUEUE_PAIRS)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("Configuration error: 'NumQueuePairs' must be between 1 and %u"),
+                                   VNET_MAX_QUEUE_PAIRS);
+
     /* Initialize PCI part. */
     pThis->VPCI.IBase.pfnQueryInterface    = vnetQueryInterface;
     rc = vpciConstruct(pDevIns, &pThis->VPCI, iInstance,
                        VNET_NAME_FMT, VNET_PCI_SUBSYSTEM_ID,
-                       VNET_PCI_CLASS, VNET_N_QUEUES);
-    pThis->pRxQueue  = vpciAddQueue(&pThis->VPCI, 256, vnetQueueReceive,  "RX ");
-    pThis->pTxQueue  = vpciAddQueue(&pThis->VPCI, 256, vnetQueueTransmit, "TX ");
+                       VNET_PCI_CLASS, VNET_N_QUEUES(pThis->cQueuePairsMax));
+    /* The virtqueue layout is RX0, TX0, RX1, TX1, ..., CTL. */
+    for (unsigned i = 0; i < pThis->cQueuePairsMax; i++)
+    {
+        pThis->aQueuePairs[i].pRxQueue = vpciAddQueue(&pThis->VPCI, 256, vnetQueueReceive,  "RX ");
+        pThis->aQueuePairs[i].pTxQueue = vpciAddQueue(&pThis->VPCI, 256, vnetQueueTransmit, "TX ");
+    }
     pThis->pCtlQueue = vpciAddQueue(&pThis->VPCI, 16,  vnetQueueControl,  "CTL");
 
     Log(("%s Constructing new instance\n", INSTANCE(pThis)));
@@ -1983,7 +2413,7 @@ static DECLCALLBACK(int) vnetConstruct(PPDMDEVINS pDevIns, int iInstance, PCFGMN
     /*
      * Validate configuration.
      */
-    if (!CFGMR3AreValuesValid(pCfg, "MAC\0" "CableConnected\0" "LineSpeed\0" "LinkUpDelay\0"))
+    if (!CFGMR3AreValuesValid(pCfg, "MAC\0" "CableConnected\0" "LineSpeed\0" "LinkUpDelay\0" "NumQueuePairs\0" "RxNotifyDelay\0"))
                     return PDMDEV_SET_ERROR(pDevIns, VERR_PDM_DEVINS_UNKNOWN_CFG_VALUES,
                                             N_("Invalid configuration for VirtioNet device"));
 
@@ -2009,6 +2439,13 @@ static DECLCALLBACK(int) vnetConstruct(PPDMDEVINS pDevIns, int iInstance, PCFGMN
     }
     Log(("%s Link up delay is set to %u seconds\n",
          INSTANCE(pThis), pThis->cMsLinkUpDelay / 1000));
+    rc = CFGMR3QueryU32Def(pCfg, "RxNotifyDelay", &pThis->cUsRxNotifyDelay, 0); /* us */
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("Configuration error: Failed to get the value of 'RxNotifyDelay'"));
+    if (pThis->cUsRxNotifyDelay > 1000)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("Configuration error: 'RxNotifyDelay' must not exceed 1000 microseconds"));
 
 
     vnetPrintFeatures(pThis, vnetIoCb_GetHostFeatures(pThis), "Device supports the following features");
@@ -2016,6 +2453,7 @@ static DECLCALLBACK(int) vnetConstruct(PPDMDEVINS pDevIns, int iInstance, PCFGMN
     /* Initialize PCI config space */
     memcpy(pThis->config.mac.au8, pThis->macConfigured.au8, sizeof(pThis->config.mac.au8));
     pThis->config.uStatus = 0;
+    pThis->config.uMaxVirtqueuePairs = (uint16_t)pThis->cQueuePairsMax;
 
     /* Initialize state structure */
     pThis->u32PktNo     = 1;
@@ -2069,14 +2507,26 @@ static DECLCALLBACK(int) vnetConstruct(PPDMDEVINS pDevIns, int iInstance, PCFGMN
         return rc;
 
 #ifdef VNET_TX_DELAY
-    /* Create Transmit Delay Timer */
-    rc = PDMDevHlpTMTimerCreate(pDevIns, TMCLOCK_VIRTUAL, vnetTxTimer, pThis,
-                                TMTIMER_FLAGS_NO_CRIT_SECT,
-                                "VirtioNet TX Delay Timer", &pThis->pTxTimerR3);
-    if (RT_FAILURE(rc))
-        return rc;
-    pThis->pTxTimerR0 = TMTimerR0Ptr(pThis->pTxTimerR3);
-    pThis->pTxTimerRC = TMTimerRCPtr(pThis->pTxTimerR3);
+    /* Create Transmit Delay Timers */
+    static const char * const s_apszTxTimerNames[] =
+    {
+        "VirtioNet TX Delay Timer",    "VirtioNet TX Delay Timer #1",
+        "VirtioNet TX Delay Timer #2", "VirtioNet TX Delay Timer #3",
+        "VirtioNet TX Delay Timer #4", "VirtioNet TX Delay Timer #5",
+        "VirtioNet TX Delay Timer #6", "VirtioNet TX Delay Timer #7"
+    };
+    AssertCompile(RT_ELEMENTS(s_apszTxTimerNames) == VNET_MAX_QUEUE_PAIRS);
+    for (unsigned i = 0; i < pThis->cQueuePairsMax; i++)
+    {
+        PVNETQUEUEPAIR pPair = &pThis->aQueuePairs[i];
+        rc = PDMDevHlpTMTimerCreate(pDevIns, TMCLOCK_VIRTUAL, vnetTxTimer, pThis,
+                                    TMTIMER_FLAGS_NO_CRIT_SECT,
+                                    s_apszTxTimerNames[i], &pPair->pTxTimerR3);
+        if (RT_FAILURE(rc))
+            return rc;
+        pPair->pTxTimerR0 = TMTimerR0Ptr(pPair->pTxTimerR3);
+        pPair->pTxTimerRC = TMTimerRCPtr(pPair->pTxTimerR3);
+    }
 
     pThis->u32i = pThis->u32AvgDiff = pThis->u32MaxDiff = 0;
     pThis->u32MinDiff = ~0;
@@ -2103,6 +2553,24 @@ static DECLCALLBACK(int) vnetConstruct(PPDMDEVINS pDevIns, int iInstance, PCFGMN
     else
         return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to attach the network LUN"));
 
+    /* Create the receive notification timers */
+    static const char * const s_apszRxTimerNames[] =
+    {
+        "VirtioNet RX Notify Timer",    "VirtioNet RX Notify Timer #1",
+        "VirtioNet RX Notify Timer #2", "VirtioNet RX Notify Timer #3",
+        "VirtioNet RX Notify Timer #4", "VirtioNet RX Notify Timer #5",
+        "VirtioNet RX Notify Timer #6", "VirtioNet RX Notify Timer #7"
+    };
+    AssertCompile(RT_ELEMENTS(s_apszRxTimerNames) == VNET_MAX_QUEUE_PAIRS);
+    for (unsigned i = 0; i < pThis->cQueuePairsMax; i++)
+    {
+        rc = PDMDevHlpTMTimerCreate(pDevIns, TMCLOCK_VIRTUAL, vnetRxNotifyTimer, pThis,
+                                    TMTIMER_FLAGS_NO_CRIT_SECT,
+                                    s_apszRxTimerNames[i], &pThis->aQueuePairs[i].pRxTimerR3);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+
     rc = RTSemEventCreate(&pThis->hEventMoreRxDescAvail);
     if (RT_FAILURE(rc))
         return rc;
@@ -2119,6 +2587,12 @@ static DECLCALLBACK(int) vnetConstruct(PPDMDEVINS pDevIns, int iInstance, PCFGMN
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatTransmitPackets,    STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,          "Number of sent packets",             "/Devices/VNet%d/Packets/Transmit", iInstance);
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatTransmitGSO,        STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,          "Number of sent GSO packets",         "/Devices/VNet%d/Packets/Transmit-Gso", iInstance);
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatTransmitCSum,       STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,          "Number of completed TX checksums",   "/Devices/VNet%d/Packets/Transmit-Csum", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReceiveNotifyCoalesced, STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,      "Number of RX notifications saved",   "/Devices/VNet%d/Interrupts/ReceiveCoalesced", iInstance);
+    for (unsigned i = 0; i < pThis->cQueuePairsMax; i++)
+    {
+        PDMDevHlpSTAMRegisterF(pDevIns, &pThis->aQueuePairs[i].StatReceivePackets,  STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_COUNT, "Number of packets received on the queue pair", "/Devices/VNet%d/Queue%u/ReceivePackets", iInstance, i);
+        PDMDevHlpSTAMRegisterF(pDevIns, &pThis->aQueuePairs[i].StatTransmitPackets, STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_COUNT, "Number of packets sent from the queue pair",   "/Devices/VNet%d/Queue%u/TransmitPackets", iInstance, i);
+    }
 #if defined(VBOX_WITH_STATISTICS)
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReceive,            STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_CALL, "Profiling receive",                  "/Devices/VNet%d/Receive/Total", iInstance);
     PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReceiveStore,       STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_CALL, "Profiling receive storing",          "/Devices/VNet%d/Receive/Store", iInstance);
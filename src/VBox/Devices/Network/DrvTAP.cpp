@@ -60,15 +60,75 @@
 #else
 # include <sys/fcntl.h>
 #endif
+#ifdef RT_OS_LINUX
+# include <sys/uio.h>
+# include <net/if.h>
+# include <linux/if_tun.h>
+# include <iprt/err.h>
+#endif
 #include <errno.h>
 #include <unistd.h>
 
 #include "VBoxDD.h"
 
 
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+#if defined(RT_OS_LINUX) && defined(IFF_VNET_HDR) && defined(TUNSETOFFLOAD) && defined(TUNGETIFF)
+/** Enables passing GSO frames and checksum offloading through the virtio-net
+ * header of the Linux TUN/TAP driver. */
+# define DRVTAP_WITH_VNET_HDR
+#endif
+
+#ifdef DRVTAP_WITH_VNET_HDR
+/** @name DRVTAPVNETHDR::u8Flags
+ * @{ */
+/** The checksum starting at u16CsumStart still needs to be calculated. */
+# define DRVTAP_VNETHDR_F_NEEDS_CSUM    1
+/** @} */
+
+/** @name DRVTAPVNETHDR::u8GsoType
+ * @{ */
+# define DRVTAP_VNETHDR_GSO_NONE        0
+# define DRVTAP_VNETHDR_GSO_TCPV4       1
+# define DRVTAP_VNETHDR_GSO_UDP         3
+# define DRVTAP_VNETHDR_GSO_TCPV6       4
+/** Flag: The TCP segments have the CWR bit set. */
+# define DRVTAP_VNETHDR_GSO_ECN         0x80
+/** @} */
+
+/** The size of the receive buffer when the host may hand us GSO frames. */
+# define DRVTAP_RECV_GSO_BUF_SIZE       (_64K + _1K)
+#endif
+
+
 /*******************************************************************************
 *   Structures and Typedefs                                                    *
 *******************************************************************************/
+#ifdef DRVTAP_WITH_VNET_HDR
+/**
+ * The virtio-net header the Linux TAP driver puts in front of every frame when
+ * the interface was set up with IFF_VNET_HDR (struct virtio_net_hdr).
+ *
+ * The fields are in host byte order.
+ */
+typedef struct DRVTAPVNETHDR
+{
+    uint8_t                 u8Flags;
+    uint8_t                 u8GsoType;
+    uint16_t                u16HdrLen;
+    uint16_t                u16GsoSize;
+    uint16_t                u16CsumStart;
+    uint16_t                u16CsumOffset;
+} DRVTAPVNETHDR;
+AssertCompileSize(DRVTAPVNETHDR, 10);
+/** Pointer to a virtio-net header. */
+typedef DRVTAPVNETHDR *PDRVTAPVNETHDR;
+/** Pointer to a const virtio-net header. */
+typedef DRVTAPVNETHDR const *PCDRVTAPVNETHDR;
+#endif
+
 /**
  * TAP driver instance data.
  *
@@ -91,6 +151,12 @@ typedef struct DRVTAP
     int                     iIPFileDes;
     /** Whether device name is obtained from setup application. */
     bool                    fStatic;
+#endif
+#ifdef DRVTAP_WITH_VNET_HDR
+    /** Whether frames are prefixed by a virtio-net header (IFF_VNET_HDR). */
+    bool                    fVnetHdr;
+    /** Receive buffer large enough for GSO frames (only when fVnetHdr is set). */
+    uint8_t                *pbRecvBuf;
 #endif
     /** TAP setup application. */
     char                   *pszSetupApplication;
@@ -116,6 +182,10 @@ typedef struct DRVTAP
     STAMCOUNTER             StatPktRecv;
     /** Number of received bytes. */
     STAMCOUNTER             StatPktRecvBytes;
+    /** The GSO portion of the sent packets. */
+    STAMCOUNTER             StatPktSentGso;
+    /** The GSO portion of the received packets. */
+    STAMCOUNTER             StatPktRecvGso;
     /** Profiling packet transmit runs. */
     STAMPROFILE             StatTransmit;
     /** Profiling packet receive runs. */
@@ -143,6 +213,217 @@ static int              SolarisTAPAttach(PDRVTAP pThis);
 #endif
 
 
+/**
+ * Writes a frame to the TAP device.
+ *
+ * @returns VBox status code.
+ * @param   pThis           The instance data.
+ * @param   pVnetHdr        The virtio-net header to prefix the frame with.  NULL
+ *                          means a plain frame.  Ignored if the interface wasn't
+ *                          set up with IFF_VNET_HDR.
+ * @param   pvFrame         The frame.
+ * @param   cbFrame         The size of the frame.
+ */
+static int drvTAPWriteFrame(PDRVTAP pThis, void const *pVnetHdr, void const *pvFrame, size_t cbFrame)
+{
+#ifdef DRVTAP_WITH_VNET_HDR
+    if (pThis->fVnetHdr)
+    {
+        static const DRVTAPVNETHDR s_NoOffloadHdr = { 0, DRVTAP_VNETHDR_GSO_NONE, 0, 0, 0, 0 };
+        struct iovec aIov[2];
+        aIov[0].iov_base = (void *)(pVnetHdr ? pVnetHdr : &s_NoOffloadHdr);
+        aIov[0].iov_len  = sizeof(DRVTAPVNETHDR);
+        aIov[1].iov_base = (void *)pvFrame;
+        aIov[1].iov_len  = cbFrame;
+        if (writev(RTFileToNative(pThis->hFileDevice), &aIov[0], RT_ELEMENTS(aIov)) < 0)
+            return RTErrConvertFromErrno(errno);
+        return VINF_SUCCESS;
+    }
+#endif
+    NOREF(pVnetHdr);
+    return RTFileWrite(pThis->hFileDevice, pvFrame, cbFrame, NULL);
+}
+
+
+#ifdef DRVTAP_WITH_VNET_HDR
+/**
+ * Prepares a GSO frame for being handed to the host in one piece.
+ *
+ * The IP header is updated and the TCP checksum field is primed with the
+ * pseudo header sum, which is what the host expects for a partially
+ * checksummed frame.  The host does the segmentation (or none at all if the
+ * frame stays on the host).
+ *
+ * @returns true if the frame can be passed on as-is, false if it needs to be
+ *          segmented by us.
+ * @param   pGso            The GSO context.
+ * @param   pbFrame         The GSO frame.  Modified on success.
+ * @param   cbFrame         The size of the frame.
+ * @param   pVnetHdr        Where to return the virtio-net header.
+ */
+static bool drvTAPGsoPrepVnetHdr(PCPDMNETWORKGSO pGso, uint8_t *pbFrame, size_t cbFrame, PDRVTAPVNETHDR pVnetHdr)
+{
+    switch ((PDMNETWORKGSOTYPE)pGso->u8Type)
+    {
+        case PDMNETWORKGSOTYPE_IPV4_TCP:
+            if (cbFrame - pGso->offHdr1 > UINT16_MAX)
+                return false;
+            pVnetHdr->u8GsoType = DRVTAP_VNETHDR_GSO_TCPV4;
+            break;
+        case PDMNETWORKGSOTYPE_IPV6_TCP:
+            pVnetHdr->u8GsoType = DRVTAP_VNETHDR_GSO_TCPV6;
+            break;
+        default:
+            /* UFO is no longer taken by recent hosts and the 4-in-6 types have no equivalent. */
+            return false;
+    }
+    if (!PDMNetGsoIsValid(pGso, sizeof(*pGso), cbFrame))
+        return false;
+
+    PDMNetGsoPrepForDirectUse(pGso, pbFrame, cbFrame, PDMNETCSUMTYPE_PSEUDO);
+
+    if (((PCRTNETTCP)&pbFrame[pGso->offHdr2])->th_flags & RTNETTCP_F_CWR)
+        pVnetHdr->u8GsoType |= DRVTAP_VNETHDR_GSO_ECN;
+    pVnetHdr->u8Flags       = DRVTAP_VNETHDR_F_NEEDS_CSUM;
+    pVnetHdr->u16HdrLen     = pGso->cbHdrsTotal;
+    pVnetHdr->u16GsoSize    = pGso->cbMaxSeg;
+    pVnetHdr->u16CsumStart  = pGso->offHdr2;
+    pVnetHdr->u16CsumOffset = RT_OFFSETOF(RTNETTCP, th_sum);
+    return true;
+}
+
+
+/**
+ * Translates the virtio-net header of a GSO frame received from the host into
+ * a GSO context.
+ *
+ * @returns true if the frame is a valid GSO frame we can handle, false if not.
+ * @param   pVnetHdr        The virtio-net header.
+ * @param   pbFrame         The GSO frame.
+ * @param   cbFrame         The size of the frame.
+ * @param   pGso            Where to return the GSO context.
+ */
+static bool drvTAPVnetHdrToGso(PCDRVTAPVNETHDR pVnetHdr, uint8_t const *pbFrame, size_t cbFrame, PPDMNETWORKGSO pGso)
+{
+    switch (pVnetHdr->u8GsoType & ~DRVTAP_VNETHDR_GSO_ECN)
+    {
+        case DRVTAP_VNETHDR_GSO_TCPV4:  pGso->u8Type = PDMNETWORKGSOTYPE_IPV4_TCP; break;
+        case DRVTAP_VNETHDR_GSO_TCPV6:  pGso->u8Type = PDMNETWORKGSOTYPE_IPV6_TCP; break;
+        default:                        return false; /* We don't ask for UFO. */
+    }
+    if (   !(pVnetHdr->u8Flags & DRVTAP_VNETHDR_F_NEEDS_CSUM)
+        || !pVnetHdr->u16GsoSize
+        || cbFrame < sizeof(RTNETETHERHDR))
+        return false;
+
+    uint32_t offHdr1 = sizeof(RTNETETHERHDR);
+    if (((PCRTNETETHERHDR)pbFrame)->EtherType == RT_H2N_U16_C(RTNET_ETHERTYPE_VLAN))
+        offHdr1 += 4;
+    uint32_t const offHdr2 = pVnetHdr->u16CsumStart;
+    if (   offHdr2 <= offHdr1
+        || offHdr2 + RTNETTCP_MIN_LEN > cbFrame)
+        return false;
+    uint32_t const cbHdrsTotal = offHdr2 + ((PCRTNETTCP)&pbFrame[offHdr2])->th_off * 4;
+    if (cbHdrsTotal > UINT8_MAX)
+        return false;
+
+    pGso->cbHdrsTotal = (uint8_t)cbHdrsTotal;
+    pGso->cbHdrsSeg   = (uint8_t)cbHdrsTotal;
+    pGso->offHdr1     = (uint8_t)offHdr1;
+    pGso->offHdr2     = (uint8_t)offHdr2;
+    pGso->cbMaxSeg    = pVnetHdr->u16GsoSize;
+    pGso->u8Unused    = 0;
+    return PDMNetGsoIsValid(pGso, sizeof(*pGso), cbFrame);
+}
+
+
+/**
+ * Completes the checksum of a frame the host left partially checksummed.
+ *
+ * The checksum field already holds the pseudo header sum, so summing up
+ * everything from the checksum start gives the final value.
+ *
+ * @param   pVnetHdr        The virtio-net header.
+ * @param   pbFrame         The frame.
+ * @param   cbFrame         The size of the frame.
+ */
+static void drvTAPCompleteChecksum(PCDRVTAPVNETHDR pVnetHdr, uint8_t *pbFrame, size_t cbFrame)
+{
+    uint32_t const offStart = pVnetHdr->u16CsumStart;
+    uint32_t const offField = offStart + pVnetHdr->u16CsumOffset;
+    if (   offStart >= cbFrame
+        || offField + sizeof(uint16_t) > cbFrame)
+        return;
+
+    bool     fOdd    = false;
+    uint16_t u16Csum = RTNetIPv4FinalizeChecksum(RTNetIPv4AddDataChecksum(&pbFrame[offStart], cbFrame - offStart, 0, &fOdd));
+    if (!u16Csum && pVnetHdr->u16CsumOffset == RT_OFFSETOF(RTNETUDP, uh_sum))
+        u16Csum = UINT16_MAX; /* zero means no checksum for UDP */
+    *(uint16_t *)&pbFrame[offField] = u16Csum;
+}
+
+
+/**
+ * Passes a GSO frame received from the host up, segmenting it if the device
+ * above cannot take it in one piece.
+ *
+ * @param   pThis           The instance data.
+ * @param   pVnetHdr        The virtio-net header.
+ * @param   pbFrame         The GSO frame.
+ * @param   cbFrame         The size of the frame.
+ */
+static void drvTAPRecvGso(PDRVTAP pThis, PCDRVTAPVNETHDR pVnetHdr, uint8_t *pbFrame, size_t cbFrame)
+{
+    PDMNETWORKGSO Gso;
+    if (!drvTAPVnetHdrToGso(pVnetHdr, pbFrame, cbFrame, &Gso))
+    {
+        Log(("drvTAPRecvGso: Dropping frame: type=%#x flags=%#x hdrlen=%#x mss=%#x start=%#x cbFrame=%#zx\n",
+             pVnetHdr->u8GsoType, pVnetHdr->u8Flags, pVnetHdr->u16HdrLen, pVnetHdr->u16GsoSize,
+             pVnetHdr->u16CsumStart, cbFrame));
+        return;
+    }
+
+    STAM_COUNTER_INC(&pThis->StatPktRecv);
+    STAM_COUNTER_INC(&pThis->StatPktRecvGso);
+    STAM_COUNTER_ADD(&pThis->StatPktRecvBytes, cbFrame);
+
+    STAM_PROFILE_ADV_STOP(&pThis->StatReceive, a);
+    int rc = pThis->pIAboveNet->pfnWaitReceiveAvail(pThis->pIAboveNet, RT_INDEFINITE_WAIT);
+    STAM_PROFILE_ADV_START(&pThis->StatReceive, a);
+    if (RT_FAILURE(rc))
+        return;
+
+    if (   !pThis->pIAboveNet->pfnReceiveGso
+        || RT_FAILURE(pThis->pIAboveNet->pfnReceiveGso(pThis->pIAboveNet, pbFrame, cbFrame, &Gso)))
+    {
+        /*
+         * The device does not do large receive offload, so segment it here.
+         * This still saves us a system call per segment.
+         */
+        uint8_t         abHdrScratch[256];
+        uint32_t const  cSegs = PDMNetGsoCalcSegmentCount(&Gso, cbFrame);
+        for (uint32_t iSeg = 0; iSeg < cSegs; iSeg++)
+        {
+            uint32_t cbSegFrame;
+            void    *pvSegFrame = PDMNetGsoCarveSegmentQD(&Gso, pbFrame, cbFrame, abHdrScratch, iSeg, cSegs, &cbSegFrame);
+            if (iSeg)
+            {
+                STAM_PROFILE_ADV_STOP(&pThis->StatReceive, a);
+                rc = pThis->pIAboveNet->pfnWaitReceiveAvail(pThis->pIAboveNet, RT_INDEFINITE_WAIT);
+                STAM_PROFILE_ADV_START(&pThis->StatReceive, a);
+                if (RT_FAILURE(rc))
+                {
+                    Log(("drvTAPRecvGso: pfnWaitReceiveAvail -> %Rrc; iSeg=%u cSegs=%u\n", rc, iSeg, cSegs));
+                    break; /* we drop the rest. */
+                }
+            }
+            rc = pThis->pIAboveNet->pfnReceive(pThis->pIAboveNet, pvSegFrame, cbSegFrame);
+            AssertRC(rc);
+        }
+    }
+}
+#endif /* DRVTAP_WITH_VNET_HDR */
+
 
 /**
  * @interface_method_impl{PDMINETWORKUP,pfnBeginXmit}
@@ -241,6 +522,9 @@ static DECLCALLBACK(int) drvTAPNetworkUp_SendBuf(PPDMINETWORKUP pInterface, PPDM
     PDMDrvHlpFTSetCheckpoint(pThis->pDrvIns, FTMCHECKPOINTTYPE_NETWORK);
 
     int rc;
+#ifdef DRVTAP_WITH_VNET_HDR
+    DRVTAPVNETHDR VnetHdr;
+#endif
     if (!pSgBuf->pvUser)
     {
 #ifdef LOG_ENABLED
@@ -253,8 +537,18 @@ static DECLCALLBACK(int) drvTAPNetworkUp_SendBuf(PPDMINETWORKUP pInterface, PPDM
               "%.*Rhxd\n",
               pSgBuf->aSegs[0].pvSeg, pSgBuf->cbUsed, pSgBuf->cbUsed, pSgBuf->aSegs[0].pvSeg));
 
-        rc = RTFileWrite(pThis->hFileDevice, pSgBuf->aSegs[0].pvSeg, pSgBuf->cbUsed, NULL);
+        rc = drvTAPWriteFrame(pThis, NULL, pSgBuf->aSegs[0].pvSeg, pSgBuf->cbUsed);
+    }
+#ifdef DRVTAP_WITH_VNET_HDR
+    else if (   pThis->fVnetHdr
+             && drvTAPGsoPrepVnetHdr((PCPDMNETWORKGSO)pSgBuf->pvUser, (uint8_t *)pSgBuf->aSegs[0].pvSeg,
+                                     pSgBuf->cbUsed, &VnetHdr))
+    {
+        /* One write for the whole GSO frame, the host segments it if it has to. */
+        STAM_COUNTER_INC(&pThis->StatPktSentGso);
+        rc = drvTAPWriteFrame(pThis, &VnetHdr, pSgBuf->aSegs[0].pvSeg, pSgBuf->cbUsed);
     }
+#endif
     else
     {
         uint8_t         abHdrScratch[256];
@@ -267,7 +561,7 @@ static DECLCALLBACK(int) drvTAPNetworkUp_SendBuf(PPDMINETWORKUP pInterface, PPDM
             uint32_t cbSegFrame;
             void *pvSegFrame = PDMNetGsoCarveSegmentQD(pGso, (uint8_t *)pbFrame, pSgBuf->cbUsed, abHdrScratch,
                                                        iSeg, cSegs, &cbSegFrame);
-            rc = RTFileWrite(pThis->hFileDevice, pvSegFrame, cbSegFrame, NULL);
+            rc = drvTAPWriteFrame(pThis, NULL, pvSegFrame, cbSegFrame);
             if (RT_FAILURE(rc))
                 break;
         }
@@ -367,13 +661,48 @@ static DECLCALLBACK(int) drvTAPAsyncIoThread(PPDMDRVINS pDrvIns, PPDMTHREAD pThr
              * Read the frame.
              */
             char achBuf[16384];
+            uint8_t *pbFrame = (uint8_t *)&achBuf[0];
             size_t cbRead = 0;
             /** @note At least on Linux we will never receive more than one network packet
              *        after poll() returned successfully. I don't know why but a second
              *        RTFileRead() operation will return with VERR_TRY_AGAIN in any case. */
-            rc = RTFileRead(pThis->hFileDevice, achBuf, sizeof(achBuf), &cbRead);
+#ifdef DRVTAP_WITH_VNET_HDR
+            DRVTAPVNETHDR VnetHdr;
+            if (pThis->fVnetHdr)
+            {
+                struct iovec aIov[2];
+                aIov[0].iov_base = &VnetHdr;
+                aIov[0].iov_len  = sizeof(VnetHdr);
+                aIov[1].iov_base = pThis->pbRecvBuf;
+                aIov[1].iov_len  = DRVTAP_RECV_GSO_BUF_SIZE;
+                ssize_t cbRet = readv(RTFileToNative(pThis->hFileDevice), &aIov[0], RT_ELEMENTS(aIov));
+                if (cbRet >= (ssize_t)sizeof(VnetHdr))
+                {
+                    pbFrame = pThis->pbRecvBuf;
+                    cbRead  = cbRet - sizeof(VnetHdr);
+                    rc = VINF_SUCCESS;
+                }
+                else
+                    rc = cbRet < 0 ? RTErrConvertFromErrno(errno) : VERR_TRY_AGAIN;
+            }
+            else
+#endif
+                rc = RTFileRead(pThis->hFileDevice, achBuf, sizeof(achBuf), &cbRead);
             if (RT_SUCCESS(rc))
             {
+#ifdef DRVTAP_WITH_VNET_HDR
+                if (pThis->fVnetHdr)
+                {
+                    if (VnetHdr.u8GsoType != DRVTAP_VNETHDR_GSO_NONE)
+                    {
+                        drvTAPRecvGso(pThis, &VnetHdr, pbFrame, cbRead);
+                        continue;
+                    }
+                    if (VnetHdr.u8Flags & DRVTAP_VNETHDR_F_NEEDS_CSUM)
+                        drvTAPCompleteChecksum(&VnetHdr, pbFrame, cbRead);
+                }
+#endif
+
                 /*
                  * Wait for the device to have space for this frame.
                  * Most guests use frame-sized receive buffers, hence non-zero cbMax
@@ -407,10 +736,10 @@ static DECLCALLBACK(int) drvTAPAsyncIoThread(PPDMDRVINS pDrvIns, PPDMTHREAD pThr
                          cbRead, u64Now, u64Now - pThis->u64LastReceiveTS, u64Now - pThis->u64LastTransferTS));
                 pThis->u64LastReceiveTS = u64Now;
 #endif
-                Log2(("drvTAPAsyncIoThread: cbRead=%#x\n" "%.*Rhxd\n", cbRead, cbRead, achBuf));
+                Log2(("drvTAPAsyncIoThread: cbRead=%#x\n" "%.*Rhxd\n", cbRead, cbRead, pbFrame));
                 STAM_COUNTER_INC(&pThis->StatPktRecv);
                 STAM_COUNTER_ADD(&pThis->StatPktRecvBytes, cbRead);
-                rc1 = pThis->pIAboveNet->pfnReceive(pThis->pIAboveNet, achBuf, cbRead);
+                rc1 = pThis->pIAboveNet->pfnReceive(pThis->pIAboveNet, pbFrame, cbRead);
                 AssertRC(rc1);
             }
             else
@@ -820,6 +1149,11 @@ static DECLCALLBACK(void) drvTAPDestruct(PPDMDRVINS pDrvIns)
     if (RTCritSectIsInitialized(&pThis->XmitLock))
         RTCritSectDelete(&pThis->XmitLock);
 
+#ifdef DRVTAP_WITH_VNET_HDR
+    RTMemFree(pThis->pbRecvBuf);
+    pThis->pbRecvBuf = NULL;
+#endif
+
 #ifdef VBOX_WITH_STATISTICS
     /*
      * Deregister statistics.
@@ -828,6 +1162,8 @@ static DECLCALLBACK(void) drvTAPDestruct(PPDMDRVINS pDrvIns)
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatPktSentBytes);
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatPktRecv);
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatPktRecvBytes);
+    PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatPktSentGso);
+    PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatPktRecvGso);
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatTransmit);
     PDMDrvHlpSTAMDeregister(pDrvIns, &pThis->StatReceive);
 #endif /* VBOX_WITH_STATISTICS */
@@ -878,6 +1214,8 @@ static DECLCALLBACK(int) drvTAPConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uin
     PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatPktSentBytes,  STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,             "Number of sent bytes.",            "/Drivers/TAP%d/Bytes/Sent", pDrvIns->iInstance);
     PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatPktRecv,       STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,        "Number of received packets.",      "/Drivers/TAP%d/Packets/Received", pDrvIns->iInstance);
     PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatPktRecvBytes,  STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,             "Number of received bytes.",        "/Drivers/TAP%d/Bytes/Received", pDrvIns->iInstance);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatPktSentGso,    STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,        "The GSO portion of the sent packets.",     "/Drivers/TAP%d/Packets/Sent-Gso", pDrvIns->iInstance);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatPktRecvGso,    STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,        "The GSO portion of the received packets.", "/Drivers/TAP%d/Packets/Received-Gso", pDrvIns->iInstance);
     PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatTransmit,      STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_CALL,    "Profiling packet transmit runs.",  "/Drivers/TAP%d/Transmit", pDrvIns->iInstance);
     PDMDrvHlpSTAMRegisterF(pDrvIns, &pThis->StatReceive,       STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_CALL,    "Profiling packet receive runs.",   "/Drivers/TAP%d/Receive", pDrvIns->iInstance);
 #endif /* VBOX_WITH_STATISTICS */
@@ -980,6 +1318,28 @@ static DECLCALLBACK(int) drvTAPConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uin
     Log(("drvTAPContruct: %d (from fd)\n", (intptr_t)pThis->hFileDevice));
     rc = VINF_SUCCESS;
 
+#ifdef DRVTAP_WITH_VNET_HDR
+    /*
+     * If Main set up the interface with virtio-net headers, GSO frames can be
+     * passed to the host in one piece.  Also tell the host which offloads we
+     * can take, so it doesn't have to segment and checksum TCP traffic for
+     * the guest either.
+     */
+    struct ifreq IfReq;
+    RT_ZERO(IfReq);
+    if (   ioctl(RTFileToNative(pThis->hFileDevice), TUNGETIFF, &IfReq) == 0
+        && (IfReq.ifr_flags & IFF_VNET_HDR))
+    {
+        pThis->pbRecvBuf = (uint8_t *)RTMemAlloc(DRVTAP_RECV_GSO_BUF_SIZE);
+        if (!pThis->pbRecvBuf)
+            return VERR_NO_MEMORY;
+        pThis->fVnetHdr = true;
+        if (ioctl(RTFileToNative(pThis->hFileDevice), TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) != 0)
+            LogRel(("TAP#%d: Failed to enable receive offloading. errno=%d\n", pDrvIns->iInstance, errno));
+        LogRel(("TAP#%d: Using virtio-net headers for segmentation and checksum offloading\n", pDrvIns->iInstance));
+    }
+#endif
+
     /*
      * Create the control pipe.
      */
@@ -60,6 +60,9 @@
 /** The wakeup bit in the INTNETIF::cBusy and INTNETRUNKIF::cBusy counters. */
 #define INTNET_BUSY_WAKEUP_MASK     RT_BIT_32(30)
 
+/** The max number of frames IntNetR0IfSend switches and delivers in one go. */
+#define INTNET_MAX_SEND_BURST       16
+
 
 /*******************************************************************************
 *   Structures and Typedefs                                                    *
@@ -2661,6 +2664,89 @@ static void intnetR0IfSend(PINTNETIF pIf, PINTNETIF pIfSender, PINTNETSG pSG, PC
 }
 
 
+/**
+ * Initializes a temporary gather list for a frame in the send ring of an
+ * interface.
+ *
+ * @returns true if it is a frame that should be sent, false if it's padding or
+ *          an invalid frame.
+ * @param   pIf             The interface.
+ * @param   pHdr            The frame header in the send ring.
+ * @param   pSG             The gather list to initialize.
+ */
+static bool intnetR0IfInitSendSg(PINTNETIF pIf, PINTNETHDR pHdr, PINTNETSG pSG)
+{
+    uint8_t const u8Type = pHdr->u8Type;
+    if (u8Type == INTNETHDR_TYPE_FRAME)
+    {
+        IntNetSgInitTemp(pSG, IntNetHdrGetFramePtr(pHdr, pIf->pIntBuf), pHdr->cbFrame);
+        return true;
+    }
+    if (u8Type == INTNETHDR_TYPE_GSO)
+    {
+        PPDMNETWORKGSO  pGso    = IntNetHdrGetGsoContext(pHdr, pIf->pIntBuf);
+        uint32_t        cbFrame = pHdr->cbFrame - sizeof(*pGso);
+        if (RT_LIKELY(PDMNetGsoIsValid(pGso, pHdr->cbFrame, cbFrame)))
+        {
+            IntNetSgInitTempGso(pSG, pGso + 1, cbFrame, pGso);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Gathers a burst of frames from the send ring of an interface that can be
+ * switched together.
+ *
+ * The frames must be consecutive, valid, and have the same source and
+ * destination MAC addresses as the first one.  Nothing is consumed from the
+ * ring.
+ *
+ * @returns The number of frames in the burst, 0 if the first frame is not
+ *          suitable.
+ * @param   pIf             The interface.
+ * @param   pHdr            The first frame in the send ring.
+ * @param   papHdrs         Where to return the frame headers.  Must have room
+ *                          for INTNET_MAX_SEND_BURST entries.
+ */
+static uint32_t intnetR0IfGatherSendBurst(PINTNETIF pIf, PINTNETHDR pHdr, PINTNETHDR *papHdrs)
+{
+    PINTNETRINGBUF  pRingBuf    = &pIf->pIntBuf->Send;
+    uint32_t const  offWriteCom = ASMAtomicUoReadU32(&pRingBuf->offWriteCom);
+    uint32_t        offRead     = (uint32_t)((uintptr_t)pHdr - (uintptr_t)pRingBuf);
+    RTNETETHERHDR   EthHdr0;
+    uint32_t        cFrames     = 0;
+    for (;;)
+    {
+        INTNETSG Sg;
+        if (   !intnetR0IfInitSendSg(pIf, pHdr, &Sg)
+            || Sg.aSegs[0].cb < sizeof(RTNETETHERHDR))
+            break;
+        PCRTNETETHERHDR pEthHdr = (PCRTNETETHERHDR)Sg.aSegs[0].pv;
+        if (!cFrames)
+            EthHdr0 = *pEthHdr;
+        else if (   memcmp(&pEthHdr->DstMac, &EthHdr0.DstMac, sizeof(RTMAC))
+                 || memcmp(&pEthHdr->SrcMac, &EthHdr0.SrcMac, sizeof(RTMAC)))
+            break;
+        papHdrs[cFrames++] = pHdr;
+        if (cFrames >= INTNET_MAX_SEND_BURST)
+            break;
+
+        /* Advance to the next frame the same way IntNetRingSkipFrame does. */
+        offRead = RT_ALIGN_32(offRead + pHdr->offFrame + pHdr->cbFrame, INTNETHDR_ALIGNMENT);
+        if (offRead >= pRingBuf->offEnd)
+            offRead = pRingBuf->offStart;
+        if (   offRead == offWriteCom
+            || offRead <  pRingBuf->offStart)
+            break;
+        pHdr = (PINTNETHDR)((uint8_t *)pRingBuf + offRead);
+    }
+    return cFrames;
+}
+
+
 /**
  * Fallback path that does the GSO segmenting before passing the frame on to the
  * trunk interface.
@@ -3583,10 +3669,90 @@ static void intnetR0NetworkDeliver(PINTNETNETWORK pNetwork, PINTNETDSTTAB pDstTa
 
 
 /**
- * Sends a frame.
+ * Deliver a burst of frames to the interfaces specified in the destination
+ * table.
  *
- * This function will distribute the frame to the interfaces it is addressed to.
- * It will also update the MAC address of the sender.
+ * All the frames have the same source and destination MAC addresses, so the
+ * destination table applies to each of them.  Each destination interface gets
+ * as much of the burst as it has room for with a single acquisition of its
+ * receive lock and a single wakeup.
+ *
+ * The frame headers are read again from the send ring, which ring-3 can write
+ * to, so frames which are no longer valid are dropped.
+ *
+ * @param   pNetwork            The network.
+ * @param   pDstTab             The destination table.
+ * @param   pIfSender           The sender interface.
+ * @param   papHdrs             The frames in the send ring of @a pIfSender.
+ * @param   cFrames             The number of frames.
+ */
+static void intnetR0NetworkDeliverBurst(PINTNETNETWORK pNetwork, PINTNETDSTTAB pDstTab, PINTNETIF pIfSender,
+                                        PINTNETHDR *papHdrs, uint32_t cFrames)
+{
+    INTNETSG Sg;
+
+    /*
+     * Do the interfaces first before sending it to the wire and risk having to
+     * modify it.
+     */
+    uint32_t iIf = pDstTab->cIfs;
+    while (iIf-- > 0)
+    {
+        PINTNETIF pIf        = pDstTab->aIfs[iIf].pIf;
+        PCRTMAC   pNewDstMac = pDstTab->aIfs[iIf].fReplaceDstMac ? &pIf->MacAddr : NULL;
+
+        uint32_t iFrame = 0;
+        RTSpinlockAcquire(pIf->hRecvInSpinlock);
+        for (; iFrame < cFrames; iFrame++)
+        {
+            if (!intnetR0IfInitSendSg(pIfSender, papHdrs[iFrame], &Sg))
+                continue;
+            if (RT_FAILURE(intnetR0RingWriteFrame(&pIf->pIntBuf->Recv, &Sg, pNewDstMac)))
+                break;
+        }
+        RTSpinlockReleaseNoInts(pIf->hRecvInSpinlock);
+
+        if (iFrame == cFrames)
+        {
+            pIf->cYields = 0;
+            RTSemEventSignal(pIf->hRecvEvent);
+        }
+        else
+        {
+            /* Out of ring space, let the single frame path deal with yielding and accounting. */
+            if (iFrame > 0)
+                pIf->cYields = 0;
+            for (; iFrame < cFrames; iFrame++)
+                if (intnetR0IfInitSendSg(pIfSender, papHdrs[iFrame], &Sg))
+                    intnetR0IfSend(pIf, pIfSender, &Sg, pNewDstMac);
+        }
+
+        intnetR0BusyDecIf(pIf);
+        pDstTab->aIfs[iIf].pIf = NULL;
+    }
+    pDstTab->cIfs = 0;
+
+    /*
+     * Send to the trunk.
+     */
+    if (pDstTab->fTrunkDst)
+    {
+        PINTNETTRUNKIF pTrunk = pDstTab->pTrunk;
+        for (uint32_t iFrame = 0; iFrame < cFrames; iFrame++)
+            if (intnetR0IfInitSendSg(pIfSender, papHdrs[iFrame], &Sg))
+                intnetR0TrunkIfSend(pTrunk, pNetwork, pIfSender, pDstTab->fTrunkDst, &Sg);
+        intnetR0BusyDec(pNetwork, &pTrunk->cBusy);
+        pDstTab->pTrunk    = NULL;
+        pDstTab->fTrunkDst = 0;
+    }
+}
+
+
+/**
+ * Switches a frame, i.e. fills in the destination table for it.
+ *
+ * It will also update the MAC address of the sender.  This is the first half
+ * of intnetR0NetworkSend and is also used for switching bursts.
  *
  * The caller must own the network mutex.
  *
@@ -3597,8 +3763,8 @@ static void intnetR0NetworkDeliver(PINTNETNETWORK pNetwork, PINTNETDSTTAB pDstTa
  * @param   pSG             Pointer to the gather list.
  * @param   pDstTab         The destination table to use.
  */
-static INTNETSWDECISION intnetR0NetworkSend(PINTNETNETWORK pNetwork, PINTNETIF pIfSender, uint32_t fSrc,
-                                            PINTNETSG pSG, PINTNETDSTTAB pDstTab)
+static INTNETSWDECISION intnetR0NetworkSwitch(PINTNETNETWORK pNetwork, PINTNETIF pIfSender, uint32_t fSrc,
+                                              PINTNETSG pSG, PINTNETDSTTAB pDstTab)
 {
     /*
      * Assert reality.
@@ -3678,6 +3844,30 @@ static INTNETSWDECISION intnetR0NetworkSend(PINTNETNETWORK pNetwork, PINTNETIF p
     else
         enmSwDecision = intnetR0NetworkSwitchUnicast(pNetwork, fSrc, pIfSender, &EthHdr.DstMac, pDstTab);
 
+    return enmSwDecision;
+}
+
+
+/**
+ * Sends a frame.
+ *
+ * This function will distribute the frame to the interfaces it is addressed to.
+ * It will also update the MAC address of the sender.
+ *
+ * The caller must own the network mutex.
+ *
+ * @returns The switching decision.
+ * @param   pNetwork        The network the frame is being sent to.
+ * @param   pIfSender       The interface sending the frame. This is NULL if it's the trunk.
+ * @param   fSrc            The source flags. This 0 if it's not from the trunk.
+ * @param   pSG             Pointer to the gather list.
+ * @param   pDstTab         The destination table to use.
+ */
+static INTNETSWDECISION intnetR0NetworkSend(PINTNETNETWORK pNetwork, PINTNETIF pIfSender, uint32_t fSrc,
+                                            PINTNETSG pSG, PINTNETDSTTAB pDstTab)
+{
+    INTNETSWDECISION enmSwDecision = intnetR0NetworkSwitch(pNetwork, pIfSender, fSrc, pSG, pDstTab);
+
     /*
      * Deliver to the destinations if we can.
      */
@@ -3696,6 +3886,45 @@ static INTNETSWDECISION intnetR0NetworkSend(PINTNETNETWORK pNetwork, PINTNETIF p
 }
 
 
+/**
+ * Sends a burst of frames with the same source and destination MAC addresses.
+ *
+ * The burst is switched once, based on the first frame, and delivered to each
+ * destination in one go.
+ *
+ * The caller must own the network mutex.
+ *
+ * @returns The switching decision.
+ * @param   pNetwork        The network the frames are being sent to.
+ * @param   pIfSender       The interface sending the frames.
+ * @param   papHdrs         The frames in the send ring of @a pIfSender, as
+ *                          gathered by intnetR0IfGatherSendBurst.
+ * @param   cFrames         The number of frames.
+ * @param   pDstTab         The destination table to use.
+ */
+static INTNETSWDECISION intnetR0NetworkSendBurst(PINTNETNETWORK pNetwork, PINTNETIF pIfSender,
+                                                 PINTNETHDR *papHdrs, uint32_t cFrames, PINTNETDSTTAB pDstTab)
+{
+    INTNETSG Sg;
+    if (RT_UNLIKELY(!intnetR0IfInitSendSg(pIfSender, papHdrs[0], &Sg)))
+        return INTNETSWDECISION_DROP; /* Changed by ring-3 after it was gathered. */
+    INTNETSWDECISION enmSwDecision = intnetR0NetworkSwitch(pNetwork, pIfSender, 0 /*fSrc*/, &Sg, pDstTab);
+
+    if (enmSwDecision != INTNETSWDECISION_BAD_CONTEXT)
+    {
+        if (intnetR0NetworkIsContextOk(pNetwork, pIfSender, pDstTab))
+            intnetR0NetworkDeliverBurst(pNetwork, pDstTab, pIfSender, papHdrs, cFrames);
+        else
+        {
+            intnetR0NetworkReleaseDstTab(pNetwork, pDstTab);
+            enmSwDecision = INTNETSWDECISION_BAD_CONTEXT;
+        }
+    }
+
+    return enmSwDecision;
+}
+
+
 /**
  * Sends one or more frames.
  *
@@ -3749,41 +3978,42 @@ INTNETR0DECL(int) IntNetR0IfSend(INTNETIFHANDLE hIf, PSUPDRVSESSION pSession)
                                      * with buffer sharing for some OS or service. Darwin copies everything so
                                      * I won't bother allocating and managing SGs right now. Sorry. */
             PINTNETHDR          pHdr;
+            PINTNETHDR          apBurst[INTNET_MAX_SEND_BURST];
             while ((pHdr = IntNetRingGetNextFrameToRead(&pIf->pIntBuf->Send)) != NULL)
             {
-                uint8_t const      u8Type = pHdr->u8Type;
-                if (u8Type == INTNETHDR_TYPE_FRAME)
-                {
-                    /* Send regular frame. */
-                    void *pvCurFrame = IntNetHdrGetFramePtr(pHdr, pIf->pIntBuf);
-                    IntNetSgInitTemp(&Sg, pvCurFrame, pHdr->cbFrame);
-                    if (pNetwork->fFlags & INTNET_OPEN_FLAGS_SHARED_MAC_ON_WIRE)
-                        intnetR0IfSnoopAddr(pIf, (uint8_t *)pvCurFrame, pHdr->cbFrame, false /*fGso*/, (uint16_t *)&Sg.fFlags);
-                    enmSwDecision = intnetR0NetworkSend(pNetwork, pIf,  0 /*fSrc*/, &Sg, pDstTab);
-                }
-                else if (u8Type == INTNETHDR_TYPE_GSO)
+                /*
+                 * Runs of frames for the same destination (typically a TCP
+                 * stream) are switched once and handed to each destination in
+                 * one go.  Not done when sharing the MAC with the host, as
+                 * the frames may have to be edited one by one then.
+                 */
+                uint32_t cFrames = 0;
+                if (!(pNetwork->fFlags & INTNET_OPEN_FLAGS_SHARED_MAC_ON_WIRE))
+                    cFrames = intnetR0IfGatherSendBurst(pIf, pHdr, apBurst);
+                if (cFrames > 1)
                 {
-                    /* Send GSO frame if sane. */
-                    PPDMNETWORKGSO  pGso       = IntNetHdrGetGsoContext(pHdr, pIf->pIntBuf);
-                    uint32_t        cbFrame    = pHdr->cbFrame - sizeof(*pGso);
-                    if (RT_LIKELY(PDMNetGsoIsValid(pGso, pHdr->cbFrame, cbFrame)))
+                    enmSwDecision = intnetR0NetworkSendBurst(pNetwork, pIf, apBurst, cFrames, pDstTab);
+                    if (enmSwDecision == INTNETSWDECISION_BAD_CONTEXT)
                     {
-                        void       *pvCurFrame = pGso + 1;
-                        IntNetSgInitTempGso(&Sg, pvCurFrame, cbFrame, pGso);
-                        if (pNetwork->fFlags & INTNET_OPEN_FLAGS_SHARED_MAC_ON_WIRE)
-                            intnetR0IfSnoopAddr(pIf, (uint8_t *)pvCurFrame, cbFrame, true /*fGso*/, (uint16_t *)&Sg.fFlags);
-                        enmSwDecision = intnetR0NetworkSend(pNetwork, pIf, 0 /*fSrc*/, &Sg, pDstTab);
-                    }
-                    else
-                    {
-                        STAM_REL_COUNTER_INC(&pIf->pIntBuf->cStatBadFrames); /* ignore */
-                        enmSwDecision = INTNETSWDECISION_DROP;
+                        rc = VERR_TRY_AGAIN;
+                        break;
                     }
+                    while (cFrames-- > 0)
+                        IntNetRingSkipFrame(&pIf->pIntBuf->Send);
+                    continue;
+                }
+
+                if (intnetR0IfInitSendSg(pIf, pHdr, &Sg))
+                {
+                    if (pNetwork->fFlags & INTNET_OPEN_FLAGS_SHARED_MAC_ON_WIRE)
+                        intnetR0IfSnoopAddr(pIf, (uint8_t *)Sg.aSegs[0].pv, Sg.cbTotal,
+                                            Sg.GsoCtx.u8Type != PDMNETWORKGSOTYPE_INVALID /*fGso*/, (uint16_t *)&Sg.fFlags);
+                    enmSwDecision = intnetR0NetworkSend(pNetwork, pIf, 0 /*fSrc*/, &Sg, pDstTab);
                 }
                 /* Unless it's a padding frame, we're getting babble from the producer. */
                 else
                 {
-                    if (u8Type != INTNETHDR_TYPE_PADDING)
+                    if (pHdr->u8Type != INTNETHDR_TYPE_PADDING)
                         STAM_REL_COUNTER_INC(&pIf->pIntBuf->cStatBadFrames); /* ignore */
                     enmSwDecision = INTNETSWDECISION_DROP;
                 }
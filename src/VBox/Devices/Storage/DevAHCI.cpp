@@ -449,8 +449,14 @@ typedef struct AHCIPort
     volatile bool                   fRedo;
     /** Flag whether the worker thread is sleeping. */
     volatile bool                   fWrkThreadSleeping;
+    /** Flag whether the worker thread or the EMT is processing new tasks at the moment. */
+    volatile bool                   fProcessing;
+    /** Flag whether new tasks are submitted directly on the EMT writing the CI register. */
+    bool                            fSubmitOnEmt;
+    /** Flag whether an interrupt was deferred until the current submission batch ends. */
+    volatile bool                   fIntrDeferred;
 
-    bool                            afAlignment[3];
+    bool                            afAlignment[1];
 
     /** Number of total sectors. */
     uint64_t                        cTotalSectors;
@@ -486,8 +492,10 @@ typedef struct AHCIPort
      * Accessed by the guest by reading the CMD register.
      * Holds the command slot of the command processed at the moment. */
     volatile uint32_t               u32CurrentCommandSlot;
+    /** Number of submission batches in progress, interrupts are deferred while this is not 0. */
+    volatile uint32_t               cSubmitBatches;
 
-#if HC_ARCH_BITS == 64
+#if HC_ARCH_BITS == 32
     uint32_t                        u32Alignment2;
 #endif
 
@@ -540,6 +548,10 @@ typedef struct AHCIPort
     STAMCOUNTER                     StatBytesRead;
     /** Release statistics: Number of I/O requests processed per second. */
     STAMCOUNTER                     StatIORequestsPerSecond;
+    /** Release statistics: Number of task batches submitted on the EMT. */
+    STAMCOUNTER                     StatSubmitOnEmt;
+    /** Release statistics: Number of interrupts deferred to the end of a submission batch. */
+    STAMCOUNTER                     StatIntrBatched;
 #ifdef VBOX_WITH_STATISTICS
     /** Statistics: Time to complete one request. */
     STAMPROFILE                     StatProfileProcessTime;
@@ -691,6 +703,8 @@ typedef struct AHCI
     bool volatile                   fSignalIdle;
     /** Flag whether the controller has BIOS access enabled. */
     bool                            fBootable;
+    /** Flag whether new tasks should be submitted on the EMT if the port allows it. */
+    bool                            fSubmitOnEmt;
 
     /** Number of usable ports on this controller. */
     uint32_t                        cPortsImpl;
@@ -937,6 +951,7 @@ static size_t ahciCopyToPrdtl(PPDMDEVINS pDevIns, PAHCIREQ pAhciReq,
 static size_t ahciCopyFromPrdtl(PPDMDEVINS pDevIns, PAHCIREQ pAhciReq,
                                 void *pvBuf, size_t cbBuf);
 static bool ahciCancelActiveTasks(PAHCIPort pAhciPort);
+static void ahciR3PortSubmitOnEmt(PAHCI pAhci, PAHCIPort pAhciPort);
 #endif
 RT_C_DECLS_END
 
@@ -991,6 +1006,24 @@ static void ahciHbaClearInterrupt(PAHCI pAhci)
     PDMDevHlpPCISetIrq(pAhci->CTX_SUFF(pDevIns), 0, 0);
 }
 
+/**
+ * Asserts the command completion coalescing interrupt and resets the coalescing state.
+ *
+ * The caller must own the HBA lock.
+ */
+static void ahciHbaCccSetInterrupt(PAHCI pAhci)
+{
+    TMTimerStop(pAhci->CTX_SUFF(pHbaCccTimer));
+    pAhci->uCccCurrentNr = 0;
+
+    ASMAtomicOrU32((volatile uint32_t *)&pAhci->u32PortsInterrupted, (1 << pAhci->uCccPortNr));
+    if (!(pAhci->u32PortsInterrupted & ~(1 << pAhci->uCccPortNr)))
+    {
+        Log(("%s: Fire CCC interrupt\n", __FUNCTION__));
+        PDMDevHlpPCISetIrq(pAhci->CTX_SUFF(pDevIns), 0, 1);
+    }
+}
+
 /**
  * Updates the IRQ level and sets port bit in the global interrupt status register of the HBA.
  */
@@ -1006,20 +1039,17 @@ static int ahciHbaSetInterrupt(PAHCI pAhci, uint8_t iPort, int rcBusy)
     {
         if ((pAhci->regHbaCccCtl & AHCI_HBA_CCC_CTL_EN) && (pAhci->regHbaCccPorts & (1 << iPort)))
         {
+            /*
+             * The interrupt is asserted when the configured number of commands completed
+             * (a count of 0 disables this) or when the timer armed by the first completion
+             * expires, whatever happens first.
+             */
             pAhci->uCccCurrentNr++;
-            if (pAhci->uCccCurrentNr >= pAhci->uCccNr)
-            {
-                /* Reset command completion coalescing state. */
+            if (   (pAhci->uCccNr && pAhci->uCccCurrentNr >= pAhci->uCccNr)
+                || !pAhci->uCccTimeout)
+                ahciHbaCccSetInterrupt(pAhci);
+            else if (pAhci->uCccCurrentNr == 1)
                 TMTimerSetMillies(pAhci->CTX_SUFF(pHbaCccTimer), pAhci->uCccTimeout);
-                pAhci->uCccCurrentNr = 0;
-
-                pAhci->u32PortsInterrupted |= (1 << pAhci->uCccPortNr);
-                if (!(pAhci->u32PortsInterrupted & ~(1 << pAhci->uCccPortNr)))
-                {
-                    Log(("P%u: %s: Fire interrupt\n", iPort, __FUNCTION__));
-                    PDMDevHlpPCISetIrq(pAhci->CTX_SUFF(pDevIns), 0, 1);
-                }
-            }
         }
         else
         {
@@ -1049,17 +1079,35 @@ DECLCALLBACK(void) ahciCccTimer(PPDMDEVINS pDevIns, PTMTIMER pTimer, void *pvUse
 {
     PAHCI pAhci = (PAHCI)pvUser;
 
-    int rc = ahciHbaSetInterrupt(pAhci, pAhci->uCccPortNr, VERR_IGNORED);
+    int rc = PDMCritSectEnter(&pAhci->lock, VERR_IGNORED);
     AssertRC(rc);
+
+    if (   (pAhci->regHbaCtrl & AHCI_HBA_CTRL_IE)
+        && (pAhci->regHbaCccCtl & AHCI_HBA_CCC_CTL_EN)
+        && pAhci->uCccCurrentNr)
+        ahciHbaCccSetInterrupt(pAhci);
+
+    PDMCritSectLeave(&pAhci->lock);
 }
 #endif
 
 static int PortCmdIssue_w(PAHCI ahci, PAHCIPort pAhciPort, uint32_t iReg, uint32_t u32Value)
 {
     uint32_t uCIValue;
+#ifdef IN_RING3
+    bool fSubmit = false;
+#endif
 
     ahciLog(("%s: write u32Value=%#010x\n", __FUNCTION__, u32Value));
 
+#ifndef IN_RING3
+    /* The new tasks are submitted by the EMT in R3 directly if enabled for this port. */
+    if (   pAhciPort->fSubmitOnEmt
+        && (pAhciPort->regCMD & AHCI_PORT_CMD_CR)
+        && u32Value > 0)
+        return VINF_IOM_R3_MMIO_WRITE;
+#endif
+
     /* Update the CI register first. */
     uCIValue = ASMAtomicXchgU32(&pAhciPort->u32TasksFinished, 0);
     pAhciPort->regCI &= ~uCIValue;
@@ -1075,8 +1123,15 @@ static int PortCmdIssue_w(PAHCI ahci, PAHCIPort pAhciPort, uint32_t iReg, uint32
 
         ASMAtomicOrU32(&pAhciPort->u32TasksNew, u32Value);
 
+        if (pAhciPort->fSubmitOnEmt)
+        {
+            /* Only reached in R3, the other contexts hand the write over to it above. */
+#ifdef IN_RING3
+            fSubmit = true;
+#endif
+        }
         /* Send a notification to R3 if u32TasksNew was before our write. */
-        if (ASMAtomicReadBool(&pAhciPort->fWrkThreadSleeping))
+        else if (ASMAtomicReadBool(&pAhciPort->fWrkThreadSleeping))
         {
 #ifdef IN_RC
             PDEVPORTNOTIFIERQUEUEITEM pItem = (PDEVPORTNOTIFIERQUEUEITEM)PDMQueueAlloc(ahci->CTX_SUFF(pNotifierQueue));
@@ -1094,6 +1149,11 @@ static int PortCmdIssue_w(PAHCI ahci, PAHCIPort pAhciPort, uint32_t iReg, uint32
 
     pAhciPort->regCI |= u32Value;
 
+#ifdef IN_RING3
+    if (fSubmit)
+        ahciR3PortSubmitOnEmt(ahci, pAhciPort);
+#endif
+
     return VINF_SUCCESS;
 }
 
@@ -1833,21 +1893,20 @@ static int HbaCccCtl_w(PAHCI ahci, uint32_t iReg, uint32_t u32Value)
          __FUNCTION__, AHCI_HBA_CCC_CTL_TV_GET(u32Value), AHCI_HBA_CCC_CTL_CC_GET(u32Value),
          AHCI_HBA_CCC_CTL_INT_GET(u32Value), (u32Value & AHCI_HBA_CCC_CTL_EN)));
 
-    ahci->regHbaCccCtl = u32Value;
-    ahci->uCccTimeout  = AHCI_HBA_CCC_CTL_TV_GET(u32Value);
-    ahci->uCccPortNr   = AHCI_HBA_CCC_CTL_INT_GET(u32Value);
-    ahci->uCccNr       = AHCI_HBA_CCC_CTL_CC_GET(u32Value);
+    int rc = PDMCritSectEnter(&ahci->lock, VINF_IOM_R3_MMIO_WRITE);
+    if (rc != VINF_SUCCESS)
+        return rc;
+
+    ahci->regHbaCccCtl  = u32Value;
+    ahci->uCccTimeout   = AHCI_HBA_CCC_CTL_TV_GET(u32Value);
+    ahci->uCccPortNr    = AHCI_HBA_CCC_CTL_INT_GET(u32Value);
+    ahci->uCccNr        = AHCI_HBA_CCC_CTL_CC_GET(u32Value);
 
-    if (u32Value & AHCI_HBA_CCC_CTL_EN)
-    {
-        /* Arm the timer */
-        TMTimerSetMillies(ahci->CTX_SUFF(pHbaCccTimer), ahci->uCccTimeout);
-    }
-    else
-    {
-        TMTimerStop(ahci->CTX_SUFF(pHbaCccTimer));
-    }
+    /* The timer is armed when the first command completes. */
+    ahci->uCccCurrentNr = 0;
+    TMTimerStop(ahci->CTX_SUFF(pHbaCccTimer));
 
+    PDMCritSectLeave(&ahci->lock);
     return VINF_SUCCESS;
 }
 
@@ -2112,6 +2171,7 @@ static void ahciHBAReset(PAHCI pThis)
     pThis->uCccTimeout    = 0;
     pThis->uCccPortNr     = 0;
     pThis->uCccNr         = 0;
+    pThis->uCccCurrentNr  = 0;
 
     /* Clear pending interrupts. */
     pThis->regHbaIs            = 0;
@@ -5105,6 +5165,63 @@ static void ahciDeviceReset(PAHCIPort pAhciPort, PAHCIREQ pAhciReq)
     ahciFinishStorageDeviceReset(pAhciPort, pAhciReq);
 }
 
+/**
+ * Asserts the interrupt for a port after a FIS was posted.
+ *
+ * While tasks are submitted in a batch the interrupt is deferred until the
+ * batch ends, so requests completing during submission (cache hits for
+ * example) cause only one interrupt.  Ports taking part in command completion
+ * coalescing are handled by the CCC logic which needs every completion.
+ *
+ * @returns nothing.
+ * @param   pAhciPort          The port of the SATA controller.
+ */
+static void ahciR3PortSetInterrupt(PAHCIPort pAhciPort)
+{
+    PAHCI pAhci = pAhciPort->CTX_SUFF(pAhci);
+
+    if (   !(pAhci->regHbaCccCtl & AHCI_HBA_CCC_CTL_EN)
+        || !(pAhci->regHbaCccPorts & RT_BIT_32(pAhciPort->iLUN)))
+    {
+        /* Pairs with ahciR3PortSubmitBatchEnd(), only one of us asserts the interrupt. */
+        ASMAtomicWriteBool(&pAhciPort->fIntrDeferred, true);
+        if (   ASMAtomicReadU32(&pAhciPort->cSubmitBatches)
+            || !ASMAtomicXchgBool(&pAhciPort->fIntrDeferred, false))
+            return;
+    }
+
+    int rc = ahciHbaSetInterrupt(pAhci, pAhciPort->iLUN, VERR_IGNORED);
+    AssertRC(rc);
+}
+
+/**
+ * Starts a submission batch, deferring interrupts of the port.
+ *
+ * @returns nothing.
+ * @param   pAhciPort          The port of the SATA controller.
+ */
+DECLINLINE(void) ahciR3PortSubmitBatchBegin(PAHCIPort pAhciPort)
+{
+    ASMAtomicIncU32(&pAhciPort->cSubmitBatches);
+}
+
+/**
+ * Ends a submission batch, asserting the interrupt if any was deferred.
+ *
+ * @returns nothing.
+ * @param   pAhciPort          The port of the SATA controller.
+ */
+static void ahciR3PortSubmitBatchEnd(PAHCIPort pAhciPort)
+{
+    if (   !ASMAtomicDecU32(&pAhciPort->cSubmitBatches)
+        && ASMAtomicXchgBool(&pAhciPort->fIntrDeferred, false))
+    {
+        STAM_REL_COUNTER_INC(&pAhciPort->StatIntrBatched);
+        int rc = ahciHbaSetInterrupt(pAhciPort->CTX_SUFF(pAhci), pAhciPort->iLUN, VERR_IGNORED);
+        AssertRC(rc);
+    }
+}
+
 /**
  * Create a PIO setup FIS and post it into the memory area of the guest.
  *
@@ -5119,7 +5236,6 @@ static void ahciSendPioSetupFis(PAHCIPort pAhciPort, PAHCIREQ pAhciReq, uint8_t
 {
     uint8_t abPioSetupFis[20];
     bool fAssertIntr = false;
-    PAHCI pAhci = pAhciPort->CTX_SUFF(pAhci);
 
     ahciLog(("%s: building PIO setup Fis\n", __FUNCTION__));
 
@@ -5164,10 +5280,7 @@ static void ahciSendPioSetupFis(PAHCIPort pAhciPort, PAHCIREQ pAhciReq, uint8_t
         }
 
         if (fAssertIntr)
-        {
-            int rc = ahciHbaSetInterrupt(pAhci, pAhciPort->iLUN, VERR_IGNORED);
-            AssertRC(rc);
-        }
+            ahciR3PortSetInterrupt(pAhciPort);
     }
 }
 
@@ -5184,7 +5297,6 @@ static void ahciSendD2HFis(PAHCIPort pAhciPort, PAHCIREQ pAhciReq, uint8_t *pCmd
 {
     uint8_t d2hFis[20];
     bool fAssertIntr = false;
-    PAHCI pAhci = pAhciPort->CTX_SUFF(pAhci);
 
     ahciLog(("%s: building D2H Fis\n", __FUNCTION__));
 
@@ -5233,10 +5345,7 @@ static void ahciSendD2HFis(PAHCIPort pAhciPort, PAHCIREQ pAhciReq, uint8_t *pCmd
         }
 
         if (fAssertIntr)
-        {
-            int rc = ahciHbaSetInterrupt(pAhci, pAhciPort->iLUN, VERR_IGNORED);
-            AssertRC(rc);
-        }
+            ahciR3PortSetInterrupt(pAhciPort);
     }
 }
 
@@ -5252,7 +5361,6 @@ static void ahciSendSDBFis(PAHCIPort pAhciPort, uint32_t uFinishedTasks, bool fI
 {
     uint32_t sdbFis[2];
     bool fAssertIntr = false;
-    PAHCI pAhci = pAhciPort->CTX_SUFF(pAhci);
     PAHCIREQ pTaskErr = ASMAtomicReadPtrT(&pAhciPort->pTaskErr, PAHCIREQ);
 
     ahciLog(("%s: Building SDB FIS\n", __FUNCTION__));
@@ -5300,10 +5408,7 @@ static void ahciSendSDBFis(PAHCIPort pAhciPort, uint32_t uFinishedTasks, bool fI
         ASMAtomicOrU32(&pAhciPort->u32QueuedTasksFinished, uFinishedTasks);
 
         if (fAssertIntr)
-        {
-            int rc = ahciHbaSetInterrupt(pAhci, pAhciPort->iLUN, VERR_IGNORED);
-            AssertRC(rc);
-        }
+            ahciR3PortSetInterrupt(pAhciPort);
     }
 }
 
@@ -6485,6 +6590,270 @@ static DECLCALLBACK(bool) ahciNotifyQueueConsumer(PPDMDEVINS pDevIns, PPDMQUEUEI
     return true;
 }
 
+/**
+ * Processes a set of new tasks of a port.
+ *
+ * Called by the worker thread or by the EMT which wrote the CI register,
+ * the caller must own the port (AHCIPort::fProcessing).
+ *
+ * @returns nothing.
+ * @param   pAhciPort   The port the tasks belong to.
+ * @param   u32Tasks    Bitmask of command slots to process.
+ */
+static void ahciR3PortTasksProcess(PAHCIPort pAhciPort, uint32_t u32Tasks)
+{
+    int rc = VINF_SUCCESS;
+    unsigned idx = 0;
+
+    /*
+     * Interrupts of requests completing during submission are raised once at the end,
+     * only done for the async interface because synchronous requests take a while.
+     */
+    bool fBatch = pAhciPort->fAsyncInterface;
+    if (fBatch)
+        ahciR3PortSubmitBatchBegin(pAhciPort);
+
+    idx = ASMBitFirstSetU32(u32Tasks);
+    while (idx)
+    {
+        bool fReqCanceled = false;
+        AHCITXDIR enmTxDir;
+        PAHCIREQ pAhciReq;
+
+        /* Decrement to get the slot number. */
+        idx--;
+        ahciLog(("%s: Processing command at slot %d\n", __FUNCTION__, idx));
+
+        /*
+         * Check if there is already an allocated task struct in the cache.
+         * Allocate a new task otherwise.
+         */
+        if (!pAhciPort->aCachedTasks[idx])
+        {
+            pAhciReq = (PAHCIREQ)RTMemAllocZ(sizeof(AHCIREQ));
+            AssertMsg(pAhciReq, ("%s: Cannot allocate task state memory!\n"));
+            pAhciReq->enmTxState = AHCITXSTATE_FREE;
+            pAhciPort->aCachedTasks[idx] = pAhciReq;
+        }
+        else
+            pAhciReq = pAhciPort->aCachedTasks[idx];
+
+        bool fXchg;
+        ASMAtomicCmpXchgSize(&pAhciReq->enmTxState, AHCITXSTATE_ACTIVE, AHCITXSTATE_FREE, fXchg);
+        AssertMsg(fXchg, ("Task is already active\n"));
+
+        pAhciReq->tsStart = RTTimeMilliTS();
+        pAhciReq->uATARegStatus = 0;
+        pAhciReq->uATARegError  = 0;
+        pAhciReq->fFlags        = 0;
+
+        /* Set current command slot */
+        pAhciReq->uTag = idx;
+        ASMAtomicWriteU32(&pAhciPort->u32CurrentCommandSlot, pAhciReq->uTag);
+
+        bool fFisRead = ahciPortTaskGetCommandFis(pAhciPort, pAhciReq);
+        if (RT_UNLIKELY(!fFisRead))
+        {
+            /*
+             * Couldn't find anything in either the AHCI or SATA spec which
+             * indicates what should be done if the FIS is not read successfully.
+             * The closest thing is in the state machine, stating that the device
+             * should go into idle state again (SATA spec 1.0 chapter 8.7.1).
+             * Do the same here and ignore any corrupt FIS types, after all
+             * the guest messed up everything and this behavior is undefined.
+             */
+            ASMAtomicCmpXchgSize(&pAhciReq->enmTxState, AHCITXSTATE_FREE, AHCITXSTATE_ACTIVE, fXchg);
+            Assert(fXchg);
+            u32Tasks &= ~RT_BIT_32(idx); /* Clear task bit. */
+            idx = ASMBitFirstSetU32(u32Tasks);
+            continue;
+        }
+
+        /* Mark the task as processed by the HBA if this is a queued task so that it doesn't occur in the CI register anymore. */
+        if (pAhciPort->regSACT & (1 << idx))
+        {
+            pAhciReq->fFlags |= AHCI_REQ_CLEAR_SACT;
+            ASMAtomicOrU32(&pAhciPort->u32TasksFinished, (1 << pAhciReq->uTag));
+        }
+
+        if (!(pAhciReq->cmdFis[AHCI_CMDFIS_BITS] & AHCI_CMDFIS_C))
+        {
+            /* If the reset bit is set put the device into reset state. */
+            if (pAhciReq->cmdFis[AHCI_CMDFIS_CTL] & AHCI_CMDFIS_CTL_SRST)
+            {
+                ahciLog(("%s: Setting device into reset state\n", __FUNCTION__));
+                pAhciPort->fResetDevice = true;
+                ahciSendD2HFis(pAhciPort, pAhciReq, pAhciReq->cmdFis, true);
+            }
+            else if (pAhciPort->fResetDevice) /* The bit is not set and we are in a reset state. */
+                ahciFinishStorageDeviceReset(pAhciPort, pAhciReq);
+            else /* We are not in a reset state update the control registers. */
+                AssertMsgFailed(("%s: Update the control register\n", __FUNCTION__));
+
+            ASMAtomicCmpXchgSize(&pAhciReq->enmTxState, AHCITXSTATE_FREE, AHCITXSTATE_ACTIVE, fXchg);
+            AssertMsg(fXchg, ("Task is not active\n"));
+            break;
+        }
+        else
+        {
+            AssertReleaseMsg(ASMAtomicReadU32(&pAhciPort->cTasksActive) < AHCI_NR_COMMAND_SLOTS,
+                             ("There are more than 32 requests active"));
+            ASMAtomicIncU32(&pAhciPort->cTasksActive);
+
+            enmTxDir = ahciProcessCmd(pAhciPort, pAhciReq, pAhciReq->cmdFis);
+            pAhciReq->enmTxDir = enmTxDir;
+
+            if (enmTxDir != AHCITXDIR_NONE)
+            {
+                if (   enmTxDir != AHCITXDIR_FLUSH
+                    && enmTxDir != AHCITXDIR_TRIM)
+                {
+                    STAM_REL_COUNTER_INC(&pAhciPort->StatDMA);
+
+                    rc = ahciIoBufAllocate(pAhciPort->pDevInsR3, pAhciReq, pAhciReq->cbTransfer);
+                    if (RT_FAILURE(rc))
+                        AssertMsgFailed(("%s: Failed to process command %Rrc\n", __FUNCTION__, rc));
+                }
+
+                if (!(pAhciReq->fFlags & AHCI_REQ_OVERFLOW))
+                {
+                    if (pAhciPort->fAsyncInterface)
+                    {
+                        VBOXDD_AHCI_REQ_SUBMIT(pAhciReq, enmTxDir, pAhciReq->uOffset, pAhciReq->cbTransfer);
+                        VBOXDD_AHCI_REQ_SUBMIT_TIMESTAMP(pAhciReq, pAhciReq->tsStart);
+                        if (enmTxDir == AHCITXDIR_FLUSH)
+                        {
+                            rc = pAhciPort->pDrvBlockAsync->pfnStartFlush(pAhciPort->pDrvBlockAsync,
+                                                                          pAhciReq);
+                        }
+                        else if (enmTxDir == AHCITXDIR_TRIM)
+                        {
+                            rc = ahciTrimRangesCreate(pAhciPort, pAhciReq);
+                            if (RT_SUCCESS(rc))
+                            {
+                                pAhciPort->Led.Asserted.s.fWriting = pAhciPort->Led.Actual.s.fWriting = 1;
+                                rc = pAhciPort->pDrvBlockAsync->pfnStartDiscard(pAhciPort->pDrvBlockAsync, pAhciReq->u.Trim.paRanges,
+                                                                                pAhciReq->u.Trim.cRanges, pAhciReq);
+                            }
+                        }
+                        else if (enmTxDir == AHCITXDIR_READ)
+                        {
+                            pAhciPort->Led.Asserted.s.fReading = pAhciPort->Led.Actual.s.fReading = 1;
+                            rc = pAhciPort->pDrvBlockAsync->pfnStartRead(pAhciPort->pDrvBlockAsync, pAhciReq->uOffset,
+                                                                         &pAhciReq->u.Io.DataSeg, 1,
+                                                                         pAhciReq->cbTransfer,
+                                                                         pAhciReq);
+                        }
+                        else
+                        {
+                            pAhciPort->Led.Asserted.s.fWriting = pAhciPort->Led.Actual.s.fWriting = 1;
+                            rc = pAhciPort->pDrvBlockAsync->pfnStartWrite(pAhciPort->pDrvBlockAsync, pAhciReq->uOffset,
+                                                                          &pAhciReq->u.Io.DataSeg, 1,
+                                                                          pAhciReq->cbTransfer,
+                                                                          pAhciReq);
+                        }
+                        if (rc == VINF_VD_ASYNC_IO_FINISHED)
+                            fReqCanceled = ahciTransferComplete(pAhciPort, pAhciReq, VINF_SUCCESS, true);
+                        else if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                            fReqCanceled = ahciTransferComplete(pAhciPort, pAhciReq, rc, true);
+                    }
+                    else
+                    {
+                        if (enmTxDir == AHCITXDIR_FLUSH)
+                            rc = pAhciPort->pDrvBlock->pfnFlush(pAhciPort->pDrvBlock);
+                        else if (enmTxDir == AHCITXDIR_TRIM)
+                        {
+                            rc = ahciTrimRangesCreate(pAhciPort, pAhciReq);
+                            if (RT_SUCCESS(rc))
+                            {
+                                pAhciPort->Led.Asserted.s.fWriting = pAhciPort->Led.Actual.s.fWriting = 1;
+                                rc = pAhciPort->pDrvBlock->pfnDiscard(pAhciPort->pDrvBlock, pAhciReq->u.Trim.paRanges,
+                                                                      pAhciReq->u.Trim.cRanges);
+                                pAhciPort->Led.Asserted.s.fWriting = pAhciPort->Led.Actual.s.fWriting = 0;
+                            }
+                        }
+                        else if (enmTxDir == AHCITXDIR_READ)
+                        {
+                            pAhciPort->Led.Asserted.s.fReading = pAhciPort->Led.Actual.s.fReading = 1;
+                            rc = pAhciPort->pDrvBlock->pfnRead(pAhciPort->pDrvBlock, pAhciReq->uOffset,
+                                                               pAhciReq->u.Io.DataSeg.pvSeg,
+                                                               pAhciReq->cbTransfer);
+                            pAhciPort->Led.Asserted.s.fReading = pAhciPort->Led.Actual.s.fReading = 0;
+                        }
+                        else
+                        {
+                            pAhciPort->Led.Asserted.s.fWriting = pAhciPort->Led.Actual.s.fWriting = 1;
+                            rc = pAhciPort->pDrvBlock->pfnWrite(pAhciPort->pDrvBlock, pAhciReq->uOffset,
+                                                                pAhciReq->u.Io.DataSeg.pvSeg,
+                                                                pAhciReq->cbTransfer);
+                            pAhciPort->Led.Asserted.s.fWriting = pAhciPort->Led.Actual.s.fWriting = 0;
+                        }
+                        fReqCanceled = ahciTransferComplete(pAhciPort, pAhciReq, rc, true);
+                    }
+                }
+            }
+            else
+                fReqCanceled = ahciTransferComplete(pAhciPort, pAhciReq, VINF_SUCCESS, true);
+        } /* Command */
+
+        /*
+         * Don't process other requests if the last one was canceled,
+         * the others are not valid anymore.
+         */
+        if (fReqCanceled)
+            break;
+
+        u32Tasks &= ~RT_BIT_32(idx); /* Clear task bit. */
+        idx = ASMBitFirstSetU32(u32Tasks);
+    } /* while tasks available */
+
+    if (fBatch)
+        ahciR3PortSubmitBatchEnd(pAhciPort);
+}
+
+/**
+ * Submits the new tasks of a port on the EMT which wrote the CI register.
+ *
+ * This saves the wakeup of and the switch to the worker thread.  If the worker
+ * thread is busy with the port the tasks are left to it.
+ *
+ * @returns nothing.
+ * @param   pAhci       The AHCI controller.
+ * @param   pAhciPort   The port the tasks belong to.
+ */
+static void ahciR3PortSubmitOnEmt(PAHCI pAhci, PAHCIPort pAhciPort)
+{
+    if (ASMAtomicCmpXchgBool(&pAhciPort->fProcessing, true, false))
+    {
+        ASMAtomicIncU32(&pAhci->cThreadsActive);
+
+        uint32_t u32Tasks = ASMAtomicXchgU32(&pAhciPort->u32TasksNew, 0);
+        if (   u32Tasks
+            && !(ASMAtomicReadU32(&pAhci->regHbaCtrl) & AHCI_HBA_CTRL_HR))
+        {
+            STAM_REL_COUNTER_INC(&pAhciPort->StatSubmitOnEmt);
+            ahciR3PortTasksProcess(pAhciPort, u32Tasks);
+        }
+
+        ASMAtomicWriteBool(&pAhciPort->fProcessing, false);
+
+        /* Do a pending host controller reset if this is the last active thread. */
+        uint32_t u32RegHbaCtrl = ASMAtomicReadU32(&pAhci->regHbaCtrl);
+        uint32_t cThreadsActive = ASMAtomicDecU32(&pAhci->cThreadsActive);
+        if (   (u32RegHbaCtrl & AHCI_HBA_CTRL_HR)
+            && !cThreadsActive)
+            ahciHBAReset(pAhci);
+    }
+
+    /* Hand tasks we couldn't process or which arrived in the meantime over to the worker thread. */
+    if (   ASMAtomicReadU32(&pAhciPort->u32TasksNew)
+        && ASMAtomicReadBool(&pAhciPort->fWrkThreadSleeping))
+    {
+        int rc = SUPSemEventSignal(pAhci->pSupDrvSession, pAhciPort->hEvtProcess);
+        AssertRC(rc);
+    }
+}
+
 /* The async IO thread for one port. */
 static DECLCALLBACK(int) ahciAsyncIOLoop(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
 {
@@ -6504,13 +6873,12 @@ static DECLCALLBACK(int) ahciAsyncIOLoop(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
 
     while (pThread->enmState == PDMTHREADSTATE_RUNNING)
     {
-        unsigned idx = 0;
         uint32_t u32Tasks = 0;
         uint32_t u32RegHbaCtrl = 0;
 
         ASMAtomicWriteBool(&pAhciPort->fWrkThreadSleeping, true);
-        u32Tasks = ASMAtomicXchgU32(&pAhciPort->u32TasksNew, 0);
-        if (!u32Tasks)
+        if (   !ASMAtomicReadU32(&pAhciPort->u32TasksNew)
+            || ASMAtomicReadBool(&pAhciPort->fProcessing))
         {
             Assert(ASMAtomicReadBool(&pAhciPort->fWrkThreadSleeping));
             rc = SUPSemEventWaitNoResume(pAhci->pSupDrvSession, pAhciPort->hEvtProcess, RT_INDEFINITE_WAIT);
@@ -6518,10 +6886,17 @@ static DECLCALLBACK(int) ahciAsyncIOLoop(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
             if (RT_UNLIKELY(pThread->enmState != PDMTHREADSTATE_RUNNING))
                 break;
             LogFlowFunc(("Woken up with rc=%Rrc\n", rc));
-            u32Tasks = ASMAtomicXchgU32(&pAhciPort->u32TasksNew, 0);
         }
 
         ASMAtomicWriteBool(&pAhciPort->fWrkThreadSleeping, false);
+
+        /*
+         * The EMT might be submitting tasks for this port at the moment,
+         * it hands the remaining ones over to us when it is done.
+         */
+        if (!ASMAtomicCmpXchgBool(&pAhciPort->fProcessing, true, false))
+            continue;
+        u32Tasks = ASMAtomicXchgU32(&pAhciPort->u32TasksNew, 0);
         ASMAtomicIncU32(&pAhci->cThreadsActive);
 
         /*
@@ -6532,203 +6907,14 @@ static DECLCALLBACK(int) ahciAsyncIOLoop(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
         if (   u32RegHbaCtrl & AHCI_HBA_CTRL_HR
             && !ASMAtomicDecU32(&pAhci->cThreadsActive))
         {
+            ASMAtomicWriteBool(&pAhciPort->fProcessing, false);
             ahciHBAReset(pAhci);
             continue;
         }
 
-        idx = ASMBitFirstSetU32(u32Tasks);
-        while (idx)
-        {
-            bool fReqCanceled = false;
-            AHCITXDIR enmTxDir;
-            PAHCIREQ pAhciReq;
-
-            /* Decrement to get the slot number. */
-            idx--;
-            ahciLog(("%s: Processing command at slot %d\n", __FUNCTION__, idx));
+        ahciR3PortTasksProcess(pAhciPort, u32Tasks);
 
-            /*
-             * Check if there is already an allocated task struct in the cache.
-             * Allocate a new task otherwise.
-             */
-            if (!pAhciPort->aCachedTasks[idx])
-            {
-                pAhciReq = (PAHCIREQ)RTMemAllocZ(sizeof(AHCIREQ));
-                AssertMsg(pAhciReq, ("%s: Cannot allocate task state memory!\n"));
-                pAhciReq->enmTxState = AHCITXSTATE_FREE;
-                pAhciPort->aCachedTasks[idx] = pAhciReq;
-            }
-            else
-                pAhciReq = pAhciPort->aCachedTasks[idx];
-
-            bool fXchg;
-            ASMAtomicCmpXchgSize(&pAhciReq->enmTxState, AHCITXSTATE_ACTIVE, AHCITXSTATE_FREE, fXchg);
-            AssertMsg(fXchg, ("Task is already active\n"));
-
-            pAhciReq->tsStart = RTTimeMilliTS();
-            pAhciReq->uATARegStatus = 0;
-            pAhciReq->uATARegError  = 0;
-            pAhciReq->fFlags        = 0;
-
-            /* Set current command slot */
-            pAhciReq->uTag = idx;
-            ASMAtomicWriteU32(&pAhciPort->u32CurrentCommandSlot, pAhciReq->uTag);
-
-            bool fFisRead = ahciPortTaskGetCommandFis(pAhciPort, pAhciReq);
-            if (RT_UNLIKELY(!fFisRead))
-            {
-                /*
-                 * Couldn't find anything in either the AHCI or SATA spec which
-                 * indicates what should be done if the FIS is not read successfully.
-                 * The closest thing is in the state machine, stating that the device
-                 * should go into idle state again (SATA spec 1.0 chapter 8.7.1).
-                 * Do the same here and ignore any corrupt FIS types, after all
-                 * the guest messed up everything and this behavior is undefined.
-                 */
-                ASMAtomicCmpXchgSize(&pAhciReq->enmTxState, AHCITXSTATE_FREE, AHCITXSTATE_ACTIVE, fXchg);
-                Assert(fXchg);
-                u32Tasks &= ~RT_BIT_32(idx); /* Clear task bit. */
-                idx = ASMBitFirstSetU32(u32Tasks);
-                continue;
-            }
-
-            /* Mark the task as processed by the HBA if this is a queued task so that it doesn't occur in the CI register anymore. */
-            if (pAhciPort->regSACT & (1 << idx))
-            {
-                pAhciReq->fFlags |= AHCI_REQ_CLEAR_SACT;
-                ASMAtomicOrU32(&pAhciPort->u32TasksFinished, (1 << pAhciReq->uTag));
-            }
-
-            if (!(pAhciReq->cmdFis[AHCI_CMDFIS_BITS] & AHCI_CMDFIS_C))
-            {
-                /* If the reset bit is set put the device into reset state. */
-                if (pAhciReq->cmdFis[AHCI_CMDFIS_CTL] & AHCI_CMDFIS_CTL_SRST)
-                {
-                    ahciLog(("%s: Setting device into reset state\n", __FUNCTION__));
-                    pAhciPort->fResetDevice = true;
-                    ahciSendD2HFis(pAhciPort, pAhciReq, pAhciReq->cmdFis, true);
-                }
-                else if (pAhciPort->fResetDevice) /* The bit is not set and we are in a reset state. */
-                    ahciFinishStorageDeviceReset(pAhciPort, pAhciReq);
-                else /* We are not in a reset state update the control registers. */
-                    AssertMsgFailed(("%s: Update the control register\n", __FUNCTION__));
-
-                ASMAtomicCmpXchgSize(&pAhciReq->enmTxState, AHCITXSTATE_FREE, AHCITXSTATE_ACTIVE, fXchg);
-                AssertMsg(fXchg, ("Task is not active\n"));
-                break;
-            }
-            else
-            {
-                AssertReleaseMsg(ASMAtomicReadU32(&pAhciPort->cTasksActive) < AHCI_NR_COMMAND_SLOTS,
-                                 ("There are more than 32 requests active"));
-                ASMAtomicIncU32(&pAhciPort->cTasksActive);
-
-                enmTxDir = ahciProcessCmd(pAhciPort, pAhciReq, pAhciReq->cmdFis);
-                pAhciReq->enmTxDir = enmTxDir;
-
-                if (enmTxDir != AHCITXDIR_NONE)
-                {
-                    if (   enmTxDir != AHCITXDIR_FLUSH
-                        && enmTxDir != AHCITXDIR_TRIM)
-                    {
-                        STAM_REL_COUNTER_INC(&pAhciPort->StatDMA);
-
-                        rc = ahciIoBufAllocate(pAhciPort->pDevInsR3, pAhciReq, pAhciReq->cbTransfer);
-                        if (RT_FAILURE(rc))
-                            AssertMsgFailed(("%s: Failed to process command %Rrc\n", __FUNCTION__, rc));
-                    }
-
-                    if (!(pAhciReq->fFlags & AHCI_REQ_OVERFLOW))
-                    {
-                        if (pAhciPort->fAsyncInterface)
-                        {
-                            VBOXDD_AHCI_REQ_SUBMIT(pAhciReq, enmTxDir, pAhciReq->uOffset, pAhciReq->cbTransfer);
-                            VBOXDD_AHCI_REQ_SUBMIT_TIMESTAMP(pAhciReq, pAhciReq->tsStart);
-                            if (enmTxDir == AHCITXDIR_FLUSH)
-                            {
-                                rc = pAhciPort->pDrvBlockAsync->pfnStartFlush(pAhciPort->pDrvBlockAsync,
-                                                                              pAhciReq);
-                            }
-                            else if (enmTxDir == AHCITXDIR_TRIM)
-                            {
-                                rc = ahciTrimRangesCreate(pAhciPort, pAhciReq);
-                                if (RT_SUCCESS(rc))
-                                {
-                                    pAhciPort->Led.Asserted.s.fWriting = pAhciPort->Led.Actual.s.fWriting = 1;
-                                    rc = pAhciPort->pDrvBlockAsync->pfnStartDiscard(pAhciPort->pDrvBlockAsync, pAhciReq->u.Trim.paRanges,
-                                                                                    pAhciReq->u.Trim.cRanges, pAhciReq);
-                                }
-                            }
-                            else if (enmTxDir == AHCITXDIR_READ)
-                            {
-                                pAhciPort->Led.Asserted.s.fReading = pAhciPort->Led.Actual.s.fReading = 1;
-                                rc = pAhciPort->pDrvBlockAsync->pfnStartRead(pAhciPort->pDrvBlockAsync, pAhciReq->uOffset,
-                                                                             &pAhciReq->u.Io.DataSeg, 1,
-                                                                             pAhciReq->cbTransfer,
-                                                                             pAhciReq);
-                            }
-                            else
-                            {
-                                pAhciPort->Led.Asserted.s.fWriting = pAhciPort->Led.Actual.s.fWriting = 1;
-                                rc = pAhciPort->pDrvBlockAsync->pfnStartWrite(pAhciPort->pDrvBlockAsync, pAhciReq->uOffset,
-                                                                              &pAhciReq->u.Io.DataSeg, 1,
-                                                                              pAhciReq->cbTransfer,
-                                                                              pAhciReq);
-                            }
-                            if (rc == VINF_VD_ASYNC_IO_FINISHED)
-                                fReqCanceled = ahciTransferComplete(pAhciPort, pAhciReq, VINF_SUCCESS, true);
-                            else if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
-                                fReqCanceled = ahciTransferComplete(pAhciPort, pAhciReq, rc, true);
-                        }
-                        else
-                        {
-                            if (enmTxDir == AHCITXDIR_FLUSH)
-                                rc = pAhciPort->pDrvBlock->pfnFlush(pAhciPort->pDrvBlock);
-                            else if (enmTxDir == AHCITXDIR_TRIM)
-                            {
-                                rc = ahciTrimRangesCreate(pAhciPort, pAhciReq);
-                                if (RT_SUCCESS(rc))
-                                {
-                                    pAhciPort->Led.Asserted.s.fWriting = pAhciPort->Led.Actual.s.fWriting = 1;
-                                    rc = pAhciPort->pDrvBlock->pfnDiscard(pAhciPort->pDrvBlock, pAhciReq->u.Trim.paRanges,
-                                                                          pAhciReq->u.Trim.cRanges);
-                                    pAhciPort->Led.Asserted.s.fWriting = pAhciPort->Led.Actual.s.fWriting = 0;
-                                }
-                            }
-                            else if (enmTxDir == AHCITXDIR_READ)
-                            {
-                                pAhciPort->Led.Asserted.s.fReading = pAhciPort->Led.Actual.s.fReading = 1;
-                                rc = pAhciPort->pDrvBlock->pfnRead(pAhciPort->pDrvBlock, pAhciReq->uOffset,
-                                                                   pAhciReq->u.Io.DataSeg.pvSeg,
-                                                                   pAhciReq->cbTransfer);
-                                pAhciPort->Led.Asserted.s.fReading = pAhciPort->Led.Actual.s.fReading = 0;
-                            }
-                            else
-                            {
-                                pAhciPort->Led.Asserted.s.fWriting = pAhciPort->Led.Actual.s.fWriting = 1;
-                                rc = pAhciPort->pDrvBlock->pfnWrite(pAhciPort->pDrvBlock, pAhciReq->uOffset,
-                                                                    pAhciReq->u.Io.DataSeg.pvSeg,
-                                                                    pAhciReq->cbTransfer);
-                                pAhciPort->Led.Asserted.s.fWriting = pAhciPort->Led.Actual.s.fWriting = 0;
-                            }
-                            fReqCanceled = ahciTransferComplete(pAhciPort, pAhciReq, rc, true);
-                        }
-                    }
-                }
-                else
-                    fReqCanceled = ahciTransferComplete(pAhciPort, pAhciReq, VINF_SUCCESS, true);
-            } /* Command */
-
-            /*
-             * Don't process other requests if the last one was canceled,
-             * the others are not valid anymore.
-             */
-            if (fReqCanceled)
-                break;
-
-            u32Tasks &= ~RT_BIT_32(idx); /* Clear task bit. */
-            idx = ASMBitFirstSetU32(u32Tasks);
-        } /* while tasks available */
+        ASMAtomicWriteBool(&pAhciPort->fProcessing, false);
 
         /*
          * Check whether a host controller reset is pending and execute the reset
@@ -7745,6 +7931,7 @@ static DECLCALLBACK(void) ahciR3Detach(PPDMDEVINS pDevIns, unsigned iLUN, uint32
     pAhciPort->pDrvBlock = NULL;
     pAhciPort->pDrvBlockAsync = NULL;
     pAhciPort->pDrvBlockBios = NULL;
+    pAhciPort->fSubmitOnEmt = false;
 }
 
 /**
@@ -7811,6 +7998,7 @@ static DECLCALLBACK(int)  ahciR3Attach(PPDMDEVINS pDevIns, unsigned iLUN, uint32
             pAhciPort->fAsyncInterface = true;
         else
             pAhciPort->fAsyncInterface = false;
+        pAhciPort->fSubmitOnEmt = pThis->fSubmitOnEmt && pAhciPort->fAsyncInterface;
 
         rc = SUPSemEventCreate(pThis->pSupDrvSession, &pAhciPort->hEvtProcess);
         if (RT_FAILURE(rc))
@@ -8006,7 +8194,8 @@ static DECLCALLBACK(int) ahciR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFG
                                     "PortCount\0"
                                     "UseAsyncInterfaceIfAvailable\0"
                                     "Bootable\0"
-                                    "CmdSlotsAvail\0"))
+                                    "CmdSlotsAvail\0"
+                                    "SubmitOnEmt\0"))
         return PDMDEV_SET_ERROR(pDevIns, VERR_PDM_DEVINS_UNKNOWN_CFG_VALUES,
                                 N_("AHCI configuration error: unknown option specified"));
 
@@ -8046,6 +8235,16 @@ static DECLCALLBACK(int) ahciR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFG
         return PDMDEV_SET_ERROR(pDevIns, rc,
                                 N_("AHCI configuration error: failed to read Bootable as boolean"));
 
+    /*
+     * Submitting new tasks on the EMT saves the worker thread wakeup but requires
+     * the CI register writes to be handled in R3, so it is only the default if
+     * the MMIO handlers run in R3 anyway.
+     */
+    rc = CFGMR3QueryBoolDef(pCfg, "SubmitOnEmt", &pThis->fSubmitOnEmt, !fGCEnabled && !fR0Enabled);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("AHCI configuration error: failed to read SubmitOnEmt as boolean"));
+
     rc = CFGMR3QueryU32Def(pCfg, "CmdSlotsAvail", &pThis->cCmdSlotsAvail, AHCI_NR_COMMAND_SLOTS);
     if (RT_FAILURE(rc))
         return PDMDEV_SET_ERROR(pDevIns, rc,
@@ -8239,6 +8438,10 @@ static DECLCALLBACK(int) ahciR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFG
                                "Amount of data written.", "/Devices/SATA%d/Port%d/WrittenBytes", iInstance, i);
         PDMDevHlpSTAMRegisterF(pDevIns, &pAhciPort->StatIORequestsPerSecond, STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_OCCURENCES,
                                "Number of processed I/O requests per second.", "/Devices/SATA%d/Port%d/IORequestsPerSecond", iInstance, i);
+        PDMDevHlpSTAMRegisterF(pDevIns, &pAhciPort->StatSubmitOnEmt, STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_OCCURENCES,
+                               "Number of task batches submitted on the EMT.", "/Devices/SATA%d/Port%d/SubmitOnEmt", iInstance, i);
+        PDMDevHlpSTAMRegisterF(pDevIns, &pAhciPort->StatIntrBatched, STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_OCCURENCES,
+                               "Number of interrupts raised at the end of a submission batch.", "/Devices/SATA%d/Port%d/IntrBatched", iInstance, i);
 #ifdef VBOX_WITH_STATISTICS
         PDMDevHlpSTAMRegisterF(pDevIns, &pAhciPort->StatProfileProcessTime, STAMTYPE_PROFILE, STAMVISIBILITY_USED, STAMUNIT_NS_PER_CALL,
                                "Amount of time to process one request.", "/Devices/SATA%d/Port%d/ProfileProcessTime", iInstance, i);
@@ -8315,6 +8518,11 @@ static DECLCALLBACK(int) ahciR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFG
                 pAhciPort->fAsyncInterface = false;
             }
 
+            /* Only the async interface can be used on the EMT without blocking the VCPU. */
+            pAhciPort->fSubmitOnEmt = pThis->fSubmitOnEmt && pAhciPort->fAsyncInterface && !pAhciPort->fATAPI;
+            if (pAhciPort->fSubmitOnEmt)
+                LogRel(("AHCI: LUN#%d: submitting requests on the EMT\n", pAhciPort->iLUN));
+
             rc = SUPSemEventCreate(pThis->pSupDrvSession, &pAhciPort->hEvtProcess);
             if (RT_FAILURE(rc))
                 return PDMDevHlpVMSetError(pDevIns, rc, RT_SRC_POS,
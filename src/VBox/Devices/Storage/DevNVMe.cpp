@@ -0,0 +1,2637 @@
+/* $Id$ */
+/** @file
+ * DevNVMe - NVM Express controller emulation.
+ */
+
+/*
+ * Copyright (C) 2013 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/** @page pg_dev_nvme   NVMe - NVM Express Controller Emulation.
+ *
+ * This component implements an NVM Express 1.0 controller with a single
+ * namespace backed by the disk attached to LUN#0.
+ *
+ * The guest talks to the controller through submission and completion queues
+ * in guest memory and a doorbell register per queue.  Doorbell writes for the
+ * I/O queues are handled in R0 without taking any lock: the new tail is stored
+ * and the worker thread owning the submission queue is woken up if it sleeps.
+ * There is one worker thread per I/O submission queue, so a guest creating a
+ * queue pair per vCPU gets its requests fetched in parallel.  The admin queue
+ * is processed on the EMT under the controller lock.
+ *
+ * Completions are posted to the completion queue under a lock per completion
+ * queue.  Every completion queue can have its own MSI-X vector if the chipset
+ * supports MSI-X, pin based interrupts are used otherwise.
+ *
+ * The data is transferred through DrvBlock's asynchronous interface if the
+ * attached driver provides it, synchronously on the worker thread otherwise.
+ */
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#define LOG_GROUP LOG_GROUP_DEV_NVME
+#include <VBox/vmm/pdmdev.h>
+#include <VBox/vmm/pdmthread.h>
+#include <VBox/vmm/pdmcritsect.h>
+#include <VBox/sup.h>
+#include <iprt/assert.h>
+#include <iprt/asm.h>
+#include <iprt/string.h>
+#ifdef IN_RING3
+# include <iprt/mem.h>
+# include <iprt/uuid.h>
+#endif
+#include "VBoxDD.h"
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+/** The saved state version. */
+#define NVME_SAVED_STATE_VERSION            1
+
+/** Maximum number of I/O queue pairs. */
+#define NVME_IO_QUEUES_MAX                  16
+/** Maximum number of queues including the admin queue. */
+#define NVME_QUEUES_MAX                     (NVME_IO_QUEUES_MAX + 1)
+/** Maximum number of entries in a queue. */
+#define NVME_QUEUE_ENTRIES_MAX              4096
+/** Maximum number of outstanding asynchronous event requests. */
+#define NVME_AER_MAX                        4
+/** Number of feature identifiers we keep values for. */
+#define NVME_FEAT_MAX                       0x10
+
+/** Memory page size, the only one we support (CC.MPS = 0). */
+#define NVME_PAGE_SHIFT                     12
+#define NVME_PAGE_SIZE                      RT_BIT_32(NVME_PAGE_SHIFT)
+#define NVME_PAGE_OFFSET_MASK               (NVME_PAGE_SIZE - 1)
+/** Maximum data transfer size, in units of the memory page size (2^n). */
+#define NVME_MDTS                           7
+/** Maximum data transfer size in bytes. */
+#define NVME_TRANSFER_MAX                   (NVME_PAGE_SIZE << NVME_MDTS)
+
+/** Size of the register BAR. */
+#define NVME_MMIO_SIZE                      0x4000
+/** Size of a submission queue entry (2^6). */
+#define NVME_SQE_SIZE                       64
+/** Size of a completion queue entry (2^4). */
+#define NVME_CQE_SIZE                       16
+
+#define NVME_SERIAL_NUMBER_LENGTH           20
+#define NVME_MODEL_NUMBER_LENGTH            40
+#define NVME_FIRMWARE_REVISION_LENGTH       8
+
+/** @name Controller registers.
+ * @{ */
+#define NVME_REG_CAP                        0x00
+#define NVME_REG_VS                         0x08
+#define NVME_REG_INTMS                      0x0c
+#define NVME_REG_INTMC                      0x10
+#define NVME_REG_CC                         0x14
+#define NVME_REG_CSTS                       0x1c
+#define NVME_REG_AQA                        0x24
+#define NVME_REG_ASQ                        0x28
+#define NVME_REG_ACQ                        0x30
+#define NVME_REG_DBS                        0x1000
+/** @} */
+
+/** Controller capabilities: queue size, contiguous queues, 8s timeout, NVM command set. */
+#define NVME_CAP_VALUE                      (  (uint64_t)(NVME_QUEUE_ENTRIES_MAX - 1) \
+                                             | RT_BIT_64(16) \
+                                             | ((uint64_t)0x10 << 24) \
+                                             | RT_BIT_64(37))
+/** Version 1.0. */
+#define NVME_VS_VALUE                       UINT32_C(0x00010000)
+
+/** @name Controller configuration register bits.
+ * @{ */
+#define NVME_CC_EN                          RT_BIT_32(0)
+#define NVME_CC_CSS_MASK                    UINT32_C(0x00000070)
+#define NVME_CC_MPS_MASK                    UINT32_C(0x00000780)
+#define NVME_CC_AMS_MASK                    UINT32_C(0x00003800)
+#define NVME_CC_SHN_MASK                    UINT32_C(0x0000c000)
+#define NVME_CC_IOSQES_GET(a)               (((a) >> 16) & 0xf)
+#define NVME_CC_IOCQES_GET(a)               (((a) >> 20) & 0xf)
+#define NVME_CC_WRITABLE_MASK               UINT32_C(0x00fffff1)
+/** @} */
+
+/** @name Controller status register bits.
+ * @{ */
+#define NVME_CSTS_RDY                       RT_BIT_32(0)
+#define NVME_CSTS_CFS                       RT_BIT_32(1)
+#define NVME_CSTS_SHST_COMPLETE             UINT32_C(0x00000008)
+#define NVME_CSTS_SHST_MASK                 UINT32_C(0x0000000c)
+/** @} */
+
+/** @name Admin command opcodes.
+ * @{ */
+#define NVME_ADM_DELETE_IO_SQ               0x00
+#define NVME_ADM_CREATE_IO_SQ               0x01
+#define NVME_ADM_GET_LOG_PAGE               0x02
+#define NVME_ADM_DELETE_IO_CQ               0x04
+#define NVME_ADM_CREATE_IO_CQ               0x05
+#define NVME_ADM_IDENTIFY                   0x06
+#define NVME_ADM_ABORT                      0x08
+#define NVME_ADM_SET_FEATURES               0x09
+#define NVME_ADM_GET_FEATURES               0x0a
+#define NVME_ADM_ASYNC_EVENT_REQUEST        0x0c
+/** @} */
+
+/** @name NVM command set opcodes.
+ * @{ */
+#define NVME_CMD_FLUSH                      0x00
+#define NVME_CMD_WRITE                      0x01
+#define NVME_CMD_READ                       0x02
+/** @} */
+
+/** @name Feature identifiers.
+ * @{ */
+#define NVME_FEAT_ARBITRATION               0x01
+#define NVME_FEAT_POWER_MGMT                0x02
+#define NVME_FEAT_TEMP_THRESHOLD            0x04
+#define NVME_FEAT_ERROR_RECOVERY            0x05
+#define NVME_FEAT_VOLATILE_WC               0x06
+#define NVME_FEAT_NUM_QUEUES                0x07
+#define NVME_FEAT_INT_COALESCING            0x08
+#define NVME_FEAT_INT_VECTOR_CONFIG         0x09
+#define NVME_FEAT_WRITE_ATOMICITY           0x0a
+#define NVME_FEAT_ASYNC_EVENT_CONFIG        0x0b
+/** @} */
+
+/** @name Completion status values (status code type << 8 | status code).
+ * @{ */
+#define NVME_STATUS(a_Sct, a_Sc)            ((uint16_t)(((a_Sct) << 8) | (a_Sc)))
+#define NVME_SC_SUCCESS                     NVME_STATUS(0, 0x00)
+#define NVME_SC_INVALID_OPCODE              NVME_STATUS(0, 0x01)
+#define NVME_SC_INVALID_FIELD               NVME_STATUS(0, 0x02)
+#define NVME_SC_DATA_TRANSFER_ERROR         NVME_STATUS(0, 0x04)
+#define NVME_SC_INTERNAL_ERROR              NVME_STATUS(0, 0x06)
+#define NVME_SC_ABORTED_SQ_DELETED          NVME_STATUS(0, 0x08)
+#define NVME_SC_INVALID_NAMESPACE           NVME_STATUS(0, 0x0b)
+#define NVME_SC_LBA_OUT_OF_RANGE            NVME_STATUS(0, 0x80)
+#define NVME_SC_CQ_INVALID                  NVME_STATUS(1, 0x00)
+#define NVME_SC_INVALID_QUEUE_ID            NVME_STATUS(1, 0x01)
+#define NVME_SC_MAX_QUEUE_SIZE_EXCEEDED     NVME_STATUS(1, 0x02)
+#define NVME_SC_AER_LIMIT_EXCEEDED          NVME_STATUS(1, 0x05)
+#define NVME_SC_INVALID_INT_VECTOR          NVME_STATUS(1, 0x08)
+#define NVME_SC_INVALID_LOG_PAGE            NVME_STATUS(1, 0x09)
+#define NVME_SC_INVALID_QUEUE_DELETION      NVME_STATUS(1, 0x0c)
+#define NVME_SC_WRITE_TO_RO_RANGE           NVME_STATUS(1, 0x82)
+#define NVME_SC_WRITE_FAULT                 NVME_STATUS(2, 0x80)
+#define NVME_SC_UNRECOVERED_READ_ERROR      NVME_STATUS(2, 0x81)
+/** Internal: The command does not complete now (asynchronous event request). */
+#define NVME_SC_NO_COMPLETION               UINT16_C(0xffff)
+/** @} */
+
+/** The namespace ID of our only namespace. */
+#define NVME_NSID                           1
+/** The namespace ID addressing all namespaces. */
+#define NVME_NSID_ALL                       UINT32_C(0xffffffff)
+
+/** Returns the instance number for logging. */
+#define NVME_INSTANCE(a_pThis)              ((a_pThis)->CTX_SUFF(pDevIns)->iInstance)
+
+
+/*******************************************************************************
+*   Structures and Typedefs                                                    *
+*******************************************************************************/
+/**
+ * Submission queue entry.
+ */
+typedef struct NVMECMD
+{
+    /** Opcode. */
+    uint8_t     u8Opc;
+    /** Fused operation and PRP/SGL selection. */
+    uint8_t     u8Flags;
+    /** Command identifier. */
+    uint16_t    u16Cid;
+    /** Namespace identifier. */
+    uint32_t    u32Nsid;
+    uint64_t    u64Reserved;
+    /** Metadata pointer. */
+    uint64_t    u64Mptr;
+    /** PRP entry 1. */
+    uint64_t    u64Prp1;
+    /** PRP entry 2. */
+    uint64_t    u64Prp2;
+    /** Command dwords 10 to 15. */
+    uint32_t    au32Cdw[6];
+} NVMECMD;
+AssertCompileSize(NVMECMD, NVME_SQE_SIZE);
+/** Pointer to a submission queue entry. */
+typedef NVMECMD *PNVMECMD;
+/** Pointer to a const submission queue entry. */
+typedef const NVMECMD *PCNVMECMD;
+
+/**
+ * Completion queue entry.
+ */
+typedef struct NVMECQE
+{
+    /** Command specific result. */
+    uint32_t    u32Dw0;
+    uint32_t    u32Reserved;
+    /** Submission queue head pointer. */
+    uint16_t    u16SqHead;
+    /** Submission queue identifier. */
+    uint16_t    u16SqId;
+    /** Command identifier. */
+    uint16_t    u16Cid;
+    /** Status field and phase tag. */
+    uint16_t    u16Status;
+} NVMECQE;
+AssertCompileSize(NVMECQE, NVME_CQE_SIZE);
+
+/**
+ * Completion queue state.
+ */
+typedef struct NVMECQ
+{
+    /** Lock serializing posting of completions. */
+    PDMCRITSECT             CritSect;
+    /** Guest physical address of the queue. */
+    RTGCPHYS                GCPhysBase;
+    /** Number of entries, 0 if the queue does not exist. */
+    uint32_t                cEntries;
+    /** Tail index, where the next completion is posted. */
+    uint32_t                uTail;
+    /** Head index written by the guest through the doorbell. */
+    uint32_t volatile       uHead;
+    /** Number of entries reserved for fetched commands which did not complete yet. */
+    uint32_t                cReserved;
+    /** Generation, incremented whenever the queue is deleted. */
+    uint32_t                uGen;
+    /** Number of submission queues using this completion queue. */
+    uint32_t                cSqs;
+    /** The interrupt vector. */
+    uint16_t                uIv;
+    /** Whether interrupts are enabled. */
+    bool                    fIen;
+    /** The current phase tag. */
+    bool                    fPhase;
+    uint32_t                u32Alignment;
+} NVMECQ;
+/** Pointer to a completion queue state. */
+typedef NVMECQ *PNVMECQ;
+
+/**
+ * Submission queue state.
+ */
+typedef struct NVMESQ
+{
+    /** Guest physical address of the queue. */
+    RTGCPHYS                GCPhysBase;
+    /** Number of entries, 0 if the queue does not exist. */
+    uint32_t                cEntries;
+    /** Head index, next entry to fetch. */
+    uint32_t                uHead;
+    /** Tail index written by the guest through the doorbell. */
+    uint32_t volatile       uTail;
+    /** Generation, incremented whenever the queue is deleted. */
+    uint32_t                uGen;
+    /** The completion queue used. */
+    uint16_t                uCqId;
+    /** The queue identifier. */
+    uint16_t                uId;
+    /** Flag whether the worker thread waits for the event semaphore. */
+    bool volatile           fWrkThreadSleeping;
+    /** Flag whether the worker thread waits for room in the completion queue. */
+    bool volatile           fWaitCq;
+    bool                    afAlignment[2];
+    /** The worker thread fetching commands from this queue. */
+    R3PTRTYPE(PPDMTHREAD)   pWrkThread;
+    /** Event semaphore the worker thread waits on. */
+    SUPSEMEVENT             hEvtProcess;
+} NVMESQ;
+/** Pointer to a submission queue state. */
+typedef NVMESQ *PNVMESQ;
+
+/**
+ * The NVMe controller instance data.
+ *
+ * @implements  PDMIBASE
+ * @implements  PDMIBLOCKPORT
+ * @implements  PDMIBLOCKASYNCPORT
+ * @implements  PDMILEDPORTS
+ */
+typedef struct NVME
+{
+    /** The PCI device structure. */
+    PCIDEVICE                       dev;
+    /** Pointer to the device instance - R3 ptr */
+    PPDMDEVINSR3                    pDevInsR3;
+    /** Pointer to the device instance - R0 ptr */
+    PPDMDEVINSR0                    pDevInsR0;
+    /** Pointer to the device instance - RC ptr. */
+    PPDMDEVINSRC                    pDevInsRC;
+    /** The support driver session handle. */
+    R3R0PTRTYPE(PSUPDRVSESSION)     pSupDrvSession;
+
+    /** Status LUN: Base interface. */
+    PDMIBASE                        IBase;
+    /** Status LUN: Leds interface. */
+    PDMILEDPORTS                    ILeds;
+    /** Status LUN: Partner of ILeds. */
+    R3PTRTYPE(PPDMILEDCONNECTORS)   pLedsConnector;
+    /** The disk LED. */
+    PDMLED                          Led;
+
+    /** Base interface of the disk LUN. */
+    PDMIBASE                        IBaseDisk;
+    /** Block port interface of the disk LUN. */
+    PDMIBLOCKPORT                   IPort;
+    /** Asynchronous block port interface of the disk LUN. */
+    PDMIBLOCKASYNCPORT              IPortAsync;
+    /** Attached disk driver. */
+    R3PTRTYPE(PPDMIBASE)            pDrvBase;
+    /** Block interface of the attached disk. */
+    R3PTRTYPE(PPDMIBLOCK)           pDrvBlock;
+    /** Asynchronous block interface of the attached disk, optional. */
+    R3PTRTYPE(PPDMIBLOCKASYNC)      pDrvBlockAsync;
+
+    /** Base address of the register BAR. */
+    RTGCPHYS                        GCPhysMMIO;
+    /** Admin submission queue base address. */
+    uint64_t                        u64Asq;
+    /** Admin completion queue base address. */
+    uint64_t                        u64Acq;
+    /** Controller configuration. */
+    uint32_t                        u32Cc;
+    /** Controller status. */
+    uint32_t volatile               u32Csts;
+    /** Admin queue attributes. */
+    uint32_t                        u32Aqa;
+    /** Interrupt mask for pin based interrupts. */
+    uint32_t                        u32IntMask;
+
+    /** Number of I/O queue pairs supported (configured). */
+    uint32_t                        cIoQueuesMax;
+    /** Number of I/O queue pairs granted to the guest. */
+    uint32_t                        cIoQueues;
+    /** Number of MSI-X vectors, 0 if MSI-X is not available. */
+    uint32_t                        cMsixVectors;
+    /** Number of outstanding asynchronous event requests. */
+    uint32_t                        cAers;
+    /** Command identifiers of the outstanding asynchronous event requests. */
+    uint16_t                        au16AerCids[NVME_AER_MAX];
+    /** Current values of the features. */
+    uint32_t                        au32Features[NVME_FEAT_MAX];
+
+    /** Number of requests submitted to the disk. */
+    uint32_t volatile               cReqsActive;
+    /** Number of worker threads processing a submission queue. */
+    uint32_t volatile               cThreadsActive;
+    /** Indicates that PDMDevHlpAsyncNotificationCompleted should be called when
+     * the controller becomes idle. */
+    bool volatile                   fSignalIdle;
+    /** Current level of the pin based interrupt. */
+    bool                            fIntxAsserted;
+    /** Whether R0 is enabled. */
+    bool                            fR0Enabled;
+    /** Flag whether the attached disk is read only. */
+    bool                            fReadOnly;
+    /** Logical block size of the namespace. */
+    uint32_t                        cbBlock;
+    /** Number of logical blocks of the namespace. */
+    uint64_t                        cBlocks;
+
+    /** The serial number reported in the identify data. */
+    char                            szSerialNumber[NVME_SERIAL_NUMBER_LENGTH+1];
+    /** The model number reported in the identify data. */
+    char                            szModelNumber[NVME_MODEL_NUMBER_LENGTH+1];
+    /** The firmware revision reported in the identify data. */
+    char                            szFirmwareRevision[NVME_FIRMWARE_REVISION_LENGTH+1];
+    char                            achAlignment[2];
+
+    /** The controller lock, serializes register writes and the admin queue. */
+    PDMCRITSECT                     lock;
+    /** The completion queues, index 0 is the admin queue. */
+    NVMECQ                          aCqs[NVME_QUEUES_MAX];
+    /** The submission queues, index 0 is the admin queue. */
+    NVMESQ                          aSqs[NVME_QUEUES_MAX];
+
+    /** @name Statistics.
+     * @{ */
+    STAMCOUNTER                     StatBytesRead;
+    STAMCOUNTER                     StatBytesWritten;
+    STAMCOUNTER                     StatReqsRead;
+    STAMCOUNTER                     StatReqsWrite;
+    STAMCOUNTER                     StatReqsFlush;
+    STAMCOUNTER                     StatAdminCmds;
+#ifdef VBOX_WITH_STATISTICS
+    STAMCOUNTER                     StatDoorbellsR3;
+    STAMCOUNTER                     StatDoorbellsRZ;
+    STAMCOUNTER                     StatWorkerWakeups;
+    STAMCOUNTER                     StatCqFull;
+    STAMCOUNTER                     StatInterrupts;
+#endif
+    /** @} */
+} NVME;
+/** Pointer to the NVMe controller instance data. */
+typedef NVME *PNVME;
+
+/**
+ * A guest data segment of a request.
+ */
+typedef struct NVMEGUESTSEG
+{
+    RTGCPHYS    GCPhys;
+    uint32_t    cb;
+} NVMEGUESTSEG;
+/** Pointer to a guest data segment. */
+typedef NVMEGUESTSEG *PNVMEGUESTSEG;
+
+/**
+ * An I/O request.
+ */
+typedef struct NVMEREQ
+{
+    /** The submission queue the command was fetched from. */
+    uint16_t        uSqId;
+    /** The completion queue the command completes on. */
+    uint16_t        uCqId;
+    /** Submission queue generation the command was fetched in. */
+    uint32_t        uSqGen;
+    /** Completion queue generation the entry was reserved in. */
+    uint32_t        uCqGen;
+    /** The command identifier. */
+    uint16_t        u16Cid;
+    /** The opcode. */
+    uint8_t         u8Opc;
+    /** Start offset on the disk in bytes. */
+    uint64_t        uOffset;
+    /** Amount of data to transfer. */
+    size_t          cbTransfer;
+    /** Bounce buffer for the data. */
+    RTSGSEG         DataSeg;
+    /** Number of guest data segments. */
+    unsigned        cGuestSegs;
+    /** The guest data segments - variable size. */
+    NVMEGUESTSEG    aGuestSegs[1];
+} NVMEREQ;
+/** Pointer to an I/O request. */
+typedef NVMEREQ *PNVMEREQ;
+
+#ifndef VBOX_DEVICE_STRUCT_TESTCASE
+
+#define PDMIBASE_2_PNVME(pInterface)            ( (PNVME)((uintptr_t)(pInterface) - RT_OFFSETOF(NVME, IBase)) )
+#define PDMIBASEDISK_2_PNVME(pInterface)        ( (PNVME)((uintptr_t)(pInterface) - RT_OFFSETOF(NVME, IBaseDisk)) )
+#define PDMILEDPORTS_2_PNVME(pInterface)        ( (PNVME)((uintptr_t)(pInterface) - RT_OFFSETOF(NVME, ILeds)) )
+#define PDMIBLOCKPORT_2_PNVME(pInterface)       ( (PNVME)((uintptr_t)(pInterface) - RT_OFFSETOF(NVME, IPort)) )
+#define PDMIBLOCKASYNCPORT_2_PNVME(pInterface)  ( (PNVME)((uintptr_t)(pInterface) - RT_OFFSETOF(NVME, IPortAsync)) )
+
+
+/**
+ * Updates the pin based interrupt line from the state of the completion queues.
+ *
+ * The caller must own the controller lock.
+ *
+ * @param   pThis       The NVMe controller instance data.
+ */
+static void nvmeIntxUpdate(PNVME pThis)
+{
+    bool fAssert = false;
+
+    if (   !PCIDevIsIntxDisabled(&pThis->dev)
+        && !(pThis->u32IntMask & RT_BIT_32(0)))
+    {
+        for (unsigned i = 0; i < RT_ELEMENTS(pThis->aCqs) && !fAssert; i++)
+        {
+            PNVMECQ pCq = &pThis->aCqs[i];
+            if (   pCq->cEntries
+                && pCq->fIen
+                && ASMAtomicReadU32(&pCq->uHead) != ASMAtomicReadU32(&pCq->uTail))
+                fAssert = true;
+        }
+    }
+
+    if (fAssert != pThis->fIntxAsserted)
+    {
+        pThis->fIntxAsserted = fAssert;
+        PDMDevHlpPCISetIrq(pThis->CTX_SUFF(pDevIns), 0, fAssert ? PDM_IRQ_LEVEL_HIGH : PDM_IRQ_LEVEL_LOW);
+    }
+}
+
+/**
+ * Returns the value of a controller register.
+ *
+ * @returns The register value, 0 for undefined and write only registers.
+ * @param   pThis       The NVMe controller instance data.
+ * @param   offReg      The register offset.
+ */
+static uint32_t nvmeRegRead(PNVME pThis, uint32_t offReg)
+{
+    switch (offReg)
+    {
+        case NVME_REG_CAP:
+            return RT_LO_U32(NVME_CAP_VALUE);
+        case NVME_REG_CAP + 4:
+            return RT_HI_U32(NVME_CAP_VALUE);
+        case NVME_REG_VS:
+            return NVME_VS_VALUE;
+        case NVME_REG_INTMS:
+        case NVME_REG_INTMC:
+            return pThis->u32IntMask;
+        case NVME_REG_CC:
+            return pThis->u32Cc;
+        case NVME_REG_CSTS:
+            return ASMAtomicReadU32(&pThis->u32Csts);
+        case NVME_REG_AQA:
+            return pThis->u32Aqa;
+        case NVME_REG_ASQ:
+            return RT_LO_U32(pThis->u64Asq);
+        case NVME_REG_ASQ + 4:
+            return RT_HI_U32(pThis->u64Asq);
+        case NVME_REG_ACQ:
+            return RT_LO_U32(pThis->u64Acq);
+        case NVME_REG_ACQ + 4:
+            return RT_HI_U32(pThis->u64Acq);
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Wakes up the worker thread of a submission queue if it is sleeping.
+ *
+ * @param   pThis       The NVMe controller instance data.
+ * @param   pSq         The submission queue.
+ */
+DECLINLINE(void) nvmeSqKick(PNVME pThis, PNVMESQ pSq)
+{
+    if (ASMAtomicReadBool(&pSq->fWrkThreadSleeping))
+    {
+        STAM_COUNTER_INC(&pThis->StatWorkerWakeups);
+        int rc = SUPSemEventSignal(pThis->pSupDrvSession, pSq->hEvtProcess);
+        AssertRC(rc);
+    }
+}
+
+#ifdef IN_RING3
+static void nvmeR3AdminProcess(PNVME pThis);
+#endif
+
+/**
+ * Handles a doorbell write.
+ *
+ * @returns VBox status code.
+ * @param   pThis       The NVMe controller instance data.
+ * @param   offDb       Offset relative to the start of the doorbells.
+ * @param   u32Value    The value written.
+ */
+static int nvmeDoorbellWrite(PNVME pThis, uint32_t offDb, uint32_t u32Value)
+{
+    uint32_t iQueue = offDb / 8;
+    bool     fCq    = RT_BOOL(offDb & 4);
+
+    if (   (offDb & 3)
+        || iQueue >= RT_ELEMENTS(pThis->aSqs)
+        || !(ASMAtomicReadU32(&pThis->u32Csts) & NVME_CSTS_RDY))
+    {
+        Log(("nvme#%u: Ignoring doorbell write at %#x (value %#x)\n", NVME_INSTANCE(pThis), offDb, u32Value));
+        return VINF_SUCCESS;
+    }
+
+    /* The admin queue is processed on the EMT. */
+    if (iQueue == 0)
+    {
+#ifndef IN_RING3
+        return VINF_IOM_R3_MMIO_WRITE;
+#else
+        int rc = PDMCritSectEnter(&pThis->lock, VINF_IOM_R3_MMIO_WRITE);
+        if (rc != VINF_SUCCESS)
+            return rc;
+        if (fCq)
+        {
+            if (u32Value < pThis->aCqs[0].cEntries)
+                ASMAtomicWriteU32(&pThis->aCqs[0].uHead, u32Value);
+            ASMAtomicWriteBool(&pThis->aSqs[0].fWaitCq, false);
+        }
+        else if (u32Value < pThis->aSqs[0].cEntries)
+            ASMAtomicWriteU32(&pThis->aSqs[0].uTail, u32Value);
+        nvmeR3AdminProcess(pThis);
+        PDMCritSectLeave(&pThis->lock);
+        return VINF_SUCCESS;
+#endif
+    }
+
+    if (!fCq)
+    {
+        PNVMESQ pSq = &pThis->aSqs[iQueue];
+        if (RT_UNLIKELY(u32Value >= pSq->cEntries))
+        {
+            Log(("nvme#%u: Invalid tail %u for SQ %u\n", NVME_INSTANCE(pThis), u32Value, iQueue));
+            return VINF_SUCCESS;
+        }
+        ASMAtomicWriteU32(&pSq->uTail, u32Value);
+        nvmeSqKick(pThis, pSq);
+    }
+    else
+    {
+        PNVMECQ pCq = &pThis->aCqs[iQueue];
+        if (RT_UNLIKELY(u32Value >= pCq->cEntries))
+        {
+            Log(("nvme#%u: Invalid head %u for CQ %u\n", NVME_INSTANCE(pThis), u32Value, iQueue));
+            return VINF_SUCCESS;
+        }
+
+        if (!PCIDevIsIntxDisabled(&pThis->dev))
+        {
+            /* The pin based interrupt level depends on the head. */
+            int rc = PDMCritSectEnter(&pThis->lock, VINF_IOM_R3_MMIO_WRITE);
+            if (rc != VINF_SUCCESS)
+                return rc;
+            ASMAtomicWriteU32(&pCq->uHead, u32Value);
+            nvmeIntxUpdate(pThis);
+            PDMCritSectLeave(&pThis->lock);
+        }
+        else
+            ASMAtomicWriteU32(&pCq->uHead, u32Value);
+
+        /* Restart the submission queues which ran out of completion entries. */
+        for (unsigned i = 1; i < RT_ELEMENTS(pThis->aSqs); i++)
+        {
+            PNVMESQ pSq = &pThis->aSqs[i];
+            if (   pSq->uCqId == iQueue
+                && ASMAtomicXchgBool(&pSq->fWaitCq, false))
+                nvmeSqKick(pThis, pSq);
+        }
+    }
+
+    return VINF_SUCCESS;
+}
+
+#ifdef IN_RING3
+static int nvmeR3RegWrite(PNVME pThis, uint32_t offReg, uint32_t u32Value);
+#endif
+
+/**
+ * Writes a register.
+ *
+ * @returns VBox status code.
+ * @param   pThis       The NVMe controller instance data.
+ * @param   offReg      The register offset.
+ * @param   u32Value    The value written.
+ */
+static int nvmeRegWrite(PNVME pThis, uint32_t offReg, uint32_t u32Value)
+{
+    if (offReg >= NVME_REG_DBS)
+    {
+        STAM_COUNTER_INC(&pThis->CTX_SUFF_Z(StatDoorbells));
+        return nvmeDoorbellWrite(pThis, offReg - NVME_REG_DBS, u32Value);
+    }
+#ifdef IN_RING3
+    return nvmeR3RegWrite(pThis, offReg, u32Value);
+#else
+    return VINF_IOM_R3_MMIO_WRITE;
+#endif
+}
+
+/**
+ * @callback_method_impl{FNIOMMMIOREAD}
+ */
+PDMBOTHCBDECL(int) nvmeMMIORead(PPDMDEVINS pDevIns, void *pvUser, RTGCPHYS GCPhysAddr, void *pv, unsigned cb)
+{
+    PNVME    pThis  = PDMINS_2_DATA(pDevIns, PNVME);
+    uint32_t offReg = (uint32_t)(GCPhysAddr - pThis->GCPhysMMIO);
+    NOREF(pvUser);
+
+    if (cb == 8)
+        *(uint64_t *)pv = RT_MAKE_U64(nvmeRegRead(pThis, offReg), nvmeRegRead(pThis, offReg + 4));
+    else
+    {
+        Assert(cb == 4);
+        *(uint32_t *)pv = nvmeRegRead(pThis, offReg);
+    }
+    return VINF_SUCCESS;
+}
+
+/**
+ * @callback_method_impl{FNIOMMMIOWRITE}
+ */
+PDMBOTHCBDECL(int) nvmeMMIOWrite(PPDMDEVINS pDevIns, void *pvUser, RTGCPHYS GCPhysAddr, void const *pv, unsigned cb)
+{
+    PNVME    pThis  = PDMINS_2_DATA(pDevIns, PNVME);
+    uint32_t offReg = (uint32_t)(GCPhysAddr - pThis->GCPhysMMIO);
+    NOREF(pvUser);
+
+    if (cb == 8)
+    {
+        /* Only the 64-bit registers are written this way, handle both halves in R3. */
+#ifndef IN_RING3
+        return VINF_IOM_R3_MMIO_WRITE;
+#else
+        uint64_t u64Value = *(uint64_t const *)pv;
+        int rc = nvmeRegWrite(pThis, offReg, RT_LO_U32(u64Value));
+        if (RT_SUCCESS(rc))
+            rc = nvmeRegWrite(pThis, offReg + 4, RT_HI_U32(u64Value));
+        return rc;
+#endif
+    }
+
+    Assert(cb == 4);
+    return nvmeRegWrite(pThis, offReg, *(uint32_t const *)pv);
+}
+
+#ifdef IN_RING3
+
+/* -=-=-=-=- Queue handling -=-=-=-=- */
+
+/**
+ * Returns the number of free entries in a completion queue.
+ *
+ * @returns Number of free entries.
+ * @param   pCq         The completion queue, the caller owns its lock.
+ */
+DECLINLINE(uint32_t) nvmeR3CqFree(PNVMECQ pCq)
+{
+    uint32_t uHead = ASMAtomicReadU32(&pCq->uHead);
+    uint32_t cUsed = (pCq->uTail + pCq->cEntries - uHead) % pCq->cEntries;
+    uint32_t cBusy = cUsed + pCq->cReserved;
+    return cBusy < pCq->cEntries - 1 ? pCq->cEntries - 1 - cBusy : 0;
+}
+
+/**
+ * Posts a completion queue entry and signals the interrupt vector of the queue.
+ *
+ * The caller must own the lock of the completion queue and update the pin
+ * based interrupt after leaving it.
+ *
+ * @param   pThis       The NVMe controller instance data.
+ * @param   pCq         The completion queue.
+ * @param   pSq         The submission queue the command came from.
+ * @param   u16Cid      The command identifier.
+ * @param   u16Status   The completion status.
+ * @param   u32Dw0      The command specific result.
+ */
+static void nvmeR3CqPost(PNVME pThis, PNVMECQ pCq, PNVMESQ pSq, uint16_t u16Cid, uint16_t u16Status, uint32_t u32Dw0)
+{
+    NVMECQE Cqe;
+
+    Cqe.u32Dw0      = u32Dw0;
+    Cqe.u32Reserved = 0;
+    Cqe.u16SqHead   = (uint16_t)pSq->uHead;
+    Cqe.u16SqId     = pSq->uId;
+    Cqe.u16Cid      = u16Cid;
+    Cqe.u16Status   = (uint16_t)(u16Status << 1) | (pCq->fPhase ? 1 : 0);
+
+    PDMDevHlpPCIPhysWrite(pThis->CTX_SUFF(pDevIns), pCq->GCPhysBase + pCq->uTail * NVME_CQE_SIZE,
+                          &Cqe, sizeof(Cqe));
+
+    uint32_t uTail = pCq->uTail + 1;
+    if (uTail == pCq->cEntries)
+    {
+        uTail = 0;
+        pCq->fPhase = !pCq->fPhase;
+    }
+    ASMAtomicWriteU32(&pCq->uTail, uTail);
+
+    /* Message signalled interrupts are edge triggered and go out right away. */
+    if (   pCq->fIen
+        && PCIDevIsIntxDisabled(&pThis->dev))
+    {
+        STAM_COUNTER_INC(&pThis->StatInterrupts);
+        PDMDevHlpPCISetIrq(pThis->CTX_SUFF(pDevIns), pCq->uIv, PDM_IRQ_LEVEL_HIGH);
+    }
+}
+
+/**
+ * Updates the pin based interrupt after completions were posted.
+ *
+ * @param   pThis       The NVMe controller instance data.
+ */
+static void nvmeR3IntxUpdateLocked(PNVME pThis)
+{
+    if (!PCIDevIsIntxDisabled(&pThis->dev))
+    {
+        int rc = PDMCritSectEnter(&pThis->lock, VERR_IGNORED);
+        AssertRC(rc);
+        nvmeIntxUpdate(pThis);
+        PDMCritSectLeave(&pThis->lock);
+    }
+}
+
+/**
+ * Converts a PRP pair into a list of guest data segments.
+ *
+ * @returns NVMe status code.
+ * @param   pThis       The NVMe controller instance data.
+ * @param   u64Prp1     PRP entry 1.
+ * @param   u64Prp2     PRP entry 2.
+ * @param   cbTransfer  Number of bytes to transfer.
+ * @param   paSegs      Where to store the segments.
+ * @param   cSegsMax    Maximum number of segments.
+ * @param   pcSegs      Where to store the number of segments.
+ */
+static uint16_t nvmeR3PrpToSegs(PNVME pThis, uint64_t u64Prp1, uint64_t u64Prp2, size_t cbTransfer,
+                                PNVMEGUESTSEG paSegs, unsigned cSegsMax, unsigned *pcSegs)
+{
+    PPDMDEVINS pDevIns = pThis->CTX_SUFF(pDevIns);
+    unsigned   cSegs   = 0;
+    size_t     cbLeft  = cbTransfer;
+
+#define NVME_ADD_SEG(a_GCPhys, a_cb) \
+    do { \
+        if (   cSegs \
+            && paSegs[cSegs - 1].GCPhys + paSegs[cSegs - 1].cb == (a_GCPhys)) \
+            paSegs[cSegs - 1].cb += (uint32_t)(a_cb); \
+        else \
+        { \
+            if (cSegs == cSegsMax) \
+                return NVME_SC_INVALID_FIELD; \
+            paSegs[cSegs].GCPhys = (a_GCPhys); \
+            paSegs[cSegs].cb     = (uint32_t)(a_cb); \
+            cSegs++; \
+        } \
+    } while (0)
+
+    /* The first entry may have an offset into the page. */
+    size_t cbThis = RT_MIN(cbLeft, NVME_PAGE_SIZE - (u64Prp1 & NVME_PAGE_OFFSET_MASK));
+    NVME_ADD_SEG(u64Prp1, cbThis);
+    cbLeft -= cbThis;
+
+    if (cbLeft && cbLeft <= NVME_PAGE_SIZE)
+    {
+        /* The second entry points to the second page. */
+        if (u64Prp2 & NVME_PAGE_OFFSET_MASK)
+            return NVME_SC_INVALID_FIELD;
+        NVME_ADD_SEG(u64Prp2, cbLeft);
+        cbLeft = 0;
+    }
+    else if (cbLeft)
+    {
+        /* The second entry points to a PRP list, the last entry of a list page chains to the next one. */
+        RTGCPHYS GCPhysList = u64Prp2;
+        if (GCPhysList & 7)
+            return NVME_SC_INVALID_FIELD;
+
+        while (cbLeft)
+        {
+            uint32_t cEntriesPage = (NVME_PAGE_SIZE - (GCPhysList & NVME_PAGE_OFFSET_MASK)) / sizeof(uint64_t);
+            size_t   cPagesLeft   = (cbLeft + NVME_PAGE_SIZE - 1) / NVME_PAGE_SIZE;
+            bool     fChain       = cPagesLeft > cEntriesPage;
+            uint32_t cEntries     = fChain ? cEntriesPage - 1 : (uint32_t)cPagesLeft;
+            uint64_t au64Prps[32];
+
+            for (uint32_t iEntry = 0; iEntry < cEntries; )
+            {
+                uint32_t cThisRead = RT_MIN(cEntries - iEntry, RT_ELEMENTS(au64Prps));
+                PDMDevHlpPhysRead(pDevIns, GCPhysList + iEntry * sizeof(uint64_t), au64Prps,
+                                  cThisRead * sizeof(uint64_t));
+                for (uint32_t i = 0; i < cThisRead; i++)
+                {
+                    if (au64Prps[i] & NVME_PAGE_OFFSET_MASK)
+                        return NVME_SC_INVALID_FIELD;
+                    cbThis = RT_MIN(cbLeft, NVME_PAGE_SIZE);
+                    NVME_ADD_SEG(au64Prps[i], cbThis);
+                    cbLeft -= cbThis;
+                }
+                iEntry += cThisRead;
+            }
+
+            if (fChain)
+            {
+                uint64_t u64Next;
+                PDMDevHlpPhysRead(pDevIns, GCPhysList + cEntries * sizeof(uint64_t), &u64Next, sizeof(u64Next));
+                if (u64Next & NVME_PAGE_OFFSET_MASK)
+                    return NVME_SC_INVALID_FIELD;
+                GCPhysList = u64Next;
+            }
+        }
+    }
+
+#undef NVME_ADD_SEG
+
+    *pcSegs = cSegs;
+    return NVME_SC_SUCCESS;
+}
+
+/**
+ * Copies data between a host buffer and guest data segments.
+ *
+ * @param   pThis       The NVMe controller instance data.
+ * @param   paSegs      The guest data segments.
+ * @param   cSegs       Number of guest data segments.
+ * @param   pvBuf       The host buffer.
+ * @param   cbBuf       Size of the host buffer.
+ * @param   fToGuest    Direction of the copy.
+ */
+static void nvmeR3SegsCopy(PNVME pThis, PNVMEGUESTSEG paSegs, unsigned cSegs, void *pvBuf, size_t cbBuf, bool fToGuest)
+{
+    PPDMDEVINS pDevIns = pThis->CTX_SUFF(pDevIns);
+    uint8_t   *pbBuf   = (uint8_t *)pvBuf;
+
+    for (unsigned i = 0; i < cSegs && cbBuf; i++)
+    {
+        size_t cbThisCopy = RT_MIN(cbBuf, paSegs[i].cb);
+
+        if (fToGuest)
+            PDMDevHlpPCIPhysWrite(pDevIns, paSegs[i].GCPhys, pbBuf, cbThisCopy);
+        else
+            PDMDevHlpPhysRead(pDevIns, paSegs[i].GCPhys, pbBuf, cbThisCopy);
+
+        pbBuf += cbThisCopy;
+        cbBuf -= cbThisCopy;
+    }
+}
+
+/**
+ * Copies a data structure returned by an admin command to the guest.
+ *
+ * @returns NVMe status code.
+ * @param   pThis       The NVMe controller instance data.
+ * @param   pCmd        The admin command.
+ * @param   pvBuf       The data to copy.
+ * @param   cbBuf       Size of the data.
+ */
+static uint16_t nvmeR3AdminCopyToGuest(PNVME pThis, PCNVMECMD pCmd, void *pvBuf, size_t cbBuf)
+{
+    NVMEGUESTSEG aSegs[2];
+    unsigned     cSegs = 0;
+
+    AssertReturn(cbBuf <= NVME_PAGE_SIZE, NVME_SC_INTERNAL_ERROR);
+    uint16_t u16Status = nvmeR3PrpToSegs(pThis, pCmd->u64Prp1, pCmd->u64Prp2, cbBuf,
+                                         &aSegs[0], RT_ELEMENTS(aSegs), &cSegs);
+    if (u16Status == NVME_SC_SUCCESS)
+        nvmeR3SegsCopy(pThis, &aSegs[0], cSegs, pvBuf, cbBuf, true /* fToGuest */);
+    return u16Status;
+}
+
+/**
+ * Returns an I/O request to the guest and frees it.
+ *
+ * @param   pThis       The NVMe controller instance data.
+ * @param   pReq        The request to complete.
+ * @param   u16Status   The NVMe status of the request.
+ */
+static void nvmeR3ReqComplete(PNVME pThis, PNVMEREQ pReq, uint16_t u16Status)
+{
+    PNVMESQ pSq = &pThis->aSqs[pReq->uSqId];
+    PNVMECQ pCq = &pThis->aCqs[pReq->uCqId];
+
+    if (pReq->u8Opc == NVME_CMD_READ)
+        pThis->Led.Actual.s.fReading = 0;
+    else if (pReq->u8Opc == NVME_CMD_WRITE)
+        pThis->Led.Actual.s.fWriting = 0;
+
+    int rc = PDMCritSectEnter(&pCq->CritSect, VERR_IGNORED);
+    AssertRC(rc);
+
+    /* Completions of commands from deleted queues are dropped, the memory may belong to someone else now. */
+    if (pReq->uCqGen == pCq->uGen)
+    {
+        Assert(pCq->cReserved);
+        pCq->cReserved--;
+
+        if (pReq->uSqGen == pSq->uGen)
+        {
+            if (   pReq->u8Opc == NVME_CMD_READ
+                && u16Status == NVME_SC_SUCCESS)
+                nvmeR3SegsCopy(pThis, &pReq->aGuestSegs[0], pReq->cGuestSegs,
+                               pReq->DataSeg.pvSeg, pReq->cbTransfer, true /* fToGuest */);
+            nvmeR3CqPost(pThis, pCq, pSq, pReq->u16Cid, u16Status, 0);
+        }
+    }
+
+    PDMCritSectLeave(&pCq->CritSect);
+    nvmeR3IntxUpdateLocked(pThis);
+
+    if (pReq->DataSeg.pvSeg)
+        RTMemPageFree(pReq->DataSeg.pvSeg, pReq->DataSeg.cbSeg);
+    RTMemFree(pReq);
+
+    if (   !ASMAtomicDecU32(&pThis->cReqsActive)
+        && !ASMAtomicReadU32(&pThis->cThreadsActive)
+        && pThis->fSignalIdle)
+        PDMDevHlpAsyncNotificationCompleted(pThis->pDevInsR3);
+}
+
+/**
+ * Converts a VBox status code of a failed transfer to an NVMe status.
+ *
+ * @returns NVMe status code.
+ * @param   pReq        The request.
+ * @param   rcReq       The status code.
+ */
+static uint16_t nvmeR3StatusFromRc(PNVMEREQ pReq, int rcReq)
+{
+    if (RT_SUCCESS(rcReq))
+        return NVME_SC_SUCCESS;
+    if (pReq->u8Opc == NVME_CMD_READ)
+        return NVME_SC_UNRECOVERED_READ_ERROR;
+    if (pReq->u8Opc == NVME_CMD_WRITE)
+        return NVME_SC_WRITE_FAULT;
+    return NVME_SC_INTERNAL_ERROR;
+}
+
+/**
+ * @interface_method_impl{PDMIBLOCKASYNCPORT,pfnTransferCompleteNotify}
+ */
+static DECLCALLBACK(int) nvmeR3TransferCompleteNotify(PPDMIBLOCKASYNCPORT pInterface, void *pvUser, int rcReq)
+{
+    PNVME    pThis = PDMIBLOCKASYNCPORT_2_PNVME(pInterface);
+    PNVMEREQ pReq  = (PNVMEREQ)pvUser;
+
+    if (RT_FAILURE(rcReq))
+        LogRel(("nvme#%u: Request opcode %#x at offset %llu (%zu bytes) failed with %Rrc\n",
+                NVME_INSTANCE(pThis), pReq->u8Opc, pReq->uOffset, pReq->cbTransfer, rcReq));
+    nvmeR3ReqComplete(pThis, pReq, nvmeR3StatusFromRc(pReq, rcReq));
+    return VINF_SUCCESS;
+}
+
+/**
+ * Submits an I/O request to the attached disk.
+ *
+ * @param   pThis       The NVMe controller instance data.
+ * @param   pReq        The request.
+ */
+static void nvmeR3ReqSubmit(PNVME pThis, PNVMEREQ pReq)
+{
+    int rc;
+
+    if (pReq->u8Opc == NVME_CMD_READ)
+        pThis->Led.Asserted.s.fReading = pThis->Led.Actual.s.fReading = 1;
+    else if (pReq->u8Opc == NVME_CMD_WRITE)
+        pThis->Led.Asserted.s.fWriting = pThis->Led.Actual.s.fWriting = 1;
+
+    if (pThis->pDrvBlockAsync)
+    {
+        if (pReq->u8Opc == NVME_CMD_READ)
+            rc = pThis->pDrvBlockAsync->pfnStartRead(pThis->pDrvBlockAsync, pReq->uOffset,
+                                                     &pReq->DataSeg, 1, pReq->cbTransfer, pReq);
+        else if (pReq->u8Opc == NVME_CMD_WRITE)
+            rc = pThis->pDrvBlockAsync->pfnStartWrite(pThis->pDrvBlockAsync, pReq->uOffset,
+                                                      &pReq->DataSeg, 1, pReq->cbTransfer, pReq);
+        else
+            rc = pThis->pDrvBlockAsync->pfnStartFlush(pThis->pDrvBlockAsync, pReq);
+
+        if (rc == VINF_VD_ASYNC_IO_FINISHED)
+            nvmeR3ReqComplete(pThis, pReq, NVME_SC_SUCCESS);
+        else if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+            nvmeR3TransferCompleteNotify(&pThis->IPortAsync, pReq, rc);
+    }
+    else
+    {
+        if (pReq->u8Opc == NVME_CMD_READ)
+            rc = pThis->pDrvBlock->pfnRead(pThis->pDrvBlock, pReq->uOffset,
+                                           pReq->DataSeg.pvSeg, pReq->cbTransfer);
+        else if (pReq->u8Opc == NVME_CMD_WRITE)
+            rc = pThis->pDrvBlock->pfnWrite(pThis->pDrvBlock, pReq->uOffset,
+                                            pReq->DataSeg.pvSeg, pReq->cbTransfer);
+        else
+            rc = pThis->pDrvBlock->pfnFlush(pThis->pDrvBlock);
+
+        nvmeR3TransferCompleteNotify(&pThis->IPortAsync, pReq, rc);
+    }
+}
+
+/**
+ * Processes a command from an I/O submission queue.
+ *
+ * @param   pThis       The NVMe controller instance data.
+ * @param   pSq         The submission queue the command was fetched from.
+ * @param   pCmd        The command.
+ * @param   uSqGen      The submission queue generation.
+ * @param   uCqGen      The completion queue generation.
+ */
+static void nvmeR3IoCmdProcess(PNVME pThis, PNVMESQ pSq, PCNVMECMD pCmd, uint32_t uSqGen, uint32_t uCqGen)
+{
+    uint16_t u16Status  = NVME_SC_SUCCESS;
+    size_t   cbTransfer = 0;
+    uint64_t uOffset    = 0;
+
+    switch (pCmd->u8Opc)
+    {
+        case NVME_CMD_READ:
+        case NVME_CMD_WRITE:
+        {
+            uint64_t uLba    = RT_MAKE_U64(pCmd->au32Cdw[0], pCmd->au32Cdw[1]);
+            uint32_t cBlocks = (pCmd->au32Cdw[2] & 0xffff) + 1;
+
+            if (pCmd->u32Nsid != NVME_NSID || !pThis->pDrvBlock)
+                u16Status = NVME_SC_INVALID_NAMESPACE;
+            else if (   uLba >= pThis->cBlocks
+                     || cBlocks > pThis->cBlocks - uLba)
+                u16Status = NVME_SC_LBA_OUT_OF_RANGE;
+            else if ((uint64_t)cBlocks * pThis->cbBlock > NVME_TRANSFER_MAX)
+                u16Status = NVME_SC_INVALID_FIELD;
+            else if (pCmd->u8Opc == NVME_CMD_WRITE && pThis->fReadOnly)
+                u16Status = NVME_SC_WRITE_TO_RO_RANGE;
+            cbTransfer = (size_t)cBlocks * pThis->cbBlock;
+            uOffset    = uLba * pThis->cbBlock;
+            break;
+        }
+        case NVME_CMD_FLUSH:
+        {
+            if (   (pCmd->u32Nsid != NVME_NSID && pCmd->u32Nsid != NVME_NSID_ALL)
+                || !pThis->pDrvBlock)
+                u16Status = NVME_SC_INVALID_NAMESPACE;
+            break;
+        }
+        default:
+            u16Status = NVME_SC_INVALID_OPCODE;
+    }
+
+    unsigned cSegsMax = u16Status == NVME_SC_SUCCESS ? (unsigned)(cbTransfer / NVME_PAGE_SIZE + 2) : 1;
+    PNVMEREQ pReq = (PNVMEREQ)RTMemAllocZ(RT_OFFSETOF(NVMEREQ, aGuestSegs[cSegsMax]));
+    if (RT_UNLIKELY(!pReq))
+    {
+        /* Complete the command with an internal error using the completion queue entry reserved for it. */
+        LogRel(("nvme#%u: Out of memory while processing a command\n", NVME_INSTANCE(pThis)));
+        PNVMECQ pCq = &pThis->aCqs[pSq->uCqId];
+        int rc = PDMCritSectEnter(&pCq->CritSect, VERR_IGNORED);
+        AssertRC(rc);
+        if (uCqGen == pCq->uGen)
+        {
+            Assert(pCq->cReserved);
+            pCq->cReserved--;
+            if (uSqGen == pSq->uGen)
+                nvmeR3CqPost(pThis, pCq, pSq, pCmd->u16Cid, NVME_SC_INTERNAL_ERROR, 0);
+        }
+        PDMCritSectLeave(&pCq->CritSect);
+        nvmeR3IntxUpdateLocked(pThis);
+        return;
+    }
+
+    pReq->uSqId      = pSq->uId;
+    pReq->uCqId      = pSq->uCqId;
+    pReq->uSqGen     = uSqGen;
+    pReq->uCqGen     = uCqGen;
+    pReq->u16Cid     = pCmd->u16Cid;
+    pReq->u8Opc      = pCmd->u8Opc;
+    pReq->uOffset    = uOffset;
+    pReq->cbTransfer = cbTransfer;
+    ASMAtomicIncU32(&pThis->cReqsActive);
+
+    if (   u16Status == NVME_SC_SUCCESS
+        && cbTransfer)
+    {
+        u16Status = nvmeR3PrpToSegs(pThis, pCmd->u64Prp1, pCmd->u64Prp2, cbTransfer,
+                                    &pReq->aGuestSegs[0], cSegsMax, &pReq->cGuestSegs);
+        if (u16Status == NVME_SC_SUCCESS)
+        {
+            pReq->DataSeg.cbSeg = cbTransfer;
+            pReq->DataSeg.pvSeg = RTMemPageAlloc(cbTransfer);
+            if (RT_UNLIKELY(!pReq->DataSeg.pvSeg))
+                u16Status = NVME_SC_INTERNAL_ERROR;
+        }
+    }
+
+    if (u16Status != NVME_SC_SUCCESS)
+    {
+        Log(("nvme#%u: I/O command %#x on SQ %u failed with status %#x\n",
+             NVME_INSTANCE(pThis), pCmd->u8Opc, pSq->uId, u16Status));
+        nvmeR3ReqComplete(pThis, pReq, u16Status);
+        return;
+    }
+
+    if (pReq->u8Opc == NVME_CMD_READ)
+    {
+        STAM_REL_COUNTER_INC(&pThis->StatReqsRead);
+        STAM_REL_COUNTER_ADD(&pThis->StatBytesRead, cbTransfer);
+    }
+    else if (pReq->u8Opc == NVME_CMD_WRITE)
+    {
+        nvmeR3SegsCopy(pThis, &pReq->aGuestSegs[0], pReq->cGuestSegs,
+                       pReq->DataSeg.pvSeg, cbTransfer, false /* fToGuest */);
+        STAM_REL_COUNTER_INC(&pThis->StatReqsWrite);
+        STAM_REL_COUNTER_ADD(&pThis->StatBytesWritten, cbTransfer);
+    }
+    else
+        STAM_REL_COUNTER_INC(&pThis->StatReqsFlush);
+
+    nvmeR3ReqSubmit(pThis, pReq);
+}
+
+/**
+ * Checks whether the worker of a submission queue has something to do.
+ *
+ * @returns true if there are commands to fetch, false otherwise.
+ * @param   pSq         The submission queue.
+ */
+DECLINLINE(bool) nvmeR3SqHasWork(PNVMESQ pSq)
+{
+    return    pSq->cEntries
+           && !ASMAtomicReadBool(&pSq->fWaitCq)
+           && pSq->uHead != ASMAtomicReadU32(&pSq->uTail);
+}
+
+/**
+ * Fetches and processes all commands of an I/O submission queue.
+ *
+ * Each fetched command reserves an entry in the completion queue, so the
+ * completion can always be posted.  If the completion queue is full the
+ * worker waits for the guest to consume entries.
+ *
+ * @param   pThis       The NVMe controller instance data.
+ * @param   pSq         The submission queue.
+ */
+static void nvmeR3SqProcess(PNVME pThis, PNVMESQ pSq)
+{
+    for (;;)
+    {
+        NVMECMD  Cmd;
+        uint16_t uCqId = pSq->uCqId;
+        PNVMECQ  pCq   = &pThis->aCqs[uCqId];
+
+        int rc = PDMCritSectEnter(&pCq->CritSect, VERR_IGNORED);
+        AssertRC(rc);
+
+        /* The queue might have been deleted or recreated in the meantime. */
+        if (   !pSq->cEntries
+            || pSq->uCqId != uCqId
+            || !pCq->cEntries
+            || pSq->uHead == ASMAtomicReadU32(&pSq->uTail))
+        {
+            PDMCritSectLeave(&pCq->CritSect);
+            break;
+        }
+
+        if (!nvmeR3CqFree(pCq))
+        {
+            STAM_COUNTER_INC(&pThis->StatCqFull);
+            ASMAtomicWriteBool(&pSq->fWaitCq, true);
+            PDMCritSectLeave(&pCq->CritSect);
+
+            /* Recheck, the guest might have freed entries before seeing the flag. */
+            rc = PDMCritSectEnter(&pCq->CritSect, VERR_IGNORED);
+            AssertRC(rc);
+            bool fRetry = pCq->cEntries && nvmeR3CqFree(pCq) && ASMAtomicXchgBool(&pSq->fWaitCq, false);
+            PDMCritSectLeave(&pCq->CritSect);
+            if (fRetry)
+                continue;
+            break;
+        }
+
+        pCq->cReserved++;
+        PDMDevHlpPhysRead(pThis->CTX_SUFF(pDevIns), pSq->GCPhysBase + pSq->uHead * NVME_SQE_SIZE,
+                          &Cmd, sizeof(Cmd));
+        pSq->uHead = (pSq->uHead + 1) % pSq->cEntries;
+        uint32_t uSqGen = pSq->uGen;
+        uint32_t uCqGen = pCq->uGen;
+
+        PDMCritSectLeave(&pCq->CritSect);
+
+        nvmeR3IoCmdProcess(pThis, pSq, &Cmd, uSqGen, uCqGen);
+    }
+}
+
+/**
+ * Checks whether all requests completed and no worker is busy.
+ *
+ * @returns true if the controller is idle, false otherwise.
+ * @param   pThis       The NVMe controller instance data.
+ */
+DECLINLINE(bool) nvmeR3IsIdle(PNVME pThis)
+{
+    return    !ASMAtomicReadU32(&pThis->cReqsActive)
+           && !ASMAtomicReadU32(&pThis->cThreadsActive);
+}
+
+/**
+ * The worker thread of an I/O submission queue.
+ *
+ * @returns VBox status code.
+ * @param   pDevIns     The device instance.
+ * @param   pThread     The thread, pvUser points to the submission queue.
+ */
+static DECLCALLBACK(int) nvmeR3SqWorker(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
+{
+    PNVME   pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    PNVMESQ pSq   = (PNVMESQ)pThread->pvUser;
+
+    if (pThread->enmState == PDMTHREADSTATE_INITIALIZING)
+        return VINF_SUCCESS;
+
+    while (pThread->enmState == PDMTHREADSTATE_RUNNING)
+    {
+        ASMAtomicWriteBool(&pSq->fWrkThreadSleeping, true);
+        if (!nvmeR3SqHasWork(pSq))
+        {
+            int rc = SUPSemEventWaitNoResume(pThis->pSupDrvSession, pSq->hEvtProcess, RT_INDEFINITE_WAIT);
+            AssertLogRelMsgReturn(RT_SUCCESS(rc) || rc == VERR_INTERRUPTED, ("%Rrc\n", rc), rc);
+            if (RT_UNLIKELY(pThread->enmState != PDMTHREADSTATE_RUNNING))
+                break;
+        }
+        ASMAtomicWriteBool(&pSq->fWrkThreadSleeping, false);
+
+        ASMAtomicIncU32(&pThis->cThreadsActive);
+        nvmeR3SqProcess(pThis, pSq);
+        if (   !ASMAtomicDecU32(&pThis->cThreadsActive)
+            && !ASMAtomicReadU32(&pThis->cReqsActive)
+            && pThis->fSignalIdle)
+            PDMDevHlpAsyncNotificationCompleted(pDevIns);
+    }
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Wakes up the worker thread of a submission queue for termination.
+ *
+ * @returns VBox status code.
+ * @param   pDevIns     The device instance.
+ * @param   pThread     The thread.
+ */
+static DECLCALLBACK(int) nvmeR3SqWorkerWakeUp(PPDMDEVINS pDevIns, PPDMTHREAD pThread)
+{
+    PNVME   pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    PNVMESQ pSq   = (PNVMESQ)pThread->pvUser;
+    return SUPSemEventSignal(pThis->pSupDrvSession, pSq->hEvtProcess);
+}
+
+
+/* -=-=-=-=- Admin commands -=-=-=-=- */
+
+/**
+ * Copies a string into a space padded identify data field.
+ */
+static void nvmeR3PadString(uint8_t *pbDst, const char *pszSrc, size_t cbDst)
+{
+    size_t cchSrc = RT_MIN(strlen(pszSrc), cbDst);
+    memcpy(pbDst, pszSrc, cchSrc);
+    memset(pbDst + cchSrc, ' ', cbDst - cchSrc);
+}
+
+/**
+ * Executes the identify command.
+ */
+static uint16_t nvmeR3AdmIdentify(PNVME pThis, PCNVMECMD pCmd)
+{
+    uint8_t abData[NVME_PAGE_SIZE];
+    RT_ZERO(abData);
+
+    switch (pCmd->au32Cdw[0] & 0xff)
+    {
+        case 0: /* Namespace */
+        {
+            if (pCmd->u32Nsid != NVME_NSID)
+                return NVME_SC_INVALID_NAMESPACE;
+            *(uint64_t *)&abData[0]   = pThis->cBlocks;                  /* NSZE */
+            *(uint64_t *)&abData[8]   = pThis->cBlocks;                  /* NCAP */
+            *(uint64_t *)&abData[16]  = pThis->cBlocks;                  /* NUSE */
+            *(uint32_t *)&abData[128] = (ASMBitFirstSetU32(pThis->cbBlock) - 1) << 16; /* LBAF0.LBADS */
+            break;
+        }
+        case 1: /* Controller */
+        {
+            *(uint16_t *)&abData[0]   = 0x80ee;                          /* VID */
+            *(uint16_t *)&abData[2]   = 0x80ee;                          /* SSVID */
+            nvmeR3PadString(&abData[4],  pThis->szSerialNumber,     NVME_SERIAL_NUMBER_LENGTH);
+            nvmeR3PadString(&abData[24], pThis->szModelNumber,      NVME_MODEL_NUMBER_LENGTH);
+            nvmeR3PadString(&abData[64], pThis->szFirmwareRevision, NVME_FIRMWARE_REVISION_LENGTH);
+            abData[77]                = NVME_MDTS;                       /* MDTS */
+            abData[258]               = 3;                               /* ACL: 4 aborts */
+            abData[259]               = NVME_AER_MAX - 1;                /* AERL */
+            abData[260]               = 0x02;                            /* FRMW: 1 slot */
+            abData[512]               = 0x66;                            /* SQES */
+            abData[513]               = 0x44;                            /* CQES */
+            *(uint32_t *)&abData[516] = 1;                               /* NN */
+            abData[525]               = 1;                               /* VWC */
+            *(uint16_t *)&abData[2048] = 2500;                           /* PSD0.MP: 25W */
+            break;
+        }
+        case 2: /* Active namespace list */
+        {
+            if (pCmd->u32Nsid < NVME_NSID)
+                *(uint32_t *)&abData[0] = NVME_NSID;
+            break;
+        }
+        default:
+            return NVME_SC_INVALID_FIELD;
+    }
+
+    return nvmeR3AdminCopyToGuest(pThis, pCmd, &abData[0], sizeof(abData));
+}
+
+/**
+ * Executes the get log page command.
+ */
+static uint16_t nvmeR3AdmGetLogPage(PNVME pThis, PCNVMECMD pCmd)
+{
+    uint8_t  abData[NVME_PAGE_SIZE];
+    uint8_t  uLid   = pCmd->au32Cdw[0] & 0xff;
+    size_t   cbLog  = ((size_t)((pCmd->au32Cdw[0] >> 16) & 0xfff) + 1) * sizeof(uint32_t);
+
+    RT_ZERO(abData);
+    switch (uLid)
+    {
+        case 1: /* Error information, no errors. */
+        case 3: /* Firmware slot information. */
+            break;
+        case 2: /* SMART / health information. */
+            *(uint16_t *)&abData[1] = 273 + 40;                          /* Composite temperature: 40 C */
+            abData[3]               = 100;                               /* Available spare */
+            abData[4]               = 10;                                /* Available spare threshold */
+            break;
+        default:
+            return NVME_SC_INVALID_LOG_PAGE;
+    }
+
+    return nvmeR3AdminCopyToGuest(pThis, pCmd, &abData[0], RT_MIN(cbLog, sizeof(abData)));
+}
+
+/**
+ * Executes the create I/O completion queue command.
+ */
+static uint16_t nvmeR3AdmCreateIoCq(PNVME pThis, PCNVMECMD pCmd)
+{
+    uint16_t uQid     = pCmd->au32Cdw[0] & 0xffff;
+    uint32_t cEntries = (pCmd->au32Cdw[0] >> 16) + 1;
+    bool     fPc      = RT_BOOL(pCmd->au32Cdw[1] & RT_BIT_32(0));
+    bool     fIen     = RT_BOOL(pCmd->au32Cdw[1] & RT_BIT_32(1));
+    uint16_t uIv      = pCmd->au32Cdw[1] >> 16;
+
+    if (   uQid == 0
+        || uQid > pThis->cIoQueues
+        || pThis->aCqs[uQid].cEntries)
+        return NVME_SC_INVALID_QUEUE_ID;
+    if (cEntries < 2 || cEntries > NVME_QUEUE_ENTRIES_MAX)
+        return NVME_SC_MAX_QUEUE_SIZE_EXCEEDED;
+    if (uIv >= RT_MAX(pThis->cMsixVectors, 1))
+        return NVME_SC_INVALID_INT_VECTOR;
+    if (   !fPc
+        || (pCmd->u64Prp1 & NVME_PAGE_OFFSET_MASK)
+        || NVME_CC_IOCQES_GET(pThis->u32Cc) != 4)
+        return NVME_SC_INVALID_FIELD;
+
+    PNVMECQ pCq = &pThis->aCqs[uQid];
+    int rc = PDMCritSectEnter(&pCq->CritSect, VERR_IGNORED);
+    AssertRC(rc);
+    pCq->GCPhysBase = pCmd->u64Prp1;
+    pCq->uTail      = 0;
+    pCq->uHead      = 0;
+    pCq->cReserved  = 0;
+    pCq->cSqs       = 0;
+    pCq->uIv        = uIv;
+    pCq->fIen       = fIen;
+    pCq->fPhase     = true;
+    pCq->cEntries   = cEntries;
+    PDMCritSectLeave(&pCq->CritSect);
+
+    Log(("nvme#%u: Created CQ %u with %u entries at %RGp, vector %u\n",
+         NVME_INSTANCE(pThis), uQid, cEntries, pCq->GCPhysBase, uIv));
+    return NVME_SC_SUCCESS;
+}
+
+/**
+ * Executes the create I/O submission queue command.
+ */
+static uint16_t nvmeR3AdmCreateIoSq(PNVME pThis, PCNVMECMD pCmd)
+{
+    uint16_t uQid     = pCmd->au32Cdw[0] & 0xffff;
+    uint32_t cEntries = (pCmd->au32Cdw[0] >> 16) + 1;
+    bool     fPc      = RT_BOOL(pCmd->au32Cdw[1] & RT_BIT_32(0));
+    uint16_t uCqId    = pCmd->au32Cdw[1] >> 16;
+
+    if (   uQid == 0
+        || uQid > pThis->cIoQueues
+        || pThis->aSqs[uQid].cEntries)
+        return NVME_SC_INVALID_QUEUE_ID;
+    if (   uCqId == 0
+        || uCqId >= RT_ELEMENTS(pThis->aCqs)
+        || !pThis->aCqs[uCqId].cEntries)
+        return NVME_SC_CQ_INVALID;
+    if (cEntries < 2 || cEntries > NVME_QUEUE_ENTRIES_MAX)
+        return NVME_SC_MAX_QUEUE_SIZE_EXCEEDED;
+    if (   !fPc
+        || (pCmd->u64Prp1 & NVME_PAGE_OFFSET_MASK)
+        || NVME_CC_IOSQES_GET(pThis->u32Cc) != 6)
+        return NVME_SC_INVALID_FIELD;
+
+    PNVMESQ pSq = &pThis->aSqs[uQid];
+    PNVMECQ pCq = &pThis->aCqs[uCqId];
+    int rc = PDMCritSectEnter(&pCq->CritSect, VERR_IGNORED);
+    AssertRC(rc);
+    pSq->GCPhysBase = pCmd->u64Prp1;
+    pSq->uHead      = 0;
+    pSq->uTail      = 0;
+    pSq->uCqId      = uCqId;
+    pSq->fWaitCq    = false;
+    pSq->cEntries   = cEntries;
+    pCq->cSqs++;
+    PDMCritSectLeave(&pCq->CritSect);
+
+    Log(("nvme#%u: Created SQ %u with %u entries at %RGp for CQ %u\n",
+         NVME_INSTANCE(pThis), uQid, cEntries, pSq->GCPhysBase, uCqId));
+    return NVME_SC_SUCCESS;
+}
+
+/**
+ * Deletes an I/O submission queue, the commands still in flight are dropped.
+ *
+ * @param   pThis       The NVMe controller instance data.
+ * @param   pSq         The submission queue.
+ */
+static void nvmeR3SqDelete(PNVME pThis, PNVMESQ pSq)
+{
+    PNVMECQ pCq = &pThis->aCqs[pSq->uCqId];
+    int rc = PDMCritSectEnter(&pCq->CritSect, VERR_IGNORED);
+    AssertRC(rc);
+    pSq->cEntries = 0;
+    pSq->uGen++;
+    Assert(pCq->cSqs);
+    pCq->cSqs--;
+    PDMCritSectLeave(&pCq->CritSect);
+}
+
+/**
+ * Deletes a completion queue.
+ *
+ * @param   pCq         The completion queue.
+ */
+static void nvmeR3CqDelete(PNVMECQ pCq)
+{
+    int rc = PDMCritSectEnter(&pCq->CritSect, VERR_IGNORED);
+    AssertRC(rc);
+    pCq->cEntries  = 0;
+    pCq->cReserved = 0;
+    pCq->cSqs      = 0;
+    pCq->uGen++;
+    PDMCritSectLeave(&pCq->CritSect);
+}
+
+/**
+ * Executes the set and get features commands.
+ */
+static uint16_t nvmeR3AdmFeatures(PNVME pThis, PCNVMECMD pCmd, bool fSet, uint32_t *pu32Dw0)
+{
+    uint8_t  uFid  = pCmd->au32Cdw[0] & 0xff;
+    uint32_t uCdw11 = pCmd->au32Cdw[1];
+
+    switch (uFid)
+    {
+        case NVME_FEAT_NUM_QUEUES:
+        {
+            if (fSet)
+            {
+                uint32_t cSqs = (uCdw11 & 0xffff) + 1;
+                uint32_t cCqs = (uCdw11 >> 16) + 1;
+                if (cSqs > 0xffff || cCqs > 0xffff)
+                    return NVME_SC_INVALID_FIELD;
+                /* Only changeable as long as no I/O queues exist. */
+                bool fQueues = false;
+                for (unsigned i = 1; i < RT_ELEMENTS(pThis->aCqs); i++)
+                    fQueues |= pThis->aCqs[i].cEntries != 0;
+                if (!fQueues)
+                    pThis->cIoQueues = RT_MAX(RT_MIN(RT_MAX(cSqs, cCqs), pThis->cIoQueuesMax), 1);
+            }
+            *pu32Dw0 = (pThis->cIoQueues - 1) | ((pThis->cIoQueues - 1) << 16);
+            return NVME_SC_SUCCESS;
+        }
+        case NVME_FEAT_INT_VECTOR_CONFIG:
+        {
+            if ((uCdw11 & 0xffff) >= RT_MAX(pThis->cMsixVectors, 1))
+                return NVME_SC_INVALID_FIELD;
+            if (!fSet)
+                uCdw11 &= 0xffff;
+            *pu32Dw0 = uCdw11;
+            return NVME_SC_SUCCESS;
+        }
+        case NVME_FEAT_ARBITRATION:
+        case NVME_FEAT_POWER_MGMT:
+        case NVME_FEAT_TEMP_THRESHOLD:
+        case NVME_FEAT_ERROR_RECOVERY:
+        case NVME_FEAT_VOLATILE_WC:
+        case NVME_FEAT_INT_COALESCING:
+        case NVME_FEAT_WRITE_ATOMICITY:
+        case NVME_FEAT_ASYNC_EVENT_CONFIG:
+        {
+            if (fSet)
+                pThis->au32Features[uFid] = uCdw11;
+            *pu32Dw0 = pThis->au32Features[uFid];
+            return NVME_SC_SUCCESS;
+        }
+        default:
+            return NVME_SC_INVALID_FIELD;
+    }
+}
+
+/**
+ * Executes an admin command.
+ *
+ * @returns NVMe status code, NVME_SC_NO_COMPLETION if the command stays outstanding.
+ * @param   pThis       The NVMe controller instance data.
+ * @param   pCmd        The command.
+ * @param   pu32Dw0     Where to store the command specific result.
+ */
+static uint16_t nvmeR3AdminCmdExecute(PNVME pThis, PCNVMECMD pCmd, uint32_t *pu32Dw0)
+{
+    STAM_REL_COUNTER_INC(&pThis->StatAdminCmds);
+    Log(("nvme#%u: Admin command %#x cid=%#x\n", NVME_INSTANCE(pThis), pCmd->u8Opc, pCmd->u16Cid));
+
+    switch (pCmd->u8Opc)
+    {
+        case NVME_ADM_IDENTIFY:
+            return nvmeR3AdmIdentify(pThis, pCmd);
+        case NVME_ADM_GET_LOG_PAGE:
+            return nvmeR3AdmGetLogPage(pThis, pCmd);
+        case NVME_ADM_CREATE_IO_CQ:
+            return nvmeR3AdmCreateIoCq(pThis, pCmd);
+        case NVME_ADM_CREATE_IO_SQ:
+            return nvmeR3AdmCreateIoSq(pThis, pCmd);
+        case NVME_ADM_DELETE_IO_SQ:
+        {
+            uint16_t uQid = pCmd->au32Cdw[0] & 0xffff;
+            if (   uQid == 0
+                || uQid >= RT_ELEMENTS(pThis->aSqs)
+                || !pThis->aSqs[uQid].cEntries)
+                return NVME_SC_INVALID_QUEUE_ID;
+            nvmeR3SqDelete(pThis, &pThis->aSqs[uQid]);
+            return NVME_SC_SUCCESS;
+        }
+        case NVME_ADM_DELETE_IO_CQ:
+        {
+            uint16_t uQid = pCmd->au32Cdw[0] & 0xffff;
+            if (   uQid == 0
+                || uQid >= RT_ELEMENTS(pThis->aCqs)
+                || !pThis->aCqs[uQid].cEntries)
+                return NVME_SC_INVALID_QUEUE_ID;
+            if (pThis->aCqs[uQid].cSqs)
+                return NVME_SC_INVALID_QUEUE_DELETION;
+            nvmeR3CqDelete(&pThis->aCqs[uQid]);
+            return NVME_SC_SUCCESS;
+        }
+        case NVME_ADM_SET_FEATURES:
+            return nvmeR3AdmFeatures(pThis, pCmd, true /* fSet */, pu32Dw0);
+        case NVME_ADM_GET_FEATURES:
+            return nvmeR3AdmFeatures(pThis, pCmd, false /* fSet */, pu32Dw0);
+        case NVME_ADM_ABORT:
+            /* Commands are never aborted, they complete quickly enough. */
+            *pu32Dw0 = 1;
+            return NVME_SC_SUCCESS;
+        case NVME_ADM_ASYNC_EVENT_REQUEST:
+            /* We don't generate any events, the request stays outstanding. */
+            if (pThis->cAers >= NVME_AER_MAX)
+                return NVME_SC_AER_LIMIT_EXCEEDED;
+            pThis->au16AerCids[pThis->cAers++] = pCmd->u16Cid;
+            return NVME_SC_NO_COMPLETION;
+        default:
+            return NVME_SC_INVALID_OPCODE;
+    }
+}
+
+/**
+ * Processes the admin submission queue.
+ *
+ * @param   pThis       The NVMe controller instance data, the caller owns the lock.
+ */
+static void nvmeR3AdminProcess(PNVME pThis)
+{
+    PNVMESQ pSq = &pThis->aSqs[0];
+    PNVMECQ pCq = &pThis->aCqs[0];
+
+    while (   pSq->cEntries
+           && pSq->uHead != ASMAtomicReadU32(&pSq->uTail))
+    {
+        NVMECMD Cmd;
+
+        if (!nvmeR3CqFree(pCq))
+        {
+            ASMAtomicWriteBool(&pSq->fWaitCq, true);
+            break;
+        }
+
+        PDMDevHlpPhysRead(pThis->CTX_SUFF(pDevIns), pSq->GCPhysBase + pSq->uHead * NVME_SQE_SIZE,
+                          &Cmd, sizeof(Cmd));
+        pSq->uHead = (pSq->uHead + 1) % pSq->cEntries;
+
+        uint32_t u32Dw0    = 0;
+        uint16_t u16Status = nvmeR3AdminCmdExecute(pThis, &Cmd, &u32Dw0);
+        if (u16Status != NVME_SC_NO_COMPLETION)
+        {
+            int rc = PDMCritSectEnter(&pCq->CritSect, VERR_IGNORED);
+            AssertRC(rc);
+            nvmeR3CqPost(pThis, pCq, pSq, Cmd.u16Cid, u16Status, u32Dw0);
+            PDMCritSectLeave(&pCq->CritSect);
+        }
+    }
+
+    nvmeIntxUpdate(pThis);
+}
+
+
+/* -=-=-=-=- Controller registers -=-=-=-=- */
+
+/**
+ * Resets the controller state, deleting all queues.
+ *
+ * Requests still in flight are dropped when they complete.
+ *
+ * @param   pThis       The NVMe controller instance data, the caller owns the lock.
+ */
+static void nvmeR3CtrlReset(PNVME pThis)
+{
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aSqs); i++)
+        if (pThis->aSqs[i].cEntries)
+            nvmeR3SqDelete(pThis, &pThis->aSqs[i]);
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aCqs); i++)
+        nvmeR3CqDelete(&pThis->aCqs[i]);
+
+    pThis->cAers      = 0;
+    pThis->cIoQueues  = pThis->cIoQueuesMax;
+    pThis->u32IntMask = 0;
+    RT_ZERO(pThis->au32Features);
+    pThis->au32Features[NVME_FEAT_TEMP_THRESHOLD] = 273 + 70;
+    pThis->au32Features[NVME_FEAT_VOLATILE_WC]    = 1;
+    ASMAtomicAndU32(&pThis->u32Csts, ~(NVME_CSTS_RDY | NVME_CSTS_CFS));
+    nvmeIntxUpdate(pThis);
+}
+
+/**
+ * Enables the controller, setting up the admin queues.
+ *
+ * @param   pThis       The NVMe controller instance data, the caller owns the lock.
+ */
+static void nvmeR3CtrlEnable(PNVME pThis)
+{
+    uint32_t cSqEntries = (pThis->u32Aqa & 0xfff) + 1;
+    uint32_t cCqEntries = ((pThis->u32Aqa >> 16) & 0xfff) + 1;
+
+    if (   (pThis->u32Cc & (NVME_CC_CSS_MASK | NVME_CC_MPS_MASK | NVME_CC_AMS_MASK))
+        || cSqEntries < 2
+        || cCqEntries < 2
+        || (pThis->u64Asq & NVME_PAGE_OFFSET_MASK)
+        || (pThis->u64Acq & NVME_PAGE_OFFSET_MASK))
+    {
+        LogRel(("nvme#%u: Invalid controller configuration CC=%#x AQA=%#x ASQ=%#RX64 ACQ=%#RX64\n",
+                NVME_INSTANCE(pThis), pThis->u32Cc, pThis->u32Aqa, pThis->u64Asq, pThis->u64Acq));
+        ASMAtomicOrU32(&pThis->u32Csts, NVME_CSTS_CFS);
+        return;
+    }
+
+    PNVMECQ pCq = &pThis->aCqs[0];
+    pCq->GCPhysBase = pThis->u64Acq;
+    pCq->uTail      = 0;
+    pCq->uHead      = 0;
+    pCq->cReserved  = 0;
+    pCq->cSqs       = 1;
+    pCq->uIv        = 0;
+    pCq->fIen       = true;
+    pCq->fPhase     = true;
+    pCq->cEntries   = cCqEntries;
+
+    PNVMESQ pSq = &pThis->aSqs[0];
+    pSq->GCPhysBase = pThis->u64Asq;
+    pSq->uHead      = 0;
+    pSq->uTail      = 0;
+    pSq->uCqId      = 0;
+    pSq->fWaitCq    = false;
+    pSq->cEntries   = cSqEntries;
+
+    ASMAtomicAndU32(&pThis->u32Csts, ~NVME_CSTS_SHST_MASK);
+    ASMAtomicOrU32(&pThis->u32Csts, NVME_CSTS_RDY);
+}
+
+/**
+ * Writes a controller register, R3 part.
+ *
+ * @returns VBox status code.
+ * @param   pThis       The NVMe controller instance data.
+ * @param   offReg      The register offset.
+ * @param   u32Value    The value written.
+ */
+static int nvmeR3RegWrite(PNVME pThis, uint32_t offReg, uint32_t u32Value)
+{
+    int rc = PDMCritSectEnter(&pThis->lock, VINF_IOM_R3_MMIO_WRITE);
+    if (rc != VINF_SUCCESS)
+        return rc;
+
+    switch (offReg)
+    {
+        case NVME_REG_INTMS:
+            pThis->u32IntMask |= u32Value;
+            nvmeIntxUpdate(pThis);
+            break;
+        case NVME_REG_INTMC:
+            pThis->u32IntMask &= ~u32Value;
+            nvmeIntxUpdate(pThis);
+            break;
+        case NVME_REG_CC:
+        {
+            uint32_t u32CcOld = pThis->u32Cc;
+            pThis->u32Cc = u32Value & NVME_CC_WRITABLE_MASK;
+
+            if (!(u32CcOld & NVME_CC_EN) && (u32Value & NVME_CC_EN))
+                nvmeR3CtrlEnable(pThis);
+            else if ((u32CcOld & NVME_CC_EN) && !(u32Value & NVME_CC_EN))
+                nvmeR3CtrlReset(pThis);
+
+            if (   (u32Value & NVME_CC_SHN_MASK)
+                && !(u32CcOld & NVME_CC_SHN_MASK))
+            {
+                /* Shutdown notification, make sure everything is on the disk. */
+                LogRel(("nvme#%u: Shutdown notification\n", NVME_INSTANCE(pThis)));
+                if (pThis->pDrvBlock)
+                    pThis->pDrvBlock->pfnFlush(pThis->pDrvBlock);
+                ASMAtomicAndU32(&pThis->u32Csts, ~NVME_CSTS_SHST_MASK);
+                ASMAtomicOrU32(&pThis->u32Csts, NVME_CSTS_SHST_COMPLETE);
+            }
+            break;
+        }
+        case NVME_REG_AQA:
+            pThis->u32Aqa = u32Value & UINT32_C(0x0fff0fff);
+            break;
+        case NVME_REG_ASQ:
+            pThis->u64Asq = RT_MAKE_U64(u32Value & ~NVME_PAGE_OFFSET_MASK, RT_HI_U32(pThis->u64Asq));
+            break;
+        case NVME_REG_ASQ + 4:
+            pThis->u64Asq = RT_MAKE_U64(RT_LO_U32(pThis->u64Asq), u32Value);
+            break;
+        case NVME_REG_ACQ:
+            pThis->u64Acq = RT_MAKE_U64(u32Value & ~NVME_PAGE_OFFSET_MASK, RT_HI_U32(pThis->u64Acq));
+            break;
+        case NVME_REG_ACQ + 4:
+            pThis->u64Acq = RT_MAKE_U64(RT_LO_U32(pThis->u64Acq), u32Value);
+            break;
+        default:
+            Log(("nvme#%u: Ignoring write to register %#x (value %#x)\n", NVME_INSTANCE(pThis), offReg, u32Value));
+    }
+
+    PDMCritSectLeave(&pThis->lock);
+    return VINF_SUCCESS;
+}
+
+
+/* -=-=-=-=- PCI -=-=-=-=- */
+
+/**
+ * @callback_method_impl{FNPCIIOREGIONMAP}
+ */
+static DECLCALLBACK(int) nvmeR3MMIOMap(PPCIDEVICE pPciDev, int iRegion, RTGCPHYS GCPhysAddress, uint32_t cb, PCIADDRESSSPACE enmType)
+{
+    PPDMDEVINS pDevIns = pPciDev->pDevIns;
+    PNVME      pThis   = PDMINS_2_DATA(pDevIns, PNVME);
+    int        rc;
+
+    Log2(("%s: registering MMIO area at GCPhysAddr=%RGp cb=%u\n", __FUNCTION__, GCPhysAddress, cb));
+    Assert(cb >= NVME_MMIO_SIZE);
+    NOREF(iRegion); NOREF(enmType);
+
+    rc = PDMDevHlpMMIORegister(pDevIns, GCPhysAddress, cb, NULL /*pvUser*/,
+                               IOMMMIO_FLAGS_READ_DWORD_QWORD | IOMMMIO_FLAGS_WRITE_ONLY_DWORD_QWORD,
+                               nvmeMMIOWrite, nvmeMMIORead, "NVMe");
+    if (RT_FAILURE(rc))
+        return rc;
+
+    if (pThis->fR0Enabled)
+    {
+        rc = PDMDevHlpMMIORegisterR0(pDevIns, GCPhysAddress, cb, NIL_RTR0PTR /*pvUser*/, "nvmeMMIOWrite", "nvmeMMIORead");
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+
+    pThis->GCPhysMMIO = GCPhysAddress;
+    return rc;
+}
+
+
+/* -=-=-=-=- Interfaces -=-=-=-=- */
+
+/**
+ * @interface_method_impl{PDMILEDPORTS,pfnQueryStatusLed}
+ */
+static DECLCALLBACK(int) nvmeR3Status_QueryStatusLed(PPDMILEDPORTS pInterface, unsigned iLUN, PPDMLED *ppLed)
+{
+    PNVME pThis = PDMILEDPORTS_2_PNVME(pInterface);
+    if (iLUN == 0)
+    {
+        *ppLed = &pThis->Led;
+        Assert((*ppLed)->u32Magic == PDMLED_MAGIC);
+        return VINF_SUCCESS;
+    }
+    return VERR_PDM_LUN_NOT_FOUND;
+}
+
+/**
+ * @interface_method_impl{PDMIBASE,pfnQueryInterface, Status LUN}
+ */
+static DECLCALLBACK(void *) nvmeR3Status_QueryInterface(PPDMIBASE pInterface, const char *pszIID)
+{
+    PNVME pThis = PDMIBASE_2_PNVME(pInterface);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBASE, &pThis->IBase);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMILEDPORTS, &pThis->ILeds);
+    return NULL;
+}
+
+/**
+ * @interface_method_impl{PDMIBASE,pfnQueryInterface, Disk LUN}
+ */
+static DECLCALLBACK(void *) nvmeR3Disk_QueryInterface(PPDMIBASE pInterface, const char *pszIID)
+{
+    PNVME pThis = PDMIBASEDISK_2_PNVME(pInterface);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBASE, &pThis->IBaseDisk);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBLOCKPORT, &pThis->IPort);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBLOCKASYNCPORT, &pThis->IPortAsync);
+    return NULL;
+}
+
+/**
+ * @interface_method_impl{PDMIBLOCKPORT,pfnQueryDeviceLocation}
+ */
+static DECLCALLBACK(int) nvmeR3QueryDeviceLocation(PPDMIBLOCKPORT pInterface, const char **ppcszController,
+                                                   uint32_t *piInstance, uint32_t *piLUN)
+{
+    PNVME      pThis   = PDMIBLOCKPORT_2_PNVME(pInterface);
+    PPDMDEVINS pDevIns = pThis->pDevInsR3;
+
+    AssertPtrReturn(ppcszController, VERR_INVALID_POINTER);
+    AssertPtrReturn(piInstance, VERR_INVALID_POINTER);
+    AssertPtrReturn(piLUN, VERR_INVALID_POINTER);
+
+    *ppcszController = pDevIns->pReg->szName;
+    *piInstance = pDevIns->iInstance;
+    *piLUN = 0;
+
+    return VINF_SUCCESS;
+}
+
+
+/* -=-=-=-=- Saved State -=-=-=-=- */
+
+/**
+ * @callback_method_impl{FNSSMDEVLIVEEXEC}
+ */
+static DECLCALLBACK(int) nvmeR3LiveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint32_t uPass)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    SSMR3PutU32(pSSM, pThis->cIoQueuesMax);
+    SSMR3PutU32(pSSM, pThis->cMsixVectors);
+    SSMR3PutBool(pSSM, pThis->pDrvBase != NULL);
+    SSMR3PutStrZ(pSSM, pThis->szSerialNumber);
+    return VINF_SSM_DONT_CALL_AGAIN;
+}
+
+/**
+ * @callback_method_impl{FNSSMDEVSAVEEXEC}
+ */
+static DECLCALLBACK(int) nvmeR3SaveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    /* The controller was quiesced when the VM was suspended. */
+    Assert(nvmeR3IsIdle(pThis));
+
+    nvmeR3LiveExec(pDevIns, pSSM, SSM_PASS_FINAL);
+
+    SSMR3PutU32(pSSM, pThis->u32Cc);
+    SSMR3PutU32(pSSM, pThis->u32Csts);
+    SSMR3PutU32(pSSM, pThis->u32Aqa);
+    SSMR3PutU64(pSSM, pThis->u64Asq);
+    SSMR3PutU64(pSSM, pThis->u64Acq);
+    SSMR3PutU32(pSSM, pThis->u32IntMask);
+    SSMR3PutU32(pSSM, pThis->cIoQueues);
+    SSMR3PutMem(pSSM, pThis->au32Features, sizeof(pThis->au32Features));
+    SSMR3PutU32(pSSM, pThis->cAers);
+    SSMR3PutMem(pSSM, pThis->au16AerCids, sizeof(pThis->au16AerCids));
+
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aCqs); i++)
+    {
+        PNVMECQ pCq = &pThis->aCqs[i];
+        SSMR3PutGCPhys(pSSM, pCq->GCPhysBase);
+        SSMR3PutU32(pSSM, pCq->cEntries);
+        SSMR3PutU32(pSSM, pCq->uTail);
+        SSMR3PutU32(pSSM, pCq->uHead);
+        SSMR3PutU32(pSSM, pCq->cSqs);
+        SSMR3PutU16(pSSM, pCq->uIv);
+        SSMR3PutBool(pSSM, pCq->fIen);
+        SSMR3PutBool(pSSM, pCq->fPhase);
+    }
+
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aSqs); i++)
+    {
+        PNVMESQ pSq = &pThis->aSqs[i];
+        SSMR3PutGCPhys(pSSM, pSq->GCPhysBase);
+        SSMR3PutU32(pSSM, pSq->cEntries);
+        SSMR3PutU32(pSSM, pSq->uHead);
+        SSMR3PutU32(pSSM, pSq->uTail);
+        SSMR3PutU16(pSSM, pSq->uCqId);
+    }
+
+    return SSMR3PutU32(pSSM, UINT32_MAX); /* sanity/terminator */
+}
+
+/**
+ * @callback_method_impl{FNSSMDEVLOADEXEC}
+ */
+static DECLCALLBACK(int) nvmeR3LoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t uPass)
+{
+    PNVME    pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    uint32_t u32;
+    bool     fAttached;
+    int      rc;
+
+    if (uVersion != NVME_SAVED_STATE_VERSION)
+        return VERR_SSM_UNSUPPORTED_DATA_UNIT_VERSION;
+
+    /* config checks */
+    rc = SSMR3GetU32(pSSM, &u32);
+    AssertRCReturn(rc, rc);
+    if (u32 != pThis->cIoQueuesMax)
+        return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("Config mismatch - saved NumQueues=%u; configured NumQueues=%u"),
+                                u32, pThis->cIoQueuesMax);
+    rc = SSMR3GetU32(pSSM, &u32);
+    AssertRCReturn(rc, rc);
+    if (u32 != pThis->cMsixVectors)
+        return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("Config mismatch - saved %u MSI-X vectors; configured %u"),
+                                u32, pThis->cMsixVectors);
+    rc = SSMR3GetBool(pSSM, &fAttached);
+    AssertRCReturn(rc, rc);
+    if (fAttached != (pThis->pDrvBase != NULL))
+        return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("The disk is %s in the saved state but %s in the VM configuration"),
+                                fAttached ? "attached" : "detached", pThis->pDrvBase ? "attached" : "detached");
+    char szSerialNumber[NVME_SERIAL_NUMBER_LENGTH+1];
+    rc = SSMR3GetStrZ(pSSM, szSerialNumber, sizeof(szSerialNumber));
+    AssertRCReturn(rc, rc);
+    if (strcmp(szSerialNumber, pThis->szSerialNumber))
+        LogRel(("nvme#%u: config mismatch: Serial number changed from '%s' to '%s'\n",
+                NVME_INSTANCE(pThis), szSerialNumber, pThis->szSerialNumber));
+
+    if (uPass != SSM_PASS_FINAL)
+        return VINF_SUCCESS;
+
+    SSMR3GetU32(pSSM, &pThis->u32Cc);
+    SSMR3GetU32(pSSM, (uint32_t *)&pThis->u32Csts);
+    SSMR3GetU32(pSSM, &pThis->u32Aqa);
+    SSMR3GetU64(pSSM, &pThis->u64Asq);
+    SSMR3GetU64(pSSM, &pThis->u64Acq);
+    SSMR3GetU32(pSSM, &pThis->u32IntMask);
+    SSMR3GetU32(pSSM, &pThis->cIoQueues);
+    SSMR3GetMem(pSSM, pThis->au32Features, sizeof(pThis->au32Features));
+    SSMR3GetU32(pSSM, &pThis->cAers);
+    rc = SSMR3GetMem(pSSM, pThis->au16AerCids, sizeof(pThis->au16AerCids));
+    AssertRCReturn(rc, rc);
+    if (   pThis->cAers > NVME_AER_MAX
+        || pThis->cIoQueues > pThis->cIoQueuesMax)
+        return VERR_SSM_DATA_UNIT_FORMAT_CHANGED;
+
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aCqs); i++)
+    {
+        PNVMECQ pCq = &pThis->aCqs[i];
+        SSMR3GetGCPhys(pSSM, &pCq->GCPhysBase);
+        SSMR3GetU32(pSSM, &pCq->cEntries);
+        SSMR3GetU32(pSSM, &pCq->uTail);
+        SSMR3GetU32(pSSM, (uint32_t *)&pCq->uHead);
+        SSMR3GetU32(pSSM, &pCq->cSqs);
+        SSMR3GetU16(pSSM, &pCq->uIv);
+        SSMR3GetBool(pSSM, &pCq->fIen);
+        rc = SSMR3GetBool(pSSM, &pCq->fPhase);
+        AssertRCReturn(rc, rc);
+        pCq->cReserved = 0;
+        if (   pCq->cEntries > NVME_QUEUE_ENTRIES_MAX
+            || (pCq->cEntries && (pCq->uTail >= pCq->cEntries || pCq->uHead >= pCq->cEntries)))
+            return VERR_SSM_DATA_UNIT_FORMAT_CHANGED;
+    }
+
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aSqs); i++)
+    {
+        PNVMESQ pSq = &pThis->aSqs[i];
+        SSMR3GetGCPhys(pSSM, &pSq->GCPhysBase);
+        SSMR3GetU32(pSSM, &pSq->cEntries);
+        SSMR3GetU32(pSSM, &pSq->uHead);
+        SSMR3GetU32(pSSM, (uint32_t *)&pSq->uTail);
+        rc = SSMR3GetU16(pSSM, &pSq->uCqId);
+        AssertRCReturn(rc, rc);
+        pSq->fWaitCq = false;
+        if (   pSq->cEntries > NVME_QUEUE_ENTRIES_MAX
+            || pSq->uCqId >= RT_ELEMENTS(pThis->aCqs)
+            || (pSq->cEntries && (pSq->uHead >= pSq->cEntries || pSq->uTail >= pSq->cEntries)))
+            return VERR_SSM_DATA_UNIT_FORMAT_CHANGED;
+    }
+
+    rc = SSMR3GetU32(pSSM, &u32);
+    if (RT_FAILURE(rc))
+        return rc;
+    AssertMsgReturn(u32 == UINT32_MAX, ("%#x\n", u32), VERR_SSM_DATA_UNIT_FORMAT_CHANGED);
+
+    /* The interrupt line is restored by the PCI bus, resync our view of it. */
+    pThis->fIntxAsserted = false;
+    PDMCritSectEnter(&pThis->lock, VERR_IGNORED);
+    nvmeIntxUpdate(pThis);
+    PDMCritSectLeave(&pThis->lock);
+    return VINF_SUCCESS;
+}
+
+
+/* -=-=-=-=- Device life cycle -=-=-=-=- */
+
+/**
+ * Queries the parameters of the attached disk.
+ *
+ * @returns VBox status code.
+ * @param   pDevIns     The device instance.
+ */
+static int nvmeR3ConfigureLUN(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    pThis->pDrvBlock = PDMIBASE_QUERY_INTERFACE(pThis->pDrvBase, PDMIBLOCK);
+    AssertMsgReturn(pThis->pDrvBlock, ("Configuration error: LUN#0 hasn't a block interface!\n"),
+                    VERR_PDM_MISSING_INTERFACE);
+    pThis->pDrvBlockAsync = PDMIBASE_QUERY_INTERFACE(pThis->pDrvBase, PDMIBLOCKASYNC);
+
+    PDMBLOCKTYPE enmType = pThis->pDrvBlock->pfnGetType(pThis->pDrvBlock);
+    if (enmType != PDMBLOCKTYPE_HARD_DISK)
+    {
+        AssertMsgFailed(("Configuration error: LUN#0 isn't a disk. enmType=%d\n", enmType));
+        return VERR_PDM_UNSUPPORTED_BLOCK_TYPE;
+    }
+
+    pThis->fReadOnly = pThis->pDrvBlock->pfnIsReadOnly(pThis->pDrvBlock);
+    pThis->cbBlock   = pThis->pDrvBlock->pfnGetSectorSize(pThis->pDrvBlock);
+    if (   pThis->cbBlock < 512
+        || pThis->cbBlock > NVME_PAGE_SIZE
+        || !RT_IS_POWER_OF_TWO(pThis->cbBlock))
+        pThis->cbBlock = 512;
+    pThis->cBlocks   = pThis->pDrvBlock->pfnGetSize(pThis->pDrvBlock) / pThis->cbBlock;
+
+    LogRel(("nvme#%u: LUN#0: disk, %llu blocks of %u bytes%s%s\n", pDevIns->iInstance,
+            pThis->cBlocks, pThis->cbBlock, pThis->fReadOnly ? ", read only" : "",
+            pThis->pDrvBlockAsync ? ", async I/O" : ""));
+    return VINF_SUCCESS;
+}
+
+/**
+ * Common worker for nvmeR3Suspend, nvmeR3PowerOff and nvmeR3Reset.
+ *
+ * @returns true if we've quiesced, false if we're still working.
+ * @param   pDevIns     The device instance.
+ */
+static DECLCALLBACK(bool) nvmeR3IsAsyncSuspendOrPowerOffDone(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    if (!nvmeR3IsIdle(pThis))
+        return false;
+    ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+    return true;
+}
+
+/**
+ * Common worker for nvmeR3Suspend and nvmeR3PowerOff.
+ */
+static void nvmeR3SuspendOrPowerOff(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    ASMAtomicWriteBool(&pThis->fSignalIdle, true);
+    if (!nvmeR3IsIdle(pThis))
+        PDMDevHlpSetAsyncNotification(pDevIns, nvmeR3IsAsyncSuspendOrPowerOffDone);
+    else
+        ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnSuspend}
+ */
+static DECLCALLBACK(void) nvmeR3Suspend(PPDMDEVINS pDevIns)
+{
+    Log(("nvmeR3Suspend\n"));
+    nvmeR3SuspendOrPowerOff(pDevIns);
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnPowerOff}
+ */
+static DECLCALLBACK(void) nvmeR3PowerOff(PPDMDEVINS pDevIns)
+{
+    Log(("nvmeR3PowerOff\n"));
+    nvmeR3SuspendOrPowerOff(pDevIns);
+}
+
+/**
+ * Resets all registers.
+ *
+ * @param   pDevIns     The device instance.
+ */
+static void nvmeR3ResetCommon(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    PDMCritSectEnter(&pThis->lock, VERR_IGNORED);
+    nvmeR3CtrlReset(pThis);
+    pThis->u32Cc   = 0;
+    pThis->u32Csts = 0;
+    pThis->u32Aqa  = 0;
+    pThis->u64Asq  = 0;
+    pThis->u64Acq  = 0;
+    PDMCritSectLeave(&pThis->lock);
+}
+
+/**
+ * Callback employed by nvmeR3Reset.
+ *
+ * @returns true if we've quiesced, false if we're still working.
+ * @param   pDevIns     The device instance.
+ */
+static DECLCALLBACK(bool) nvmeR3IsAsyncResetDone(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    if (!nvmeR3IsIdle(pThis))
+        return false;
+    ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+
+    nvmeR3ResetCommon(pDevIns);
+    return true;
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnReset}
+ */
+static DECLCALLBACK(void) nvmeR3Reset(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    ASMAtomicWriteBool(&pThis->fSignalIdle, true);
+    if (!nvmeR3IsIdle(pThis))
+        PDMDevHlpSetAsyncNotification(pDevIns, nvmeR3IsAsyncResetDone);
+    else
+    {
+        ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+        nvmeR3ResetCommon(pDevIns);
+    }
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnDetach}
+ */
+static DECLCALLBACK(void) nvmeR3Detach(PPDMDEVINS pDevIns, unsigned iLUN, uint32_t fFlags)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    AssertLogRelReturnVoid(iLUN == 0);
+    AssertMsg(fFlags & PDM_TACH_FLAGS_NOT_HOT_PLUG,
+              ("NVMe: Device does not support hotplugging\n"));
+
+    pThis->pDrvBase       = NULL;
+    pThis->pDrvBlock      = NULL;
+    pThis->pDrvBlockAsync = NULL;
+    pThis->cBlocks        = 0;
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnAttach}
+ */
+static DECLCALLBACK(int) nvmeR3Attach(PPDMDEVINS pDevIns, unsigned iLUN, uint32_t fFlags)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+
+    AssertLogRelReturn(iLUN == 0, VERR_PDM_NO_SUCH_LUN);
+    AssertMsgReturn(fFlags & PDM_TACH_FLAGS_NOT_HOT_PLUG,
+                    ("NVMe: Device does not support hotplugging\n"),
+                    VERR_INVALID_PARAMETER);
+
+    /* the usual paranoia */
+    AssertRelease(!pThis->pDrvBase);
+    AssertRelease(!pThis->pDrvBlock);
+
+    int rc = PDMDevHlpDriverAttach(pDevIns, 0, &pThis->IBaseDisk, &pThis->pDrvBase, "Disk");
+    if (RT_SUCCESS(rc))
+        rc = nvmeR3ConfigureLUN(pDevIns);
+    else
+        AssertMsgFailed(("Failed to attach LUN#0. rc=%Rrc\n", rc));
+
+    if (RT_FAILURE(rc))
+    {
+        pThis->pDrvBase  = NULL;
+        pThis->pDrvBlock = NULL;
+    }
+    return rc;
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnDestruct}
+ */
+static DECLCALLBACK(int) nvmeR3Destruct(PPDMDEVINS pDevIns)
+{
+    PNVME pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    PDMDEV_CHECK_VERSIONS_RETURN_QUIET(pDevIns);
+
+    /*
+     * The worker threads are suspended at this point and PDM takes care of
+     * terminating them.
+     */
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aSqs); i++)
+        if (pThis->aSqs[i].hEvtProcess != NIL_SUPSEMEVENT)
+        {
+            SUPSemEventClose(pThis->pSupDrvSession, pThis->aSqs[i].hEvtProcess);
+            pThis->aSqs[i].hEvtProcess = NIL_SUPSEMEVENT;
+        }
+
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aCqs); i++)
+        if (PDMCritSectIsInitialized(&pThis->aCqs[i].CritSect))
+            PDMR3CritSectDelete(&pThis->aCqs[i].CritSect);
+
+    if (PDMCritSectIsInitialized(&pThis->lock))
+        PDMR3CritSectDelete(&pThis->lock);
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnConstruct}
+ */
+static DECLCALLBACK(int) nvmeR3Construct(PPDMDEVINS pDevIns, int iInstance, PCFGMNODE pCfg)
+{
+    PNVME    pThis = PDMINS_2_DATA(pDevIns, PNVME);
+    uint32_t cCpus;
+    int      rc;
+    PDMDEV_CHECK_VERSIONS_RETURN(pDevIns);
+
+    /*
+     * Initialize the instance data (everything touched by the destructor need
+     * to be initialized here!).
+     */
+    pThis->pDevInsR3      = pDevIns;
+    pThis->pDevInsR0      = PDMDEVINS_2_R0PTR(pDevIns);
+    pThis->pDevInsRC      = PDMDEVINS_2_RCPTR(pDevIns);
+    pThis->pSupDrvSession = PDMDevHlpGetSupDrvSession(pDevIns);
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aSqs); i++)
+    {
+        pThis->aSqs[i].uId         = (uint16_t)i;
+        pThis->aSqs[i].hEvtProcess = NIL_SUPSEMEVENT;
+    }
+
+    /*
+     * Validate and read configuration.
+     */
+    if (!CFGMR3AreValuesValid(pCfg, "R0Enabled\0"
+                                    "NumCPUs\0"
+                                    "NumQueues\0"
+                                    "SerialNumber\0"
+                                    "ModelNumber\0"
+                                    "FirmwareRevision\0"))
+        return PDMDEV_SET_ERROR(pDevIns, VERR_PDM_DEVINS_UNKNOWN_CFG_VALUES,
+                                N_("NVMe configuration error: unknown option specified"));
+
+    rc = CFGMR3QueryBoolDef(pCfg, "R0Enabled", &pThis->fR0Enabled, true);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read R0Enabled as boolean"));
+
+    /* One queue pair per vCPU by default. */
+    rc = CFGMR3QueryU32Def(pCfg, "NumCPUs", &cCpus, 1);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read NumCPUs as integer"));
+    rc = CFGMR3QueryU32Def(pCfg, "NumQueues", &pThis->cIoQueuesMax, RT_MIN(RT_MAX(cCpus, 1), NVME_IO_QUEUES_MAX));
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read NumQueues as integer"));
+    if (pThis->cIoQueuesMax < 1 || pThis->cIoQueuesMax > NVME_IO_QUEUES_MAX)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("NVMe configuration error: NumQueues=%u should be between 1 and %u"),
+                                   pThis->cIoQueuesMax, NVME_IO_QUEUES_MAX);
+    pThis->cIoQueues = pThis->cIoQueuesMax;
+
+    rc = CFGMR3QueryStringDef(pCfg, "ModelNumber", pThis->szModelNumber, sizeof(pThis->szModelNumber),
+                              "VBOX NVMe");
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read \"ModelNumber\" as string"));
+    rc = CFGMR3QueryStringDef(pCfg, "FirmwareRevision", pThis->szFirmwareRevision, sizeof(pThis->szFirmwareRevision),
+                              "1.0");
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read \"FirmwareRevision\" as string"));
+
+    /*
+     * Locks, the MMIO handlers do their own locking.
+     */
+    rc = PDMDevHlpSetDeviceCritSect(pDevIns, PDMDevHlpCritSectGetNop(pDevIns));
+    if (RT_FAILURE(rc))
+        return rc;
+
+    rc = PDMDevHlpCritSectInit(pDevIns, &pThis->lock, RT_SRC_POS, "NVMe#%u", iInstance);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    for (unsigned i = 0; i < RT_ELEMENTS(pThis->aCqs); i++)
+    {
+        rc = PDMDevHlpCritSectInit(pDevIns, &pThis->aCqs[i].CritSect, RT_SRC_POS, "NVMe#%uCQ%u", iInstance, i);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+
+    /*
+     * PCI configuration space.
+     */
+    PCIDevSetVendorId    (&pThis->dev, 0x80ee); /* Oracle */
+    PCIDevSetDeviceId    (&pThis->dev, 0x4e56); /* "NV" */
+    PCIDevSetCommand     (&pThis->dev, 0x0000);
+    PCIDevSetRevisionId  (&pThis->dev, 0x00);
+    PCIDevSetClassProg   (&pThis->dev, 0x02);   /* NVM Express */
+    PCIDevSetClassSub    (&pThis->dev, 0x08);   /* Non-volatile memory controller */
+    PCIDevSetClassBase   (&pThis->dev, 0x01);   /* Mass storage */
+    PCIDevSetInterruptLine(&pThis->dev, 0x00);
+    PCIDevSetInterruptPin (&pThis->dev, 0x01);
+#ifdef VBOX_WITH_MSI_DEVICES
+    PCIDevSetStatus      (&pThis->dev, VBOX_PCI_STATUS_CAP_LIST);
+    PCIDevSetCapabilityList(&pThis->dev, 0x80);
+#endif
+
+    rc = PDMDevHlpPCIRegister(pDevIns, &pThis->dev);
+    if (RT_FAILURE(rc))
+        return rc;
+
+#ifdef VBOX_WITH_MSI_DEVICES
+    /* One vector for the admin queue and one for each I/O completion queue. */
+    PDMMSIREG MsiReg;
+    RT_ZERO(MsiReg);
+    MsiReg.cMsixVectors    = (uint16_t)(pThis->cIoQueuesMax + 1);
+    MsiReg.iMsixCapOffset  = 0x80;
+    MsiReg.iMsixNextOffset = 0x00;
+    MsiReg.iMsixBar        = 4;
+    rc = PDMDevHlpPCIRegisterMsi(pDevIns, &MsiReg);
+    if (RT_FAILURE(rc))
+    {
+        LogRel(("nvme#%u: Chipset cannot do MSI-X: %Rrc\n", iInstance, rc));
+        /* That's OK, we can work with a shared pin based interrupt. */
+        PCIDevSetCapabilityList(&pThis->dev, 0x0);
+    }
+    else
+        pThis->cMsixVectors = MsiReg.cMsixVectors;
+#endif
+
+    rc = PDMDevHlpPCIIORegionRegister(pDevIns, 0, NVME_MMIO_SIZE,
+                                      (PCIADDRESSSPACE)(PCI_ADDRESS_SPACE_MEM | PCI_ADDRESS_SPACE_BAR64),
+                                      nvmeR3MMIOMap);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe cannot register PCI memory region for registers"));
+
+    rc = PDMDevHlpSSMRegisterEx(pDevIns, NVME_SAVED_STATE_VERSION, sizeof(*pThis), NULL,
+                                NULL,           nvmeR3LiveExec, NULL,
+                                NULL,           nvmeR3SaveExec, NULL,
+                                NULL,           nvmeR3LoadExec, NULL);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    /*
+     * Interfaces and the status LUN.
+     */
+    pThis->IBase.pfnQueryInterface          = nvmeR3Status_QueryInterface;
+    pThis->ILeds.pfnQueryStatusLed          = nvmeR3Status_QueryStatusLed;
+    pThis->IBaseDisk.pfnQueryInterface      = nvmeR3Disk_QueryInterface;
+    pThis->IPort.pfnQueryDeviceLocation     = nvmeR3QueryDeviceLocation;
+    pThis->IPortAsync.pfnTransferCompleteNotify = nvmeR3TransferCompleteNotify;
+    pThis->Led.u32Magic                     = PDMLED_MAGIC;
+
+    PPDMIBASE pBase;
+    rc = PDMDevHlpDriverAttach(pDevIns, PDM_STATUS_LUN, &pThis->IBase, &pBase, "Status Port");
+    if (RT_SUCCESS(rc))
+        pThis->pLedsConnector = PDMIBASE_QUERY_INTERFACE(pBase, PDMILEDCONNECTORS);
+    else if (rc != VERR_PDM_NO_ATTACHED_DRIVER)
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe cannot attach to status driver"));
+
+    /*
+     * Attach the disk.
+     */
+    rc = PDMDevHlpDriverAttach(pDevIns, 0, &pThis->IBaseDisk, &pThis->pDrvBase, "Disk");
+    if (RT_SUCCESS(rc))
+    {
+        rc = nvmeR3ConfigureLUN(pDevIns);
+        if (RT_FAILURE(rc))
+            return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe failed to configure the disk LUN"));
+    }
+    else if (rc == VERR_PDM_NO_ATTACHED_DRIVER)
+    {
+        pThis->pDrvBase = NULL;
+        LogRel(("nvme#%u: no disk attached\n", iInstance));
+    }
+    else
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("NVMe failed to attach the disk LUN"));
+
+    /* Generate a default serial number like AHCI does. */
+    char   szSerial[NVME_SERIAL_NUMBER_LENGTH+1];
+    RTUUID Uuid;
+    if (   !pThis->pDrvBlock
+        || RT_FAILURE(pThis->pDrvBlock->pfnGetUuid(pThis->pDrvBlock, &Uuid))
+        || RTUuidIsNull(&Uuid))
+        RTStrPrintf(szSerial, sizeof(szSerial), "VB%x-1a2b3c4d", iInstance);
+    else
+        RTStrPrintf(szSerial, sizeof(szSerial), "VB%08x-%08x", Uuid.au32[0], Uuid.au32[3]);
+    rc = CFGMR3QueryStringDef(pCfg, "SerialNumber", pThis->szSerialNumber, sizeof(pThis->szSerialNumber), szSerial);
+    if (RT_FAILURE(rc))
+    {
+        if (rc == VERR_CFGM_NOT_ENOUGH_SPACE)
+            return PDMDEV_SET_ERROR(pDevIns, VERR_INVALID_PARAMETER,
+                                    N_("NVMe configuration error: \"SerialNumber\" is longer than 20 bytes"));
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("NVMe configuration error: failed to read \"SerialNumber\" as string"));
+    }
+
+    /*
+     * One worker thread per I/O submission queue.
+     */
+    for (unsigned i = 1; i <= pThis->cIoQueuesMax; i++)
+    {
+        PNVMESQ pSq = &pThis->aSqs[i];
+        char    szName[24];
+
+        rc = SUPSemEventCreate(pThis->pSupDrvSession, &pSq->hEvtProcess);
+        if (RT_FAILURE(rc))
+            return PDMDevHlpVMSetError(pDevIns, rc, RT_SRC_POS,
+                                       N_("NVMe: Failed to create SUP event semaphore"));
+
+        RTStrPrintf(szName, sizeof(szName), "NVMe%uSQ%u", iInstance, i);
+        rc = PDMDevHlpThreadCreate(pDevIns, &pSq->pWrkThread, pSq, nvmeR3SqWorker, nvmeR3SqWorkerWakeUp, 0,
+                                   RTTHREADTYPE_IO, szName);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+
+    nvmeR3ResetCommon(pDevIns);
+
+    LogRel(("nvme#%u: %u I/O queue pairs, %u MSI-X vectors\n", iInstance, pThis->cIoQueuesMax, pThis->cMsixVectors));
+
+    /*
+     * Statistics.
+     */
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatBytesRead,      STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,       "Amount of data read.",                  "/Devices/NVMe%u/ReadBytes", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatBytesWritten,   STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,       "Amount of data written.",               "/Devices/NVMe%u/WrittenBytes", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReqsRead,       STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,       "Number of read commands.",              "/Devices/NVMe%u/Cmds/Read", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReqsWrite,      STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,       "Number of write commands.",             "/Devices/NVMe%u/Cmds/Write", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReqsFlush,      STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,       "Number of flush commands.",             "/Devices/NVMe%u/Cmds/Flush", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatAdminCmds,      STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,       "Number of admin commands.",             "/Devices/NVMe%u/Cmds/Admin", iInstance);
+#ifdef VBOX_WITH_STATISTICS
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatDoorbellsR3,    STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,  "Doorbell writes handled in R3.",        "/Devices/NVMe%u/DoorbellsR3", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatDoorbellsRZ,    STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,  "Doorbell writes handled in RZ.",        "/Devices/NVMe%u/DoorbellsRZ", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatWorkerWakeups,  STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,  "Worker thread wakeups.",                "/Devices/NVMe%u/WorkerWakeups", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatCqFull,         STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,  "Times a completion queue was full.",    "/Devices/NVMe%u/CqFull", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatInterrupts,     STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,  "Message signalled interrupts sent.",    "/Devices/NVMe%u/Interrupts", iInstance);
+#endif
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * The device registration structure.
+ */
+const PDMDEVREG g_DeviceNVMe =
+{
+    /* u32Version */
+    PDM_DEVREG_VERSION,
+    /* szName */
+    "nvme",
+    /* szRCMod */
+    "",
+    /* szR0Mod */
+    "VBoxDDR0.r0",
+    /* pszDescription */
+    "NVM Express controller.\n",
+    /* fFlags */
+    PDM_DEVREG_FLAGS_DEFAULT_BITS | PDM_DEVREG_FLAGS_R0,
+    /* fClass */
+    PDM_DEVREG_CLASS_STORAGE,
+    /* cMaxInstances */
+    ~0U,
+    /* cbInstance */
+    sizeof(NVME),
+    /* pfnConstruct */
+    nvmeR3Construct,
+    /* pfnDestruct */
+    nvmeR3Destruct,
+    /* pfnRelocate */
+    NULL,
+    /* pfnMemSetup */
+    NULL,
+    /* pfnPowerOn */
+    NULL,
+    /* pfnReset */
+    nvmeR3Reset,
+    /* pfnSuspend */
+    nvmeR3Suspend,
+    /* pfnResume */
+    NULL,
+    /* pfnAttach */
+    nvmeR3Attach,
+    /* pfnDetach */
+    nvmeR3Detach,
+    /* pfnQueryInterface. */
+    NULL,
+    /* pfnInitComplete */
+    NULL,
+    /* pfnPowerOff */
+    nvmeR3PowerOff,
+    /* pfnSoftReset */
+    NULL,
+    /* u32VersionEnd */
+    PDM_DEVREG_VERSION
+};
+
+#endif /* IN_RING3 */
+#endif /* !VBOX_DEVICE_STRUCT_TESTCASE */
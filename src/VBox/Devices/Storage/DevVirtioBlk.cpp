@@ -0,0 +1,1302 @@
+/* $Id$ */
+/** @file
+ * DevVirtioBlk - Virtio Block Device
+ */
+
+/*
+ * Copyright (C) 2009-2013 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#define LOG_GROUP LOG_GROUP_DEV_VIRTIO
+#define VBLK_GC_SUPPORT
+
+#include <VBox/vmm/pdmdev.h>
+#include <iprt/asm.h>
+#include <iprt/string.h>
+#ifdef IN_RING3
+# include <iprt/mem.h>
+# include <iprt/uuid.h>
+#endif /* IN_RING3 */
+#include "VBoxDD.h"
+#include "../VirtIO/Virtio.h"
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+#ifndef VBOX_DEVICE_STRUCT_TESTCASE
+
+#define INSTANCE(pThis) pThis->VPCI.szInstance
+
+#ifdef IN_RING3
+
+#define VBLK_PCI_SUBSYSTEM_ID        1 + VIRTIO_BLK_ID
+#define VBLK_PCI_CLASS               0x0180
+#define VBLK_NAME_FMT                "VBlk%d"
+
+#endif /* IN_RING3 */
+
+#endif /* VBOX_DEVICE_STRUCT_TESTCASE */
+
+
+/** Maximum number of request queues. */
+#define VBLK_N_QUEUES_MAX       VIRTIO_MAX_NQUEUES
+/** Number of descriptors in each request queue. */
+#define VBLK_QUEUE_SIZE         256
+/** Maximum number of data segments in a request, announced to the guest. */
+#define VBLK_SEG_MAX            (VBLK_QUEUE_SIZE - 2)
+/** Maximum amount of data in a single request. */
+#define VBLK_TRANSFER_MAX       (32 * _1M)
+/** The sector size requests are addressed in, independent of the medium. */
+#define VBLK_SECTOR_SIZE        512
+/** Length of the device ID string returned by VBLK_T_GET_ID. */
+#define VBLK_ID_BYTES           20
+/** Maximum number of I/O errors written to the release log. */
+#define VBLK_MAX_LOG_REL_ERRORS 1024
+
+/** @name Virtio block features
+ * @{  */
+#define VBLK_F_SIZE_MAX   0x00000002  /**< Maximum size of any single segment is in size_max. */
+#define VBLK_F_SEG_MAX    0x00000004  /**< Maximum number of segments in a request is in seg_max. */
+#define VBLK_F_GEOMETRY   0x00000010  /**< Disk-style geometry specified in geometry. */
+#define VBLK_F_RO         0x00000020  /**< Device is read-only. */
+#define VBLK_F_BLK_SIZE   0x00000040  /**< Block size of disk is in blk_size. */
+#define VBLK_F_FLUSH      0x00000200  /**< Cache flush command support. */
+#define VBLK_F_MQ         0x00001000  /**< Device supports multiple request queues. */
+/** @} */
+
+/** @name Virtio block request types
+ * @{  */
+#define VBLK_T_IN         0
+#define VBLK_T_OUT        1
+#define VBLK_T_FLUSH      4
+#define VBLK_T_GET_ID     8
+/** @} */
+
+/** @name Virtio block request status
+ * @{  */
+#define VBLK_S_OK         0
+#define VBLK_S_IOERR      1
+#define VBLK_S_UNSUPP     2
+/** @} */
+
+
+/*******************************************************************************
+*   Structures and Typedefs                                                    *
+*******************************************************************************/
+#pragma pack(1)
+/**
+ * The device specific configuration space, see virtio_blk_config.
+ */
+struct VBlkPCIConfig
+{
+    uint64_t uCapacity;          /**< Capacity in 512 byte sectors. */
+    uint32_t uSizeMax;           /**< Maximum segment size (VBLK_F_SIZE_MAX). */
+    uint32_t uSegMax;            /**< Maximum number of segments (VBLK_F_SEG_MAX). */
+    uint16_t uCylinders;         /**< Geometry (VBLK_F_GEOMETRY). */
+    uint8_t  uHeads;
+    uint8_t  uSectors;
+    uint32_t uBlkSize;           /**< Block size (VBLK_F_BLK_SIZE). */
+    uint8_t  uPhysBlkExp;        /**< Topology, not announced. */
+    uint8_t  uAlignmentOffset;
+    uint16_t uMinIoSize;
+    uint32_t uOptIoSize;
+    uint8_t  uWriteback;         /**< Cache mode, not announced. */
+    uint8_t  uUnused0;
+    uint16_t uNumQueues;         /**< Number of request queues (VBLK_F_MQ). */
+};
+#pragma pack()
+AssertCompileMemberOffset(struct VBlkPCIConfig, uBlkSize, 20);
+AssertCompileMemberOffset(struct VBlkPCIConfig, uNumQueues, 34);
+
+/**
+ * Device state structure. Holds the current state of device.
+ *
+ * @extends     VPCISTATE
+ * @implements  PDMIBLOCKPORT
+ * @implements  PDMIBLOCKASYNCPORT
+ */
+typedef struct VBlkState_st
+{
+    /* VPCISTATE must be the first member! */
+    VPCISTATE                       VPCI;
+
+    /** Block port interface of the disk. */
+    PDMIBLOCKPORT                   IPort;
+    /** Asynchronous block port interface of the disk. */
+    PDMIBLOCKASYNCPORT              IPortAsync;
+    /** Attached disk driver. */
+    R3PTRTYPE(PPDMIBASE)            pDrvBase;
+    /** Block interface of the attached disk. */
+    R3PTRTYPE(PPDMIBLOCK)           pDrvBlock;
+    /** Asynchronous block interface of the attached disk, optional. */
+    R3PTRTYPE(PPDMIBLOCKASYNC)      pDrvBlockAsync;
+    /** BIOS interface of the attached disk, optional. */
+    R3PTRTYPE(PPDMIBLOCKBIOS)       pDrvBlockBios;
+
+    /** The request queues. */
+    R3PTRTYPE(PVQUEUE)              apReqQueues[VBLK_N_QUEUES_MAX];
+
+    /** PCI config area holding the disk parameters. */
+    struct VBlkPCIConfig            config;
+    /** Number of request queues the device provides. */
+    uint32_t                        cQueues;
+    /** Size of the attached disk in bytes. */
+    uint64_t                        cbDisk;
+    /** Flag whether the attached disk is read only. */
+    bool                            fReadOnly;
+    /** Flag whether a queue notification is processed, used to batch the
+     * used ring updates of requests which complete during submission. */
+    bool                            fInNotify;
+    /** Indicates that PDMDevHlpAsyncNotificationCompleted should be called when
+     * the last outstanding request completes. */
+    bool volatile                   fSignalIdle;
+    bool                            afAlignment[1];
+    /** Bitmap of queues which got requests completed during a notification. */
+    uint32_t                        fQueuesSyncPending;
+    /** Reset generation, completions of requests from before a reset are dropped. */
+    uint32_t                        uGeneration;
+    /** Number of outstanding requests. */
+    uint32_t volatile               cReqsActive;
+    /** Number of errors written to the release log. */
+    uint32_t volatile               cErrors;
+    /** Device ID string returned to the guest. */
+    char                            szId[VBLK_ID_BYTES + 1];
+    char                            achAlignment[3];
+
+    /** @name Statistic
+     * @{ */
+    STAMCOUNTER                     StatBytesRead;
+    STAMCOUNTER                     StatBytesWritten;
+    STAMCOUNTER                     StatReqsRead;
+    STAMCOUNTER                     StatReqsWrite;
+    STAMCOUNTER                     StatReqsFlush;
+    STAMCOUNTER                     StatNotifies;
+    STAMCOUNTER                     StatNotifyReqs;
+#if defined(VBOX_WITH_STATISTICS)
+    STAMPROFILE                     StatNotify;
+#endif /* VBOX_WITH_STATISTICS */
+    /** @}  */
+} VBLKSTATE;
+/** Pointer to a virtual I/O block device state. */
+typedef VBLKSTATE *PVBLKSTATE;
+
+#ifndef VBOX_DEVICE_STRUCT_TESTCASE
+
+AssertCompileMemberOffset(VBLKSTATE, VPCI, 0);
+
+/**
+ * The request header at the start of each request.
+ */
+struct VBlkReqHdr
+{
+    uint32_t u32Type;
+    uint32_t u32IoPrio;
+    uint64_t u64Sector;
+};
+typedef struct VBlkReqHdr VBLKREQHDR;
+AssertCompileSize(VBLKREQHDR, 16);
+
+/**
+ * A guest data segment of a request.
+ */
+typedef struct VBLKGUESTSEG
+{
+    RTGCPHYS  GCPhys;
+    uint32_t  cb;
+} VBLKGUESTSEG;
+
+/**
+ * An outstanding request.
+ */
+typedef struct VBLKREQ
+{
+    /** The queue the request was taken from. */
+    PVQUEUE       pQueue;
+    /** Head of the descriptor chain. */
+    uint32_t      uIndex;
+    /** Reset generation the request was started in. */
+    uint32_t      uGeneration;
+    /** Request type. */
+    uint32_t      u32Type;
+    /** Start offset on the disk in bytes. */
+    uint64_t      uOffset;
+    /** Amount of data to transfer. */
+    size_t        cbTransfer;
+    /** Guest address of the status byte. */
+    RTGCPHYS      GCPhysStatus;
+    /** Bounce buffer for the data. */
+    RTSGSEG       DataSeg;
+    /** Number of guest data segments. */
+    unsigned      cGuestSegs;
+    /** The guest data segments - variable size. */
+    VBLKGUESTSEG  aGuestSegs[1];
+} VBLKREQ;
+/** Pointer to an outstanding request. */
+typedef VBLKREQ *PVBLKREQ;
+
+/** Makes a PVBLKSTATE out of a PPDMIBLOCKPORT. */
+#define PDMIBLOCKPORT_2_PVBLKSTATE(pInterface)      ( (PVBLKSTATE)((uintptr_t)pInterface - RT_OFFSETOF(VBLKSTATE, IPort)) )
+/** Makes a PVBLKSTATE out of a PPDMIBLOCKASYNCPORT. */
+#define PDMIBLOCKASYNCPORT_2_PVBLKSTATE(pInterface) ( (PVBLKSTATE)((uintptr_t)pInterface - RT_OFFSETOF(VBLKSTATE, IPortAsync)) )
+
+
+DECLINLINE(int) vblkCsEnter(PVBLKSTATE pThis, int rcBusy)
+{
+    return vpciCsEnter(&pThis->VPCI, rcBusy);
+}
+
+DECLINLINE(void) vblkCsLeave(PVBLKSTATE pThis)
+{
+    vpciCsLeave(&pThis->VPCI);
+}
+
+static DECLCALLBACK(uint32_t) vblkIoCb_GetHostFeatures(void *pvState)
+{
+    PVBLKSTATE pThis = (PVBLKSTATE)pvState;
+
+    /* We support:
+     * - Segment limit and geometry reporting in config space
+     * - Cache flush command
+     * - Indirect descriptors, the guest can use large requests with a small ring
+     * - Several request queues if configured
+     */
+    uint32_t fFeatures = VBLK_F_SEG_MAX
+                       | VBLK_F_GEOMETRY
+                       | VBLK_F_BLK_SIZE
+                       | VBLK_F_FLUSH
+                       | VPCI_F_RING_INDIRECT_DESC;
+    if (pThis->fReadOnly)
+        fFeatures |= VBLK_F_RO;
+    if (pThis->cQueues > 1)
+        fFeatures |= VBLK_F_MQ;
+    return fFeatures;
+}
+
+static DECLCALLBACK(uint32_t) vblkIoCb_GetHostMinimalFeatures(void *pvState)
+{
+    PVBLKSTATE pThis = (PVBLKSTATE)pvState;
+    return pThis->fReadOnly ? VBLK_F_RO : 0;
+}
+
+static DECLCALLBACK(void) vblkIoCb_SetHostFeatures(void *pvState, uint32_t fFeatures)
+{
+    PVBLKSTATE pThis = (PVBLKSTATE)pvState; NOREF(pThis);
+    LogFlow(("%s vblkIoCb_SetHostFeatures: uFeatures=%x\n", INSTANCE(pThis), fFeatures));
+}
+
+static DECLCALLBACK(int) vblkIoCb_GetConfig(void *pvState, uint32_t offCfg, uint32_t cb, void *data)
+{
+    PVBLKSTATE pThis = (PVBLKSTATE)pvState;
+    if (offCfg + cb > sizeof(struct VBlkPCIConfig))
+    {
+        Log(("%s vblkIoCb_GetConfig: Read beyond the config structure is attempted (offCfg=%#x cb=%x).\n", INSTANCE(pThis), offCfg, cb));
+        return VERR_IOM_IOPORT_UNUSED;
+    }
+    memcpy(data, (uint8_t *)&pThis->config + offCfg, cb);
+    return VINF_SUCCESS;
+}
+
+static DECLCALLBACK(int) vblkIoCb_SetConfig(void *pvState, uint32_t offCfg, uint32_t cb, void *data)
+{
+    /* None of the announced fields is writable. */
+    PVBLKSTATE pThis = (PVBLKSTATE)pvState; NOREF(pThis);
+    Log(("%s vblkIoCb_SetConfig: Ignoring write to the config structure (offCfg=%#x cb=%x).\n", INSTANCE(pThis), offCfg, cb));
+    return VINF_SUCCESS;
+}
+
+/**
+ * Hardware reset. Revert all registers to initial values.
+ *
+ * @param   pThis      The device state structure.
+ */
+static DECLCALLBACK(int) vblkIoCb_Reset(void *pvState)
+{
+#ifndef IN_RING3
+    return VINF_IOM_R3_IOPORT_WRITE;
+#else
+    PVBLKSTATE pThis = (PVBLKSTATE)pvState;
+    Log(("%s Reset triggered\n", INSTANCE(pThis)));
+
+    int rc = vblkCsEnter(pThis, VERR_SEM_BUSY);
+    if (RT_UNLIKELY(rc != VINF_SUCCESS))
+    {
+        LogRel(("vblkIoCb_Reset failed to enter critical section!\n"));
+        return rc;
+    }
+    vpciReset(&pThis->VPCI);
+    /* Requests still outstanding must not touch the rings anymore. */
+    pThis->uGeneration++;
+    pThis->fQueuesSyncPending = 0;
+    vblkCsLeave(pThis);
+    return VINF_SUCCESS;
+#endif
+}
+
+/**
+ * This function is called when the driver becomes ready.
+ *
+ * @param   pThis      The device state structure.
+ */
+static DECLCALLBACK(void) vblkIoCb_Ready(void *pvState)
+{
+    PVBLKSTATE pThis = (PVBLKSTATE)pvState; NOREF(pThis);
+    Log(("%s Driver became ready\n", INSTANCE(pThis)));
+}
+
+
+/**
+ * I/O port callbacks.
+ */
+static const VPCIIOCALLBACKS g_IOCallbacks =
+{
+     vblkIoCb_GetHostFeatures,
+     vblkIoCb_GetHostMinimalFeatures,
+     vblkIoCb_SetHostFeatures,
+     vblkIoCb_GetConfig,
+     vblkIoCb_SetConfig,
+     vblkIoCb_Reset,
+     vblkIoCb_Ready,
+};
+
+
+/**
+ * @callback_method_impl{FNIOMIOPORTIN}
+ */
+PDMBOTHCBDECL(int) vblkIOPortIn(PPDMDEVINS pDevIns, void *pvUser, RTIOPORT port, uint32_t *pu32, unsigned cb)
+{
+    return vpciIOPortIn(pDevIns, pvUser, port, pu32, cb, &g_IOCallbacks);
+}
+
+
+/**
+ * @callback_method_impl{FNIOMIOPORTOUT}
+ */
+PDMBOTHCBDECL(int) vblkIOPortOut(PPDMDEVINS pDevIns, void *pvUser, RTIOPORT port, uint32_t u32, unsigned cb)
+{
+    return vpciIOPortOut(pDevIns, pvUser, port, u32, cb, &g_IOCallbacks);
+}
+
+
+#ifdef IN_RING3
+
+/**
+ * @interface_method_impl{PDMIBASE,pfnQueryInterface}
+ */
+static DECLCALLBACK(void *) vblkQueryInterface(struct PDMIBASE *pInterface, const char *pszIID)
+{
+    PVBLKSTATE pThis = RT_FROM_MEMBER(pInterface, VBLKSTATE, VPCI.IBase);
+    Assert(&pThis->VPCI.IBase == pInterface);
+
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBLOCKPORT, &pThis->IPort);
+    PDMIBASE_RETURN_INTERFACE(pszIID, PDMIBLOCKASYNCPORT, &pThis->IPortAsync);
+    return vpciQueryInterface(pInterface, pszIID);
+}
+
+/**
+ * @interface_method_impl{PDMIBLOCKPORT,pfnQueryDeviceLocation}
+ */
+static DECLCALLBACK(int) vblkR3QueryDeviceLocation(PPDMIBLOCKPORT pInterface, const char **ppcszController,
+                                                   uint32_t *piInstance, uint32_t *piLUN)
+{
+    PVBLKSTATE pThis = PDMIBLOCKPORT_2_PVBLKSTATE(pInterface);
+    PPDMDEVINS pDevIns = pThis->VPCI.CTX_SUFF(pDevIns);
+
+    AssertPtrReturn(ppcszController, VERR_INVALID_POINTER);
+    AssertPtrReturn(piInstance, VERR_INVALID_POINTER);
+    AssertPtrReturn(piLUN, VERR_INVALID_POINTER);
+
+    *ppcszController = pDevIns->pReg->szName;
+    *piInstance = pDevIns->iInstance;
+    *piLUN = 0;
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Copies data between a host buffer and the guest data segments of a request.
+ *
+ * @param   pThis       The device state structure.
+ * @param   pReq        The request.
+ * @param   pvBuf       The host buffer.
+ * @param   cbBuf       Size of the host buffer.
+ * @param   fToGuest    Direction of the copy.
+ */
+static void vblkR3ReqCopy(PVBLKSTATE pThis, PVBLKREQ pReq, void *pvBuf, size_t cbBuf, bool fToGuest)
+{
+    PPDMDEVINS pDevIns = pThis->VPCI.CTX_SUFF(pDevIns);
+    uint8_t   *pbBuf   = (uint8_t *)pvBuf;
+
+    for (unsigned i = 0; i < pReq->cGuestSegs && cbBuf; i++)
+    {
+        size_t cbThisCopy = RT_MIN(cbBuf, pReq->aGuestSegs[i].cb);
+
+        if (fToGuest)
+            PDMDevHlpPCIPhysWrite(pDevIns, pReq->aGuestSegs[i].GCPhys, pbBuf, cbThisCopy);
+        else
+            PDMDevHlpPhysRead(pDevIns, pReq->aGuestSegs[i].GCPhys, pbBuf, cbThisCopy);
+
+        pbBuf += cbThisCopy;
+        cbBuf -= cbThisCopy;
+    }
+}
+
+/**
+ * Returns a request to the guest and frees it.
+ *
+ * @param   pThis       The device state structure.
+ * @param   pReq        The request to complete.
+ * @param   rcReq       Status code of the request.
+ */
+static void vblkR3ReqComplete(PVBLKSTATE pThis, PVBLKREQ pReq, int rcReq)
+{
+    uint8_t  u8Status = VBLK_S_OK;
+    uint32_t cbWritten = 1; /* Status byte. */
+
+    if (RT_FAILURE(rcReq))
+    {
+        u8Status = rcReq == VERR_NOT_SUPPORTED ? VBLK_S_UNSUPP : VBLK_S_IOERR;
+        if (   rcReq != VERR_NOT_SUPPORTED
+            && ASMAtomicIncU32(&pThis->cErrors) < VBLK_MAX_LOG_REL_ERRORS)
+            LogRel(("%s: Request type %u at offset %llu (%zu bytes) failed with %Rrc\n",
+                    INSTANCE(pThis), pReq->u32Type, pReq->uOffset, pReq->cbTransfer, rcReq));
+    }
+
+    if (pReq->u32Type == VBLK_T_IN)
+        vpciSetReadLed(&pThis->VPCI, false);
+    else if (pReq->u32Type == VBLK_T_OUT)
+        vpciSetWriteLed(&pThis->VPCI, false);
+
+    int rc = vblkCsEnter(pThis, VERR_SEM_BUSY);
+    AssertRC(rc);
+
+    /* Drop requests from before a reset, the rings are not valid anymore. */
+    if (   pReq->uGeneration == pThis->uGeneration
+        && vqueueIsReady(&pThis->VPCI, pReq->pQueue))
+    {
+        if (   pReq->u32Type == VBLK_T_IN
+            && u8Status == VBLK_S_OK)
+        {
+            vblkR3ReqCopy(pThis, pReq, pReq->DataSeg.pvSeg, pReq->cbTransfer, true /* fToGuest */);
+            cbWritten += (uint32_t)pReq->cbTransfer;
+        }
+
+        PDMDevHlpPCIPhysWrite(pThis->VPCI.CTX_SUFF(pDevIns), pReq->GCPhysStatus,
+                              &u8Status, sizeof(u8Status));
+        vqueuePutHead(&pThis->VPCI, pReq->pQueue, pReq->uIndex, cbWritten);
+
+        /*
+         * Requests completing while the notification is processed are synced
+         * once at the end, other completions are made visible right away.
+         */
+        if (pThis->fInNotify)
+            pThis->fQueuesSyncPending |= RT_BIT_32(pReq->pQueue - &pThis->VPCI.Queues[0]);
+        else
+            vqueueSync(&pThis->VPCI, pReq->pQueue);
+    }
+
+    vblkCsLeave(pThis);
+
+    if (pReq->DataSeg.pvSeg)
+        RTMemPageFree(pReq->DataSeg.pvSeg, pReq->DataSeg.cbSeg);
+    RTMemFree(pReq);
+
+    uint32_t cReqsActive = ASMAtomicDecU32(&pThis->cReqsActive);
+    if (!cReqsActive && pThis->fSignalIdle)
+        PDMDevHlpAsyncNotificationCompleted(pThis->VPCI.pDevInsR3);
+}
+
+/**
+ * @interface_method_impl{PDMIBLOCKASYNCPORT,pfnTransferCompleteNotify}
+ */
+static DECLCALLBACK(int) vblkR3TransferCompleteNotify(PPDMIBLOCKASYNCPORT pInterface, void *pvUser, int rcReq)
+{
+    PVBLKSTATE pThis = PDMIBLOCKASYNCPORT_2_PVBLKSTATE(pInterface);
+    PVBLKREQ   pReq  = (PVBLKREQ)pvUser;
+
+    vblkR3ReqComplete(pThis, pReq, rcReq);
+    return VINF_SUCCESS;
+}
+
+/**
+ * Submits a request to the attached disk.
+ *
+ * @param   pThis       The device state structure.
+ * @param   pReq        The request.
+ */
+static void vblkR3ReqSubmit(PVBLKSTATE pThis, PVBLKREQ pReq)
+{
+    int rc;
+
+    if (pReq->u32Type == VBLK_T_IN)
+        vpciSetReadLed(&pThis->VPCI, true);
+    else if (pReq->u32Type == VBLK_T_OUT)
+        vpciSetWriteLed(&pThis->VPCI, true);
+
+    if (pThis->pDrvBlockAsync)
+    {
+        if (pReq->u32Type == VBLK_T_IN)
+            rc = pThis->pDrvBlockAsync->pfnStartRead(pThis->pDrvBlockAsync, pReq->uOffset,
+                                                     &pReq->DataSeg, 1, pReq->cbTransfer, pReq);
+        else if (pReq->u32Type == VBLK_T_OUT)
+            rc = pThis->pDrvBlockAsync->pfnStartWrite(pThis->pDrvBlockAsync, pReq->uOffset,
+                                                      &pReq->DataSeg, 1, pReq->cbTransfer, pReq);
+        else
+            rc = pThis->pDrvBlockAsync->pfnStartFlush(pThis->pDrvBlockAsync, pReq);
+
+        if (rc == VINF_VD_ASYNC_IO_FINISHED)
+            vblkR3ReqComplete(pThis, pReq, VINF_SUCCESS);
+        else if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+            vblkR3ReqComplete(pThis, pReq, rc);
+    }
+    else
+    {
+        if (pReq->u32Type == VBLK_T_IN)
+            rc = pThis->pDrvBlock->pfnRead(pThis->pDrvBlock, pReq->uOffset,
+                                           pReq->DataSeg.pvSeg, pReq->cbTransfer);
+        else if (pReq->u32Type == VBLK_T_OUT)
+            rc = pThis->pDrvBlock->pfnWrite(pThis->pDrvBlock, pReq->uOffset,
+                                            pReq->DataSeg.pvSeg, pReq->cbTransfer);
+        else
+            rc = pThis->pDrvBlock->pfnFlush(pThis->pDrvBlock);
+
+        vblkR3ReqComplete(pThis, pReq, rc);
+    }
+}
+
+/**
+ * Parses a descriptor chain taken from a request queue and starts the request.
+ *
+ * @param   pThis       The device state structure.
+ * @param   pQueue      The queue the chain was taken from.
+ * @param   pElem       The descriptor chain.
+ */
+static void vblkR3ReqProcess(PVBLKSTATE pThis, PVQUEUE pQueue, PVQUEUEELEM pElem)
+{
+    PPDMDEVINS pDevIns = pThis->VPCI.CTX_SUFF(pDevIns);
+
+    if (   pElem->nOut < 1
+        || pElem->aSegsOut[0].cb < sizeof(VBLKREQHDR)
+        || pElem->nIn < 1
+        || pElem->aSegsIn[pElem->nIn - 1].cb < 1)
+    {
+        Log(("%s vblkR3ReqProcess: Malformed request (nOut=%u nIn=%u), dropping it\n",
+             INSTANCE(pThis), pElem->nOut, pElem->nIn));
+        vqueuePutHead(&pThis->VPCI, pQueue, pElem->uIndex, 0);
+        pThis->fQueuesSyncPending |= RT_BIT_32(pQueue - &pThis->VPCI.Queues[0]);
+        return;
+    }
+
+    VBLKREQHDR Hdr;
+    PDMDevHlpPhysRead(pDevIns, pElem->aSegsOut[0].addr, &Hdr, sizeof(Hdr));
+
+    /*
+     * The status byte is the last byte of the last guest writable segment,
+     * the data is in the segments between the header and the status byte.
+     */
+    VQUEUESEG *paSegs = NULL;
+    unsigned   cSegs  = 0;
+    if (Hdr.u32Type == VBLK_T_IN || Hdr.u32Type == VBLK_T_GET_ID)
+    {
+        paSegs = &pElem->aSegsIn[0];
+        cSegs  = pElem->nIn;
+    }
+    else if (Hdr.u32Type == VBLK_T_OUT)
+    {
+        paSegs = &pElem->aSegsOut[1];
+        cSegs  = pElem->nOut - 1;
+    }
+
+    PVBLKREQ pReq = (PVBLKREQ)RTMemAllocZ(RT_OFFSETOF(VBLKREQ, aGuestSegs[RT_MAX(cSegs, 1)]));
+    if (RT_UNLIKELY(!pReq))
+    {
+        LogRel(("%s: Out of memory while processing a request\n", INSTANCE(pThis)));
+        vqueuePutHead(&pThis->VPCI, pQueue, pElem->uIndex, 0);
+        pThis->fQueuesSyncPending |= RT_BIT_32(pQueue - &pThis->VPCI.Queues[0]);
+        return;
+    }
+
+    pReq->pQueue       = pQueue;
+    pReq->uIndex       = pElem->uIndex;
+    pReq->uGeneration  = pThis->uGeneration;
+    pReq->u32Type      = Hdr.u32Type;
+    /* A sector number beyond the disk would overflow the offset, let the range check below fail instead. */
+    pReq->uOffset      =   Hdr.u64Sector <= pThis->cbDisk / VBLK_SECTOR_SIZE
+                         ? Hdr.u64Sector * VBLK_SECTOR_SIZE
+                         : UINT64_MAX;
+    pReq->GCPhysStatus = pElem->aSegsIn[pElem->nIn - 1].addr + pElem->aSegsIn[pElem->nIn - 1].cb - 1;
+
+    for (unsigned i = 0; i < cSegs; i++)
+    {
+        uint32_t cbSeg = paSegs[i].cb;
+
+        /* Exclude the status byte. */
+        if (paSegs == &pElem->aSegsIn[0] && i == cSegs - 1)
+            cbSeg--;
+        if (cbSeg)
+        {
+            pReq->aGuestSegs[pReq->cGuestSegs].GCPhys = paSegs[i].addr;
+            pReq->aGuestSegs[pReq->cGuestSegs].cb     = cbSeg;
+            pReq->cGuestSegs++;
+            pReq->cbTransfer += cbSeg;
+        }
+    }
+
+    ASMAtomicIncU32(&pThis->cReqsActive);
+
+    switch (pReq->u32Type)
+    {
+        case VBLK_T_IN:
+        case VBLK_T_OUT:
+        {
+            if (   !pThis->pDrvBlock
+                || !pReq->cbTransfer
+                || pReq->cbTransfer > VBLK_TRANSFER_MAX
+                || pReq->cbTransfer % VBLK_SECTOR_SIZE
+                || pReq->uOffset > pThis->cbDisk
+                || pReq->cbTransfer > pThis->cbDisk - pReq->uOffset
+                || (pReq->u32Type == VBLK_T_OUT && pThis->fReadOnly))
+            {
+                Log(("%s vblkR3ReqProcess: Invalid request type %u offset %llu size %zu\n",
+                     INSTANCE(pThis), pReq->u32Type, pReq->uOffset, pReq->cbTransfer));
+                vblkR3ReqComplete(pThis, pReq, VERR_INVALID_PARAMETER);
+                break;
+            }
+
+            pReq->DataSeg.cbSeg = pReq->cbTransfer;
+            pReq->DataSeg.pvSeg = RTMemPageAlloc(pReq->cbTransfer);
+            if (RT_UNLIKELY(!pReq->DataSeg.pvSeg))
+            {
+                vblkR3ReqComplete(pThis, pReq, VERR_NO_MEMORY);
+                break;
+            }
+
+            if (pReq->u32Type == VBLK_T_IN)
+            {
+                STAM_REL_COUNTER_INC(&pThis->StatReqsRead);
+                STAM_REL_COUNTER_ADD(&pThis->StatBytesRead, pReq->cbTransfer);
+            }
+            else
+            {
+                vblkR3ReqCopy(pThis, pReq, pReq->DataSeg.pvSeg, pReq->cbTransfer, false /* fToGuest */);
+                STAM_REL_COUNTER_INC(&pThis->StatReqsWrite);
+                STAM_REL_COUNTER_ADD(&pThis->StatBytesWritten, pReq->cbTransfer);
+            }
+            vblkR3ReqSubmit(pThis, pReq);
+            break;
+        }
+        case VBLK_T_FLUSH:
+        {
+            if (!pThis->pDrvBlock)
+            {
+                vblkR3ReqComplete(pThis, pReq, VERR_INVALID_PARAMETER);
+                break;
+            }
+            STAM_REL_COUNTER_INC(&pThis->StatReqsFlush);
+            vblkR3ReqSubmit(pThis, pReq);
+            break;
+        }
+        case VBLK_T_GET_ID:
+        {
+            /* Not zero terminated if the ID uses the full length. */
+            vblkR3ReqCopy(pThis, pReq, pThis->szId, RT_MIN(pReq->cbTransfer, VBLK_ID_BYTES), true /* fToGuest */);
+            pReq->cbTransfer = 0;
+            vblkR3ReqComplete(pThis, pReq, VINF_SUCCESS);
+            break;
+        }
+        default:
+            vblkR3ReqComplete(pThis, pReq, VERR_NOT_SUPPORTED);
+    }
+}
+
+/**
+ * Processes all requests available in a request queue.
+ *
+ * Guest notifications are disabled while the queue is drained, the guest only
+ * kicks us again after we re-enable them, and completions of requests which
+ * finish during the drain are made visible with a single ring update.
+ *
+ * @param   pvState     The device state structure.
+ * @param   pQueue      The queue to process.
+ */
+static DECLCALLBACK(void) vblkR3QueueNotify(void *pvState, PVQUEUE pQueue)
+{
+    PVBLKSTATE  pThis = (PVBLKSTATE)pvState;
+    VQUEUEELEM  elem;
+
+    int rc = vblkCsEnter(pThis, VERR_SEM_BUSY);
+    if (RT_UNLIKELY(rc != VINF_SUCCESS))
+    {
+        LogRel(("%s vblkR3QueueNotify failed to enter critical section!\n", INSTANCE(pThis)));
+        return;
+    }
+
+    STAM_PROFILE_START(&pThis->StatNotify, a);
+    STAM_REL_COUNTER_INC(&pThis->StatNotifies);
+    pThis->fInNotify = true;
+
+    for (;;)
+    {
+        vringSetNotification(&pThis->VPCI, &pQueue->VRing, false);
+        while (vqueueGet(&pThis->VPCI, pQueue, &elem))
+        {
+            STAM_REL_COUNTER_INC(&pThis->StatNotifyReqs);
+            vblkR3ReqProcess(pThis, pQueue, &elem);
+        }
+        vringSetNotification(&pThis->VPCI, &pQueue->VRing, true);
+
+        /* Catch requests the guest added before it saw the notification flag. */
+        ASMMemoryFence();
+        if (vqueueIsEmpty(&pThis->VPCI, pQueue))
+            break;
+    }
+
+    pThis->fInNotify = false;
+    for (unsigned i = 0; pThis->fQueuesSyncPending; i++)
+        if (pThis->fQueuesSyncPending & RT_BIT_32(i))
+        {
+            pThis->fQueuesSyncPending &= ~RT_BIT_32(i);
+            vqueueSync(&pThis->VPCI, &pThis->VPCI.Queues[i]);
+        }
+
+    STAM_PROFILE_STOP(&pThis->StatNotify, a);
+    vblkCsLeave(pThis);
+}
+
+
+/* -=-=-=-=- Saved State -=-=-=-=- */
+
+/**
+ * @callback_method_impl{FNSSMDEVLIVEEXEC}
+ */
+static DECLCALLBACK(int) vblkLiveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint32_t uPass)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+    SSMR3PutU32(pSSM, pThis->cQueues);
+    SSMR3PutBool(pSSM, pThis->pDrvBase != NULL);
+    return VINF_SSM_DONT_CALL_AGAIN;
+}
+
+
+/**
+ * @callback_method_impl{FNSSMDEVSAVEEXEC}
+ */
+static DECLCALLBACK(int) vblkSaveExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+
+    /* All requests were completed when the VM was suspended. */
+    Assert(!pThis->cReqsActive);
+
+    /* Save config first */
+    vblkLiveExec(pDevIns, pSSM, SSM_PASS_FINAL);
+
+    /* Save the common part */
+    int rc = vpciSaveExec(&pThis->VPCI, pSSM);
+    AssertRCReturn(rc, rc);
+    Log(("%s State has been saved\n", INSTANCE(pThis)));
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * @callback_method_impl{FNSSMDEVLOADEXEC}
+ */
+static DECLCALLBACK(int) vblkLoadExec(PPDMDEVINS pDevIns, PSSMHANDLE pSSM, uint32_t uVersion, uint32_t uPass)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+    int        rc;
+
+    /* config checks */
+    uint32_t cQueues;
+    rc = SSMR3GetU32(pSSM, &cQueues);
+    AssertRCReturn(rc, rc);
+    if (cQueues != pThis->cQueues)
+        return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("Config mismatch - saved NumQueues=%u; configured NumQueues=%u"),
+                                cQueues, pThis->cQueues);
+    bool fAttached;
+    rc = SSMR3GetBool(pSSM, &fAttached);
+    AssertRCReturn(rc, rc);
+    if (fAttached != (pThis->pDrvBase != NULL))
+        return SSMR3SetCfgError(pSSM, RT_SRC_POS, N_("The disk is %s in the saved state but %s in the VM configuration"),
+                                fAttached ? "attached" : "detached", pThis->pDrvBase ? "attached" : "detached");
+
+    if (uPass == SSM_PASS_FINAL)
+    {
+        rc = vpciLoadExec(&pThis->VPCI, pSSM, uVersion, uPass, pThis->cQueues);
+        AssertRCReturn(rc, rc);
+    }
+
+    return rc;
+}
+
+
+/* -=-=-=-=- PCI Device -=-=-=-=- */
+
+/**
+ * @callback_method_impl{FNPCIIOREGIONMAP}
+ */
+static DECLCALLBACK(int) vblkMap(PPCIDEVICE pPciDev, int iRegion,
+                                 RTGCPHYS GCPhysAddress, uint32_t cb, PCIADDRESSSPACE enmType)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pPciDev->pDevIns, PVBLKSTATE);
+    int        rc;
+
+    if (enmType != PCI_ADDRESS_SPACE_IO)
+    {
+        /* We should never get here */
+        AssertMsgFailed(("Invalid PCI address space param in map callback"));
+        return VERR_INTERNAL_ERROR;
+    }
+
+    pThis->VPCI.IOPortBase = (RTIOPORT)GCPhysAddress;
+    rc = PDMDevHlpIOPortRegister(pPciDev->pDevIns, pThis->VPCI.IOPortBase,
+                                 cb, 0, vblkIOPortOut, vblkIOPortIn,
+                                 NULL, NULL, "VirtioBlk");
+#ifdef VBLK_GC_SUPPORT
+    AssertRCReturn(rc, rc);
+    rc = PDMDevHlpIOPortRegisterR0(pPciDev->pDevIns, pThis->VPCI.IOPortBase,
+                                   cb, 0, "vblkIOPortOut", "vblkIOPortIn",
+                                   NULL, NULL, "VirtioBlk");
+    AssertRCReturn(rc, rc);
+    rc = PDMDevHlpIOPortRegisterRC(pPciDev->pDevIns, pThis->VPCI.IOPortBase,
+                                   cb, 0, "vblkIOPortOut", "vblkIOPortIn",
+                                   NULL, NULL, "VirtioBlk");
+#endif
+    AssertRC(rc);
+    return rc;
+}
+
+
+/* -=-=-=-=- PDMDEVREG -=-=-=-=- */
+
+/**
+ * Queries the disk parameters from the attached driver and sets up the
+ * configuration space accordingly.
+ *
+ * @returns VBox status code.
+ * @param   pDevIns     The device instance.
+ */
+static int vblkR3ConfigureLUN(PPDMDEVINS pDevIns)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+
+    pThis->pDrvBlock = PDMIBASE_QUERY_INTERFACE(pThis->pDrvBase, PDMIBLOCK);
+    AssertMsgReturn(pThis->pDrvBlock, ("Configuration error: LUN#0 hasn't a block interface!\n"),
+                    VERR_PDM_MISSING_INTERFACE);
+    pThis->pDrvBlockBios = PDMIBASE_QUERY_INTERFACE(pThis->pDrvBase, PDMIBLOCKBIOS);
+    AssertMsgReturn(pThis->pDrvBlockBios, ("Configuration error: LUN#0 hasn't a block BIOS interface!\n"),
+                    VERR_PDM_MISSING_INTERFACE);
+    pThis->pDrvBlockAsync = PDMIBASE_QUERY_INTERFACE(pThis->pDrvBase, PDMIBLOCKASYNC);
+
+    PDMBLOCKTYPE enmType = pThis->pDrvBlock->pfnGetType(pThis->pDrvBlock);
+    if (enmType != PDMBLOCKTYPE_HARD_DISK)
+    {
+        AssertMsgFailed(("Configuration error: LUN#0 isn't a disk. enmType=%d\n", enmType));
+        return VERR_PDM_UNSUPPORTED_BLOCK_TYPE;
+    }
+
+    pThis->fReadOnly = pThis->pDrvBlock->pfnIsReadOnly(pThis->pDrvBlock);
+    pThis->cbDisk    = pThis->pDrvBlock->pfnGetSize(pThis->pDrvBlock) & ~(uint64_t)(VBLK_SECTOR_SIZE - 1);
+
+    uint32_t cbSector = pThis->pDrvBlock->pfnGetSectorSize(pThis->pDrvBlock);
+    if (!cbSector || cbSector % VBLK_SECTOR_SIZE)
+        cbSector = VBLK_SECTOR_SIZE;
+
+    PDMMEDIAGEOMETRY PCHSGeometry;
+    int rc = pThis->pDrvBlockBios->pfnGetPCHSGeometry(pThis->pDrvBlockBios, &PCHSGeometry);
+    if (RT_FAILURE(rc))
+        PCHSGeometry.cCylinders = 0; /* autodetect marker */
+    if (   PCHSGeometry.cCylinders == 0
+        || PCHSGeometry.cHeads == 0
+        || PCHSGeometry.cSectors == 0)
+    {
+        uint64_t cCylinders = pThis->cbDisk / VBLK_SECTOR_SIZE / (16 * 63);
+        PCHSGeometry.cCylinders = RT_MAX(RT_MIN(cCylinders, 16383), 1);
+        PCHSGeometry.cHeads     = 16;
+        PCHSGeometry.cSectors   = 63;
+    }
+
+    pThis->config.uCapacity  = pThis->cbDisk / VBLK_SECTOR_SIZE;
+    pThis->config.uSizeMax   = 0;
+    pThis->config.uSegMax    = VBLK_SEG_MAX;
+    pThis->config.uCylinders = (uint16_t)RT_MIN(PCHSGeometry.cCylinders, UINT16_MAX);
+    pThis->config.uHeads     = (uint8_t)PCHSGeometry.cHeads;
+    pThis->config.uSectors   = (uint8_t)PCHSGeometry.cSectors;
+    pThis->config.uBlkSize   = cbSector;
+
+    /* Generate the device ID from the disk UUID like the other controllers do for the serial number. */
+    RTUUID Uuid;
+    rc = pThis->pDrvBlock->pfnGetUuid(pThis->pDrvBlock, &Uuid);
+    if (RT_FAILURE(rc) || RTUuidIsNull(&Uuid))
+        RTStrPrintf(pThis->szId, sizeof(pThis->szId), "VB%x-1a2b3c4d", pDevIns->iInstance);
+    else
+        RTStrPrintf(pThis->szId, sizeof(pThis->szId), "VB%08x-%08x", Uuid.au32[0], Uuid.au32[3]);
+
+    LogRel(("%s: disk, PCHS=%u/%u/%u, total number of sectors %llu, sector size %u%s%s\n",
+            INSTANCE(pThis), PCHSGeometry.cCylinders, PCHSGeometry.cHeads, PCHSGeometry.cSectors,
+            pThis->config.uCapacity, cbSector, pThis->fReadOnly ? ", read only" : "",
+            pThis->pDrvBlockAsync ? ", async I/O" : ""));
+    return VINF_SUCCESS;
+}
+
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnDetach}
+ */
+static DECLCALLBACK(void) vblkDetach(PPDMDEVINS pDevIns, unsigned iLUN, uint32_t fFlags)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+    Log(("%s vblkDetach:\n", INSTANCE(pThis)));
+
+    AssertLogRelReturnVoid(iLUN == 0);
+    AssertMsg(fFlags & PDM_TACH_FLAGS_NOT_HOT_PLUG,
+              ("virtio-blk: Device does not support hotplugging\n"));
+
+    /*
+     * Zero some important members.
+     */
+    pThis->pDrvBase       = NULL;
+    pThis->pDrvBlock      = NULL;
+    pThis->pDrvBlockAsync = NULL;
+    pThis->pDrvBlockBios  = NULL;
+    pThis->cbDisk         = 0;
+    pThis->config.uCapacity = 0;
+}
+
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnAttach}
+ */
+static DECLCALLBACK(int) vblkAttach(PPDMDEVINS pDevIns, unsigned iLUN, uint32_t fFlags)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+    LogFlow(("%s vblkAttach:\n",  INSTANCE(pThis)));
+
+    AssertLogRelReturn(iLUN == 0, VERR_PDM_NO_SUCH_LUN);
+    AssertMsgReturn(fFlags & PDM_TACH_FLAGS_NOT_HOT_PLUG,
+                    ("virtio-blk: Device does not support hotplugging\n"),
+                    VERR_INVALID_PARAMETER);
+
+    /* the usual paranoia */
+    AssertRelease(!pThis->pDrvBase);
+    AssertRelease(!pThis->pDrvBlock);
+
+    int rc = PDMDevHlpDriverAttach(pDevIns, 0, &pThis->VPCI.IBase, &pThis->pDrvBase, "Disk");
+    if (RT_SUCCESS(rc))
+        rc = vblkR3ConfigureLUN(pDevIns);
+    else
+        AssertMsgFailed(("Failed to attach LUN#0. rc=%Rrc\n", rc));
+
+    if (RT_FAILURE(rc))
+    {
+        pThis->pDrvBase  = NULL;
+        pThis->pDrvBlock = NULL;
+    }
+    return rc;
+}
+
+
+/**
+ * Checks whether all requests have been completed.
+ *
+ * @returns true if there are no outstanding requests, false otherwise.
+ * @param   pDevIns     The device instance.
+ */
+static bool vblkR3AllAsyncIOIsFinished(PPDMDEVINS pDevIns)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+    return ASMAtomicReadU32(&pThis->cReqsActive) == 0;
+}
+
+
+/**
+ * Callback employed by vblkSuspend and vblkPowerOff.
+ *
+ * @returns true if we've quiesced, false if we're still working.
+ * @param   pDevIns     The device instance.
+ */
+static DECLCALLBACK(bool) vblkIsAsyncSuspendOrPowerOffDone(PPDMDEVINS pDevIns)
+{
+    if (!vblkR3AllAsyncIOIsFinished(pDevIns))
+        return false;
+
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+    ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+    return true;
+}
+
+
+/**
+ * Common worker for vblkSuspend and vblkPowerOff.
+ */
+static void vblkSuspendOrPowerOff(PPDMDEVINS pDevIns)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+
+    ASMAtomicWriteBool(&pThis->fSignalIdle, true);
+    if (!vblkR3AllAsyncIOIsFinished(pDevIns))
+        PDMDevHlpSetAsyncNotification(pDevIns, vblkIsAsyncSuspendOrPowerOffDone);
+    else
+        ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+}
+
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnSuspend}
+ */
+static DECLCALLBACK(void) vblkSuspend(PPDMDEVINS pDevIns)
+{
+    vblkSuspendOrPowerOff(pDevIns);
+}
+
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnPowerOff}
+ */
+static DECLCALLBACK(void) vblkPowerOff(PPDMDEVINS pDevIns)
+{
+    vblkSuspendOrPowerOff(pDevIns);
+}
+
+
+/**
+ * Callback employed by vblkReset.
+ *
+ * @returns true if we've quiesced, false if we're still working.
+ * @param   pDevIns     The device instance.
+ */
+static DECLCALLBACK(bool) vblkIsAsyncResetDone(PPDMDEVINS pDevIns)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+
+    if (!vblkR3AllAsyncIOIsFinished(pDevIns))
+        return false;
+    ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+
+    vblkIoCb_Reset(pThis);
+    return true;
+}
+
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnReset}
+ */
+static DECLCALLBACK(void) vblkReset(PPDMDEVINS pDevIns)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+
+    ASMAtomicWriteBool(&pThis->fSignalIdle, true);
+    if (!vblkR3AllAsyncIOIsFinished(pDevIns))
+        PDMDevHlpSetAsyncNotification(pDevIns, vblkIsAsyncResetDone);
+    else
+    {
+        ASMAtomicWriteBool(&pThis->fSignalIdle, false);
+        vblkIoCb_Reset(pThis);
+    }
+}
+
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnRelocate}
+ */
+static DECLCALLBACK(void) vblkRelocate(PPDMDEVINS pDevIns, RTGCINTPTR offDelta)
+{
+    vpciRelocate(pDevIns, offDelta);
+}
+
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnDestruct}
+ */
+static DECLCALLBACK(int) vblkDestruct(PPDMDEVINS pDevIns)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+    PDMDEV_CHECK_VERSIONS_RETURN_QUIET(pDevIns);
+
+    Log(("%s Destroying instance\n", INSTANCE(pThis)));
+    return vpciDestruct(&pThis->VPCI);
+}
+
+
+/**
+ * @interface_method_impl{PDMDEVREG,pfnConstruct}
+ */
+static DECLCALLBACK(int) vblkConstruct(PPDMDEVINS pDevIns, int iInstance, PCFGMNODE pCfg)
+{
+    PVBLKSTATE pThis = PDMINS_2_DATA(pDevIns, PVBLKSTATE);
+    int        rc;
+    PDMDEV_CHECK_VERSIONS_RETURN(pDevIns);
+
+    /* Do our own locking. */
+    rc = PDMDevHlpSetDeviceCritSect(pDevIns, PDMDevHlpCritSectGetNop(pDevIns));
+    AssertRCReturn(rc, rc);
+
+    /*
+     * Validate configuration.
+     */
+    if (!CFGMR3AreValuesValid(pCfg, "NumQueues\0"))
+        return PDMDEV_SET_ERROR(pDevIns, VERR_PDM_DEVINS_UNKNOWN_CFG_VALUES,
+                                N_("Invalid configuration for VirtioBlk device"));
+
+    rc = CFGMR3QueryU32Def(pCfg, "NumQueues", &pThis->cQueues, 1);
+    if (RT_FAILURE(rc))
+        return PDMDEV_SET_ERROR(pDevIns, rc,
+                                N_("Configuration error: Failed to get the value of 'NumQueues'"));
+    if (pThis->cQueues < 1 || pThis->cQueues > VBLK_N_QUEUES_MAX)
+        return PDMDevHlpVMSetError(pDevIns, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                                   N_("Configuration error: 'NumQueues' must be between 1 and %u"),
+                                   VBLK_N_QUEUES_MAX);
+
+    /* Initialize PCI part. */
+    pThis->VPCI.IBase.pfnQueryInterface = vblkQueryInterface;
+    rc = vpciConstruct(pDevIns, &pThis->VPCI, iInstance,
+                       VBLK_NAME_FMT, VBLK_PCI_SUBSYSTEM_ID,
+                       VBLK_PCI_CLASS, pThis->cQueues);
+    if (RT_FAILURE(rc))
+        return rc;
+    for (unsigned i = 0; i < pThis->cQueues; i++)
+    {
+        static const char * const s_apszNames[VBLK_N_QUEUES_MAX] =
+        { "RQ0", "RQ1", "RQ2", "RQ3", "RQ4", "RQ5", "RQ6", "RQ7" };
+        pThis->apReqQueues[i] = vpciAddQueue(&pThis->VPCI, VBLK_QUEUE_SIZE, vblkR3QueueNotify, s_apszNames[i]);
+        AssertReturn(pThis->apReqQueues[i], VERR_INTERNAL_ERROR_2);
+    }
+
+    Log(("%s Constructing new instance\n", INSTANCE(pThis)));
+
+    /* Initialize PCI config space */
+    pThis->config.uNumQueues = (uint16_t)pThis->cQueues;
+
+    /* Interfaces */
+    pThis->IPort.pfnQueryDeviceLocation           = vblkR3QueryDeviceLocation;
+    pThis->IPortAsync.pfnTransferCompleteNotify   = vblkR3TransferCompleteNotify;
+
+    /* Map our ports to IO space. */
+    rc = PDMDevHlpPCIIORegionRegister(pDevIns, 0,
+                                      VPCI_CONFIG + sizeof(struct VBlkPCIConfig),
+                                      PCI_ADDRESS_SPACE_IO, vblkMap);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    /* Register save/restore state handlers. */
+    rc = PDMDevHlpSSMRegisterEx(pDevIns, VIRTIO_SAVEDSTATE_VERSION, sizeof(VBLKSTATE), NULL,
+                                NULL,         vblkLiveExec, NULL,
+                                NULL,         vblkSaveExec, NULL,
+                                NULL,         vblkLoadExec, NULL);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    /* Attach the disk. */
+    rc = PDMDevHlpDriverAttach(pDevIns, 0, &pThis->VPCI.IBase, &pThis->pDrvBase, "Disk");
+    if (RT_SUCCESS(rc))
+    {
+        rc = vblkR3ConfigureLUN(pDevIns);
+        if (RT_FAILURE(rc))
+            return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to configure the disk LUN"));
+    }
+    else if (rc == VERR_PDM_NO_ATTACHED_DRIVER)
+    {
+         /* No error! */
+        pThis->pDrvBase = NULL;
+        Log(("%s No disk is attached to this controller\n", INSTANCE(pThis)));
+    }
+    else
+        return PDMDEV_SET_ERROR(pDevIns, rc, N_("Failed to attach the disk LUN"));
+
+    rc = vblkIoCb_Reset(pThis);
+    AssertRC(rc);
+
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatBytesRead,          STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,          "Amount of data read",                "/Devices/VBlk%d/ReadBytes", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatBytesWritten,       STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_BYTES,          "Amount of data written",             "/Devices/VBlk%d/WrittenBytes", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReqsRead,           STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,          "Number of read requests",            "/Devices/VBlk%d/Reqs/Read", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReqsWrite,          STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,          "Number of write requests",           "/Devices/VBlk%d/Reqs/Write", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatReqsFlush,          STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,          "Number of flush requests",           "/Devices/VBlk%d/Reqs/Flush", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatNotifies,           STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_OCCURENCES,     "Number of queue notifications",      "/Devices/VBlk%d/Notify/Count", iInstance);
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatNotifyReqs,         STAMTYPE_COUNTER, STAMVISIBILITY_ALWAYS, STAMUNIT_COUNT,          "Number of requests taken from the queues", "/Devices/VBlk%d/Notify/Reqs", iInstance);
+#if defined(VBOX_WITH_STATISTICS)
+    PDMDevHlpSTAMRegisterF(pDevIns, &pThis->StatNotify,             STAMTYPE_PROFILE, STAMVISIBILITY_ALWAYS, STAMUNIT_TICKS_PER_CALL, "Profiling queue notifications",      "/Devices/VBlk%d/Notify/Total", iInstance);
+#endif /* VBOX_WITH_STATISTICS */
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * The device registration structure.
+ */
+const PDMDEVREG g_DeviceVirtioBlk =
+{
+    /* Structure version. PDM_DEVREG_VERSION defines the current version. */
+    PDM_DEVREG_VERSION,
+    /* Device name. */
+    "virtio-blk",
+    /* Name of guest context module (no path).
+     * Only evalutated if PDM_DEVREG_FLAGS_RC is set. */
+    "VBoxDDGC.gc",
+    /* Name of ring-0 module (no path).
+     * Only evalutated if PDM_DEVREG_FLAGS_RC is set. */
+    "VBoxDDR0.r0",
+    /* The description of the device. The UTF-8 string pointed to shall, like this structure,
+     * remain unchanged from registration till VM destruction. */
+    "Virtio Block Device.\n",
+
+    /* Flags, combination of the PDM_DEVREG_FLAGS_* \#defines. */
+#ifdef VBLK_GC_SUPPORT
+    PDM_DEVREG_FLAGS_DEFAULT_BITS | PDM_DEVREG_FLAGS_RC | PDM_DEVREG_FLAGS_R0,
+#else
+    PDM_DEVREG_FLAGS_DEFAULT_BITS,
+#endif
+    /* Device class(es), combination of the PDM_DEVREG_CLASS_* \#defines. */
+    PDM_DEVREG_CLASS_STORAGE,
+    /* Maximum number of instances (per VM). */
+    ~0U,
+    /* Size of the instance data. */
+    sizeof(VBLKSTATE),
+
+    /* pfnConstruct */
+    vblkConstruct,
+    /* pfnDestruct */
+    vblkDestruct,
+    /* pfnRelocate */
+    vblkRelocate,
+    /* pfnMemSetup. */
+    NULL,
+    /* pfnPowerOn */
+    NULL,
+    /* pfnReset */
+    vblkReset,
+    /* pfnSuspend */
+    vblkSuspend,
+    /* pfnResume */
+    NULL,
+    /* pfnAttach */
+    vblkAttach,
+    /* pfnDetach */
+    vblkDetach,
+    /* pfnQueryInterface */
+    NULL,
+    /* pfnInitComplete */
+    NULL,
+    /* pfnPowerOff */
+    vblkPowerOff,
+    /* pfnSoftReset */
+    NULL,
+
+    /* u32VersionEnd */
+    PDM_DEVREG_VERSION
+};
+
+#endif /* IN_RING3 */
+#endif /* !VBOX_DEVICE_STRUCT_TESTCASE */
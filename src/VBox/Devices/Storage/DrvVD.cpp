@@ -70,6 +70,34 @@ extern bool DevINIPConfigured(void);
 #define PDMIMEDIAASYNC_2_VBOXDISK(pInterface) \
     ( (PVBOXDISK)((uintptr_t)pInterface - RT_OFFSETOF(VBOXDISK, IMediaAsync)) )
 
+/** Number of log2 buckets of a latency histogram. */
+#define DRVVD_LATENCY_BUCKETS               24
+/** Number of samples after which the percentiles of a histogram are recalculated. */
+#define DRVVD_LATENCY_PERCENTILE_INTERVAL   256
+
+/**
+ * Latency histogram with log2 buckets.
+ */
+typedef struct DRVVDLATHIST
+{
+    /** Profile of all samples giving the number, average, minimum and maximum. */
+    STAMPROFILE         Profile;
+    /** Number of samples in each bucket. Bucket i counts latencies in the range
+     * [2^i, 2^(i+1)) microseconds, bucket 0 includes everything below 1us and
+     * the last bucket everything above. */
+    STAMCOUNTER         aBuckets[DRVVD_LATENCY_BUCKETS];
+    /** 50th percentile in nanoseconds (upper bound of the containing bucket). */
+    uint64_t            cNsP50;
+    /** 90th percentile in nanoseconds (upper bound of the containing bucket). */
+    uint64_t            cNsP90;
+    /** 99th percentile in nanoseconds (upper bound of the containing bucket). */
+    uint64_t            cNsP99;
+    /** 99.9th percentile in nanoseconds (upper bound of the containing bucket). */
+    uint64_t            cNsP999;
+    /** Number of samples since the percentiles were recalculated. */
+    volatile uint32_t   cSamplesSinceUpdate;
+} DRVVDLATHIST, *PDRVVDLATHIST;
+
 /**
  * VBox disk container, image information, private part.
  */
@@ -185,6 +213,16 @@ typedef struct VBOXDISK
 
     /** The block cache handle if configured. */
     PPDMBLKCACHE             pBlkCache;
+
+    /** Flag whether latency statistics are collected. */
+    bool                     fLatencyStats;
+    /** Latency reporting interface. */
+    VDINTERFACELATENCY       VDIfLatency;
+    /** Latency of the submission calls made by the device (the whole
+     * request for synchronous I/O), indexed by read (0) and write (1). */
+    DRVVDLATHIST             aLatSubmit[2];
+    /** Latencies reported by the VD layer, indexed by stage and read (0) / write (1). */
+    DRVVDLATHIST             aLatVd[VDLATENCYSTAGE_END][2];
 } VBOXDISK, *PVBOXDISK;
 
 
@@ -226,6 +264,120 @@ static void drvvdFreeImages(PVBOXDISK pThis)
 }
 
 
+/**
+ * Internal: Recalculates the percentiles of a latency histogram from the bucket counts.
+ */
+static void drvvdLatHistUpdatePercentiles(PDRVVDLATHIST pHist)
+{
+    static const unsigned s_auPerMille[] = { 500, 900, 990, 999 };
+    uint64_t *apcNsPercentile[] = { &pHist->cNsP50, &pHist->cNsP90, &pHist->cNsP99, &pHist->cNsP999 };
+    uint64_t acSamples[DRVVD_LATENCY_BUCKETS];
+    uint64_t cSamples = 0;
+
+    for (unsigned i = 0; i < RT_ELEMENTS(acSamples); i++)
+    {
+        acSamples[i] = ASMAtomicReadU64(&pHist->aBuckets[i].c);
+        cSamples += acSamples[i];
+    }
+
+    if (!cSamples)
+        return;
+
+    unsigned idxBucket = 0;
+    uint64_t cSamplesBelow = acSamples[0];
+    for (unsigned i = 0; i < RT_ELEMENTS(s_auPerMille); i++)
+    {
+        uint64_t cSamplesTarget = (cSamples * s_auPerMille[i] + 999) / 1000;
+
+        while (   cSamplesBelow < cSamplesTarget
+               && idxBucket < DRVVD_LATENCY_BUCKETS - 1)
+            cSamplesBelow += acSamples[++idxBucket];
+
+        *apcNsPercentile[i] = (uint64_t)RT_NS_1US << (idxBucket + 1);
+    }
+}
+
+/**
+ * Internal: Adds a sample to a latency histogram.
+ */
+static void drvvdLatHistAdd(PDRVVDLATHIST pHist, uint64_t cNsLatency)
+{
+    uint64_t cUsLatency = cNsLatency / RT_NS_1US;
+    unsigned idxBucket = cUsLatency ? ASMBitLastSetU32((uint32_t)RT_MIN(cUsLatency, UINT32_MAX)) - 1 : 0;
+
+    idxBucket = RT_MIN(idxBucket, DRVVD_LATENCY_BUCKETS - 1);
+    ASMAtomicIncU64(&pHist->aBuckets[idxBucket].c);
+    STAM_REL_PROFILE_ADD_PERIOD(&pHist->Profile, cNsLatency);
+
+    if (ASMAtomicIncU32(&pHist->cSamplesSinceUpdate) >= DRVVD_LATENCY_PERCENTILE_INTERVAL)
+    {
+        ASMAtomicWriteU32(&pHist->cSamplesSinceUpdate, 0);
+        drvvdLatHistUpdatePercentiles(pHist);
+    }
+}
+
+/**
+ * Internal: Registers a latency histogram with STAM.
+ */
+static void drvvdLatHistRegister(PPDMDRVINS pDrvIns, PDRVVDLATHIST pHist, const char *pszDesc,
+                                 const char *pszStage, const char *pszDir)
+{
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pHist->Profile, STAMTYPE_PROFILE, STAMVISIBILITY_USED, STAMUNIT_NS_PER_CALL,
+                           pszDesc, "/Drivers/VD%d/Latency/%s/%s/Profile", pDrvIns->iInstance, pszStage, pszDir);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pHist->cNsP50, STAMTYPE_U64, STAMVISIBILITY_USED, STAMUNIT_NS,
+                           "50th percentile", "/Drivers/VD%d/Latency/%s/%s/P50", pDrvIns->iInstance, pszStage, pszDir);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pHist->cNsP90, STAMTYPE_U64, STAMVISIBILITY_USED, STAMUNIT_NS,
+                           "90th percentile", "/Drivers/VD%d/Latency/%s/%s/P90", pDrvIns->iInstance, pszStage, pszDir);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pHist->cNsP99, STAMTYPE_U64, STAMVISIBILITY_USED, STAMUNIT_NS,
+                           "99th percentile", "/Drivers/VD%d/Latency/%s/%s/P99", pDrvIns->iInstance, pszStage, pszDir);
+    PDMDrvHlpSTAMRegisterF(pDrvIns, &pHist->cNsP999, STAMTYPE_U64, STAMVISIBILITY_USED, STAMUNIT_NS,
+                           "99.9th percentile", "/Drivers/VD%d/Latency/%s/%s/P99.9", pDrvIns->iInstance, pszStage, pszDir);
+    for (unsigned i = 0; i < DRVVD_LATENCY_BUCKETS; i++)
+        PDMDrvHlpSTAMRegisterF(pDrvIns, &pHist->aBuckets[i], STAMTYPE_COUNTER, STAMVISIBILITY_USED, STAMUNIT_OCCURENCES,
+                               "Number of samples below the latency in the name (and above the previous bucket)",
+                               "/Drivers/VD%d/Latency/%s/%s/Lt%08uus", pDrvIns->iInstance, pszStage, pszDir, 1U << (i + 1));
+}
+
+/**
+ * Internal: Deregisters a latency histogram from STAM.
+ */
+static void drvvdLatHistDeregister(PPDMDRVINS pDrvIns, PDRVVDLATHIST pHist)
+{
+    PDMDrvHlpSTAMDeregister(pDrvIns, &pHist->Profile);
+    PDMDrvHlpSTAMDeregister(pDrvIns, &pHist->cNsP50);
+    PDMDrvHlpSTAMDeregister(pDrvIns, &pHist->cNsP90);
+    PDMDrvHlpSTAMDeregister(pDrvIns, &pHist->cNsP99);
+    PDMDrvHlpSTAMDeregister(pDrvIns, &pHist->cNsP999);
+    for (unsigned i = 0; i < DRVVD_LATENCY_BUCKETS; i++)
+        PDMDrvHlpSTAMDeregister(pDrvIns, &pHist->aBuckets[i]);
+}
+
+/**
+ * Internal: Returns the start timestamp for a submission latency sample.
+ *
+ * @returns Timestamp in nanoseconds, 0 if latency statistics are disabled.
+ * @param   pThis    The disk instance.
+ */
+DECLINLINE(uint64_t) drvvdLatSubmitStart(PVBOXDISK pThis)
+{
+    return RT_UNLIKELY(pThis->fLatencyStats) ? RTTimeNanoTS() : 0;
+}
+
+/**
+ * Internal: Records the latency of a submission call.
+ *
+ * @returns nothing.
+ * @param   pThis    The disk instance.
+ * @param   fWrite   Flag whether this was a write, flush or discard.
+ * @param   tsStart  The start timestamp from drvvdLatSubmitStart().
+ */
+DECLINLINE(void) drvvdLatSubmitEnd(PVBOXDISK pThis, bool fWrite, uint64_t tsStart)
+{
+    if (RT_UNLIKELY(tsStart))
+        drvvdLatHistAdd(&pThis->aLatSubmit[fWrite ? 1 : 0], RTTimeNanoTS() - tsStart);
+}
+
+
 /**
  * Make the image temporarily read-only.
  *
@@ -596,6 +748,19 @@ static DECLCALLBACK(int) drvvdThreadFinishWrite(void *pvUser)
 }
 
 
+/*******************************************************************************
+*   VD latency interface implementation                                        *
+*******************************************************************************/
+
+static DECLCALLBACK(void) drvvdLatencyRecord(void *pvUser, VDLATENCYSTAGE enmStage, bool fWrite, uint64_t cNsLatency)
+{
+    PVBOXDISK pThis = (PVBOXDISK)pvUser;
+
+    AssertReturnVoid(enmStage < VDLATENCYSTAGE_END);
+    drvvdLatHistAdd(&pThis->aLatVd[enmStage][fWrite ? 1 : 0], cNsLatency);
+}
+
+
 /*******************************************************************************
 *   VD Configuration interface implementation                                  *
 *******************************************************************************/
@@ -1498,6 +1663,7 @@ static DECLCALLBACK(int) drvvdRead(PPDMIMEDIA pInterface,
 
     LogFlowFunc(("off=%#llx pvBuf=%p cbRead=%d\n", off, pvBuf, cbRead));
     PVBOXDISK pThis = PDMIMEDIA_2_VBOXDISK(pInterface);
+    uint64_t tsStart = drvvdLatSubmitStart(pThis);
 
     if (!pThis->fBootAccelActive)
         rc = VDRead(pThis->pDisk, off, pvBuf, cbRead);
@@ -1533,6 +1699,8 @@ static DECLCALLBACK(int) drvvdRead(PPDMIMEDIA pInterface,
         }
     }
 
+    drvvdLatSubmitEnd(pThis, false /* fWrite */, tsStart);
+
     if (RT_SUCCESS(rc))
         Log2(("%s: off=%#llx pvBuf=%p cbRead=%d\n%.*Rhxd\n", __FUNCTION__,
               off, pvBuf, cbRead, cbRead, pvBuf));
@@ -1557,7 +1725,9 @@ static DECLCALLBACK(int) drvvdWrite(PPDMIMEDIA pInterface,
         pThis->offDisk     = 0;
     }
 
+    uint64_t tsStart = drvvdLatSubmitStart(pThis);
     int rc = VDWrite(pThis->pDisk, off, pvBuf, cbWrite);
+    drvvdLatSubmitEnd(pThis, true /* fWrite */, tsStart);
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
 }
@@ -1567,7 +1737,9 @@ static DECLCALLBACK(int) drvvdFlush(PPDMIMEDIA pInterface)
 {
     LogFlowFunc(("\n"));
     PVBOXDISK pThis = PDMIMEDIA_2_VBOXDISK(pInterface);
+    uint64_t tsStart = drvvdLatSubmitStart(pThis);
     int rc = VDFlush(pThis->pDisk);
+    drvvdLatSubmitEnd(pThis, true /* fWrite */, tsStart);
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
 }
@@ -1768,6 +1940,8 @@ static DECLCALLBACK(int) drvvdStartRead(PPDMIMEDIAASYNC pInterface, uint64_t uOf
     int rc = VINF_SUCCESS;
     PVBOXDISK pThis = PDMIMEDIAASYNC_2_VBOXDISK(pInterface);
 
+    uint64_t tsStart = drvvdLatSubmitStart(pThis);
+
     pThis->fBootAccelActive = false;
 
     RTSGBUF SgBuf;
@@ -1784,6 +1958,7 @@ static DECLCALLBACK(int) drvvdStartRead(PPDMIMEDIAASYNC pInterface, uint64_t uOf
             rc = VINF_VD_ASYNC_IO_FINISHED;
     }
 
+    drvvdLatSubmitEnd(pThis, false /* fWrite */, tsStart);
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
 }
@@ -1797,6 +1972,8 @@ static DECLCALLBACK(int) drvvdStartWrite(PPDMIMEDIAASYNC pInterface, uint64_t uO
     int rc = VINF_SUCCESS;
     PVBOXDISK pThis = PDMIMEDIAASYNC_2_VBOXDISK(pInterface);
 
+    uint64_t tsStart = drvvdLatSubmitStart(pThis);
+
     pThis->fBootAccelActive = false;
 
     RTSGBUF SgBuf;
@@ -1814,6 +1991,7 @@ static DECLCALLBACK(int) drvvdStartWrite(PPDMIMEDIAASYNC pInterface, uint64_t uO
             rc = VINF_VD_ASYNC_IO_FINISHED;
     }
 
+    drvvdLatSubmitEnd(pThis, true /* fWrite */, tsStart);
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
 }
@@ -1823,6 +2001,7 @@ static DECLCALLBACK(int) drvvdStartFlush(PPDMIMEDIAASYNC pInterface, void *pvUse
     LogFlowFunc(("pvUser=%#p\n", pvUser));
     int rc = VINF_SUCCESS;
     PVBOXDISK pThis = PDMIMEDIAASYNC_2_VBOXDISK(pInterface);
+    uint64_t tsStart = drvvdLatSubmitStart(pThis);
 
     if (!pThis->pBlkCache)
         rc = VDAsyncFlush(pThis->pDisk, drvvdAsyncReqComplete, pThis, pvUser);
@@ -1834,6 +2013,8 @@ static DECLCALLBACK(int) drvvdStartFlush(PPDMIMEDIAASYNC pInterface, void *pvUse
         else if (rc == VINF_SUCCESS)
             rc = VINF_VD_ASYNC_IO_FINISHED;
     }
+
+    drvvdLatSubmitEnd(pThis, true /* fWrite */, tsStart);
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
 }
@@ -1847,6 +2028,8 @@ static DECLCALLBACK(int) drvvdStartDiscard(PPDMIMEDIAASYNC pInterface, PCRTRANGE
     LogFlowFunc(("paRanges=%#p cRanges=%u pvUser=%#p\n",
                  paRanges, cRanges, pvUser));
 
+    uint64_t tsStart = drvvdLatSubmitStart(pThis);
+
     if (!pThis->pBlkCache)
         rc = VDAsyncDiscardRanges(pThis->pDisk, paRanges, cRanges, drvvdAsyncReqComplete,
                                   pThis, pvUser);
@@ -1858,6 +2041,8 @@ static DECLCALLBACK(int) drvvdStartDiscard(PPDMIMEDIAASYNC pInterface, PCRTRANGE
         else if (rc == VINF_SUCCESS)
             rc = VINF_VD_ASYNC_IO_FINISHED;
     }
+
+    drvvdLatSubmitEnd(pThis, true /* fWrite */, tsStart);
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
 }
@@ -2128,6 +2313,16 @@ static DECLCALLBACK(void) drvvdDestruct(PPDMDRVINS pDrvIns)
         MMR3HeapFree(pThis->pszBwGroup);
         pThis->pszBwGroup = NULL;
     }
+    if (pThis->fLatencyStats)
+    {
+        drvvdLatHistDeregister(pDrvIns, &pThis->aLatSubmit[0]);
+        drvvdLatHistDeregister(pDrvIns, &pThis->aLatSubmit[1]);
+        for (unsigned i = 0; i < VDLATENCYSTAGE_END; i++)
+        {
+            drvvdLatHistDeregister(pDrvIns, &pThis->aLatVd[i][0]);
+            drvvdLatHistDeregister(pDrvIns, &pThis->aLatVd[i][1]);
+        }
+    }
 }
 
 /**
@@ -2215,6 +2410,7 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
     bool        fDiscard = false;
     bool        fInformAboutZeroBlocks = false;
     bool        fSkipConsistencyChecks = false;
+    bool        fCacheWriteBack = false;
     unsigned    iLevel = 0;
     PCFGMNODE   pCurNode = pCfg;
     VDTYPE      enmType = VDTYPE_HDD;
@@ -2232,8 +2428,8 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
                                           "ReadOnly\0MaybeReadOnly\0TempReadOnly\0Shareable\0HonorZeroWrites\0"
                                           "HostIPStack\0UseNewIo\0BootAcceleration\0BootAccelerationBuffer\0"
                                           "SetupMerge\0MergeSource\0MergeTarget\0BwGroup\0Type\0BlockCache\0"
-                                          "CachePath\0CacheFormat\0Discard\0InformAboutZeroBlocks\0"
-                                          "SkipConsistencyChecks\0");
+                                          "CachePath\0CacheFormat\0CacheWriteBack\0Discard\0InformAboutZeroBlocks\0"
+                                          "SkipConsistencyChecks\0LatencyStatistics\0");
         }
         else
         {
@@ -2382,6 +2578,13 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
                                       N_("DrvVD: Configuration error: Querying \"SKipConsistencyChecks\" as boolean failed"));
                 break;
             }
+            rc = CFGMR3QueryBoolDef(pCurNode, "LatencyStatistics", &pThis->fLatencyStats, false);
+            if (RT_FAILURE(rc))
+            {
+                rc = PDMDRV_SET_ERROR(pDrvIns, rc,
+                                      N_("DrvVD: Configuration error: Querying \"LatencyStatistics\" as boolean failed"));
+                break;
+            }
 
             char *psz;
             rc = CFGMR3QueryStringAlloc(pCfg, "Type", &psz);
@@ -2424,6 +2627,14 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
                                           N_("DrvVD: Configuration error: Querying \"CacheFormat\" as string failed"));
                     break;
                 }
+
+                rc = CFGMR3QueryBoolDef(pCurNode, "CacheWriteBack", &fCacheWriteBack, false);
+                if (RT_FAILURE(rc))
+                {
+                    rc = PDMDRV_SET_ERROR(pDrvIns, rc,
+                                          N_("DrvVD: Configuration error: Querying \"CacheWriteBack\" as boolean failed"));
+                    break;
+                }
             }
         }
 
@@ -2477,6 +2688,31 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
             }
         }
 
+        if (RT_SUCCESS(rc) && pThis->fLatencyStats)
+        {
+            static const char * const s_apszStages[VDLATENCYSTAGE_END] = { "Request", "LockWait", "MetaRead", "HostIo" };
+            static const char * const s_apszDescs[VDLATENCYSTAGE_END] =
+            {
+                "Latency of requests from submission to completion in the VD layer",
+                "Time requests spent waiting for an overlapping request or the disk lock",
+                "Latency of image metadata reads",
+                "Latency of host I/O issued for user data"
+            };
+
+            pThis->VDIfLatency.pfnLatencyRecord = drvvdLatencyRecord;
+            rc = VDInterfaceAdd(&pThis->VDIfLatency.Core, "DrvVD_Latency", VDINTERFACETYPE_LATENCY,
+                                pThis, sizeof(VDINTERFACELATENCY), &pThis->pVDIfsDisk);
+            AssertRC(rc);
+
+            drvvdLatHistRegister(pDrvIns, &pThis->aLatSubmit[0], "Time spent in read submission calls", "Submit", "Read");
+            drvvdLatHistRegister(pDrvIns, &pThis->aLatSubmit[1], "Time spent in write, flush and discard submission calls", "Submit", "Write");
+            for (unsigned i = 0; i < VDLATENCYSTAGE_END; i++)
+            {
+                drvvdLatHistRegister(pDrvIns, &pThis->aLatVd[i][0], s_apszDescs[i], s_apszStages[i], "Read");
+                drvvdLatHistRegister(pDrvIns, &pThis->aLatVd[i][1], s_apszDescs[i], s_apszStages[i], "Write");
+            }
+        }
+
         if (RT_SUCCESS(rc))
         {
             rc = VDCreate(pThis->pVDIfsDisk, enmType, &pThis->pDisk);
@@ -2781,7 +3017,9 @@ static DECLCALLBACK(int) drvvdConstruct(PPDMDRVINS pDrvIns, PCFGMNODE pCfg, uint
             AssertRC(rc);
         }
 
-        rc = VDCacheOpen(pThis->pDisk, pszCacheFormat, pszCachePath, VD_OPEN_FLAGS_NORMAL, pThis->pVDIfsCache);
+        rc = VDCacheOpen(pThis->pDisk, pszCacheFormat, pszCachePath,
+                         fCacheWriteBack ? VD_OPEN_FLAGS_CACHE_WRITE_BACK : VD_OPEN_FLAGS_NORMAL,
+                         pThis->pVDIfsCache);
         if (RT_FAILURE(rc))
             rc = PDMDRV_SET_ERROR(pDrvIns, rc, N_("DrvVD: Could not open cache image"));
     }
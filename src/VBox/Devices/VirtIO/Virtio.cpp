@@ -103,6 +103,10 @@ void vringSetNotification(PVPCISTATE pState, PVRING pVRing, bool fEnabled)
                       pVRing->addrUsed + RT_OFFSETOF(VRINGUSED, uFlags),
                       &tmp, sizeof(tmp));
 
+    /* This is called for every received packet, skip the write if nothing changes. */
+    if (!(tmp & VRINGUSED_F_NO_NOTIFY) == fEnabled)
+        return;
+
     if (fEnabled)
         tmp &= ~ VRINGUSED_F_NO_NOTIFY;
     else
@@ -124,11 +128,17 @@ bool vqueueSkip(PVPCISTATE pState, PVQUEUE pQueue)
     return true;
 }
 
-bool vqueueGet(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, bool fRemove)
+/**
+ * Reads the descriptor chain of the next available element.
+ *
+ * @returns true if the chain is valid, false if it is broken.
+ * @param   pState      The VirtIO PCI state.
+ * @param   pQueue      The queue, must not be empty.
+ * @param   pElem       Where to store the element.
+ * @param   fRemove     Whether to remove the element from the available ring.
+ */
+static bool vqueueReadChain(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, bool fRemove)
 {
-    if (vqueueIsEmpty(pState, pQueue))
-        return false;
-
     pElem->nIn = pElem->nOut = 0;
 
     Log2(("%s vqueueGet: %s avail_idx=%u\n", INSTANCE(pState),
@@ -139,11 +149,59 @@ bool vqueueGet(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, bool fRemov
     if (fRemove)
         pQueue->uNextAvailIndex++;
     pElem->uIndex = idx;
-    do
+
+    /* Descriptor table of an indirect descriptor, replaces the rest of the chain. */
+    RTGCPHYS GCPhysIndirect = NIL_RTGCPHYS;
+    uint32_t cIndirect      = 0;
+    bool     fValid         = false;
+    for (;;)
     {
         VQUEUESEG *pSeg;
 
-        vringReadDesc(pState, &pQueue->VRing, idx, &desc);
+        /*
+         * A broken or malicious guest could link the descriptors into a loop,
+         * stop when the element is full.
+         */
+        if (   pElem->nIn  >= RT_ELEMENTS(pElem->aSegsIn)
+            || pElem->nOut >= RT_ELEMENTS(pElem->aSegsOut))
+        {
+            Log(("%s vqueueGet: %s too many segments in descriptor chain\n", INSTANCE(pState),
+                 QUEUENAME(pState, pQueue)));
+            break;
+        }
+
+        if (GCPhysIndirect != NIL_RTGCPHYS)
+        {
+            if (idx >= cIndirect)
+            {
+                Log(("%s vqueueGet: %s invalid indirect descriptor index %u (max %u)\n", INSTANCE(pState),
+                     QUEUENAME(pState, pQueue), idx, cIndirect));
+                break;
+            }
+            PDMDevHlpPhysRead(pState->CTX_SUFF(pDevIns), GCPhysIndirect + sizeof(VRINGDESC) * idx,
+                              &desc, sizeof(VRINGDESC));
+        }
+        else
+            vringReadDesc(pState, &pQueue->VRing, idx, &desc);
+
+        if (desc.u16Flags & VRINGDESC_F_INDIRECT)
+        {
+            /* Nested indirect tables are not allowed. */
+            if (   GCPhysIndirect != NIL_RTGCPHYS
+                || desc.uLen < sizeof(VRINGDESC))
+            {
+                Log(("%s vqueueGet: %s invalid indirect descriptor (cb=%u)\n", INSTANCE(pState),
+                     QUEUENAME(pState, pQueue), desc.uLen));
+                break;
+            }
+            Log2(("%s vqueueGet: %s indirect table addr=%RGp entries=%u\n", INSTANCE(pState),
+                  QUEUENAME(pState, pQueue), desc.u64Addr, desc.uLen / sizeof(VRINGDESC)));
+            GCPhysIndirect = desc.u64Addr;
+            cIndirect      = desc.uLen / sizeof(VRINGDESC);
+            idx            = 0;
+            continue;
+        }
+
         if (desc.u16Flags & VRINGDESC_F_WRITE)
         {
             Log2(("%s vqueueGet: %s IN  seg=%u desc_idx=%u addr=%p cb=%u\n", INSTANCE(pState),
@@ -161,12 +219,37 @@ bool vqueueGet(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, bool fRemov
         pSeg->cb   = desc.uLen;
         pSeg->pv   = NULL;
 
+        if (!(desc.u16Flags & VRINGDESC_F_NEXT))
+        {
+            fValid = true;
+            break;
+        }
         idx = desc.u16Next;
-    } while (desc.u16Flags & VRINGDESC_F_NEXT);
+    }
 
     Log2(("%s vqueueGet: %s head_desc_idx=%u nIn=%u nOut=%u\n", INSTANCE(pState),
           QUEUENAME(pState, pQueue), pElem->uIndex, pElem->nIn, pElem->nOut));
-    return true;
+    return fValid;
+}
+
+bool vqueueGet(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, bool fRemove)
+{
+    while (!vqueueIsEmpty(pState, pQueue))
+    {
+        if (vqueueReadChain(pState, pQueue, pElem, fRemove))
+            return true;
+
+        /*
+         * Don't pass a broken chain to the device, it could be cut off in the middle.
+         * It is given back to the guest without any data instead and becomes visible
+         * with the next vqueueSync() of the caller.
+         */
+        if (!fRemove)
+            return false;
+        vqueuePutHead(pState, pQueue, pElem->uIndex, 0);
+    }
+
+    return false;
 }
 
 uint16_t vringReadUsedIndex(PVPCISTATE pState, PVRING pVRing)
@@ -196,18 +279,33 @@ void vringWriteUsedElem(PVPCISTATE pState, PVRING pVRing, uint32_t uIndex, uint3
                           &elem, sizeof(elem));
 }
 
-void vqueuePut(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, uint32_t uLen, uint32_t uReserved)
+/**
+ * Copies the segment data of an element into guest memory and prepares the
+ * used ring entry for it, without writing the entry yet.
+ *
+ * This allows returning several elements with a single vqueueFlush() call.
+ *
+ * @param   pState      The VirtIO PCI core state.
+ * @param   pQueue      The queue the element was taken from.
+ * @param   pElem       The element, segments with a data pointer get copied.
+ * @param   uLen        Number of bytes written into the element.
+ * @param   uReserved   Number of bytes at the start of the element the
+ *                      caller writes itself.
+ * @param   pUsed       Where to store the used ring entry.
+ */
+void vqueueFill(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, uint32_t uLen, uint32_t uReserved,
+                PVRINGUSEDELEM pUsed)
 {
     unsigned int i, uOffset, cbReserved = uReserved;
 
-    Log2(("%s vqueuePut: %s desc_idx=%u acb=%u\n", INSTANCE(pState),
+    Log2(("%s vqueueFill: %s desc_idx=%u acb=%u\n", INSTANCE(pState),
           QUEUENAME(pState, pQueue), pElem->uIndex, uLen));
     for (i = uOffset = 0; i < pElem->nIn && uOffset < uLen - uReserved; i++)
     {
         uint32_t cbSegLen = RT_MIN(uLen - cbReserved - uOffset, pElem->aSegsIn[i].cb - cbReserved);
         if (pElem->aSegsIn[i].pv)
         {
-            Log2(("%s vqueuePut: %s used_idx=%u seg=%u addr=%p pv=%p cb=%u acb=%u\n", INSTANCE(pState),
+            Log2(("%s vqueueFill: %s used_idx=%u seg=%u addr=%p pv=%p cb=%u acb=%u\n", INSTANCE(pState),
                   QUEUENAME(pState, pQueue), pQueue->uNextUsedIndex, i, pElem->aSegsIn[i].addr, pElem->aSegsIn[i].pv, pElem->aSegsIn[i].cb, cbSegLen));
             PDMDevHlpPCIPhysWrite(pState->CTX_SUFF(pDevIns), pElem->aSegsIn[i].addr + cbReserved,
                                   pElem->aSegsIn[i].pv, cbSegLen);
@@ -217,9 +315,64 @@ void vqueuePut(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, uint32_t uL
     }
 
     Assert((uReserved + uOffset) == uLen || pElem->nIn == 0);
+    pUsed->uId  = pElem->uIndex;
+    pUsed->uLen = uLen;
+}
+
+/**
+ * Writes used ring entries prepared by vqueueFill().
+ *
+ * The entries are written with one access, or two if the ring wraps. The
+ * guest does not see them before the next vqueueSync().
+ *
+ * @param   pState      The VirtIO PCI core state.
+ * @param   pQueue      The queue the elements were taken from.
+ * @param   paUsed      The used ring entries.
+ * @param   cUsed       Number of entries.
+ */
+void vqueueFlush(PVPCISTATE pState, PVQUEUE pQueue, PCVRINGUSEDELEM paUsed, uint32_t cUsed)
+{
+    PVRING pVRing = &pQueue->VRing;
+
+    Log2(("%s vqueueFlush: %s used_idx=%u count=%u\n", INSTANCE(pState),
+          QUEUENAME(pState, pQueue), pQueue->uNextUsedIndex, cUsed));
+    while (cUsed)
+    {
+        uint32_t iSlot  = pQueue->uNextUsedIndex % pVRing->uSize;
+        uint32_t cChunk = RT_MIN(cUsed, pVRing->uSize - iSlot);
+        PDMDevHlpPCIPhysWrite(pState->CTX_SUFF(pDevIns),
+                              pVRing->addrUsed + RT_OFFSETOF(VRINGUSED, aRing[iSlot]),
+                              paUsed, cChunk * sizeof(VRINGUSEDELEM));
+        pQueue->uNextUsedIndex += cChunk;
+        paUsed += cChunk;
+        cUsed  -= cChunk;
+    }
+}
+
+void vqueuePut(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, uint32_t uLen, uint32_t uReserved)
+{
+    VRINGUSEDELEM Used;
+
+    vqueueFill(pState, pQueue, pElem, uLen, uReserved, &Used);
     Log2(("%s vqueuePut: %s used_idx=%u guest_used_idx=%u id=%u len=%u\n", INSTANCE(pState),
           QUEUENAME(pState, pQueue), pQueue->uNextUsedIndex, vringReadUsedIndex(pState, &pQueue->VRing), pElem->uIndex, uLen));
-    vringWriteUsedElem(pState, &pQueue->VRing, pQueue->uNextUsedIndex++, pElem->uIndex, uLen);
+    vringWriteUsedElem(pState, &pQueue->VRing, pQueue->uNextUsedIndex++, Used.uId, Used.uLen);
+}
+
+/**
+ * Returns a descriptor chain to the guest without copying any data, for
+ * devices which transfer the segment contents themselves.
+ *
+ * @param   pState      The VirtIO PCI core state.
+ * @param   pQueue      The queue the chain was taken from.
+ * @param   uIndex      Index of the head descriptor of the chain.
+ * @param   uLen        Number of bytes written into the chain.
+ */
+void vqueuePutHead(PVPCISTATE pState, PVQUEUE pQueue, uint32_t uIndex, uint32_t uLen)
+{
+    Log2(("%s vqueuePutHead: %s used_idx=%u id=%u len=%u\n", INSTANCE(pState),
+          QUEUENAME(pState, pQueue), pQueue->uNextUsedIndex, uIndex, uLen));
+    vringWriteUsedElem(pState, &pQueue->VRing, pQueue->uNextUsedIndex++, uIndex, uLen);
 }
 
 void vqueueNotify(PVPCISTATE pState, PVQUEUE pQueue)
@@ -242,12 +395,21 @@ void vqueueNotify(PVPCISTATE pState, PVQUEUE pQueue)
 
 }
 
-void vqueueSync(PVPCISTATE pState, PVQUEUE pQueue)
+/**
+ * Makes the elements returned so far visible to the guest.
+ *
+ * @param   pState      The VirtIO PCI core state.
+ * @param   pQueue      The queue.
+ * @param   fNotify     Whether to notify the guest as well. Devices which
+ *                      coalesce notifications call vqueueNotify() later.
+ */
+void vqueueSync(PVPCISTATE pState, PVQUEUE pQueue, bool fNotify)
 {
     Log2(("%s vqueueSync: %s old_used_idx=%u new_used_idx=%u\n", INSTANCE(pState),
           QUEUENAME(pState, pQueue), vringReadUsedIndex(pState, &pQueue->VRing), pQueue->uNextUsedIndex));
     vringWriteUsedIndex(pState, &pQueue->VRing, pQueue->uNextUsedIndex);
-    vqueueNotify(pState, pQueue);
+    if (fNotify)
+        vqueueNotify(pState, pQueue);
 }
 
 void vpciReset(PVPCISTATE pState)
@@ -28,14 +28,16 @@
  * for example.
  */
 #define VIRTIO_SAVEDSTATE_VERSION_3_1_BETA1 1
-#define VIRTIO_SAVEDSTATE_VERSION           2
+#define VIRTIO_SAVEDSTATE_VERSION_PRE_MQ    2
+#define VIRTIO_SAVEDSTATE_VERSION           3
 /** @} */
 
 #define DEVICE_PCI_VENDOR_ID                0x1AF4
 #define DEVICE_PCI_DEVICE_ID                0x1000
 #define DEVICE_PCI_SUBSYSTEM_VENDOR_ID      0x1AF4
 
-#define VIRTIO_MAX_NQUEUES                  3
+/** Enough for 8 virtio-net queue pairs plus the control queue. */
+#define VIRTIO_MAX_NQUEUES                  17
 
 #define VPCI_HOST_FEATURES                  0x0
 #define VPCI_GUEST_FEATURES                 0x4
@@ -56,11 +58,13 @@
 #define VPCI_STATUS_FAILED                  0x80
 
 #define VPCI_F_NOTIFY_ON_EMPTY              0x01000000
+#define VPCI_F_RING_INDIRECT_DESC           0x10000000
 #define VPCI_F_BAD_FEATURE                  0x40000000
 
 #define VRINGDESC_MAX_SIZE                  (2 * 1024 * 1024)
 #define VRINGDESC_F_NEXT                    0x01
 #define VRINGDESC_F_WRITE                   0x02
+#define VRINGDESC_F_INDIRECT                0x04
 
 typedef struct VRingDesc
 {
@@ -85,6 +89,8 @@ typedef struct VRingUsedElem
     uint32_t uId;
     uint32_t uLen;
 } VRINGUSEDELEM;
+typedef VRINGUSEDELEM *PVRINGUSEDELEM;
+typedef VRINGUSEDELEM const *PCVRINGUSEDELEM;
 
 #define VRINGUSED_F_NO_NOTIFY 0x01
 
@@ -301,8 +307,12 @@ DECLINLINE(uint16_t) vringReadAvailIndex(PVPCISTATE pState, PVRING pVRing)
 bool vqueueSkip(PVPCISTATE pState, PVQUEUE pQueue);
 bool vqueueGet(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, bool fRemove = true);
 void vqueuePut(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, uint32_t uLen, uint32_t uReserved = 0);
+void vqueueFill(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem, uint32_t uLen, uint32_t uReserved,
+                PVRINGUSEDELEM pUsed);
+void vqueueFlush(PVPCISTATE pState, PVQUEUE pQueue, PCVRINGUSEDELEM paUsed, uint32_t cUsed);
+void vqueuePutHead(PVPCISTATE pState, PVQUEUE pQueue, uint32_t uIndex, uint32_t uLen);
 void vqueueNotify(PVPCISTATE pState, PVQUEUE pQueue);
-void vqueueSync(PVPCISTATE pState, PVQUEUE pQueue);
+void vqueueSync(PVPCISTATE pState, PVQUEUE pQueue, bool fNotify = true);
 
 DECLINLINE(bool) vqueuePeek(PVPCISTATE pState, PVQUEUE pQueue, PVQUEUEELEM pElem)
 {
@@ -48,6 +48,7 @@ extern const PDMDEVREG g_DeviceE1000;
 #endif
 #ifdef VBOX_WITH_VIRTIO
 extern const PDMDEVREG g_DeviceVirtioNet;
+extern const PDMDEVREG g_DeviceVirtioBlk;
 #endif
 #ifdef VBOX_WITH_INIP
 extern const PDMDEVREG g_DeviceINIP;
@@ -68,6 +69,9 @@ extern const PDMDEVREG g_DeviceParallelPort;
 #ifdef VBOX_WITH_AHCI
 extern const PDMDEVREG g_DeviceAHCI;
 #endif
+#ifdef VBOX_WITH_NVME
+extern const PDMDEVREG g_DeviceNVMe;
+#endif
 #ifdef VBOX_WITH_BUSLOGIC
 extern const PDMDEVREG g_DeviceBusLogic;
 #endif
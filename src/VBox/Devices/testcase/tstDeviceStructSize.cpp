@@ -47,6 +47,8 @@
 #ifdef VBOX_WITH_VIRTIO
 # undef LOG_GROUP
 # include "../Network/DevVirtioNet.cpp"
+# undef LOG_GROUP
+# include "../Storage/DevVirtioBlk.cpp"
 #endif
 #undef LOG_GROUP
 #include "../PC/DevACPI.cpp"
@@ -86,6 +88,10 @@
 # undef LOG_GROUP
 # include "../Storage/DevAHCI.cpp"
 #endif
+#ifdef VBOX_WITH_NVME
+# undef LOG_GROUP
+# include "../Storage/DevNVMe.cpp"
+#endif
 #ifdef VBOX_WITH_BUSLOGIC
 # undef LOG_GROUP
 # include "../Storage/DevBusLogic.cpp"
@@ -285,7 +291,9 @@ int main()
     CHECK_MEMBER_ALIGNMENT(E1KSTATE, StatReceiveBytes, 8);
 #endif
 #ifdef VBOX_WITH_VIRTIO
+    CHECK_MEMBER_ALIGNMENT(VNETSTATE, aQueuePairs, 8);
     CHECK_MEMBER_ALIGNMENT(VNETSTATE, StatReceiveBytes, 8);
+    CHECK_MEMBER_ALIGNMENT(VBLKSTATE, StatBytesRead, 8);
 #endif
     //CHECK_MEMBER_ALIGNMENT(E1KSTATE, csTx, 8);
 #ifdef VBOX_WITH_USB
@@ -307,6 +315,11 @@ int main()
     CHECK_MEMBER_ALIGNMENT(LSILOGISCSI, ReplyFreeQueueCritSect, 8);
     CHECK_MEMBER_ALIGNMENT(LSILOGISCSI, uReplyFreeQueueNextEntryFreeWrite, 8);
     CHECK_MEMBER_ALIGNMENT(LSILOGISCSI, VBoxSCSI, 8);
+#ifdef VBOX_WITH_NVME
+    CHECK_MEMBER_ALIGNMENT(NVME, lock, 8);
+    CHECK_MEMBER_ALIGNMENT(NVME, aCqs, 8);
+    CHECK_MEMBER_ALIGNMENT(NVME, StatBytesRead, 8);
+#endif
 #ifdef VBOX_WITH_USB
     CHECK_MEMBER_ALIGNMENT(OHCI, RootHub, 8);
 # ifdef VBOX_WITH_STATISTICS
@@ -88,6 +88,8 @@
 #ifdef VBOX_WITH_VIRTIO
 # undef LOG_GROUP
 # include "../Network/DevVirtioNet.cpp"
+# undef LOG_GROUP
+# include "../Storage/DevVirtioBlk.cpp"
 #endif
 #ifdef VBOX_WITH_BUSLOGIC
 # undef LOG_GROUP
@@ -1215,6 +1217,9 @@ int main()
     GEN_CHECK_OFF(AHCIPort, fHotpluggable);
     GEN_CHECK_OFF(AHCIPort, fRedo);
     GEN_CHECK_OFF(AHCIPort, fWrkThreadSleeping);
+    GEN_CHECK_OFF(AHCIPort, fProcessing);
+    GEN_CHECK_OFF(AHCIPort, fSubmitOnEmt);
+    GEN_CHECK_OFF(AHCIPort, fIntrDeferred);
     GEN_CHECK_OFF(AHCIPort, cTotalSectors);
     GEN_CHECK_OFF(AHCIPort, cbSector);
     GEN_CHECK_OFF(AHCIPort, cMultSectors);
@@ -1230,6 +1235,7 @@ int main()
     GEN_CHECK_OFF(AHCIPort, u32TasksNew);
     GEN_CHECK_OFF(AHCIPort, u32TasksRedo);
     GEN_CHECK_OFF(AHCIPort, u32CurrentCommandSlot);
+    GEN_CHECK_OFF(AHCIPort, cSubmitBatches);
     GEN_CHECK_OFF(AHCIPort, pDrvBase);
     GEN_CHECK_OFF(AHCIPort, pDrvBlock);
     GEN_CHECK_OFF(AHCIPort, pDrvBlockAsync);
@@ -1307,6 +1313,7 @@ int main()
     GEN_CHECK_OFF(AHCI, fR0Enabled);
     GEN_CHECK_OFF(AHCI, fSignalIdle);
     GEN_CHECK_OFF(AHCI, fBootable);
+    GEN_CHECK_OFF(AHCI, fSubmitOnEmt);
     GEN_CHECK_OFF(AHCI, cPortsImpl);
     GEN_CHECK_OFF(AHCI, cCmdSlotsAvail);
     GEN_CHECK_OFF(AHCI, f8ByteMMIO4BytesWrittenSuccessfully);
@@ -1374,6 +1381,11 @@ int main()
     GEN_CHECK_OFF(E1KSTATE, fCableConnected);
     GEN_CHECK_OFF(E1KSTATE, fR0Enabled);
     GEN_CHECK_OFF(E1KSTATE, fRCEnabled);
+    GEN_CHECK_OFF(E1KSTATE, fItrEnabled);
+    GEN_CHECK_OFF(E1KSTATE, fItrRxEnabled);
+    GEN_CHECK_OFF(E1KSTATE, fTidEnabled);
+    GEN_CHECK_OFF(E1KSTATE, fRidEnabled);
+    GEN_CHECK_OFF(E1KSTATE, cMsLinkUpDelay);
     GEN_CHECK_OFF(E1KSTATE, auRegs[E1K_NUM_OF_32BIT_REGS]);
     GEN_CHECK_OFF(E1KSTATE, led);
     GEN_CHECK_OFF(E1KSTATE, u32PktNo);
@@ -1439,22 +1451,58 @@ int main()
     GEN_CHECK_OFF(VNETSTATE, pCanRxQueueR0);
     GEN_CHECK_OFF(VNETSTATE, pCanRxQueueRC);
     GEN_CHECK_OFF(VNETSTATE, pLinkUpTimer);
-# ifdef VNET_TX_DELAY
-    GEN_CHECK_OFF(VNETSTATE, pTxTimerR3);
-    GEN_CHECK_OFF(VNETSTATE, pTxTimerR0);
-    GEN_CHECK_OFF(VNETSTATE, pTxTimerRC);
-# endif /* VNET_TX_DELAY */
     GEN_CHECK_OFF(VNETSTATE, config);
     GEN_CHECK_OFF(VNETSTATE, macConfigured);
     GEN_CHECK_OFF(VNETSTATE, fCableConnected);
+    GEN_CHECK_OFF(VNETSTATE, cUsRxNotifyDelay);
     GEN_CHECK_OFF(VNETSTATE, u32PktNo);
     GEN_CHECK_OFF(VNETSTATE, fPromiscuous);
     GEN_CHECK_OFF(VNETSTATE, fAllMulti);
-    GEN_CHECK_OFF(VNETSTATE, pRxQueue);
-    GEN_CHECK_OFF(VNETSTATE, pTxQueue);
     GEN_CHECK_OFF(VNETSTATE, pCtlQueue);
+    GEN_CHECK_OFF(VNETSTATE, aQueuePairs);
+    GEN_CHECK_OFF(VNETSTATE, aQueuePairs[1]);
+    GEN_CHECK_OFF(VNETSTATE, cQueuePairsMax);
+    GEN_CHECK_OFF(VNETSTATE, cQueuePairs);
+    GEN_CHECK_OFF(VNETSTATE, abFlowTable);
     GEN_CHECK_OFF(VNETSTATE, fMaybeOutOfSpace);
     GEN_CHECK_OFF(VNETSTATE, hEventMoreRxDescAvail);
+    GEN_CHECK_SIZE(VNETQUEUEPAIR);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, pRxQueue);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, pTxQueue);
+# ifdef VNET_TX_DELAY
+    GEN_CHECK_OFF(VNETQUEUEPAIR, pTxTimerR3);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, pTxTimerR0);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, pTxTimerRC);
+# endif /* VNET_TX_DELAY */
+    GEN_CHECK_OFF(VNETQUEUEPAIR, uIsTransmitting);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, u64NanoTS);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, pRxTimerR3);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, fRxNotifyPending);
+    GEN_CHECK_OFF(VNETQUEUEPAIR, StatReceivePackets);
+
+    /* Storage/DevVirtioBlk.cpp */
+    GEN_CHECK_SIZE(VBLKSTATE);
+    GEN_CHECK_OFF(VBLKSTATE, VPCI);
+    GEN_CHECK_OFF(VBLKSTATE, IPort);
+    GEN_CHECK_OFF(VBLKSTATE, IPortAsync);
+    GEN_CHECK_OFF(VBLKSTATE, pDrvBase);
+    GEN_CHECK_OFF(VBLKSTATE, pDrvBlock);
+    GEN_CHECK_OFF(VBLKSTATE, pDrvBlockAsync);
+    GEN_CHECK_OFF(VBLKSTATE, pDrvBlockBios);
+    GEN_CHECK_OFF(VBLKSTATE, apReqQueues);
+    GEN_CHECK_OFF(VBLKSTATE, apReqQueues[1]);
+    GEN_CHECK_OFF(VBLKSTATE, config);
+    GEN_CHECK_OFF(VBLKSTATE, cQueues);
+    GEN_CHECK_OFF(VBLKSTATE, cbDisk);
+    GEN_CHECK_OFF(VBLKSTATE, fReadOnly);
+    GEN_CHECK_OFF(VBLKSTATE, fInNotify);
+    GEN_CHECK_OFF(VBLKSTATE, fSignalIdle);
+    GEN_CHECK_OFF(VBLKSTATE, fQueuesSyncPending);
+    GEN_CHECK_OFF(VBLKSTATE, uGeneration);
+    GEN_CHECK_OFF(VBLKSTATE, cReqsActive);
+    GEN_CHECK_OFF(VBLKSTATE, cErrors);
+    GEN_CHECK_OFF(VBLKSTATE, szId);
+    GEN_CHECK_OFF(VBLKSTATE, StatBytesRead);
 #endif /* VBOX_WITH_VIRTIO */
 
 #ifdef VBOX_WITH_SCSI
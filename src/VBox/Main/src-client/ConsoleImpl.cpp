@@ -8329,6 +8329,13 @@ HRESULT Console::attachToTapInterface(INetworkAdapter *networkAdapter)
             Utf8Str str(tapDeviceName);
             RTStrCopy(IfReq.ifr_name, sizeof(IfReq.ifr_name), str.c_str()); /** @todo bitch about names which are too long... */
             IfReq.ifr_flags = IFF_TAP | IFF_NO_PI;
+#  ifdef IFF_VNET_HDR
+            /* Let the TAP driver pass GSO frames and checksum offloading through if the host supports it. */
+            unsigned int fTunFeatures = 0;
+            if (   ioctl(RTFileToNative(maTapFD[slot]), TUNGETFEATURES, &fTunFeatures) == 0
+                && (fTunFeatures & IFF_VNET_HDR))
+                IfReq.ifr_flags |= IFF_VNET_HDR;
+#  endif
             rcVBox = ioctl(RTFileToNative(maTapFD[slot]), TUNSETIFF, &IfReq);
             if (rcVBox != 0)
             {
@@ -7339,6 +7339,8 @@ HRESULT Medium::i_taskCloneHandler(Medium::CloneTask &task)
                                    0 /* cbSize */,
                                    task.midxSrcImageSame,
                                    task.midxDstImageSame,
+                                   0 /* cCopyBufs */,
+                                   0 /* cbCopyBuf */,
                                    task.mVariant & ~MediumVariant_NoCreateDir,
                                    targetId.raw(),
                                    VD_OPEN_FLAGS_NORMAL | m->uOpenFlagsDef,
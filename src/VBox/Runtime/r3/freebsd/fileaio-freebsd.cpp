@@ -136,6 +136,7 @@ RTR3DECL(int) RTFileAioGetLimits(PRTFILEAIOLIMITS pAioLimits)
 
     pAioLimits->cReqsOutstandingMax = cReqsOutstandingMax;
     pAioLimits->cbBufferAlignment   = 0;
+    pAioLimits->fFlags              = RTFILEAIOLIMITS_F_BUFFERED_IO;
 
     return VINF_SUCCESS;
 }
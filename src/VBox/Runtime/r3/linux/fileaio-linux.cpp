@@ -40,6 +40,24 @@
  * compensated if the user of this API implements caching itself. The next
  * limitation is that data buffers must be aligned at a 512 byte boundary or the
  * request will fail.
+ *
+ * Newer kernels (5.1+) provide io_uring which doesn't have these limitations
+ * and is used if available. Requests are passed to the kernel through a
+ * submission ring shared with the kernel which allows submitting a whole batch
+ * with a single syscall, completions are reaped from the completion ring
+ * without entering the kernel at all. Buffered I/O is supported as well, the
+ * kernel punts requests which would block to its own worker threads.
+ * Registered buffers and fixed files are not used because the API has no way to
+ * tell us which buffers are going to be used and files are never disassociated
+ * from a context, so a recycled file descriptor could end up in a stale slot.
+ * Kernels before 5.5 drop completions if the completion ring overflows, so
+ * the number of outstanding requests is limited to its size. The ring memory
+ * is charged against the locked memory limit on kernels before 5.12, a smaller
+ * ring is used if the requested size doesn't fit. Once io_uring was found to
+ * be usable contexts never fall back to the kernel async I/O interface because
+ * RTFileAioGetLimits already reported support for buffered I/O.
+ * Setting the IPRT_FILEAIO_LINUX_NO_IO_URING environment variable forces the
+ * kernel async I/O interface.
  */
 /** @todo r=bird: What's this about "must be opened with O_DIRECT"? An
  *        explanation would be nice, esp. seeing what Linus is quoted saying
@@ -52,6 +70,9 @@
 #include <iprt/asm.h>
 #include <iprt/mem.h>
 #include <iprt/assert.h>
+#include <iprt/critsect.h>
+#include <iprt/env.h>
+#include <iprt/once.h>
 #include <iprt/string.h>
 #include <iprt/err.h>
 #include <iprt/log.h>
@@ -60,6 +81,9 @@
 
 #include <unistd.h>
 #include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <errno.h>
 
 #include <iprt/file.h>
@@ -166,6 +190,158 @@ typedef struct LNXKAIOIOEVENT
 } LNXKAIOIOEVENT, *PLNXKAIOIOEVENT;
 
 
+/**
+ * io_uring submission queue entry.
+ */
+typedef struct LNXIOURINGSQE
+{
+    /** The operation code (LNXIOURING_OP_XXX). */
+    uint8_t           u8OpCode;
+    /** Submission flags. */
+    uint8_t           fFlags;
+    /** The I/O priority. */
+    uint16_t          u16IoPrio;
+    /** The file descriptor. */
+    int32_t           iFileDesc;
+    /** The start offset of the transfer. */
+    uint64_t          off;
+    /** The buffer or I/O vector array address. */
+    uint64_t          u64AddrBuf;
+    /** Number of bytes or I/O vectors. */
+    uint32_t          cbTransfer;
+    /** Operation specific flags (read/write or fsync flags). */
+    uint32_t          fOpFlags;
+    /** Opaque user data passed back in the completion entry. */
+    uint64_t          u64User;
+    /** Reserved (buffer index, personality, etc.). */
+    uint64_t          au64Reserved[3];
+} LNXIOURINGSQE;
+AssertCompileSize(LNXIOURINGSQE, 64);
+/** Pointer to a submission queue entry. */
+typedef LNXIOURINGSQE *PLNXIOURINGSQE;
+
+/**
+ * io_uring completion queue entry.
+ */
+typedef struct LNXIOURINGCQE
+{
+    /** The user data from the submission queue entry. */
+    uint64_t          u64User;
+    /** The result, number of bytes transferred or negative errno. */
+    int32_t           rcLnx;
+    /** Flags. */
+    uint32_t          fFlags;
+} LNXIOURINGCQE;
+AssertCompileSize(LNXIOURINGCQE, 16);
+/** Pointer to a completion queue entry. */
+typedef LNXIOURINGCQE *PLNXIOURINGCQE;
+
+/**
+ * Offsets of the submission ring members in the mapping.
+ */
+typedef struct LNXIOURINGSQOFFSETS
+{
+    uint32_t          offHead;
+    uint32_t          offTail;
+    uint32_t          offRingMask;
+    uint32_t          offRingEntries;
+    uint32_t          offFlags;
+    uint32_t          offDropped;
+    uint32_t          offArray;
+    uint32_t          u32Reserved1;
+    uint64_t          u64Reserved2;
+} LNXIOURINGSQOFFSETS;
+AssertCompileSize(LNXIOURINGSQOFFSETS, 40);
+
+/**
+ * Offsets of the completion ring members in the mapping.
+ */
+typedef struct LNXIOURINGCQOFFSETS
+{
+    uint32_t          offHead;
+    uint32_t          offTail;
+    uint32_t          offRingMask;
+    uint32_t          offRingEntries;
+    uint32_t          offOverflow;
+    uint32_t          offCqes;
+    uint32_t          offFlags;
+    uint32_t          u32Reserved1;
+    uint64_t          u64Reserved2;
+} LNXIOURINGCQOFFSETS;
+AssertCompileSize(LNXIOURINGCQOFFSETS, 40);
+
+/**
+ * io_uring setup parameters.
+ */
+typedef struct LNXIOURINGPARAMS
+{
+    /** Number of submission queue entries (updated by the kernel). */
+    uint32_t            cSqEntries;
+    /** Number of completion queue entries (set by the kernel). */
+    uint32_t            cCqEntries;
+    /** Setup flags. */
+    uint32_t            fFlags;
+    /** Submission thread CPU, unused. */
+    uint32_t            u32SqThreadCpu;
+    /** Submission thread idle time, unused. */
+    uint32_t            u32SqThreadIdle;
+    /** Features supported by the kernel. */
+    uint32_t            fFeatures;
+    /** Reserved. */
+    uint32_t            au32Reserved[4];
+    /** Submission ring offsets. */
+    LNXIOURINGSQOFFSETS SqOffsets;
+    /** Completion ring offsets. */
+    LNXIOURINGCQOFFSETS CqOffsets;
+} LNXIOURINGPARAMS;
+AssertCompileSize(LNXIOURINGPARAMS, 120);
+
+/**
+ * io_uring state of a context.
+ */
+typedef struct LNXIOURING
+{
+    /** The ring file descriptor. */
+    int                 iFdRing;
+    /** Number of submission queue entries. */
+    uint32_t            cSqEntries;
+    /** Number of completion queue entries, limits the outstanding requests. */
+    uint32_t            cCqEntries;
+    /** The submission ring mapping. */
+    void               *pvSqRing;
+    /** Size of the submission ring mapping. */
+    size_t              cbSqRing;
+    /** The completion ring mapping. */
+    void               *pvCqRing;
+    /** Size of the completion ring mapping. */
+    size_t              cbCqRing;
+    /** The submission queue entry array mapping. */
+    PLNXIOURINGSQE      paSqes;
+    /** Size of the submission queue entry array mapping. */
+    size_t              cbSqes;
+    /** Submission ring head, written by the kernel. */
+    volatile uint32_t  *pidxSqHead;
+    /** Submission ring tail, written by us. */
+    volatile uint32_t  *pidxSqTail;
+    /** Submission ring index mask. */
+    uint32_t            fSqMask;
+    /** The submission ring index array. */
+    volatile uint32_t  *paidxSqArray;
+    /** Completion ring head, written by us. */
+    volatile uint32_t  *pidxCqHead;
+    /** Completion ring tail, written by the kernel. */
+    volatile uint32_t  *pidxCqTail;
+    /** Completion ring index mask. */
+    uint32_t            fCqMask;
+    /** The completion queue entries. */
+    PLNXIOURINGCQE      paCqes;
+    /** Serializes submissions, the submission ring has a single producer. */
+    RTCRITSECT          CritSectSubmit;
+} LNXIOURING;
+/** Pointer to the io_uring state. */
+typedef LNXIOURING *PLNXIOURING;
+
+
 /**
  * Async I/O completion context state.
  */
@@ -183,10 +359,14 @@ typedef struct RTFILEAIOCTXINTERNAL
     volatile bool       fWokenUp;
     /** Flag whether the thread is currently waiting in the syscall. */
     volatile bool       fWaiting;
+    /** Flag whether this context uses io_uring instead of the kernel AIO API. */
+    bool                fIoUring;
     /** Flags given during creation. */
     uint32_t            fFlags;
     /** Magic value (RTFILEAIOCTX_MAGIC). */
     uint32_t            u32Magic;
+    /** The io_uring state if fIoUring is set. */
+    LNXIOURING          IoUring;
 } RTFILEAIOCTXINTERNAL;
 /** Pointer to an internal context structure. */
 typedef RTFILEAIOCTXINTERNAL *PRTFILEAIOCTXINTERNAL;
@@ -207,6 +387,8 @@ typedef struct RTFILEAIOREQINTERNAL
     int                   Rc;
     /** Number of bytes actually transferred. */
     size_t                cbTransfered;
+    /** The I/O vector describing the buffer for io_uring. */
+    struct iovec          IoVec;
     /** Completion context we are assigned to. */
     PRTFILEAIOCTXINTERNAL pCtxInt;
     /** Magic value  (RTFILEAIOREQ_MAGIC). */
@@ -222,6 +404,45 @@ typedef RTFILEAIOREQINTERNAL *PRTFILEAIOREQINTERNAL;
 /** The max number of events to get in one call. */
 #define AIO_MAXIMUM_REQUESTS_PER_CONTEXT 64
 
+/** The maximum number of io_uring submission queue entries older kernels accept. */
+#define LNXIOURING_ENTRIES_MAX          4096
+/** The minimum number of io_uring submission queue entries a context is created with. */
+#define LNXIOURING_ENTRIES_MIN          32
+
+/** @name io_uring operation codes.
+ * @{ */
+#define LNXIOURING_OP_READV             1
+#define LNXIOURING_OP_WRITEV            2
+#define LNXIOURING_OP_FSYNC             3
+/** @} */
+
+/** io_uring_enter flag to wait for completions. */
+#define LNXIOURING_ENTER_GETEVENTS      RT_BIT_32(0)
+
+/** @name io_uring mmap offsets.
+ * @{ */
+#define LNXIOURING_OFF_SQ_RING          UINT64_C(0)
+#define LNXIOURING_OFF_CQ_RING          UINT64_C(0x8000000)
+#define LNXIOURING_OFF_SQES             UINT64_C(0x10000000)
+/** @} */
+
+/* The io_uring syscalls are identical for all architectures using the generic table. */
+#ifndef __NR_io_uring_setup
+# define __NR_io_uring_setup            425
+#endif
+#ifndef __NR_io_uring_enter
+# define __NR_io_uring_enter            426
+#endif
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+/** Makes sure the io_uring probing is done only once. */
+static RTONCE   g_IoUringOnce = RTONCE_INITIALIZER;
+/** Flag whether io_uring is available and should be used. */
+static bool     g_fIoUring    = false;
+
 
 /**
  * Creates a new async I/O context.
@@ -287,11 +508,371 @@ DECLINLINE(int) rtFileAsyncIoLinuxGetEvents(LNXKAIOCONTEXT AioContext, long cReq
     return rc;
 }
 
+/**
+ * Checks once whether io_uring is usable on this host.
+ */
+static DECLCALLBACK(int32_t) rtFileAioLinuxIoUringProbeOnce(void *pvUser)
+{
+    NOREF(pvUser);
+
+    if (RTEnvExist("IPRT_FILEAIO_LINUX_NO_IO_URING"))
+        return VINF_SUCCESS;
+
+    /*
+     * Seccomp filters and old kernels make this fail with ENOSYS or EPERM.
+     * Use the smallest ring a context is created with, so creating a context
+     * fails only if the locked memory limit is exhausted.
+     */
+    LNXIOURINGPARAMS Params;
+    RT_ZERO(Params);
+    int iFd = syscall(__NR_io_uring_setup, LNXIOURING_ENTRIES_MIN, &Params);
+    if (iFd >= 0)
+    {
+        close(iFd);
+        g_fIoUring = true;
+    }
+    return VINF_SUCCESS;
+}
+
+/**
+ * Returns whether io_uring should be used.
+ */
+DECLINLINE(bool) rtFileAioLinuxIoUringIsAvailable(void)
+{
+    RTOnce(&g_IoUringOnce, rtFileAioLinuxIoUringProbeOnce, NULL);
+    return g_fIoUring;
+}
+
+/**
+ * Wrapper for the io_uring_enter syscall.
+ * @returns Number of consumed submission queue entries (natural number w/ 0), IPRT error code (negative).
+ */
+DECLINLINE(int) rtFileAioLinuxIoUringEnter(PLNXIOURING pIoUring, uint32_t cToSubmit, uint32_t cMinComplete, uint32_t fFlags)
+{
+    int rc = syscall(__NR_io_uring_enter, pIoUring->iFdRing, cToSubmit, cMinComplete, fFlags, NULL, 0);
+    if (RT_UNLIKELY(rc == -1))
+        return RTErrConvertFromErrno(errno);
+
+    return rc;
+}
+
+/**
+ * Destroys the io_uring of a context.
+ */
+static void rtFileAioLinuxIoUringDestroy(PLNXIOURING pIoUring)
+{
+    if (pIoUring->paSqes)
+        munmap(pIoUring->paSqes, pIoUring->cbSqes);
+    if (pIoUring->pvCqRing)
+        munmap(pIoUring->pvCqRing, pIoUring->cbCqRing);
+    if (pIoUring->pvSqRing)
+        munmap(pIoUring->pvSqRing, pIoUring->cbSqRing);
+    if (pIoUring->iFdRing != -1)
+        close(pIoUring->iFdRing);
+    if (RTCritSectIsInitialized(&pIoUring->CritSectSubmit))
+        RTCritSectDelete(&pIoUring->CritSectSubmit);
+    pIoUring->iFdRing  = -1;
+    pIoUring->paSqes   = NULL;
+    pIoUring->pvCqRing = NULL;
+    pIoUring->pvSqRing = NULL;
+}
+
+/**
+ * Creates an io_uring and maps the rings into our address space.
+ *
+ * The ring is made smaller if the kernel refuses the requested size because
+ * of the locked memory limit.
+ */
+static int rtFileAioLinuxIoUringCreate(PLNXIOURING pIoUring, uint32_t cEntries)
+{
+    LNXIOURINGPARAMS Params;
+    uint32_t cEntriesTry = RT_MAX(RT_MIN(cEntries, LNXIOURING_ENTRIES_MAX), LNXIOURING_ENTRIES_MIN);
+
+    for (;;)
+    {
+        RT_ZERO(Params);
+        pIoUring->iFdRing = syscall(__NR_io_uring_setup, cEntriesTry, &Params);
+        if (pIoUring->iFdRing != -1)
+            break;
+        if (   errno != ENOMEM
+            || cEntriesTry <= LNXIOURING_ENTRIES_MIN)
+            return RTErrConvertFromErrno(errno);
+        cEntriesTry /= 2;
+    }
+
+    int rc = RTCritSectInit(&pIoUring->CritSectSubmit);
+    if (RT_SUCCESS(rc))
+    {
+        pIoUring->cbSqRing = Params.SqOffsets.offArray + Params.cSqEntries * sizeof(uint32_t);
+        pIoUring->cbCqRing = Params.CqOffsets.offCqes  + Params.cCqEntries * sizeof(LNXIOURINGCQE);
+        pIoUring->cbSqes   = Params.cSqEntries * sizeof(LNXIOURINGSQE);
+
+        void *pv = mmap(NULL, pIoUring->cbSqRing, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        pIoUring->iFdRing, LNXIOURING_OFF_SQ_RING);
+        if (pv != MAP_FAILED)
+        {
+            pIoUring->pvSqRing = pv;
+            pv = mmap(NULL, pIoUring->cbCqRing, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      pIoUring->iFdRing, LNXIOURING_OFF_CQ_RING);
+            if (pv != MAP_FAILED)
+            {
+                pIoUring->pvCqRing = pv;
+                pv = mmap(NULL, pIoUring->cbSqes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          pIoUring->iFdRing, LNXIOURING_OFF_SQES);
+                if (pv != MAP_FAILED)
+                {
+                    uint8_t *pbSqRing = (uint8_t *)pIoUring->pvSqRing;
+                    uint8_t *pbCqRing = (uint8_t *)pIoUring->pvCqRing;
+
+                    pIoUring->paSqes       = (PLNXIOURINGSQE)pv;
+                    pIoUring->cSqEntries   = Params.cSqEntries;
+                    pIoUring->cCqEntries   = Params.cCqEntries;
+                    pIoUring->pidxSqHead   = (volatile uint32_t *)(pbSqRing + Params.SqOffsets.offHead);
+                    pIoUring->pidxSqTail   = (volatile uint32_t *)(pbSqRing + Params.SqOffsets.offTail);
+                    pIoUring->fSqMask      = *(uint32_t *)(pbSqRing + Params.SqOffsets.offRingMask);
+                    pIoUring->paidxSqArray = (volatile uint32_t *)(pbSqRing + Params.SqOffsets.offArray);
+                    pIoUring->pidxCqHead   = (volatile uint32_t *)(pbCqRing + Params.CqOffsets.offHead);
+                    pIoUring->pidxCqTail   = (volatile uint32_t *)(pbCqRing + Params.CqOffsets.offTail);
+                    pIoUring->fCqMask      = *(uint32_t *)(pbCqRing + Params.CqOffsets.offRingMask);
+                    pIoUring->paCqes       = (PLNXIOURINGCQE)(pbCqRing + Params.CqOffsets.offCqes);
+                    return VINF_SUCCESS;
+                }
+            }
+        }
+        rc = RTErrConvertFromErrno(errno);
+    }
+
+    rtFileAioLinuxIoUringDestroy(pIoUring);
+    return rc;
+}
+
+/**
+ * Submits requests through the io_uring of the given context.
+ *
+ * Fills as many submission queue entries as possible and passes them to the
+ * kernel with a single syscall. Entries the kernel didn't consume are taken
+ * back so the requests can be resubmitted later.
+ */
+static int rtFileAioLinuxIoUringSubmit(PRTFILEAIOCTXINTERNAL pCtxInt, PRTFILEAIOREQ pahReqs, size_t cReqs)
+{
+    PLNXIOURING pIoUring = &pCtxInt->IoUring;
+    int         rc       = VINF_SUCCESS;
+
+    RTCritSectEnter(&pIoUring->CritSectSubmit);
+    while (cReqs)
+    {
+        /*
+         * There is no kernel side polling thread, so all entries are consumed when the syscall returns.
+         * Completions must not overflow the completion ring, older kernels drop them.
+         */
+        uint32_t const idxTail    = *pIoUring->pidxSqTail;
+        uint32_t const cFree      = pIoUring->cSqEntries - (idxTail - ASMAtomicReadU32(pIoUring->pidxSqHead));
+        int32_t  const cInFlight  = ASMAtomicReadS32(&pCtxInt->cRequests);
+        uint32_t const cCqFree    = (uint32_t)cInFlight < pIoUring->cCqEntries ? pIoUring->cCqEntries - cInFlight : 0;
+        uint32_t const cToSubmit  = (uint32_t)RT_MIN(cReqs, RT_MIN(cFree, cCqFree));
+
+        for (uint32_t i = 0; i < cToSubmit; i++)
+        {
+            PRTFILEAIOREQINTERNAL pReqInt = pahReqs[i];
+            uint32_t const        idxSqe  = (idxTail + i) & pIoUring->fSqMask;
+            PLNXIOURINGSQE        pSqe    = &pIoUring->paSqes[idxSqe];
+
+            RT_ZERO(*pSqe);
+            pSqe->iFileDesc = pReqInt->AioCB.uFileDesc;
+            pSqe->u64User   = (uintptr_t)pReqInt;
+            if (pReqInt->AioCB.u16IoOpCode == LNXKAIO_IOCB_CMD_FSYNC)
+                pSqe->u8OpCode = LNXIOURING_OP_FSYNC;
+            else
+            {
+                pReqInt->IoVec.iov_base = pReqInt->AioCB.pvBuf;
+                pReqInt->IoVec.iov_len  = pReqInt->AioCB.cbTransfer;
+                pSqe->u8OpCode   =   pReqInt->AioCB.u16IoOpCode == LNXKAIO_IOCB_CMD_READ
+                                   ? LNXIOURING_OP_READV
+                                   : LNXIOURING_OP_WRITEV;
+                pSqe->off        = pReqInt->AioCB.off;
+                pSqe->u64AddrBuf = (uintptr_t)&pReqInt->IoVec;
+                pSqe->cbTransfer = 1;
+            }
+            pIoUring->paidxSqArray[idxSqe] = idxSqe;
+        }
+
+        /* Publish the new tail, the atomic write orders the entry stores before it. */
+        ASMAtomicWriteU32(pIoUring->pidxSqTail, idxTail + cToSubmit);
+
+        int cSubmitted = 0;
+        if (cToSubmit)
+        {
+            cSubmitted = rtFileAioLinuxIoUringEnter(pIoUring, cToSubmit, 0, 0);
+            if (RT_FAILURE(cSubmitted))
+            {
+                rc = cSubmitted;
+                cSubmitted = 0;
+            }
+        }
+
+        /* Take back whatever the kernel left in the ring. */
+        if ((uint32_t)cSubmitted < cToSubmit)
+            ASMAtomicWriteU32(pIoUring->pidxSqTail, idxTail + cSubmitted);
+
+        ASMAtomicAddS32(&pCtxInt->cRequests, cSubmitted);
+        cReqs   -= cSubmitted;
+        pahReqs += cSubmitted;
+
+        if ((uint32_t)cSubmitted < cToSubmit || !cToSubmit)
+        {
+            if (RT_SUCCESS(rc))
+                rc = VERR_FILE_AIO_INSUFFICIENT_RESSOURCES;
+            break;
+        }
+    }
+    RTCritSectLeave(&pIoUring->CritSectSubmit);
+
+    if (RT_FAILURE(rc))
+    {
+        /* Revert the remaining requests into the prepared state. */
+        for (size_t i = 0; i < cReqs; i++)
+        {
+            PRTFILEAIOREQINTERNAL pReqInt = pahReqs[i];
+            pReqInt->pCtxInt = NULL;
+            RTFILEAIOREQ_SET_STATE(pReqInt, PREPARED);
+        }
+
+        if (   rc == VERR_TRY_AGAIN
+            || rc == VERR_RESOURCE_BUSY
+            || rc == VERR_NO_MEMORY)
+            rc = VERR_FILE_AIO_INSUFFICIENT_RESSOURCES;
+        else if (rc != VERR_FILE_AIO_INSUFFICIENT_RESSOURCES)
+        {
+            /* The first request failed. */
+            PRTFILEAIOREQINTERNAL pReqInt = pahReqs[0];
+            RTFILEAIOREQ_SET_STATE(pReqInt, COMPLETED);
+            pReqInt->Rc = rc;
+            pReqInt->cbTransfered = 0;
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * Reaps completed requests from the completion ring without entering the kernel.
+ *
+ * @returns Number of completed requests stored in pahReqs.
+ */
+static uint32_t rtFileAioLinuxIoUringReap(PLNXIOURING pIoUring, PRTFILEAIOREQ pahReqs, size_t cReqs)
+{
+    uint32_t       idxHead = *pIoUring->pidxCqHead;
+    uint32_t const idxTail = ASMAtomicReadU32(pIoUring->pidxCqTail);
+    uint32_t       cDone   = 0;
+
+    while (   idxHead != idxTail
+           && cDone < cReqs)
+    {
+        PLNXIOURINGCQE        pCqe    = &pIoUring->paCqes[idxHead & pIoUring->fCqMask];
+        PRTFILEAIOREQINTERNAL pReqInt = (PRTFILEAIOREQINTERNAL)(uintptr_t)pCqe->u64User;
+        AssertPtr(pReqInt);
+        Assert(pReqInt->u32Magic == RTFILEAIOREQ_MAGIC);
+
+        if (RT_UNLIKELY(pCqe->rcLnx < 0))
+            pReqInt->Rc = RTErrConvertFromErrno(-pCqe->rcLnx);
+        else
+        {
+            pReqInt->Rc = VINF_SUCCESS;
+            pReqInt->cbTransfered = pCqe->rcLnx;
+        }
+
+        /* Mark the request as finished. */
+        RTFILEAIOREQ_SET_STATE(pReqInt, COMPLETED);
+
+        pahReqs[cDone++] = (RTFILEAIOREQ)pReqInt;
+        idxHead++;
+    }
+
+    /* Give the entries back to the kernel. */
+    ASMAtomicWriteU32(pIoUring->pidxCqHead, idxHead);
+    return cDone;
+}
+
+/**
+ * Waits for completed requests on the io_uring of the given context.
+ *
+ * @returns IPRT status code.
+ * @param   pCtxInt     The context.
+ * @param   cMinReqs    Minimum number of requests to wait for, at least 1.
+ * @param   cMillies    The timeout.
+ * @param   pahReqs     Where to store the completed requests.
+ * @param   cReqs       Size of the array.
+ * @param   pcReqs      Where to store the number of completed requests.
+ */
+static int rtFileAioLinuxIoUringWait(PRTFILEAIOCTXINTERNAL pCtxInt, size_t cMinReqs, RTMSINTERVAL cMillies,
+                                     PRTFILEAIOREQ pahReqs, size_t cReqs, uint32_t *pcReqs)
+{
+    PLNXIOURING pIoUring           = &pCtxInt->IoUring;
+    uint64_t    StartNanoTS        = cMillies != RT_INDEFINITE_WAIT ? RTTimeNanoTS() : 0;
+    uint32_t    cRequestsCompleted = 0;
+    int         rc                 = VINF_SUCCESS;
+
+    while (!pCtxInt->fWokenUp)
+    {
+        uint32_t cDone = rtFileAioLinuxIoUringReap(pIoUring, &pahReqs[cRequestsCompleted], cReqs - cRequestsCompleted);
+        cRequestsCompleted += cDone;
+        if (cRequestsCompleted >= cMinReqs)
+            break;
+
+        /*
+         * Nothing left in the ring, block in the kernel. io_uring_enter
+         * can't time out on older kernels, so poll the ring descriptor
+         * in that case which becomes readable when completions arrive.
+         */
+        ASMAtomicXchgBool(&pCtxInt->fWaiting, true);
+        if (cMillies == RT_INDEFINITE_WAIT)
+            rc = rtFileAioLinuxIoUringEnter(pIoUring, 0, (uint32_t)(cMinReqs - cRequestsCompleted),
+                                            LNXIOURING_ENTER_GETEVENTS);
+        else
+        {
+            uint64_t cMilliesElapsed = (RTTimeNanoTS() - StartNanoTS) / RT_NS_1MS;
+            if (cMilliesElapsed >= cMillies)
+                rc = VERR_TIMEOUT;
+            else
+            {
+                struct pollfd PollFd;
+                PollFd.fd      = pIoUring->iFdRing;
+                PollFd.events  = POLLIN;
+                PollFd.revents = 0;
+                rc = poll(&PollFd, 1, (int)RT_MIN(cMillies - cMilliesElapsed, INT32_MAX));
+                if (rc == -1)
+                    rc = RTErrConvertFromErrno(errno);
+                else if (rc == 0)
+                    rc = VERR_TIMEOUT;
+            }
+        }
+        ASMAtomicXchgBool(&pCtxInt->fWaiting, false);
+        if (RT_FAILURE(rc))
+            break;
+        rc = VINF_SUCCESS;
+    }
+
+    *pcReqs = cRequestsCompleted;
+    return rc;
+}
+
 RTR3DECL(int) RTFileAioGetLimits(PRTFILEAIOLIMITS pAioLimits)
 {
     int rc = VINF_SUCCESS;
     AssertPtrReturn(pAioLimits, VERR_INVALID_POINTER);
 
+    /*
+     * io_uring has no restrictions besides the ones O_DIRECT imposes
+     * if the file was opened that way.
+     */
+    if (rtFileAioLinuxIoUringIsAvailable())
+    {
+        pAioLimits->cReqsOutstandingMax = RTFILEAIO_UNLIMITED_REQS;
+        pAioLimits->cbBufferAlignment   = 512;
+        pAioLimits->fFlags              = RTFILEAIOLIMITS_F_BUFFERED_IO;
+        return VINF_SUCCESS;
+    }
+
     /*
      * Check if the API is implemented by creating a
      * completion port.
@@ -308,6 +889,7 @@ RTR3DECL(int) RTFileAioGetLimits(PRTFILEAIOLIMITS pAioLimits)
     /* Supported - fill in the limits. The alignment is the only restriction. */
     pAioLimits->cReqsOutstandingMax = RTFILEAIO_UNLIMITED_REQS;
     pAioLimits->cbBufferAlignment   = 512;
+    pAioLimits->fFlags              = 0;
 
     return VINF_SUCCESS;
 }
@@ -436,6 +1018,10 @@ RTDECL(int) RTFileAioReqCancel(RTFILEAIOREQ hReq)
     RTFILEAIOREQ_VALID_RETURN(pReqInt);
     RTFILEAIOREQ_STATE_RETURN_RC(pReqInt, SUBMITTED, VERR_FILE_AIO_NOT_SUBMITTED);
 
+    /* Requests on an io_uring can't be canceled synchronously, let them complete. */
+    if (pReqInt->pCtxInt->fIoUring)
+        return VERR_FILE_AIO_IN_PROGRESS;
+
     LNXKAIOIOEVENT AioEvent;
     int rc = rtFileAsyncIoLinuxCancel(pReqInt->AioContext, &pReqInt->AioCB, &AioEvent);
     if (RT_SUCCESS(rc))
@@ -489,8 +1075,20 @@ RTDECL(int) RTFileAioCtxCreate(PRTFILEAIOCTX phAioCtx, uint32_t cAioReqsMax,
     if (RT_UNLIKELY(!pCtxInt))
         return VERR_NO_MEMORY;
 
-    /* Init the event handle. */
-    int rc = rtFileAsyncIoLinuxCreate(cAioReqsMax, &pCtxInt->AioContext);
+    /* Set up an io_uring if possible and fall back to the kernel AIO interface otherwise. */
+    int rc = VERR_NOT_SUPPORTED;
+    pCtxInt->IoUring.iFdRing = -1;
+    if (rtFileAioLinuxIoUringIsAvailable())
+    {
+        /* No fallback, the kernel AIO interface can't handle the buffered I/O we advertised. */
+        rc = rtFileAioLinuxIoUringCreate(&pCtxInt->IoUring, cAioReqsMax);
+        if (RT_SUCCESS(rc))
+            pCtxInt->fIoUring = true;
+        else
+            LogFlow(("RTFileAioCtxCreate: Creating an io_uring failed with %Rrc\n", rc));
+    }
+    else
+        rc = rtFileAsyncIoLinuxCreate(cAioReqsMax, &pCtxInt->AioContext);
     if (RT_SUCCESS(rc))
     {
         pCtxInt->fWokenUp     = false;
@@ -521,9 +1119,14 @@ RTDECL(int) RTFileAioCtxDestroy(RTFILEAIOCTX hAioCtx)
         return VERR_FILE_AIO_BUSY;
 
     /* The native bit first, then mark it as dead and free it. */
-    int rc = rtFileAsyncIoLinuxDestroy(pCtxInt->AioContext);
-    if (RT_FAILURE(rc))
-        return rc;
+    if (pCtxInt->fIoUring)
+        rtFileAioLinuxIoUringDestroy(&pCtxInt->IoUring);
+    else
+    {
+        int rc = rtFileAsyncIoLinuxDestroy(pCtxInt->AioContext);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
     ASMAtomicUoWriteU32(&pCtxInt->u32Magic, RTFILEAIOCTX_MAGIC_DEAD);
     RTMemFree(pCtxInt);
 
@@ -590,6 +1193,9 @@ RTDECL(int) RTFileAioCtxSubmit(RTFILEAIOCTX hAioCtx, PRTFILEAIOREQ pahReqs, size
         RTFILEAIOREQ_SET_STATE(pReqInt, SUBMITTED);
     }
 
+    if (pCtxInt->fIoUring)
+        return rtFileAioLinuxIoUringSubmit(pCtxInt, pahReqs, cReqs);
+
     do
     {
         /*
@@ -646,27 +1252,20 @@ RTDECL(int) RTFileAioCtxSubmit(RTFILEAIOCTX hAioCtx, PRTFILEAIOREQ pahReqs, size
 }
 
 
-RTDECL(int) RTFileAioCtxWait(RTFILEAIOCTX hAioCtx, size_t cMinReqs, RTMSINTERVAL cMillies,
-                             PRTFILEAIOREQ pahReqs, size_t cReqs, uint32_t *pcReqs)
+/**
+ * Waits for completed requests using the kernel AIO interface.
+ *
+ * @returns IPRT status code.
+ * @param   pCtxInt     The context.
+ * @param   cMinReqs    Minimum number of requests to wait for, at least 1.
+ * @param   cMillies    The timeout.
+ * @param   pahReqs     Where to store the completed requests.
+ * @param   cReqs       Size of the array.
+ * @param   pcReqs      Where to store the number of completed requests.
+ */
+static int rtFileAioLinuxKAioWait(PRTFILEAIOCTXINTERNAL pCtxInt, size_t cMinReqs, RTMSINTERVAL cMillies,
+                                  PRTFILEAIOREQ pahReqs, size_t cReqs, uint32_t *pcReqs)
 {
-    /*
-     * Validate the parameters, making sure to always set pcReqs.
-     */
-    AssertPtrReturn(pcReqs, VERR_INVALID_POINTER);
-    *pcReqs = 0; /* always set */
-    PRTFILEAIOCTXINTERNAL pCtxInt = hAioCtx;
-    RTFILEAIOCTX_VALID_RETURN(pCtxInt);
-    AssertPtrReturn(pahReqs, VERR_INVALID_POINTER);
-    AssertReturn(cReqs != 0, VERR_INVALID_PARAMETER);
-    AssertReturn(cReqs >= cMinReqs, VERR_OUT_OF_RANGE);
-
-    /*
-     * Can't wait if there are not requests around.
-     */
-    if (   RT_UNLIKELY(ASMAtomicUoReadS32(&pCtxInt->cRequests) == 0)
-        && !(pCtxInt->fFlags & RTFILEAIOCTX_FLAGS_WAIT_WITHOUT_PENDING_REQUESTS))
-        return VERR_FILE_AIO_NO_REQUEST;
-
     /*
      * Convert the timeout if specified.
      */
@@ -681,14 +1280,6 @@ RTDECL(int) RTFileAioCtxWait(RTFILEAIOCTX hAioCtx, size_t cMinReqs, RTMSINTERVAL
         StartNanoTS = RTTimeNanoTS();
     }
 
-    /* Wait for at least one. */
-    if (!cMinReqs)
-        cMinReqs = 1;
-
-    /* For the wakeup call. */
-    Assert(pCtxInt->hThreadWait == NIL_RTTHREAD);
-    ASMAtomicWriteHandle(&pCtxInt->hThreadWait, RTThreadSelf());
-
     /*
      * Loop until we're woken up, hit an error (incl timeout), or
      * have collected the desired number of requests.
@@ -764,11 +1355,52 @@ RTDECL(int) RTFileAioCtxWait(RTFILEAIOCTX hAioCtx, size_t cMinReqs, RTMSINTERVAL
         }
     }
 
+    *pcReqs = cRequestsCompleted;
+    return rc;
+}
+
+
+RTDECL(int) RTFileAioCtxWait(RTFILEAIOCTX hAioCtx, size_t cMinReqs, RTMSINTERVAL cMillies,
+                             PRTFILEAIOREQ pahReqs, size_t cReqs, uint32_t *pcReqs)
+{
+    /*
+     * Validate the parameters, making sure to always set pcReqs.
+     */
+    AssertPtrReturn(pcReqs, VERR_INVALID_POINTER);
+    *pcReqs = 0; /* always set */
+    PRTFILEAIOCTXINTERNAL pCtxInt = hAioCtx;
+    RTFILEAIOCTX_VALID_RETURN(pCtxInt);
+    AssertPtrReturn(pahReqs, VERR_INVALID_POINTER);
+    AssertReturn(cReqs != 0, VERR_INVALID_PARAMETER);
+    AssertReturn(cReqs >= cMinReqs, VERR_OUT_OF_RANGE);
+
+    /*
+     * Can't wait if there are not requests around.
+     */
+    if (   RT_UNLIKELY(ASMAtomicUoReadS32(&pCtxInt->cRequests) == 0)
+        && !(pCtxInt->fFlags & RTFILEAIOCTX_FLAGS_WAIT_WITHOUT_PENDING_REQUESTS))
+        return VERR_FILE_AIO_NO_REQUEST;
+
+    /* Wait for at least one. */
+    if (!cMinReqs)
+        cMinReqs = 1;
+
+    /* For the wakeup call. */
+    Assert(pCtxInt->hThreadWait == NIL_RTTHREAD);
+    ASMAtomicWriteHandle(&pCtxInt->hThreadWait, RTThreadSelf());
+
+    int rc = VINF_SUCCESS;
+    uint32_t cRequestsCompleted = 0;
+    if (pCtxInt->fIoUring)
+        rc = rtFileAioLinuxIoUringWait(pCtxInt, cMinReqs, cMillies, pahReqs, cReqs, &cRequestsCompleted);
+    else
+        rc = rtFileAioLinuxKAioWait(pCtxInt, cMinReqs, cMillies, pahReqs, cReqs, &cRequestsCompleted);
+
     /*
      * Update the context state and set the return value.
      */
     *pcReqs = cRequestsCompleted;
-    ASMAtomicSubS32(&pCtxInt->cRequests, cRequestsCompleted);
+    ASMAtomicSubS32(&pCtxInt->cRequests, (int32_t)cRequestsCompleted);
     Assert(pCtxInt->hThreadWait == RTThreadSelf());
     ASMAtomicWriteHandle(&pCtxInt->hThreadWait, NIL_RTTHREAD);
 
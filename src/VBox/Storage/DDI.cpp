@@ -0,0 +1,2324 @@
+/* $Id$ */
+/** @file
+ * DDI - Deduplicating Disk Image.
+ */
+
+/*
+ * Copyright (C) 2013 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#define LOG_GROUP LOG_GROUP_VD_DDI
+#include <VBox/vd-plugin.h>
+#include <VBox/err.h>
+
+#include <VBox/log.h>
+#include <iprt/asm.h>
+#include <iprt/assert.h>
+#include <iprt/string.h>
+#include <iprt/alloc.h>
+#include <iprt/path.h>
+#include <iprt/list.h>
+#include <iprt/avl.h>
+#include <iprt/sha.h>
+#include <iprt/uuid.h>
+
+/**
+ * The DDI backend implements a content addressed image format. The virtual disk
+ * is split into fixed size blocks and every block is stored as a chunk in a
+ * chunk store which is part of the image. Chunks are identified by the SHA-256
+ * digest of their content, so writing data which is already present in the image
+ * only updates the block map and the reference count of the existing chunk
+ * instead of writing the data again.
+ *
+ * On disk the image consists of:
+ *    - the header,
+ *    - the block map with one 32bit slot index per block (0 means unallocated),
+ *    - the chunk table with the SHA-256 digest of every slot,
+ *    - the chunk slots holding the data.
+ *
+ * Reference counts and the hash index are not stored but rebuilt from the block
+ * map and the chunk table when the image is opened. A slot which is not referenced
+ * anymore is only reused after the next flush completed, so the block map on disk
+ * never points to a slot which is being rewritten. The digests of an image which
+ * was not closed properly are recomputed from the data before they are trusted.
+ *
+ * The number of slots is fixed when the image is created: one per block plus
+ * 25% for chunks replaced since the last flush.  When the spare slots run out
+ * before the guest flushes, the image is flushed synchronously to reclaim the
+ * slots of all replaced chunks.  As a block references at most one chunk, this
+ * always frees enough slots unless a quarter of the blocks is written at the
+ * same time.  Growing the chunk store would require moving the data behind
+ * the chunk table.
+ *
+ * Missing things to implement:
+ *    - discard, compaction and resizing
+ *    - sharing the chunk store between images
+ */
+
+/*******************************************************************************
+*   Structures in a DDI image, little endian                                   *
+*******************************************************************************/
+
+#pragma pack(1)
+typedef struct DdiHeader
+{
+    /** Magic value. */
+    uint32_t    u32Magic;
+    /** Version of the image format. */
+    uint32_t    u32Version;
+    /** Header flags, see DDI_HDR_FLAGS_*. */
+    uint32_t    u32Flags;
+    /** Image flags, only VD_IMAGE_FLAGS_DIFF is stored. */
+    uint32_t    u32ImageFlags;
+    /** Logical image size as seen by the guest. */
+    uint64_t    u64Size;
+    /** Block size in bytes, the unit of deduplication. */
+    uint32_t    u32BlockSize;
+    /** Number of entries in the block map. */
+    uint32_t    u32Blocks;
+    /** Offset of the block map in bytes. */
+    uint64_t    u64OffBlockMap;
+    /** Number of slots in the chunk store. */
+    uint32_t    u32Slots;
+    /** Reserved, must be 0. */
+    uint32_t    u32Reserved;
+    /** Offset of the chunk table in bytes. */
+    uint64_t    u64OffChunkTbl;
+    /** Offset of the first chunk slot in bytes. */
+    uint64_t    u64OffData;
+    /** Physical geometry. */
+    uint32_t    u32PCHSCylinders;
+    uint32_t    u32PCHSHeads;
+    uint32_t    u32PCHSSectors;
+    /** Logical geometry. */
+    uint32_t    u32LCHSCylinders;
+    uint32_t    u32LCHSHeads;
+    uint32_t    u32LCHSSectors;
+    /** UUID of the image. */
+    RTUUID      UuidCreate;
+    /** UUID of the last modification. */
+    RTUUID      UuidModification;
+    /** UUID of the parent image. */
+    RTUUID      UuidParent;
+    /** UUID of the last modification of the parent image. */
+    RTUUID      UuidParentModification;
+} DdiHeader;
+#pragma pack()
+/** Pointer to a on disk DDI header. */
+typedef DdiHeader *PDdiHeader;
+
+/** DDI magic value. */
+#define DDI_MAGIC                            UINT32_C(0x00494444) /* DDI\0 */
+/** Current version of the image format. */
+#define DDI_VERSION                          1
+/** Space reserved for the header, the block map starts after it. */
+#define DDI_HDR_SIZE                         _4K
+/** Block size minimum. */
+#define DDI_BLOCK_SIZE_MIN                   _4K
+/** Block size maximum. */
+#define DDI_BLOCK_SIZE_MAX                   _1M
+/** DDI default block size when creating an image. */
+#define DDI_BLOCK_SIZE_DEFAULT               (64 * _1K)
+
+/** Header flags.
+ * @{
+ */
+/** The image is in use or was not closed properly, the chunk table
+ * might not match the data. */
+#define DDI_HDR_FLAGS_UNCLEAN                RT_BIT_32(0)
+/** Mask of valid header flags. */
+#define DDI_HDR_FLAGS_MASK                   (DDI_HDR_FLAGS_UNCLEAN)
+/** @} */
+
+/*******************************************************************************
+*   Constants And Macros, Structures and Typedefs                              *
+*******************************************************************************/
+
+/** Number of chunk table entries processed at once when opening an image. */
+#define DDI_CHUNK_TBL_ENTRIES_PER_READ       _32K
+
+/**
+ * A chunk in the chunk store.
+ */
+typedef struct DDICHUNK
+{
+    /** AVL tree node for the hash index, the key is the start of the digest. */
+    AVLRU64NODECORE     Core;
+    /** List node for the list of chunks waiting for a flush before the slot is reused. */
+    RTLISTNODE          NodePending;
+    /** The slot index of the chunk (1 based). */
+    uint32_t            idxSlot;
+    /** Number of block map entries referencing the chunk. */
+    uint32_t            cRefs;
+    /** Flag whether the chunk is in the hash index. */
+    bool                fIndexed;
+    /** SHA-256 digest of the chunk data. */
+    uint8_t             abHash[RTSHA256_HASH_SIZE];
+} DDICHUNK, *PDDICHUNK;
+
+/**
+ * DDI image data structure.
+ */
+typedef struct DDIIMAGE
+{
+    /** Image name. */
+    const char          *pszFilename;
+    /** Storage handle. */
+    PVDIOSTORAGE        pStorage;
+
+    /** Pointer to the per-disk VD interface list. */
+    PVDINTERFACE        pVDIfsDisk;
+    /** Pointer to the per-image VD interface list. */
+    PVDINTERFACE        pVDIfsImage;
+    /** Error interface. */
+    PVDINTERFACEERROR   pIfError;
+    /** I/O interface. */
+    PVDINTERFACEIOINT   pIfIo;
+
+    /** Open flags passed by VBoxHD layer. */
+    unsigned            uOpenFlags;
+    /** Image flags defined during creation or determined during open. */
+    unsigned            uImageFlags;
+    /** Total size of the image. */
+    uint64_t            cbSize;
+    /** Physical geometry of this image. */
+    VDGEOMETRY          PCHSGeometry;
+    /** Logical geometry of this image. */
+    VDGEOMETRY          LCHSGeometry;
+    /** Image UUID. */
+    RTUUID              ImageUuid;
+    /** Image modification UUID. */
+    RTUUID              ModificationUuid;
+    /** Parent image UUID. */
+    RTUUID              ParentUuid;
+    /** Parent image modification UUID. */
+    RTUUID              ParentModificationUuid;
+    /** Header flags written with the next header update. */
+    uint32_t            fHdrFlags;
+
+    /** Block size in bytes. */
+    uint32_t            cbBlock;
+    /** Number of blocks in the block map. */
+    uint32_t            cBlocks;
+    /** Offset of the block map. */
+    uint64_t            offBlockMap;
+    /** Number of slots in the chunk store. */
+    uint32_t            cSlots;
+    /** Offset of the chunk table. */
+    uint64_t            offChunkTbl;
+    /** Offset of the first chunk slot. */
+    uint64_t            offData;
+
+    /** The block map, slot index for every block. */
+    uint32_t           *paBlockMap;
+    /** Chunk for every slot, indexed by slot index (entry 0 is unused). */
+    PDDICHUNK          *papChunks;
+    /** Highest slot index ever used. */
+    uint32_t            cSlotsUsed;
+    /** Stack of free slots below cSlotsUsed. */
+    uint32_t           *paSlotsFree;
+    /** Number of entries on the free slot stack. */
+    uint32_t            cSlotsFree;
+    /** The hash index of all chunks. */
+    AVLRU64TREE         pTreeChunks;
+    /** Chunks without references waiting for the next flush. */
+    RTLISTNODE          ListChunksPending;
+    /** Async flushes in progress, see DDIFLUSH. */
+    RTLISTNODE          ListFlushes;
+
+    /** Number of full block writes which were satisfied by an existing chunk. */
+    uint64_t            cDedupHits;
+    /** Number of full block writes which needed a new chunk. */
+    uint64_t            cDedupMisses;
+} DDIIMAGE, *PDDIIMAGE;
+
+/**
+ * State of an async block write.
+ */
+typedef enum DDIBLOCKWRITESTATE
+{
+    /** Invalid. */
+    DDIBLOCKWRITESTATE_INVALID = 0,
+    /** Writing the data of a new chunk. */
+    DDIBLOCKWRITESTATE_CHUNK_DATA,
+    /** Writing the digest of a new chunk to the chunk table. */
+    DDIBLOCKWRITESTATE_CHUNK_HASH,
+    /** Linking the chunk into the block map. */
+    DDIBLOCKWRITESTATE_LINK,
+    /** 32bit blowup. */
+    DDIBLOCKWRITESTATE_32BIT_HACK = 0x7fffffff
+} DDIBLOCKWRITESTATE, *PDDIBLOCKWRITESTATE;
+
+/**
+ * Data needed to track an async block write.
+ */
+typedef struct DDIBLOCKWRITE
+{
+    /** The state of the block write. */
+    DDIBLOCKWRITESTATE  enmState;
+    /** The block to update. */
+    uint32_t            idxBlock;
+    /** The chunk the block is linked to, NULL if the block is freed. A reference
+     * is held for the duration of the write. */
+    PDDICHUNK           pChunk;
+    /** The block data, only valid for new chunks. */
+    uint8_t             abData[1];
+} DDIBLOCKWRITE, *PDDIBLOCKWRITE;
+
+/**
+ * Data needed to track an async flush.
+ */
+typedef struct DDIFLUSH
+{
+    /** List node for the list of flushes in progress. */
+    RTLISTNODE          NodeFlush;
+    /** Chunks whose slots can be reused once the flush completed. */
+    RTLISTNODE          ListChunks;
+} DDIFLUSH, *PDDIFLUSH;
+
+/*******************************************************************************
+*   Static Variables                                                           *
+*******************************************************************************/
+
+/** NULL-terminated array of supported file extensions. */
+static const VDFILEEXTENSION s_aDdiFileExtensions[] =
+{
+    {"ddi", VDTYPE_HDD},
+    {NULL,  VDTYPE_INVALID}
+};
+
+/*******************************************************************************
+*   Internal Functions                                                         *
+*******************************************************************************/
+
+/**
+ * Converts the image header to the host endianess and performs basic checks.
+ *
+ * @returns Whether the given header is valid or not.
+ * @param   pHeader    Pointer to the header to convert.
+ */
+static bool ddiHdrConvertToHostEndianess(PDdiHeader pHeader)
+{
+    pHeader->u32Magic         = RT_LE2H_U32(pHeader->u32Magic);
+    pHeader->u32Version       = RT_LE2H_U32(pHeader->u32Version);
+    pHeader->u32Flags         = RT_LE2H_U32(pHeader->u32Flags);
+    pHeader->u32ImageFlags    = RT_LE2H_U32(pHeader->u32ImageFlags);
+    pHeader->u64Size          = RT_LE2H_U64(pHeader->u64Size);
+    pHeader->u32BlockSize     = RT_LE2H_U32(pHeader->u32BlockSize);
+    pHeader->u32Blocks        = RT_LE2H_U32(pHeader->u32Blocks);
+    pHeader->u64OffBlockMap   = RT_LE2H_U64(pHeader->u64OffBlockMap);
+    pHeader->u32Slots         = RT_LE2H_U32(pHeader->u32Slots);
+    pHeader->u64OffChunkTbl   = RT_LE2H_U64(pHeader->u64OffChunkTbl);
+    pHeader->u64OffData       = RT_LE2H_U64(pHeader->u64OffData);
+    pHeader->u32PCHSCylinders = RT_LE2H_U32(pHeader->u32PCHSCylinders);
+    pHeader->u32PCHSHeads     = RT_LE2H_U32(pHeader->u32PCHSHeads);
+    pHeader->u32PCHSSectors   = RT_LE2H_U32(pHeader->u32PCHSSectors);
+    pHeader->u32LCHSCylinders = RT_LE2H_U32(pHeader->u32LCHSCylinders);
+    pHeader->u32LCHSHeads     = RT_LE2H_U32(pHeader->u32LCHSHeads);
+    pHeader->u32LCHSSectors   = RT_LE2H_U32(pHeader->u32LCHSSectors);
+
+    if (   pHeader->u32Magic != DDI_MAGIC
+        || pHeader->u32Version != DDI_VERSION
+        || pHeader->u32BlockSize < DDI_BLOCK_SIZE_MIN
+        || pHeader->u32BlockSize > DDI_BLOCK_SIZE_MAX
+        || !RT_IS_POWER_OF_TWO(pHeader->u32BlockSize)
+        || (uint64_t)pHeader->u32Blocks * pHeader->u32BlockSize < pHeader->u64Size
+        || pHeader->u32Slots < pHeader->u32Blocks
+        || pHeader->u64OffBlockMap < DDI_HDR_SIZE
+        || pHeader->u64OffChunkTbl < pHeader->u64OffBlockMap + (uint64_t)pHeader->u32Blocks * sizeof(uint32_t)
+        || pHeader->u64OffData < pHeader->u64OffChunkTbl + (uint64_t)pHeader->u32Slots * RTSHA256_HASH_SIZE
+        || (pHeader->u64OffData & (pHeader->u32BlockSize - 1)))
+        return false;
+
+    return true;
+}
+
+/**
+ * Creates a DDI header from the given image state.
+ *
+ * @returns nothing.
+ * @param   pImage     Image instance data.
+ * @param   pHeader    Pointer to the header to convert.
+ */
+static void ddiHdrConvertFromHostEndianess(PDDIIMAGE pImage, PDdiHeader pHeader)
+{
+    memset(pHeader, 0, sizeof(DdiHeader));
+    pHeader->u32Magic               = RT_H2LE_U32(DDI_MAGIC);
+    pHeader->u32Version             = RT_H2LE_U32(DDI_VERSION);
+    pHeader->u32Flags               = RT_H2LE_U32(pImage->fHdrFlags);
+    pHeader->u32ImageFlags          = RT_H2LE_U32(pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF);
+    pHeader->u64Size                = RT_H2LE_U64(pImage->cbSize);
+    pHeader->u32BlockSize           = RT_H2LE_U32(pImage->cbBlock);
+    pHeader->u32Blocks              = RT_H2LE_U32(pImage->cBlocks);
+    pHeader->u64OffBlockMap         = RT_H2LE_U64(pImage->offBlockMap);
+    pHeader->u32Slots               = RT_H2LE_U32(pImage->cSlots);
+    pHeader->u64OffChunkTbl         = RT_H2LE_U64(pImage->offChunkTbl);
+    pHeader->u64OffData             = RT_H2LE_U64(pImage->offData);
+    pHeader->u32PCHSCylinders       = RT_H2LE_U32(pImage->PCHSGeometry.cCylinders);
+    pHeader->u32PCHSHeads           = RT_H2LE_U32(pImage->PCHSGeometry.cHeads);
+    pHeader->u32PCHSSectors         = RT_H2LE_U32(pImage->PCHSGeometry.cSectors);
+    pHeader->u32LCHSCylinders       = RT_H2LE_U32(pImage->LCHSGeometry.cCylinders);
+    pHeader->u32LCHSHeads           = RT_H2LE_U32(pImage->LCHSGeometry.cHeads);
+    pHeader->u32LCHSSectors         = RT_H2LE_U32(pImage->LCHSGeometry.cSectors);
+    pHeader->UuidCreate             = pImage->ImageUuid;
+    pHeader->UuidModification       = pImage->ModificationUuid;
+    pHeader->UuidParent             = pImage->ParentUuid;
+    pHeader->UuidParentModification = pImage->ParentModificationUuid;
+}
+
+/**
+ * Returns the image offset of the given slot.
+ *
+ * @returns Offset of the slot in the image.
+ * @param   pImage     The image instance data.
+ * @param   idxSlot    The slot index (1 based).
+ */
+DECLINLINE(uint64_t) ddiSlotOffset(PDDIIMAGE pImage, uint32_t idxSlot)
+{
+    Assert(idxSlot > 0 && idxSlot <= pImage->cSlots);
+    return pImage->offData + (uint64_t)(idxSlot - 1) * pImage->cbBlock;
+}
+
+/**
+ * Returns the hash index key for the given digest.
+ *
+ * @returns The key.
+ * @param   pbHash    The SHA-256 digest.
+ */
+DECLINLINE(uint64_t) ddiHashKey(const uint8_t *pbHash)
+{
+    uint64_t u64Key;
+    memcpy(&u64Key, pbHash, sizeof(u64Key));
+    return u64Key;
+}
+
+/**
+ * Looks up a chunk with the given digest in the hash index.
+ *
+ * @returns Pointer to the chunk or NULL if there is no chunk with the digest.
+ * @param   pImage    The image instance data.
+ * @param   pbHash    The SHA-256 digest to look for.
+ */
+static PDDICHUNK ddiChunkLookup(PDDIIMAGE pImage, const uint8_t *pbHash)
+{
+    PDDICHUNK pChunk = (PDDICHUNK)RTAvlrU64Get(&pImage->pTreeChunks, ddiHashKey(pbHash));
+
+    if (   pChunk
+        && memcmp(pChunk->abHash, pbHash, RTSHA256_HASH_SIZE))
+        pChunk = NULL;
+
+    return pChunk;
+}
+
+/**
+ * Inserts the given chunk into the hash index.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ * @param   pChunk    The chunk to insert.
+ *
+ * @note A chunk whose key collides with another chunk with a different digest
+ *       is not indexed, it is just not deduplicated.
+ */
+static void ddiChunkIndexInsert(PDDIIMAGE pImage, PDDICHUNK pChunk)
+{
+    Assert(!pChunk->fIndexed);
+    pChunk->Core.Key     = ddiHashKey(pChunk->abHash);
+    pChunk->Core.KeyLast = pChunk->Core.Key;
+    pChunk->fIndexed     = RTAvlrU64Insert(&pImage->pTreeChunks, &pChunk->Core);
+}
+
+/**
+ * Allocates a new chunk in a free slot.
+ *
+ * @returns Pointer to the new chunk with one reference or NULL if the chunk store
+ *          is full or out of memory.
+ * @param   pImage    The image instance data.
+ * @param   pbHash    The SHA-256 digest of the chunk data.
+ */
+static PDDICHUNK ddiChunkAlloc(PDDIIMAGE pImage, const uint8_t *pbHash)
+{
+    uint32_t idxSlot = 0;
+
+    if (pImage->cSlotsFree)
+        idxSlot = pImage->paSlotsFree[pImage->cSlotsFree - 1];
+    else if (pImage->cSlotsUsed < pImage->cSlots)
+        idxSlot = pImage->cSlotsUsed + 1;
+    else
+        return NULL;
+
+    PDDICHUNK pChunk = (PDDICHUNK)RTMemAllocZ(sizeof(DDICHUNK));
+    if (pChunk)
+    {
+        if (pImage->cSlotsFree)
+            pImage->cSlotsFree--;
+        else
+            pImage->cSlotsUsed++;
+
+        pChunk->idxSlot = idxSlot;
+        pChunk->cRefs   = 1;
+        memcpy(pChunk->abHash, pbHash, RTSHA256_HASH_SIZE);
+        pImage->papChunks[idxSlot] = pChunk;
+    }
+
+    return pChunk;
+}
+
+/**
+ * Releases a reference to the given chunk. A chunk without references is removed
+ * from the hash index and its slot becomes free after the next flush.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ * @param   pChunk    The chunk to release.
+ */
+static void ddiChunkRelease(PDDIIMAGE pImage, PDDICHUNK pChunk)
+{
+    Assert(pChunk->cRefs > 0);
+
+    pChunk->cRefs--;
+    if (!pChunk->cRefs)
+    {
+        if (pChunk->fIndexed)
+        {
+            PAVLRU64NODECORE pCore = RTAvlrU64Remove(&pImage->pTreeChunks, pChunk->Core.Key);
+            Assert(pCore == &pChunk->Core); NOREF(pCore);
+            pChunk->fIndexed = false;
+        }
+        RTListAppend(&pImage->ListChunksPending, &pChunk->NodePending);
+    }
+}
+
+/**
+ * Returns the slots of all chunks in the given list to the free slot stack.
+ * Must only be called once the block map updates dropping the references
+ * to the chunks are on stable storage.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ * @param   pList     The list of unreferenced chunks.
+ */
+static void ddiChunksFree(PDDIIMAGE pImage, PRTLISTNODE pList)
+{
+    PDDICHUNK pIt, pItNext;
+
+    RTListForEachSafe(pList, pIt, pItNext, DDICHUNK, NodePending)
+    {
+        Assert(!pIt->cRefs && !pIt->fIndexed);
+        RTListNodeRemove(&pIt->NodePending);
+        pImage->papChunks[pIt->idxSlot] = NULL;
+        pImage->paSlotsFree[pImage->cSlotsFree++] = pIt->idxSlot;
+        RTMemFree(pIt);
+    }
+}
+
+/**
+ * Reclaims the slots of all chunks without references by flushing the image.
+ * Used when the chunk store runs out of free slots before the next flush
+ * requested by the guest.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_DISK_FULL if there is nothing to reclaim.
+ * @param   pImage    The image instance data.
+ */
+static int ddiChunksReclaim(PDDIIMAGE pImage)
+{
+    int rc = VINF_SUCCESS;
+    PDDIFLUSH pFlush;
+    bool fPending = !RTListIsEmpty(&pImage->ListChunksPending);
+
+    RTListForEach(&pImage->ListFlushes, pFlush, DDIFLUSH, NodeFlush)
+        fPending |= !RTListIsEmpty(&pFlush->ListChunks);
+
+    if (!fPending)
+        return VERR_DISK_FULL;
+
+    LogFlowFunc(("Chunk store of image '%s' is full, flushing to reclaim slots\n", pImage->pszFilename));
+
+    /*
+     * The block map updates which dropped the last references completed already,
+     * this includes the ones of flushes still in progress. They find an empty
+     * list when they complete.
+     */
+    rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+    if (RT_SUCCESS(rc))
+    {
+        ddiChunksFree(pImage, &pImage->ListChunksPending);
+        RTListForEach(&pImage->ListFlushes, pFlush, DDIFLUSH, NodeFlush)
+            ddiChunksFree(pImage, &pFlush->ListChunks);
+    }
+
+    return rc;
+}
+
+/**
+ * Internal. Flush image data to disk.
+ */
+static int ddiFlushImage(PDDIIMAGE pImage)
+{
+    int rc = VINF_SUCCESS;
+
+    if (   pImage->pStorage
+        && !(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
+    {
+        DdiHeader Header;
+
+        /* The block map is written as it is updated, only the header can be dirty. */
+        ddiHdrConvertFromHostEndianess(pImage, &Header);
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, 0, &Header,
+                                    sizeof(Header));
+        if (RT_SUCCESS(rc))
+            rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+        if (RT_SUCCESS(rc))
+            ddiChunksFree(pImage, &pImage->ListChunksPending);
+    }
+
+    return rc;
+}
+
+/**
+ * Completion callback of an async flush, frees the slots which
+ * were waiting for the flush.
+ *
+ * @returns VBox status code.
+ * @param   pBackendData    The opaque backend data.
+ * @param   pIoCtx          I/O context associated with this request.
+ * @param   pvUser          Opaque user data passed during a read/write request.
+ * @param   rcReq           Status code for the completed request.
+ */
+static DECLCALLBACK(int) ddiFlushComplete(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    PDDIFLUSH pFlush = (PDDIFLUSH)pvUser;
+    NOREF(pIoCtx);
+
+    RTListNodeRemove(&pFlush->NodeFlush);
+
+    if (RT_SUCCESS(rcReq))
+        ddiChunksFree(pImage, &pFlush->ListChunks);
+    else
+    {
+        /* Keep the slots reserved until a flush succeeds. */
+        PDDICHUNK pIt, pItNext;
+        RTListForEachSafe(&pFlush->ListChunks, pIt, pItNext, DDICHUNK, NodePending)
+        {
+            RTListNodeRemove(&pIt->NodePending);
+            RTListAppend(&pImage->ListChunksPending, &pIt->NodePending);
+        }
+    }
+
+    RTMemFree(pFlush);
+    return VINF_SUCCESS;
+}
+
+/**
+ * Flush image data to disk - version for async I/O.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   pIoCtx    The I/o context
+ */
+static int ddiFlushImageAsync(PDDIIMAGE pImage, PVDIOCTX pIoCtx)
+{
+    int rc = VINF_SUCCESS;
+
+    if (   pImage->pStorage
+        && !(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
+    {
+        DdiHeader Header;
+        PDDIFLUSH pFlush = (PDDIFLUSH)RTMemAllocZ(sizeof(DDIFLUSH));
+
+        if (!pFlush)
+            return VERR_NO_MEMORY;
+
+        /* Only slots freed before the flush was issued can be reused afterwards. */
+        RTListMove(&pFlush->ListChunks, &pImage->ListChunksPending);
+        RTListAppend(&pImage->ListFlushes, &pFlush->NodeFlush);
+
+        ddiHdrConvertFromHostEndianess(pImage, &Header);
+        rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                    0, &Header, sizeof(Header),
+                                    pIoCtx, NULL, NULL);
+        if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+        {
+            rc = vdIfIoIntFileFlush(pImage->pIfIo, pImage->pStorage,
+                                    pIoCtx, ddiFlushComplete, pFlush);
+            if (RT_SUCCESS(rc))
+                rc = ddiFlushComplete(pImage, pIoCtx, pFlush, rc);
+        }
+
+        if (RT_FAILURE(rc) && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+            ddiFlushComplete(pImage, pIoCtx, pFlush, rc);
+    }
+
+    return rc;
+}
+
+/**
+ * Loads the chunk table for all referenced slots and builds the hash index.
+ *
+ * @returns VBox status code.
+ * @param   pImage     The image instance data.
+ * @param   fRehash    Flag whether to recompute the digests from the chunk data
+ *                     and write them back instead of trusting the chunk table.
+ */
+static int ddiChunkTblLoad(PDDIIMAGE pImage, bool fRehash)
+{
+    int rc = VINF_SUCCESS;
+    uint8_t *pbTbl = (uint8_t *)RTMemAlloc(DDI_CHUNK_TBL_ENTRIES_PER_READ * RTSHA256_HASH_SIZE);
+    uint8_t *pbData = fRehash ? (uint8_t *)RTMemAlloc(pImage->cbBlock) : NULL;
+
+    if (   !pbTbl
+        || (fRehash && !pbData))
+    {
+        RTMemFree(pbTbl);
+        RTMemFree(pbData);
+        return VERR_NO_MEMORY;
+    }
+
+    for (uint32_t idxSlotStart = 1;
+         idxSlotStart <= pImage->cSlotsUsed && RT_SUCCESS(rc);
+         idxSlotStart += DDI_CHUNK_TBL_ENTRIES_PER_READ)
+    {
+        uint32_t cEntries = RT_MIN(DDI_CHUNK_TBL_ENTRIES_PER_READ, pImage->cSlotsUsed - idxSlotStart + 1);
+        uint64_t offTbl   = pImage->offChunkTbl + (uint64_t)(idxSlotStart - 1) * RTSHA256_HASH_SIZE;
+
+        rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, offTbl,
+                                   pbTbl, cEntries * RTSHA256_HASH_SIZE);
+        if (RT_FAILURE(rc))
+            break;
+
+        for (uint32_t i = 0; i < cEntries; i++)
+        {
+            PDDICHUNK pChunk = pImage->papChunks[idxSlotStart + i];
+            uint8_t *pbHash = &pbTbl[i * RTSHA256_HASH_SIZE];
+
+            if (!pChunk)
+                continue;
+
+            if (fRehash)
+            {
+                rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage,
+                                           ddiSlotOffset(pImage, pChunk->idxSlot),
+                                           pbData, pImage->cbBlock);
+                if (RT_FAILURE(rc))
+                    break;
+                RTSha256(pbData, pImage->cbBlock, pbHash);
+            }
+
+            memcpy(pChunk->abHash, pbHash, RTSHA256_HASH_SIZE);
+            ddiChunkIndexInsert(pImage, pChunk);
+        }
+
+        if (   RT_SUCCESS(rc)
+            && fRehash)
+            rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, offTbl,
+                                        pbTbl, cEntries * RTSHA256_HASH_SIZE);
+    }
+
+    RTMemFree(pbTbl);
+    RTMemFree(pbData);
+    return rc;
+}
+
+/**
+ * Builds the reference counts and the free slot stack from the block map.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ */
+static int ddiChunksBuild(PDDIIMAGE pImage)
+{
+    for (uint32_t idxBlock = 0; idxBlock < pImage->cBlocks; idxBlock++)
+    {
+        uint32_t idxSlot = pImage->paBlockMap[idxBlock];
+
+        if (!idxSlot)
+            continue;
+
+        if (idxSlot > pImage->cSlots)
+            return vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                             N_("DDI: Block %u of image '%s' references the invalid slot %u"),
+                             idxBlock, pImage->pszFilename, idxSlot);
+
+        PDDICHUNK pChunk = pImage->papChunks[idxSlot];
+        if (!pChunk)
+        {
+            pChunk = (PDDICHUNK)RTMemAllocZ(sizeof(DDICHUNK));
+            if (!pChunk)
+                return VERR_NO_MEMORY;
+
+            pChunk->idxSlot = idxSlot;
+            pImage->papChunks[idxSlot] = pChunk;
+        }
+
+        pChunk->cRefs++;
+        pImage->cSlotsUsed = RT_MAX(pImage->cSlotsUsed, idxSlot);
+    }
+
+    /* Push the free slots in reverse order so the lowest ones are used first. */
+    for (uint32_t idxSlot = pImage->cSlotsUsed; idxSlot > 0; idxSlot--)
+        if (!pImage->papChunks[idxSlot])
+            pImage->paSlotsFree[pImage->cSlotsFree++] = idxSlot;
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Allocates the in memory tables of the image.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ */
+static int ddiTablesAlloc(PDDIIMAGE pImage)
+{
+    pImage->paBlockMap  = (uint32_t *)RTMemAllocZ(pImage->cBlocks * sizeof(uint32_t));
+    pImage->papChunks   = (PDDICHUNK *)RTMemAllocZ(((size_t)pImage->cSlots + 1) * sizeof(PDDICHUNK));
+    pImage->paSlotsFree = (uint32_t *)RTMemAllocZ(pImage->cSlots * sizeof(uint32_t));
+    pImage->cSlotsUsed  = 0;
+    pImage->cSlotsFree  = 0;
+    pImage->pTreeChunks = NULL;
+    RTListInit(&pImage->ListChunksPending);
+    RTListInit(&pImage->ListFlushes);
+
+    if (   !pImage->paBlockMap
+        || !pImage->papChunks
+        || !pImage->paSlotsFree)
+        return VERR_NO_MEMORY;
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Internal. Free all allocated space for representing an image except pImage,
+ * and optionally delete the image from disk.
+ */
+static int ddiFreeImage(PDDIIMAGE pImage, bool fDelete)
+{
+    int rc = VINF_SUCCESS;
+
+    /* Freeing a never allocated image (e.g. because the open failed) is
+     * not signalled as an error. After all nothing bad happens. */
+    if (pImage)
+    {
+        if (pImage->pStorage)
+        {
+            /* No point updating the file that is deleted anyway. */
+            if (!fDelete)
+            {
+                pImage->fHdrFlags &= ~DDI_HDR_FLAGS_UNCLEAN;
+                ddiFlushImage(pImage);
+            }
+
+            rc = vdIfIoIntFileClose(pImage->pIfIo, pImage->pStorage);
+            pImage->pStorage = NULL;
+        }
+
+        if (pImage->papChunks)
+        {
+            for (uint32_t idxSlot = 1; idxSlot <= pImage->cSlotsUsed; idxSlot++)
+                if (pImage->papChunks[idxSlot])
+                    RTMemFree(pImage->papChunks[idxSlot]);
+            RTMemFree(pImage->papChunks);
+            pImage->papChunks = NULL;
+        }
+        pImage->pTreeChunks = NULL;
+        RTListInit(&pImage->ListChunksPending);
+        RTListInit(&pImage->ListFlushes);
+
+        if (pImage->paBlockMap)
+        {
+            RTMemFree(pImage->paBlockMap);
+            pImage->paBlockMap = NULL;
+        }
+
+        if (pImage->paSlotsFree)
+        {
+            RTMemFree(pImage->paSlotsFree);
+            pImage->paSlotsFree = NULL;
+        }
+
+        if (fDelete && pImage->pszFilename)
+            vdIfIoIntFileDelete(pImage->pIfIo, pImage->pszFilename);
+    }
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/**
+ * Internal: Open an image, constructing all necessary data structures.
+ */
+static int ddiOpenImage(PDDIIMAGE pImage, unsigned uOpenFlags)
+{
+    int rc;
+
+    pImage->uOpenFlags = uOpenFlags;
+
+    pImage->pIfError = VDIfErrorGet(pImage->pVDIfsDisk);
+    pImage->pIfIo = VDIfIoIntGet(pImage->pVDIfsImage);
+    AssertPtrReturn(pImage->pIfIo, VERR_INVALID_PARAMETER);
+
+    /*
+     * Open the image.
+     */
+    rc = vdIfIoIntFileOpen(pImage->pIfIo, pImage->pszFilename,
+                           VDOpenFlagsToFileOpenFlags(uOpenFlags,
+                                                      false /* fCreate */),
+                           &pImage->pStorage);
+    if (RT_FAILURE(rc))
+    {
+        /* Do NOT signal an appropriate error here, as the VD layer has the
+         * choice of retrying the open if it failed. */
+        goto out;
+    }
+
+    uint64_t cbFile;
+    DdiHeader Header;
+    rc = vdIfIoIntFileGetSize(pImage->pIfIo, pImage->pStorage, &cbFile);
+    if (RT_FAILURE(rc))
+        goto out;
+    if (cbFile < DDI_HDR_SIZE)
+    {
+        rc = VERR_VD_GEN_INVALID_HEADER;
+        goto out;
+    }
+
+    rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, 0, &Header, sizeof(Header));
+    if (RT_FAILURE(rc))
+        goto out;
+    if (!ddiHdrConvertToHostEndianess(&Header))
+    {
+        rc = VERR_VD_GEN_INVALID_HEADER;
+        goto out;
+    }
+    if (   (Header.u32Flags & ~DDI_HDR_FLAGS_MASK)
+        || (Header.u32ImageFlags & ~VD_IMAGE_FLAGS_DIFF))
+    {
+        rc = vdIfError(pImage->pIfError, VERR_NOT_SUPPORTED, RT_SRC_POS,
+                       N_("DDI: The image '%s' makes use of unsupported features"),
+                       pImage->pszFilename);
+        goto out;
+    }
+
+    pImage->uImageFlags               = Header.u32ImageFlags;
+    pImage->fHdrFlags                 = Header.u32Flags;
+    pImage->cbSize                    = Header.u64Size;
+    pImage->cbBlock                   = Header.u32BlockSize;
+    pImage->cBlocks                   = Header.u32Blocks;
+    pImage->offBlockMap               = Header.u64OffBlockMap;
+    pImage->cSlots                    = Header.u32Slots;
+    pImage->offChunkTbl               = Header.u64OffChunkTbl;
+    pImage->offData                   = Header.u64OffData;
+    pImage->PCHSGeometry.cCylinders   = Header.u32PCHSCylinders;
+    pImage->PCHSGeometry.cHeads       = Header.u32PCHSHeads;
+    pImage->PCHSGeometry.cSectors     = Header.u32PCHSSectors;
+    pImage->LCHSGeometry.cCylinders   = Header.u32LCHSCylinders;
+    pImage->LCHSGeometry.cHeads       = Header.u32LCHSHeads;
+    pImage->LCHSGeometry.cSectors     = Header.u32LCHSSectors;
+    pImage->ImageUuid                 = Header.UuidCreate;
+    pImage->ModificationUuid          = Header.UuidModification;
+    pImage->ParentUuid                = Header.UuidParent;
+    pImage->ParentModificationUuid    = Header.UuidParentModification;
+
+    rc = ddiTablesAlloc(pImage);
+    if (RT_FAILURE(rc))
+    {
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                       N_("DDI: Out of memory allocating the tables for image '%s'"),
+                       pImage->pszFilename);
+        goto out;
+    }
+
+    rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, pImage->offBlockMap,
+                               pImage->paBlockMap, pImage->cBlocks * sizeof(uint32_t));
+    if (RT_FAILURE(rc))
+    {
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                       N_("DDI: Reading the block map for image '%s' failed"),
+                       pImage->pszFilename);
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < pImage->cBlocks; i++)
+        pImage->paBlockMap[i] = RT_LE2H_U32(pImage->paBlockMap[i]);
+
+    rc = ddiChunksBuild(pImage);
+    if (RT_FAILURE(rc))
+        goto out;
+
+    /*
+     * The hash index is only required for writing. The digests of an image
+     * which was not closed properly might not match the data, rebuild them.
+     */
+    if (!(uOpenFlags & (VD_OPEN_FLAGS_READONLY | VD_OPEN_FLAGS_INFO)))
+    {
+        bool fRehash = RT_BOOL(pImage->fHdrFlags & DDI_HDR_FLAGS_UNCLEAN);
+
+        if (fRehash)
+        {
+            LogRel(("DDI: Image '%s' was not closed properly, recomputing the chunk digests\n",
+                    pImage->pszFilename));
+
+            /* Slots referenced by the block map might not have been written completely. */
+            uint64_t cbFileMin = ddiSlotOffset(pImage, RT_MAX(pImage->cSlotsUsed, 1)) + pImage->cbBlock;
+            if (   pImage->cSlotsUsed
+                && cbFile < cbFileMin)
+                rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, cbFileMin);
+        }
+
+        if (RT_SUCCESS(rc))
+            rc = ddiChunkTblLoad(pImage, fRehash);
+        if (RT_FAILURE(rc))
+        {
+            rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                           N_("DDI: Loading the chunk table for image '%s' failed"),
+                           pImage->pszFilename);
+            goto out;
+        }
+
+        /* Mark the image as in use until it is closed. */
+        pImage->fHdrFlags |= DDI_HDR_FLAGS_UNCLEAN;
+        rc = ddiFlushImage(pImage);
+    }
+
+out:
+    if (RT_FAILURE(rc))
+    {
+        /* Don't touch the header, the digests of an unclean image are not verified yet. */
+        pImage->uOpenFlags |= VD_OPEN_FLAGS_READONLY;
+        ddiFreeImage(pImage, false);
+        pImage->uOpenFlags = uOpenFlags;
+    }
+    return rc;
+}
+
+/**
+ * Internal: Create a DDI image.
+ */
+static int ddiCreateImage(PDDIIMAGE pImage, uint64_t cbSize,
+                          unsigned uImageFlags, const char *pszComment,
+                          PCVDGEOMETRY pPCHSGeometry,
+                          PCVDGEOMETRY pLCHSGeometry, PCRTUUID pUuid,
+                          unsigned uOpenFlags,
+                          PFNVDPROGRESS pfnProgress, void *pvUser,
+                          unsigned uPercentStart, unsigned uPercentSpan)
+{
+    int rc;
+    int32_t fOpen;
+    uint64_t cBlocks;
+    uint64_t cSlots;
+
+    if (uImageFlags & VD_IMAGE_FLAGS_FIXED)
+    {
+        rc = vdIfError(pImage->pIfError, VERR_VD_INVALID_TYPE, RT_SRC_POS, N_("DDI: cannot create fixed image '%s'"), pImage->pszFilename);
+        goto out;
+    }
+
+    pImage->uOpenFlags   = uOpenFlags & ~VD_OPEN_FLAGS_READONLY;
+    pImage->uImageFlags  = uImageFlags;
+    pImage->PCHSGeometry = *pPCHSGeometry;
+    pImage->LCHSGeometry = *pLCHSGeometry;
+
+    pImage->pIfError = VDIfErrorGet(pImage->pVDIfsDisk);
+    pImage->pIfIo = VDIfIoIntGet(pImage->pVDIfsImage);
+    AssertPtrReturn(pImage->pIfIo, VERR_INVALID_PARAMETER);
+
+    /*
+     * One slot for every block plus room for a quarter of the blocks to get new
+     * content before the next flush makes the replaced slots reusable.  Running
+     * out of spare slots triggers a flush, see the description at the top.
+     */
+    cBlocks = (cbSize + DDI_BLOCK_SIZE_DEFAULT - 1) / DDI_BLOCK_SIZE_DEFAULT;
+    cSlots  = cBlocks + cBlocks / 4 + 1;
+    if (cSlots >= UINT32_MAX)
+    {
+        rc = vdIfError(pImage->pIfError, VERR_VD_INVALID_SIZE, RT_SRC_POS, N_("DDI: size of image '%s' is too big"), pImage->pszFilename);
+        goto out;
+    }
+
+    /* Create image file. */
+    fOpen = VDOpenFlagsToFileOpenFlags(pImage->uOpenFlags, true /* fCreate */);
+    rc = vdIfIoIntFileOpen(pImage->pIfIo, pImage->pszFilename, fOpen, &pImage->pStorage);
+    if (RT_FAILURE(rc))
+    {
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("DDI: cannot create image '%s'"), pImage->pszFilename);
+        goto out;
+    }
+
+    /* Init image state. */
+    pImage->cbSize      = cbSize;
+    pImage->cbBlock     = DDI_BLOCK_SIZE_DEFAULT;
+    pImage->cBlocks     = (uint32_t)cBlocks;
+    pImage->cSlots      = (uint32_t)cSlots;
+    pImage->offBlockMap = DDI_HDR_SIZE;
+    pImage->offChunkTbl = RT_ALIGN_64(pImage->offBlockMap + cBlocks * sizeof(uint32_t), _4K);
+    pImage->offData     = RT_ALIGN_64(pImage->offChunkTbl + cSlots * RTSHA256_HASH_SIZE, pImage->cbBlock);
+    pImage->fHdrFlags   = DDI_HDR_FLAGS_UNCLEAN;
+    pImage->ImageUuid = *pUuid;
+    RTUuidCreate(&pImage->ModificationUuid);
+    RTUuidClear(&pImage->ParentUuid);
+    RTUuidClear(&pImage->ParentModificationUuid);
+
+    rc = ddiTablesAlloc(pImage);
+    if (RT_FAILURE(rc))
+    {
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("DDI: cannot allocate memory for the tables of image '%s'"),
+                       pImage->pszFilename);
+        goto out;
+    }
+
+    /* The chunk table needs no initialization, only slots referenced by the block map are looked at. */
+    rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, pImage->offData);
+    if (RT_SUCCESS(rc))
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, pImage->offBlockMap,
+                                    pImage->paBlockMap, pImage->cBlocks * sizeof(uint32_t));
+    if (RT_FAILURE(rc))
+    {
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("DDI: cannot write the block map of image '%s'"),
+                       pImage->pszFilename);
+        goto out;
+    }
+
+    if (RT_SUCCESS(rc) && pfnProgress)
+        pfnProgress(pvUser, uPercentStart + uPercentSpan * 98 / 100);
+
+    rc = ddiFlushImage(pImage);
+
+out:
+    if (RT_SUCCESS(rc) && pfnProgress)
+        pfnProgress(pvUser, uPercentStart + uPercentSpan);
+
+    if (RT_FAILURE(rc))
+        ddiFreeImage(pImage, rc != VERR_ALREADY_EXISTS);
+    return rc;
+}
+
+/**
+ * Rollback anything done during an async block write.
+ *
+ * @returns nothing.
+ * @param   pImage           The image instance data.
+ * @param   pBlockWrite      The block write to rollback.
+ */
+static void ddiAsyncBlockWriteRollback(PDDIIMAGE pImage, PDDIBLOCKWRITE pBlockWrite)
+{
+    /* The block map is not modified if linking fails, drop the reference of the write. */
+    if (pBlockWrite->pChunk)
+        ddiChunkRelease(pImage, pBlockWrite->pChunk);
+
+    RTMemFree(pBlockWrite);
+}
+
+static DECLCALLBACK(int) ddiAsyncBlockWriteUpdate(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq);
+
+/**
+ * Updates the block map entry on disk for an async block write.
+ *
+ * @returns VBox status code.
+ * @param   pImage           The image instance data.
+ * @param   pIoCtx           The I/O context.
+ * @param   pBlockWrite      The block write.
+ */
+static int ddiAsyncBlockWriteLink(PDDIIMAGE pImage, PVDIOCTX pIoCtx, PDDIBLOCKWRITE pBlockWrite)
+{
+    uint32_t idxSlotLe = RT_H2LE_U32(pBlockWrite->pChunk ? pBlockWrite->pChunk->idxSlot : 0);
+
+    pBlockWrite->enmState = DDIBLOCKWRITESTATE_LINK;
+    int rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                    pImage->offBlockMap + pBlockWrite->idxBlock * sizeof(uint32_t),
+                                    &idxSlotLe, sizeof(uint32_t), pIoCtx,
+                                    ddiAsyncBlockWriteUpdate, pBlockWrite);
+    if (   RT_FAILURE(rc)
+        && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+        ddiAsyncBlockWriteRollback(pImage, pBlockWrite);
+
+    return rc;
+}
+
+/**
+ * Updates the state of an async block write.
+ *
+ * @returns VBox status code.
+ * @param   pBackendData    The opaque backend data.
+ * @param   pIoCtx          I/O context associated with this request.
+ * @param   pvUser          Opaque user data passed during a read/write request.
+ * @param   rcReq           Status code for the completed request.
+ */
+static DECLCALLBACK(int) ddiAsyncBlockWriteUpdate(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    int rc = VINF_SUCCESS;
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    PDDIBLOCKWRITE pBlockWrite = (PDDIBLOCKWRITE)pvUser;
+
+    if (RT_FAILURE(rcReq))
+    {
+        ddiAsyncBlockWriteRollback(pImage, pBlockWrite);
+        return VINF_SUCCESS;
+    }
+
+    switch (pBlockWrite->enmState)
+    {
+        case DDIBLOCKWRITESTATE_CHUNK_DATA:
+        {
+            PDDICHUNK pChunk = pBlockWrite->pChunk;
+
+            /* Data is written, record the digest of the slot in the chunk table. */
+            pBlockWrite->enmState = DDIBLOCKWRITESTATE_CHUNK_HASH;
+            rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                        pImage->offChunkTbl + (uint64_t)(pChunk->idxSlot - 1) * RTSHA256_HASH_SIZE,
+                                        pChunk->abHash, RTSHA256_HASH_SIZE, pIoCtx,
+                                        ddiAsyncBlockWriteUpdate, pBlockWrite);
+            if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+                break;
+            else if (RT_FAILURE(rc))
+            {
+                ddiAsyncBlockWriteRollback(pImage, pBlockWrite);
+                break;
+            }
+            /* Success, fall through. */
+        }
+        case DDIBLOCKWRITESTATE_CHUNK_HASH:
+        {
+            /* The chunk is complete, later writes of the same data can use it. */
+            ddiChunkIndexInsert(pImage, pBlockWrite->pChunk);
+
+            rc = ddiAsyncBlockWriteLink(pImage, pIoCtx, pBlockWrite);
+            if (RT_FAILURE(rc))
+                break;
+            /* Success, fall through. */
+        }
+        case DDIBLOCKWRITESTATE_LINK:
+        {
+            /* Everything done without errors, the reference of the write moves to the block map. */
+            uint32_t idxSlotOld = pImage->paBlockMap[pBlockWrite->idxBlock];
+
+            pImage->paBlockMap[pBlockWrite->idxBlock] = pBlockWrite->pChunk ? pBlockWrite->pChunk->idxSlot : 0;
+            if (idxSlotOld)
+                ddiChunkRelease(pImage, pImage->papChunks[idxSlotOld]);
+            RTMemFree(pBlockWrite);
+            rc = VINF_SUCCESS;
+            break;
+        }
+        default:
+            AssertMsgFailed(("Invalid async block write state %d\n",
+                             pBlockWrite->enmState));
+    }
+
+    return rc;
+}
+
+/**
+ * Writes a complete block, deduplicating the data against the chunks already
+ * in the image.
+ *
+ * @returns VBox status code.
+ * @param   pImage      The image instance data.
+ * @param   pIoCtx      The I/O context holding the block data.
+ * @param   idxBlock    The block to write.
+ */
+static int ddiBlockWrite(PDDIIMAGE pImage, PVDIOCTX pIoCtx, uint32_t idxBlock)
+{
+    int rc = VINF_SUCCESS;
+    PDDIBLOCKWRITE pBlockWrite;
+
+    pBlockWrite = (PDDIBLOCKWRITE)RTMemAllocZ(RT_OFFSETOF(DDIBLOCKWRITE, abData) + pImage->cbBlock);
+    if (RT_UNLIKELY(!pBlockWrite))
+        return VERR_NO_MEMORY;
+
+    pBlockWrite->idxBlock = idxBlock;
+    vdIfIoIntIoCtxCopyFrom(pImage->pIfIo, pIoCtx, pBlockWrite->abData, pImage->cbBlock);
+
+    if (   !(pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF)
+        && !(pImage->uOpenFlags & VD_OPEN_FLAGS_HONOR_ZEROES)
+        && !ASMMemIsAll8(pBlockWrite->abData, pImage->cbBlock, 0))
+    {
+        /* Zero blocks in a base image don't need a chunk. */
+        pBlockWrite->pChunk = NULL;
+    }
+    else
+    {
+        uint8_t abHash[RTSHA256_HASH_SIZE];
+
+        RTSha256(pBlockWrite->abData, pImage->cbBlock, abHash);
+        pBlockWrite->pChunk = ddiChunkLookup(pImage, abHash);
+        if (pBlockWrite->pChunk)
+        {
+            pImage->cDedupHits++;
+            pBlockWrite->pChunk->cRefs++;
+        }
+        else
+        {
+            pBlockWrite->pChunk = ddiChunkAlloc(pImage, abHash);
+            if (   !pBlockWrite->pChunk
+                && !pImage->cSlotsFree
+                && pImage->cSlotsUsed == pImage->cSlots)
+            {
+                /* Out of slots, reclaim the ones of replaced chunks and try again. */
+                rc = ddiChunksReclaim(pImage);
+                if (RT_FAILURE(rc))
+                {
+                    RTMemFree(pBlockWrite);
+                    if (rc == VERR_DISK_FULL)
+                        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                                       N_("DDI: No free chunk slot left in image '%s'"),
+                                       pImage->pszFilename);
+                    return rc;
+                }
+                pBlockWrite->pChunk = ddiChunkAlloc(pImage, abHash);
+            }
+            if (!pBlockWrite->pChunk)
+            {
+                RTMemFree(pBlockWrite);
+                return VERR_NO_MEMORY;
+            }
+            pImage->cDedupMisses++;
+
+            /* Write the data of the new chunk, the state machine does the rest. */
+            pBlockWrite->enmState = DDIBLOCKWRITESTATE_CHUNK_DATA;
+            rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                        ddiSlotOffset(pImage, pBlockWrite->pChunk->idxSlot),
+                                        pBlockWrite->abData, pImage->cbBlock, pIoCtx,
+                                        ddiAsyncBlockWriteUpdate, pBlockWrite);
+            if (RT_SUCCESS(rc))
+                rc = ddiAsyncBlockWriteUpdate(pImage, pIoCtx, pBlockWrite, rc);
+            else if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                ddiAsyncBlockWriteRollback(pImage, pBlockWrite);
+            return rc;
+        }
+    }
+
+    /* Metadata only update from here on, nothing to do if the block references the chunk already. */
+    if (pImage->paBlockMap[idxBlock] == (pBlockWrite->pChunk ? pBlockWrite->pChunk->idxSlot : 0))
+    {
+        ddiAsyncBlockWriteRollback(pImage, pBlockWrite);
+        return VINF_SUCCESS;
+    }
+
+    rc = ddiAsyncBlockWriteLink(pImage, pIoCtx, pBlockWrite);
+    if (RT_SUCCESS(rc))
+        rc = ddiAsyncBlockWriteUpdate(pImage, pIoCtx, pBlockWrite, rc);
+
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnCheckIfValid */
+static int ddiCheckIfValid(const char *pszFilename, PVDINTERFACE pVDIfsDisk,
+                           PVDINTERFACE pVDIfsImage, VDTYPE *penmType)
+{
+    LogFlowFunc(("pszFilename=\"%s\" pVDIfsDisk=%#p pVDIfsImage=%#p\n", pszFilename, pVDIfsDisk, pVDIfsImage));
+    PVDIOSTORAGE pStorage = NULL;
+    uint64_t cbFile;
+    int rc = VINF_SUCCESS;
+
+    /* Get I/O interface. */
+    PVDINTERFACEIOINT pIfIo = VDIfIoIntGet(pVDIfsImage);
+    AssertPtrReturn(pIfIo, VERR_INVALID_PARAMETER);
+
+    if (   !VALID_PTR(pszFilename)
+        || !*pszFilename)
+    {
+        rc = VERR_INVALID_PARAMETER;
+        goto out;
+    }
+
+    /*
+     * Open the file and read the header.
+     */
+    rc = vdIfIoIntFileOpen(pIfIo, pszFilename,
+                           VDOpenFlagsToFileOpenFlags(VD_OPEN_FLAGS_READONLY,
+                                                      false /* fCreate */),
+                           &pStorage);
+    if (RT_SUCCESS(rc))
+        rc = vdIfIoIntFileGetSize(pIfIo, pStorage, &cbFile);
+
+    if (   RT_SUCCESS(rc)
+        && cbFile >= DDI_HDR_SIZE)
+    {
+        DdiHeader Header;
+
+        rc = vdIfIoIntFileReadSync(pIfIo, pStorage, 0, &Header, sizeof(Header));
+        if (   RT_SUCCESS(rc)
+            && ddiHdrConvertToHostEndianess(&Header))
+        {
+            *penmType = VDTYPE_HDD;
+            rc = VINF_SUCCESS;
+        }
+        else
+            rc = VERR_VD_GEN_INVALID_HEADER;
+    }
+    else
+        rc = VERR_VD_GEN_INVALID_HEADER;
+
+    if (pStorage)
+        vdIfIoIntFileClose(pIfIo, pStorage);
+
+out:
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnOpen */
+static int ddiOpen(const char *pszFilename, unsigned uOpenFlags,
+                   PVDINTERFACE pVDIfsDisk, PVDINTERFACE pVDIfsImage,
+                   VDTYPE enmType, void **ppBackendData)
+{
+    LogFlowFunc(("pszFilename=\"%s\" uOpenFlags=%#x pVDIfsDisk=%#p pVDIfsImage=%#p ppBackendData=%#p\n", pszFilename, uOpenFlags, pVDIfsDisk, pVDIfsImage, ppBackendData));
+    int rc;
+    PDDIIMAGE pImage;
+
+    /* Check open flags. All valid flags are supported. */
+    if (uOpenFlags & ~VD_OPEN_FLAGS_MASK)
+    {
+        rc = VERR_INVALID_PARAMETER;
+        goto out;
+    }
+
+    /* Check remaining arguments. */
+    if (   !VALID_PTR(pszFilename)
+        || !*pszFilename)
+    {
+        rc = VERR_INVALID_PARAMETER;
+        goto out;
+    }
+
+
+    pImage = (PDDIIMAGE)RTMemAllocZ(sizeof(DDIIMAGE));
+    if (!pImage)
+    {
+        rc = VERR_NO_MEMORY;
+        goto out;
+    }
+    pImage->pszFilename = pszFilename;
+    pImage->pStorage = NULL;
+    pImage->pVDIfsDisk = pVDIfsDisk;
+    pImage->pVDIfsImage = pVDIfsImage;
+
+    rc = ddiOpenImage(pImage, uOpenFlags);
+    if (RT_SUCCESS(rc))
+        *ppBackendData = pImage;
+    else
+        RTMemFree(pImage);
+
+out:
+    LogFlowFunc(("returns %Rrc (pBackendData=%#p)\n", rc, *ppBackendData));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnCreate */
+static int ddiCreate(const char *pszFilename, uint64_t cbSize,
+                     unsigned uImageFlags, const char *pszComment,
+                     PCVDGEOMETRY pPCHSGeometry, PCVDGEOMETRY pLCHSGeometry,
+                     PCRTUUID pUuid, unsigned uOpenFlags,
+                     unsigned uPercentStart, unsigned uPercentSpan,
+                     PVDINTERFACE pVDIfsDisk, PVDINTERFACE pVDIfsImage,
+                     PVDINTERFACE pVDIfsOperation, void **ppBackendData)
+{
+    LogFlowFunc(("pszFilename=\"%s\" cbSize=%llu uImageFlags=%#x pszComment=\"%s\" pPCHSGeometry=%#p pLCHSGeometry=%#p Uuid=%RTuuid uOpenFlags=%#x uPercentStart=%u uPercentSpan=%u pVDIfsDisk=%#p pVDIfsImage=%#p pVDIfsOperation=%#p ppBackendData=%#p",
+                 pszFilename, cbSize, uImageFlags, pszComment, pPCHSGeometry, pLCHSGeometry, pUuid, uOpenFlags, uPercentStart, uPercentSpan, pVDIfsDisk, pVDIfsImage, pVDIfsOperation, ppBackendData));
+    int rc;
+    PDDIIMAGE pImage;
+
+    PFNVDPROGRESS pfnProgress = NULL;
+    void *pvUser = NULL;
+    PVDINTERFACEPROGRESS pIfProgress = VDIfProgressGet(pVDIfsOperation);
+    if (pIfProgress)
+    {
+        pfnProgress = pIfProgress->pfnProgress;
+        pvUser = pIfProgress->Core.pvUser;
+    }
+
+    /* Check open flags. All valid flags are supported. */
+    if (uOpenFlags & ~VD_OPEN_FLAGS_MASK)
+    {
+        rc = VERR_INVALID_PARAMETER;
+        goto out;
+    }
+
+    /* Check remaining arguments. */
+    if (   !VALID_PTR(pszFilename)
+        || !*pszFilename
+        || !VALID_PTR(pPCHSGeometry)
+        || !VALID_PTR(pLCHSGeometry))
+    {
+        rc = VERR_INVALID_PARAMETER;
+        goto out;
+    }
+
+    pImage = (PDDIIMAGE)RTMemAllocZ(sizeof(DDIIMAGE));
+    if (!pImage)
+    {
+        rc = VERR_NO_MEMORY;
+        goto out;
+    }
+    pImage->pszFilename = pszFilename;
+    pImage->pStorage = NULL;
+    pImage->pVDIfsDisk = pVDIfsDisk;
+    pImage->pVDIfsImage = pVDIfsImage;
+
+    rc = ddiCreateImage(pImage, cbSize, uImageFlags, pszComment,
+                        pPCHSGeometry, pLCHSGeometry, pUuid, uOpenFlags,
+                        pfnProgress, pvUser, uPercentStart, uPercentSpan);
+    if (RT_SUCCESS(rc))
+    {
+        /* So far the image is opened in read/write mode. Make sure the
+         * image is opened in read-only mode if the caller requested that. */
+        if (uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        {
+            ddiFreeImage(pImage, false);
+            rc = ddiOpenImage(pImage, uOpenFlags);
+            if (RT_FAILURE(rc))
+            {
+                RTMemFree(pImage);
+                goto out;
+            }
+        }
+        *ppBackendData = pImage;
+    }
+    else
+        RTMemFree(pImage);
+
+out:
+    LogFlowFunc(("returns %Rrc (pBackendData=%#p)\n", rc, *ppBackendData));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnRename */
+static int ddiRename(void *pBackendData, const char *pszFilename)
+{
+    LogFlowFunc(("pBackendData=%#p pszFilename=%#p\n", pBackendData, pszFilename));
+    int rc = VINF_SUCCESS;
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    /* Check arguments. */
+    if (   !pImage
+        || !pszFilename
+        || !*pszFilename)
+    {
+        rc = VERR_INVALID_PARAMETER;
+        goto out;
+    }
+
+    /* Close the image. */
+    rc = ddiFreeImage(pImage, false);
+    if (RT_FAILURE(rc))
+        goto out;
+
+    /* Rename the file. */
+    rc = vdIfIoIntFileMove(pImage->pIfIo, pImage->pszFilename, pszFilename, 0);
+    if (RT_FAILURE(rc))
+    {
+        /* The move failed, try to reopen the original image. */
+        int rc2 = ddiOpenImage(pImage, pImage->uOpenFlags);
+        if (RT_FAILURE(rc2))
+            rc = rc2;
+
+        goto out;
+    }
+
+    /* Update pImage with the new information. */
+    pImage->pszFilename = pszFilename;
+
+    /* Open the old image with new name. */
+    rc = ddiOpenImage(pImage, pImage->uOpenFlags);
+    if (RT_FAILURE(rc))
+        goto out;
+
+out:
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnClose */
+static int ddiClose(void *pBackendData, bool fDelete)
+{
+    LogFlowFunc(("pBackendData=%#p fDelete=%d\n", pBackendData, fDelete));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    rc = ddiFreeImage(pImage, fDelete);
+    RTMemFree(pImage);
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+static int ddiRead(void *pBackendData, uint64_t uOffset, size_t cbToRead,
+                   PVDIOCTX pIoCtx, size_t *pcbActuallyRead)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu pIoCtx=%#p cbToRead=%zu pcbActuallyRead=%#p\n",
+                 pBackendData, uOffset, pIoCtx, cbToRead, pcbActuallyRead));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    uint32_t idxBlock;
+    uint32_t offBlock;
+    uint32_t idxSlot;
+    int rc;
+
+    AssertPtr(pImage);
+    Assert(uOffset % 512 == 0);
+    Assert(cbToRead % 512 == 0);
+
+    if (!VALID_PTR(pIoCtx) || !cbToRead)
+    {
+        rc = VERR_INVALID_PARAMETER;
+        goto out;
+    }
+
+    if (   uOffset + cbToRead > pImage->cbSize
+        || cbToRead == 0)
+    {
+        rc = VERR_INVALID_PARAMETER;
+        goto out;
+    }
+
+    idxBlock = (uint32_t)(uOffset / pImage->cbBlock);
+    offBlock = (uint32_t)(uOffset % pImage->cbBlock);
+
+    /* Clip read size to remain in the block. */
+    cbToRead = RT_MIN(cbToRead, pImage->cbBlock - offBlock);
+
+    idxSlot = pImage->paBlockMap[idxBlock];
+    if (idxSlot)
+        rc = vdIfIoIntFileReadUser(pImage->pIfIo, pImage->pStorage,
+                                   ddiSlotOffset(pImage, idxSlot) + offBlock,
+                                   pIoCtx, cbToRead);
+    else
+        rc = VERR_VD_BLOCK_FREE;
+
+    if (   (   RT_SUCCESS(rc)
+            || rc == VERR_VD_BLOCK_FREE
+            || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+        && pcbActuallyRead)
+        *pcbActuallyRead = cbToRead;
+
+out:
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+static int ddiWrite(void *pBackendData, uint64_t uOffset, size_t cbToWrite,
+                    PVDIOCTX pIoCtx, size_t *pcbWriteProcess, size_t *pcbPreRead,
+                    size_t *pcbPostRead, unsigned fWrite)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu pIoCtx=%#p cbToWrite=%zu pcbWriteProcess=%#p pcbPreRead=%#p pcbPostRead=%#p\n",
+                 pBackendData, uOffset, pIoCtx, cbToWrite, pcbWriteProcess, pcbPreRead, pcbPostRead));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    uint32_t idxBlock;
+    uint32_t offBlock;
+    int rc = VINF_SUCCESS;
+
+    AssertPtr(pImage);
+    Assert(!(uOffset % 512));
+    Assert(!(cbToWrite % 512));
+
+    if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+    {
+        rc = VERR_VD_IMAGE_READ_ONLY;
+        goto out;
+    }
+
+    if (!VALID_PTR(pIoCtx) || !cbToWrite)
+    {
+        rc = VERR_INVALID_PARAMETER;
+        goto out;
+    }
+
+    /* The last block might exceed the nominal size of the image. */
+    if (   uOffset + cbToWrite > (uint64_t)pImage->cBlocks * pImage->cbBlock
+        || uOffset >= pImage->cbSize
+        || cbToWrite == 0)
+    {
+        rc = VERR_INVALID_PARAMETER;
+        goto out;
+    }
+
+    idxBlock = (uint32_t)(uOffset / pImage->cbBlock);
+    offBlock = (uint32_t)(uOffset % pImage->cbBlock);
+
+    /* Clip write size to remain in the block. */
+    cbToWrite = RT_MIN(cbToWrite, pImage->cbBlock - offBlock);
+    Assert(!(cbToWrite % 512));
+
+    /*
+     * Chunks are shared and never modified in place, so every write must
+     * provide a complete block. Let the upper layer read the remaining data
+     * of partial writes, even if the block is allocated.
+     */
+    if (   cbToWrite == pImage->cbBlock
+        && (   pImage->paBlockMap[idxBlock]
+            || !(fWrite & VD_WRITE_NO_ALLOC)))
+    {
+        rc = ddiBlockWrite(pImage, pIoCtx, idxBlock);
+        *pcbPreRead = 0;
+        *pcbPostRead = 0;
+    }
+    else
+    {
+        *pcbPreRead = offBlock;
+        *pcbPostRead = pImage->cbBlock - cbToWrite - *pcbPreRead;
+        rc = VERR_VD_BLOCK_FREE;
+    }
+
+    if (pcbWriteProcess)
+        *pcbWriteProcess = cbToWrite;
+
+out:
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+static int ddiFlush(void *pBackendData, PVDIOCTX pIoCtx)
+{
+    LogFlowFunc(("pBackendData=%#p\n", pBackendData));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    Assert(pImage);
+
+    if (VALID_PTR(pIoCtx))
+        rc = ddiFlushImageAsync(pImage, pIoCtx);
+    else
+        rc = VERR_INVALID_PARAMETER;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnGetVersion */
+static unsigned ddiGetVersion(void *pBackendData)
+{
+    LogFlowFunc(("pBackendData=%#p\n", pBackendData));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+        return DDI_VERSION;
+    else
+        return 0;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnGetSectorSize */
+static uint32_t ddiGetSectorSize(void *pBackendData)
+{
+    LogFlowFunc(("pBackendData=%#p\n", pBackendData));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    uint32_t cb = 0;
+
+    AssertPtr(pImage);
+
+    if (pImage && pImage->pStorage)
+        cb = 512;
+
+    LogFlowFunc(("returns %u\n", cb));
+    return cb;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnGetSize */
+static uint64_t ddiGetSize(void *pBackendData)
+{
+    LogFlowFunc(("pBackendData=%#p\n", pBackendData));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    uint64_t cb = 0;
+
+    AssertPtr(pImage);
+
+    if (pImage && pImage->pStorage)
+        cb = pImage->cbSize;
+
+    LogFlowFunc(("returns %llu\n", cb));
+    return cb;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnGetFileSize */
+static uint64_t ddiGetFileSize(void *pBackendData)
+{
+    LogFlowFunc(("pBackendData=%#p\n", pBackendData));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    uint64_t cb = 0;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+    {
+        uint64_t cbFile;
+        if (pImage->pStorage)
+        {
+            int rc = vdIfIoIntFileGetSize(pImage->pIfIo, pImage->pStorage, &cbFile);
+            if (RT_SUCCESS(rc))
+                cb += cbFile;
+        }
+    }
+
+    LogFlowFunc(("returns %lld\n", cb));
+    return cb;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnGetPCHSGeometry */
+static int ddiGetPCHSGeometry(void *pBackendData,
+                              PVDGEOMETRY pPCHSGeometry)
+{
+    LogFlowFunc(("pBackendData=%#p pPCHSGeometry=%#p\n", pBackendData, pPCHSGeometry));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+    {
+        if (pImage->PCHSGeometry.cCylinders)
+        {
+            *pPCHSGeometry = pImage->PCHSGeometry;
+            rc = VINF_SUCCESS;
+        }
+        else
+            rc = VERR_VD_GEOMETRY_NOT_SET;
+    }
+    else
+        rc = VERR_VD_NOT_OPENED;
+
+    LogFlowFunc(("returns %Rrc (PCHS=%u/%u/%u)\n", rc, pPCHSGeometry->cCylinders, pPCHSGeometry->cHeads, pPCHSGeometry->cSectors));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnSetPCHSGeometry */
+static int ddiSetPCHSGeometry(void *pBackendData,
+                              PCVDGEOMETRY pPCHSGeometry)
+{
+    LogFlowFunc(("pBackendData=%#p pPCHSGeometry=%#p PCHS=%u/%u/%u\n", pBackendData, pPCHSGeometry, pPCHSGeometry->cCylinders, pPCHSGeometry->cHeads, pPCHSGeometry->cSectors));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+    {
+        if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        {
+            rc = VERR_VD_IMAGE_READ_ONLY;
+            goto out;
+        }
+
+        pImage->PCHSGeometry = *pPCHSGeometry;
+        rc = VINF_SUCCESS;
+    }
+    else
+        rc = VERR_VD_NOT_OPENED;
+
+out:
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnGetLCHSGeometry */
+static int ddiGetLCHSGeometry(void *pBackendData,
+                              PVDGEOMETRY pLCHSGeometry)
+{
+    LogFlowFunc(("pBackendData=%#p pLCHSGeometry=%#p\n", pBackendData, pLCHSGeometry));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+    {
+        if (pImage->LCHSGeometry.cCylinders)
+        {
+            *pLCHSGeometry = pImage->LCHSGeometry;
+            rc = VINF_SUCCESS;
+        }
+        else
+            rc = VERR_VD_GEOMETRY_NOT_SET;
+    }
+    else
+        rc = VERR_VD_NOT_OPENED;
+
+    LogFlowFunc(("returns %Rrc (LCHS=%u/%u/%u)\n", rc, pLCHSGeometry->cCylinders, pLCHSGeometry->cHeads, pLCHSGeometry->cSectors));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnSetLCHSGeometry */
+static int ddiSetLCHSGeometry(void *pBackendData,
+                              PCVDGEOMETRY pLCHSGeometry)
+{
+    LogFlowFunc(("pBackendData=%#p pLCHSGeometry=%#p LCHS=%u/%u/%u\n", pBackendData, pLCHSGeometry, pLCHSGeometry->cCylinders, pLCHSGeometry->cHeads, pLCHSGeometry->cSectors));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+    {
+        if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        {
+            rc = VERR_VD_IMAGE_READ_ONLY;
+            goto out;
+        }
+
+        pImage->LCHSGeometry = *pLCHSGeometry;
+        rc = VINF_SUCCESS;
+    }
+    else
+        rc = VERR_VD_NOT_OPENED;
+
+out:
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnGetImageFlags */
+static unsigned ddiGetImageFlags(void *pBackendData)
+{
+    LogFlowFunc(("pBackendData=%#p\n", pBackendData));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    unsigned uImageFlags;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+        uImageFlags = pImage->uImageFlags;
+    else
+        uImageFlags = 0;
+
+    LogFlowFunc(("returns %#x\n", uImageFlags));
+    return uImageFlags;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnGetOpenFlags */
+static unsigned ddiGetOpenFlags(void *pBackendData)
+{
+    LogFlowFunc(("pBackendData=%#p\n", pBackendData));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    unsigned uOpenFlags;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+        uOpenFlags = pImage->uOpenFlags;
+    else
+        uOpenFlags = 0;
+
+    LogFlowFunc(("returns %#x\n", uOpenFlags));
+    return uOpenFlags;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnSetOpenFlags */
+static int ddiSetOpenFlags(void *pBackendData, unsigned uOpenFlags)
+{
+    LogFlowFunc(("pBackendData=%#p\n uOpenFlags=%#x", pBackendData, uOpenFlags));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    /* Image must be opened and the new flags must be valid. */
+    if (!pImage || (uOpenFlags & ~(  VD_OPEN_FLAGS_READONLY | VD_OPEN_FLAGS_INFO
+                                   | VD_OPEN_FLAGS_ASYNC_IO | VD_OPEN_FLAGS_SKIP_CONSISTENCY_CHECKS)))
+    {
+        rc = VERR_INVALID_PARAMETER;
+        goto out;
+    }
+
+    /* Implement this operation via reopening the image. */
+    rc = ddiFreeImage(pImage, false);
+    if (RT_FAILURE(rc))
+        goto out;
+    rc = ddiOpenImage(pImage, uOpenFlags);
+
+out:
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnGetComment */
+static int ddiGetComment(void *pBackendData, char *pszComment,
+                          size_t cbComment)
+{
+    LogFlowFunc(("pBackendData=%#p pszComment=%#p cbComment=%zu\n", pBackendData, pszComment, cbComment));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+        rc = VERR_NOT_SUPPORTED;
+    else
+        rc = VERR_VD_NOT_OPENED;
+
+    LogFlowFunc(("returns %Rrc comment='%s'\n", rc, pszComment));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnSetComment */
+static int ddiSetComment(void *pBackendData, const char *pszComment)
+{
+    LogFlowFunc(("pBackendData=%#p pszComment=\"%s\"\n", pBackendData, pszComment));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+    {
+        if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+            rc = VERR_VD_IMAGE_READ_ONLY;
+        else
+            rc = VERR_NOT_SUPPORTED;
+    }
+    else
+        rc = VERR_VD_NOT_OPENED;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/**
+ * Internal. Updates one of the UUIDs stored in the header.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   pUuidDst  Where to store the UUID in the image instance data.
+ * @param   pUuid     The new UUID.
+ */
+static int ddiUuidSet(PDDIIMAGE pImage, PRTUUID pUuidDst, PCRTUUID pUuid)
+{
+    int rc;
+
+    if (pImage)
+    {
+        if (!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
+        {
+            *pUuidDst = *pUuid;
+            rc = ddiFlushImage(pImage);
+        }
+        else
+            rc = VERR_VD_IMAGE_READ_ONLY;
+    }
+    else
+        rc = VERR_VD_NOT_OPENED;
+
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnGetUuid */
+static int ddiGetUuid(void *pBackendData, PRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p pUuid=%#p\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+    {
+        *pUuid = pImage->ImageUuid;
+        rc = VINF_SUCCESS;
+    }
+    else
+        rc = VERR_VD_NOT_OPENED;
+
+    LogFlowFunc(("returns %Rrc (%RTuuid)\n", rc, pUuid));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnSetUuid */
+static int ddiSetUuid(void *pBackendData, PCRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p Uuid=%RTuuid\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    AssertPtr(pImage);
+
+    rc = ddiUuidSet(pImage, pImage ? &pImage->ImageUuid : NULL, pUuid);
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnGetModificationUuid */
+static int ddiGetModificationUuid(void *pBackendData, PRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p pUuid=%#p\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+    {
+        *pUuid = pImage->ModificationUuid;
+        rc = VINF_SUCCESS;
+    }
+    else
+        rc = VERR_VD_NOT_OPENED;
+
+    LogFlowFunc(("returns %Rrc (%RTuuid)\n", rc, pUuid));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnSetModificationUuid */
+static int ddiSetModificationUuid(void *pBackendData, PCRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p Uuid=%RTuuid\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    AssertPtr(pImage);
+
+    rc = ddiUuidSet(pImage, pImage ? &pImage->ModificationUuid : NULL, pUuid);
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnGetParentUuid */
+static int ddiGetParentUuid(void *pBackendData, PRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p pUuid=%#p\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+    {
+        *pUuid = pImage->ParentUuid;
+        rc = VINF_SUCCESS;
+    }
+    else
+        rc = VERR_VD_NOT_OPENED;
+
+    LogFlowFunc(("returns %Rrc (%RTuuid)\n", rc, pUuid));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnSetParentUuid */
+static int ddiSetParentUuid(void *pBackendData, PCRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p Uuid=%RTuuid\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    AssertPtr(pImage);
+
+    rc = ddiUuidSet(pImage, pImage ? &pImage->ParentUuid : NULL, pUuid);
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnGetParentModificationUuid */
+static int ddiGetParentModificationUuid(void *pBackendData, PRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p pUuid=%#p\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+    {
+        *pUuid = pImage->ParentModificationUuid;
+        rc = VINF_SUCCESS;
+    }
+    else
+        rc = VERR_VD_NOT_OPENED;
+
+    LogFlowFunc(("returns %Rrc (%RTuuid)\n", rc, pUuid));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnSetParentModificationUuid */
+static int ddiSetParentModificationUuid(void *pBackendData, PCRTUUID pUuid)
+{
+    LogFlowFunc(("pBackendData=%#p Uuid=%RTuuid\n", pBackendData, pUuid));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc;
+
+    AssertPtr(pImage);
+
+    rc = ddiUuidSet(pImage, pImage ? &pImage->ParentModificationUuid : NULL, pUuid);
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnDump */
+static void ddiDump(void *pBackendData)
+{
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+
+    AssertPtr(pImage);
+    if (pImage)
+    {
+        uint32_t cBlocksAllocated = 0;
+        uint32_t cChunks = 0;
+
+        for (uint32_t i = 0; i < pImage->cBlocks; i++)
+            if (pImage->paBlockMap[i])
+                cBlocksAllocated++;
+        for (uint32_t i = 1; i <= pImage->cSlotsUsed; i++)
+            if (pImage->papChunks[i] && pImage->papChunks[i]->cRefs)
+                cChunks++;
+
+        vdIfErrorMessage(pImage->pIfError, "Header: Geometry PCHS=%u/%u/%u LCHS=%u/%u/%u cbSector=%llu\n",
+                         pImage->PCHSGeometry.cCylinders, pImage->PCHSGeometry.cHeads, pImage->PCHSGeometry.cSectors,
+                         pImage->LCHSGeometry.cCylinders, pImage->LCHSGeometry.cHeads, pImage->LCHSGeometry.cSectors,
+                         pImage->cbSize / 512);
+        vdIfErrorMessage(pImage->pIfError, "Blocks: cbBlock=%u cBlocks=%u cBlocksAllocated=%u cChunks=%u cSlots=%u cSlotsUsed=%u\n",
+                         pImage->cbBlock, pImage->cBlocks, cBlocksAllocated, cChunks,
+                         pImage->cSlots, pImage->cSlotsUsed);
+        vdIfErrorMessage(pImage->pIfError, "Dedup: cHits=%llu cMisses=%llu\n",
+                         pImage->cDedupHits, pImage->cDedupMisses);
+    }
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnQueryAllocatedRanges */
+static int ddiQueryAllocatedRanges(void *pBackendData, uint64_t uOffset,
+                                   uint64_t cbRange, PRTRANGE paRanges,
+                                   unsigned cRanges, unsigned *pcRanges)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu cbRange=%llu paRanges=%#p cRanges=%u pcRanges=%#p\n",
+                 pBackendData, uOffset, cbRange, paRanges, cRanges, pcRanges));
+    PDDIIMAGE pImage = (PDDIIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+    unsigned cRangesUsed = 0;
+
+    AssertPtr(pImage);
+
+    uint64_t offEnd = RT_MIN(uOffset + cbRange, pImage->cbSize);
+    uint64_t offCur = uOffset;
+
+    while (offCur < offEnd)
+    {
+        uint32_t idxBlock = (uint32_t)(offCur / pImage->cbBlock);
+        uint64_t offBlockEnd = RT_MIN(((uint64_t)idxBlock + 1) * pImage->cbBlock, offEnd);
+
+        if (   pImage->paBlockMap[idxBlock]
+            && !vdPluginRangeAppend(paRanges, cRanges, &cRangesUsed,
+                                    offCur, (size_t)(offBlockEnd - offCur)))
+        {
+            rc = VERR_BUFFER_OVERFLOW;
+            break;
+        }
+
+        offCur = offBlockEnd;
+    }
+
+    *pcRanges = cRangesUsed;
+
+    LogFlowFunc(("returns %Rrc (cRanges=%u)\n", rc, cRangesUsed));
+    return rc;
+}
+
+VBOXHDDBACKEND g_DdiBackend =
+{
+    /* pszBackendName */
+    "DDI",
+    /* cbSize */
+    sizeof(VBOXHDDBACKEND),
+    /* uBackendCaps */
+    VD_CAP_FILE | VD_CAP_VFS | VD_CAP_CREATE_DYNAMIC | VD_CAP_DIFF | VD_CAP_ASYNC,
+    /* paFileExtensions */
+    s_aDdiFileExtensions,
+    /* paConfigInfo */
+    NULL,
+    /* hPlugin */
+    NIL_RTLDRMOD,
+    /* pfnCheckIfValid */
+    ddiCheckIfValid,
+    /* pfnOpen */
+    ddiOpen,
+    /* pfnCreate */
+    ddiCreate,
+    /* pfnRename */
+    ddiRename,
+    /* pfnClose */
+    ddiClose,
+    /* pfnRead */
+    ddiRead,
+    /* pfnWrite */
+    ddiWrite,
+    /* pfnFlush */
+    ddiFlush,
+    /* pfnDiscard */
+    NULL,
+    /* pfnGetVersion */
+    ddiGetVersion,
+    /* pfnGetSectorSize */
+    ddiGetSectorSize,
+    /* pfnGetSize */
+    ddiGetSize,
+    /* pfnGetFileSize */
+    ddiGetFileSize,
+    /* pfnGetPCHSGeometry */
+    ddiGetPCHSGeometry,
+    /* pfnSetPCHSGeometry */
+    ddiSetPCHSGeometry,
+    /* pfnGetLCHSGeometry */
+    ddiGetLCHSGeometry,
+    /* pfnSetLCHSGeometry */
+    ddiSetLCHSGeometry,
+    /* pfnGetImageFlags */
+    ddiGetImageFlags,
+    /* pfnGetOpenFlags */
+    ddiGetOpenFlags,
+    /* pfnSetOpenFlags */
+    ddiSetOpenFlags,
+    /* pfnGetComment */
+    ddiGetComment,
+    /* pfnSetComment */
+    ddiSetComment,
+    /* pfnGetUuid */
+    ddiGetUuid,
+    /* pfnSetUuid */
+    ddiSetUuid,
+    /* pfnGetModificationUuid */
+    ddiGetModificationUuid,
+    /* pfnSetModificationUuid */
+    ddiSetModificationUuid,
+    /* pfnGetParentUuid */
+    ddiGetParentUuid,
+    /* pfnSetParentUuid */
+    ddiSetParentUuid,
+    /* pfnGetParentModificationUuid */
+    ddiGetParentModificationUuid,
+    /* pfnSetParentModificationUuid */
+    ddiSetParentModificationUuid,
+    /* pfnDump */
+    ddiDump,
+    /* pfnGetTimeStamp */
+    NULL,
+    /* pfnGetParentTimeStamp */
+    NULL,
+    /* pfnSetParentTimeStamp */
+    NULL,
+    /* pfnGetParentFilename */
+    NULL,
+    /* pfnSetParentFilename */
+    NULL,
+    /* pfnComposeLocation */
+    genericFileComposeLocation,
+    /* pfnComposeName */
+    genericFileComposeName,
+    /* pfnCompact */
+    NULL,
+    /* pfnResize */
+    NULL,
+    /* pfnRepair */
+    NULL,
+    /* pfnQueryAllocatedRanges */
+    ddiQueryAllocatedRanges,
+    /* pfnDefragment */
+    NULL
+};
@@ -2565,6 +2565,10 @@ VBOXHDDBACKEND g_DmgBackend =
     /* pfnResize */
     NULL,
     /* pfnRepair */
+    NULL,
+    /* pfnQueryAllocatedRanges */
+    NULL,
+    /* pfnDefragment */
     NULL
 };
 
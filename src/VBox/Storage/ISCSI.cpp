@@ -106,10 +106,16 @@ typedef enum SCSIDEVTYPE
 /** Mask to extract the CmdQue bit out of the seventh byte of the INQUIRY response. */
 #define SCSI_INQUIRY_CMDQUE_MASK 0x02
 
-/** Maximum PDU payload size we can handle in one piece. Greater or equal than
- * s_iscsiConfigDefaultWriteSplit. */
+/** Maximum PDU payload size we can handle in one piece. Writes larger than this
+ * are transferred with Data-Out PDUs on request of the target (R2T). */
 #define ISCSI_DATA_LENGTH_MAX _256K
 
+/** Maximum amount of data we offer to transfer for a single R2T. */
+#define ISCSI_BURST_LENGTH_MAX _1M
+
+/** Maximum number of outstanding R2Ts per task we offer to the target. */
+#define ISCSI_OUTSTANDING_R2T_MAX 8
+
 /** Maximum PDU size we can handle in one piece. */
 #define ISCSI_RECV_PDU_BUFFER_SIZE (ISCSI_DATA_LENGTH_MAX + ISCSI_BHS_SIZE)
 
@@ -224,7 +230,7 @@ typedef enum ISCSIOPCODE
 #define ISCSI_SG_SEGMENTS_MAX 4
 
 /** Number of entries in the command table. */
-#define ISCSI_CMD_WAITING_ENTRIES 32
+#define ISCSI_CMD_WAITING_ENTRIES 128
 
 /**
  * iSCSI login status class. */
@@ -464,6 +470,11 @@ typedef struct ISCSIPDUTX
     size_t      cbSgLeft;
     /** The iSCSI command this PDU belongs to. */
     PISCSICMD   pIScsiCmd;
+    /** Command the target completed while this Data-Out PDU was partially sent.
+     * It is completed once the PDU is on the wire as the PDU refers to its data. */
+    PISCSICMD   pIScsiCmdDone;
+    /** Status code to complete pIScsiCmdDone with. */
+    int         rcCmdDone;
     /** Number of segments in the request segments array. */
     unsigned    cISCSIReq;
     /** The request segments - variable in size. */
@@ -530,6 +541,14 @@ typedef struct ISCSIIMAGE
     uint32_t            cbSendDataLength;
     /** Negotiated maximum data length when receiving from target. */
     uint32_t            cbRecvDataLength;
+    /** Negotiated maximum amount of unsolicited data for a command (FirstBurstLength). */
+    uint32_t            cbFirstBurstLength;
+    /** Negotiated maximum amount of data solicited by a single R2T (MaxBurstLength). */
+    uint32_t            cbMaxBurstLength;
+    /** Negotiated maximum number of outstanding R2Ts per task. */
+    uint32_t            cMaxOutstandingR2T;
+    /** Flag whether the target accepts immediate data. */
+    bool                fImmediateData;
 
     /** Current state of the connection/session. */
     ISCSISTATE          state;
@@ -599,6 +618,10 @@ typedef struct ISCSIIMAGE
     PISCSIPDUTX         pIScsiPDUTxTail;
     /** PDU we are currently transmitting. */
     PISCSIPDUTX         pIScsiPDUTxCur;
+    /** List of Data-Out PDUs answering R2Ts, sent before any new command PDU. */
+    PISCSIPDUTX         pIScsiPDUTxDataHead;
+    /** Tail of Data-Out PDUs waiting to get transmitted. */
+    PISCSIPDUTX         pIScsiPDUTxDataTail;
     /** Number of commands waiting for an answer from the target.
      * Used for timeout handling for poll.
      */
@@ -625,7 +648,7 @@ static const char *s_iscsiConfigDefaultLUN = "0";
 static const char *s_iscsiConfigDefaultTimeout = "10000";
 
 /** Default write split value, less or equal to ISCSI_DATA_LENGTH_MAX. */
-static const char *s_iscsiConfigDefaultWriteSplit = "262144";
+static const char *s_iscsiConfigDefaultWriteSplit = "1048576";
 
 /** Default host IP stack. */
 static const char *s_iscsiConfigDefaultHostIPStack = "1";
@@ -1228,10 +1251,25 @@ static int iscsiAttach(void *pvUser)
     PISCSIIMAGE pImage = (PISCSIIMAGE)pvUser;
 
     bool fParameterNeg = true;;
-    pImage->cbRecvDataLength = ISCSI_DATA_LENGTH_MAX;
-    pImage->cbSendDataLength = RT_MIN(ISCSI_DATA_LENGTH_MAX, pImage->cbWriteSplit);
+    pImage->cbRecvDataLength   = ISCSI_DATA_LENGTH_MAX;
+    pImage->cbSendDataLength   = ISCSI_DATA_LENGTH_MAX;
+    pImage->cbFirstBurstLength = ISCSI_DATA_LENGTH_MAX;
+    pImage->cbMaxBurstLength   = ISCSI_BURST_LENGTH_MAX;
+    pImage->cMaxOutstandingR2T = ISCSI_OUTSTANDING_R2T_MAX;
+    pImage->fImmediateData     = true;
     char szMaxDataLength[16];
     RTStrPrintf(szMaxDataLength, sizeof(szMaxDataLength), "%u", ISCSI_DATA_LENGTH_MAX);
+    char szMaxBurstLength[16];
+    RTStrPrintf(szMaxBurstLength, sizeof(szMaxBurstLength), "%u", ISCSI_BURST_LENGTH_MAX);
+    char szMaxOutstandingR2T[16];
+    RTStrPrintf(szMaxOutstandingR2T, sizeof(szMaxOutstandingR2T), "%u", ISCSI_OUTSTANDING_R2T_MAX);
+    /** @todo Multiple connections per session (MC/S). Every connection needs its
+     * own login with the TSIH of the session, commands must be spread over the
+     * connections with the CmdSN window shared while all PDUs of a task stay on
+     * the connection it was issued on (connection allegiance), and a failed
+     * connection requires task reassignment (ErrorRecoveryLevel 2) instead of the
+     * plain reattach done now. This means splitting ISCSIIMAGE into session and
+     * connection state, the connection count stays at 1 until then. */
     ISCSIPARAMETER aParameterNeg[] =
     {
         { "HeaderDigest", "None", 0 },
@@ -1240,14 +1278,14 @@ static int iscsiAttach(void *pvUser)
         { "InitialR2T", "No", 0 },
         { "ImmediateData", "Yes", 0 },
         { "MaxRecvDataSegmentLength", szMaxDataLength, 0 },
-        { "MaxBurstLength", szMaxDataLength, 0 },
+        { "MaxBurstLength", szMaxBurstLength, 0 },
         { "FirstBurstLength", szMaxDataLength, 0 },
         { "DefaultTime2Wait", "0", 0 },
         { "DefaultTime2Retain", "60", 0 },
         { "DataPDUInOrder", "Yes", 0 },
         { "DataSequenceInOrder", "Yes", 0 },
         { "ErrorRecoveryLevel", "0", 0 },
-        { "MaxOutstandingR2T", "1", 0 }
+        { "MaxOutstandingR2T", szMaxOutstandingR2T, 0 }
     };
 
     LogFlowFunc(("entering\n"));
@@ -2402,14 +2440,29 @@ static int iscsiSendPDUAsync(PISCSIIMAGE pImage)
          */
         if (!pImage->pIScsiPDUTxCur)
         {
-            if (   !pImage->pIScsiPDUTxHead
-                || serial_number_greater(pImage->pIScsiPDUTxHead->CmdSN, pImage->MaxCmdSN))
-                break;
+            if (pImage->pIScsiPDUTxDataHead)
+            {
+                /*
+                 * Data-Out PDUs belong to commands the target received already
+                 * and are not subject to the command window. Send them first
+                 * to get the outstanding commands completed.
+                 */
+                pImage->pIScsiPDUTxCur = pImage->pIScsiPDUTxDataHead;
+                pImage->pIScsiPDUTxDataHead = pImage->pIScsiPDUTxCur->pNext;
+                if (!pImage->pIScsiPDUTxDataHead)
+                    pImage->pIScsiPDUTxDataTail = NULL;
+            }
+            else
+            {
+                if (   !pImage->pIScsiPDUTxHead
+                    || serial_number_greater(pImage->pIScsiPDUTxHead->CmdSN, pImage->MaxCmdSN))
+                    break;
 
-            pImage->pIScsiPDUTxCur = pImage->pIScsiPDUTxHead;
-            pImage->pIScsiPDUTxHead = pImage->pIScsiPDUTxCur->pNext;
-            if (!pImage->pIScsiPDUTxHead)
-                pImage->pIScsiPDUTxTail = NULL;
+                pImage->pIScsiPDUTxCur = pImage->pIScsiPDUTxHead;
+                pImage->pIScsiPDUTxHead = pImage->pIScsiPDUTxCur->pNext;
+                if (!pImage->pIScsiPDUTxHead)
+                    pImage->pIScsiPDUTxTail = NULL;
+            }
         }
 
         /* Send as much as we can. */
@@ -2428,6 +2481,9 @@ static int iscsiSendPDUAsync(PISCSIIMAGE pImage)
                     LogFlow(("Sent complete PDU, placing on waiting list\n"));
                     iscsiCmdInsert(pImage, pImage->pIScsiPDUTxCur->pIScsiCmd);
                 }
+                if (pImage->pIScsiPDUTxCur->pIScsiCmdDone)
+                    iscsiCmdComplete(pImage, pImage->pIScsiPDUTxCur->pIScsiCmdDone,
+                                     pImage->pIScsiPDUTxCur->rcCmdDone);
                 RTMemFree(pImage->pIScsiPDUTxCur);
                 pImage->pIScsiPDUTxCur = NULL;
             }
@@ -2671,8 +2727,16 @@ static int iscsiValidatePDU(PISCSIRES paRes, uint32_t cnRes)
                 ||  (RT_N2H_U32(pcrgResBHS[4]) != ISCSI_TASK_TAG_RSVD))
                 return VERR_PARSE_ERROR;
             break;
-        case ISCSIOP_SCSI_TASKMGMT_RES:
         case ISCSIOP_R2T:
+            /* R2Ts must have the final bit set, may not carry any data and must
+             * refer to a task of ours soliciting a non empty range. */
+            if (    ((hw0 & ISCSI_FINAL_BIT) == 0)
+                ||  (RT_N2H_U32(pcrgResBHS[1]) != 0)
+                ||  (RT_N2H_U32(pcrgResBHS[4]) == ISCSI_TASK_TAG_RSVD)
+                ||  (RT_N2H_U32(pcrgResBHS[11]) == 0))
+                return VERR_PARSE_ERROR;
+            break;
+        case ISCSIOP_SCSI_TASKMGMT_RES:
         case ISCSIOP_REJECT:
         default:
             /* Do some logging, ignore PDU. */
@@ -2688,6 +2752,167 @@ static int iscsiValidatePDU(PISCSIRES paRes, uint32_t cnRes)
 }
 
 
+/**
+ * Appends a range of the initiator to target data of a SCSI request to the
+ * segment array of a PDU, including any padding required.
+ *
+ * @returns Number of bytes added to the PDU, including padding.
+ * @param   pImage      The iSCSI connection state to be used.
+ * @param   pIScsiPDU   The PDU to add the data to.
+ * @param   cSegsMax    Number of entries in the segment array of the PDU.
+ * @param   pScsiReq    The SCSI request holding the data.
+ * @param   offData     Offset into the initiator to target data to start at.
+ * @param   cbData      Number of bytes to add.
+ */
+static size_t iscsiPDUTxAddI2TData(PISCSIIMAGE pImage, PISCSIPDUTX pIScsiPDU, unsigned cSegsMax,
+                                   PSCSIREQ pScsiReq, size_t offData, size_t cbData)
+{
+    RTSGBUF SgBuf;
+    unsigned cSegs = cSegsMax - pIScsiPDU->cISCSIReq - 1; /* Reserve one for the padding. */
+
+    Assert(pIScsiPDU->cISCSIReq + 1 < cSegsMax);
+
+    RTSgBufInit(&SgBuf, pScsiReq->paI2TSegs, pScsiReq->cI2TSegs);
+    RTSgBufAdvance(&SgBuf, offData);
+    size_t cbSegs = RTSgBufSegArrayCreate(&SgBuf, &pIScsiPDU->aISCSIReq[pIScsiPDU->cISCSIReq], &cSegs, cbData);
+    Assert(cbSegs == cbData);
+    pIScsiPDU->cISCSIReq += cSegs;
+
+    /* Add padding if necessary. */
+    if (cbSegs & 3)
+    {
+        pIScsiPDU->aISCSIReq[pIScsiPDU->cISCSIReq].pvSeg = &pImage->aPadding[0];
+        pIScsiPDU->aISCSIReq[pIScsiPDU->cISCSIReq].cbSeg = 4 - (cbSegs & 3);
+        cbSegs += pIScsiPDU->aISCSIReq[pIScsiPDU->cISCSIReq].cbSeg;
+        pIScsiPDU->cISCSIReq++;
+    }
+
+    return cbSegs;
+}
+
+/**
+ * Prepares the Data-Out PDUs answering an R2T for the given command
+ * and adds them to the Data-Out list.
+ *
+ * @returns VBox status code.
+ * @param   pImage      The iSCSI connection state to be used.
+ * @param   pIScsiCmd   The command the target requests data for.
+ * @param   paResBHS    The BHS of the R2T PDU.
+ */
+static int iscsiPDUTxPrepareDataOut(PISCSIIMAGE pImage, PISCSICMD pIScsiCmd, const uint32_t *paResBHS)
+{
+    PSCSIREQ pScsiReq = pIScsiCmd->CmdType.ScsiReq.pScsiReq;
+    uint32_t offData  = RT_N2H_U32(paResBHS[10]);
+    uint32_t cbData   = RT_N2H_U32(paResBHS[11]);
+    uint32_t DataSN   = 0;
+    unsigned cSegsMax = pScsiReq->cI2TSegs + 2; /* BHS and padding. */
+
+    LogFlowFunc(("pImage=%#p pIScsiCmd=%#p offData=%u cbData=%u\n", pImage, pIScsiCmd, offData, cbData));
+
+    if (    pScsiReq->enmXfer != SCSIXFER_TO_TARGET
+        ||  offData >= pScsiReq->cbI2TData
+        ||  cbData > pScsiReq->cbI2TData - offData
+        ||  cbData > pImage->cbMaxBurstLength)
+        return VERR_PARSE_ERROR;
+
+    while (cbData)
+    {
+        uint32_t cbThisPDU = RT_MIN(cbData, pImage->cbSendDataLength);
+        PISCSIPDUTX pIScsiPDU = (PISCSIPDUTX)RTMemAllocZ(RT_OFFSETOF(ISCSIPDUTX, aISCSIReq[cSegsMax]));
+        if (!pIScsiPDU)
+            return VERR_NO_MEMORY;
+
+        uint32_t *paReqBHS = pIScsiPDU->aBHS;
+        paReqBHS[0] = RT_H2N_U32(ISCSIOP_SCSI_DATA_OUT | (cbThisPDU == cbData ? ISCSI_FINAL_BIT : 0));
+        paReqBHS[1] = RT_H2N_U32(cbThisPDU); /* TotalAHSLength=0 */
+        paReqBHS[2] = RT_H2N_U32(pImage->LUN >> 32);
+        paReqBHS[3] = RT_H2N_U32(pImage->LUN & 0xffffffff);
+        paReqBHS[4] = pIScsiCmd->Itt;
+        paReqBHS[5] = paResBHS[5];   /* copy TTT from R2T */
+        paReqBHS[6] = 0;             /* reserved */
+        paReqBHS[7] = RT_H2N_U32(pImage->ExpStatSN);
+        paReqBHS[8] = 0;             /* reserved */
+        paReqBHS[9] = RT_H2N_U32(DataSN);
+        paReqBHS[10] = RT_H2N_U32(offData);
+        paReqBHS[11] = 0;            /* reserved */
+
+        pIScsiPDU->aISCSIReq[0].pvSeg = paReqBHS;
+        pIScsiPDU->aISCSIReq[0].cbSeg = sizeof(pIScsiPDU->aBHS);
+        pIScsiPDU->cISCSIReq = 1;
+        pIScsiPDU->cbSgLeft  =   sizeof(pIScsiPDU->aBHS)
+                               + iscsiPDUTxAddI2TData(pImage, pIScsiPDU, cSegsMax, pScsiReq, offData, cbThisPDU);
+        RTSgBufInit(&pIScsiPDU->SgBuf, pIScsiPDU->aISCSIReq, pIScsiPDU->cISCSIReq);
+        /* The command is on the waiting list already. */
+        pIScsiPDU->pIScsiCmd = NULL;
+
+        /* Link the PDU to the Data-Out list, sequences must be kept in order. */
+        if (!pImage->pIScsiPDUTxDataHead)
+            pImage->pIScsiPDUTxDataHead = pIScsiPDU;
+        else
+            pImage->pIScsiPDUTxDataTail->pNext = pIScsiPDU;
+        pImage->pIScsiPDUTxDataTail = pIScsiPDU;
+
+        DataSN++;
+        offData += cbThisPDU;
+        cbData  -= cbThisPDU;
+    }
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Frees all queued Data-Out PDUs of the given command. Used when the target
+ * completes a command without soliciting all data.
+ *
+ * A Data-Out PDU of the command which is partially sent must be finished to
+ * keep the stream in sync. It still refers to the data of the command, so the
+ * command is completed after the PDU was sent in that case.
+ *
+ * @returns nothing.
+ * @param   pImage      The iSCSI connection state to be used.
+ * @param   pIScsiCmd   The command to drop the Data-Out PDUs for.
+ * @param   rcCmd       The status code to complete the command with.
+ */
+static void iscsiPDUTxDataOutDrop(PISCSIIMAGE pImage, PISCSICMD pIScsiCmd, int rcCmd)
+{
+    uint32_t    Itt   = pIScsiCmd->Itt;
+    PISCSIPDUTX pPrev = NULL;
+    PISCSIPDUTX pCur  = pImage->pIScsiPDUTxDataHead;
+
+    while (pCur)
+    {
+        PISCSIPDUTX pNext = pCur->pNext;
+
+        if (pCur->aBHS[4] == Itt)
+        {
+            if (pPrev)
+                pPrev->pNext = pNext;
+            else
+                pImage->pIScsiPDUTxDataHead = pNext;
+            if (pImage->pIScsiPDUTxDataTail == pCur)
+                pImage->pIScsiPDUTxDataTail = pPrev;
+            RTMemFree(pCur);
+        }
+        else
+            pPrev = pCur;
+
+        pCur = pNext;
+    }
+
+    pCur = pImage->pIScsiPDUTxCur;
+    if (   pCur
+        && (RT_N2H_U32(pCur->aBHS[0]) & ISCSIOP_MASK) == ISCSIOP_SCSI_DATA_OUT
+        && pCur->aBHS[4] == Itt)
+    {
+        /* Remove it from the table, it must not be resent on a reconnect. */
+        iscsiCmdRemove(pImage, Itt);
+        pCur->pIScsiCmdDone = pIScsiCmd;
+        pCur->rcCmdDone     = rcCmd;
+    }
+    else
+        iscsiCmdComplete(pImage, pIScsiCmd, rcCmd);
+}
+
 /**
  * Prepares a PDU to transfer for the given command and adds it to the list.
  */
@@ -2726,12 +2951,20 @@ static int iscsiPDUTxPrepare(PISCSIIMAGE pImage, PISCSICMD pIScsiCmd)
     else
         cbData = (uint32_t)pScsiReq->cbI2TData;
 
+    /*
+     * Send as much data as allowed as immediate data, the rest is solicited by the target
+     * with R2Ts. The final bit indicates that no unsolicited Data-Out PDUs follow.
+     */
+    size_t cbImmediate = 0;
+    if (pImage->fImmediateData)
+        cbImmediate = RT_MIN(pScsiReq->cbI2TData, RT_MIN(pImage->cbFirstBurstLength, pImage->cbSendDataLength));
+
     paReqBHS = pIScsiPDU->aBHS;
 
     /* Setup the BHS. */
     paReqBHS[0] = RT_H2N_U32(  ISCSI_FINAL_BIT | ISCSI_TASK_ATTR_SIMPLE | ISCSIOP_SCSI_CMD
                              | (pScsiReq->enmXfer << 21)); /* I=0,F=1,Attr=Simple */
-    paReqBHS[1] = RT_H2N_U32(0x00000000 | ((uint32_t)pScsiReq->cbI2TData & 0xffffff)); /* TotalAHSLength=0 */
+    paReqBHS[1] = RT_H2N_U32(0x00000000 | ((uint32_t)cbImmediate & 0xffffff)); /* TotalAHSLength=0 */
     paReqBHS[2] = RT_H2N_U32(pImage->LUN >> 32);
     paReqBHS[3] = RT_H2N_U32(pImage->LUN & 0xffffffff);
     paReqBHS[4] = pIScsiCmd->Itt;
@@ -2751,31 +2984,12 @@ static int iscsiPDUTxPrepare(PISCSIIMAGE pImage, PISCSICMD pIScsiCmd)
     cbSegs = sizeof(pIScsiPDU->aBHS);
     /* Padding is not necessary for the BHS. */
 
-    if (pScsiReq->cbI2TData)
-    {
-        for (unsigned cSeg = 0; cSeg < pScsiReq->cI2TSegs; cSeg++)
-        {
-            Assert(cnISCSIReq < cI2TSegs);
-            pIScsiPDU->aISCSIReq[cnISCSIReq].cbSeg = pScsiReq->paI2TSegs[cSeg].cbSeg;
-            pIScsiPDU->aISCSIReq[cnISCSIReq].pvSeg = pScsiReq->paI2TSegs[cSeg].pvSeg;
-            cbSegs += pScsiReq->paI2TSegs[cSeg].cbSeg;
-            cnISCSIReq++;
-
-            /* Add padding if necessary. */
-            if (pScsiReq->paI2TSegs[cSeg].cbSeg & 3)
-            {
-                Assert(cnISCSIReq < cI2TSegs);
-                pIScsiPDU->aISCSIReq[cnISCSIReq].pvSeg = &pImage->aPadding[0];
-                pIScsiPDU->aISCSIReq[cnISCSIReq].cbSeg = 4 - (pScsiReq->paI2TSegs[cSeg].cbSeg & 3);
-                cbSegs += pIScsiPDU->aISCSIReq[cnISCSIReq].cbSeg;
-                cnISCSIReq++;
-            }
-        }
-    }
-
     pIScsiPDU->cISCSIReq = cnISCSIReq;
+    if (cbImmediate)
+        cbSegs += iscsiPDUTxAddI2TData(pImage, pIScsiPDU, (unsigned)cI2TSegs, pScsiReq, 0, cbImmediate);
+
     pIScsiPDU->cbSgLeft  = cbSegs;
-    RTSgBufInit(&pIScsiPDU->SgBuf, pIScsiPDU->aISCSIReq, cnISCSIReq);
+    RTSgBufInit(&pIScsiPDU->SgBuf, pIScsiPDU->aISCSIReq, pIScsiPDU->cISCSIReq);
 
     /* Link the PDU to the list. */
     iscsiPDUTxAdd(pImage, pIScsiPDU, false /* fFront */);
@@ -2860,8 +3074,15 @@ static int iscsiRecvPDUUpdateRequest(PISCSIIMAGE pImage, PISCSIRES paRes, uint32
                 else
                     pScsiReq->cbSense = 0;
             }
-            iscsiCmdComplete(pImage, pIScsiCmd, rc);
+
+            /* The target might complete a write early (with an error), don't send data for it anymore. */
+            if (pScsiReq->enmXfer == SCSIXFER_TO_TARGET)
+                iscsiPDUTxDataOutDrop(pImage, pIScsiCmd, rc);
+            else
+                iscsiCmdComplete(pImage, pIScsiCmd, rc);
         }
+        else if (cmd == ISCSIOP_R2T)
+            rc = iscsiPDUTxPrepareDataOut(pImage, pIScsiCmd, paResBHS);
         else if (cmd == ISCSIOP_SCSI_DATA_IN)
         {
             /* A Data-In PDU carries some data that needs to be added to the received
@@ -3115,6 +3336,8 @@ static int iscsiUpdateParameters(PISCSIIMAGE pImage, const uint8_t *pbBuf, size_
     const char *pcszMaxRecvDataSegmentLength = NULL;
     const char *pcszMaxBurstLength = NULL;
     const char *pcszFirstBurstLength = NULL;
+    const char *pcszMaxOutstandingR2T = NULL;
+    const char *pcszImmediateData = NULL;
     rc = iscsiTextGetKeyValue(pbBuf, cbBuf, "MaxRecvDataSegmentLength", &pcszMaxRecvDataSegmentLength);
     if (rc == VERR_INVALID_NAME)
         rc = VINF_SUCCESS;
@@ -3126,6 +3349,16 @@ static int iscsiUpdateParameters(PISCSIIMAGE pImage, const uint8_t *pbBuf, size_
     if (RT_FAILURE(rc))
         return VERR_PARSE_ERROR;
     rc = iscsiTextGetKeyValue(pbBuf, cbBuf, "FirstBurstLength", &pcszFirstBurstLength);
+    if (rc == VERR_INVALID_NAME)
+        rc = VINF_SUCCESS;
+    if (RT_FAILURE(rc))
+        return VERR_PARSE_ERROR;
+    rc = iscsiTextGetKeyValue(pbBuf, cbBuf, "MaxOutstandingR2T", &pcszMaxOutstandingR2T);
+    if (rc == VERR_INVALID_NAME)
+        rc = VINF_SUCCESS;
+    if (RT_FAILURE(rc))
+        return VERR_PARSE_ERROR;
+    rc = iscsiTextGetKeyValue(pbBuf, cbBuf, "ImmediateData", &pcszImmediateData);
     if (rc == VERR_INVALID_NAME)
         rc = VINF_SUCCESS;
     if (RT_FAILURE(rc))
@@ -3139,18 +3372,27 @@ static int iscsiUpdateParameters(PISCSIIMAGE pImage, const uint8_t *pbBuf, size_
     }
     if (pcszMaxBurstLength)
     {
-        uint32_t cb = pImage->cbSendDataLength;
+        uint32_t cb = pImage->cbMaxBurstLength;
         rc = RTStrToUInt32Full(pcszMaxBurstLength, 0, &cb);
         AssertRC(rc);
-        pImage->cbSendDataLength = RT_MIN(pImage->cbSendDataLength, cb);
+        pImage->cbMaxBurstLength = RT_MIN(pImage->cbMaxBurstLength, cb);
     }
     if (pcszFirstBurstLength)
     {
-        uint32_t cb = pImage->cbSendDataLength;
+        uint32_t cb = pImage->cbFirstBurstLength;
         rc = RTStrToUInt32Full(pcszFirstBurstLength, 0, &cb);
         AssertRC(rc);
-        pImage->cbSendDataLength = RT_MIN(pImage->cbSendDataLength, cb);
+        pImage->cbFirstBurstLength = RT_MIN(pImage->cbFirstBurstLength, cb);
     }
+    if (pcszMaxOutstandingR2T)
+    {
+        uint32_t c = pImage->cMaxOutstandingR2T;
+        rc = RTStrToUInt32Full(pcszMaxOutstandingR2T, 0, &c);
+        AssertRC(rc);
+        pImage->cMaxOutstandingR2T = RT_MAX(1, RT_MIN(pImage->cMaxOutstandingR2T, c));
+    }
+    if (pcszImmediateData)
+        pImage->fImmediateData = !RTStrCmp(pcszImmediateData, "Yes");
     return VINF_SUCCESS;
 }
 
@@ -3318,6 +3560,15 @@ static void iscsiReattach(PISCSIIMAGE pImage)
     /* Clear the tail pointer (safety precaution). */
     pImage->pIScsiPDUTxTail = NULL;
 
+    /* Data-Out PDUs are regenerated when the target sends R2Ts for the resent commands. */
+    while (pImage->pIScsiPDUTxDataHead)
+    {
+        pIScsiPDUTx = pImage->pIScsiPDUTxDataHead;
+        pImage->pIScsiPDUTxDataHead = pIScsiPDUTx->pNext;
+        RTMemFree(pIScsiPDUTx);
+    }
+    pImage->pIScsiPDUTxDataTail = NULL;
+
     /* Clear the current PDU too. */
     if (pImage->pIScsiPDUTxCur)
     {
@@ -3331,6 +3582,10 @@ static void iscsiReattach(PISCSIIMAGE pImage)
             pIScsiCmd->pNext = pIScsiCmdHead;
             pIScsiCmdHead = pIScsiCmd;
         }
+
+        /* The target completed this command already, the remaining data is not needed anymore. */
+        if (pIScsiPDUTx->pIScsiCmdDone)
+            iscsiCmdComplete(pImage, pIScsiPDUTx->pIScsiCmdDone, pIScsiPDUTx->rcCmdDone);
         RTMemFree(pIScsiPDUTx);
     }
 
@@ -4796,9 +5051,15 @@ static int iscsiWrite(void *pBackendData, uint64_t uOffset, size_t cbToWrite,
         return VERR_INVALID_PARAMETER;
 
     /*
-     * Clip read size to a value which is supported by the target.
+     * Clip write size to a value which is supported by the target. The I/O thread
+     * transfers everything beyond the immediate data on request of the target (R2T),
+     * without it everything must fit into the command PDU.
      */
-    cbToWrite = RT_MIN(cbToWrite, pImage->cbSendDataLength);
+    if (pImage->fExtendedSelectSupported)
+        cbToWrite = RT_MIN(cbToWrite, pImage->cbWriteSplit);
+    else
+        cbToWrite = RT_MIN(cbToWrite, RT_MIN(pImage->cbWriteSplit,
+                                             RT_MIN(pImage->cbSendDataLength, pImage->cbFirstBurstLength)));
 
     unsigned cI2TSegs = 0;
     size_t   cbSegs = 0;
@@ -5553,5 +5814,9 @@ VBOXHDDBACKEND g_ISCSIBackend =
     /* pfnResize */
     NULL,
     /* pfnRepair */
+    NULL,
+    /* pfnQueryAllocatedRanges */
+    NULL,
+    /* pfnDefragment */
     NULL
 };
@@ -1297,5 +1297,9 @@ VBOXHDDBACKEND g_ParallelsBackend =
     /* pfnResize */
     NULL,
     /* pfnRepair */
+    NULL,
+    /* pfnQueryAllocatedRanges */
+    NULL,
+    /* pfnDefragment */
     NULL
 };
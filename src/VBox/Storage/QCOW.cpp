@@ -29,6 +29,7 @@
 #include <iprt/alloc.h>
 #include <iprt/path.h>
 #include <iprt/list.h>
+#include <iprt/avl.h>
 
 /**
  * The QCOW backend implements support for the qemu copy on write format (short QCOW)
@@ -37,7 +38,7 @@
  * and http://people.gnome.org/~markmc/qcow-image-format-version-1.html for version 1.
  *
  * Missing things to implement:
- *    - v2 image creation and handling of the reference count table. (Blocker to enable support for V2 images)
+ *    - v2 image creation and growing the reference count table. (Blocker to enable support for V2 images)
  *    - cluster encryption
  *    - cluster compression
  *    - compaction
@@ -126,6 +127,8 @@ typedef QCowHeader *PQCowHeader;
 #define QCOW_V2_COPIED_FLAG                   RT_BIT_64(63)
 /** Cluster is compressed flag for QCOW2 images. */
 #define QCOW_V2_COMPRESSED_FLAG               RT_BIT_64(62)
+/** Mask of the offset part in L1 table entries of QCOW2 images. */
+#define QCOW_V2_TBL_OFFSET_MASK               UINT64_C(0x00fffffffffffe00)
 
 
 /*******************************************************************************
@@ -137,8 +140,8 @@ typedef QCowHeader *PQCowHeader;
  */
 typedef struct QCOWL2CACHEENTRY
 {
-    /** List node for the search list. */
-    RTLISTNODE              NodeSearch;
+    /** AVL tree node for searching, keyed by the offset of the L2 table. */
+    AVLRU64NODECORE         Core;
     /** List node for the LRU list. */
     RTLISTNODE              NodeLru;
     /** Reference counter. */
@@ -149,8 +152,38 @@ typedef struct QCOWL2CACHEENTRY
     uint64_t               *paL2Tbl;
 } QCOWL2CACHEENTRY, *PQCOWL2CACHEENTRY;
 
-/** Maximum amount of memory the cache is allowed to use. */
-#define QCOW_L2_CACHE_MEMORY_MAX (2*_1M)
+/**
+ * QCOW refcount block cache entry.
+ */
+typedef struct QCOWREFCOUNTCACHEENTRY
+{
+    /** AVL tree node for searching, keyed by the offset of the refcount block. */
+    AVLRU64NODECORE         Core;
+    /** List node for the LRU list. */
+    RTLISTNODE              NodeLru;
+    /** Reference counter. */
+    uint32_t                cRefs;
+    /** Index of the block in the refcount table. */
+    uint32_t                idxRefcountTbl;
+    /** Flag whether the block was modified and needs to be written. */
+    bool                    fDirty;
+    /** Flag whether the block was created and is not yet linked in the on disk refcount table. */
+    bool                    fLinkPending;
+    /** Pointer to the cached refcount block. */
+    uint16_t               *paRefcounts;
+} QCOWREFCOUNTCACHEENTRY, *PQCOWREFCOUNTCACHEENTRY;
+
+/** Default amount of memory the L2 table cache is allowed to use. */
+#define QCOW_L2_CACHE_MEMORY_DEF (2*_1M)
+/** Default amount of memory the refcount block cache is allowed to use. */
+#define QCOW_REFCOUNT_CACHE_MEMORY_DEF (256*_1K)
+/** Minimum number of entries a cache can hold, a cluster allocation keeps up to
+ * two refcount blocks referenced. */
+#define QCOW_CACHE_ENTRIES_MIN (4)
+/** Default number of clusters reserved at once for sequential writes. */
+#define QCOW_PREALLOC_CLUSTERS_DEF (16)
+/** Maximum number of clusters reserved at once for sequential writes. */
+#define QCOW_PREALLOC_CLUSTERS_MAX (1024)
 
 /** QCOW default cluster size for image version 2. */
 #define QCOW2_CLUSTER_SIZE_DEFAULT (64*_1K)
@@ -177,6 +210,8 @@ typedef struct QCOWIMAGE
     PVDINTERFACEERROR   pIfError;
     /** I/O interface. */
     PVDINTERFACEIOINT   pIfIo;
+    /** Config interface, optional. */
+    PVDINTERFACECONFIG  pIfConfig;
 
     /** Open flags passed by VBoxHD layer. */
     unsigned            uOpenFlags;
@@ -203,6 +238,17 @@ typedef struct QCOWIMAGE
 
     /** Next offset of a new cluster, aligned to sector size. */
     uint64_t            offNextCluster;
+    /** Start of the clusters reserved for upcoming allocations, everything up to
+     * offNextCluster is reserved already (and accounted for in the refcounts). */
+    uint64_t            offPreallocNext;
+    /** Number of clusters to reserve at once for sequential writes. */
+    uint32_t            cPreallocClusters;
+    /** Logical offset of the last allocated cluster to detect sequential writes. */
+    uint64_t            offLastAllocLogical;
+    /** Cluster allocation writing its refcount updates, NULL if none. */
+    struct QCOWCLUSTERASYNCALLOC *pClusterAllocRefcounts;
+    /** Cluster allocations waiting for the refcount updates of another one to complete. */
+    RTLISTANCHOR        ListClusterAllocWaiting;
     /** Cluster size in bytes. */
     uint32_t            cbCluster;
     /** Number of entries in the L1 table. */
@@ -220,8 +266,10 @@ typedef struct QCOWIMAGE
     uint32_t            cL2TableEntries;
     /** Memory occupied by the L2 table cache. */
     size_t              cbL2Cache;
-    /** The sorted L2 entry list used for searching. */
-    RTLISTNODE          ListSearch;
+    /** Maximum amount of memory the L2 table cache is allowed to use. */
+    size_t              cbL2CacheMax;
+    /** The L2 entry tree used for searching. */
+    AVLRU64TREE         TreeL2;
     /** The LRU L2 entry list used for eviction. */
     RTLISTNODE          ListLru;
 
@@ -233,6 +281,18 @@ typedef struct QCOWIMAGE
     uint32_t            cRefcountTableEntries;
     /** Pointer to the refcount table. */
     uint64_t           *paRefcountTable;
+    /** Number of refcounts in a refcount block. */
+    uint32_t            cRefcountsPerBlock;
+    /** Number of bits to shift an image offset to get the refcount table index. */
+    uint32_t            cRefcountBlockShift;
+    /** Memory occupied by the refcount block cache. */
+    size_t              cbRefcountCache;
+    /** Maximum amount of memory the refcount block cache is allowed to use. */
+    size_t              cbRefcountCacheMax;
+    /** The refcount block tree used for searching. */
+    AVLRU64TREE         TreeRefcount;
+    /** The LRU refcount block list used for eviction. */
+    RTLISTNODE          ListRefcountLru;
 
     /** Offset mask for a cluster. */
     uint64_t            fOffsetMask;
@@ -252,6 +312,10 @@ typedef enum QCOWCLUSTERASYNCALLOCSTATE
 {
     /** Invalid. */
     QCOWCLUSTERASYNCALLOCSTATE_INVALID = 0,
+    /** Write modified refcount blocks. */
+    QCOWCLUSTERASYNCALLOCSTATE_REFCOUNT_UPDATE,
+    /** Link new refcount blocks into the refcount table. */
+    QCOWCLUSTERASYNCALLOCSTATE_REFCOUNT_LINK,
     /** L2 table allocation. */
     QCOWCLUSTERASYNCALLOCSTATE_L2_ALLOC,
     /** Link L2 table into L1. */
@@ -271,18 +335,26 @@ typedef struct QCOWCLUSTERASYNCALLOC
 {
     /** The state of the cluster allocation. */
     QCOWCLUSTERASYNCALLOCSTATE enmAllocState;
-    /** Old image size to rollback in case of an error. */
-    uint64_t                   offNextClusterOld;
+    /** Number of metadata writes pending in the refcount states. */
+    uint32_t                   cWritesPending;
+    /** Status of issuing the refcount metadata writes. */
+    int                        rcCommit;
+    /** Flag whether a new L2 table is allocated. */
+    bool                       fL2TblNew;
     /** L1 index to link if any. */
     uint32_t                   idxL1;
     /** L2 index to link, required in any case. */
     uint32_t                   idxL2;
     /** Start offset of the allocated cluster. */
     uint64_t                   offClusterNew;
-    /** L2 cache entry if a L2 table is allocated. */
+    /** L2 cache entry, a new one if a L2 table is allocated. */
     PQCOWL2CACHEENTRY          pL2Entry;
     /** Number of bytes to write. */
     size_t                     cbToWrite;
+    /** The I/O context of the allocation while it is waiting. */
+    PVDIOCTX                   pIoCtx;
+    /** List node for the list of waiting allocations. */
+    RTLISTNODE                 NodeWaiting;
 } QCOWCLUSTERASYNCALLOC, *PQCOWCLUSTERASYNCALLOC;
 
 /*******************************************************************************
@@ -297,6 +369,24 @@ static const VDFILEEXTENSION s_aQCowFileExtensions[] =
     {NULL,  VDTYPE_INVALID}
 };
 
+/** Default size of the L2 table cache in bytes. */
+static const char *s_qcowConfigDefaultL2CacheSize = "2097152";
+
+/** Default size of the refcount block cache in bytes. */
+static const char *s_qcowConfigDefaultRefcountCacheSize = "262144";
+
+/** Default number of clusters to reserve for sequential writes. */
+static const char *s_qcowConfigDefaultPreallocClusters = "16";
+
+/** Description of all accepted config parameters. */
+static const VDCONFIGINFO s_qcowConfigInfo[] =
+{
+    { "L2CacheSize",          s_qcowConfigDefaultL2CacheSize,            VDCFGVALUETYPE_INTEGER, VD_CFGKEY_EXPERT },
+    { "RefcountCacheSize",    s_qcowConfigDefaultRefcountCacheSize,      VDCFGVALUETYPE_INTEGER, VD_CFGKEY_EXPERT },
+    { "PreallocClusters",     s_qcowConfigDefaultPreallocClusters,       VDCFGVALUETYPE_INTEGER, VD_CFGKEY_EXPERT },
+    { NULL,                   NULL,                                      VDCFGVALUETYPE_INTEGER, 0 }
+};
+
 /*******************************************************************************
 *   Internal Functions                                                         *
 *******************************************************************************/
@@ -489,7 +579,7 @@ static void qcowRefcountTableConvertFromHostEndianess(uint16_t *paTblImg, uint16
 static int qcowL2TblCacheCreate(PQCOWIMAGE pImage)
 {
     pImage->cbL2Cache = 0;
-    RTListInit(&pImage->ListSearch);
+    pImage->TreeL2    = NULL;
     RTListInit(&pImage->ListLru);
 
     return VINF_SUCCESS;
@@ -506,17 +596,17 @@ static void qcowL2TblCacheDestroy(PQCOWIMAGE pImage)
     PQCOWL2CACHEENTRY pL2Entry = NULL;
     PQCOWL2CACHEENTRY pL2Next  = NULL;
 
-    RTListForEachSafe(&pImage->ListSearch, pL2Entry, pL2Next, QCOWL2CACHEENTRY, NodeSearch)
+    RTListForEachSafe(&pImage->ListLru, pL2Entry, pL2Next, QCOWL2CACHEENTRY, NodeLru)
     {
         Assert(!pL2Entry->cRefs);
 
-        RTListNodeRemove(&pL2Entry->NodeSearch);
+        RTListNodeRemove(&pL2Entry->NodeLru);
         RTMemPageFree(pL2Entry->paL2Tbl, pImage->cbL2Table);
         RTMemFree(pL2Entry);
     }
 
     pImage->cbL2Cache       = 0;
-    RTListInit(&pImage->ListSearch);
+    pImage->TreeL2          = NULL;
     RTListInit(&pImage->ListLru);
 }
 
@@ -529,24 +619,17 @@ static void qcowL2TblCacheDestroy(PQCOWIMAGE pImage)
  */
 static PQCOWL2CACHEENTRY qcowL2TblCacheRetain(PQCOWIMAGE pImage, uint64_t offL2Tbl)
 {
-    PQCOWL2CACHEENTRY pL2Entry = NULL;
-
-    RTListForEach(&pImage->ListSearch, pL2Entry, QCOWL2CACHEENTRY, NodeSearch)
-    {
-        if (pL2Entry->offL2Tbl == offL2Tbl)
-            break;
-    }
+    PQCOWL2CACHEENTRY pL2Entry = (PQCOWL2CACHEENTRY)RTAvlrU64Get(&pImage->TreeL2, offL2Tbl);
 
-    if (!RTListNodeIsDummy(&pImage->ListSearch, pL2Entry, QCOWL2CACHEENTRY, NodeSearch))
+    if (pL2Entry)
     {
         /* Update LRU list. */
         RTListNodeRemove(&pL2Entry->NodeLru);
         RTListPrepend(&pImage->ListLru, &pL2Entry->NodeLru);
         pL2Entry->cRefs++;
-        return pL2Entry;
     }
-    else
-        return NULL;
+
+    return pL2Entry;
 }
 
 /**
@@ -570,9 +653,8 @@ static void qcowL2TblCacheEntryRelease(PQCOWL2CACHEENTRY pL2Entry)
 static PQCOWL2CACHEENTRY qcowL2TblCacheEntryAlloc(PQCOWIMAGE pImage)
 {
     PQCOWL2CACHEENTRY pL2Entry = NULL;
-    int rc = VINF_SUCCESS;
 
-    if (pImage->cbL2Cache + pImage->cbL2Table <= QCOW_L2_CACHE_MEMORY_MAX)
+    if (pImage->cbL2Cache + pImage->cbL2Table <= pImage->cbL2CacheMax)
     {
         /* Add a new entry. */
         pL2Entry = (PQCOWL2CACHEENTRY)RTMemAllocZ(sizeof(QCOWL2CACHEENTRY));
@@ -602,9 +684,10 @@ static PQCOWL2CACHEENTRY qcowL2TblCacheEntryAlloc(PQCOWIMAGE pImage)
                 break;
         }
 
-        if (!RTListNodeIsDummy(&pImage->ListSearch, pL2Entry, QCOWL2CACHEENTRY, NodeSearch))
+        if (!RTListNodeIsDummy(&pImage->ListLru, pL2Entry, QCOWL2CACHEENTRY, NodeLru))
         {
-            RTListNodeRemove(&pL2Entry->NodeSearch);
+            PAVLRU64NODECORE pCore = RTAvlrU64Remove(&pImage->TreeL2, pL2Entry->Core.Key);
+            Assert(pCore == &pL2Entry->Core); NOREF(pCore);
             RTListNodeRemove(&pL2Entry->NodeLru);
             pL2Entry->offL2Tbl = 0;
             pL2Entry->cRefs    = 1;
@@ -641,40 +724,15 @@ static void qcowL2TblCacheEntryFree(PQCOWIMAGE pImage, PQCOWL2CACHEENTRY pL2Entr
  */
 static void qcowL2TblCacheEntryInsert(PQCOWIMAGE pImage, PQCOWL2CACHEENTRY pL2Entry)
 {
-    PQCOWL2CACHEENTRY pIt = NULL;
-
     Assert(pL2Entry->offL2Tbl > 0);
 
     /* Insert at the top of the LRU list. */
     RTListPrepend(&pImage->ListLru, &pL2Entry->NodeLru);
 
-    if (RTListIsEmpty(&pImage->ListSearch))
-    {
-        RTListAppend(&pImage->ListSearch, &pL2Entry->NodeSearch);
-    }
-    else
-    {
-        /* Insert into search list. */
-        pIt = RTListGetFirst(&pImage->ListSearch, QCOWL2CACHEENTRY, NodeSearch);
-        if (pIt->offL2Tbl > pL2Entry->offL2Tbl)
-            RTListPrepend(&pImage->ListSearch, &pL2Entry->NodeSearch);
-        else
-        {
-            bool fInserted = false;
-
-            RTListForEach(&pImage->ListSearch, pIt, QCOWL2CACHEENTRY, NodeSearch)
-            {
-                Assert(pIt->offL2Tbl != pL2Entry->offL2Tbl);
-                if (pIt->offL2Tbl < pL2Entry->offL2Tbl)
-                {
-                    RTListNodeInsertAfter(&pIt->NodeSearch, &pL2Entry->NodeSearch);
-                    fInserted = true;
-                    break;
-                }
-            }
-             Assert(fInserted);
-        }
-    }
+    pL2Entry->Core.Key     = pL2Entry->offL2Tbl;
+    pL2Entry->Core.KeyLast = pL2Entry->offL2Tbl + pImage->cbL2Table - 1;
+    bool fInserted = RTAvlrU64Insert(&pImage->TreeL2, &pL2Entry->Core);
+    Assert(fInserted); NOREF(fInserted);
 }
 
 /**
@@ -732,6 +790,309 @@ static int qcowL2TblCacheFetch(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, uint64_t offL
     return rc;
 }
 
+/**
+ * Creates the refcount block cache.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ */
+static int qcowRefcountCacheCreate(PQCOWIMAGE pImage)
+{
+    pImage->cbRefcountCache = 0;
+    pImage->TreeRefcount    = NULL;
+    RTListInit(&pImage->ListRefcountLru);
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Destroys the refcount block cache, modified blocks must be written before.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ */
+static void qcowRefcountCacheDestroy(PQCOWIMAGE pImage)
+{
+    PQCOWREFCOUNTCACHEENTRY pEntry = NULL;
+    PQCOWREFCOUNTCACHEENTRY pNext  = NULL;
+
+    RTListForEachSafe(&pImage->ListRefcountLru, pEntry, pNext, QCOWREFCOUNTCACHEENTRY, NodeLru)
+    {
+        Assert(!pEntry->cRefs);
+
+        RTListNodeRemove(&pEntry->NodeLru);
+        RTMemPageFree(pEntry->paRefcounts, pImage->cbCluster);
+        RTMemFree(pEntry);
+    }
+
+    pImage->cbRefcountCache = 0;
+    pImage->TreeRefcount    = NULL;
+    RTListInit(&pImage->ListRefcountLru);
+}
+
+/**
+ * Releases a refcount block cache entry.
+ *
+ * @returns nothing.
+ * @param   pEntry    The refcount cache entry.
+ */
+static void qcowRefcountCacheEntryRelease(PQCOWREFCOUNTCACHEENTRY pEntry)
+{
+    Assert(pEntry->cRefs > 0);
+    pEntry->cRefs--;
+}
+
+/**
+ * Allocates a new refcount block from the cache evicting old entries if required.
+ * Modified entries are never evicted.
+ *
+ * @returns Pointer to the refcount cache entry or NULL.
+ * @param   pImage    The image instance data.
+ */
+static PQCOWREFCOUNTCACHEENTRY qcowRefcountCacheEntryAlloc(PQCOWIMAGE pImage)
+{
+    PQCOWREFCOUNTCACHEENTRY pEntry = NULL;
+
+    if (pImage->cbRefcountCache + pImage->cbCluster <= pImage->cbRefcountCacheMax)
+    {
+        pEntry = (PQCOWREFCOUNTCACHEENTRY)RTMemAllocZ(sizeof(QCOWREFCOUNTCACHEENTRY));
+        if (pEntry)
+        {
+            pEntry->paRefcounts = (uint16_t *)RTMemPageAllocZ(pImage->cbCluster);
+            if (RT_UNLIKELY(!pEntry->paRefcounts))
+            {
+                RTMemFree(pEntry);
+                pEntry = NULL;
+            }
+            else
+            {
+                pEntry->cRefs            = 1;
+                pImage->cbRefcountCache += pImage->cbCluster;
+            }
+        }
+    }
+    else
+    {
+        RTListForEachReverse(&pImage->ListRefcountLru, pEntry, QCOWREFCOUNTCACHEENTRY, NodeLru)
+        {
+            if (   !pEntry->cRefs
+                && !pEntry->fDirty
+                && !pEntry->fLinkPending)
+                break;
+        }
+
+        if (!RTListNodeIsDummy(&pImage->ListRefcountLru, pEntry, QCOWREFCOUNTCACHEENTRY, NodeLru))
+        {
+            PAVLRU64NODECORE pCore = RTAvlrU64Remove(&pImage->TreeRefcount, pEntry->Core.Key);
+            Assert(pCore == &pEntry->Core); NOREF(pCore);
+            RTListNodeRemove(&pEntry->NodeLru);
+            pEntry->cRefs = 1;
+        }
+        else
+            pEntry = NULL;
+    }
+
+    return pEntry;
+}
+
+/**
+ * Frees a refcount block cache entry which is not in the cache.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ * @param   pEntry    The refcount cache entry to free.
+ */
+static void qcowRefcountCacheEntryFree(PQCOWIMAGE pImage, PQCOWREFCOUNTCACHEENTRY pEntry)
+{
+    Assert(!pEntry->cRefs);
+    RTMemPageFree(pEntry->paRefcounts, pImage->cbCluster);
+    RTMemFree(pEntry);
+
+    pImage->cbRefcountCache -= pImage->cbCluster;
+}
+
+/**
+ * Inserts an entry in the refcount block cache.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ * @param   pEntry    The refcount cache entry to insert.
+ * @param   idxBlock  Index of the refcount block in the refcount table.
+ */
+static void qcowRefcountCacheEntryInsert(PQCOWIMAGE pImage, PQCOWREFCOUNTCACHEENTRY pEntry,
+                                         uint32_t idxBlock)
+{
+    RTListPrepend(&pImage->ListRefcountLru, &pEntry->NodeLru);
+
+    pEntry->idxRefcountTbl = idxBlock;
+    pEntry->Core.Key       = pImage->paRefcountTable[idxBlock];
+    pEntry->Core.KeyLast   = pEntry->Core.Key + pImage->cbCluster - 1;
+    bool fInserted = RTAvlrU64Insert(&pImage->TreeRefcount, &pEntry->Core);
+    Assert(fInserted); NOREF(fInserted);
+}
+
+/**
+ * Fetches the given refcount block trying the cache first and reading it
+ * from the image after a cache miss.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   pIoCtx    The I/O context, NULL for synchronous operation.
+ * @param   idxBlock  Index of the refcount block in the refcount table, must be allocated.
+ * @param   ppEntry   Where to store the retained refcount block on success.
+ */
+static int qcowRefcountCacheFetch(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, uint32_t idxBlock,
+                                  PQCOWREFCOUNTCACHEENTRY *ppEntry)
+{
+    int rc = VINF_SUCCESS;
+    uint64_t offBlock = pImage->paRefcountTable[idxBlock];
+
+    Assert(offBlock);
+
+    PQCOWREFCOUNTCACHEENTRY pEntry = (PQCOWREFCOUNTCACHEENTRY)RTAvlrU64Get(&pImage->TreeRefcount, offBlock);
+    if (pEntry)
+    {
+        RTListNodeRemove(&pEntry->NodeLru);
+        RTListPrepend(&pImage->ListRefcountLru, &pEntry->NodeLru);
+        pEntry->cRefs++;
+    }
+    else
+    {
+        pEntry = qcowRefcountCacheEntryAlloc(pImage);
+        if (pEntry)
+        {
+            PVDMETAXFER pMetaXfer = NULL;
+
+            rc = vdIfIoIntFileReadMeta(pImage->pIfIo, pImage->pStorage,
+                                       offBlock, pEntry->paRefcounts,
+                                       pImage->cbCluster, pIoCtx,
+                                       pIoCtx ? &pMetaXfer : NULL, NULL, NULL);
+            if (RT_SUCCESS(rc))
+            {
+                if (pMetaXfer)
+                    vdIfIoIntMetaXferRelease(pImage->pIfIo, pMetaXfer);
+#if defined(RT_LITTLE_ENDIAN)
+                qcowRefcountTableConvertToHostEndianess(pEntry->paRefcounts, pImage->cRefcountsPerBlock);
+#endif
+                qcowRefcountCacheEntryInsert(pImage, pEntry, idxBlock);
+            }
+            else
+            {
+                qcowRefcountCacheEntryRelease(pEntry);
+                qcowRefcountCacheEntryFree(pImage, pEntry);
+            }
+        }
+        else
+            rc = VERR_NO_MEMORY;
+    }
+
+    if (RT_SUCCESS(rc))
+        *ppEntry = pEntry;
+
+    return rc;
+}
+
+/**
+ * Writes all modified refcount blocks to the image.
+ *
+ * @returns VBox status code.
+ * @param   pImage          Image instance data.
+ * @param   pIoCtx          The I/O context, NULL for synchronous operation.
+ * @param   pfnComplete     Completion callback for every write, optional.
+ * @param   pvUser          Opaque user data for the completion callback.
+ * @param   pcWritesPending Where to add the number of writes still in progress, optional.
+ */
+static int qcowRefcountCacheCommit(PQCOWIMAGE pImage, PVDIOCTX pIoCtx,
+                                   PFNVDXFERCOMPLETED pfnComplete, void *pvUser,
+                                   uint32_t *pcWritesPending)
+{
+    int rc = VINF_SUCCESS;
+    uint16_t *paRefcountsImg = NULL;
+    PQCOWREFCOUNTCACHEENTRY pEntry;
+
+    RTListForEach(&pImage->ListRefcountLru, pEntry, QCOWREFCOUNTCACHEENTRY, NodeLru)
+    {
+        if (!pEntry->fDirty)
+            continue;
+
+        if (!paRefcountsImg)
+        {
+            paRefcountsImg = (uint16_t *)RTMemTmpAlloc(pImage->cbCluster);
+            if (!paRefcountsImg)
+            {
+                rc = VERR_NO_MEMORY;
+                break;
+            }
+        }
+
+        /* The metadata write keeps a copy of the buffer. */
+        qcowRefcountTableConvertFromHostEndianess(paRefcountsImg, pEntry->paRefcounts,
+                                                  pImage->cRefcountsPerBlock);
+        rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                    pEntry->Core.Key, paRefcountsImg,
+                                    pImage->cbCluster, pIoCtx,
+                                    pfnComplete, pvUser);
+        if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+        {
+            if (pcWritesPending)
+                (*pcWritesPending)++;
+            rc = VINF_SUCCESS;
+        }
+        if (RT_FAILURE(rc))
+            break;
+
+        pEntry->fDirty = false;
+    }
+
+    if (paRefcountsImg)
+        RTMemTmpFree(paRefcountsImg);
+
+    return rc;
+}
+
+/**
+ * Links refcount blocks created since the last call into the on disk refcount table.
+ *
+ * @returns VBox status code.
+ * @param   pImage          Image instance data.
+ * @param   pIoCtx          The I/O context, NULL for synchronous operation.
+ * @param   pfnComplete     Completion callback for every write, optional.
+ * @param   pvUser          Opaque user data for the completion callback.
+ * @param   pcWritesPending Where to add the number of writes still in progress, optional.
+ */
+static int qcowRefcountTableCommit(PQCOWIMAGE pImage, PVDIOCTX pIoCtx,
+                                   PFNVDXFERCOMPLETED pfnComplete, void *pvUser,
+                                   uint32_t *pcWritesPending)
+{
+    int rc = VINF_SUCCESS;
+    PQCOWREFCOUNTCACHEENTRY pEntry;
+
+    RTListForEach(&pImage->ListRefcountLru, pEntry, QCOWREFCOUNTCACHEENTRY, NodeLru)
+    {
+        if (!pEntry->fLinkPending)
+            continue;
+
+        Assert(!pEntry->fDirty);
+        uint64_t offUpdateLe = RT_H2BE_U64(pEntry->Core.Key);
+        rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                    pImage->offRefcountTable + pEntry->idxRefcountTbl * sizeof(uint64_t),
+                                    &offUpdateLe, sizeof(uint64_t), pIoCtx,
+                                    pfnComplete, pvUser);
+        if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+        {
+            if (pcWritesPending)
+                (*pcWritesPending)++;
+            rc = VINF_SUCCESS;
+        }
+        if (RT_FAILURE(rc))
+            break;
+
+        pEntry->fLinkPending = false;
+    }
+
+    return rc;
+}
+
 /**
  * Sets the L1, L2 and offset bitmasks and L1 and L2 bit shift members.
  *
@@ -751,6 +1112,10 @@ static void qcowTableMasksInit(PQCOWIMAGE pImage)
     pImage->fL2Mask     = ((uint64_t)pImage->cL2TableEntries - 1) << cClusterBits;
     pImage->cL2Shift    = cClusterBits;
     pImage->cL1Shift    = cClusterBits + cL2TableBits;
+
+    /* Each refcount block holds a 16bit refcount for every cluster it covers. */
+    pImage->cRefcountsPerBlock  = pImage->cbCluster / sizeof(uint16_t);
+    pImage->cRefcountBlockShift = cClusterBits + qcowGetPowerOfTwo(pImage->cRefcountsPerBlock);
 }
 
 /**
@@ -800,20 +1165,271 @@ DECLINLINE(uint64_t) qcowByte2Cluster(PQCOWIMAGE pImage, uint64_t cb)
 }
 
 /**
- * Allocates a new cluster in the image.
+ * Returns whether cluster allocations have to be accounted for in the refcount table.
+ *
+ * @returns true if refcounts are maintained, false otherwise.
+ * @param   pImage    The image instance data.
+ */
+DECLINLINE(bool) qcowRefcountsTracked(PQCOWIMAGE pImage)
+{
+    return    pImage->uVersion == 2
+           && pImage->paRefcountTable;
+}
+
+/**
+ * Returns the index of the refcount block covering the given image offset.
+ *
+ * @returns Index into the refcount table.
+ * @param   pImage    The image instance data.
+ * @param   off       The image offset.
+ */
+DECLINLINE(uint32_t) qcowRefcountBlockIdx(PQCOWIMAGE pImage, uint64_t off)
+{
+    return (uint32_t)(off >> pImage->cRefcountBlockShift);
+}
+
+/**
+ * Returns the index of the refcount for the given image offset inside its refcount block.
  *
- * @returns The start offset of the new cluster in the image.
+ * @returns Index into the refcount block.
  * @param   pImage    The image instance data.
- * @param   cCLusters Number of clusters to allocate.
+ * @param   off       The image offset.
  */
-DECLINLINE(uint64_t) qcowClusterAllocate(PQCOWIMAGE pImage, uint32_t cClusters)
+DECLINLINE(uint32_t) qcowRefcountIdx(PQCOWIMAGE pImage, uint64_t off)
 {
-    uint64_t offCluster;
+    return (uint32_t)(off >> pImage->cL2Shift) & (pImage->cRefcountsPerBlock - 1);
+}
 
-    offCluster = pImage->offNextCluster;
-    pImage->offNextCluster += cClusters*pImage->cbCluster;
+/**
+ * Converts a table offset into a L1 or L2 table entry.
+ *
+ * @returns The table entry.
+ * @param   pImage    The image instance data.
+ * @param   off       The offset of the cluster or table.
+ */
+DECLINLINE(uint64_t) qcowTblEntryFromOffset(PQCOWIMAGE pImage, uint64_t off)
+{
+    /* Snapshots are not supported so every cluster we reference has a refcount of exactly one. */
+    if (   pImage->uVersion == 2
+        && off)
+        off |= QCOW_V2_COPIED_FLAG;
+    return off;
+}
 
-    return offCluster;
+/**
+ * Creates a new refcount block at the end of the image and links it into the
+ * in memory refcount table. The block is written and linked on disk with the next commit.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ * @param   idxBlock  Index of the refcount block in the refcount table.
+ * @param   ppEntry   Where to store the retained refcount block on success.
+ */
+static int qcowRefcountBlockCreate(PQCOWIMAGE pImage, uint32_t idxBlock,
+                                   PQCOWREFCOUNTCACHEENTRY *ppEntry)
+{
+    PQCOWREFCOUNTCACHEENTRY pEntry = qcowRefcountCacheEntryAlloc(pImage);
+    if (RT_UNLIKELY(!pEntry))
+        return VERR_NO_MEMORY;
+
+    Assert(!pImage->paRefcountTable[idxBlock]);
+    memset(pEntry->paRefcounts, 0, pImage->cbCluster);
+    pImage->paRefcountTable[idxBlock] = pImage->offNextCluster;
+    pImage->offNextCluster += pImage->cbCluster;
+    pEntry->fDirty       = true;
+    pEntry->fLinkPending = true;
+    qcowRefcountCacheEntryInsert(pImage, pEntry, idxBlock);
+
+    *ppEntry = pEntry;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Allocates a run of consecutive clusters at the end of the image and
+ * updates the refcounts of all of them in one go.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_VD_NOT_ENOUGH_METADATA if a refcount block must be read first,
+ *          nothing is changed in that case.
+ * @param   pImage    The image instance data.
+ * @param   pIoCtx    The I/O context, NULL for synchronous operation.
+ * @param   cClusters Number of clusters to allocate.
+ * @param   poffRun   Where to store the start offset of the run on success.
+ */
+static int qcowClusterRunAllocate(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, uint32_t cClusters,
+                                  uint64_t *poffRun)
+{
+    int rc = VINF_SUCCESS;
+    uint64_t offStart = pImage->offNextCluster;
+
+    if (qcowRefcountsTracked(pImage))
+    {
+        /* Limiting the run to a block minus the new refcount blocks it might need keeps it within two blocks. */
+        PQCOWREFCOUNTCACHEENTRY apEntries[2] = { NULL, NULL };
+        uint32_t idxBlockFirst = qcowRefcountBlockIdx(pImage, offStart);
+        uint32_t idxBlockLast  = qcowRefcountBlockIdx(pImage, offStart + qcowCluster2Byte(pImage, cClusters + RT_ELEMENTS(apEntries)) - 1);
+        uint32_t idxBlock;
+
+        AssertReturn(cClusters + RT_ELEMENTS(apEntries) <= pImage->cRefcountsPerBlock, VERR_INVALID_PARAMETER);
+        Assert(idxBlockLast - idxBlockFirst < RT_ELEMENTS(apEntries));
+
+        /*
+         * Get all existing refcount blocks the run might touch before changing
+         * anything so the request can simply be restarted if one must be read.
+         */
+        for (idxBlock = idxBlockFirst; idxBlock <= idxBlockLast && RT_SUCCESS(rc); idxBlock++)
+        {
+            if (idxBlock >= pImage->cRefcountTableEntries)
+                rc = vdIfError(pImage->pIfError, VERR_NOT_SUPPORTED, RT_SRC_POS,
+                               N_("QCow: Refcount table of image '%s' is full, growing it is not supported"),
+                               pImage->pszFilename);
+            else if (pImage->paRefcountTable[idxBlock])
+                rc = qcowRefcountCacheFetch(pImage, pIoCtx, idxBlock, &apEntries[idxBlock - idxBlockFirst]);
+        }
+
+        if (RT_SUCCESS(rc))
+        {
+            /*
+             * Create the refcount blocks for regions not covered so far. They are
+             * placed at the end of the image too, moving the run behind them.
+             */
+            for (idxBlock = idxBlockFirst;
+                    RT_SUCCESS(rc)
+                 && idxBlock <= qcowRefcountBlockIdx(pImage, pImage->offNextCluster + qcowCluster2Byte(pImage, cClusters) - 1);
+                 idxBlock++)
+            {
+                Assert(idxBlock - idxBlockFirst < RT_ELEMENTS(apEntries));
+                if (!apEntries[idxBlock - idxBlockFirst])
+                    rc = qcowRefcountBlockCreate(pImage, idxBlock, &apEntries[idxBlock - idxBlockFirst]);
+            }
+
+            /* Account for the new refcount blocks and the run in one go. */
+            uint64_t offEnd = pImage->offNextCluster;
+            if (RT_SUCCESS(rc))
+                offEnd += qcowCluster2Byte(pImage, cClusters);
+
+            for (uint64_t off = offStart; off < offEnd; off += pImage->cbCluster)
+            {
+                PQCOWREFCOUNTCACHEENTRY pEntry = apEntries[qcowRefcountBlockIdx(pImage, off) - idxBlockFirst];
+                uint32_t idxRefcount = qcowRefcountIdx(pImage, off);
+
+                AssertPtr(pEntry);
+                Assert(!pEntry->paRefcounts[idxRefcount]);
+                pEntry->paRefcounts[idxRefcount]++;
+                pEntry->fDirty = true;
+            }
+        }
+
+        for (unsigned i = 0; i < RT_ELEMENTS(apEntries); i++)
+            if (apEntries[i])
+                qcowRefcountCacheEntryRelease(apEntries[i]);
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        *poffRun = pImage->offNextCluster;
+        pImage->offNextCluster += qcowCluster2Byte(pImage, cClusters);
+    }
+
+    return rc;
+}
+
+/**
+ * Allocates new clusters in the image. They are taken from the clusters reserved
+ * for upcoming allocations, a new run is reserved if there are not enough left.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_VD_NOT_ENOUGH_METADATA if a refcount block must be read first,
+ *          nothing is changed in that case.
+ * @param   pImage      The image instance data.
+ * @param   pIoCtx      The I/O context, NULL for synchronous operation.
+ * @param   cClusters   Number of consecutive clusters to allocate.
+ * @param   cPrealloc   Number of clusters to reserve if a new run is required.
+ * @param   poffCluster Where to store the start offset of the clusters on success.
+ */
+static int qcowClusterAllocate(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, uint32_t cClusters,
+                               uint32_t cPrealloc, uint64_t *poffCluster)
+{
+    int rc = VINF_SUCCESS;
+    uint64_t cbAlloc = qcowCluster2Byte(pImage, cClusters);
+
+    Assert(pImage->offPreallocNext <= pImage->offNextCluster);
+
+    if (pImage->offNextCluster - pImage->offPreallocNext < cbAlloc)
+    {
+        uint64_t offNextClusterOld = pImage->offNextCluster;
+        uint64_t offRun = 0;
+
+        rc = qcowClusterRunAllocate(pImage, pIoCtx, RT_MAX(cClusters, cPrealloc), &offRun);
+        if (   RT_SUCCESS(rc)
+            && offRun != offNextClusterOld)
+        {
+            /*
+             * New refcount blocks were placed in front of the run, the remaining
+             * reserved clusters are not contiguous anymore and stay unused.
+             */
+            pImage->offPreallocNext = offRun;
+        }
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        *poffCluster = pImage->offPreallocNext;
+        pImage->offPreallocNext += cbAlloc;
+    }
+
+    return rc;
+}
+
+/**
+ * Gives back the clusters reserved for upcoming allocations, used when the image is closed.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ */
+static int qcowClusterPreallocRelease(PQCOWIMAGE pImage)
+{
+    int rc = VINF_SUCCESS;
+
+    while (   pImage->offNextCluster > pImage->offPreallocNext
+           && RT_SUCCESS(rc))
+    {
+        uint64_t off = pImage->offNextCluster - pImage->cbCluster;
+
+        if (qcowRefcountsTracked(pImage))
+        {
+            PQCOWREFCOUNTCACHEENTRY pEntry;
+
+            rc = qcowRefcountCacheFetch(pImage, NULL, qcowRefcountBlockIdx(pImage, off), &pEntry);
+            if (RT_SUCCESS(rc))
+            {
+                uint32_t idxRefcount = qcowRefcountIdx(pImage, off);
+
+                Assert(pEntry->paRefcounts[idxRefcount] == 1);
+                pEntry->paRefcounts[idxRefcount]--;
+                pEntry->fDirty = true;
+                qcowRefcountCacheEntryRelease(pEntry);
+            }
+        }
+
+        if (RT_SUCCESS(rc))
+            pImage->offNextCluster = off;
+    }
+
+    return rc;
+}
+
+/**
+ * Converts the in memory L1 table into the on disk format.
+ *
+ * @returns nothing.
+ * @param   pImage      The image instance data.
+ * @param   paL1TblImg  Where to store the L1 table, must be cbL1Table bytes big.
+ */
+static void qcowL1TblConvertToImage(PQCOWIMAGE pImage, uint64_t *paL1TblImg)
+{
+    for (uint32_t i = 0; i < pImage->cL1TableEntries; i++)
+        paL1TblImg[i] = RT_H2BE_U64(qcowTblEntryFromOffset(pImage, pImage->paL1Table[i]));
 }
 
 /**
@@ -866,18 +1482,83 @@ static int qcowConvertToImageOffset(PQCOWIMAGE pImage, PVDIOCTX pIoCtx,
                         off &= ~QCOW_V1_COMPRESSED_FLAG;
                 }
 
-                *poffImage = off + offCluster;
-            }
-            else
-                rc = VERR_VD_BLOCK_FREE;
+                *poffImage = off + offCluster;
+            }
+            else
+                rc = VERR_VD_BLOCK_FREE;
+
+            qcowL2TblCacheEntryRelease(pL2Entry);
+        }
+    }
+
+    return rc;
+}
+
+
+/**
+ * Queries the tunables from the optional config interface.
+ *
+ * @returns VBox status code.
+ * @param   pImage    The image instance data.
+ */
+static int qcowConfigQuery(PQCOWIMAGE pImage)
+{
+    int rc = VINF_SUCCESS;
+    uint32_t cbL2CacheMax       = QCOW_L2_CACHE_MEMORY_DEF;
+    uint32_t cbRefcountCacheMax = QCOW_REFCOUNT_CACHE_MEMORY_DEF;
+
+    pImage->cPreallocClusters = QCOW_PREALLOC_CLUSTERS_DEF;
 
-            qcowL2TblCacheEntryRelease(pL2Entry);
-        }
+    pImage->pIfConfig = VDIfConfigGet(pImage->pVDIfsImage);
+    if (pImage->pIfConfig)
+    {
+        rc = VDCFGQueryU32Def(pImage->pIfConfig, "L2CacheSize", &cbL2CacheMax,
+                              QCOW_L2_CACHE_MEMORY_DEF);
+        if (RT_FAILURE(rc))
+            return vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                             N_("QCow: configuration error: failed to read L2CacheSize as U32"));
+
+        rc = VDCFGQueryU32Def(pImage->pIfConfig, "RefcountCacheSize", &cbRefcountCacheMax,
+                              QCOW_REFCOUNT_CACHE_MEMORY_DEF);
+        if (RT_FAILURE(rc))
+            return vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                             N_("QCow: configuration error: failed to read RefcountCacheSize as U32"));
+
+        rc = VDCFGQueryU32Def(pImage->pIfConfig, "PreallocClusters", &pImage->cPreallocClusters,
+                              QCOW_PREALLOC_CLUSTERS_DEF);
+        if (RT_FAILURE(rc))
+            return vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                             N_("QCow: configuration error: failed to read PreallocClusters as U32"));
     }
 
+    pImage->cbL2CacheMax       = cbL2CacheMax;
+    pImage->cbRefcountCacheMax = cbRefcountCacheMax;
     return rc;
 }
 
+/**
+ * Clamps the cache sizes and the number of clusters to reserve once the
+ * image geometry is known and resets the cluster reservation.
+ *
+ * @returns nothing.
+ * @param   pImage    The image instance data.
+ */
+static void qcowAllocStateInit(PQCOWIMAGE pImage)
+{
+    pImage->cbL2CacheMax       = RT_MAX(pImage->cbL2CacheMax, QCOW_CACHE_ENTRIES_MIN * (size_t)pImage->cbL2Table);
+    pImage->cbRefcountCacheMax = RT_MAX(pImage->cbRefcountCacheMax, QCOW_CACHE_ENTRIES_MIN * (size_t)pImage->cbCluster);
+
+    /* A run must leave room for the new refcount blocks and the L2 table allocated along with it. */
+    uint32_t cPreallocMax = QCOW_PREALLOC_CLUSTERS_MAX;
+    if (pImage->uVersion == 2)
+        cPreallocMax = RT_MIN(cPreallocMax, pImage->cRefcountsPerBlock - 4);
+    pImage->cPreallocClusters   = RT_MIN(RT_MAX(pImage->cPreallocClusters, 1), cPreallocMax);
+
+    pImage->offPreallocNext     = pImage->offNextCluster;
+    pImage->offLastAllocLogical = UINT64_MAX;
+    pImage->pClusterAllocRefcounts = NULL;
+    RTListInit(&pImage->ListClusterAllocWaiting);
+}
 
 /**
  * Internal. Flush image data to disk.
@@ -892,24 +1573,24 @@ static int qcowFlushImage(PQCOWIMAGE pImage)
     {
         QCowHeader Header;
 
-#if defined(RT_LITTLE_ENDIAN)
-        uint64_t *paL1TblImg = (uint64_t *)RTMemAllocZ(pImage->cbL1Table);
-        if (paL1TblImg)
+        /* Refcounts go first so the tables never reference clusters which are still free on disk. */
+        rc = qcowRefcountCacheCommit(pImage, NULL, NULL, NULL, NULL);
+        if (RT_SUCCESS(rc))
+            rc = qcowRefcountTableCommit(pImage, NULL, NULL, NULL, NULL);
+        if (RT_SUCCESS(rc))
         {
-            qcowTableConvertFromHostEndianess(paL1TblImg, pImage->paL1Table,
-                                              pImage->cL1TableEntries);
-            rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage,
-                                        pImage->offL1Table, paL1TblImg,
-                                        pImage->cbL1Table);
-            RTMemFree(paL1TblImg);
+            uint64_t *paL1TblImg = (uint64_t *)RTMemAllocZ(pImage->cbL1Table);
+            if (paL1TblImg)
+            {
+                qcowL1TblConvertToImage(pImage, paL1TblImg);
+                rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage,
+                                            pImage->offL1Table, paL1TblImg,
+                                            pImage->cbL1Table);
+                RTMemFree(paL1TblImg);
+            }
+            else
+                rc = VERR_NO_MEMORY;
         }
-        else
-            rc = VERR_NO_MEMORY;
-#else
-        /* Write L1 table directly. */
-        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, pImage->offL1Table,
-                                    pImage->paL1Table, pImage->cbL1Table);
-#endif
         if (RT_SUCCESS(rc))
         {
             /* Write header. */
@@ -941,25 +1622,27 @@ static int qcowFlushImageAsync(PQCOWIMAGE pImage, PVDIOCTX pIoCtx)
     {
         QCowHeader Header;
 
-#if defined(RT_LITTLE_ENDIAN)
-        uint64_t *paL1TblImg = (uint64_t *)RTMemAllocZ(pImage->cbL1Table);
-        if (paL1TblImg)
+        /*
+         * Cluster allocations write their refcount updates before linking the
+         * clusters, this only catches what is left over from failed allocations.
+         */
+        rc = qcowRefcountCacheCommit(pImage, pIoCtx, NULL, NULL, NULL);
+        if (RT_SUCCESS(rc))
+            rc = qcowRefcountTableCommit(pImage, pIoCtx, NULL, NULL, NULL);
+        if (RT_SUCCESS(rc))
         {
-            qcowTableConvertFromHostEndianess(paL1TblImg, pImage->paL1Table,
-                                             pImage->cL1TableEntries);
-            rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
-                                        pImage->offL1Table, paL1TblImg,
-                                        pImage->cbL1Table, pIoCtx, NULL, NULL);
-            RTMemFree(paL1TblImg);
+            uint64_t *paL1TblImg = (uint64_t *)RTMemAllocZ(pImage->cbL1Table);
+            if (paL1TblImg)
+            {
+                qcowL1TblConvertToImage(pImage, paL1TblImg);
+                rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                            pImage->offL1Table, paL1TblImg,
+                                            pImage->cbL1Table, pIoCtx, NULL, NULL);
+                RTMemFree(paL1TblImg);
+            }
+            else
+                rc = VERR_NO_MEMORY;
         }
-        else
-            rc = VERR_NO_MEMORY;
-#else
-        /* Write L1 table directly. */
-        rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
-                                    pImage->offL1Table, pImage->paL1Table,
-                                    pImage->cbL1Table, pIoCtx, NULL, NULL);
-#endif
         if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
         {
             /* Write header. */
@@ -993,7 +1676,11 @@ static int qcowFreeImage(PQCOWIMAGE pImage, bool fDelete)
         {
             /* No point updating the file that is deleted anyway. */
             if (!fDelete)
+            {
+                if (!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
+                    qcowClusterPreallocRelease(pImage);
                 qcowFlushImage(pImage);
+            }
 
             rc = vdIfIoIntFileClose(pImage->pIfIo, pImage->pStorage);
             pImage->pStorage = NULL;
@@ -1008,7 +1695,14 @@ static int qcowFreeImage(PQCOWIMAGE pImage, bool fDelete)
             pImage->pszBackingFilename = NULL;
         }
 
+        if (pImage->paRefcountTable)
+        {
+            RTMemFree(pImage->paRefcountTable);
+            pImage->paRefcountTable = NULL;
+        }
+
         qcowL2TblCacheDestroy(pImage);
+        qcowRefcountCacheDestroy(pImage);
 
         if (fDelete && pImage->pszFilename)
             vdIfIoIntFileDelete(pImage->pIfIo, pImage->pszFilename);
@@ -1031,6 +1725,15 @@ static int qcowOpenImage(PQCOWIMAGE pImage, unsigned uOpenFlags)
     pImage->pIfIo = VDIfIoIntGet(pImage->pVDIfsImage);
     AssertPtrReturn(pImage->pIfIo, VERR_INVALID_PARAMETER);
 
+    rc = qcowL2TblCacheCreate(pImage);
+    AssertRC(rc);
+    rc = qcowRefcountCacheCreate(pImage);
+    AssertRC(rc);
+
+    rc = qcowConfigQuery(pImage);
+    if (RT_FAILURE(rc))
+        goto out;
+
     /*
      * Open the image.
      */
@@ -1059,9 +1762,6 @@ static int qcowOpenImage(PQCOWIMAGE pImage, unsigned uOpenFlags)
             pImage->offNextCluster = RT_ALIGN_64(cbFile, 512); /* Align image to sector boundary. */
             Assert(pImage->offNextCluster >= cbFile);
 
-            rc = qcowL2TblCacheCreate(pImage);
-            AssertRC(rc);
-
             if (Header.u32Version == 1)
             {
                 if (!Header.Version.v1.u32CryptMethod)
@@ -1110,6 +1810,9 @@ static int qcowOpenImage(PQCOWIMAGE pImage, unsigned uOpenFlags)
                     pImage->offRefcountTable      = Header.Version.v2.u64RefcountTableOffset;
                     pImage->cbRefcountTable       = qcowCluster2Byte(pImage, Header.Version.v2.u32RefcountTableClusters);
                     pImage->cRefcountTableEntries = pImage->cbRefcountTable / sizeof(uint64_t);
+
+                    /* Clusters in QCOW2 images must be cluster aligned because refcounts are tracked per cluster. */
+                    pImage->offNextCluster        = RT_ALIGN_64(pImage->offNextCluster, pImage->cbCluster);
                 }
             }
             else
@@ -1167,6 +1870,7 @@ static int qcowOpenImage(PQCOWIMAGE pImage, unsigned uOpenFlags)
             if (RT_SUCCESS(rc))
             {
                 qcowTableMasksInit(pImage);
+                qcowAllocStateInit(pImage);
 
                 /* Allocate L1 table. */
                 pImage->paL1Table = (uint64_t *)RTMemAllocZ(pImage->cbL1Table);
@@ -1177,7 +1881,14 @@ static int qcowOpenImage(PQCOWIMAGE pImage, unsigned uOpenFlags)
                                                pImage->offL1Table, pImage->paL1Table,
                                                pImage->cbL1Table);
                     if (RT_SUCCESS(rc))
+                    {
                         qcowTableConvertToHostEndianess(pImage->paL1Table, pImage->cL1TableEntries);
+
+                        /* Strip the flags from the L2 table offsets, they are restored when the table is written. */
+                        if (pImage->uVersion == 2)
+                            for (uint32_t i = 0; i < pImage->cL1TableEntries; i++)
+                                pImage->paL1Table[i] &= QCOW_V2_TBL_OFFSET_MASK;
+                    }
                     else
                         rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
                                        N_("QCow: Reading the L1 table for image '%s' failed"),
@@ -1229,6 +1940,21 @@ static int qcowCreateImage(PQCOWIMAGE pImage, uint64_t cbSize,
     pImage->pIfIo = VDIfIoIntGet(pImage->pVDIfsImage);
     AssertPtrReturn(pImage->pIfIo, VERR_INVALID_PARAMETER);
 
+    rc = qcowL2TblCacheCreate(pImage);
+    if (RT_FAILURE(rc))
+    {
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("QCow: Failed to create L2 cache for image '%s'"),
+                       pImage->pszFilename);
+        goto out;
+    }
+
+    rc = qcowRefcountCacheCreate(pImage);
+    AssertRC(rc);
+
+    rc = qcowConfigQuery(pImage);
+    if (RT_FAILURE(rc))
+        goto out;
+
     /* Create image file. */
     fOpen = VDOpenFlagsToFileOpenFlags(pImage->uOpenFlags, true /* fCreate */);
     rc = vdIfIoIntFileOpen(pImage->pIfIo, pImage->pszFilename, fOpen, &pImage->pStorage);
@@ -1253,6 +1979,7 @@ static int qcowCreateImage(PQCOWIMAGE pImage, uint64_t cbSize,
     pImage->offBackingFilename = 0;
     pImage->offNextCluster     = RT_ALIGN_64(QCOW_V1_HDR_SIZE + pImage->cbL1Table, pImage->cbCluster);
     qcowTableMasksInit(pImage);
+    qcowAllocStateInit(pImage);
 
     /* Init L1 table. */
     pImage->paL1Table = (uint64_t *)RTMemAllocZ(pImage->cbL1Table);
@@ -1263,14 +1990,6 @@ static int qcowCreateImage(PQCOWIMAGE pImage, uint64_t cbSize,
         goto out;
     }
 
-    rc = qcowL2TblCacheCreate(pImage);
-    if (RT_FAILURE(rc))
-    {
-        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("QCow: Failed to create L2 cache for image '%s'"),
-                       pImage->pszFilename);
-        goto out;
-    }
-
     if (RT_SUCCESS(rc) && pfnProgress)
         pfnProgress(pvUser, uPercentStart + uPercentSpan * 98 / 100);
 
@@ -1299,21 +2018,27 @@ static int qcowAsyncClusterAllocRollback(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, PQC
 {
     int rc = VINF_SUCCESS;
 
+    /*
+     * The allocated clusters are accounted for in the refcounts already and stay
+     * allocated, the worst case is a leak of some clusters.
+     */
     switch (pClusterAlloc->enmAllocState)
     {
+        case QCOWCLUSTERASYNCALLOCSTATE_REFCOUNT_UPDATE:
+        case QCOWCLUSTERASYNCALLOCSTATE_REFCOUNT_LINK:
         case QCOWCLUSTERASYNCALLOCSTATE_L2_ALLOC:
         case QCOWCLUSTERASYNCALLOCSTATE_L2_LINK:
         {
             /* Assumption right now is that the L1 table is not modified if the link fails. */
-            rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, pClusterAlloc->offNextClusterOld);
             qcowL2TblCacheEntryRelease(pClusterAlloc->pL2Entry); /* Release L2 cache entry. */
-            qcowL2TblCacheEntryFree(pImage, pClusterAlloc->pL2Entry); /* Free it, it is not in the cache yet. */
+            if (pClusterAlloc->fL2TblNew)
+                qcowL2TblCacheEntryFree(pImage, pClusterAlloc->pL2Entry); /* Free it, it is not in the cache yet. */
+            break;
         }
         case QCOWCLUSTERASYNCALLOCSTATE_USER_ALLOC:
         case QCOWCLUSTERASYNCALLOCSTATE_USER_LINK:
         {
             /* Assumption right now is that the L2 table is not modified if the link fails. */
-            rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, pClusterAlloc->offNextClusterOld);
             qcowL2TblCacheEntryRelease(pClusterAlloc->pL2Entry); /* Release L2 cache entry. */
             break;
         }
@@ -1326,6 +2051,107 @@ static int qcowAsyncClusterAllocRollback(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, PQC
     return rc;
 }
 
+static DECLCALLBACK(int) qcowAsyncClusterAllocUpdate(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq);
+static int qcowAsyncClusterAllocRefcountCommit(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, PQCOWCLUSTERASYNCALLOC pClusterAlloc);
+
+/**
+ * Starts writing the refcount updates of a cluster allocation. Only one allocation
+ * writes refcount updates at a time, the clusters might be taken from a run whose
+ * refcounts are still being written by another allocation. The allocation waits
+ * for that one to complete in this case, so no cluster is linked before its
+ * refcount is on disk.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_VD_IOCTX_HALT if the allocation has to wait.
+ * @param   pImage           The image instance data.
+ * @param   pIoCtx           The I/O context.
+ * @param   pClusterAlloc    The cluster allocation.
+ */
+static int qcowAsyncClusterAllocRefcountStart(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, PQCOWCLUSTERASYNCALLOC pClusterAlloc)
+{
+    if (pImage->pClusterAllocRefcounts)
+    {
+        pClusterAlloc->pIoCtx = pIoCtx;
+        RTListAppend(&pImage->ListClusterAllocWaiting, &pClusterAlloc->NodeWaiting);
+        return VERR_VD_IOCTX_HALT;
+    }
+
+    pImage->pClusterAllocRefcounts = pClusterAlloc;
+    return qcowAsyncClusterAllocRefcountCommit(pImage, pIoCtx, pClusterAlloc);
+}
+
+/**
+ * Called when a cluster allocation finished writing its refcount updates,
+ * continues the allocations waiting for it.
+ *
+ * @returns nothing.
+ * @param   pImage           The image instance data.
+ * @param   pClusterAlloc    The cluster allocation.
+ * @param   rcCommit         Status of the refcount writes.
+ */
+static void qcowAsyncClusterAllocRefcountDone(PQCOWIMAGE pImage, PQCOWCLUSTERASYNCALLOC pClusterAlloc, int rcCommit)
+{
+    Assert(pImage->pClusterAllocRefcounts == pClusterAlloc); NOREF(pClusterAlloc);
+    pImage->pClusterAllocRefcounts = NULL;
+
+    /* The refcounts of the reserved clusters might not be on disk, don't hand them out anymore. */
+    if (RT_FAILURE(rcCommit))
+        pImage->offPreallocNext = pImage->offNextCluster;
+
+    while (   !pImage->pClusterAllocRefcounts
+           && !RTListIsEmpty(&pImage->ListClusterAllocWaiting))
+    {
+        PQCOWCLUSTERASYNCALLOC pClusterAllocWaiting = RTListGetFirst(&pImage->ListClusterAllocWaiting,
+                                                                     QCOWCLUSTERASYNCALLOC, NodeWaiting);
+        PVDIOCTX pIoCtx = pClusterAllocWaiting->pIoCtx;
+        int rc = rcCommit;
+
+        RTListNodeRemove(&pClusterAllocWaiting->NodeWaiting);
+
+        /* The waiting allocations might use clusters from the same run, they fail as well. */
+        if (RT_SUCCESS(rcCommit))
+        {
+            pImage->pClusterAllocRefcounts = pClusterAllocWaiting;
+            rc = qcowAsyncClusterAllocRefcountCommit(pImage, pIoCtx, pClusterAllocWaiting);
+        }
+        else
+            qcowAsyncClusterAllocRollback(pImage, pIoCtx, pClusterAllocWaiting);
+
+        /* Continue the halted I/O context, it waits for the transfers started above as usual. */
+        if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+            rc = VINF_SUCCESS;
+        pImage->pIfIo->pfnIoCtxCompleted(pImage->pIfIo->Core.pvUser, pIoCtx, rc, 0);
+    }
+}
+
+/**
+ * Writes the refcount updates of a cluster allocation, either the modified
+ * refcount blocks or the links of new blocks in the refcount table depending
+ * on the state, and advances the allocation once all writes completed.
+ *
+ * @returns VBox status code.
+ * @param   pImage           The image instance data.
+ * @param   pIoCtx           The I/O context.
+ * @param   pClusterAlloc    The cluster allocation.
+ */
+static int qcowAsyncClusterAllocRefcountCommit(PQCOWIMAGE pImage, PVDIOCTX pIoCtx, PQCOWCLUSTERASYNCALLOC pClusterAlloc)
+{
+    int rc;
+
+    /* Hold a reference until all writes are issued, dropped by the update below. */
+    pClusterAlloc->cWritesPending = 1;
+    if (pClusterAlloc->enmAllocState == QCOWCLUSTERASYNCALLOCSTATE_REFCOUNT_UPDATE)
+        rc = qcowRefcountCacheCommit(pImage, pIoCtx, qcowAsyncClusterAllocUpdate, pClusterAlloc,
+                                     &pClusterAlloc->cWritesPending);
+    else
+        rc = qcowRefcountTableCommit(pImage, pIoCtx, qcowAsyncClusterAllocUpdate, pClusterAlloc,
+                                     &pClusterAlloc->cWritesPending);
+    if (RT_FAILURE(rc))
+        pClusterAlloc->rcCommit = rc;
+
+    return qcowAsyncClusterAllocUpdate(pImage, pIoCtx, pClusterAlloc, VINF_SUCCESS);
+}
+
 /**
  * Updates the state of the async cluster allocation.
  *
@@ -1341,16 +2167,77 @@ static DECLCALLBACK(int) qcowAsyncClusterAllocUpdate(void *pBackendData, PVDIOCT
     PQCOWIMAGE pImage = (PQCOWIMAGE)pBackendData;
     PQCOWCLUSTERASYNCALLOC pClusterAlloc = (PQCOWCLUSTERASYNCALLOC)pvUser;
 
-    if (RT_FAILURE(rcReq))
+    if (   RT_FAILURE(rcReq)
+        && pClusterAlloc->enmAllocState != QCOWCLUSTERASYNCALLOCSTATE_REFCOUNT_UPDATE
+        && pClusterAlloc->enmAllocState != QCOWCLUSTERASYNCALLOCSTATE_REFCOUNT_LINK)
         return qcowAsyncClusterAllocRollback(pImage, pIoCtx, pClusterAlloc);
 
     AssertPtr(pClusterAlloc->pL2Entry);
 
     switch (pClusterAlloc->enmAllocState)
     {
+        case QCOWCLUSTERASYNCALLOCSTATE_REFCOUNT_UPDATE:
+        case QCOWCLUSTERASYNCALLOCSTATE_REFCOUNT_LINK:
+        {
+            if (RT_FAILURE(rcReq))
+                pClusterAlloc->rcCommit = rcReq;
+
+            Assert(pClusterAlloc->cWritesPending > 0);
+            if (--pClusterAlloc->cWritesPending)
+            {
+                /* Wait for the remaining refcount writes. */
+                rc = VERR_VD_ASYNC_IO_IN_PROGRESS;
+                break;
+            }
+
+            if (RT_FAILURE(pClusterAlloc->rcCommit))
+            {
+                rc = pClusterAlloc->rcCommit;
+                qcowAsyncClusterAllocRefcountDone(pImage, pClusterAlloc, rc);
+                qcowAsyncClusterAllocRollback(pImage, pIoCtx, pClusterAlloc);
+                break;
+            }
+
+            if (pClusterAlloc->enmAllocState == QCOWCLUSTERASYNCALLOCSTATE_REFCOUNT_UPDATE)
+            {
+                /* The refcount blocks are on disk, link new ones into the refcount table. */
+                pClusterAlloc->enmAllocState = QCOWCLUSTERASYNCALLOCSTATE_REFCOUNT_LINK;
+                rc = qcowAsyncClusterAllocRefcountCommit(pImage, pIoCtx, pClusterAlloc);
+                break;
+            }
+
+            qcowAsyncClusterAllocRefcountDone(pImage, pClusterAlloc, VINF_SUCCESS);
+
+            /* Refcounts are updated, write the L2 table or the data. */
+            if (pClusterAlloc->fL2TblNew)
+            {
+                pClusterAlloc->enmAllocState = QCOWCLUSTERASYNCALLOCSTATE_L2_ALLOC;
+                rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                            pClusterAlloc->pL2Entry->offL2Tbl, pClusterAlloc->pL2Entry->paL2Tbl,
+                                            pImage->cbL2Table, pIoCtx,
+                                            qcowAsyncClusterAllocUpdate, pClusterAlloc);
+            }
+            else
+            {
+                pClusterAlloc->enmAllocState = QCOWCLUSTERASYNCALLOCSTATE_USER_ALLOC;
+                rc = vdIfIoIntFileWriteUser(pImage->pIfIo, pImage->pStorage,
+                                            pClusterAlloc->offClusterNew, pIoCtx, pClusterAlloc->cbToWrite,
+                                            qcowAsyncClusterAllocUpdate, pClusterAlloc);
+            }
+            if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+                break;
+            else if (RT_FAILURE(rc))
+            {
+                qcowAsyncClusterAllocRollback(pImage, pIoCtx, pClusterAlloc);
+                break;
+            }
+
+            rc = qcowAsyncClusterAllocUpdate(pImage, pIoCtx, pClusterAlloc, rc);
+            break;
+        }
         case QCOWCLUSTERASYNCALLOCSTATE_L2_ALLOC:
         {
-            uint64_t offUpdateLe = RT_H2BE_U64(pClusterAlloc->pL2Entry->offL2Tbl);
+            uint64_t offUpdateLe = RT_H2BE_U64(qcowTblEntryFromOffset(pImage, pClusterAlloc->pL2Entry->offL2Tbl));
 
             /* Update the link in the on disk L1 table now. */
             pClusterAlloc->enmAllocState = QCOWCLUSTERASYNCALLOCSTATE_L2_LINK;
@@ -1370,33 +2257,27 @@ static DECLCALLBACK(int) qcowAsyncClusterAllocUpdate(void *pBackendData, PVDIOCT
         }
         case QCOWCLUSTERASYNCALLOCSTATE_L2_LINK:
         {
-            /* L2 link updated in L1 , save L2 entry in cache and allocate new user data cluster. */
-            uint64_t offData = qcowClusterAllocate(pImage, 1);
-
-            /* Update the link in the in memory L1 table now. */
+            /* L2 link updated in L1 , save L2 entry in cache and write the data to the cluster allocated along with it. */
             pImage->paL1Table[pClusterAlloc->idxL1] = pClusterAlloc->pL2Entry->offL2Tbl;
             qcowL2TblCacheEntryInsert(pImage, pClusterAlloc->pL2Entry);
-
-            pClusterAlloc->enmAllocState     = QCOWCLUSTERASYNCALLOCSTATE_USER_ALLOC;
-            pClusterAlloc->offNextClusterOld = offData;
-            pClusterAlloc->offClusterNew     = offData;
+            pClusterAlloc->fL2TblNew     = false;
+            pClusterAlloc->enmAllocState = QCOWCLUSTERASYNCALLOCSTATE_USER_ALLOC;
 
             /* Write data. */
             rc = vdIfIoIntFileWriteUser(pImage->pIfIo, pImage->pStorage,
-                                        offData, pIoCtx, pClusterAlloc->cbToWrite,
+                                        pClusterAlloc->offClusterNew, pIoCtx, pClusterAlloc->cbToWrite,
                                         qcowAsyncClusterAllocUpdate, pClusterAlloc);
             if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
                 break;
             else if (RT_FAILURE(rc))
             {
                 qcowAsyncClusterAllocRollback(pImage, pIoCtx, pClusterAlloc);
-                RTMemFree(pClusterAlloc);
                 break;
             }
         }
         case QCOWCLUSTERASYNCALLOCSTATE_USER_ALLOC:
         {
-            uint64_t offUpdateLe = RT_H2BE_U64(pClusterAlloc->offClusterNew);
+            uint64_t offUpdateLe = RT_H2BE_U64(qcowTblEntryFromOffset(pImage, pClusterAlloc->offClusterNew));
 
             pClusterAlloc->enmAllocState = QCOWCLUSTERASYNCALLOCSTATE_USER_LINK;
 
@@ -1410,14 +2291,13 @@ static DECLCALLBACK(int) qcowAsyncClusterAllocUpdate(void *pBackendData, PVDIOCT
             else if (RT_FAILURE(rc))
             {
                 qcowAsyncClusterAllocRollback(pImage, pIoCtx, pClusterAlloc);
-                RTMemFree(pClusterAlloc);
                 break;
             }
         }
         case QCOWCLUSTERASYNCALLOCSTATE_USER_LINK:
         {
             /* Everything done without errors, signal completion. */
-            pClusterAlloc->pL2Entry->paL2Tbl[pClusterAlloc->idxL2] = pClusterAlloc->offClusterNew;
+            pClusterAlloc->pL2Entry->paL2Tbl[pClusterAlloc->idxL2] = qcowTblEntryFromOffset(pImage, pClusterAlloc->offClusterNew);
             qcowL2TblCacheEntryRelease(pClusterAlloc->pL2Entry);
             RTMemFree(pClusterAlloc);
             rc = VINF_SUCCESS;
@@ -1777,113 +2657,94 @@ static int qcowWrite(void *pBackendData, uint64_t uOffset, size_t cbToWrite,
             && !(fWrite & VD_WRITE_NO_ALLOC))
         {
             PQCOWL2CACHEENTRY pL2Entry = NULL;
+            PQCOWCLUSTERASYNCALLOC pClusterAlloc = NULL;
+            uint32_t cL2Clusters = 0;
+            uint32_t cPrealloc = 1;
+            uint64_t offAlloc = 0;
 
             /* Full cluster write to previously unallocated cluster.
              * Allocate cluster and write data. */
             Assert(!offCluster);
 
+            /* Reserve a whole run of clusters for sequential writes, the following ones are placed right behind. */
+            if (uOffset == pImage->offLastAllocLogical + pImage->cbCluster)
+                cPrealloc = pImage->cPreallocClusters;
+
             do
             {
-                uint64_t idxUpdateLe = 0;
-
                 /* Check if we have to allocate a new cluster for L2 tables. */
                 if (!pImage->paL1Table[idxL1])
                 {
-                    uint64_t offL2Tbl;
-                    PQCOWCLUSTERASYNCALLOC pL2ClusterAlloc = NULL;
-
-                    /* Allocate new async cluster allocation state. */
-                    pL2ClusterAlloc = (PQCOWCLUSTERASYNCALLOC)RTMemAllocZ(sizeof(QCOWCLUSTERASYNCALLOC));
-                    if (RT_UNLIKELY(!pL2ClusterAlloc))
-                    {
-                        rc = VERR_NO_MEMORY;
-                        break;
-                    }
-
+                    cL2Clusters = (uint32_t)qcowByte2Cluster(pImage, pImage->cbL2Table);
                     pL2Entry = qcowL2TblCacheEntryAlloc(pImage);
                     if (!pL2Entry)
                     {
                         rc = VERR_NO_MEMORY;
-                        RTMemFree(pL2ClusterAlloc);
-                        break;
-                    }
-
-                    offL2Tbl = qcowClusterAllocate(pImage, qcowByte2Cluster(pImage, pImage->cbL2Table));
-                    pL2Entry->offL2Tbl = offL2Tbl;
-                    memset(pL2Entry->paL2Tbl, 0, pImage->cbL2Table);
-
-                    pL2ClusterAlloc->enmAllocState     = QCOWCLUSTERASYNCALLOCSTATE_L2_ALLOC;
-                    pL2ClusterAlloc->offNextClusterOld = offL2Tbl;
-                    pL2ClusterAlloc->offClusterNew     = offL2Tbl;
-                    pL2ClusterAlloc->idxL1             = idxL1;
-                    pL2ClusterAlloc->idxL2             = idxL2;
-                    pL2ClusterAlloc->cbToWrite         = cbToWrite;
-                    pL2ClusterAlloc->pL2Entry          = pL2Entry;
-
-                    /*
-                     * Write the L2 table first and link to the L1 table afterwards.
-                     * If something unexpected happens the worst case which can happen
-                     * is a leak of some clusters.
-                     */
-                    rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
-                                                offL2Tbl, pL2Entry->paL2Tbl, pImage->cbL2Table, pIoCtx,
-                                                qcowAsyncClusterAllocUpdate, pL2ClusterAlloc);
-                    if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
-                        break;
-                    else if (RT_FAILURE(rc))
-                    {
-                        RTMemFree(pL2ClusterAlloc);
-                        qcowL2TblCacheEntryFree(pImage, pL2Entry);
                         break;
                     }
-
-                    rc = qcowAsyncClusterAllocUpdate(pImage, pIoCtx, pL2ClusterAlloc, rc);
                 }
                 else
                 {
                     rc = qcowL2TblCacheFetch(pImage, pIoCtx, pImage->paL1Table[idxL1],
                                              &pL2Entry);
-                    if (RT_SUCCESS(rc))
-                    {
-                        PQCOWCLUSTERASYNCALLOC pDataClusterAlloc = NULL;
-
-                        /* Allocate new async cluster allocation state. */
-                        pDataClusterAlloc = (PQCOWCLUSTERASYNCALLOC)RTMemAllocZ(sizeof(QCOWCLUSTERASYNCALLOC));
-                        if (RT_UNLIKELY(!pDataClusterAlloc))
-                        {
-                            rc = VERR_NO_MEMORY;
-                            break;
-                        }
-
-                        /* Allocate new cluster for the data. */
-                        uint64_t offData = qcowClusterAllocate(pImage, 1);
-
-                        pDataClusterAlloc->enmAllocState     = QCOWCLUSTERASYNCALLOCSTATE_USER_ALLOC;
-                        pDataClusterAlloc->offNextClusterOld = offData;
-                        pDataClusterAlloc->offClusterNew     = offData;
-                        pDataClusterAlloc->idxL1             = idxL1;
-                        pDataClusterAlloc->idxL2             = idxL2;
-                        pDataClusterAlloc->cbToWrite         = cbToWrite;
-                        pDataClusterAlloc->pL2Entry          = pL2Entry;
-
-                        /* Write data. */
-                        rc = vdIfIoIntFileWriteUser(pImage->pIfIo, pImage->pStorage,
-                                                    offData, pIoCtx, cbToWrite,
-                                                    qcowAsyncClusterAllocUpdate, pDataClusterAlloc);
-                        if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
-                            break;
-                        else if (RT_FAILURE(rc))
-                        {
-                            RTMemFree(pDataClusterAlloc);
-                            break;
-                        }
-
-                        rc = qcowAsyncClusterAllocUpdate(pImage, pIoCtx, pDataClusterAlloc, rc);
-                    }
+                    if (RT_FAILURE(rc))
+                        break;
+                }
+
+                /* Allocate new async cluster allocation state. */
+                pClusterAlloc = (PQCOWCLUSTERASYNCALLOC)RTMemAllocZ(sizeof(QCOWCLUSTERASYNCALLOC));
+                if (RT_UNLIKELY(!pClusterAlloc))
+                {
+                    rc = VERR_NO_MEMORY;
+                    break;
+                }
+
+                /*
+                 * Allocate the L2 table and the data cluster in one go, this is the only
+                 * step which might have to be restarted because a refcount block must be read.
+                 */
+                rc = qcowClusterAllocate(pImage, pIoCtx, cL2Clusters + 1,
+                                         RT_MAX(cPrealloc, cL2Clusters + 1), &offAlloc);
+                if (RT_FAILURE(rc))
+                    break;
+
+                if (cL2Clusters)
+                {
+                    pL2Entry->offL2Tbl = offAlloc;
+                    memset(pL2Entry->paL2Tbl, 0, pImage->cbL2Table);
                 }
 
+                pClusterAlloc->enmAllocState = QCOWCLUSTERASYNCALLOCSTATE_REFCOUNT_UPDATE;
+                pClusterAlloc->fL2TblNew     = cL2Clusters != 0;
+                pClusterAlloc->offClusterNew = offAlloc + qcowCluster2Byte(pImage, cL2Clusters);
+                pClusterAlloc->idxL1         = idxL1;
+                pClusterAlloc->idxL2         = idxL2;
+                pClusterAlloc->cbToWrite     = cbToWrite;
+                pClusterAlloc->pL2Entry      = pL2Entry;
+                pImage->offLastAllocLogical  = uOffset;
+
+                /*
+                 * The refcount updates are written first, then the L2 table (if new)
+                 * which is linked to the L1 table afterwards, then the data which is
+                 * linked to the L2 table last. Allocations taking clusters from a run
+                 * whose refcounts are still being written wait for them, so if something
+                 * unexpected happens the worst case is a leak of some clusters.
+                 */
+                rc = qcowAsyncClusterAllocRefcountStart(pImage, pIoCtx, pClusterAlloc);
+                pClusterAlloc = NULL;
+                pL2Entry = NULL;
             } while (0);
 
+            /* Cleanup if the allocation didn't even start. */
+            if (pClusterAlloc)
+                RTMemFree(pClusterAlloc);
+            if (pL2Entry)
+            {
+                qcowL2TblCacheEntryRelease(pL2Entry);
+                if (cL2Clusters)
+                    qcowL2TblCacheEntryFree(pImage, pL2Entry);
+            }
+
             *pcbPreRead = 0;
             *pcbPostRead = 0;
         }
@@ -2433,13 +3294,20 @@ static int qcowSetParentFilename(void *pBackendData, const char *pszParentFilena
                 if (!pImage->offBackingFilename)
                 {
                     /* Allocate new cluster. */
-                    uint64_t offData = qcowClusterAllocate(pImage, 1);
-
-                    Assert((offData & UINT32_MAX) == offData);
-                    pImage->offBackingFilename = (uint32_t)offData;
-                    pImage->cbBackingFilename  = (uint32_t)strlen(pszParentFilename);
-                    rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage,
-                                              offData + pImage->cbCluster);
+                    uint64_t offData = 0;
+                    rc = qcowClusterAllocate(pImage, NULL, 1, 1, &offData);
+                    if (RT_SUCCESS(rc))
+                        rc = qcowRefcountCacheCommit(pImage, NULL, NULL, NULL, NULL);
+                    if (RT_SUCCESS(rc))
+                        rc = qcowRefcountTableCommit(pImage, NULL, NULL, NULL, NULL);
+                    if (RT_SUCCESS(rc))
+                    {
+                        Assert((offData & UINT32_MAX) == offData);
+                        pImage->offBackingFilename = (uint32_t)offData;
+                        pImage->cbBackingFilename  = (uint32_t)strlen(pszParentFilename);
+                        rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage,
+                                                  offData + pImage->cbCluster);
+                    }
                 }
 
                 if (RT_SUCCESS(rc))
@@ -2459,6 +3327,101 @@ static int qcowSetParentFilename(void *pBackendData, const char *pszParentFilena
 
 
 
+/** @copydoc VBOXHDDBACKEND::pfnQueryAllocatedRanges */
+static int qcowQueryAllocatedRanges(void *pBackendData, uint64_t uOffset,
+                                    uint64_t cbRange, PRTRANGE paRanges,
+                                    unsigned cRanges, unsigned *pcRanges)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu cbRange=%llu paRanges=%#p cRanges=%u pcRanges=%#p\n",
+                 pBackendData, uOffset, cbRange, paRanges, cRanges, pcRanges));
+    PQCOWIMAGE pImage = (PQCOWIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+    unsigned cRangesUsed = 0;
+    uint64_t *paL2TblTmp = NULL;
+
+    AssertPtr(pImage);
+
+    uint64_t offEnd = RT_MIN(uOffset + cbRange, pImage->cbSize);
+    uint64_t offCur = uOffset;
+
+    while (   offCur < offEnd
+           && RT_SUCCESS(rc))
+    {
+        uint32_t idxL1, idxL2, offCluster;
+
+        qcowConvertLogicalOffset(pImage, offCur, &idxL1, &idxL2, &offCluster);
+
+        uint64_t offL2End = RT_MIN(((uint64_t)idxL1 + 1) << pImage->cL1Shift, offEnd);
+
+        /* An unused L1 entry means there is no data in the whole range covered by the L2 table. */
+        if (!pImage->paL1Table[idxL1])
+        {
+            offCur = offL2End;
+            continue;
+        }
+
+        /*
+         * Use the cached L2 table if available, read it synchronously into
+         * a temporary buffer otherwise to avoid evicting hot tables.
+         */
+        uint64_t *paL2Tbl;
+        PQCOWL2CACHEENTRY pL2Entry = qcowL2TblCacheRetain(pImage, pImage->paL1Table[idxL1]);
+        if (pL2Entry)
+            paL2Tbl = pL2Entry->paL2Tbl;
+        else
+        {
+            if (!paL2TblTmp)
+            {
+                paL2TblTmp = (uint64_t *)RTMemAlloc(pImage->cbL2Table);
+                if (!paL2TblTmp)
+                {
+                    rc = VERR_NO_MEMORY;
+                    break;
+                }
+            }
+
+            rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage,
+                                       pImage->paL1Table[idxL1], paL2TblTmp,
+                                       pImage->cbL2Table);
+            if (RT_FAILURE(rc))
+                break;
+#if defined(RT_LITTLE_ENDIAN)
+            qcowTableConvertToHostEndianess(paL2TblTmp, pImage->cL2TableEntries);
+#endif
+            paL2Tbl = paL2TblTmp;
+        }
+
+        while (offCur < offL2End)
+        {
+            uint64_t offClusterEnd = RT_MIN(offCur - offCluster + pImage->cbCluster, offL2End);
+
+            /* Compressed clusters count as allocated as well. */
+            if (   paL2Tbl[idxL2]
+                && !vdPluginRangeAppend(paRanges, cRanges, &cRangesUsed,
+                                        offCur, (size_t)(offClusterEnd - offCur)))
+            {
+                rc = VERR_BUFFER_OVERFLOW;
+                break;
+            }
+
+            offCur = offClusterEnd;
+            offCluster = 0;
+            idxL2++;
+        }
+
+        if (pL2Entry)
+            qcowL2TblCacheEntryRelease(pL2Entry);
+    }
+
+    if (paL2TblTmp)
+        RTMemFree(paL2TblTmp);
+
+    *pcRanges = cRangesUsed;
+
+    LogFlowFunc(("returns %Rrc (cRanges=%u)\n", rc, cRangesUsed));
+    return rc;
+}
+
 VBOXHDDBACKEND g_QCowBackend =
 {
     /* pszBackendName */
@@ -2470,7 +3433,7 @@ VBOXHDDBACKEND g_QCowBackend =
     /* paFileExtensions */
     s_aQCowFileExtensions,
     /* paConfigInfo */
-    NULL,
+    s_qcowConfigInfo,
     /* hPlugin */
     NIL_RTLDRMOD,
     /* pfnCheckIfValid */
@@ -2554,5 +3517,9 @@ VBOXHDDBACKEND g_QCowBackend =
     /* pfnResize */
     NULL,
     /* pfnRepair */
+    NULL,
+    /* pfnQueryAllocatedRanges */
+    qcowQueryAllocatedRanges,
+    /* pfnDefragment */
     NULL
 };
@@ -2597,6 +2597,69 @@ static int qedResize(void *pBackendData, uint64_t cbSize,
 }
 
 
+/** @copydoc VBOXHDDBACKEND::pfnQueryAllocatedRanges */
+static int qedQueryAllocatedRanges(void *pBackendData, uint64_t uOffset,
+                                   uint64_t cbRange, PRTRANGE paRanges,
+                                   unsigned cRanges, unsigned *pcRanges)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu cbRange=%llu paRanges=%#p cRanges=%u pcRanges=%#p\n",
+                 pBackendData, uOffset, cbRange, paRanges, cRanges, pcRanges));
+    PQEDIMAGE pImage = (PQEDIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+    unsigned cRangesUsed = 0;
+
+    AssertPtr(pImage);
+
+    uint64_t offEnd = RT_MIN(uOffset + cbRange, pImage->cbSize);
+    uint64_t offCur = uOffset;
+
+    while (   offCur < offEnd
+           && RT_SUCCESS(rc))
+    {
+        uint32_t idxL1, idxL2, offCluster;
+
+        qedConvertLogicalOffset(pImage, offCur, &idxL1, &idxL2, &offCluster);
+
+        uint64_t offL2End = RT_MIN(((uint64_t)idxL1 + 1) << pImage->cL1Shift, offEnd);
+
+        /* An unused L1 entry means there is no data in the whole range covered by the L2 table. */
+        if (!pImage->paL1Table[idxL1])
+        {
+            offCur = offL2End;
+            continue;
+        }
+
+        PQEDL2CACHEENTRY pL2Entry;
+        rc = qedL2TblCacheFetch(pImage, pImage->paL1Table[idxL1], &pL2Entry);
+        if (RT_FAILURE(rc))
+            break;
+
+        while (offCur < offL2End)
+        {
+            uint64_t offClusterEnd = RT_MIN(offCur - offCluster + pImage->cbCluster, offL2End);
+
+            if (   pL2Entry->paL2Tbl[idxL2]
+                && !vdPluginRangeAppend(paRanges, cRanges, &cRangesUsed,
+                                        offCur, (size_t)(offClusterEnd - offCur)))
+            {
+                rc = VERR_BUFFER_OVERFLOW;
+                break;
+            }
+
+            offCur = offClusterEnd;
+            offCluster = 0;
+            idxL2++;
+        }
+
+        qedL2TblCacheEntryRelease(pL2Entry);
+    }
+
+    *pcRanges = cRangesUsed;
+
+    LogFlowFunc(("returns %Rrc (cRanges=%u)\n", rc, cRangesUsed));
+    return rc;
+}
+
 VBOXHDDBACKEND g_QedBackend =
 {
     /* pszBackendName */
@@ -2692,5 +2755,9 @@ VBOXHDDBACKEND g_QedBackend =
     /* pfnResize */
     qedResize,
     /* pfnRepair */
+    NULL,
+    /* pfnQueryAllocatedRanges */
+    qedQueryAllocatedRanges,
+    /* pfnDefragment */
     NULL
 };
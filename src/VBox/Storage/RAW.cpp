@@ -1221,5 +1221,9 @@ VBOXHDDBACKEND g_RawBackend =
     /* pfnResize */
     NULL,
     /* pfnRepair */
+    NULL,
+    /* pfnQueryAllocatedRanges */
+    NULL,
+    /* pfnDefragment */
     NULL
 };
@@ -27,6 +27,8 @@
 #include <iprt/alloc.h>
 #include <iprt/file.h>
 #include <iprt/asm.h>
+#include <iprt/avl.h>
+#include <iprt/list.h>
 
 /*******************************************************************************
 * On disk data structures                                                      *
@@ -83,7 +85,7 @@ AssertCompileSize(VciHdr, 2 * VCI_BLOCK_SIZE);
 /** VCI signature to identify a valid image. */
 #define VCI_HDR_SIGNATURE          UINT32_C(0x00494356) /* \0ICV */
 /** Current version we support. */
-#define VCI_HDR_VERSION            UINT32_C(0x00000001)
+#define VCI_HDR_VERSION            UINT32_C(0x00000002)
 
 /** Value for an unclean cache shutdown. */
 #define VCI_HDR_UNCLEAN_SHUTDOWN   UINT8_C(0x01)
@@ -107,7 +109,7 @@ typedef struct VciCacheExtent
     uint64_t    u64ExtentPrev;
     /** Block address of the next extent in the LRU list. */
     uint64_t    u64ExtentNext;
-    /** Flags (for compression, encryption etc.) - currently unused and should be always 0. */
+    /** Flags, combination of VCI_CACHE_EXTENT_FLAGS_*. */
     uint8_t     u8Flags;
     /** Reserved */
     uint8_t     u8Reserved;
@@ -121,6 +123,9 @@ typedef struct VciCacheExtent
 #pragma pack()
 AssertCompileSize(VciCacheExtent, 38);
 
+/** Extent flags: The data was not written back to the image yet. */
+#define VCI_CACHE_EXTENT_FLAGS_DIRTY UINT8_C(0x01)
+
 /**
  * On disk representation of an internal node.
  *
@@ -203,6 +208,17 @@ typedef uint8_t VciBlkMapEnt;
 *   Constants And Macros, Structures and Typedefs                              *
 *******************************************************************************/
 
+/** Maximum number of blocks a single cache extent covers. */
+#define VCI_EXTENT_BLOCKS_MAX      VCI_BYTE2BLOCK(_1M)
+/** Maximum number of blocks returned as one dirty range. */
+#define VCI_DIRTY_RANGE_BLOCKS_MAX (4 * VCI_EXTENT_BLOCKS_MAX)
+/** Number of clean extents evicted at once when the cache runs out of space. */
+#define VCI_EVICT_BATCH            32
+/** Maximum depth of the B+-Tree accepted when loading it. */
+#define VCI_TREE_DEPTH_MAX         8
+/** Size of a tree node in blocks. */
+#define VCI_TREE_NODE_BLOCKS       VCI_BYTE2BLOCK(sizeof(VciTreeNode))
+
 /**
  * Block range descriptor.
  */
@@ -244,88 +260,60 @@ typedef struct VCIBLKMAP
 typedef VCIBLKMAP *PVCIBLKMAP;
 
 /**
- * B+-Tree node header.
- */
-typedef struct VCITREENODE
-{
-    /** Type of the node (VCI_TREE_NODE_TYPE_*). */
-    uint8_t             u8Type;
-    /** Block address where the node is stored. */
-    uint64_t            u64BlockAddr;
-    /** Pointer to the parent. */
-    struct VCITREENODE *pParent;
-} VCITREENODE, *PVCITREENODE;
-
-/**
- * B+-Tree node pointer.
+ * A in memory cache extent.
  */
-typedef struct VCITREENODEPTR
+typedef struct VCIEXTENT
 {
-    /** Flag whether the node is in memory or still on the disk. */
-    bool         fInMemory;
-    /** Type dependent data. */
-    union
-    {
-        /** Pointer to a in memory node. */
-        PVCITREENODE pNode;
-        /** Start block address of the node. */
-        uint64_t     offAddrBlockNode;
-    } u;
-} VCITREENODEPTR, *PVCITREENODEPTR;
+    /** AVL tree core, the key range covers the cached blocks of the virtual disk. */
+    AVLRU64NODECORE Core;
+    /** Node in the LRU list, most recently used extents first. */
+    RTLISTNODE      NodeLru;
+    /** First block in the image where the data is stored. */
+    uint64_t        u64BlockAddr;
+    /** Flag whether the data was not written back to the image yet. */
+    bool            fDirty;
+    /** Flag whether the extent is recorded as dirty in the tree on the disk.
+     * The blocks can't be reused before the next checkpoint in that case. */
+    bool            fDirtyOnDisk;
+    /** Flag whether the data was handed out for writing it back to the image. */
+    bool            fWriteBack;
+} VCIEXTENT, *PVCIEXTENT;
 
 /**
- * Internal node.
+ * State of a data write to the cache which is in progress.
  */
-typedef struct VCINODEINTERNAL
+typedef struct VCIWRITE
 {
-    /** First block of cached data the internal node represents. */
-    uint64_t       u64BlockOffset;
-    /** Number of blocks the internal node represents. */
-    uint32_t       u32Blocks;
-    /** Pointer to the child node. */
-    VCITREENODEPTR PtrChild;
-} VCINODEINTERNAL, *PVCINODEINTERNAL;
+    /** The new extent, inserted into the tree once the data was written. */
+    PVCIEXTENT   pExtent;
+    /** Spare extent in case an existing extent must be split when the new one
+     * is inserted, so completing the write can't fail. */
+    PVCIEXTENT   pExtentSpare;
+} VCIWRITE, *PVCIWRITE;
 
 /**
- * A in memory internal B+-tree node.
+ * Range of blocks which can be reused only after the next checkpoint.
  */
-typedef struct VCITREENODEINT
+typedef struct VCIBLKRANGE
 {
-    /** Node core. */
-    VCITREENODE     Core;
-    /** Number of used nodes. */
-    unsigned        cUsedNodes;
-    /** Array of internal nodes. */
-    VCINODEINTERNAL aIntNodes[VCI_TREE_INTERNAL_NODES_PER_NODE];
-} VCITREENODEINT, *PVCITREENODEINT;
+    /** Start address of the range. */
+    uint64_t     offAddrStart;
+    /** Number of blocks in the range. */
+    uint64_t     cBlocks;
+} VCIBLKRANGE, *PVCIBLKRANGE;
 
 /**
- * A in memory cache extent.
+ * Node of the B+-Tree written during a checkpoint.
  */
-typedef struct VCICACHEEXTENT
+typedef struct VCICOMMITNODE
 {
-    /** First block of cached data the extent represents. */
-    uint64_t    u64BlockOffset;
-    /** Number of blocks the extent represents. */
-    uint32_t    u32Blocks;
-    /** First block in the image where the data is stored. */
-    uint64_t    u64BlockAddr;
-} VCICACHEEXTENT, *PVCICACHEEXTENT;
-
-/**
- * A in memory leaf B+-tree node.
- */
-typedef struct VCITREENODELEAF
-{
-    /** Node core. */
-    VCITREENODE             Core;
-    /** Next leaf node in the list. */
-    struct VCITREENODELEAF *pNext;
-    /** Number of used nodes. */
-    unsigned                cUsedNodes;
-    /** The extents in the node. */
-    VCICACHEEXTENT          aExtents[VCI_TREE_EXTENTS_PER_NODE];
-} VCITREENODELEAF, *PVCITREENODELEAF;
+    /** Block address of the node. */
+    uint64_t     u64BlockAddr;
+    /** First block of cached data the node represents. */
+    uint64_t     u64BlockFirst;
+    /** Last block of cached data the node represents. */
+    uint64_t     u64BlockLast;
+} VCICOMMITNODE, *PVCICOMMITNODE;
 
 /**
  * VCI image data structure.
@@ -352,17 +340,73 @@ typedef struct VCICACHE
     unsigned          uImageFlags;
     /** Total size of the image. */
     uint64_t          cbSize;
+    /** Cache type (VCI_HDR_CACHE_TYPE_*). */
+    uint32_t          u32CacheType;
+    /** Flag whether the header was marked as in use and must be cleared on close. */
+    bool              fHdrUnclean;
 
-    /** Offset of the B+-Tree in the image in bytes. */
+    /** Offset of the B+-Tree root in the image in blocks. */
     uint64_t          offTreeRoot;
-    /** Pointer to the root node of the B+-Tree. */
-    PVCITREENODE      pRoot;
-    /** Offset to the block allocation bitmap in bytes. */
+    /** Block addresses of all nodes of the B+-Tree on the disk. */
+    uint64_t         *pau64TreeNodes;
+    /** Number of nodes of the B+-Tree on the disk. */
+    unsigned          cTreeNodes;
+    /** Offset to the block allocation bitmap in blocks. */
     uint64_t          offBlksBitmap;
+    /** Size of the block allocation bitmap in blocks. */
+    uint32_t          cBlkMap;
     /** Block map. */
     PVCIBLKMAP        pBlkMap;
+
+    /** Tree of cached extents. */
+    PAVLRU64TREE      pTreeExtents;
+    /** LRU list of cached extents. */
+    RTLISTNODE        ListLru;
+    /** Number of cached extents. */
+    uint64_t          cExtents;
+    /** Number of dirty blocks. */
+    uint64_t          cBlocksDirty;
+    /** Flag whether the cached extents changed since the last checkpoint. */
+    bool              fTreeChanged;
+    /** Flag whether the set of dirty extents changed since the last checkpoint. */
+    bool              fDirtyChanged;
+    /** Blocks which can be reused after the next checkpoint. */
+    PVCIBLKRANGE      paFreePending;
+    /** Number of entries used in paFreePending. */
+    unsigned          cFreePending;
+    /** Number of entries allocated in paFreePending. */
+    unsigned          cFreePendingMax;
 } VCICACHE, *PVCICACHE;
 
+/**
+ * State while writing the B+-Tree during a checkpoint.
+ */
+typedef struct VCICOMMITSTATE
+{
+    /** The cache image instance. */
+    PVCICACHE        pCache;
+    /** The node currently filled. */
+    VciTreeNode      Node;
+    /** Number of entries in the current node. */
+    unsigned         cEntries;
+    /** First block of cached data the current node represents. */
+    uint64_t         u64BlockFirst;
+    /** Last block of cached data the current node represents. */
+    uint64_t         u64BlockLast;
+    /** Nodes written for the current level of the tree. */
+    PVCICOMMITNODE   paLevel;
+    /** Number of entries used in paLevel. */
+    unsigned         cLevel;
+    /** Number of entries allocated in paLevel. */
+    unsigned         cLevelMax;
+    /** Block addresses of all nodes written. */
+    uint64_t        *pau64Nodes;
+    /** Number of entries used in pau64Nodes. */
+    unsigned         cNodes;
+    /** Number of entries allocated in pau64Nodes. */
+    unsigned         cNodesMax;
+} VCICOMMITSTATE, *PVCICOMMITSTATE;
+
 /** No block free in bitmap error code. */
 #define VERR_VCI_NO_BLOCKS_FREE (-65536)
 
@@ -386,6 +430,11 @@ static const char *const s_apszVciFileExtensions[] =
 *   Internal Functions                                                         *
 *******************************************************************************/
 
+static int vciCommit(PVCICACHE pCache);
+static int vciBlkMapSave(PVCIBLKMAP pBlkMap, PVCICACHE pStorage, uint64_t offBlkMap, uint32_t cBlkMap);
+static void vciBlkMapDestroy(PVCIBLKMAP pBlkMap);
+static DECLCALLBACK(int) vciExtentDestroy(PAVLRU64NODECORE pCore, void *pvUser);
+
 /**
  * Internal. Flush image data to disk.
  */
@@ -402,6 +451,30 @@ static int vciFlushImage(PVCICACHE pCache)
     return rc;
 }
 
+/**
+ * Internal. Writes the header of the image.
+ *
+ * @returns VBox status code.
+ * @param   pCache      The cache image instance.
+ * @param   fUnclean    Flag whether to mark the cache as in use.
+ */
+static int vciHdrWrite(PVCICACHE pCache, bool fUnclean)
+{
+    VciHdr Hdr;
+
+    memset(&Hdr, 0, sizeof(VciHdr));
+    Hdr.u32Signature     = RT_H2LE_U32(VCI_HDR_SIGNATURE);
+    Hdr.u32Version       = RT_H2LE_U32(VCI_HDR_VERSION);
+    Hdr.cBlocksCache     = RT_H2LE_U64(pCache->pBlkMap->cBlocks);
+    Hdr.fUncleanShutdown = fUnclean ? VCI_HDR_UNCLEAN_SHUTDOWN : VCI_HDR_CLEAN_SHUTDOWN;
+    Hdr.u32CacheType     = RT_H2LE_U32(pCache->u32CacheType);
+    Hdr.offTreeRoot      = RT_H2LE_U64(pCache->offTreeRoot);
+    Hdr.offBlkMap        = RT_H2LE_U64(pCache->offBlksBitmap);
+    Hdr.cBlkMap          = RT_H2LE_U32(pCache->cBlkMap);
+
+    return vdIfIoIntFileWriteSync(pCache->pIfIo, pCache->pStorage, 0, &Hdr, sizeof(VciHdr));
+}
+
 /**
  * Internal. Free all allocated space for representing an image except pCache,
  * and optionally delete the image from disk.
@@ -417,6 +490,20 @@ static int vciFreeImage(PVCICACHE pCache, bool fDelete)
         if (pCache->pStorage)
         {
             /* No point updating the file that is deleted anyway. */
+            if (   !fDelete
+                && pCache->fHdrUnclean)
+            {
+                rc = vciCommit(pCache);
+                if (RT_SUCCESS(rc))
+                    rc = vciBlkMapSave(pCache->pBlkMap, pCache, pCache->offBlksBitmap, pCache->cBlkMap);
+                if (RT_SUCCESS(rc))
+                    rc = vciFlushImage(pCache);
+                if (RT_SUCCESS(rc))
+                    rc = vciHdrWrite(pCache, false /* fUnclean */);
+                if (RT_SUCCESS(rc))
+                    pCache->fHdrUnclean = false;
+            }
+
             if (!fDelete)
                 vciFlushImage(pCache);
 
@@ -424,6 +511,39 @@ static int vciFreeImage(PVCICACHE pCache, bool fDelete)
             pCache->pStorage = NULL;
         }
 
+        if (pCache->pTreeExtents)
+        {
+            RTAvlrU64Destroy(pCache->pTreeExtents, vciExtentDestroy, NULL);
+            RTMemFree(pCache->pTreeExtents);
+            pCache->pTreeExtents = NULL;
+        }
+
+        if (pCache->pBlkMap)
+        {
+            vciBlkMapDestroy(pCache->pBlkMap);
+            pCache->pBlkMap = NULL;
+        }
+
+        if (pCache->pau64TreeNodes)
+        {
+            RTMemFree(pCache->pau64TreeNodes);
+            pCache->pau64TreeNodes = NULL;
+            pCache->cTreeNodes     = 0;
+        }
+
+        if (pCache->paFreePending)
+        {
+            RTMemFree(pCache->paFreePending);
+            pCache->paFreePending   = NULL;
+            pCache->cFreePending    = 0;
+            pCache->cFreePendingMax = 0;
+        }
+
+        pCache->cExtents      = 0;
+        pCache->cBlocksDirty  = 0;
+        pCache->fTreeChanged  = false;
+        pCache->fDirtyChanged = false;
+
         if (fDelete && pCache->pszFilename)
             vdIfIoIntFileDelete(pCache->pIfIo, pCache->pszFilename);
     }
@@ -432,6 +552,19 @@ static int vciFreeImage(PVCICACHE pCache, bool fDelete)
     return rc;
 }
 
+/**
+ * Returns the size of the on disk block map for the given number of blocks.
+ *
+ * @returns Size of the block map in blocks, including the header.
+ * @param   cBlocks      The number of blocks the bitmap manages.
+ */
+static uint32_t vciBlkMapGetSize(uint64_t cBlocks)
+{
+    uint64_t cbBlkMap = RT_ALIGN_64((cBlocks + 7) / 8, VCI_BLOCK_SIZE);
+
+    return (uint32_t)VCI_BYTE2BLOCK(cbBlkMap + sizeof(VciBlkMap));
+}
+
 /**
  * Creates a new block map which can manage the given number of blocks.
  *
@@ -446,11 +579,10 @@ static int vciFreeImage(PVCICACHE pCache, bool fDelete)
 static int vciBlkMapCreate(uint64_t cBlocks, PVCIBLKMAP *ppBlkMap, uint32_t *pcBlkMap)
 {
     int rc = VINF_SUCCESS;
-    uint32_t cbBlkMap = RT_ALIGN_Z(cBlocks / sizeof(VciBlkMapEnt) / 8, VCI_BLOCK_SIZE);
     PVCIBLKMAP pBlkMap = (PVCIBLKMAP)RTMemAllocZ(sizeof(VCIBLKMAP));
     PVCIBLKRANGEDESC pFree   = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
 
-    LogFlowFunc(("cBlocks=%u ppBlkMap=%#p pcBlkMap=%#p\n", cBlocks, ppBlkMap, pcBlkMap));
+    LogFlowFunc(("cBlocks=%llu ppBlkMap=%#p pcBlkMap=%#p\n", cBlocks, ppBlkMap, pcBlkMap));
 
     if (pBlkMap && pFree)
     {
@@ -468,9 +600,8 @@ static int vciBlkMapCreate(uint64_t cBlocks, PVCIBLKMAP *ppBlkMap, uint32_t *pcB
         pBlkMap->pRangesHead = pFree;
         pBlkMap->pRangesTail = pFree;
 
-        Assert(!((cbBlkMap + sizeof(VciBlkMap)) % VCI_BLOCK_SIZE));
         *ppBlkMap = pBlkMap;
-        *pcBlkMap = VCI_BYTE2BLOCK(cbBlkMap + sizeof(VciBlkMap));
+        *pcBlkMap = vciBlkMapGetSize(cBlocks);
     }
     else
     {
@@ -502,9 +633,9 @@ static void vciBlkMapDestroy(PVCIBLKMAP pBlkMap)
     {
         PVCIBLKRANGEDESC pTmp = pRangeCur;
 
-        RTMemFree(pTmp);
-
         pRangeCur = pRangeCur->pNext;
+
+        RTMemFree(pTmp);
     }
 
     RTMemFree(pBlkMap);
@@ -512,177 +643,13 @@ static void vciBlkMapDestroy(PVCIBLKMAP pBlkMap)
     LogFlowFunc(("returns\n"));
 }
 
-/**
- * Loads the block map from the specified medium and creates all necessary
- * in memory structures to manage used and free blocks.
- *
- * @returns VBox status code.
- * @param   pStorage        Storage handle to read the block bitmap from.
- * @param   offBlkMap       Start of the block bitmap in blocks.
- * @param   cBlkMap         Size of the block bitmap on the disk in blocks.
- * @param   ppBlkMap        Where to store the block bitmap on success.
- */
-static int vciBlkMapLoad(PVCICACHE pStorage, uint64_t offBlkMap, uint32_t cBlkMap, PVCIBLKMAP *ppBlkMap)
-{
-    int rc = VINF_SUCCESS;
-    VciBlkMap BlkMap;
-
-    LogFlowFunc(("pStorage=%#p offBlkMap=%llu cBlkMap=%u ppBlkMap=%#p\n",
-                 pStorage, offBlkMap, cBlkMap, ppBlkMap));
-
-    if (cBlkMap >= VCI_BYTE2BLOCK(sizeof(VciBlkMap)))
-    {
-        cBlkMap -= VCI_BYTE2BLOCK(sizeof(VciBlkMap));
-
-        rc = vdIfIoIntFileReadSync(pStorage->pIfIo, pStorage->pStorage, offBlkMap,
-                                   &BlkMap, VCI_BYTE2BLOCK(sizeof(VciBlkMap)));
-        if (RT_SUCCESS(rc))
-        {
-            offBlkMap += VCI_BYTE2BLOCK(sizeof(VciBlkMap));
-
-            BlkMap.u32Magic         = RT_LE2H_U32(BlkMap.u32Magic);
-            BlkMap.u32Version       = RT_LE2H_U32(BlkMap.u32Version);
-            BlkMap.cBlocks          = RT_LE2H_U32(BlkMap.cBlocks);
-            BlkMap.cBlocksFree      = RT_LE2H_U32(BlkMap.cBlocksFree);
-            BlkMap.cBlocksAllocMeta = RT_LE2H_U32(BlkMap.cBlocksAllocMeta);
-            BlkMap.cBlocksAllocData = RT_LE2H_U32(BlkMap.cBlocksAllocData);
-
-            if (   BlkMap.u32Magic == VCI_BLKMAP_MAGIC
-                && BlkMap.u32Version == VCI_BLKMAP_VERSION
-                && BlkMap.cBlocks == BlkMap.cBlocksFree + BlkMap.cBlocksAllocMeta + BlkMap.cBlocksAllocData
-                && VCI_BYTE2BLOCK(BlkMap.cBlocks / 8) == cBlkMap)
-            {
-                PVCIBLKMAP pBlkMap = (PVCIBLKMAP)RTMemAllocZ(sizeof(VCIBLKMAP));
-                if (pBlkMap)
-                {
-                    pBlkMap->cBlocks          = BlkMap.cBlocks;
-                    pBlkMap->cBlocksFree      = BlkMap.cBlocksFree;
-                    pBlkMap->cBlocksAllocMeta = BlkMap.cBlocksAllocMeta;
-                    pBlkMap->cBlocksAllocData = BlkMap.cBlocksAllocData;
-
-                    /* Load the bitmap and construct the range list. */
-                    uint32_t cBlocksFree = 0;
-                    uint32_t cBlocksAllocated = 0;
-                    PVCIBLKRANGEDESC pRangeCur = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
-
-                    if (pRangeCur)
-                    {
-                        uint8_t abBitmapBuffer[16 * _1K];
-                        uint32_t cBlocksRead = 0;
-                        uint64_t cBlocksLeft = VCI_BYTE2BLOCK(pBlkMap->cBlocks / 8);
-
-                        cBlocksRead = RT_MIN(VCI_BYTE2BLOCK(sizeof(abBitmapBuffer)), cBlocksLeft);
-                        rc = vdIfIoIntFileReadSync(pStorage->pIfIo, pStorage->pStorage,
-                                                   offBlkMap, abBitmapBuffer,
-                                                   cBlocksRead);
-
-                        if (RT_SUCCESS(rc))
-                        {
-                            pRangeCur->fFree        = !(abBitmapBuffer[0] & 0x01);
-                            pRangeCur->offAddrStart = 0;
-                            pRangeCur->cBlocks      = 0;
-                            pRangeCur->pNext        = NULL;
-                            pRangeCur->pPrev        = NULL;
-                            pBlkMap->pRangesHead = pRangeCur;
-                            pBlkMap->pRangesTail = pRangeCur;
-                        }
-
-                        while (   RT_SUCCESS(rc)
-                               && cBlocksLeft)
-                        {
-                            int iBit = 0;
-                            uint32_t cBits = VCI_BLOCK2BYTE(cBlocksRead) * 8;
-                            uint32_t iBitPrev = 0xffffffff;
-
-                            while (cBits)
-                            {
-                                if (pRangeCur->fFree)
-                                {
-                                    /* Check for the first set bit. */
-                                    iBit = ASMBitNextSet(abBitmapBuffer, cBits, iBitPrev);
-                                }
-                                else
-                                {
-                                    /* Check for the first free bit. */
-                                    iBit = ASMBitNextClear(abBitmapBuffer, cBits, iBitPrev);
-                                }
-
-                                if (iBit == -1)
-                                {
-                                    /* No change. */
-                                    pRangeCur->cBlocks += cBits;
-                                    cBits = 0;
-                                }
-                                else
-                                {
-                                    Assert((uint32_t)iBit < cBits);
-                                    pRangeCur->cBlocks += iBit;
-
-                                    /* Create a new range descriptor. */
-                                    PVCIBLKRANGEDESC pRangeNew = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
-                                    if (!pRangeNew)
-                                    {
-                                        rc = VERR_NO_MEMORY;
-                                        break;
-                                    }
-
-                                    pRangeNew->fFree = !pRangeCur->fFree;
-                                    pRangeNew->offAddrStart = pRangeCur->offAddrStart + pRangeCur->cBlocks;
-                                    pRangeNew->cBlocks = 0;
-                                    pRangeNew->pPrev = pRangeCur;
-                                    pRangeCur->pNext = pRangeNew;
-                                    pBlkMap->pRangesTail = pRangeNew;
-                                    pRangeCur = pRangeNew;
-                                    cBits -= iBit;
-                                    iBitPrev = iBit;
-                                }
-                            }
-
-                            cBlocksLeft -= cBlocksRead;
-                            offBlkMap   += cBlocksRead;
-
-                            if (   RT_SUCCESS(rc)
-                                && cBlocksLeft)
-                            {
-                                /* Read next chunk. */
-                                cBlocksRead = RT_MIN(VCI_BYTE2BLOCK(sizeof(abBitmapBuffer)), cBlocksLeft);
-                                rc = vdIfIoIntFileReadSync(pStorage->pIfIo, pStorage->pStorage,
-                                                           offBlkMap, abBitmapBuffer, cBlocksRead);
-                            }
-                        }
-                    }
-                    else
-                        rc = VERR_NO_MEMORY;
-
-                    if (RT_SUCCESS(rc))
-                    {
-                        *ppBlkMap = pBlkMap;
-                        LogFlowFunc(("return success\n"));
-                        return VINF_SUCCESS;
-                    }
-                    else
-                        RTMemFree(pBlkMap);
-                }
-                else
-                    rc = VERR_NO_MEMORY;
-            }
-            else
-                rc = VERR_VD_GEN_INVALID_HEADER;
-        }
-        else if (RT_SUCCESS(rc))
-            rc = VERR_VD_GEN_INVALID_HEADER;
-    }
-    else
-        rc = VERR_VD_GEN_INVALID_HEADER;
-
-    LogFlowFunc(("returns rc=%Rrc\n", rc));
-    return rc;
-}
-
 /**
  * Saves the block map in the cache image. All necessary on disk structures
  * are written.
  *
+ * The bitmap is informational only, the allocation state is rebuilt from the
+ * B+-Tree when the image is opened.
+ *
  * @returns VBox status code.
  * @param   pBlkMap         The block bitmap to save.
  * @param   pStorage        Where the block bitmap should be written to.
@@ -698,40 +665,39 @@ static int vciBlkMapSave(PVCIBLKMAP pBlkMap, PVCICACHE pStorage, uint64_t offBlk
                  pBlkMap, pStorage, offBlkMap, cBlkMap));
 
     /* Make sure the number of blocks allocated for us match our expectations. */
-    if (VCI_BYTE2BLOCK(pBlkMap->cBlocks / 8) + VCI_BYTE2BLOCK(sizeof(VciBlkMap)) == cBlkMap)
+    if (vciBlkMapGetSize(pBlkMap->cBlocks) == cBlkMap)
     {
         /* Setup the header */
         memset(&BlkMap, 0, sizeof(VciBlkMap));
 
         BlkMap.u32Magic         = RT_H2LE_U32(VCI_BLKMAP_MAGIC);
         BlkMap.u32Version       = RT_H2LE_U32(VCI_BLKMAP_VERSION);
-        BlkMap.cBlocks          = RT_H2LE_U32(pBlkMap->cBlocks);
-        BlkMap.cBlocksFree      = RT_H2LE_U32(pBlkMap->cBlocksFree);
-        BlkMap.cBlocksAllocMeta = RT_H2LE_U32(pBlkMap->cBlocksAllocMeta);
-        BlkMap.cBlocksAllocData = RT_H2LE_U32(pBlkMap->cBlocksAllocData);
+        BlkMap.cBlocks          = RT_H2LE_U64(pBlkMap->cBlocks);
+        BlkMap.cBlocksFree      = RT_H2LE_U64(pBlkMap->cBlocksFree);
+        BlkMap.cBlocksAllocMeta = RT_H2LE_U64(pBlkMap->cBlocksAllocMeta);
+        BlkMap.cBlocksAllocData = RT_H2LE_U64(pBlkMap->cBlocksAllocData);
 
-        rc = vdIfIoIntFileWriteSync(pStorage->pIfIo, pStorage->pStorage, offBlkMap,
-                                    &BlkMap, VCI_BYTE2BLOCK(sizeof(VciBlkMap)));
+        rc = vdIfIoIntFileWriteSync(pStorage->pIfIo, pStorage->pStorage, VCI_BLOCK2BYTE(offBlkMap),
+                                    &BlkMap, sizeof(VciBlkMap));
         if (RT_SUCCESS(rc))
         {
             uint8_t abBitmapBuffer[16*_1K];
-            unsigned iBit = 0;
+            uint32_t iBit = 0;
             PVCIBLKRANGEDESC pCur = pBlkMap->pRangesHead;
 
             offBlkMap += VCI_BYTE2BLOCK(sizeof(VciBlkMap));
+            memset(abBitmapBuffer, 0, sizeof(abBitmapBuffer));
 
             /* Write the descriptor ranges. */
-            while (pCur)
+            while (pCur && RT_SUCCESS(rc))
             {
                 uint64_t cBlocks = pCur->cBlocks;
 
                 while (cBlocks)
                 {
-                    uint64_t cBlocksMax = RT_MIN(cBlocks, sizeof(abBitmapBuffer) * 8 - iBit);
+                    uint32_t cBlocksMax = (uint32_t)RT_MIN(cBlocks, sizeof(abBitmapBuffer) * 8 - iBit);
 
-                    if (pCur->fFree)
-                        ASMBitClearRange(abBitmapBuffer, iBit, iBit + cBlocksMax);
-                    else
+                    if (!pCur->fFree)
                         ASMBitSetRange(abBitmapBuffer, iBit, iBit + cBlocksMax);
 
                     iBit    += cBlocksMax;
@@ -741,12 +707,13 @@ static int vciBlkMapSave(PVCIBLKMAP pBlkMap, PVCICACHE pStorage, uint64_t offBlk
                     {
                         /* Buffer is full, write to file and reset. */
                         rc = vdIfIoIntFileWriteSync(pStorage->pIfIo, pStorage->pStorage,
-                                                    offBlkMap, abBitmapBuffer,
-                                                    VCI_BYTE2BLOCK(sizeof(abBitmapBuffer)));
+                                                    VCI_BLOCK2BYTE(offBlkMap), abBitmapBuffer,
+                                                    sizeof(abBitmapBuffer));
                         if (RT_FAILURE(rc))
                             break;
 
                         offBlkMap += VCI_BYTE2BLOCK(sizeof(abBitmapBuffer));
+                        memset(abBitmapBuffer, 0, sizeof(abBitmapBuffer));
                         iBit = 0;
                     }
                 }
@@ -754,11 +721,10 @@ static int vciBlkMapSave(PVCIBLKMAP pBlkMap, PVCICACHE pStorage, uint64_t offBlk
                 pCur = pCur->pNext;
             }
 
-            Assert(iBit % 8 == 0);
-
             if (RT_SUCCESS(rc) && iBit)
                 rc = vdIfIoIntFileWriteSync(pStorage->pIfIo, pStorage->pStorage,
-                                            offBlkMap, abBitmapBuffer, VCI_BYTE2BLOCK(iBit / 8));
+                                            VCI_BLOCK2BYTE(offBlkMap), abBitmapBuffer,
+                                            RT_ALIGN_32((iBit + 7) / 8, VCI_BLOCK_SIZE));
         }
     }
     else
@@ -780,121 +746,180 @@ static PVCIBLKRANGEDESC vciBlkMapFindByBlock(PVCIBLKMAP pBlkMap, uint64_t offBlo
     PVCIBLKRANGEDESC pBlk = pBlkMap->pRangesHead;
 
     while (   pBlk
-           && pBlk->offAddrStart < offBlockAddr)
+           && pBlk->offAddrStart + pBlk->cBlocks <= offBlockAddr)
         pBlk = pBlk->pNext;
 
     return pBlk;
 }
 
+/**
+ * Splits a block range descriptor in two, the new descriptor is linked in
+ * after the given one and has the same state.
+ *
+ * @returns VBox status code.
+ * @param   pBlkMap          The block bitmap.
+ * @param   pBlk             The range to split.
+ * @param   cBlocks          Number of blocks to keep in the given range.
+ */
+static int vciBlkMapRangeSplit(PVCIBLKMAP pBlkMap, PVCIBLKRANGEDESC pBlk, uint64_t cBlocks)
+{
+    Assert(cBlocks && cBlocks < pBlk->cBlocks);
+
+    PVCIBLKRANGEDESC pNew = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
+    if (!pNew)
+        return VERR_NO_MEMORY;
+
+    pNew->fFree        = pBlk->fFree;
+    pNew->offAddrStart = pBlk->offAddrStart + cBlocks;
+    pNew->cBlocks      = pBlk->cBlocks - cBlocks;
+    pBlk->cBlocks      = cBlocks;
+
+    /* Link into the list. */
+    pNew->pPrev = pBlk;
+    pNew->pNext = pBlk->pNext;
+    if (pBlk->pNext)
+        pBlk->pNext->pPrev = pNew;
+    else
+        pBlkMap->pRangesTail = pNew;
+    pBlk->pNext = pNew;
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Updates the allocation statistics of the block map.
+ *
+ * @returns nothing.
+ * @param   pBlkMap          The block bitmap.
+ * @param   cBlocks          Number of blocks allocated (positive) or freed (negative).
+ * @param   fFlags           Allocation flags, combination of VCIBLKMAP_ALLOC_*.
+ */
+static void vciBlkMapAccount(PVCIBLKMAP pBlkMap, int64_t cBlocks, uint32_t fFlags)
+{
+    if ((fFlags & VCIBLKMAP_ALLOC_MASK) == VCIBLKMAP_ALLOC_DATA)
+        pBlkMap->cBlocksAllocData += cBlocks;
+    else
+        pBlkMap->cBlocksAllocMeta += cBlocks;
+
+    pBlkMap->cBlocksFree -= cBlocks;
+}
+
 /**
  * Allocates the given number of blocks in the bitmap and returns the start block address.
  *
  * @returns VBox status code.
- * @param   pBlkMap          The block bitmap to allocate the blocks from.
- * @param   cBlocks          How many blocks to allocate.
- * @param   fFlags           Allocation flags, comgination of VCIBLKMAP_ALLOC_*.
- * @param   poffBlockAddr    Where to store the start address of the allocated region.
+ * @param   pBlkMap           The block bitmap to allocate the blocks from.
+ * @param   cBlocks           How many blocks to allocate.
+ * @param   fFlags            Allocation flags, comgination of VCIBLKMAP_ALLOC_*.
+ * @param   poffBlockAddr     Where to store the start address of the allocated region.
+ * @param   pcBlocksAllocated Where to store the number of blocks allocated, optional.
+ *                            If given the largest free region is returned if there
+ *                            is none which can satisfy the whole request.
  */
-static int vciBlkMapAllocate(PVCIBLKMAP pBlkMap, uint32_t cBlocks, uint32_t fFlags,
-                             uint64_t *poffBlockAddr)
+static int vciBlkMapAllocate(PVCIBLKMAP pBlkMap, uint64_t cBlocks, uint32_t fFlags,
+                             uint64_t *poffBlockAddr, uint64_t *pcBlocksAllocated)
 {
     PVCIBLKRANGEDESC pBestFit = NULL;
+    PVCIBLKRANGEDESC pLargest = NULL;
     PVCIBLKRANGEDESC pCur = NULL;
     int rc = VINF_SUCCESS;
 
-    LogFlowFunc(("pBlkMap=%#p cBlocks=%u poffBlockAddr=%#p\n",
+    LogFlowFunc(("pBlkMap=%#p cBlocks=%llu poffBlockAddr=%#p\n",
                  pBlkMap, cBlocks, poffBlockAddr));
 
     pCur = pBlkMap->pRangesHead;
 
     while (pCur)
     {
-        if (   pCur->fFree
-            && pCur->cBlocks >= cBlocks)
+        if (pCur->fFree)
         {
-            if (   !pBestFit
-                || pCur->cBlocks < pBestFit->cBlocks)
+            if (   pCur->cBlocks >= cBlocks
+                && (   !pBestFit
+                    || pCur->cBlocks < pBestFit->cBlocks))
             {
                 pBestFit = pCur;
                 /* Stop searching if the size is matching exactly. */
                 if (pBestFit->cBlocks == cBlocks)
                     break;
             }
+
+            if (   !pLargest
+                || pCur->cBlocks > pLargest->cBlocks)
+                pLargest = pCur;
         }
         pCur = pCur->pNext;
     }
 
+    if (   !pBestFit
+        && pLargest
+        && pcBlocksAllocated)
+    {
+        pBestFit = pLargest;
+        cBlocks  = pLargest->cBlocks;
+    }
+
     Assert(!pBestFit || pBestFit->fFree);
 
     if (pBestFit)
     {
-        pBestFit->fFree = false;
-
         if (pBestFit->cBlocks > cBlocks)
-        {
-            /* Create a new free block. */
-            PVCIBLKRANGEDESC pFree = (PVCIBLKRANGEDESC)RTMemAllocZ(sizeof(VCIBLKRANGEDESC));
+            rc = vciBlkMapRangeSplit(pBlkMap, pBestFit, cBlocks);
 
-            if (pFree)
-            {
-                pFree->fFree = true;
-                pFree->cBlocks = pBestFit->cBlocks - cBlocks;
-                pBestFit->cBlocks -= pFree->cBlocks;
-                pFree->offAddrStart = pBestFit->offAddrStart + cBlocks;
-
-                /* Link into the list. */
-                pFree->pNext = pBestFit->pNext;
-                pBestFit->pNext = pFree;
-                pFree->pPrev    = pBestFit;
-                if (!pFree->pNext)
-                    pBlkMap->pRangesTail = pFree;
-
-                *poffBlockAddr = pBestFit->offAddrStart;
-            }
-            else
-            {
-                rc = VERR_NO_MEMORY;
-                pBestFit->fFree = true;
-            }
+        if (RT_SUCCESS(rc))
+        {
+            pBestFit->fFree = false;
+            *poffBlockAddr = pBestFit->offAddrStart;
+            if (pcBlocksAllocated)
+                *pcBlocksAllocated = cBlocks;
+            vciBlkMapAccount(pBlkMap, cBlocks, fFlags);
         }
     }
     else
         rc = VERR_VCI_NO_BLOCKS_FREE;
 
-    if (RT_SUCCESS(rc))
-    {
-        if ((fFlags & VCIBLKMAP_ALLOC_MASK) == VCIBLKMAP_ALLOC_DATA)
-            pBlkMap->cBlocksAllocMeta += cBlocks;
-        else
-            pBlkMap->cBlocksAllocData += cBlocks;
-
-        pBlkMap->cBlocksFree -= cBlocks;
-    }
-
     LogFlowFunc(("returns rc=%Rrc offBlockAddr=%llu\n", rc, *poffBlockAddr));
     return rc;
 }
 
 /**
- * Try to extend the space of an already allocated block.
+ * Marks the given range of blocks as allocated, used when rebuilding the block
+ * map from the B+-Tree.
  *
  * @returns VBox status code.
- * @param   pBlkMap          The block bitmap to allocate the blocks from.
- * @param   cBlocksNew       How many blocks the extended block should have.
- * @param   offBlockAddrOld  The start address of the block to reallocate.
- * @param   poffBlockAddr    Where to store the start address of the allocated region.
+ * @retval  VERR_VD_GEN_INVALID_HEADER if the range is already allocated.
+ * @param   pBlkMap          The block bitmap.
+ * @param   offBlockAddr     Address of the first block to allocate.
+ * @param   cBlocks          How many blocks to allocate.
+ * @param   fFlags           Allocation flags, comgination of VCIBLKMAP_ALLOC_*.
  */
-static int vciBlkMapRealloc(PVCIBLKMAP pBlkMap, uint32_t cBlocksNew, uint64_t offBlockAddrOld,
-                            uint64_t *poffBlockAddr)
+static int vciBlkMapAllocateAt(PVCIBLKMAP pBlkMap, uint64_t offBlockAddr, uint64_t cBlocks,
+                               uint32_t fFlags)
 {
     int rc = VINF_SUCCESS;
+    PVCIBLKRANGEDESC pBlk = vciBlkMapFindByBlock(pBlkMap, offBlockAddr);
 
-    LogFlowFunc(("pBlkMap=%#p cBlocksNew=%u offBlockAddrOld=%llu poffBlockAddr=%#p\n",
-                 pBlkMap, cBlocksNew, offBlockAddrOld, poffBlockAddr));
+    if (   !cBlocks
+        || !pBlk
+        || !pBlk->fFree
+        || pBlk->offAddrStart + pBlk->cBlocks < offBlockAddr + cBlocks)
+        return VERR_VD_GEN_INVALID_HEADER;
 
-    AssertMsgFailed(("Implement\n"));
+    if (pBlk->offAddrStart < offBlockAddr)
+    {
+        rc = vciBlkMapRangeSplit(pBlkMap, pBlk, offBlockAddr - pBlk->offAddrStart);
+        pBlk = pBlk->pNext;
+    }
+
+    if (   RT_SUCCESS(rc)
+        && pBlk->cBlocks > cBlocks)
+        rc = vciBlkMapRangeSplit(pBlkMap, pBlk, cBlocks);
+
+    if (RT_SUCCESS(rc))
+    {
+        pBlk->fFree = false;
+        vciBlkMapAccount(pBlkMap, cBlocks, fFlags);
+    }
 
-    LogFlowFunc(("returns rc=%Rrc offBlockAddr=%llu\n", rc, *poffBlockAddr));
     return rc;
 }
 
@@ -907,288 +932,739 @@ static int vciBlkMapRealloc(PVCIBLKMAP pBlkMap, uint32_t cBlocksNew, uint64_t of
  * @param   cBlocks          How many blocks to free.
  * @param   fFlags           Allocation flags, comgination of VCIBLKMAP_ALLOC_*.
  */
-static void vciBlkMapFree(PVCIBLKMAP pBlkMap, uint64_t offBlockAddr, uint32_t cBlocks,
+static void vciBlkMapFree(PVCIBLKMAP pBlkMap, uint64_t offBlockAddr, uint64_t cBlocks,
                           uint32_t fFlags)
 {
     PVCIBLKRANGEDESC pBlk;
 
-    LogFlowFunc(("pBlkMap=%#p offBlockAddr=%llu cBlocks=%u\n",
+    LogFlowFunc(("pBlkMap=%#p offBlockAddr=%llu cBlocks=%llu\n",
                  pBlkMap, offBlockAddr, cBlocks));
 
     while (cBlocks)
     {
+        int rc = VINF_SUCCESS;
+
         pBlk = vciBlkMapFindByBlock(pBlkMap, offBlockAddr);
-        AssertPtr(pBlk);
+        AssertPtrBreak(pBlk);
+        AssertBreak(!pBlk->fFree);
 
-        /* Easy case, the whole block is freed. */
-        if (   pBlk->offAddrStart == offBlockAddr
-            && pBlk->cBlocks <= cBlocks)
+        /* Cut off the parts of the range which stay allocated. */
+        if (pBlk->offAddrStart < offBlockAddr)
+        {
+            rc = vciBlkMapRangeSplit(pBlkMap, pBlk, offBlockAddr - pBlk->offAddrStart);
+            if (RT_SUCCESS(rc))
+                pBlk = pBlk->pNext;
+        }
+        if (   RT_SUCCESS(rc)
+            && pBlk->cBlocks > cBlocks)
+            rc = vciBlkMapRangeSplit(pBlkMap, pBlk, cBlocks);
+        if (RT_FAILURE(rc))
         {
-            pBlk->fFree = true;
-            cBlocks      -= pBlk->cBlocks;
-            offBlockAddr += pBlk->cBlocks;
+            /* The blocks stay allocated until the image is opened the next time. */
+            LogRel(("VCI: Leaking %llu blocks at %llu because of %Rrc\n", cBlocks, offBlockAddr, rc));
+            break;
+        }
 
-            /* Check if it is possible to merge free blocks. */
-            if (   pBlk->pPrev
-                && pBlk->pPrev->fFree)
-            {
-                PVCIBLKRANGEDESC pBlkPrev = pBlk->pPrev;
+        pBlk->fFree   = true;
+        cBlocks      -= pBlk->cBlocks;
+        offBlockAddr += pBlk->cBlocks;
+        vciBlkMapAccount(pBlkMap, -(int64_t)pBlk->cBlocks, fFlags);
 
-                Assert(pBlkPrev->offAddrStart + pBlkPrev->cBlocks == pBlk->offAddrStart);
-                pBlkPrev->cBlocks += pBlk->cBlocks;
-                pBlkPrev->pNext = pBlk->pNext;
-                if (pBlk->pNext)
-                    pBlk->pNext->pPrev = pBlkPrev;
+        /* Check if it is possible to merge free blocks. */
+        if (   pBlk->pPrev
+            && pBlk->pPrev->fFree)
+        {
+            PVCIBLKRANGEDESC pBlkPrev = pBlk->pPrev;
+
+            Assert(pBlkPrev->offAddrStart + pBlkPrev->cBlocks == pBlk->offAddrStart);
+            pBlkPrev->cBlocks += pBlk->cBlocks;
+            pBlkPrev->pNext = pBlk->pNext;
+            if (pBlk->pNext)
+                pBlk->pNext->pPrev = pBlkPrev;
+            else
+                pBlkMap->pRangesTail = pBlkPrev;
+
+            RTMemFree(pBlk);
+            pBlk = pBlkPrev;
+        }
+
+        /* Now the one to the right. */
+        if (   pBlk->pNext
+            && pBlk->pNext->fFree)
+        {
+            PVCIBLKRANGEDESC pBlkNext = pBlk->pNext;
+
+            Assert(pBlk->offAddrStart + pBlk->cBlocks == pBlkNext->offAddrStart);
+            pBlk->cBlocks += pBlkNext->cBlocks;
+            pBlk->pNext = pBlkNext->pNext;
+            if (pBlkNext->pNext)
+                pBlkNext->pNext->pPrev = pBlk;
+            else
+                pBlkMap->pRangesTail = pBlk;
+
+            RTMemFree(pBlkNext);
+        }
+    }
+
+    LogFlowFunc(("returns\n"));
+}
+
+/**
+ * Returns the number of blocks needed to write a B+-Tree for the given number
+ * of extents.
+ *
+ * @returns Number of blocks.
+ * @param   cExtents         Number of extents in the tree.
+ */
+static uint64_t vciTreeGetSize(uint64_t cExtents)
+{
+    uint64_t cNodesLevel = RT_MAX(1, (cExtents + VCI_TREE_EXTENTS_PER_NODE - 1) / VCI_TREE_EXTENTS_PER_NODE);
+    uint64_t cNodes = cNodesLevel;
+
+    while (cNodesLevel > 1)
+    {
+        cNodesLevel = (cNodesLevel + VCI_TREE_INTERNAL_NODES_PER_NODE - 1) / VCI_TREE_INTERNAL_NODES_PER_NODE;
+        cNodes += cNodesLevel;
+    }
+
+    return cNodes * VCI_TREE_NODE_BLOCKS;
+}
+
+/**
+ * Releases the blocks of a cache extent which is not needed anymore.
+ *
+ * Blocks of data recorded as dirty in the tree on the disk must not be
+ * overwritten before the next checkpoint because the data would be used after
+ * a crash. Clean extents are dropped after a crash anyway so their blocks can be
+ * reused immediately.
+ *
+ * @returns nothing.
+ * @param   pCache          The cache image instance.
+ * @param   offBlockAddr    Address of the first block to release.
+ * @param   cBlocks         How many blocks to release.
+ * @param   fDirtyOnDisk    Flag whether the blocks are recorded as dirty on the disk.
+ */
+static void vciBlocksRelease(PVCICACHE pCache, uint64_t offBlockAddr, uint64_t cBlocks,
+                             bool fDirtyOnDisk)
+{
+    if (!fDirtyOnDisk)
+    {
+        vciBlkMapFree(pCache->pBlkMap, offBlockAddr, cBlocks, VCIBLKMAP_ALLOC_DATA);
+        return;
+    }
+
+    if (pCache->cFreePending == pCache->cFreePendingMax)
+    {
+        unsigned cFreePendingMaxNew = pCache->cFreePendingMax + 64;
+        PVCIBLKRANGE paFreePendingNew = (PVCIBLKRANGE)RTMemRealloc(pCache->paFreePending,
+                                                                   cFreePendingMaxNew * sizeof(VCIBLKRANGE));
+        if (!paFreePendingNew)
+        {
+            /* The blocks stay allocated until the image is opened the next time. */
+            LogRel(("VCI: Leaking %llu blocks at %llu because of VERR_NO_MEMORY\n", cBlocks, offBlockAddr));
+            return;
+        }
+
+        pCache->paFreePending   = paFreePendingNew;
+        pCache->cFreePendingMax = cFreePendingMaxNew;
+    }
+
+    pCache->paFreePending[pCache->cFreePending].offAddrStart = offBlockAddr;
+    pCache->paFreePending[pCache->cFreePending].cBlocks      = cBlocks;
+    pCache->cFreePending++;
+}
+
+/**
+ * Removes a cache extent and releases its blocks.
+ *
+ * @returns nothing.
+ * @param   pCache          The cache image instance.
+ * @param   pExtent         The extent to remove.
+ */
+static void vciExtentRemove(PVCICACHE pCache, PVCIEXTENT pExtent)
+{
+    uint64_t cBlocks = pExtent->Core.KeyLast - pExtent->Core.Key + 1;
+
+    PAVLRU64NODECORE pCore = RTAvlrU64Remove(pCache->pTreeExtents, pExtent->Core.Key);
+    Assert(pCore == &pExtent->Core); NOREF(pCore);
+    RTListNodeRemove(&pExtent->NodeLru);
+
+    vciBlocksRelease(pCache, pExtent->u64BlockAddr, cBlocks, pExtent->fDirtyOnDisk);
+    if (pExtent->fDirty)
+    {
+        pCache->cBlocksDirty -= cBlocks;
+        pCache->fDirtyChanged = true;
+    }
+    pCache->cExtents--;
+    pCache->fTreeChanged = true;
+
+    RTMemFree(pExtent);
+}
+
+/**
+ * Destroys a cache extent when the image is closed, called for every node in the tree.
+ */
+static DECLCALLBACK(int) vciExtentDestroy(PAVLRU64NODECORE pCore, void *pvUser)
+{
+    NOREF(pvUser);
+    RTMemFree(pCore);
+    return VINF_SUCCESS;
+}
+
+/**
+ * Drops all cached data in the given range of the virtual disk, trimming or
+ * splitting the affected extents.
+ *
+ * @returns VBox status code.
+ * @param   pCache          The cache image instance.
+ * @param   offBlock        First block of the virtual disk to drop.
+ * @param   cBlocks         Number of blocks to drop.
+ * @param   ppExtentSpare   Where to take the extent from if one must be split,
+ *                          optional. Set to NULL if it was used.
+ */
+static int vciExtentRangeDrop(PVCICACHE pCache, uint64_t offBlock, uint64_t cBlocks,
+                              PVCIEXTENT *ppExtentSpare)
+{
+    int rc = VINF_SUCCESS;
+    uint64_t offBlockLast = offBlock + cBlocks - 1;
+
+    while (offBlock <= offBlockLast)
+    {
+        PVCIEXTENT pExtent = (PVCIEXTENT)RTAvlrU64RangeGet(pCache->pTreeExtents, offBlock);
+        if (!pExtent)
+        {
+            pExtent = (PVCIEXTENT)RTAvlrU64GetBestFit(pCache->pTreeExtents, offBlock, true /* fAbove */);
+            if (   !pExtent
+                || pExtent->Core.Key > offBlockLast)
+                break;
+        }
+
+        uint64_t offOverlapStart = RT_MAX(offBlock, pExtent->Core.Key);
+        uint64_t offOverlapLast  = RT_MIN(offBlockLast, pExtent->Core.KeyLast);
+        uint64_t cBlocksOverlap  = offOverlapLast - offOverlapStart + 1;
+
+        if (   pExtent->Core.Key == offOverlapStart
+            && pExtent->Core.KeyLast == offOverlapLast)
+            vciExtentRemove(pCache, pExtent);
+        else
+        {
+            PVCIEXTENT pTail = NULL;
+
+            /* Dropping from the middle of an extent needs a new one for the tail. */
+            if (   pExtent->Core.Key < offOverlapStart
+                && pExtent->Core.KeyLast > offOverlapLast)
+            {
+                if (ppExtentSpare && *ppExtentSpare)
+                {
+                    pTail = *ppExtentSpare;
+                    *ppExtentSpare = NULL;
+                }
                 else
-                    pBlkMap->pRangesTail = pBlkPrev;
+                {
+                    pTail = (PVCIEXTENT)RTMemAllocZ(sizeof(VCIEXTENT));
+                    if (!pTail)
+                    {
+                        rc = VERR_NO_MEMORY;
+                        break;
+                    }
+                }
 
-                RTMemFree(pBlk);
-                pBlk = pBlkPrev;
+                pTail->Core.Key     = offOverlapLast + 1;
+                pTail->Core.KeyLast = pExtent->Core.KeyLast;
+                pTail->u64BlockAddr = pExtent->u64BlockAddr + (pTail->Core.Key - pExtent->Core.Key);
+                pTail->fDirty       = pExtent->fDirty;
+                pTail->fDirtyOnDisk = pExtent->fDirtyOnDisk;
+                pTail->fWriteBack   = pExtent->fWriteBack;
             }
 
-            /* Now the one to the right. */
-            if (   pBlk->pNext
-                && pBlk->pNext->fFree)
+            RTAvlrU64Remove(pCache->pTreeExtents, pExtent->Core.Key);
+            vciBlocksRelease(pCache, pExtent->u64BlockAddr + (offOverlapStart - pExtent->Core.Key),
+                             cBlocksOverlap, pExtent->fDirtyOnDisk);
+            if (pExtent->fDirty)
             {
-                PVCIBLKRANGEDESC pBlkNext = pBlk->pNext;
+                pCache->cBlocksDirty -= cBlocksOverlap;
+                pCache->fDirtyChanged = true;
+            }
 
-                Assert(pBlk->offAddrStart + pBlk->cBlocks == pBlkNext->offAddrStart);
-                pBlk->cBlocks += pBlkNext->cBlocks;
-                pBlk->pNext = pBlkNext->pNext;
-                if (pBlkNext->pNext)
-                    pBlkNext->pNext->pPrev = pBlk;
-                else
-                    pBlkMap->pRangesTail = pBlk;
+            if (pExtent->Core.Key < offOverlapStart)
+                pExtent->Core.KeyLast = offOverlapStart - 1;
+            else
+            {
+                pExtent->u64BlockAddr += offOverlapLast + 1 - pExtent->Core.Key;
+                pExtent->Core.Key      = offOverlapLast + 1;
+            }
+
+            bool fInserted = RTAvlrU64Insert(pCache->pTreeExtents, &pExtent->Core);
+            Assert(fInserted); NOREF(fInserted);
 
-                RTMemFree(pBlkNext);
+            if (pTail)
+            {
+                fInserted = RTAvlrU64Insert(pCache->pTreeExtents, &pTail->Core);
+                Assert(fInserted);
+                RTListNodeInsertAfter(&pExtent->NodeLru, &pTail->NodeLru);
+                pCache->cExtents++;
             }
+
+            pCache->fTreeChanged = true;
         }
-        else
+
+        if (offOverlapLast == offBlockLast)
+            break;
+        offBlock = offOverlapLast + 1;
+    }
+
+    return rc;
+}
+
+/**
+ * Evicts a batch of clean extents from the end of the LRU list.
+ *
+ * @returns Number of extents evicted.
+ * @param   pCache          The cache image instance.
+ */
+static unsigned vciEvict(PVCICACHE pCache)
+{
+    unsigned cEvicted = 0;
+    PVCIEXTENT pExtent = RTListGetLast(&pCache->ListLru, VCIEXTENT, NodeLru);
+
+    while (   pExtent
+           && cEvicted < VCI_EVICT_BATCH)
+    {
+        PVCIEXTENT pPrev = RTListGetPrev(&pCache->ListLru, pExtent, VCIEXTENT, NodeLru);
+
+        if (!pExtent->fDirty)
+        {
+            vciExtentRemove(pCache, pExtent);
+            cEvicted++;
+        }
+
+        pExtent = pPrev;
+    }
+
+    return cEvicted;
+}
+
+/**
+ * Allocates space for cached data, evicting clean data if required.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_VD_CACHE_FULL if the cache contains only dirty data.
+ * @param   pCache          The cache image instance.
+ * @param   cBlocks         Number of blocks to allocate.
+ * @param   poffBlockAddr   Where to store the start of the allocated region.
+ * @param   pcBlocks        Where to store the number of blocks allocated,
+ *                          might be less than requested.
+ */
+static int vciDataAlloc(PVCICACHE pCache, uint64_t cBlocks, uint64_t *poffBlockAddr, uint64_t *pcBlocks)
+{
+    int rc = VINF_SUCCESS;
+
+    for (;;)
+    {
+        /* Keep enough space to write the tree during the next checkpoint. */
+        uint64_t cBlocksReserved = vciTreeGetSize(pCache->cExtents + 2);
+
+        if (pCache->pBlkMap->cBlocksFree > cBlocksReserved)
         {
-            /* The block is intersecting. */
-            AssertMsgFailed(("TODO\n"));
+            rc = vciBlkMapAllocate(pCache->pBlkMap,
+                                   RT_MIN(cBlocks, pCache->pBlkMap->cBlocksFree - cBlocksReserved),
+                                   VCIBLKMAP_ALLOC_DATA, poffBlockAddr, pcBlocks);
+            if (rc != VERR_VCI_NO_BLOCKS_FREE)
+                break;
         }
+
+        if (vciEvict(pCache))
+            continue;
+
+        /* Blocks of overwritten dirty data become available after a checkpoint. */
+        if (pCache->cFreePending)
+        {
+            rc = vciCommit(pCache);
+            if (RT_FAILURE(rc))
+                break;
+            continue;
+        }
+
+        rc = VERR_VD_CACHE_FULL;
+        break;
     }
 
-    if ((fFlags & VCIBLKMAP_ALLOC_MASK) == VCIBLKMAP_ALLOC_DATA)
-        pBlkMap->cBlocksAllocMeta -= cBlocks;
-    else
-        pBlkMap->cBlocksAllocData -= cBlocks;
+    return rc;
+}
+
+/**
+ * Checks whether the given range starts with dirty data and limits the range
+ * to the part which is either completely dirty or completely clean.
+ *
+ * @returns true if the range is dirty, false otherwise.
+ * @param   pCache          The cache image instance.
+ * @param   offBlock        First block of the range.
+ * @param   pcBlocks        Number of blocks in the range, updated on return.
+ */
+static bool vciRangeStartsDirty(PVCICACHE pCache, uint64_t offBlock, uint64_t *pcBlocks)
+{
+    uint64_t offBlockLast = offBlock + *pcBlocks - 1;
+    uint64_t offBlockCur = offBlock;
+    PVCIEXTENT pExtent = (PVCIEXTENT)RTAvlrU64RangeGet(pCache->pTreeExtents, offBlock);
+
+    if (pExtent)
+    {
+        if (pExtent->fDirty)
+        {
+            *pcBlocks = RT_MIN(*pcBlocks, pExtent->Core.KeyLast - offBlock + 1);
+            return true;
+        }
+        offBlockCur = pExtent->Core.KeyLast + 1;
+    }
+
+    while (offBlockCur <= offBlockLast)
+    {
+        pExtent = (PVCIEXTENT)RTAvlrU64GetBestFit(pCache->pTreeExtents, offBlockCur, true /* fAbove */);
+        if (   !pExtent
+            || pExtent->Core.Key > offBlockLast)
+            break;
+
+        if (pExtent->fDirty)
+        {
+            *pcBlocks = pExtent->Core.Key - offBlock;
+            break;
+        }
+
+        offBlockCur = pExtent->Core.KeyLast + 1;
+    }
+
+    return false;
+}
+
+/**
+ * Appends a node to the current level while writing the tree.
+ *
+ * @returns VBox status code.
+ * @param   pState          The commit state.
+ */
+static int vciCommitNodeWrite(PVCICOMMITSTATE pState)
+{
+    PVCICACHE pCache = pState->pCache;
+    uint64_t offBlockAddr = 0;
+    int rc;
+
+    if (pState->cLevel == pState->cLevelMax)
+    {
+        unsigned cLevelMaxNew = pState->cLevelMax + 64;
+        PVCICOMMITNODE paLevelNew = (PVCICOMMITNODE)RTMemRealloc(pState->paLevel, cLevelMaxNew * sizeof(VCICOMMITNODE));
+        if (!paLevelNew)
+            return VERR_NO_MEMORY;
+        pState->paLevel   = paLevelNew;
+        pState->cLevelMax = cLevelMaxNew;
+    }
+
+    if (pState->cNodes == pState->cNodesMax)
+    {
+        unsigned cNodesMaxNew = pState->cNodesMax + 64;
+        uint64_t *pau64NodesNew = (uint64_t *)RTMemRealloc(pState->pau64Nodes, cNodesMaxNew * sizeof(uint64_t));
+        if (!pau64NodesNew)
+            return VERR_NO_MEMORY;
+        pState->pau64Nodes = pau64NodesNew;
+        pState->cNodesMax  = cNodesMaxNew;
+    }
+
+    rc = vciBlkMapAllocate(pCache->pBlkMap, VCI_TREE_NODE_BLOCKS, VCIBLKMAP_ALLOC_META,
+                           &offBlockAddr, NULL);
+    if (rc == VERR_VCI_NO_BLOCKS_FREE)
+        rc = VERR_VD_CACHE_FULL;
+    if (RT_FAILURE(rc))
+        return rc;
+
+    pState->pau64Nodes[pState->cNodes++] = offBlockAddr;
+
+    rc = vdIfIoIntFileWriteSync(pCache->pIfIo, pCache->pStorage, VCI_BLOCK2BYTE(offBlockAddr),
+                                &pState->Node, sizeof(VciTreeNode));
+    if (RT_SUCCESS(rc))
+    {
+        pState->paLevel[pState->cLevel].u64BlockAddr  = offBlockAddr;
+        pState->paLevel[pState->cLevel].u64BlockFirst = pState->u64BlockFirst;
+        pState->paLevel[pState->cLevel].u64BlockLast  = pState->u64BlockLast;
+        pState->cLevel++;
+
+        memset(pState->Node.au8Data, 0, sizeof(pState->Node.au8Data));
+        pState->cEntries = 0;
+    }
 
-    pBlkMap->cBlocksFree += cBlocks;
+    return rc;
+}
 
-    LogFlowFunc(("returns\n"));
+/**
+ * Adds an extent to the current leaf while writing the tree.
+ */
+static DECLCALLBACK(int) vciCommitLeafCallback(PAVLRU64NODECORE pCore, void *pvUser)
+{
+    PVCICOMMITSTATE pState = (PVCICOMMITSTATE)pvUser;
+    PVCIEXTENT pExtent = (PVCIEXTENT)pCore;
+    PVciCacheExtent pExtentImage = (PVciCacheExtent)&pState->Node.au8Data[pState->cEntries * sizeof(VciCacheExtent)];
+
+    pExtentImage->u64ExtentPrev  = 0;
+    pExtentImage->u64ExtentNext  = 0;
+    pExtentImage->u8Flags        = pExtent->fDirty ? VCI_CACHE_EXTENT_FLAGS_DIRTY : 0;
+    pExtentImage->u8Reserved     = 0;
+    pExtentImage->u64BlockOffset = RT_H2LE_U64(pExtent->Core.Key);
+    pExtentImage->u32Blocks      = RT_H2LE_U32((uint32_t)(pExtent->Core.KeyLast - pExtent->Core.Key + 1));
+    pExtentImage->u64BlockAddr   = RT_H2LE_U64(pExtent->u64BlockAddr);
+
+    if (!pState->cEntries)
+        pState->u64BlockFirst = pExtent->Core.Key;
+    pState->u64BlockLast = pExtent->Core.KeyLast;
+
+    if (++pState->cEntries == VCI_TREE_EXTENTS_PER_NODE)
+        return vciCommitNodeWrite(pState);
+
+    return VINF_SUCCESS;
 }
 
 /**
- * Converts a tree node from the image to the in memory structure.
+ * Writes the B+-Tree to newly allocated blocks and makes it the current one
+ * by updating the header. The blocks of the old tree and blocks released
+ * since the last checkpoint are freed afterwards.
  *
- * @returns Pointer to the in memory tree node.
- * @param   offBlockAddrNode    Block address of the node.
- * @param   pNodeImage          Pointer to the image representation of the node.
+ * @returns VBox status code.
+ * @param   pCache          The cache image instance.
  */
-static PVCITREENODE vciTreeNodeImage2Host(uint64_t offBlockAddrNode, PVciTreeNode pNodeImage)
+static int vciCommit(PVCICACHE pCache)
 {
-    PVCITREENODE pNode = NULL;
+    int rc = VINF_SUCCESS;
+    PVCICOMMITSTATE pState;
+
+    LogFlowFunc(("pCache=%#p\n", pCache));
+
+    if (   !pCache->fTreeChanged
+        || (pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY))
+        return VINF_SUCCESS;
+
+    pState = (PVCICOMMITSTATE)RTMemAllocZ(sizeof(VCICOMMITSTATE));
+    if (!pState)
+        return VERR_NO_MEMORY;
 
-    if (pNodeImage->u8Type == VCI_TREE_NODE_TYPE_LEAF)
+    pState->pCache = pCache;
+
+    do
     {
-        PVCITREENODELEAF pLeaf = (PVCITREENODELEAF)RTMemAllocZ(sizeof(VCITREENODELEAF));
+        /* The data of all extents must be on the disk before the tree referencing it. */
+        rc = vciFlushImage(pCache);
+        if (RT_FAILURE(rc))
+            break;
+
+        /* Write the leaves first and then the internal nodes level by level. */
+        pState->Node.u8Type = VCI_TREE_NODE_TYPE_LEAF;
+        rc = RTAvlrU64DoWithAll(pCache->pTreeExtents, true /* fFromLeft */, vciCommitLeafCallback, pState);
+        if (RT_FAILURE(rc))
+            break;
+        if (   pState->cEntries
+            || !pState->cLevel)
+        {
+            rc = vciCommitNodeWrite(pState);
+            if (RT_FAILURE(rc))
+                break;
+        }
 
-        if (pLeaf)
+        while (pState->cLevel > 1)
         {
-            PVciCacheExtent pExtent = (PVciCacheExtent)&pNodeImage->au8Data[0];
+            PVCICOMMITNODE paLevelPrev = pState->paLevel;
+            unsigned cLevelPrev = pState->cLevel;
 
-            pLeaf->Core.u8Type = VCI_TREE_NODE_TYPE_LEAF;
+            pState->paLevel     = NULL;
+            pState->cLevel      = 0;
+            pState->cLevelMax   = 0;
+            pState->Node.u8Type = VCI_TREE_NODE_TYPE_INTERNAL;
 
-            for (unsigned idx = 0; idx < RT_ELEMENTS(pLeaf->aExtents); idx++)
+            for (unsigned i = 0; i < cLevelPrev && RT_SUCCESS(rc); i++)
             {
-                pLeaf->aExtents[idx].u64BlockOffset = RT_LE2H_U64(pExtent->u64BlockOffset);
-                pLeaf->aExtents[idx].u32Blocks      = RT_LE2H_U32(pExtent->u32Blocks);
-                pLeaf->aExtents[idx].u64BlockAddr   = RT_LE2H_U64(pExtent->u64BlockAddr);
-                pExtent++;
-
-                if (   pLeaf->aExtents[idx].u32Blocks
-                    && pLeaf->aExtents[idx].u64BlockAddr)
-                    pLeaf->cUsedNodes++;
+                PVciTreeNodeInternal pIntImage = (PVciTreeNodeInternal)&pState->Node.au8Data[pState->cEntries * sizeof(VciTreeNodeInternal)];
+                uint64_t cBlocks = paLevelPrev[i].u64BlockLast - paLevelPrev[i].u64BlockFirst + 1;
+
+                pIntImage->u64BlockOffset = RT_H2LE_U64(paLevelPrev[i].u64BlockFirst);
+                pIntImage->u32Blocks      = RT_H2LE_U32((uint32_t)RT_MIN(cBlocks, UINT32_MAX));
+                pIntImage->u64ChildAddr   = RT_H2LE_U64(paLevelPrev[i].u64BlockAddr);
+
+                if (!pState->cEntries)
+                    pState->u64BlockFirst = paLevelPrev[i].u64BlockFirst;
+                pState->u64BlockLast = paLevelPrev[i].u64BlockLast;
+
+                if (++pState->cEntries == VCI_TREE_INTERNAL_NODES_PER_NODE)
+                    rc = vciCommitNodeWrite(pState);
             }
 
-            pNode = &pLeaf->Core;
+            if (   RT_SUCCESS(rc)
+                && pState->cEntries)
+                rc = vciCommitNodeWrite(pState);
+
+            RTMemFree(paLevelPrev);
+            if (RT_FAILURE(rc))
+                break;
         }
-    }
-    else if (pNodeImage->u8Type == VCI_TREE_NODE_TYPE_INTERNAL)
-    {
-        PVCITREENODEINT pInt = (PVCITREENODEINT)RTMemAllocZ(sizeof(VCITREENODEINT));
+        if (RT_FAILURE(rc))
+            break;
 
-        if (pInt)
-        {
-            PVciTreeNodeInternal pIntImage = (PVciTreeNodeInternal)&pNodeImage->au8Data[0];
+        Assert(pState->cLevel == 1);
 
-            pInt->Core.u8Type = VCI_TREE_NODE_TYPE_INTERNAL;
+        /* Make the new tree the current one. */
+        rc = vciFlushImage(pCache);
+        if (RT_FAILURE(rc))
+            break;
 
-            for (unsigned idx = 0; idx < RT_ELEMENTS(pInt->aIntNodes); idx++)
-            {
-                pInt->aIntNodes[idx].u64BlockOffset              = RT_LE2H_U64(pIntImage->u64BlockOffset);
-                pInt->aIntNodes[idx].u32Blocks                   = RT_LE2H_U32(pIntImage->u32Blocks);
-                pInt->aIntNodes[idx].PtrChild.fInMemory          = false;
-                pInt->aIntNodes[idx].PtrChild.u.offAddrBlockNode = RT_LE2H_U64(pIntImage->u64ChildAddr);
-                pIntImage++;
-
-                if (   pInt->aIntNodes[idx].u32Blocks
-                    && pInt->aIntNodes[idx].PtrChild.u.offAddrBlockNode)
-                    pInt->cUsedNodes++;
-            }
+        uint64_t offTreeRootOld = pCache->offTreeRoot;
+        pCache->offTreeRoot = pState->paLevel[0].u64BlockAddr;
+        rc = vciHdrWrite(pCache, pCache->fHdrUnclean);
+        if (RT_SUCCESS(rc))
+            rc = vciFlushImage(pCache);
+        if (RT_FAILURE(rc))
+        {
+            pCache->offTreeRoot = offTreeRootOld;
+            break;
+        }
 
-            pNode = &pInt->Core;
+        /* The old tree and the data it references as dirty can be reused now. */
+        for (unsigned i = 0; i < pCache->cTreeNodes; i++)
+            vciBlkMapFree(pCache->pBlkMap, pCache->pau64TreeNodes[i], VCI_TREE_NODE_BLOCKS,
+                          VCIBLKMAP_ALLOC_META);
+        RTMemFree(pCache->pau64TreeNodes);
+        pCache->pau64TreeNodes = pState->pau64Nodes;
+        pCache->cTreeNodes     = pState->cNodes;
+        pState->pau64Nodes     = NULL;
+        pState->cNodes         = 0;
+
+        for (unsigned i = 0; i < pCache->cFreePending; i++)
+            vciBlkMapFree(pCache->pBlkMap, pCache->paFreePending[i].offAddrStart,
+                          pCache->paFreePending[i].cBlocks, VCIBLKMAP_ALLOC_DATA);
+        pCache->cFreePending = 0;
+
+        PVCIEXTENT pExtent;
+        RTListForEach(&pCache->ListLru, pExtent, VCIEXTENT, NodeLru)
+        {
+            pExtent->fDirtyOnDisk = pExtent->fDirty;
         }
-    }
-    else
-        AssertMsgFailed(("Invalid node type %d\n", pNodeImage->u8Type));
 
-    if (pNode)
-        pNode->u64BlockAddr = offBlockAddrNode;
+        pCache->fTreeChanged  = false;
+        pCache->fDirtyChanged = false;
+    } while (0);
+
+    /* Release the nodes written if something went wrong. */
+    for (unsigned i = 0; i < pState->cNodes; i++)
+        vciBlkMapFree(pCache->pBlkMap, pState->pau64Nodes[i], VCI_TREE_NODE_BLOCKS,
+                      VCIBLKMAP_ALLOC_META);
 
-    return pNode;
+    if (pState->pau64Nodes)
+        RTMemFree(pState->pau64Nodes);
+    if (pState->paLevel)
+        RTMemFree(pState->paLevel);
+    RTMemFree(pState);
+
+    LogFlowFunc(("returns rc=%Rrc\n", rc));
+    return rc;
 }
 
 /**
- * Looks up the cache extent for the given virtual block address.
+ * Loads a node of the B+-Tree and all nodes below it, inserting the cache
+ * extents and marking all used blocks as allocated.
  *
- * @returns Pointer to the cache extent or NULL if none could be found.
- * @param   pCache         The cache image instance.
- * @param   offBlockOffset The block offset to search for.
- * @param   ppNextBestFit  Where to store the pointer to the next best fit
- *                         cache extent above offBlockOffset if existing. - Optional
- *                         This is always filled if possible even if the function returns NULL.
+ * @returns VBox status code.
+ * @param   pCache           The cache image instance.
+ * @param   offBlockAddrNode Block address of the node.
+ * @param   uDepth           Depth of the node in the tree.
+ * @param   fDropClean       Flag whether to drop clean extents.
  */
-static PVCICACHEEXTENT vciCacheExtentLookup(PVCICACHE pCache, uint64_t offBlockOffset,
-                                            PVCICACHEEXTENT *ppNextBestFit)
+static int vciTreeLoadNode(PVCICACHE pCache, uint64_t offBlockAddrNode, unsigned uDepth,
+                           bool fDropClean)
 {
     int rc = VINF_SUCCESS;
-    PVCICACHEEXTENT pExtent = NULL;
-    PVCITREENODE pNodeCur = pCache->pRoot;
+    PVciTreeNode pNode;
 
-    while (   RT_SUCCESS(rc)
-           && pNodeCur
-           && pNodeCur->u8Type != VCI_TREE_NODE_TYPE_LEAF)
+    if (uDepth > VCI_TREE_DEPTH_MAX)
+        return VERR_VD_GEN_INVALID_HEADER;
+
+    if (pCache->cTreeNodes % 64 == 0)
     {
-        PVCITREENODEINT pNodeInt = (PVCITREENODEINT)pNodeCur;
+        uint64_t *pau64TreeNodesNew = (uint64_t *)RTMemRealloc(pCache->pau64TreeNodes,
+                                                               (pCache->cTreeNodes + 64) * sizeof(uint64_t));
+        if (!pau64TreeNodesNew)
+            return VERR_NO_MEMORY;
+        pCache->pau64TreeNodes = pau64TreeNodesNew;
+    }
 
-        Assert(pNodeCur->u8Type == VCI_TREE_NODE_TYPE_INTERNAL);
+    rc = vciBlkMapAllocateAt(pCache->pBlkMap, offBlockAddrNode, VCI_TREE_NODE_BLOCKS, VCIBLKMAP_ALLOC_META);
+    if (RT_FAILURE(rc))
+        return rc;
+    pCache->pau64TreeNodes[pCache->cTreeNodes++] = offBlockAddrNode;
 
-        /* Search for the correct internal node. */
-        unsigned idxMin = 0;
-        unsigned idxMax = pNodeInt->cUsedNodes;
-        unsigned idxCur = pNodeInt->cUsedNodes / 2;
+    pNode = (PVciTreeNode)RTMemTmpAlloc(sizeof(VciTreeNode));
+    if (!pNode)
+        return VERR_NO_MEMORY;
 
-        while (idxMin < idxMax)
+    rc = vdIfIoIntFileReadSync(pCache->pIfIo, pCache->pStorage, VCI_BLOCK2BYTE(offBlockAddrNode),
+                               pNode, sizeof(VciTreeNode));
+    if (RT_SUCCESS(rc))
+    {
+        if (pNode->u8Type == VCI_TREE_NODE_TYPE_LEAF)
         {
-            PVCINODEINTERNAL pInt = &pNodeInt->aIntNodes[idxCur];
+            PVciCacheExtent pExtentImage = (PVciCacheExtent)&pNode->au8Data[0];
 
-            /* Determine the search direction. */
-            if (offBlockOffset < pInt->u64BlockOffset)
+            for (unsigned idx = 0; idx < VCI_TREE_EXTENTS_PER_NODE && RT_SUCCESS(rc); idx++, pExtentImage++)
             {
-                /* Search left from the current extent. */
-                idxMax = idxCur;
-            }
-            else if (offBlockOffset >= pInt->u64BlockOffset + pInt->u32Blocks)
-            {
-                /* Search right from the current extent. */
-                idxMin = idxCur;
-            }
-            else
-            {
-                /* The block lies in the node, stop searching. */
-                if (pInt->PtrChild.fInMemory)
-                    pNodeCur = pInt->PtrChild.u.pNode;
-                else
-                {
-                    PVCITREENODE pNodeNew;
-                    VciTreeNode NodeTree;
+                uint64_t u64BlockOffset = RT_LE2H_U64(pExtentImage->u64BlockOffset);
+                uint32_t u32Blocks      = RT_LE2H_U32(pExtentImage->u32Blocks);
+                uint64_t u64BlockAddr   = RT_LE2H_U64(pExtentImage->u64BlockAddr);
+                bool fDirty             = RT_BOOL(pExtentImage->u8Flags & VCI_CACHE_EXTENT_FLAGS_DIRTY);
+
+                if (   !u32Blocks
+                    || !u64BlockAddr
+                    || (fDropClean && !fDirty))
+                    continue;
+
+                rc = vciBlkMapAllocateAt(pCache->pBlkMap, u64BlockAddr, u32Blocks, VCIBLKMAP_ALLOC_DATA);
+                if (RT_FAILURE(rc))
+                    break;
 
-                    /* Read from disk and add to the tree. */
-                    rc = vdIfIoIntFileReadSync(pCache->pIfIo, pCache->pStorage,
-                                               VCI_BLOCK2BYTE(pInt->PtrChild.u.offAddrBlockNode),
-                                               &NodeTree, sizeof(NodeTree));
-                    AssertRC(rc);
+                PVCIEXTENT pExtent = (PVCIEXTENT)RTMemAllocZ(sizeof(VCIEXTENT));
+                if (!pExtent)
+                {
+                    rc = VERR_NO_MEMORY;
+                    break;
+                }
 
-                    pNodeNew = vciTreeNodeImage2Host(pInt->PtrChild.u.offAddrBlockNode, &NodeTree);
-                    if (pNodeNew)
-                    {
-                        /* Link to the parent. */
-                        pInt->PtrChild.fInMemory = true;
-                        pInt->PtrChild.u.pNode = pNodeNew;
-                        pNodeNew->pParent = pNodeCur;
-                        pNodeCur = pNodeNew;
-                    }
-                    else
-                        rc = VERR_NO_MEMORY;
+                pExtent->Core.Key     = u64BlockOffset;
+                pExtent->Core.KeyLast = u64BlockOffset + u32Blocks - 1;
+                pExtent->u64BlockAddr = u64BlockAddr;
+                pExtent->fDirty       = fDirty;
+                pExtent->fDirtyOnDisk = fDirty;
+                if (!RTAvlrU64Insert(pCache->pTreeExtents, &pExtent->Core))
+                {
+                    RTMemFree(pExtent);
+                    rc = VERR_VD_GEN_INVALID_HEADER;
+                    break;
                 }
-                break;
+                RTListAppend(&pCache->ListLru, &pExtent->NodeLru);
+                pCache->cExtents++;
+                if (fDirty)
+                    pCache->cBlocksDirty += u32Blocks;
             }
-
-            idxCur = idxMin + (idxMax - idxMin) / 2;
         }
-    }
-
-    if (   RT_SUCCESS(rc)
-        && pNodeCur)
-    {
-        PVCITREENODELEAF pLeaf = (PVCITREENODELEAF)pNodeCur;
-        Assert(pNodeCur->u8Type == VCI_TREE_NODE_TYPE_LEAF);
-
-        /* Search the range. */
-        unsigned idxMin = 0;
-        unsigned idxMax = pLeaf->cUsedNodes;
-        unsigned idxCur = pLeaf->cUsedNodes / 2;
-
-        while (idxMin < idxMax)
+        else if (pNode->u8Type == VCI_TREE_NODE_TYPE_INTERNAL)
         {
-            PVCICACHEEXTENT pExtentCur = &pLeaf->aExtents[idxCur];
-
-            /* Determine the search direction. */
-            if (offBlockOffset < pExtentCur->u64BlockOffset)
-            {
-                /* Search left from the current extent. */
-                idxMax = idxCur;
-            }
-            else if (offBlockOffset >= pExtentCur->u64BlockOffset + pExtentCur->u32Blocks)
-            {
-                /* Search right from the current extent. */
-                idxMin = idxCur;
-            }
-            else
-            {
-                /* We found the extent, stop searching. */
-                pExtent = pExtentCur;
-                break;
-            }
-
-            idxCur = idxMin + (idxMax - idxMin) / 2;
-        }
+            PVciTreeNodeInternal pIntImage = (PVciTreeNodeInternal)&pNode->au8Data[0];
 
-        /* Get the next best fit extent if it exists. */
-        if (ppNextBestFit)
-        {
-            if (idxCur < pLeaf->cUsedNodes - 1)
-                *ppNextBestFit = &pLeaf->aExtents[idxCur + 1];
-            else
+            for (unsigned idx = 0; idx < VCI_TREE_INTERNAL_NODES_PER_NODE && RT_SUCCESS(rc); idx++, pIntImage++)
             {
-                /*
-                 * Go up the tree and find the best extent
-                 * in the leftmost tree of the child subtree to the right.
-                 */
-                PVCITREENODEINT pInt = (PVCITREENODEINT)pLeaf->Core.pParent;
-
-                while (pInt)
-                {
+                uint64_t u64ChildAddr = RT_LE2H_U64(pIntImage->u64ChildAddr);
 
-                }
+                if (   pIntImage->u32Blocks
+                    && u64ChildAddr)
+                    rc = vciTreeLoadNode(pCache, u64ChildAddr, uDepth + 1, fDropClean);
             }
         }
+        else
+            rc = VERR_VD_GEN_INVALID_HEADER;
     }
 
-    return pExtent;
+    RTMemTmpFree(pNode);
+    return rc;
 }
 
 /**
@@ -1227,8 +1703,7 @@ static int vciOpenImage(PVCICACHE pCache, unsigned uOpenFlags)
         goto out;
     }
 
-    rc = vdIfIoIntFileReadSync(pCache->pIfIo, pCache->pStorage, 0, &Hdr,
-                               VCI_BYTE2BLOCK(sizeof(Hdr)));
+    rc = vdIfIoIntFileReadSync(pCache->pIfIo, pCache->pStorage, 0, &Hdr, sizeof(Hdr));
     if (RT_FAILURE(rc))
     {
         rc = VERR_VD_GEN_INVALID_HEADER;
@@ -1246,25 +1721,73 @@ static int vciOpenImage(PVCICACHE pCache, unsigned uOpenFlags)
     if (   Hdr.u32Signature == VCI_HDR_SIGNATURE
         && Hdr.u32Version == VCI_HDR_VERSION)
     {
+        bool fUnclean = Hdr.fUncleanShutdown != VCI_HDR_CLEAN_SHUTDOWN;
+
+        pCache->cbSize        = VCI_BLOCK2BYTE(Hdr.cBlocksCache);
+        pCache->u32CacheType  = Hdr.u32CacheType;
         pCache->offTreeRoot   = Hdr.offTreeRoot;
         pCache->offBlksBitmap = Hdr.offBlkMap;
+        pCache->uImageFlags   =   Hdr.u32CacheType == VCI_HDR_CACHE_TYPE_FIXED
+                                ? VD_IMAGE_FLAGS_FIXED
+                                : VD_IMAGE_FLAGS_NONE;
+
+        pCache->pTreeExtents = (PAVLRU64TREE)RTMemAllocZ(sizeof(AVLRU64TREE));
+        if (!pCache->pTreeExtents)
+        {
+            rc = VERR_NO_MEMORY;
+            goto out;
+        }
+        RTListInit(&pCache->ListLru);
 
-        /* Load the block map. */
-        rc = vciBlkMapLoad(pCache, pCache->offBlksBitmap, Hdr.cBlkMap, &pCache->pBlkMap);
+        /*
+         * The block map is rebuilt from the tree because the one on the disk
+         * is only up to date after a clean shutdown.
+         */
+        rc = vciBlkMapCreate(Hdr.cBlocksCache, &pCache->pBlkMap, &pCache->cBlkMap);
+        if (RT_FAILURE(rc))
+            goto out;
+
+        if (pCache->cBlkMap != Hdr.cBlkMap)
+        {
+            rc = VERR_VD_GEN_INVALID_HEADER;
+            goto out;
+        }
+
+        rc = vciBlkMapAllocateAt(pCache->pBlkMap, 0, VCI_BYTE2BLOCK(sizeof(VciHdr)), VCIBLKMAP_ALLOC_META);
         if (RT_SUCCESS(rc))
+            rc = vciBlkMapAllocateAt(pCache->pBlkMap, pCache->offBlksBitmap, pCache->cBlkMap, VCIBLKMAP_ALLOC_META);
+        if (RT_FAILURE(rc))
+            goto out;
+
+        /*
+         * Clean data might be stale after a crash because invalidations are
+         * only persisted when the dirty data changes, so keep only the data
+         * which wasn't written back to the image yet.
+         */
+        if (fUnclean)
+            LogRel(("VCI: Cache '%s' was not closed cleanly, dropping clean data\n", pCache->pszFilename));
+
+        rc = vciTreeLoadNode(pCache, pCache->offTreeRoot, 0, fUnclean);
+        if (RT_FAILURE(rc))
         {
-            /* Load the first tree node. */
-            VciTreeNode RootNode;
+            if (rc == VERR_VD_GEN_INVALID_HEADER)
+                rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: B+-Tree in '%s' is corrupted"), pCache->pszFilename);
+            goto out;
+        }
+
+        pCache->fTreeChanged = fUnclean;
 
-            rc = vdIfIoIntFileReadSync(pCache->pIfIo, pCache->pStorage,
-                                       pCache->offTreeRoot, &RootNode,
-                                       VCI_BYTE2BLOCK(sizeof(VciTreeNode)));
+        LogRel(("VCI: Cache '%s' holds %llu extents, %llu blocks dirty\n",
+                pCache->pszFilename, pCache->cExtents, pCache->cBlocksDirty));
+
+        /* Mark the cache as in use until it is closed. */
+        if (!(uOpenFlags & VD_OPEN_FLAGS_READONLY))
+        {
+            rc = vciHdrWrite(pCache, true /* fUnclean */);
             if (RT_SUCCESS(rc))
-            {
-                pCache->pRoot = vciTreeNodeImage2Host(pCache->offTreeRoot, &RootNode);
-                if (!pCache->pRoot)
-                    rc = VERR_NO_MEMORY;
-            }
+                rc = vciFlushImage(pCache);
+            if (RT_SUCCESS(rc))
+                pCache->fHdrUnclean = true;
         }
     }
     else
@@ -1285,7 +1808,6 @@ static int vciCreateImage(PVCICACHE pCache, uint64_t cbSize,
                           void *pvUser, unsigned uPercentStart,
                           unsigned uPercentSpan)
 {
-    VciHdr Hdr;
     VciTreeNode NodeRoot;
     int rc;
     uint64_t cBlocks = cbSize / VCI_BLOCK_SIZE; /* Size of the cache in blocks. */
@@ -1316,9 +1838,16 @@ static int vciCreateImage(PVCICACHE pCache, uint64_t cbSize,
             break;
         }
 
+        pCache->pTreeExtents = (PAVLRU64TREE)RTMemAllocZ(sizeof(AVLRU64TREE));
+        if (!pCache->pTreeExtents)
+        {
+            rc = vdIfError(pCache->pIfError, VERR_NO_MEMORY, RT_SRC_POS, N_("VCI: cannot allocate B+-Tree root pointer '%s'"), pCache->pszFilename);
+            break;
+        }
+        RTListInit(&pCache->ListLru);
+
         /* Allocate block bitmap. */
-        uint32_t cBlkMap = 0;
-        rc = vciBlkMapCreate(cBlocks, &pCache->pBlkMap, &cBlkMap);
+        rc = vciBlkMapCreate(cBlocks, &pCache->pBlkMap, &pCache->cBlkMap);
         if (RT_FAILURE(rc))
         {
             rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot create block bitmap '%s'"), pCache->pszFilename);
@@ -1330,7 +1859,7 @@ static int vciCreateImage(PVCICACHE pCache, uint64_t cbSize,
          * Because the block map is empty the header has to start at block 0
          */
         uint64_t offHdr = 0;
-        rc = vciBlkMapAllocate(pCache->pBlkMap, VCI_BYTE2BLOCK(sizeof(VciHdr)), VCIBLKMAP_ALLOC_META, &offHdr);
+        rc = vciBlkMapAllocate(pCache->pBlkMap, VCI_BYTE2BLOCK(sizeof(VciHdr)), VCIBLKMAP_ALLOC_META, &offHdr, NULL);
         if (RT_FAILURE(rc))
         {
             rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot allocate space for header in block bitmap '%s'"), pCache->pszFilename);
@@ -1342,8 +1871,7 @@ static int vciCreateImage(PVCICACHE pCache, uint64_t cbSize,
         /*
          * Allocate space for the block map itself.
          */
-        uint64_t offBlkMap = 0;
-        rc = vciBlkMapAllocate(pCache->pBlkMap, cBlkMap, VCIBLKMAP_ALLOC_META, &offBlkMap);
+        rc = vciBlkMapAllocate(pCache->pBlkMap, pCache->cBlkMap, VCIBLKMAP_ALLOC_META, &pCache->offBlksBitmap, NULL);
         if (RT_FAILURE(rc))
         {
             rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot allocate space for block map in block map '%s'"), pCache->pszFilename);
@@ -1353,54 +1881,39 @@ static int vciCreateImage(PVCICACHE pCache, uint64_t cbSize,
         /*
          * Allocate space for the tree root node.
          */
-        uint64_t offTreeRoot = 0;
-        rc = vciBlkMapAllocate(pCache->pBlkMap, VCI_BYTE2BLOCK(sizeof(VciTreeNode)), VCIBLKMAP_ALLOC_META, &offTreeRoot);
+        rc = vciBlkMapAllocate(pCache->pBlkMap, VCI_TREE_NODE_BLOCKS, VCIBLKMAP_ALLOC_META, &pCache->offTreeRoot, NULL);
         if (RT_FAILURE(rc))
         {
             rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot allocate space for block map in block map '%s'"), pCache->pszFilename);
             break;
         }
 
-        /*
-         * Allocate the in memory root node.
-         */
-        pCache->pRoot = (PVCITREENODE)RTMemAllocZ(sizeof(VCITREENODELEAF));
-        if (!pCache->pRoot)
+        pCache->pau64TreeNodes = (uint64_t *)RTMemAllocZ(64 * sizeof(uint64_t));
+        if (!pCache->pau64TreeNodes)
         {
-            rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot allocate B+-Tree root pointer '%s'"), pCache->pszFilename);
+            rc = vdIfError(pCache->pIfError, VERR_NO_MEMORY, RT_SRC_POS, N_("VCI: cannot allocate B+-Tree root pointer '%s'"), pCache->pszFilename);
             break;
         }
-
-        pCache->pRoot->u8Type = VCI_TREE_NODE_TYPE_LEAF;
-        /* Rest remains 0 as the tree is still empty. */
+        pCache->pau64TreeNodes[0] = pCache->offTreeRoot;
+        pCache->cTreeNodes = 1;
 
         /*
          * Now that we are here we have all the basic structures and know where to place them in the image.
          * It's time to write it now.
          */
+        pCache->u32CacheType = uImageFlags & VD_IMAGE_FLAGS_FIXED
+                               ? VCI_HDR_CACHE_TYPE_FIXED
+                               : VCI_HDR_CACHE_TYPE_DYNAMIC;
 
-        /* Setup the header. */
-        memset(&Hdr, 0, sizeof(VciHdr));
-        Hdr.u32Signature     = RT_H2LE_U32(VCI_HDR_SIGNATURE);
-        Hdr.u32Version       = RT_H2LE_U32(VCI_HDR_VERSION);
-        Hdr.cBlocksCache     = RT_H2LE_U64(cBlocks);
-        Hdr.fUncleanShutdown = VCI_HDR_UNCLEAN_SHUTDOWN;
-        Hdr.u32CacheType     = uImageFlags & VD_IMAGE_FLAGS_FIXED
-                               ? RT_H2LE_U32(VCI_HDR_CACHE_TYPE_FIXED)
-                               : RT_H2LE_U32(VCI_HDR_CACHE_TYPE_DYNAMIC);
-        Hdr.offTreeRoot      = RT_H2LE_U64(offTreeRoot);
-        Hdr.offBlkMap        = RT_H2LE_U64(offBlkMap);
-        Hdr.cBlkMap          = RT_H2LE_U32(cBlkMap);
-
-        rc = vdIfIoIntFileWriteSync(pCache->pIfIo, pCache->pStorage, offHdr, &Hdr,
-                                    VCI_BYTE2BLOCK(sizeof(VciHdr)));
+        rc = vciHdrWrite(pCache, true /* fUnclean */);
         if (RT_FAILURE(rc))
         {
             rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot write header '%s'"), pCache->pszFilename);
             break;
         }
+        pCache->fHdrUnclean = true;
 
-        rc = vciBlkMapSave(pCache->pBlkMap, pCache, offBlkMap, cBlkMap);
+        rc = vciBlkMapSave(pCache->pBlkMap, pCache, pCache->offBlksBitmap, pCache->cBlkMap);
         if (RT_FAILURE(rc))
         {
             rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot write block map '%s'"), pCache->pszFilename);
@@ -1409,10 +1922,10 @@ static int vciCreateImage(PVCICACHE pCache, uint64_t cbSize,
 
         /* Setup the root tree. */
         memset(&NodeRoot, 0, sizeof(VciTreeNode));
-        NodeRoot.u8Type = RT_H2LE_U32(VCI_TREE_NODE_TYPE_LEAF);
+        NodeRoot.u8Type = VCI_TREE_NODE_TYPE_LEAF;
 
-        rc = vdIfIoIntFileWriteSync(pCache->pIfIo, pCache->pStorage, offTreeRoot,
-                                    &NodeRoot, VCI_BYTE2BLOCK(sizeof(VciTreeNode)));
+        rc = vdIfIoIntFileWriteSync(pCache->pIfIo, pCache->pStorage, VCI_BLOCK2BYTE(pCache->offTreeRoot),
+                                    &NodeRoot, sizeof(VciTreeNode));
         if (RT_FAILURE(rc))
         {
             rc = vdIfError(pCache->pIfError, rc, RT_SRC_POS, N_("VCI: cannot write root node '%s'"), pCache->pszFilename);
@@ -1638,7 +2151,7 @@ static int vciRead(void *pBackendData, uint64_t uOffset, size_t cbToRead,
                  pBackendData, uOffset, cbToRead, pIoCtx, pcbActuallyRead));
     PVCICACHE pCache = (PVCICACHE)pBackendData;
     int rc = VINF_SUCCESS;
-    PVCICACHEEXTENT pExtent;
+    PVCIEXTENT pExtent;
     uint64_t cBlocksToRead = VCI_BYTE2BLOCK(cbToRead);
     uint64_t offBlockAddr  = VCI_BYTE2BLOCK(uOffset);
 
@@ -1646,20 +2159,28 @@ static int vciRead(void *pBackendData, uint64_t uOffset, size_t cbToRead,
     Assert(uOffset % 512 == 0);
     Assert(cbToRead % 512 == 0);
 
-    pExtent = vciCacheExtentLookup(pCache, offBlockAddr, NULL);
+    pExtent = (PVCIEXTENT)RTAvlrU64RangeGet(pCache->pTreeExtents, offBlockAddr);
     if (pExtent)
     {
-        uint64_t offRead = offBlockAddr - pExtent->u64BlockOffset;
-        cBlocksToRead = RT_MIN(cBlocksToRead, pExtent->u32Blocks - offRead);
+        uint64_t offRead = offBlockAddr - pExtent->Core.Key;
+        cBlocksToRead = RT_MIN(cBlocksToRead, pExtent->Core.KeyLast - offBlockAddr + 1);
 
         rc = vdIfIoIntFileReadUser(pCache->pIfIo, pCache->pStorage,
-                                   pExtent->u64BlockAddr + offRead,
-                                   pIoCtx, cBlocksToRead);
+                                   VCI_BLOCK2BYTE(pExtent->u64BlockAddr + offRead),
+                                   pIoCtx, VCI_BLOCK2BYTE(cBlocksToRead));
+
+        /* Move to the front of the LRU list. */
+        RTListNodeRemove(&pExtent->NodeLru);
+        RTListPrepend(&pCache->ListLru, &pExtent->NodeLru);
     }
     else
     {
-        /** @todo Best fit to check whether we have cached data later and set
-         * pcbActuallyRead accordingly. */
+        /* Limit the range to the start of the next cached extent. */
+        pExtent = (PVCIEXTENT)RTAvlrU64GetBestFit(pCache->pTreeExtents, offBlockAddr, true /* fAbove */);
+        if (   pExtent
+            && pExtent->Core.Key < offBlockAddr + cBlocksToRead)
+            cBlocksToRead = pExtent->Core.Key - offBlockAddr;
+
         rc = VERR_VD_BLOCK_FREE;
     }
 
@@ -1670,28 +2191,146 @@ static int vciRead(void *pBackendData, uint64_t uOffset, size_t cbToRead,
     return rc;
 }
 
+/**
+ * Completes a data write to the cache, inserting the new extent on success.
+ *
+ * The extent becomes visible only now, a checkpoint taken while the data is
+ * still being written must not reference it.
+ *
+ * @returns VBox status code.
+ * @param   pBackendData    The cache image instance.
+ * @param   pIoCtx          The I/O context of the write.
+ * @param   pvUser          The write state.
+ * @param   rcReq           Status code of the data write.
+ */
+static DECLCALLBACK(int) vciWriteDataComplete(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    PVCICACHE  pCache  = (PVCICACHE)pBackendData;
+    PVCIWRITE  pWrite  = (PVCIWRITE)pvUser;
+    PVCIEXTENT pExtent = pWrite->pExtent;
+    uint64_t   cBlocks = pExtent->Core.KeyLast - pExtent->Core.Key + 1;
+
+    NOREF(pIoCtx);
+
+    if (RT_SUCCESS(rcReq))
+    {
+        /* Can't fail, at most one extent is split and the spare is used for that. */
+        int rc = vciExtentRangeDrop(pCache, pExtent->Core.Key, cBlocks, &pWrite->pExtentSpare);
+        AssertRC(rc); NOREF(rc);
+
+        bool fInserted = RTAvlrU64Insert(pCache->pTreeExtents, &pExtent->Core);
+        Assert(fInserted); NOREF(fInserted);
+        RTListPrepend(&pCache->ListLru, &pExtent->NodeLru);
+        pCache->cExtents++;
+        pCache->fTreeChanged = true;
+        if (pExtent->fDirty)
+        {
+            pCache->cBlocksDirty += cBlocks;
+            pCache->fDirtyChanged = true;
+        }
+    }
+    else
+    {
+        /* The old data stays valid. */
+        vciBlkMapFree(pCache->pBlkMap, pExtent->u64BlockAddr, cBlocks, VCIBLKMAP_ALLOC_DATA);
+        RTMemFree(pExtent);
+    }
+
+    if (pWrite->pExtentSpare)
+        RTMemFree(pWrite->pExtentSpare);
+    RTMemFree(pWrite);
+
+    /* An error is passed on to the I/O context with rcReq. */
+    return VINF_SUCCESS;
+}
+
 /** @copydoc VDCACHEBACKEND::pfnWrite */
 static int vciWrite(void *pBackendData, uint64_t uOffset, size_t cbToWrite,
-                    PVDIOCTX pIoCtx, size_t *pcbWriteProcess)
+                    PVDIOCTX pIoCtx, size_t *pcbWriteProcess, unsigned fWrite)
 {
-    LogFlowFunc(("pBackendData=%#p uOffset=%llu cbToWrite=%zu pIoCtx=%#p pcbWriteProcess=%#p\n",
-                 pBackendData, uOffset, cbToWrite, pIoCtx, pcbWriteProcess));
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu cbToWrite=%zu pIoCtx=%#p pcbWriteProcess=%#p fWrite=%#x\n",
+                 pBackendData, uOffset, cbToWrite, pIoCtx, pcbWriteProcess, fWrite));
     PVCICACHE pCache = (PVCICACHE)pBackendData;
     int rc = VINF_SUCCESS;
-    uint64_t cBlocksToWrite = VCI_BYTE2BLOCK(cbToWrite);
+    uint64_t cBlocksToWrite = RT_MIN(VCI_BYTE2BLOCK(cbToWrite), VCI_EXTENT_BLOCKS_MAX);
     uint64_t offBlockAddr  = VCI_BYTE2BLOCK(uOffset);
+    uint64_t offBlockAddrData = 0;
+    uint64_t cBlocksAlloc = 0;
+    bool fDirty = RT_BOOL(fWrite & VD_CACHE_WRITE_DIRTY);
+    PVCIWRITE pWrite = NULL;
 
     AssertPtr(pCache);
     Assert(uOffset % 512 == 0);
     Assert(cbToWrite % 512 == 0);
+    AssertReturn(!(fWrite & ~VD_CACHE_WRITE_FLAGS_MASK), VERR_INVALID_PARAMETER);
+
+    if (pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+    {
+        rc = VERR_VD_IMAGE_READ_ONLY;
+        goto out;
+    }
+
+    /*
+     * Data read from the image must not replace data which wasn't written back
+     * yet, skip over it without consuming anything from the I/O context.
+     */
+    if (   !fDirty
+        && vciRangeStartsDirty(pCache, offBlockAddr, &cBlocksToWrite))
+    {
+        *pcbWriteProcess = VCI_BLOCK2BYTE(cBlocksToWrite);
+        goto out;
+    }
+
+    pWrite = (PVCIWRITE)RTMemAllocZ(sizeof(VCIWRITE));
+    if (pWrite)
+    {
+        pWrite->pExtent      = (PVCIEXTENT)RTMemAllocZ(sizeof(VCIEXTENT));
+        pWrite->pExtentSpare = (PVCIEXTENT)RTMemAllocZ(sizeof(VCIEXTENT));
+    }
+    if (   !pWrite
+        || !pWrite->pExtent
+        || !pWrite->pExtentSpare)
+    {
+        if (pWrite)
+        {
+            RTMemFree(pWrite->pExtent);
+            RTMemFree(pWrite->pExtentSpare);
+            RTMemFree(pWrite);
+        }
+        rc = VERR_NO_MEMORY;
+        goto out;
+    }
 
-    while (cBlocksToWrite)
+    rc = vciDataAlloc(pCache, cBlocksToWrite, &offBlockAddrData, &cBlocksAlloc);
+    if (RT_FAILURE(rc))
     {
+        RTMemFree(pWrite->pExtent);
+        RTMemFree(pWrite->pExtentSpare);
+        RTMemFree(pWrite);
+        goto out;
+    }
+
+    pWrite->pExtent->Core.Key     = offBlockAddr;
+    pWrite->pExtent->Core.KeyLast = offBlockAddr + cBlocksAlloc - 1;
+    pWrite->pExtent->u64BlockAddr = offBlockAddrData;
+    pWrite->pExtent->fDirty       = fDirty;
 
+    /*
+     * The blocks are unused so far, the old data stays valid until the write
+     * succeeded. The extent is inserted when the write completes.
+     */
+    rc = vdIfIoIntFileWriteUser(pCache->pIfIo, pCache->pStorage, VCI_BLOCK2BYTE(offBlockAddrData),
+                                pIoCtx, VCI_BLOCK2BYTE(cBlocksAlloc), vciWriteDataComplete, pWrite);
+    if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+    {
+        vciWriteDataComplete(pCache, pIoCtx, pWrite, rc);
+        if (RT_FAILURE(rc))
+            goto out;
     }
 
-    *pcbWriteProcess = cbToWrite; /** @todo: Implement. */
+    *pcbWriteProcess = VCI_BLOCK2BYTE(cBlocksAlloc);
 
+out:
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
 }
@@ -1703,7 +2342,145 @@ static int vciFlush(void *pBackendData, PVDIOCTX pIoCtx)
     PVCICACHE pCache = (PVCICACHE)pBackendData;
     int rc = VINF_SUCCESS;
 
-    rc = vciFlushImage(pCache);
+    /* Dirty data is only safe after the tree referencing it is on the disk. */
+    if (pCache->fDirtyChanged)
+        rc = vciCommit(pCache);
+    else
+        rc = vciFlushImage(pCache);
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDCACHEBACKEND::pfnDiscard */
+static int vciDiscard(void *pBackendData, PVDIOCTX pIoCtx,
+                      uint64_t uOffset, size_t cbDiscard,
+                      size_t *pcbPreAllocated, size_t *pcbPostAllocated,
+                      size_t *pcbActuallyDiscarded, void **ppbmAllocationBitmap,
+                      unsigned fDiscard)
+{
+    LogFlowFunc(("pBackendData=%#p pIoCtx=%#p uOffset=%llu cbDiscard=%zu pcbPreAllocated=%#p pcbPostAllocated=%#p pcbActuallyDiscarded=%#p ppbmAllocationBitmap=%#p fDiscard=%#x\n",
+                 pBackendData, pIoCtx, uOffset, cbDiscard, pcbPreAllocated, pcbPostAllocated, pcbActuallyDiscarded, ppbmAllocationBitmap, fDiscard));
+    PVCICACHE pCache = (PVCICACHE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    AssertPtr(pCache);
+
+    if (pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        rc = VERR_VD_IMAGE_READ_ONLY;
+    else
+    {
+        /* Dropping partially covered blocks as well is always safe for a cache. */
+        uint64_t offBlockStart = VCI_BYTE2BLOCK(uOffset);
+        uint64_t offBlockEnd   = VCI_BYTE2BLOCK(uOffset + cbDiscard + VCI_BLOCK_SIZE - 1);
+
+        if (offBlockEnd > offBlockStart)
+            rc = vciExtentRangeDrop(pCache, offBlockStart, offBlockEnd - offBlockStart, NULL);
+        if (RT_SUCCESS(rc))
+        {
+            *pcbPreAllocated      = 0;
+            *pcbPostAllocated     = 0;
+            *pcbActuallyDiscarded = cbDiscard;
+            if (ppbmAllocationBitmap)
+                *ppbmAllocationBitmap = NULL;
+        }
+    }
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDCACHEBACKEND::pfnQueryDirty */
+static int vciQueryDirty(void *pBackendData, uint64_t uOffset,
+                         uint64_t *puOffsetDirty, size_t *pcbDirty)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu puOffsetDirty=%#p pcbDirty=%#p\n",
+                 pBackendData, uOffset, puOffsetDirty, pcbDirty));
+    PVCICACHE pCache = (PVCICACHE)pBackendData;
+    int rc = VINF_SUCCESS;
+    uint64_t offBlockAddr = VCI_BYTE2BLOCK(uOffset);
+    PVCIEXTENT pExtent;
+
+    AssertPtr(pCache);
+
+    if (!pCache->cBlocksDirty)
+    {
+        rc = VERR_NOT_FOUND;
+        goto out;
+    }
+
+    /* Find the first dirty extent. */
+    pExtent = (PVCIEXTENT)RTAvlrU64RangeGet(pCache->pTreeExtents, offBlockAddr);
+    if (!pExtent)
+        pExtent = (PVCIEXTENT)RTAvlrU64GetBestFit(pCache->pTreeExtents, offBlockAddr, true /* fAbove */);
+    while (   pExtent
+           && !pExtent->fDirty)
+        pExtent = (PVCIEXTENT)RTAvlrU64GetBestFit(pCache->pTreeExtents, pExtent->Core.KeyLast + 1,
+                                                  true /* fAbove */);
+
+    if (pExtent)
+    {
+        uint64_t offBlockStart = pExtent->Core.Key;
+
+        /* Merge with directly following dirty extents. */
+        do
+        {
+            pExtent->fWriteBack = true;
+            offBlockAddr = pExtent->Core.KeyLast + 1;
+            pExtent = (PVCIEXTENT)RTAvlrU64RangeGet(pCache->pTreeExtents, offBlockAddr);
+        } while (   pExtent
+                 && pExtent->fDirty
+                 && pExtent->Core.KeyLast - offBlockStart < VCI_DIRTY_RANGE_BLOCKS_MAX);
+
+        *puOffsetDirty = VCI_BLOCK2BYTE(offBlockStart);
+        *pcbDirty      = (size_t)VCI_BLOCK2BYTE(offBlockAddr - offBlockStart);
+    }
+    else
+        rc = VERR_NOT_FOUND;
+
+out:
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/** @copydoc VDCACHEBACKEND::pfnMarkClean */
+static int vciMarkClean(void *pBackendData, uint64_t uOffset, size_t cbClean)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu cbClean=%zu\n",
+                 pBackendData, uOffset, cbClean));
+    PVCICACHE pCache = (PVCICACHE)pBackendData;
+    int rc = VINF_SUCCESS;
+    uint64_t offBlockAddr = VCI_BYTE2BLOCK(uOffset);
+    uint64_t offBlockLast = VCI_BYTE2BLOCK(uOffset + cbClean) - 1;
+    PVCIEXTENT pExtent;
+
+    AssertPtr(pCache);
+
+    if (pCache->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+    {
+        rc = VERR_VD_IMAGE_READ_ONLY;
+        goto out;
+    }
+
+    pExtent = (PVCIEXTENT)RTAvlrU64GetBestFit(pCache->pTreeExtents, offBlockAddr, true /* fAbove */);
+    while (   pExtent
+           && pExtent->Core.KeyLast <= offBlockLast)
+    {
+        /* Extents written after the data was handed out for writing it back stay dirty. */
+        if (   pExtent->fDirty
+            && pExtent->fWriteBack)
+        {
+            pExtent->fDirty     = false;
+            pExtent->fWriteBack = false;
+            pCache->cBlocksDirty -= pExtent->Core.KeyLast - pExtent->Core.Key + 1;
+            pCache->fDirtyChanged = true;
+            pCache->fTreeChanged  = true;
+        }
+
+        pExtent = (PVCIEXTENT)RTAvlrU64GetBestFit(pCache->pTreeExtents, pExtent->Core.KeyLast + 1,
+                                                  true /* fAbove */);
+    }
+
+out:
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
 }
@@ -1985,7 +2762,11 @@ VDCACHEBACKEND g_VciCacheBackend =
     /* pfnFlush */
     vciFlush,
     /* pfnDiscard */
-    NULL,
+    vciDiscard,
+    /* pfnQueryDirty */
+    vciQueryDirty,
+    /* pfnMarkClean */
+    vciMarkClean,
     /* pfnGetVersion */
     vciGetVersion,
     /* pfnGetSize */
@@ -39,6 +39,8 @@
 #include <iprt/list.h>
 #include <iprt/avl.h>
 #include <iprt/semaphore.h>
+#include <iprt/thread.h>
+#include <iprt/time.h>
 
 #include <VBox/vd-plugin.h>
 #include <VBox/vd-cache-plugin.h>
@@ -54,6 +56,20 @@
 
 /** Buffer size used for merging images. */
 #define VD_MERGE_BUFFER_SIZE    (16 * _1M)
+/** Chunk size used for merging images while other users can access the disk.
+ * Bounds the time the disk write lock is held for a single chunk. */
+#define VD_MERGE_CHUNK_SIZE_ONLINE  (1 * _1M)
+
+/** Amount of data moved per step when defragmenting images.
+ * Bounds the time the disk write lock is held for a single step. */
+#define VD_DEFRAG_CHUNK_SIZE        (4 * _1M)
+
+/** Default number of buffers in flight when copying images. */
+#define VD_COPY_BUFFERS_DEFAULT     4
+/** Maximum number of buffers in flight when copying images. */
+#define VD_COPY_BUFFERS_MAX         64
+/** Default size of one buffer used for copying images. */
+#define VD_COPY_BUFFER_SIZE_DEFAULT (4 * _1M)
 
 /** Maximum number of segments in one I/O task. */
 #define VD_IO_TASK_SEGMENTS_MAX 64
@@ -61,6 +77,9 @@
 /** Threshold after not recently used blocks are removed from the list. */
 #define VD_DISCARD_REMOVE_THRESHOLD (10 * _1M) /** @todo: experiment */
 
+/** Number of dirty ranges written back to the image before they are marked clean in the cache. */
+#define VD_CACHE_WRITE_BACK_RANGES  64
+
 /**
  * VD async I/O interface storage descriptor.
  */
@@ -232,6 +251,8 @@ struct VBOXHDD
     PVDINTERFACEERROR      pInterfaceError;
     /** Pointer to the optional thread synchronization callbacks. */
     PVDINTERFACETHREADSYNC pInterfaceThreadSync;
+    /** Pointer to the optional latency reporting interface. */
+    PVDINTERFACELATENCY    pInterfaceLatency;
 
     /** Memory cache for I/O contexts */
     RTMEMCACHE             hMemCacheIoCtx;
@@ -330,6 +351,11 @@ typedef struct VDIOCTX
     PFNVDIOCTXTRANSFER           pfnIoCtxTransferNext;
     /** Transfer direction */
     VDIOCTXTXDIR                 enmTxDir;
+    /** Timestamp of the submission in nanoseconds, only valid if latencies are reported. */
+    uint64_t                     tsStart;
+    /** Timestamp when the context was put on one of the waiting lists,
+     * only valid if latencies are reported. */
+    uint64_t                     tsQueued;
     /** Request type dependent data. */
     union
     {
@@ -444,6 +470,8 @@ typedef struct VDIOCTX
 #define VDIOCTX_FLAGS_DONT_FREE              RT_BIT_32(4)
 /* Don't set the modified flag for this I/O context when writing. */
 #define VDIOCTX_FLAGS_DONT_SET_MODIFIED_FLAG RT_BIT_32(5)
+/** Don't redirect writes to the last image to the cache, used when writing back dirty data. */
+#define VDIOCTX_FLAGS_CACHE_BYPASS           RT_BIT_32(6)
 
 /** NIL I/O context pointer value. */
 #define NIL_VDIOCTX ((PVDIOCTX)0)
@@ -480,6 +508,8 @@ typedef struct VDIOTASK
     int                          rcReq;
     /** Flag whether this is a meta data transfer. */
     bool                         fMeta;
+    /** Timestamp of the submission in nanoseconds, only valid if latencies are reported. */
+    uint64_t                     tsStart;
     /** Type dependent data. */
     union
     {
@@ -490,6 +520,8 @@ typedef struct VDIOTASK
             uint32_t             cbTransfer;
             /** Pointer to the I/O context the task belongs. */
             PVDIOCTX             pIoCtx;
+            /** Flag whether this is a write. */
+            bool                 fWrite;
         } User;
         /** Meta data transfer. */
         struct
@@ -561,6 +593,7 @@ extern VBOXHDDBACKEND g_ISCSIBackend;
 extern VBOXHDDBACKEND g_QedBackend;
 extern VBOXHDDBACKEND g_QCowBackend;
 extern VBOXHDDBACKEND g_VhdxBackend;
+extern VBOXHDDBACKEND g_DdiBackend;
 
 static unsigned g_cBackends = 0;
 static PVBOXHDDBACKEND *g_apBackends = NULL;
@@ -574,6 +607,7 @@ static PVBOXHDDBACKEND aStaticBackends[] =
     &g_QedBackend,
     &g_QCowBackend,
     &g_VhdxBackend,
+    &g_DdiBackend,
     &g_RawBackend,
     &g_ISCSIBackend
 };
@@ -811,6 +845,32 @@ static PVDIMAGE vdGetImageByNumber(PVBOXHDD pDisk, unsigned nImage)
     return pImage;
 }
 
+/**
+ * Internal: Returns the current timestamp if latencies are reported for the disk.
+ *
+ * @returns Timestamp in nanoseconds or 0 if latencies are not reported.
+ * @param   pDisk    The disk.
+ */
+DECLINLINE(uint64_t) vdLatencyTimestamp(PVBOXHDD pDisk)
+{
+    return RT_UNLIKELY(pDisk->pInterfaceLatency) ? RTTimeNanoTS() : 0;
+}
+
+/**
+ * Internal: Reports the latency of a finished stage to the latency interface if present.
+ *
+ * @returns nothing.
+ * @param   pDisk    The disk.
+ * @param   enmStage The stage which finished.
+ * @param   fWrite   Flag whether the stage belongs to a write.
+ * @param   tsStart  The timestamp when the stage started, from vdLatencyTimestamp().
+ */
+DECLINLINE(void) vdLatencyRecord(PVBOXHDD pDisk, VDLATENCYSTAGE enmStage, bool fWrite, uint64_t tsStart)
+{
+    if (RT_UNLIKELY(pDisk->pInterfaceLatency) && tsStart)
+        vdIfLatencyRecord(pDisk->pInterfaceLatency, enmStage, fWrite, RTTimeNanoTS() - tsStart);
+}
+
 /**
  * Initialize the structure members of a given I/O context.
  */
@@ -837,6 +897,8 @@ DECLINLINE(void) vdIoCtxInit(PVDIOCTX pIoCtx, PVBOXHDD pDisk, VDIOCTXTXDIR enmTx
     pIoCtx->pfnIoCtxTransferNext  = NULL;
     pIoCtx->rcReq                 = VINF_SUCCESS;
     pIoCtx->pIoCtxParent          = NULL;
+    pIoCtx->tsStart               = vdLatencyTimestamp(pDisk);
+    pIoCtx->tsQueued              = 0;
 
     /* There is no S/G list for a flush request. */
     if (   enmTxDir != VDIOCTXTXDIR_FLUSH
@@ -891,14 +953,15 @@ static int vdCacheReadHelper(PVDCACHE pCache, uint64_t uOffset,
  * @param   cbWrite    How much to write.
  * @param   pIoCtx     The I/O context to ẃrite from.
  * @param   pcbWritten How much data could be written, optional.
+ * @param   fWrite     Write flags, combination of VD_CACHE_WRITE_*.
  */
 static int vdCacheWriteHelper(PVDCACHE pCache, uint64_t uOffset, size_t cbWrite,
-                              PVDIOCTX pIoCtx, size_t *pcbWritten)
+                              PVDIOCTX pIoCtx, size_t *pcbWritten, unsigned fWrite)
 {
     int rc = VINF_SUCCESS;
 
-    LogFlowFunc(("pCache=%#p uOffset=%llu pIoCtx=%p cbWrite=%zu pcbWritten=%#p\n",
-                 pCache, uOffset, pIoCtx, cbWrite, pcbWritten));
+    LogFlowFunc(("pCache=%#p uOffset=%llu pIoCtx=%p cbWrite=%zu pcbWritten=%#p fWrite=%#x\n",
+                 pCache, uOffset, pIoCtx, cbWrite, pcbWritten, fWrite));
 
     AssertPtr(pCache);
     AssertPtr(pIoCtx);
@@ -906,7 +969,7 @@ static int vdCacheWriteHelper(PVDCACHE pCache, uint64_t uOffset, size_t cbWrite,
 
     if (pcbWritten)
         rc = pCache->Backend->pfnWrite(pCache->pBackendData, uOffset, cbWrite,
-                                       pIoCtx, pcbWritten);
+                                       pIoCtx, pcbWritten, fWrite);
     else
     {
         size_t cbWritten = 0;
@@ -914,7 +977,7 @@ static int vdCacheWriteHelper(PVDCACHE pCache, uint64_t uOffset, size_t cbWrite,
         do
         {
             rc = pCache->Backend->pfnWrite(pCache->pBackendData, uOffset, cbWrite,
-                                           pIoCtx, &cbWritten);
+                                           pIoCtx, &cbWritten, fWrite);
             uOffset += cbWritten;
             cbWrite -= cbWritten;
         } while (   cbWrite
@@ -927,6 +990,93 @@ static int vdCacheWriteHelper(PVDCACHE pCache, uint64_t uOffset, size_t cbWrite,
     return rc;
 }
 
+/**
+ * Internal: Drops the data of the given range from the cache.
+ *
+ * @returns VBox status code.
+ * @param   pCache     The cache to drop the data from.
+ * @param   pIoCtx     The I/O context of the request.
+ * @param   uOffset    Start of the range to drop.
+ * @param   cbDiscard  Size of the range to drop.
+ */
+static int vdCacheDiscardHelper(PVDCACHE pCache, PVDIOCTX pIoCtx, uint64_t uOffset, size_t cbDiscard)
+{
+    int rc = VINF_SUCCESS;
+
+    if (pCache->Backend->pfnDiscard)
+    {
+        size_t cbPreAllocated, cbPostAllocated, cbActuallyDiscarded;
+
+        rc = pCache->Backend->pfnDiscard(pCache->pBackendData, pIoCtx, uOffset, cbDiscard,
+                                         &cbPreAllocated, &cbPostAllocated,
+                                         &cbActuallyDiscarded, NULL, 0);
+        if (   rc == VERR_NOT_SUPPORTED
+            || rc == VERR_VD_IMAGE_READ_ONLY)
+            rc = VINF_SUCCESS;
+    }
+
+    return rc;
+}
+
+/**
+ * Internal: Stores data read from the images in the cache.
+ *
+ * A separate synchronous I/O context is used for every chunk so the transfer
+ * accounting of the request the data was read for isn't touched and the cache
+ * can skip ranges it holds newer data for.
+ *
+ * @returns nothing, the cache is updated on a best effort basis.
+ * @param   pDisk      The disk the cache belongs to.
+ * @param   uOffset    Offset of the virtual disk the data was read from.
+ * @param   cbFill     How much data to store.
+ * @param   pSgBuf     The S/G buffer holding the data, advanced on return.
+ */
+static void vdCacheFillHelper(PVBOXHDD pDisk, uint64_t uOffset, size_t cbFill, PRTSGBUF pSgBuf)
+{
+    int rc = VINF_SUCCESS;
+    PVDCACHE pCache = pDisk->pCache;
+
+    LogFlowFunc(("pDisk=%#p uOffset=%llu cbFill=%zu pSgBuf=%#p\n",
+                 pDisk, uOffset, cbFill, pSgBuf));
+
+    while (   cbFill
+           && RT_SUCCESS(rc))
+    {
+        size_t cbSeg = cbFill;
+        uint8_t *pbSeg = (uint8_t *)RTSgBufGetNextSegment(pSgBuf, &cbSeg);
+
+        if (!pbSeg)
+            break;
+
+        cbFill -= cbSeg;
+
+        while (cbSeg)
+        {
+            VDIOCTX IoCtx;
+            RTSGSEG Seg;
+            RTSGBUF SgBuf;
+            size_t cbWritten = 0;
+
+            Seg.pvSeg = pbSeg;
+            Seg.cbSeg = cbSeg;
+            RTSgBufInit(&SgBuf, &Seg, 1);
+            vdIoCtxInit(&IoCtx, pDisk, VDIOCTXTXDIR_WRITE, uOffset, cbSeg, NULL,
+                        &SgBuf, NULL, NULL, VDIOCTX_FLAGS_SYNC | VDIOCTX_FLAGS_DONT_FREE);
+
+            rc = pCache->Backend->pfnWrite(pCache->pBackendData, uOffset, cbSeg,
+                                           &IoCtx, &cbWritten, 0 /* fWrite */);
+            if (RT_FAILURE(rc))
+                break;
+
+            pbSeg   += cbWritten;
+            cbSeg   -= cbWritten;
+            uOffset += cbWritten;
+        }
+    }
+
+    LogFlowFunc(("returns rc=%Rrc\n", rc));
+}
+
 /**
  * Creates a new empty discard state.
  *
@@ -1171,6 +1321,8 @@ DECLINLINE(void) vdIoCtxDiscardInit(PVDIOCTX pIoCtx, PVBOXHDD pDisk, PCRTRANGE p
     pIoCtx->pfnIoCtxTransfer          = pfnIoCtxTransfer;
     pIoCtx->pfnIoCtxTransferNext      = NULL;
     pIoCtx->rcReq                     = VINF_SUCCESS;
+    pIoCtx->tsStart                   = vdLatencyTimestamp(pDisk);
+    pIoCtx->tsQueued                  = 0;
     pIoCtx->Req.Discard.paRanges      = paRanges;
     pIoCtx->Req.Discard.cRanges       = cRanges;
     pIoCtx->Req.Discard.idxRange      = 0;
@@ -1231,7 +1383,8 @@ DECLINLINE(PVDIOCTX) vdIoCtxChildAlloc(PVBOXHDD pDisk, VDIOCTXTXDIR enmTxDir,
     return pIoCtx;
 }
 
-DECLINLINE(PVDIOTASK) vdIoTaskUserAlloc(PVDIOSTORAGE pIoStorage, PFNVDXFERCOMPLETED pfnComplete, void *pvUser, PVDIOCTX pIoCtx, uint32_t cbTransfer)
+DECLINLINE(PVDIOTASK) vdIoTaskUserAlloc(PVDIOSTORAGE pIoStorage, PFNVDXFERCOMPLETED pfnComplete, void *pvUser, PVDIOCTX pIoCtx,
+                                        uint32_t cbTransfer, bool fWrite)
 {
     PVDIOTASK pIoTask = NULL;
 
@@ -1242,8 +1395,10 @@ DECLINLINE(PVDIOTASK) vdIoTaskUserAlloc(PVDIOSTORAGE pIoStorage, PFNVDXFERCOMPLE
         pIoTask->pfnComplete          = pfnComplete;
         pIoTask->pvUser               = pvUser;
         pIoTask->fMeta                = false;
+        pIoTask->tsStart              = vdLatencyTimestamp(pIoStorage->pVDIo->pDisk);
         pIoTask->Type.User.cbTransfer = cbTransfer;
         pIoTask->Type.User.pIoCtx     = pIoCtx;
+        pIoTask->Type.User.fWrite     = fWrite;
     }
 
     return pIoTask;
@@ -1260,6 +1415,7 @@ DECLINLINE(PVDIOTASK) vdIoTaskMetaAlloc(PVDIOSTORAGE pIoStorage, PFNVDXFERCOMPLE
         pIoTask->pfnComplete         = pfnComplete;
         pIoTask->pvUser              = pvUser;
         pIoTask->fMeta               = true;
+        pIoTask->tsStart             = vdLatencyTimestamp(pIoStorage->pVDIo->pDisk);
         pIoTask->Type.Meta.pMetaXfer = pMetaXfer;
     }
 
@@ -1318,6 +1474,8 @@ DECLINLINE(PVDMETAXFER) vdMetaXferAlloc(PVDIOSTORAGE pIoStorage, uint64_t uOffse
 
 DECLINLINE(void) vdIoCtxAddToWaitingList(volatile PVDIOCTX *ppList, PVDIOCTX pIoCtx)
 {
+    pIoCtx->tsQueued = vdLatencyTimestamp(pIoCtx->pDisk);
+
     /* Put it on the waiting list. */
     PVDIOCTX pNext = ASMAtomicUoReadPtrT(ppList, PVDIOCTX);
     PVDIOCTX pHeadOld;
@@ -1331,6 +1489,23 @@ DECLINLINE(void) vdIoCtxAddToWaitingList(volatile PVDIOCTX *ppList, PVDIOCTX pIo
     }
 }
 
+/**
+ * Internal: Calls the completion callback of a root I/O context.
+ *
+ * @returns nothing.
+ * @param   pDisk    The disk.
+ * @param   pIoCtx   The completed root I/O context.
+ */
+DECLINLINE(void) vdIoCtxRootComplete(PVBOXHDD pDisk, PVDIOCTX pIoCtx)
+{
+    Assert(!pIoCtx->pIoCtxParent);
+
+    vdLatencyRecord(pDisk, VDLATENCYSTAGE_REQUEST, pIoCtx->enmTxDir != VDIOCTXTXDIR_READ, pIoCtx->tsStart);
+    pIoCtx->Type.Root.pfnComplete(pIoCtx->Type.Root.pvUser1,
+                                  pIoCtx->Type.Root.pvUser2,
+                                  pIoCtx->rcReq);
+}
+
 DECLINLINE(void) vdIoCtxDefer(PVBOXHDD pDisk, PVDIOCTX pIoCtx)
 {
     LogFlowFunc(("Deferring write pIoCtx=%#p\n", pIoCtx));
@@ -1500,6 +1675,7 @@ static int vdDiskProcessWaitingIoCtx(PVBOXHDD pDisk, PVDIOCTX pIoCtxRc)
 
         pCur = pCur->pIoCtxNext;
         pTmp->pIoCtxNext = NULL;
+        vdLatencyRecord(pDisk, VDLATENCYSTAGE_LOCK_WAIT, pTmp->enmTxDir != VDIOCTXTXDIR_READ, pTmp->tsQueued);
 
         /*
          * Need to clear the sync flag here if there is a new I/O context
@@ -1529,9 +1705,7 @@ static int vdDiskProcessWaitingIoCtx(PVBOXHDD pDisk, PVDIOCTX pIoCtxRc)
         {
             LogFlowFunc(("Waiting I/O context completed pTmp=%#p\n", pTmp));
             vdThreadFinishWrite(pDisk);
-            pTmp->Type.Root.pfnComplete(pTmp->Type.Root.pvUser1,
-                                        pTmp->Type.Root.pvUser2,
-                                        pTmp->rcReq);
+            vdIoCtxRootComplete(pDisk, pTmp);
             vdIoCtxFree(pDisk, pTmp);
         }
     }
@@ -1575,6 +1749,7 @@ static void vdDiskProcessBlockedIoCtx(PVBOXHDD pDisk)
 
         pCur = pCur->pIoCtxNext;
         pTmp->pIoCtxNext = NULL;
+        vdLatencyRecord(pDisk, VDLATENCYSTAGE_LOCK_WAIT, pTmp->enmTxDir != VDIOCTXTXDIR_READ, pTmp->tsQueued);
 
         Assert(!pTmp->pIoCtxParent);
         Assert(pTmp->fFlags & VDIOCTX_FLAGS_BLOCKED);
@@ -1586,9 +1761,7 @@ static void vdDiskProcessBlockedIoCtx(PVBOXHDD pDisk)
         {
             LogFlowFunc(("Waiting I/O context completed pTmp=%#p\n", pTmp));
             vdThreadFinishWrite(pDisk);
-            pTmp->Type.Root.pfnComplete(pTmp->Type.Root.pvUser1,
-                                        pTmp->Type.Root.pvUser2,
-                                        pTmp->rcReq);
+            vdIoCtxRootComplete(pDisk, pTmp);
             vdIoCtxFree(pDisk, pTmp);
         }
     }
@@ -1769,22 +1942,24 @@ static int vdReadHelperAsync(PVDIOCTX pIoCtx)
         cbThisRead = cbToRead;
 
         if (   pDisk->pCache
-            && !pImageParentOverride)
+            && !pImageParentOverride
+            && pCurrImage == pDisk->pLast)
         {
             rc = vdCacheReadHelper(pDisk->pCache, uOffset, cbThisRead,
                                    pIoCtx, &cbThisRead);
             if (rc == VERR_VD_BLOCK_FREE)
             {
+                RTSGBUF SgBufFill;
+
+                /* The read advances the buffer, remember where the data goes. */
+                RTSgBufClone(&SgBufFill, &pIoCtx->Req.Io.SgBuf);
                 rc = vdDiskReadHelper(pDisk, pCurrImage, NULL, uOffset, cbThisRead,
                                       pIoCtx, &cbThisRead);
 
                 /* If the read was successful, write the data back into the cache. */
                 if (   RT_SUCCESS(rc)
                     && pIoCtx->fFlags & VDIOCTX_FLAGS_READ_UPDATE_CACHE)
-                {
-                    rc = vdCacheWriteHelper(pDisk->pCache, uOffset, cbThisRead,
-                                            pIoCtx, NULL);
-                }
+                    vdCacheFillHelper(pDisk, uOffset, cbThisRead, &SgBufFill);
             }
         }
         else
@@ -2089,53 +2264,358 @@ static int vdWriteHelper(PVBOXHDD pDisk, PVDIMAGE pImage, uint64_t uOffset,
 }
 
 /**
- * Internal: Copies the content of one disk to another one applying optimizations
- * to speed up the copy process if possible.
+ * internal: Writes all dirty data held by the cache back to the last image.
+ *
+ * The data is marked clean only after the image was flushed, so nothing is
+ * lost if writing it back fails halfway.
+ *
+ * @returns VBox status code.
+ * @param   pDisk     Pointer to HDD container, must be locked for writing.
  */
-static int vdCopyHelper(PVBOXHDD pDiskFrom, PVDIMAGE pImageFrom, PVBOXHDD pDiskTo,
-                        uint64_t cbSize, unsigned cImagesFromRead, unsigned cImagesToRead,
-                        bool fSuppressRedundantIo, PVDINTERFACEPROGRESS pIfProgress,
-                        PVDINTERFACEPROGRESS pDstIfProgress)
+static int vdCacheWriteBack(PVBOXHDD pDisk)
 {
     int rc = VINF_SUCCESS;
-    int rc2;
+    PVDCACHE pCache = pDisk->pCache;
+    PVDIMAGE pImage = pDisk->pLast;
     uint64_t uOffset = 0;
-    uint64_t cbRemaining = cbSize;
+    size_t cbDirty = 0;
     void *pvBuf = NULL;
-    bool fLockReadFrom = false;
-    bool fLockWriteTo = false;
-    bool fBlockwiseCopy = fSuppressRedundantIo || (cImagesFromRead > 0);
-    unsigned uProgressOld = 0;
-
-    LogFlowFunc(("pDiskFrom=%#p pImageFrom=%#p pDiskTo=%#p cbSize=%llu cImagesFromRead=%u cImagesToRead=%u fSuppressRedundantIo=%RTbool pIfProgress=%#p pDstIfProgress=%#p\n",
-                 pDiskFrom, pImageFrom, pDiskTo, cbSize, cImagesFromRead, cImagesToRead, fSuppressRedundantIo, pDstIfProgress, pDstIfProgress));
+    size_t cbBuf = 0;
+    RTRANGE aRanges[VD_CACHE_WRITE_BACK_RANGES];
+    unsigned cRanges = 0;
+
+    if (   !pCache
+        || !pImage
+        || !pCache->Backend->pfnQueryDirty
+        || !pCache->Backend->pfnMarkClean)
+        return VINF_SUCCESS;
 
-    /* Allocate tmp buffer. */
-    pvBuf = RTMemTmpAlloc(VD_MERGE_BUFFER_SIZE);
-    if (!pvBuf)
-        return rc;
+    LogFlowFunc(("pDisk=%#p\n", pDisk));
 
     do
     {
-        size_t cbThisRead = RT_MIN(VD_MERGE_BUFFER_SIZE, cbRemaining);
+        uint64_t uOffsetDirty = 0;
 
-        /* Note that we don't attempt to synchronize cross-disk accesses.
-         * It wouldn't be very difficult to do, just the lock order would
-         * need to be defined somehow to prevent deadlocks. Postpone such
-         * magic as there is no use case for this. */
+        cbDirty = 0;
+        rc = pCache->Backend->pfnQueryDirty(pCache->pBackendData, uOffset, &uOffsetDirty, &cbDirty);
+        if (rc == VERR_NOT_FOUND)
+        {
+            rc = VINF_SUCCESS;
+            cbDirty = 0;
+        }
+        else if (RT_FAILURE(rc))
+            break;
 
-        rc2 = vdThreadStartRead(pDiskFrom);
-        AssertRC(rc2);
-        fLockReadFrom = true;
+        if (cbDirty)
+        {
+            if (cbDirty > cbBuf)
+            {
+                RTMemTmpFree(pvBuf);
+                pvBuf = RTMemTmpAlloc(cbDirty);
+                if (!pvBuf)
+                {
+                    cbBuf = 0;
+                    rc = VERR_NO_MEMORY;
+                    break;
+                }
+                cbBuf = cbDirty;
+            }
+
+            /* The read is served from the cache. */
+            rc = vdReadHelper(pDisk, pImage, uOffsetDirty, pvBuf, cbDirty, false /* fUpdateCache */);
+            if (RT_SUCCESS(rc))
+                rc = vdWriteHelper(pDisk, pImage, uOffsetDirty, pvBuf, cbDirty,
+                                   VDIOCTX_FLAGS_CACHE_BYPASS);
+            if (RT_FAILURE(rc))
+                break;
+
+            aRanges[cRanges].offStart = uOffsetDirty;
+            aRanges[cRanges].cbRange  = cbDirty;
+            cRanges++;
+            uOffset = uOffsetDirty + cbDirty;
+        }
+
+        if (   cRanges
+            && (   !cbDirty
+                || cRanges == RT_ELEMENTS(aRanges)))
+        {
+            VDIOCTX IoCtx;
+
+            vdIoCtxInit(&IoCtx, pDisk, VDIOCTXTXDIR_FLUSH, 0, 0, NULL,
+                        NULL, NULL, NULL, VDIOCTX_FLAGS_SYNC);
+            rc = pImage->Backend->pfnFlush(pImage->pBackendData, &IoCtx);
+            for (unsigned i = 0; i < cRanges && RT_SUCCESS(rc); i++)
+                rc = pCache->Backend->pfnMarkClean(pCache->pBackendData, aRanges[i].offStart,
+                                                   (size_t)aRanges[i].cbRange);
+            if (RT_SUCCESS(rc))
+                rc = pCache->Backend->pfnFlush(pCache->pBackendData, &IoCtx);
+            cRanges = 0;
+        }
+    } while (   cbDirty
+             && RT_SUCCESS(rc));
+
+    if (pvBuf)
+        RTMemTmpFree(pvBuf);
+
+    if (RT_FAILURE(rc))
+        LogRel(("VD: Writing back dirty data from the cache to '%s' failed with %Rrc\n",
+                pImage->pszFilename, rc));
 
-        if (fBlockwiseCopy)
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+/**
+ * Internal: Queries the allocated ranges of a single image, treating the whole
+ * range as allocated if the backend can't tell.
+ */
+static int vdImageQueryAllocatedRanges(PVDIMAGE pImage, uint64_t uOffset, uint64_t cbRange,
+                                       PRTRANGE paRanges, unsigned cRanges, unsigned *pcRanges)
+{
+    if (pImage->Backend->pfnQueryAllocatedRanges)
+        return pImage->Backend->pfnQueryAllocatedRanges(pImage->pBackendData, uOffset, cbRange,
+                                                        paRanges, cRanges, pcRanges);
+
+    uint64_t cbDisk = pImage->Backend->pfnGetSize(pImage->pBackendData);
+    uint64_t offEnd = RT_MIN(uOffset + cbRange, cbDisk);
+    unsigned cRangesUsed = 0;
+    int rc = VINF_SUCCESS;
+
+    while (uOffset < offEnd)
+    {
+        size_t cbThisRange = (size_t)RT_MIN(offEnd - uOffset, ~(size_t)0 & ~(size_t)511);
+
+        if (!vdPluginRangeAppend(paRanges, cRanges, &cRangesUsed, uOffset, cbThisRange))
+        {
+            rc = VERR_BUFFER_OVERFLOW;
+            break;
+        }
+        uOffset += cbThisRange;
+    }
+
+    *pcRanges = cRangesUsed;
+    return rc;
+}
+
+/**
+ * Internal: Finds the first offset in the given range which is allocated in the
+ * given image or one of the parents which would be consulted by a read.
+ * Returns the end of the range if nothing is allocated.
+ */
+static int vdFindNextAllocated(PVDIMAGE pImage, unsigned cImagesRead, uint64_t uOffset,
+                               uint64_t cbRange, uint64_t *poffAllocated)
+{
+    uint64_t offAllocated = uOffset + cbRange;
+    unsigned cImagesToProcess = cImagesRead;
+
+    /* Follow the same image walk as the blockwise read in vdCopyReadChunk(). */
+    for (PVDIMAGE pCurrImage = pImage;
+         pCurrImage != NULL && offAllocated > uOffset;
+         pCurrImage = pCurrImage->pPrev)
+    {
+        RTRANGE Range;
+        unsigned cRangesRet = 0;
+
+        int rc = vdImageQueryAllocatedRanges(pCurrImage, uOffset, offAllocated - uOffset,
+                                             &Range, 1, &cRangesRet);
+        if (RT_FAILURE(rc) && rc != VERR_BUFFER_OVERFLOW)
+            return rc;
+        if (cRangesRet)
+            offAllocated = RT_MIN(offAllocated, Range.offStart);
+
+        if (pCurrImage == pImage)
+        {
+            if (cImagesRead == 1)
+                break;
+        }
+        else if (cImagesToProcess == 1)
+            break;
+        else if (cImagesToProcess > 0)
+            cImagesToProcess--;
+    }
+
+    *poffAllocated = offAllocated;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Internal: Finds the first offset in the given range which is allocated in one
+ * of the images from pImage down to, but excluding, pImageStop. Returns the end
+ * of the range if nothing is allocated.
+ */
+static int vdMergeFindNextAllocated(PVDIMAGE pImage, PVDIMAGE pImageStop, uint64_t uOffset,
+                                    uint64_t cbRange, uint64_t *poffAllocated)
+{
+    uint64_t offAllocated = uOffset + cbRange;
+
+    for (PVDIMAGE pCurrImage = pImage;
+         pCurrImage != NULL && pCurrImage != pImageStop && offAllocated > uOffset;
+         pCurrImage = pCurrImage->pPrev)
+    {
+        RTRANGE Range;
+        unsigned cRangesRet = 0;
+
+        int rc = vdImageQueryAllocatedRanges(pCurrImage, uOffset, offAllocated - uOffset,
+                                             &Range, 1, &cRangesRet);
+        if (RT_FAILURE(rc) && rc != VERR_BUFFER_OVERFLOW)
+            return rc;
+        if (cRangesRet)
+            offAllocated = RT_MIN(offAllocated, Range.offStart);
+    }
+
+    *poffAllocated = offAllocated;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Cursor over the allocated ranges of one image, used to merge the ranges of
+ * all images in a chain without collecting them first.
+ */
+typedef struct VDALLOCCURSOR
+{
+    /** The image. */
+    PVDIMAGE            pImage;
+    /** Offset to continue the query at when the buffered ranges are used up. */
+    uint64_t            offNext;
+    /** Flag whether the image has no more ranges after the buffered ones. */
+    bool                fEnd;
+    /** Index of the next buffered range. */
+    unsigned            iRange;
+    /** Number of buffered ranges. */
+    unsigned            cRanges;
+    /** The buffered ranges. */
+    RTRANGE             aRanges[16];
+} VDALLOCCURSOR;
+/** Pointer to an allocated range cursor. */
+typedef VDALLOCCURSOR *PVDALLOCCURSOR;
+
+/**
+ * Internal: Returns the next allocated range of a cursor without consuming it,
+ * querying the image for more ranges if required.
+ *
+ * @returns VBox status code.
+ * @param   pCursor     The cursor.
+ * @param   offEnd      End offset of the queried range.
+ * @param   ppRange     Where to store the pointer to the next range, NULL if
+ *                      there is none.
+ */
+static int vdAllocCursorPeek(PVDALLOCCURSOR pCursor, uint64_t offEnd, PCRTRANGE *ppRange)
+{
+    while (   pCursor->iRange == pCursor->cRanges
+           && !pCursor->fEnd)
+    {
+        unsigned cRangesRet = 0;
+
+        int rc = vdImageQueryAllocatedRanges(pCursor->pImage, pCursor->offNext, offEnd - pCursor->offNext,
+                                             &pCursor->aRanges[0], RT_ELEMENTS(pCursor->aRanges), &cRangesRet);
+        if (RT_FAILURE(rc) && rc != VERR_BUFFER_OVERFLOW)
+            return rc;
+
+        pCursor->iRange  = 0;
+        pCursor->cRanges = cRangesRet;
+        if (cRangesRet)
+            pCursor->offNext = pCursor->aRanges[cRangesRet - 1].offStart + pCursor->aRanges[cRangesRet - 1].cbRange;
+        if (   rc != VERR_BUFFER_OVERFLOW
+            || !cRangesRet
+            || pCursor->offNext >= offEnd)
+            pCursor->fEnd = true;
+    }
+
+    *ppRange = pCursor->iRange < pCursor->cRanges ? &pCursor->aRanges[pCursor->iRange] : NULL;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Copy buffer descriptor, one stage of the copy pipeline.
+ */
+typedef struct VDCOPYBUF
+{
+    /** Start of the data buffer. */
+    void               *pvBuf;
+    /** Start offset of the data in the disk. */
+    uint64_t            uOffset;
+    /** Number of valid bytes in the buffer. */
+    size_t              cbData;
+    /** Flag whether the range is not allocated in the source and must not be written. */
+    bool                fFree;
+} VDCOPYBUF, *PVDCOPYBUF;
+
+/**
+ * Copy pipeline state shared between the reader thread and the writer.
+ */
+typedef struct VDCOPYPIPE
+{
+    /** Source disk. */
+    PVBOXHDD            pDiskFrom;
+    /** Source image. */
+    PVDIMAGE            pImageFrom;
+    /** Number of bytes to copy. */
+    uint64_t            cbSize;
+    /** Number of images to read from the source chain in blockwise mode. */
+    unsigned            cImagesFromRead;
+    /** Flag whether the data is copied blockwise. */
+    bool                fBlockwiseCopy;
+    /** Size of one buffer. */
+    size_t              cbBuf;
+    /** Number of buffers in the ring. */
+    unsigned            cBufs;
+    /** Array of buffers. */
+    PVDCOPYBUF          paBufs;
+    /** Number of filled buffers not yet consumed by the writer. */
+    volatile uint32_t   cBufsFilled;
+    /** Event signalled by the reader when a buffer was filled. */
+    RTSEMEVENT          hEvtFilled;
+    /** Event signalled by the writer when a buffer was consumed. */
+    RTSEMEVENT          hEvtConsumed;
+    /** Flag whether the reader finished (successfully or not). */
+    volatile bool       fReadDone;
+    /** Flag whether the writer requests the reader to stop. */
+    volatile bool       fCancel;
+    /** Status code of the reader. */
+    int                 rcRead;
+} VDCOPYPIPE, *PVDCOPYPIPE;
+
+/**
+ * Internal: Reads one chunk of the source disk into the given buffer.
+ */
+static int vdCopyReadChunk(PVDCOPYPIPE pPipe, PVDCOPYBUF pCopyBuf, uint64_t uOffset,
+                           size_t cbThisRead)
+{
+    int rc = VINF_SUCCESS;
+    int rc2;
+    PVBOXHDD pDiskFrom = pPipe->pDiskFrom;
+    PVDIMAGE pImageFrom = pPipe->pImageFrom;
+
+    /* Note that we don't attempt to synchronize cross-disk accesses.
+     * It wouldn't be very difficult to do, just the lock order would
+     * need to be defined somehow to prevent deadlocks. Postpone such
+     * magic as there is no use case for this. */
+
+    rc2 = vdThreadStartRead(pDiskFrom);
+    AssertRC(rc2);
+
+    if (pPipe->fBlockwiseCopy)
+    {
+        uint64_t offAllocated = uOffset;
+
+        /* Skip over everything which is not allocated in the images we would read from. */
+        rc = vdFindNextAllocated(pImageFrom, pPipe->cImagesFromRead, uOffset,
+                                 pPipe->cbSize - uOffset, &offAllocated);
+        if (   RT_SUCCESS(rc)
+            && offAllocated > uOffset)
+        {
+            /* Report the whole unallocated range as one free chunk. */
+            cbThisRead = (size_t)RT_MIN(offAllocated - uOffset, (uint64_t)(~(size_t)0 & ~(size_t)511));
+            rc = VERR_VD_BLOCK_FREE;
+        }
+        else if (RT_SUCCESS(rc))
         {
             RTSGSEG SegmentBuf;
             RTSGBUF SgBuf;
             VDIOCTX IoCtx;
 
-            SegmentBuf.pvSeg = pvBuf;
-            SegmentBuf.cbSeg = VD_MERGE_BUFFER_SIZE;
+            SegmentBuf.pvSeg = pCopyBuf->pvBuf;
+            SegmentBuf.cbSeg = pPipe->cbBuf;
             RTSgBufInit(&SgBuf, &SegmentBuf, 1);
             vdIoCtxInit(&IoCtx, pDiskFrom, VDIOCTXTXDIR_READ, 0, 0, NULL,
                         &SgBuf, NULL, NULL, VDIOCTX_FLAGS_SYNC);
@@ -2146,17 +2626,17 @@ static int vdCopyHelper(PVBOXHDD pDiskFrom, PVDIMAGE pImageFrom, PVBOXHDD pDiskT
                                               &cbThisRead);
 
             if (   rc == VERR_VD_BLOCK_FREE
-                && cImagesFromRead != 1)
+                && pPipe->cImagesFromRead != 1)
             {
-                unsigned cImagesToProcess = cImagesFromRead;
+                unsigned cImagesToProcess = pPipe->cImagesFromRead;
 
                 for (PVDIMAGE pCurrImage = pImageFrom->pPrev;
                      pCurrImage != NULL && rc == VERR_VD_BLOCK_FREE;
                      pCurrImage = pCurrImage->pPrev)
                 {
                     rc = pCurrImage->Backend->pfnRead(pCurrImage->pBackendData,
-                                                           uOffset, cbThisRead,
-                                                           &IoCtx, &cbThisRead);
+                                                      uOffset, cbThisRead,
+                                                      &IoCtx, &cbThisRead);
                     if (cImagesToProcess == 1)
                         break;
                     else if (cImagesToProcess > 0)
@@ -2164,39 +2644,199 @@ static int vdCopyHelper(PVBOXHDD pDiskFrom, PVDIMAGE pImageFrom, PVBOXHDD pDiskT
                 }
             }
         }
-        else
-            rc = vdReadHelper(pDiskFrom, pImageFrom, uOffset, pvBuf, cbThisRead,
-                              false /* fUpdateCache */);
+    }
+    else
+        rc = vdReadHelper(pDiskFrom, pImageFrom, uOffset, pCopyBuf->pvBuf, cbThisRead,
+                          false /* fUpdateCache */);
+
+    rc2 = vdThreadFinishRead(pDiskFrom);
+    AssertRC(rc2);
+
+    pCopyBuf->uOffset = uOffset;
+    pCopyBuf->cbData  = cbThisRead;
+    pCopyBuf->fFree   = rc == VERR_VD_BLOCK_FREE;
+    if (rc == VERR_VD_BLOCK_FREE)
+        rc = VINF_SUCCESS;
+
+    return rc;
+}
 
-        if (RT_FAILURE(rc) && rc != VERR_VD_BLOCK_FREE)
+/**
+ * Internal: Reader thread of the copy pipeline, fills the buffer ring
+ * with data from the source disk ahead of the writer.
+ */
+static DECLCALLBACK(int) vdCopyReaderThread(RTTHREAD hThread, void *pvUser)
+{
+    PVDCOPYPIPE pPipe = (PVDCOPYPIPE)pvUser;
+    uint64_t uOffset = 0;
+    unsigned iBuf = 0;
+    int rc = VINF_SUCCESS;
+
+    NOREF(hThread);
+
+    while (   uOffset < pPipe->cbSize
+           && !ASMAtomicReadBool(&pPipe->fCancel))
+    {
+        /* Wait until the writer gave back a buffer. */
+        if (ASMAtomicReadU32(&pPipe->cBufsFilled) == pPipe->cBufs)
+        {
+            RTSemEventWait(pPipe->hEvtConsumed, RT_INDEFINITE_WAIT);
+            continue;
+        }
+
+        PVDCOPYBUF pCopyBuf = &pPipe->paBufs[iBuf];
+        size_t cbThisRead = (size_t)RT_MIN(pPipe->cbBuf, pPipe->cbSize - uOffset);
+
+        rc = vdCopyReadChunk(pPipe, pCopyBuf, uOffset, cbThisRead);
+        if (RT_FAILURE(rc))
             break;
 
-        rc2 = vdThreadFinishRead(pDiskFrom);
+        uOffset += pCopyBuf->cbData;
+        iBuf = (iBuf + 1) % pPipe->cBufs;
+
+        ASMAtomicIncU32(&pPipe->cBufsFilled);
+        RTSemEventSignal(pPipe->hEvtFilled);
+    }
+
+    pPipe->rcRead = rc;
+    ASMAtomicWriteBool(&pPipe->fReadDone, true);
+    RTSemEventSignal(pPipe->hEvtFilled);
+
+    return rc;
+}
+
+/**
+ * Internal: Copies the content of one disk to another one applying optimizations
+ * to speed up the copy process if possible.
+ *
+ * The copy is pipelined: a reader thread fills a ring of buffers from the source
+ * disk while the calling thread writes the filled buffers to the destination.
+ * Accesses to each disk stay serialized because the backends are not safe for
+ * concurrent use, the parallelism comes from overlapping reads and writes of
+ * the two disks. Ranges which are not allocated in the source are skipped.
+ */
+static int vdCopyHelper(PVBOXHDD pDiskFrom, PVDIMAGE pImageFrom, PVBOXHDD pDiskTo,
+                        uint64_t cbSize, unsigned cImagesFromRead, unsigned cImagesToRead,
+                        bool fSuppressRedundantIo, unsigned cCopyBufs, size_t cbCopyBuf,
+                        PVDINTERFACEPROGRESS pIfProgress,
+                        PVDINTERFACEPROGRESS pDstIfProgress)
+{
+    int rc = VINF_SUCCESS;
+    int rc2;
+    uint64_t uOffset = 0;
+    bool fBlockwiseCopy = fSuppressRedundantIo || (cImagesFromRead > 0);
+    unsigned uProgressOld = 0;
+    unsigned iBuf = 0;
+    RTTHREAD hThreadRead = NIL_RTTHREAD;
+    VDCOPYPIPE Pipe;
+
+    LogFlowFunc(("pDiskFrom=%#p pImageFrom=%#p pDiskTo=%#p cbSize=%llu cImagesFromRead=%u cImagesToRead=%u fSuppressRedundantIo=%RTbool cCopyBufs=%u cbCopyBuf=%zu pIfProgress=%#p pDstIfProgress=%#p\n",
+                 pDiskFrom, pImageFrom, pDiskTo, cbSize, cImagesFromRead, cImagesToRead, fSuppressRedundantIo, cCopyBufs, cbCopyBuf, pIfProgress, pDstIfProgress));
+
+    if (!cCopyBufs)
+        cCopyBufs = VD_COPY_BUFFERS_DEFAULT;
+    if (!cbCopyBuf)
+        cbCopyBuf = VD_COPY_BUFFER_SIZE_DEFAULT;
+    cCopyBufs = RT_MIN(cCopyBufs, VD_COPY_BUFFERS_MAX);
+    cbCopyBuf = RT_ALIGN_Z(cbCopyBuf, 512);
+
+    /*
+     * The blockwise copy reads straight from the image backends, data which
+     * is only in the cache would be missed. Write it back first.
+     */
+    if (pDiskFrom->pCache)
+    {
+        rc2 = vdThreadStartWrite(pDiskFrom);
         AssertRC(rc2);
-        fLockReadFrom = false;
+        rc = vdCacheWriteBack(pDiskFrom);
+        rc2 = vdThreadFinishWrite(pDiskFrom);
+        AssertRC(rc2);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
 
-        if (rc != VERR_VD_BLOCK_FREE)
+    RT_ZERO(Pipe);
+    Pipe.pDiskFrom       = pDiskFrom;
+    Pipe.pImageFrom      = pImageFrom;
+    Pipe.cbSize          = cbSize;
+    Pipe.cImagesFromRead = cImagesFromRead;
+    Pipe.fBlockwiseCopy  = fBlockwiseCopy;
+    Pipe.cbBuf           = cbCopyBuf;
+    Pipe.cBufs           = cCopyBufs;
+    Pipe.hEvtFilled      = NIL_RTSEMEVENT;
+    Pipe.hEvtConsumed    = NIL_RTSEMEVENT;
+    Pipe.rcRead          = VINF_SUCCESS;
+
+    /* Allocate the buffer ring. */
+    Pipe.paBufs = (PVDCOPYBUF)RTMemAllocZ(cCopyBufs * sizeof(VDCOPYBUF));
+    if (!Pipe.paBufs)
+        return VERR_NO_MEMORY;
+
+    for (unsigned i = 0; i < cCopyBufs; i++)
+    {
+        Pipe.paBufs[i].pvBuf = RTMemTmpAlloc(cbCopyBuf);
+        if (!Pipe.paBufs[i].pvBuf)
+        {
+            rc = VERR_NO_MEMORY;
+            break;
+        }
+    }
+
+    if (RT_SUCCESS(rc))
+        rc = RTSemEventCreate(&Pipe.hEvtFilled);
+    if (RT_SUCCESS(rc))
+        rc = RTSemEventCreate(&Pipe.hEvtConsumed);
+    if (RT_SUCCESS(rc))
+        rc = RTThreadCreate(&hThreadRead, vdCopyReaderThread, &Pipe, 0,
+                            RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE, "VDCopyRd");
+
+    while (RT_SUCCESS(rc))
+    {
+        /* Wait for the next filled buffer. */
+        if (ASMAtomicReadU32(&Pipe.cBufsFilled) == 0)
+        {
+            if (ASMAtomicReadBool(&Pipe.fReadDone))
+            {
+                /* Recheck, the reader might have filled a last buffer before finishing. */
+                if (ASMAtomicReadU32(&Pipe.cBufsFilled) == 0)
+                {
+                    rc = Pipe.rcRead;
+                    break;
+                }
+            }
+            else
+            {
+                RTSemEventWait(Pipe.hEvtFilled, RT_INDEFINITE_WAIT);
+                continue;
+            }
+        }
+
+        PVDCOPYBUF pCopyBuf = &Pipe.paBufs[iBuf];
+
+        if (!pCopyBuf->fFree)
         {
             rc2 = vdThreadStartWrite(pDiskTo);
             AssertRC(rc2);
-            fLockWriteTo = true;
 
             /* Only do collapsed I/O if we are copying the data blockwise. */
-            rc = vdWriteHelperEx(pDiskTo, pDiskTo->pLast, NULL, uOffset, pvBuf,
-                                 cbThisRead, VDIOCTX_FLAGS_DONT_SET_MODIFIED_FLAG /* fFlags */,
+            rc = vdWriteHelperEx(pDiskTo, pDiskTo->pLast, NULL, pCopyBuf->uOffset,
+                                 pCopyBuf->pvBuf, pCopyBuf->cbData,
+                                 VDIOCTX_FLAGS_DONT_SET_MODIFIED_FLAG /* fFlags */,
                                  fBlockwiseCopy ? cImagesToRead : 0);
-            if (RT_FAILURE(rc))
-                break;
 
             rc2 = vdThreadFinishWrite(pDiskTo);
             AssertRC(rc2);
-            fLockWriteTo = false;
+
+            if (RT_FAILURE(rc))
+                break;
         }
-        else /* Don't propagate the error to the outside */
-            rc = VINF_SUCCESS;
 
-        uOffset += cbThisRead;
-        cbRemaining -= cbThisRead;
+        uOffset = pCopyBuf->uOffset + pCopyBuf->cbData;
+        iBuf = (iBuf + 1) % cCopyBufs;
+
+        /* Give the buffer back to the reader. */
+        ASMAtomicDecU32(&Pipe.cBufsFilled);
+        RTSemEventSignal(Pipe.hEvtConsumed);
 
         unsigned uProgressNew = uOffset * 99 / cbSize;
         if (uProgressNew != uProgressOld)
@@ -2218,22 +2858,27 @@ static int vdCopyHelper(PVBOXHDD pDiskFrom, PVDIMAGE pImageFrom, PVBOXHDD pDiskT
                     break;
             }
         }
-    } while (uOffset < cbSize);
-
-    RTMemFree(pvBuf);
-
-    if (fLockReadFrom)
-    {
-        rc2 = vdThreadFinishRead(pDiskFrom);
-        AssertRC(rc2);
     }
 
-    if (fLockWriteTo)
+    if (hThreadRead != NIL_RTTHREAD)
     {
-        rc2 = vdThreadFinishWrite(pDiskTo);
+        /* Stop the reader if the writer bailed out early. */
+        ASMAtomicWriteBool(&Pipe.fCancel, true);
+        RTSemEventSignal(Pipe.hEvtConsumed);
+        rc2 = RTThreadWait(hThreadRead, RT_INDEFINITE_WAIT, NULL);
         AssertRC(rc2);
     }
 
+    if (Pipe.hEvtFilled != NIL_RTSEMEVENT)
+        RTSemEventDestroy(Pipe.hEvtFilled);
+    if (Pipe.hEvtConsumed != NIL_RTSEMEVENT)
+        RTSemEventDestroy(Pipe.hEvtConsumed);
+
+    for (unsigned i = 0; i < cCopyBufs; i++)
+        if (Pipe.paBufs[i].pvBuf)
+            RTMemTmpFree(Pipe.paBufs[i].pvBuf);
+    RTMemFree(Pipe.paBufs);
+
     LogFlowFunc(("returns rc=%Rrc\n", rc));
     return rc;
 }
@@ -2661,10 +3306,63 @@ static int vdWriteHelperStandardAsync(PVDIOCTX pIoCtx)
         pIoCtx->Req.Io.cbTransfer     = pIoCtx->Req.Io.cbTransferLeft;
         pIoCtx->Req.Io.uOffset       -= cbPreRead;
     }
-    else
-        pIoCtx->pfnIoCtxTransferNext = vdWriteHelperStandardAssemble;
+    else
+        pIoCtx->pfnIoCtxTransferNext = vdWriteHelperStandardAssemble;
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * internal: Redirects a write to the last image to the cache.
+ *
+ * In write back mode the data is stored in the cache as far as there is space.
+ * Everything which is not stored is dropped from the cache because it is
+ * written to the image and the cached data would be stale afterwards.
+ *
+ * @returns VBox status code.
+ * @param   pIoCtx    The I/O context of the write.
+ * @param   puOffset  The start of the write, updated to the start of
+ *                    the remaining range which must go to the image.
+ * @param   pcbWrite  The size of the write, updated to the size of the
+ *                    remaining range which must go to the image.
+ */
+static int vdCacheWriteRedirect(PVDIOCTX pIoCtx, uint64_t *puOffset, size_t *pcbWrite)
+{
+    int rc = VINF_SUCCESS;
+    PVBOXHDD pDisk  = pIoCtx->pDisk;
+    PVDCACHE pCache = pDisk->pCache;
+    uint64_t uOffset = *puOffset;
+    size_t cbWrite   = *pcbWrite;
+
+    if (pCache->uOpenFlags & VD_OPEN_FLAGS_CACHE_WRITE_BACK)
+    {
+        while (cbWrite)
+        {
+            size_t cbWritten = 0;
+
+            rc = vdCacheWriteHelper(pCache, uOffset, cbWrite, pIoCtx, &cbWritten,
+                                    VD_CACHE_WRITE_DIRTY);
+            if (rc == VERR_VD_CACHE_FULL)
+            {
+                /* The rest goes to the image directly. */
+                rc = VINF_SUCCESS;
+                break;
+            }
+            else if (   RT_FAILURE(rc)
+                     && rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                return rc;
+
+            uOffset += cbWritten;
+            cbWrite -= cbWritten;
+        }
+    }
 
-    return VINF_SUCCESS;
+    if (cbWrite)
+        rc = vdCacheDiscardHelper(pCache, pIoCtx, uOffset, cbWrite);
+
+    *puOffset = uOffset;
+    *pcbWrite = cbWrite;
+    return rc;
 }
 
 /**
@@ -2693,6 +3391,23 @@ static int vdWriteHelperAsync(PVDIOCTX pIoCtx)
     if (RT_FAILURE(rc))
         return rc;
 
+    if (   pDisk->pCache
+        && pImage == pDisk->pLast
+        && !pIoCtx->Req.Io.pImageParentOverride
+        && !(pIoCtx->fFlags & VDIOCTX_FLAGS_CACHE_BYPASS))
+    {
+        rc = vdCacheWriteRedirect(pIoCtx, &uOffset, &cbWrite);
+        if (RT_FAILURE(rc))
+            return rc;
+
+        if (!cbWrite)
+        {
+            pIoCtx->Req.Io.uOffset    = uOffset;
+            pIoCtx->Req.Io.cbTransfer = 0;
+            return VINF_SUCCESS;
+        }
+    }
+
     /* Loop until all written. */
     do
     {
@@ -3118,6 +3833,17 @@ static int vdDiscardHelperAsync(PVDIOCTX pIoCtx)
             LogFlowFunc(("New range descriptor loaded (%u) offStart=%llu cbDiscard=%zu\n",
                          pIoCtx->Req.Discard.idxRange, offStart, cbDiscardLeft));
             pIoCtx->Req.Discard.idxRange++;
+
+            /*
+             * The cache might hold data for the range which was not written back yet.
+             * Drop it, the write back would bring the discarded data back otherwise.
+             */
+            if (pDisk->pCache)
+            {
+                rc = vdCacheDiscardHelper(pDisk->pCache, pIoCtx, offStart, cbDiscardLeft);
+                if (RT_FAILURE(rc))
+                    return rc;
+            }
         }
 
         /* Look for a matching block in the AVL tree first. */
@@ -3635,9 +4361,7 @@ static int vdIoCtxContinue(PVDIOCTX pIoCtx, int rcReq)
                     && ASMAtomicCmpXchgBool(&pIoCtxParent->fComplete, true, false))
                 {
                     LogFlowFunc(("Parent I/O context completed pIoCtxParent=%#p rcReq=%Rrc\n", pIoCtxParent, pIoCtxParent->rcReq));
-                    pIoCtxParent->Type.Root.pfnComplete(pIoCtxParent->Type.Root.pvUser1,
-                                                        pIoCtxParent->Type.Root.pvUser2,
-                                                        pIoCtxParent->rcReq);
+                    vdIoCtxRootComplete(pDisk, pIoCtxParent);
                     vdThreadFinishWrite(pDisk);
                     vdIoCtxFree(pDisk, pIoCtxParent);
                     vdDiskProcessBlockedIoCtx(pDisk);
@@ -3665,9 +4389,7 @@ static int vdIoCtxContinue(PVDIOCTX pIoCtx, int rcReq)
                 }
 
                 LogFlowFunc(("I/O context completed pIoCtx=%#p rcReq=%Rrc\n", pIoCtx, pIoCtx->rcReq));
-                pIoCtx->Type.Root.pfnComplete(pIoCtx->Type.Root.pvUser1,
-                                              pIoCtx->Type.Root.pvUser2,
-                                              pIoCtx->rcReq);
+                vdIoCtxRootComplete(pDisk, pIoCtx);
             }
 
             vdIoCtxFree(pDisk, pIoCtx);
@@ -3871,6 +4593,7 @@ static void vdIoCtxProcessHaltedList(PVBOXHDD pDisk)
 
         pCur = pCur->pIoCtxNext;
         pTmp->pIoCtxNext = NULL;
+        vdLatencyRecord(pDisk, VDLATENCYSTAGE_LOCK_WAIT, pTmp->enmTxDir != VDIOCTXTXDIR_READ, pTmp->tsQueued);
 
         /* Continue */
         pTmp->fFlags &= ~VDIOCTX_FLAGS_BLOCKED;
@@ -3964,6 +4687,16 @@ static int vdIOIntReqCompleted(void *pvUser, int rcReq)
 
     LogFlowFunc(("Task completed pIoTask=%#p\n", pIoTask));
 
+    if (RT_UNLIKELY(pIoTask->tsStart))
+    {
+        PVBOXHDD pDisk = pIoTask->pIoStorage->pVDIo->pDisk;
+
+        if (!pIoTask->fMeta)
+            vdLatencyRecord(pDisk, VDLATENCYSTAGE_HOST_IO, pIoTask->Type.User.fWrite, pIoTask->tsStart);
+        else if (VDMETAXFER_TXDIR_GET(pIoTask->Type.Meta.pMetaXfer->fFlags) == VDMETAXFER_TXDIR_READ)
+            vdLatencyRecord(pDisk, VDLATENCYSTAGE_META_READ, false /* fWrite */, pIoTask->tsStart);
+    }
+
     pIoTask->rcReq = rcReq;
     vdXferTryLockDiskDeferIoTask(pIoTask);
     return VINF_SUCCESS;
@@ -4133,7 +4866,8 @@ static int vdIOIntReadUser(void *pvUser, PVDIOSTORAGE pIoStorage, uint64_t uOffs
 #endif
 
             Assert(cbTaskRead == (uint32_t)cbTaskRead);
-            PVDIOTASK pIoTask = vdIoTaskUserAlloc(pIoStorage, NULL, NULL, pIoCtx, (uint32_t)cbTaskRead);
+            PVDIOTASK pIoTask = vdIoTaskUserAlloc(pIoStorage, NULL, NULL, pIoCtx, (uint32_t)cbTaskRead,
+                                                  false /* fWrite */);
 
             if (!pIoTask)
                 return VERR_NO_MEMORY;
@@ -4233,7 +4967,8 @@ static int vdIOIntWriteUser(void *pvUser, PVDIOSTORAGE pIoStorage, uint64_t uOff
 #endif
 
             Assert(cbTaskWrite == (uint32_t)cbTaskWrite);
-            PVDIOTASK pIoTask = vdIoTaskUserAlloc(pIoStorage, pfnComplete, pvCompleteUser, pIoCtx, (uint32_t)cbTaskWrite);
+            PVDIOTASK pIoTask = vdIoTaskUserAlloc(pIoStorage, pfnComplete, pvCompleteUser, pIoCtx, (uint32_t)cbTaskWrite,
+                                                  true /* fWrite */);
 
             if (!pIoTask)
                 return VERR_NO_MEMORY;
@@ -4577,7 +5312,7 @@ static int vdIOIntFlush(void *pvUser, PVDIOSTORAGE pIoStorage, PVDIOCTX pIoCtx,
         if (!pMetaXfer)
             return VERR_NO_MEMORY;
 
-        pIoTask = vdIoTaskMetaAlloc(pIoStorage, pfnComplete, pvUser, pMetaXfer);
+        pIoTask = vdIoTaskMetaAlloc(pIoStorage, pfnComplete, pvCompleteUser, pMetaXfer);
         if (!pIoTask)
         {
             RTMemFree(pMetaXfer);
@@ -5232,6 +5967,7 @@ VBOXDDU_DECL(int) VDCreate(PVDINTERFACE pVDIfsDisk, VDTYPE enmType, PVBOXHDD *pp
             pDisk->pVDIfsDisk              = pVDIfsDisk;
             pDisk->pInterfaceError         = NULL;
             pDisk->pInterfaceThreadSync    = NULL;
+            pDisk->pInterfaceLatency       = NULL;
             pDisk->pIoCtxLockOwner         = NULL;
             pDisk->pIoCtxHead              = NULL;
             pDisk->fLocked                 = false;
@@ -5252,6 +5988,7 @@ VBOXDDU_DECL(int) VDCreate(PVDINTERFACE pVDIfsDisk, VDTYPE enmType, PVBOXHDD *pp
 
             pDisk->pInterfaceError      = VDIfErrorGet(pVDIfsDisk);
             pDisk->pInterfaceThreadSync = VDIfThreadSyncGet(pVDIfsDisk);
+            pDisk->pInterfaceLatency    = VDIfLatencyGet(pVDIfsDisk);
 
             *ppDisk = pDisk;
         }
@@ -5503,6 +6240,10 @@ VBOXDDU_DECL(int) VDOpen(PVBOXHDD pDisk, const char *pszBackend,
         AssertRC(rc2);
         fLockWrite = true;
         rc = vdDiscardStateDestroy(pDisk);
+        if (RT_FAILURE(rc))
+            break;
+        /* The image becomes read only, write back everything the cache holds for it. */
+        rc = vdCacheWriteBack(pDisk);
         if (RT_FAILURE(rc))
             break;
         rc2 = vdThreadFinishWrite(pDisk);
@@ -5861,9 +6602,19 @@ VBOXDDU_DECL(int) VDCacheOpen(PVBOXHDD pDisk, const char *pszBackend,
                             &pCache->VDIo, sizeof(VDINTERFACEIOINT), &pCache->pVDIfsCache);
         AssertRC(rc);
 
-        pCache->uOpenFlags = uOpenFlags & VD_OPEN_FLAGS_HONOR_SAME;
+        if (   (uOpenFlags & VD_OPEN_FLAGS_CACHE_WRITE_BACK)
+            && (   !pCache->Backend->pfnQueryDirty
+                || !pCache->Backend->pfnMarkClean
+                || !pCache->Backend->pfnDiscard))
+        {
+            rc = vdError(pDisk, VERR_NOT_SUPPORTED, RT_SRC_POS,
+                         N_("VD: backend '%s' doesn't support write back caching"), pszBackend);
+            break;
+        }
+
+        pCache->uOpenFlags = uOpenFlags & (VD_OPEN_FLAGS_HONOR_SAME | VD_OPEN_FLAGS_CACHE_WRITE_BACK);
         rc = pCache->Backend->pfnOpen(pCache->pszFilename,
-                                      uOpenFlags & ~VD_OPEN_FLAGS_HONOR_SAME,
+                                      uOpenFlags & ~(VD_OPEN_FLAGS_HONOR_SAME | VD_OPEN_FLAGS_CACHE_WRITE_BACK),
                                       pDisk->pVDIfsDisk,
                                       pCache->pVDIfsCache,
                                       &pCache->pBackendData);
@@ -5877,7 +6628,7 @@ VBOXDDU_DECL(int) VDCacheOpen(PVBOXHDD pDisk, const char *pszBackend,
                      || rc == VERR_SHARING_VIOLATION
                      || rc == VERR_FILE_LOCK_FAILED))
                 rc = pCache->Backend->pfnOpen(pCache->pszFilename,
-                                                (uOpenFlags & ~VD_OPEN_FLAGS_HONOR_SAME)
+                                                (uOpenFlags & ~(VD_OPEN_FLAGS_HONOR_SAME | VD_OPEN_FLAGS_CACHE_WRITE_BACK))
                                                | VD_OPEN_FLAGS_READONLY,
                                                pDisk->pVDIfsDisk,
                                                pCache->pVDIfsCache,
@@ -5890,6 +6641,16 @@ VBOXDDU_DECL(int) VDCacheOpen(PVBOXHDD pDisk, const char *pszBackend,
             }
         }
 
+        pCache->VDIo.pBackendData = pCache->pBackendData;
+
+        /* Writes can't be kept in a read only cache. */
+        if (   (pCache->uOpenFlags & VD_OPEN_FLAGS_CACHE_WRITE_BACK)
+            && (pCache->Backend->pfnGetOpenFlags(pCache->pBackendData) & VD_OPEN_FLAGS_READONLY))
+        {
+            LogRel(("VD: Cache '%s' is read only, disabling write back mode\n", pszFilename));
+            pCache->uOpenFlags &= ~VD_OPEN_FLAGS_CACHE_WRITE_BACK;
+        }
+
         /* Lock disk for writing, as we modify pDisk information below. */
         rc2 = vdThreadStartWrite(pDisk);
         AssertRC(rc2);
@@ -6325,6 +7086,10 @@ VBOXDDU_DECL(int) VDCreateDiff(PVBOXHDD pDisk, const char *pszBackend,
         AssertRC(rc2);
         fLockWrite = true;
         rc = vdDiscardStateDestroy(pDisk);
+        if (RT_FAILURE(rc))
+            break;
+        /* The image becomes read only, write back everything the cache holds for it. */
+        rc = vdCacheWriteBack(pDisk);
         if (RT_FAILURE(rc))
             break;
         rc2 = vdThreadFinishWrite(pDisk);
@@ -6646,12 +7411,22 @@ VBOXDDU_DECL(int) VDCreateCache(PVBOXHDD pDisk, const char *pszBackend,
             pUuid = &uuid;
         }
 
-        pCache->uOpenFlags = uOpenFlags & VD_OPEN_FLAGS_HONOR_SAME;
+        if (   (uOpenFlags & VD_OPEN_FLAGS_CACHE_WRITE_BACK)
+            && (   !pCache->Backend->pfnQueryDirty
+                || !pCache->Backend->pfnMarkClean
+                || !pCache->Backend->pfnDiscard))
+        {
+            rc = vdError(pDisk, VERR_NOT_SUPPORTED, RT_SRC_POS,
+                         N_("VD: backend '%s' doesn't support write back caching"), pszBackend);
+            break;
+        }
+
+        pCache->uOpenFlags = uOpenFlags & (VD_OPEN_FLAGS_HONOR_SAME | VD_OPEN_FLAGS_CACHE_WRITE_BACK);
         pCache->VDIo.fIgnoreFlush = (uOpenFlags & VD_OPEN_FLAGS_IGNORE_FLUSH) != 0;
         rc = pCache->Backend->pfnCreate(pCache->pszFilename, cbSize,
                                         uImageFlags,
                                         pszComment, pUuid,
-                                        uOpenFlags & ~VD_OPEN_FLAGS_HONOR_SAME,
+                                        uOpenFlags & ~(VD_OPEN_FLAGS_HONOR_SAME | VD_OPEN_FLAGS_CACHE_WRITE_BACK),
                                         0, 99,
                                         pDisk->pVDIfsDisk,
                                         pCache->pVDIfsCache,
@@ -6771,6 +7546,12 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
         rc2 = vdThreadStartWrite(pDisk);
         AssertRC(rc2);
         fLockWrite = true;
+
+        /* The merge reads the images directly, bring them up to date first. */
+        rc = vdCacheWriteBack(pDisk);
+        if (RT_FAILURE(rc))
+            break;
+
         PVDIMAGE pImageFrom = vdGetImageByNumber(pDisk, nImageFrom);
         PVDIMAGE pImageTo = vdGetImageByNumber(pDisk, nImageTo);
         if (!pImageFrom || !pImageTo)
@@ -6809,6 +7590,12 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
             break;
         }
 
+        /* If the disk can be accessed by others during the merge (online merge)
+         * use smaller chunks so the write lock is released more often and
+         * concurrent I/O is not stalled for too long. */
+        size_t cbChunk = pDisk->pInterfaceThreadSync ? VD_MERGE_CHUNK_SIZE_ONLINE : VD_MERGE_BUFFER_SIZE;
+        unsigned uPercentLast = 0;
+
         /* Merging is done directly on the images itself. This potentially
          * causes trouble if the disk is full in the middle of operation. */
         if (nImageFrom < nImageTo)
@@ -6817,10 +7604,9 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
              * allocated blocks in the destination image which are allocated in
              * the images to be merged. */
             uint64_t uOffset = 0;
-            uint64_t cbRemaining = cbSize;
             do
             {
-                size_t cbThisRead = RT_MIN(VD_MERGE_BUFFER_SIZE, cbRemaining);
+                size_t cbThisRead;
                 RTSGSEG SegmentBuf;
                 RTSGBUF SgBuf;
                 VDIOCTX IoCtx;
@@ -6836,6 +7622,23 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
                 AssertRC(rc2);
                 fLockWrite = true;
 
+                /* Skip everything which is not allocated in the images to merge,
+                 * there is nothing to copy for these ranges. */
+                uint64_t offAllocated;
+                rc = vdMergeFindNextAllocated(pImageTo->pPrev, pImageFrom->pPrev, uOffset,
+                                              cbSize - uOffset, &offAllocated);
+                if (RT_FAILURE(rc))
+                    break;
+                uOffset = offAllocated;
+                if (uOffset >= cbSize)
+                {
+                    rc2 = vdThreadFinishWrite(pDisk);
+                    AssertRC(rc2);
+                    fLockWrite = false;
+                    break;
+                }
+                cbThisRead = RT_MIN(cbChunk, cbSize - uOffset);
+
                 rc = pImageTo->Backend->pfnRead(pImageTo->pBackendData,
                                                 uOffset, cbThisRead,
                                                 &IoCtx, &cbThisRead);
@@ -6861,7 +7664,7 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
                         /* Updating the cache is required because this might be a live merge. */
                         rc = vdWriteHelperEx(pDisk, pImageTo, pImageFrom->pPrev,
                                              uOffset, pvBuf, cbThisRead,
-                                             VDIOCTX_FLAGS_READ_UPDATE_CACHE, 0);
+                                             VDIOCTX_FLAGS_READ_UPDATE_CACHE | VDIOCTX_FLAGS_CACHE_BYPASS, 0);
                         if (RT_FAILURE(rc))
                             break;
                     }
@@ -6876,15 +7679,15 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
                 fLockWrite = false;
 
                 uOffset += cbThisRead;
-                cbRemaining -= cbThisRead;
 
-                if (pIfProgress && pIfProgress->pfnProgress)
+                /* Report progress once per processed range but only if the
+                 * percentage actually changed, the ranges can be small. */
+                unsigned uPercent = (unsigned)(uOffset * 99 / cbSize);
+                if (   uPercent != uPercentLast
+                    && pIfProgress && pIfProgress->pfnProgress)
                 {
-                    /** @todo r=klaus: this can update the progress to the same
-                     * percentage over and over again if the image format makes
-                     * relatively small increments. */
-                    rc = pIfProgress->pfnProgress(pIfProgress->Core.pvUser,
-                                                  uOffset * 99 / cbSize);
+                    uPercentLast = uPercent;
+                    rc = pIfProgress->pfnProgress(pIfProgress->Core.pvUser, uPercent);
                     if (RT_FAILURE(rc))
                         break;
                 }
@@ -6946,16 +7749,13 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
              * which are allocated in the image up to the source image to the
              * destination image. */
             uint64_t uOffset = 0;
-            uint64_t cbRemaining = cbSize;
             do
             {
-                size_t cbThisRead = RT_MIN(VD_MERGE_BUFFER_SIZE, cbRemaining);
+                size_t cbThisRead;
                 RTSGSEG SegmentBuf;
                 RTSGBUF SgBuf;
                 VDIOCTX IoCtx;
 
-                rc = VERR_VD_BLOCK_FREE;
-
                 SegmentBuf.pvSeg = pvBuf;
                 SegmentBuf.cbSeg = VD_MERGE_BUFFER_SIZE;
                 RTSgBufInit(&SgBuf, &SegmentBuf, 1);
@@ -6967,6 +7767,24 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
                 AssertRC(rc2);
                 fLockWrite = true;
 
+                /* Skip everything which is not allocated in the images to merge. */
+                uint64_t offAllocated;
+                rc = vdMergeFindNextAllocated(pImageFrom, pImageTo, uOffset,
+                                              cbSize - uOffset, &offAllocated);
+                if (RT_FAILURE(rc))
+                    break;
+                uOffset = offAllocated;
+                if (uOffset >= cbSize)
+                {
+                    rc2 = vdThreadFinishWrite(pDisk);
+                    AssertRC(rc2);
+                    fLockWrite = false;
+                    break;
+                }
+                cbThisRead = RT_MIN(cbChunk, cbSize - uOffset);
+
+                rc = VERR_VD_BLOCK_FREE;
+
                 /* Search for image with allocated block. Do not attempt to
                  * read more than the previous reads marked as valid. Otherwise
                  * this would return stale data when different block sizes are
@@ -6985,7 +7803,7 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
                     if (RT_FAILURE(rc))
                         break;
                     rc = vdWriteHelper(pDisk, pImageTo, uOffset, pvBuf,
-                                       cbThisRead, VDIOCTX_FLAGS_READ_UPDATE_CACHE);
+                                       cbThisRead, VDIOCTX_FLAGS_READ_UPDATE_CACHE | VDIOCTX_FLAGS_CACHE_BYPASS);
                     if (RT_FAILURE(rc))
                         break;
                 }
@@ -6997,15 +7815,15 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
                 fLockWrite = false;
 
                 uOffset += cbThisRead;
-                cbRemaining -= cbThisRead;
 
-                if (pIfProgress && pIfProgress->pfnProgress)
+                /* Report progress once per processed range but only if the
+                 * percentage actually changed, the ranges can be small. */
+                unsigned uPercent = (unsigned)(uOffset * 99 / cbSize);
+                if (   uPercent != uPercentLast
+                    && pIfProgress && pIfProgress->pfnProgress)
                 {
-                    /** @todo r=klaus: this can update the progress to the same
-                     * percentage over and over again if the image format makes
-                     * relatively small increments. */
-                    rc = pIfProgress->pfnProgress(pIfProgress->Core.pvUser,
-                                                  uOffset * 99 / cbSize);
+                    uPercentLast = uPercent;
+                    rc = pIfProgress->pfnProgress(pIfProgress->Core.pvUser, uPercent);
                     if (RT_FAILURE(rc))
                         break;
                 }
@@ -7015,10 +7833,13 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
              * this again now to prevent stray writes. Failure or not. */
             if (!pImageFrom->pNext)
             {
-                /* Take the write lock. */
-                rc2 = vdThreadStartWrite(pDisk);
-                AssertRC(rc2);
-                fLockWrite = true;
+                /* Take the write lock unless the merge loop failed while holding it. */
+                if (!fLockWrite)
+                {
+                    rc2 = vdThreadStartWrite(pDisk);
+                    AssertRC(rc2);
+                    fLockWrite = true;
+                }
 
                 pDisk->pImageRelay = NULL;
 
@@ -7185,6 +8006,8 @@ VBOXDDU_DECL(int) VDMerge(PVBOXHDD pDisk, unsigned nImageFrom,
  * @param   cbSize          New image size (0 means leave unchanged).
  * @param   nImageSameFrom  todo
  * @param   nImageSameTo    todo
+ * @param   cCopyBufs       Number of buffers in flight while copying, 0 for the default.
+ * @param   cbCopyBuf       Size of one copy buffer, 0 for the default.
  * @param   uImageFlags     Flags specifying special destination image features.
  * @param   pDstUuid        New UUID of the destination image. If NULL, a new UUID is created.
  *                          This parameter is used if and only if a true copy is created.
@@ -7201,6 +8024,7 @@ VBOXDDU_DECL(int) VDCopyEx(PVBOXHDD pDiskFrom, unsigned nImage, PVBOXHDD pDiskTo
                            const char *pszBackend, const char *pszFilename,
                            bool fMoveByRename, uint64_t cbSize,
                            unsigned nImageFromSame, unsigned nImageToSame,
+                           unsigned cCopyBufs, size_t cbCopyBuf,
                            unsigned uImageFlags, PCRTUUID pDstUuid,
                            unsigned uOpenFlags, PVDINTERFACE pVDIfsOperation,
                            PVDINTERFACE pDstVDIfsImage,
@@ -7211,8 +8035,8 @@ VBOXDDU_DECL(int) VDCopyEx(PVBOXHDD pDiskFrom, unsigned nImage, PVBOXHDD pDiskTo
     bool fLockReadFrom = false, fLockWriteFrom = false, fLockWriteTo = false;
     PVDIMAGE pImageTo = NULL;
 
-    LogFlowFunc(("pDiskFrom=%#p nImage=%u pDiskTo=%#p pszBackend=\"%s\" pszFilename=\"%s\" fMoveByRename=%d cbSize=%llu nImageFromSame=%u nImageToSame=%u uImageFlags=%#x pDstUuid=%#p uOpenFlags=%#x pVDIfsOperation=%#p pDstVDIfsImage=%#p pDstVDIfsOperation=%#p\n",
-                 pDiskFrom, nImage, pDiskTo, pszBackend, pszFilename, fMoveByRename, cbSize, nImageFromSame, nImageToSame, uImageFlags, pDstUuid, uOpenFlags, pVDIfsOperation, pDstVDIfsImage, pDstVDIfsOperation));
+    LogFlowFunc(("pDiskFrom=%#p nImage=%u pDiskTo=%#p pszBackend=\"%s\" pszFilename=\"%s\" fMoveByRename=%d cbSize=%llu nImageFromSame=%u nImageToSame=%u cCopyBufs=%u cbCopyBuf=%zu uImageFlags=%#x pDstUuid=%#p uOpenFlags=%#x pVDIfsOperation=%#p pDstVDIfsImage=%#p pDstVDIfsOperation=%#p\n",
+                 pDiskFrom, nImage, pDiskTo, pszBackend, pszFilename, fMoveByRename, cbSize, nImageFromSame, nImageToSame, cCopyBufs, cbCopyBuf, uImageFlags, pDstUuid, uOpenFlags, pVDIfsOperation, pDstVDIfsImage, pDstVDIfsOperation));
 
     PVDINTERFACEPROGRESS pIfProgress    = VDIfProgressGet(pVDIfsOperation);
     PVDINTERFACEPROGRESS pDstIfProgress = VDIfProgressGet(pDstVDIfsOperation);
@@ -7422,7 +8246,8 @@ VBOXDDU_DECL(int) VDCopyEx(PVBOXHDD pDiskFrom, unsigned nImage, PVBOXHDD pDiskTo
         /* Copy the data. */
         rc = vdCopyHelper(pDiskFrom, pImageFrom, pDiskTo, cbSize,
                           cImagesFromReadBack, cImagesToReadBack,
-                          fSuppressRedundantIo, pIfProgress, pDstIfProgress);
+                          fSuppressRedundantIo, cCopyBufs, cbCopyBuf,
+                          pIfProgress, pDstIfProgress);
 
         if (RT_SUCCESS(rc))
         {
@@ -7538,6 +8363,7 @@ VBOXDDU_DECL(int) VDCopy(PVBOXHDD pDiskFrom, unsigned nImage, PVBOXHDD pDiskTo,
 {
     return VDCopyEx(pDiskFrom, nImage, pDiskTo, pszBackend, pszFilename, fMoveByRename,
                     cbSize, VD_IMAGE_CONTENT_UNKNOWN, VD_IMAGE_CONTENT_UNKNOWN,
+                    0 /* cCopyBufs */, 0 /* cbCopyBuf */,
                     uImageFlags, pDstUuid, uOpenFlags, pVDIfsOperation,
                     pDstVDIfsImage, pDstVDIfsOperation);
 }
@@ -7620,6 +8446,11 @@ VBOXDDU_DECL(int) VDCompact(PVBOXHDD pDisk, unsigned nImage,
         AssertRC(rc2);
         fLockWrite = true;
 
+        /* The backend compacts what is in the image, write back the cache first. */
+        rc = vdCacheWriteBack(pDisk);
+        if (RT_FAILURE(rc))
+            break;
+
         rc = pImage->Backend->pfnCompact(pImage->pBackendData,
                                          0, 99,
                                          pDisk->pVDIfsDisk,
@@ -7653,6 +8484,114 @@ VBOXDDU_DECL(int) VDCompact(PVBOXHDD pDisk, unsigned nImage,
     return rc;
 }
 
+/**
+ * Rearranges the blocks of an image in disk order.
+ *
+ * @return  VBox status code.
+ * @return  VERR_VD_IMAGE_NOT_FOUND if image with specified number was not opened.
+ * @return  VERR_VD_IMAGE_READ_ONLY if image is not writable.
+ * @return  VERR_NOT_SUPPORTED if this kind of image can't be defragmented.
+ * @param   pDisk           Pointer to HDD container.
+ * @param   nImage          Image number, counts from 0. 0 is always base image of container.
+ * @param   cbPerSecMax     Maximum number of bytes to move per second, 0 for no limit.
+ * @param   pVDIfsOperation Pointer to the per-operation VD interface list.
+ */
+VBOXDDU_DECL(int) VDDefragment(PVBOXHDD pDisk, unsigned nImage, uint64_t cbPerSecMax,
+                               PVDINTERFACE pVDIfsOperation)
+{
+    int rc = VINF_SUCCESS;
+    int rc2;
+    bool fLockWrite = false;
+    uint64_t uOffset = 0;
+    uint64_t cbMovedTotal = 0;
+    uint64_t tsStart = RTTimeMilliTS();
+
+    LogFlowFunc(("pDisk=%#p nImage=%u cbPerSecMax=%llu pVDIfsOperation=%#p\n",
+                 pDisk, nImage, cbPerSecMax, pVDIfsOperation));
+
+    PVDINTERFACEPROGRESS pIfProgress = VDIfProgressGet(pVDIfsOperation);
+
+    /* Check arguments. */
+    AssertMsgReturn(VALID_PTR(pDisk), ("pDisk=%#p\n", pDisk),
+                    VERR_INVALID_PARAMETER);
+    AssertMsg(pDisk->u32Signature == VBOXHDDDISK_SIGNATURE,
+              ("u32Signature=%08x\n", pDisk->u32Signature));
+
+    /*
+     * Work in small steps and drop the write lock in between so concurrent
+     * users of the disk are not stalled for the whole operation. The image
+     * is looked up again on every step, it might have been closed meanwhile.
+     */
+    for (;;)
+    {
+        uint64_t uOffsetNext = 0;
+        uint64_t cbMoved = 0;
+        uint64_t cbSize = 0;
+
+        rc2 = vdThreadStartWrite(pDisk);
+        AssertRC(rc2);
+        fLockWrite = true;
+
+        PVDIMAGE pImage = vdGetImageByNumber(pDisk, nImage);
+        AssertPtrBreakStmt(pImage, rc = VERR_VD_IMAGE_NOT_FOUND);
+
+        if (!pImage->Backend->pfnDefragment)
+        {
+            rc = VERR_NOT_SUPPORTED;
+            break;
+        }
+
+        cbSize = pImage->Backend->pfnGetSize(pImage->pBackendData);
+        rc = pImage->Backend->pfnDefragment(pImage->pBackendData, uOffset, VD_DEFRAG_CHUNK_SIZE,
+                                            &uOffsetNext, &cbMoved, pDisk->pVDIfsDisk,
+                                            pImage->pVDIfsImage, pVDIfsOperation);
+        if (RT_FAILURE(rc))
+            break;
+
+        rc2 = vdThreadFinishWrite(pDisk);
+        AssertRC(rc2);
+        fLockWrite = false;
+
+        Assert(uOffsetNext > uOffset || uOffsetNext >= cbSize);
+        uOffset       = uOffsetNext;
+        cbMovedTotal += cbMoved;
+        if (uOffset >= cbSize)
+            break;
+
+        if (pIfProgress && pIfProgress->pfnProgress)
+        {
+            rc = pIfProgress->pfnProgress(pIfProgress->Core.pvUser,
+                                          (unsigned)(uOffset * 99 / cbSize));
+            if (RT_FAILURE(rc))
+                break;
+        }
+
+        /* Throttle by sleeping until the moved data fits into the budget. */
+        if (cbPerSecMax)
+        {
+            uint64_t cMsElapsed = RTTimeMilliTS() - tsStart;
+            uint64_t cMsBudget  = cbMovedTotal * RT_MS_1SEC / cbPerSecMax;
+            if (cMsBudget > cMsElapsed)
+                RTThreadSleep((RTMSINTERVAL)RT_MIN(cMsBudget - cMsElapsed, RT_MS_1SEC));
+        }
+    }
+
+    if (RT_UNLIKELY(fLockWrite))
+    {
+        rc2 = vdThreadFinishWrite(pDisk);
+        AssertRC(rc2);
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        if (pIfProgress && pIfProgress->pfnProgress)
+            pIfProgress->pfnProgress(pIfProgress->Core.pvUser, 100);
+    }
+
+    LogFlowFunc(("returns %Rrc (cbMoved=%llu)\n", rc, cbMovedTotal));
+    return rc;
+}
+
 /**
  * Resizes the given disk image to the given size.
  *
@@ -7828,6 +8767,42 @@ VBOXDDU_DECL(int) VDClose(PVBOXHDD pDisk, bool fDelete)
         if (RT_FAILURE(rc))
             break;
 
+        if (pDisk->pCache)
+        {
+            /* Dirty data in the cache belongs to the image being closed. */
+            if (!fDelete)
+            {
+                rc = vdCacheWriteBack(pDisk);
+                if (RT_FAILURE(rc))
+                    break;
+            }
+
+            /* The cached data doesn't match the parent, drop everything. */
+            if (pDisk->pCache->Backend->pfnDiscard)
+            {
+                size_t cbPreAllocated, cbPostAllocated, cbActuallyDiscarded;
+                uint64_t uOffsetDiscard = 0;
+                VDIOCTX IoCtx;
+
+                vdIoCtxInit(&IoCtx, pDisk, VDIOCTXTXDIR_DISCARD, 0, 0, NULL,
+                            NULL, NULL, NULL, VDIOCTX_FLAGS_SYNC);
+                rc2 = VINF_SUCCESS;
+                while (   uOffsetDiscard < pDisk->cbSize
+                       && RT_SUCCESS(rc2))
+                {
+                    size_t cbDiscard = (size_t)RT_MIN(pDisk->cbSize - uOffsetDiscard, _1G);
+
+                    rc2 = pDisk->pCache->Backend->pfnDiscard(pDisk->pCache->pBackendData, &IoCtx,
+                                                             uOffsetDiscard, cbDiscard,
+                                                             &cbPreAllocated, &cbPostAllocated,
+                                                             &cbActuallyDiscarded, NULL, 0);
+                    uOffsetDiscard += cbDiscard;
+                }
+                if (RT_FAILURE(rc2))
+                    LogRel(("VD: Dropping the cache contents failed with %Rrc\n", rc2));
+            }
+        }
+
         unsigned uOpenFlags = pImage->Backend->pfnGetOpenFlags(pImage->pBackendData);
         /* Remove image from list of opened images. */
         vdRemoveImageFromList(pDisk, pImage);
@@ -7927,6 +8902,11 @@ VBOXDDU_DECL(int) VDCacheClose(PVBOXHDD pDisk, bool fDelete)
 
         AssertPtrBreakStmt(pDisk->pCache, rc = VERR_VD_CACHE_NOT_FOUND);
 
+        /* The cache must stay attached if it still holds data not in the image. */
+        rc = vdCacheWriteBack(pDisk);
+        if (RT_FAILURE(rc))
+            break;
+
         pCache = pDisk->pCache;
         pDisk->pCache = NULL;
 
@@ -7973,6 +8953,12 @@ VBOXDDU_DECL(int) VDCloseAll(PVBOXHDD pDisk)
         PVDCACHE pCache = pDisk->pCache;
         if (pCache)
         {
+            /* Dirty data stays in the cache if this fails, it is persistent. */
+            rc2 = vdCacheWriteBack(pDisk);
+            if (RT_FAILURE(rc2) && RT_SUCCESS(rc))
+                rc = rc2;
+
+            pDisk->pCache = NULL;
             rc2 = pCache->Backend->pfnClose(pCache->pBackendData, false);
             if (RT_FAILURE(rc2) && RT_SUCCESS(rc))
                 rc = rc2;
@@ -8983,6 +9969,14 @@ VBOXDDU_DECL(int) VDSetOpenFlags(PVBOXHDD pDisk, unsigned nImage,
         PVDIMAGE pImage = vdGetImageByNumber(pDisk, nImage);
         AssertPtrBreakStmt(pImage, rc = VERR_VD_IMAGE_NOT_FOUND);
 
+        if (   pImage == pDisk->pLast
+            && (uOpenFlags & VD_OPEN_FLAGS_READONLY))
+        {
+            rc = vdCacheWriteBack(pDisk);
+            if (RT_FAILURE(rc))
+                break;
+        }
+
         rc = pImage->Backend->pfnSetOpenFlags(pImage->pBackendData,
                                               uOpenFlags & ~(VD_OPEN_FLAGS_HONOR_SAME | VD_OPEN_FLAGS_IGNORE_FLUSH | VD_OPEN_FLAGS_INFORM_ABOUT_ZERO_BLOCKS));
         if (RT_SUCCESS(rc))
@@ -9517,6 +10511,131 @@ VBOXDDU_DECL(void) VDDumpImages(PVBOXHDD pDisk)
 }
 
 
+VBOXDDU_DECL(int) VDQueryAllocatedRanges(PVBOXHDD pDisk, unsigned nImage, uint64_t uOffset,
+                                         uint64_t cbRange, PRTRANGE paRanges, unsigned cRanges,
+                                         unsigned *pcRanges)
+{
+    int rc = VINF_SUCCESS;
+    int rc2;
+    bool fLockRead = false;
+    PVDALLOCCURSOR paCursors = NULL;
+
+    LogFlowFunc(("pDisk=%#p nImage=%u uOffset=%llu cbRange=%llu paRanges=%#p cRanges=%u pcRanges=%#p\n",
+                 pDisk, nImage, uOffset, cbRange, paRanges, cRanges, pcRanges));
+    do
+    {
+        /* sanity check */
+        AssertPtrBreakStmt(pDisk, rc = VERR_INVALID_PARAMETER);
+        AssertMsg(pDisk->u32Signature == VBOXHDDDISK_SIGNATURE, ("u32Signature=%08x\n", pDisk->u32Signature));
+
+        /* Check arguments. */
+        AssertMsgBreakStmt(cRanges,
+                           ("cRanges=%u\n", cRanges),
+                           rc = VERR_INVALID_PARAMETER);
+        AssertMsgBreakStmt(VALID_PTR(paRanges),
+                           ("paRanges=%#p\n", paRanges),
+                           rc = VERR_INVALID_PARAMETER);
+        AssertMsgBreakStmt(VALID_PTR(pcRanges),
+                           ("pcRanges=%#p\n", pcRanges),
+                           rc = VERR_INVALID_PARAMETER);
+
+        rc2 = vdThreadStartRead(pDisk);
+        AssertRC(rc2);
+        fLockRead = true;
+
+        PVDIMAGE pImage = vdGetImageByNumber(pDisk, nImage);
+        AssertPtrBreakStmt(pImage, rc = VERR_VD_IMAGE_NOT_FOUND);
+
+        uint64_t offEnd = uOffset + cbRange;
+        unsigned cCursors = 0;
+
+        /* One cursor per image in the chain. */
+        for (PVDIMAGE pCurrImage = pImage; pCurrImage != NULL; pCurrImage = pCurrImage->pPrev)
+            cCursors++;
+        paCursors = (PVDALLOCCURSOR)RTMemTmpAllocZ(cCursors * sizeof(VDALLOCCURSOR));
+        if (!paCursors)
+        {
+            rc = VERR_NO_MEMORY;
+            break;
+        }
+
+        unsigned iCursor = 0;
+        for (PVDIMAGE pCurrImage = pImage; pCurrImage != NULL; pCurrImage = pCurrImage->pPrev, iCursor++)
+        {
+            paCursors[iCursor].pImage  = pCurrImage;
+            paCursors[iCursor].offNext = uOffset;
+            paCursors[iCursor].fEnd    = uOffset >= offEnd;
+        }
+
+        /*
+         * Merge the ranges of all images in offset order, coalescing overlapping
+         * and adjacent ones. The images are only queried as far as needed to fill
+         * the array, so continuing after VERR_BUFFER_OVERFLOW doesn't rescan
+         * everything again.
+         */
+        unsigned cRangesUsed = 0;
+        for (;;)
+        {
+            PVDALLOCCURSOR pCursorMin = NULL;
+            PCRTRANGE      pRangeMin  = NULL;
+
+            for (iCursor = 0; iCursor < cCursors; iCursor++)
+            {
+                PCRTRANGE pRange = NULL;
+
+                rc = vdAllocCursorPeek(&paCursors[iCursor], offEnd, &pRange);
+                if (RT_FAILURE(rc))
+                    break;
+                if (   pRange
+                    && (!pRangeMin || pRange->offStart < pRangeMin->offStart))
+                {
+                    pCursorMin = &paCursors[iCursor];
+                    pRangeMin  = pRange;
+                }
+            }
+            if (RT_FAILURE(rc) || !pRangeMin)
+                break;
+
+            uint64_t offStart    = pRangeMin->offStart;
+            uint64_t offRangeEnd = pRangeMin->offStart + pRangeMin->cbRange;
+            pCursorMin->iRange++;
+
+            if (cRangesUsed)
+            {
+                PRTRANGE pLast = &paRanges[cRangesUsed - 1];
+                uint64_t offLastEnd = pLast->offStart + pLast->cbRange;
+
+                if (offRangeEnd <= offLastEnd)
+                    continue;
+                /* Add only the part after the last range, it gets merged with it. */
+                offStart = RT_MAX(offStart, offLastEnd);
+            }
+
+            if (!vdPluginRangeAppend(paRanges, cRanges, &cRangesUsed,
+                                     offStart, (size_t)(offRangeEnd - offStart)))
+            {
+                rc = VERR_BUFFER_OVERFLOW;
+                break;
+            }
+        }
+
+        *pcRanges = cRangesUsed;
+    } while (0);
+
+    if (RT_UNLIKELY(fLockRead))
+    {
+        rc2 = vdThreadFinishRead(pDisk);
+        AssertRC(rc2);
+    }
+
+    if (paCursors)
+        RTMemTmpFree(paCursors);
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
+
 VBOXDDU_DECL(int) VDDiscardRanges(PVBOXHDD pDisk, PCRTRANGE paRanges, unsigned cRanges)
 {
     int rc;
@@ -29,8 +29,12 @@
 #include <iprt/uuid.h>
 #include <iprt/string.h>
 #include <iprt/asm.h>
+#include <iprt/sort.h>
 
 #define VDI_IMAGE_DEFAULT_BLOCK_SIZE _1M
+/** Block size of compressed images. Smaller than the default because every
+ * partial block write means decompressing and recompressing the whole block. */
+#define VDI_IMAGE_COMPRESSED_BLOCK_SIZE _256K
 
 /** Macros for endianess conversion. */
 #define SET_ENDIAN_U32(conv, u32) (conv == VDIECONV_H2F ? RT_H2LE_U32(u32) : RT_LE2H_U32(u32))
@@ -240,6 +244,24 @@ static int vdiFreeImage(PVDIIMAGEDESC pImage, bool fDelete)
             pImage->paBlocksRev = NULL;
         }
 
+        if (pImage->paBlocksComp)
+        {
+            RTMemFree(pImage->paBlocksComp);
+            pImage->paBlocksComp = NULL;
+        }
+
+        if (pImage->pvBlockComp)
+        {
+            RTMemFree(pImage->pvBlockComp);
+            pImage->pvBlockComp = NULL;
+        }
+
+        if (pImage->pvBlockCache)
+        {
+            RTMemFree(pImage->pvBlockCache);
+            pImage->pvBlockCache = NULL;
+        }
+
         if (fDelete && pImage->pszFilename)
             vdIfIoIntFileDelete(pImage->pIfIo, pImage->pszFilename);
     }
@@ -299,6 +321,8 @@ static VDIIMAGETYPE vdiTranslateImageFlags2VDI(unsigned uImageFlags)
         return VDI_IMAGE_TYPE_FIXED;
     else if (uImageFlags & VD_IMAGE_FLAGS_DIFF)
         return VDI_IMAGE_TYPE_DIFF;
+    else if (uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+        return VDI_IMAGE_TYPE_COMPRESSED;
     else
         return VDI_IMAGE_TYPE_NORMAL;
 }
@@ -316,6 +340,8 @@ static unsigned vdiTranslateVDI2ImageFlags(VDIIMAGETYPE enmType)
             return VD_IMAGE_FLAGS_FIXED;
         case VDI_IMAGE_TYPE_DIFF:
             return VD_IMAGE_FLAGS_DIFF;
+        case VDI_IMAGE_TYPE_COMPRESSED:
+            return VD_VDI_IMAGE_FLAGS_COMPRESSED;
         default:
             AssertMsgFailed(("invalid VDIIMAGETYPE enmType=%d\n", (int)enmType));
             return VD_IMAGE_FLAGS_NONE;
@@ -362,9 +388,13 @@ static void vdiInitHeader(PVDIHEADER pHeader, uint32_t uImageFlags,
     pHeader->u.v1plus.cbBlockExtra = cbBlockExtra;
     pHeader->u.v1plus.cBlocksAllocated = 0;
 
-    /* Init offsets. */
+    /* Init offsets. Compressed images store the compressed block sizes
+     * right after the block array. */
+    uint32_t cbBlockArray = pHeader->u.v1plus.cBlocks * sizeof(VDIIMAGEBLOCKPOINTER);
+    if (pHeader->u.v1plus.u32Type == VDI_IMAGE_TYPE_COMPRESSED)
+        cbBlockArray *= 2;
     pHeader->u.v1plus.offBlocks = RT_ALIGN_32(sizeof(VDIPREHEADER) + sizeof(VDIHEADER1PLUS), cbDataAlign);
-    pHeader->u.v1plus.offData = RT_ALIGN_32(pHeader->u.v1plus.offBlocks + (pHeader->u.v1plus.cBlocks * sizeof(VDIIMAGEBLOCKPOINTER)), cbDataAlign);
+    pHeader->u.v1plus.offData = RT_ALIGN_32(pHeader->u.v1plus.offBlocks + cbBlockArray, cbDataAlign);
 
     /* Init uuids. */
     RTUuidCreate(&pHeader->u.v1plus.uuidCreate);
@@ -441,6 +471,25 @@ static int vdiValidateHeader(PVDIHEADER pHeader)
         fFailed = true;
     }
 
+    if (getImageType(pHeader) == VDI_IMAGE_TYPE_COMPRESSED)
+    {
+        /* Compressed images were introduced long after the v1 header. */
+        if (   GET_MAJOR_HEADER_VERSION(pHeader) != 1
+            || getImageExtraBlockSize(pHeader) != 0
+            ||   getImageDataOffset(pHeader)
+               < getImageBlocksOffset(pHeader) + 2 * getImageBlocks(pHeader) * sizeof(VDIIMAGEBLOCKPOINTER))
+        {
+            LogRel(("VDI: invalid compressed image layout\n"));
+            fFailed = true;
+        }
+        else if (   pHeader->u.v1.u32Dummy != RTZIPTYPE_LZF
+                 && pHeader->u.v1.u32Dummy != RTZIPTYPE_ZLIB)
+        {
+            LogRel(("VDI: unsupported compression type %u\n", pHeader->u.v1.u32Dummy));
+            fFailed = true;
+        }
+    }
+
     if (   getImageLCHSGeometry(pHeader)
         && (getImageLCHSGeometry(pHeader))->cbSector != VDI_GEOMETRY_SECTOR_SIZE)
     {
@@ -515,6 +564,70 @@ static void vdiSetupImageDesc(PVDIIMAGEDESC pImage)
                                  + getImageBlockSize(&pImage->Header);
 }
 
+/**
+ * Internal: Set up the in-memory state of a compressed image.
+ */
+static int vdiCompInit(PVDIIMAGEDESC pImage)
+{
+    size_t cbBlock = getImageBlockSize(&pImage->Header);
+
+    pImage->enmCompType  = (RTZIPTYPE)pImage->Header.u.v1.u32Dummy;
+    pImage->uBlockCache  = ~0U;
+    pImage->pvBlockComp  = RTMemAlloc(cbBlock);
+    pImage->pvBlockCache = RTMemAlloc(cbBlock);
+    if (   !pImage->pvBlockComp
+        || !pImage->pvBlockCache)
+        return VERR_NO_MEMORY;
+
+    return VINF_SUCCESS;
+}
+
+/**
+ * Internal: Load the compressed block sizes of an opened image and check
+ * that all blocks are inside the image file.
+ */
+static int vdiCompLoad(PVDIIMAGEDESC pImage)
+{
+    unsigned cBlocks = getImageBlocks(&pImage->Header);
+    uint32_t cbBlock = getImageBlockSize(&pImage->Header);
+    uint64_t cbUsed = 0;
+    int rc;
+
+    pImage->paBlocksComp = (uint32_t *)RTMemAlloc(sizeof(uint32_t) * cBlocks);
+    if (!pImage->paBlocksComp)
+        return VERR_NO_MEMORY;
+
+    rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage,
+                               pImage->offStartBlocks + cBlocks * sizeof(VDIIMAGEBLOCKPOINTER),
+                               pImage->paBlocksComp, cBlocks * sizeof(uint32_t));
+    if (RT_FAILURE(rc))
+        return vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                         N_("VDI: Error reading the compressed block sizes in '%s'"), pImage->pszFilename);
+    vdiConvBlocksEndianess(VDIECONV_F2H, pImage->paBlocksComp, cBlocks);
+
+    for (unsigned i = 0; i < cBlocks; i++)
+    {
+        if (IS_VDI_IMAGE_BLOCK_ALLOCATED(pImage->paBlocks[i]))
+        {
+            uint32_t cbComp = pImage->paBlocksComp[i];
+
+            if (   !cbComp
+                || cbComp > cbBlock
+                ||   VDI_COMP_BLOCK_OFFSET(pImage, pImage->paBlocks[i]) + RT_ALIGN_32(cbComp, 512)
+                   > pImage->cbImage)
+                return vdIfError(pImage->pIfError, VERR_VD_VDI_INVALID_HEADER, RT_SRC_POS,
+                                 N_("VDI: Compressed block %u is invalid in '%s'"), i, pImage->pszFilename);
+            cbUsed += RT_ALIGN_32(cbComp, 512);
+        }
+    }
+
+    /* Everything not referenced by the block array is left over from rewritten blocks. */
+    if (pImage->cbImage >= pImage->offStartData + cbUsed)
+        pImage->cbGarbage = pImage->cbImage - pImage->offStartData - cbUsed;
+
+    return vdiCompInit(pImage);
+}
+
 /**
  * Internal: Create VDI image file.
  */
@@ -531,6 +644,8 @@ static int vdiCreateImage(PVDIIMAGEDESC pImage, uint64_t cbSize,
     uint64_t cbFill;
     uint64_t uOff;
     uint32_t cbDataAlign = VDI_DATA_ALIGN;
+    uint32_t cbBlock = VDI_IMAGE_DEFAULT_BLOCK_SIZE;
+    RTZIPTYPE enmCompType = RTZIPTYPE_LZF;
 
     AssertPtr(pPCHSGeometry);
     AssertPtr(pLCHSGeometry);
@@ -557,10 +672,33 @@ static int vdiCreateImage(PVDIIMAGEDESC pImage, uint64_t cbSize,
                            N_("VDI: Getting data alignment for '%s' failed (%Rrc)"), pImage->pszFilename);
             goto out;
         }
+
+        if (uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+        {
+            char *pszCompType = NULL;
+            rc = VDCFGQueryStringAllocDef(pIfCfg, "CompressionType", &pszCompType, "LZF");
+            if (RT_FAILURE(rc))
+            {
+                rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                               N_("VDI: Getting compression type for '%s' failed (%Rrc)"), pImage->pszFilename);
+                goto out;
+            }
+            if (!RTStrICmp(pszCompType, "ZLIB"))
+                enmCompType = RTZIPTYPE_ZLIB;
+            else if (RTStrICmp(pszCompType, "LZF"))
+                rc = vdIfError(pImage->pIfError, VERR_INVALID_PARAMETER, RT_SRC_POS,
+                               N_("VDI: Unsupported compression type '%s' for '%s'"), pszCompType, pImage->pszFilename);
+            RTMemFree(pszCompType);
+            if (RT_FAILURE(rc))
+                goto out;
+        }
     }
 
+    if (uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+        cbBlock = VDI_IMAGE_COMPRESSED_BLOCK_SIZE;
+
     vdiInitPreHeader(&pImage->PreHeader);
-    vdiInitHeader(&pImage->Header, uImageFlags, pszComment, cbSize, VDI_IMAGE_DEFAULT_BLOCK_SIZE, 0,
+    vdiInitHeader(&pImage->Header, uImageFlags, pszComment, cbSize, cbBlock, 0,
                   cbDataAlign);
     /* Save PCHS geometry. Not much work, and makes the flow of information
      * quite a bit clearer - relying on the higher level isn't obvious. */
@@ -592,6 +730,21 @@ static int vdiCreateImage(PVDIIMAGEDESC pImage, uint64_t cbSize,
         pImage->Header.u.v1.cBlocksAllocated = pImage->Header.u.v1.cBlocks;
     }
 
+    if (uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+    {
+        /* The compression type lives in the otherwise unused translation field. */
+        pImage->Header.u.v1plus.u32Dummy = enmCompType;
+        pImage->paBlocksComp = (uint32_t *)RTMemAllocZ(sizeof(uint32_t) * getImageBlocks(&pImage->Header));
+        if (!pImage->paBlocksComp)
+        {
+            rc = VERR_NO_MEMORY;
+            goto out;
+        }
+        rc = vdiCompInit(pImage);
+        if (RT_FAILURE(rc))
+            goto out;
+    }
+
     /* Setup image parameters. */
     vdiSetupImageDesc(pImage);
 
@@ -687,6 +840,20 @@ static int vdiCreateImage(PVDIIMAGEDESC pImage, uint64_t cbSize,
         goto out;
     }
 
+    if (VDI_IMAGE_IS_COMPRESSED(pImage))
+    {
+        /* All blocks are free, the size array is all zeroes. */
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage,
+                                    pImage->offStartBlocks + getImageBlocks(&pImage->Header) * sizeof(VDIIMAGEBLOCKPOINTER),
+                                    pImage->paBlocksComp, getImageBlocks(&pImage->Header) * sizeof(uint32_t));
+        if (RT_FAILURE(rc))
+        {
+            rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VDI: writing compressed block sizes failed for '%s'"),
+                           pImage->pszFilename);
+            goto out;
+        }
+    }
+
     if (uImageFlags & VD_IMAGE_FLAGS_FIXED)
     {
         /* Fill image with zeroes. We do this for every fixed-size image since on some systems
@@ -881,7 +1048,13 @@ static int vdiOpenImage(PVDIIMAGEDESC pImage, unsigned uOpenFlags)
     }
     vdiConvBlocksEndianess(VDIECONV_F2H, pImage->paBlocks, getImageBlocks(&pImage->Header));
 
-    if (uOpenFlags & VD_OPEN_FLAGS_DISCARD)
+    if (getImageType(&pImage->Header) == VDI_IMAGE_TYPE_COMPRESSED)
+    {
+        rc = vdiCompLoad(pImage);
+        if (RT_FAILURE(rc))
+            goto out;
+    }
+    else if (uOpenFlags & VD_OPEN_FLAGS_DISCARD)
     {
         /*
          * Create the back resolving table for discards.
@@ -1028,6 +1201,15 @@ static int vdiUpdateBlockInfo(PVDIIMAGEDESC pImage, unsigned uBlock)
         rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage,
                                     pImage->offStartBlocks + uBlock * sizeof(VDIIMAGEBLOCKPOINTER),
                                     &ptrBlock, sizeof(VDIIMAGEBLOCKPOINTER));
+        if (   RT_SUCCESS(rc)
+            && VDI_IMAGE_IS_COMPRESSED(pImage))
+        {
+            /* The compressed size lives in the second array. */
+            uint32_t cbComp = RT_H2LE_U32(pImage->paBlocksComp[uBlock]);
+            rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage,
+                                        pImage->offStartBlocks + (getImageBlocks(&pImage->Header) + uBlock) * sizeof(uint32_t),
+                                        &cbComp, sizeof(uint32_t));
+        }
         AssertMsgRC(rc, ("vdiUpdateBlockInfo failed to update block=%u, filename=\"%s\", rc=%Rrc\n",
                          uBlock, pImage->pszFilename, rc));
     }
@@ -1054,6 +1236,15 @@ static int vdiUpdateBlockInfoAsync(PVDIIMAGEDESC pImage, unsigned uBlock,
                                     pImage->offStartBlocks + uBlock * sizeof(VDIIMAGEBLOCKPOINTER),
                                     &ptrBlock, sizeof(VDIIMAGEBLOCKPOINTER),
                                     pIoCtx, NULL, NULL);
+        if (   (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+            && VDI_IMAGE_IS_COMPRESSED(pImage))
+        {
+            uint32_t cbComp = RT_H2LE_U32(pImage->paBlocksComp[uBlock]);
+            rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                        pImage->offStartBlocks + (getImageBlocks(&pImage->Header) + uBlock) * sizeof(uint32_t),
+                                        &cbComp, sizeof(uint32_t),
+                                        pIoCtx, NULL, NULL);
+        }
         AssertMsg(RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS,
                   ("vdiUpdateBlockInfo failed to update block=%u, filename=\"%s\", rc=%Rrc\n",
                   uBlock, pImage->pszFilename, rc));
@@ -1304,6 +1495,300 @@ static DECLCALLBACK(int) vdiBlockAllocUpdate(void *pBackendData, PVDIOCTX pIoCtx
     return rc;
 }
 
+/**
+ * Output callback for compressing a block into the compressed block buffer.
+ */
+static DECLCALLBACK(int) vdiCompOutHelper(void *pvUser, const void *pvBuf, size_t cbBuf)
+{
+    PVDICOMPRESSIO pCompIo = (PVDICOMPRESSIO)pvUser;
+
+    if (pCompIo->offBuf + cbBuf > pCompIo->cbBuf)
+        return VERR_BUFFER_OVERFLOW;
+    memcpy(pCompIo->pbBuf + pCompIo->offBuf, pvBuf, cbBuf);
+    pCompIo->offBuf += cbBuf;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Input callback for decompressing a block from the compressed block buffer.
+ */
+static DECLCALLBACK(int) vdiCompInHelper(void *pvUser, void *pvBuf, size_t cbBuf, size_t *pcbBuf)
+{
+    PVDICOMPRESSIO pCompIo = (PVDICOMPRESSIO)pvUser;
+
+    cbBuf = RT_MIN(cbBuf, pCompIo->cbBuf - pCompIo->offBuf);
+    if (!cbBuf)
+        return VERR_ZIP_CORRUPTED;
+    memcpy(pvBuf, pCompIo->pbBuf + pCompIo->offBuf, cbBuf);
+    pCompIo->offBuf += cbBuf;
+    if (pcbBuf)
+        *pcbBuf = cbBuf;
+    return VINF_SUCCESS;
+}
+
+/**
+ * Internal: Compress the block in the block cache into the compressed block
+ * buffer. Blocks which don't shrink by at least one sector are stored as is.
+ *
+ * @returns VBox status code.
+ * @param   pImage    VDI image instance data.
+ * @param   pcbComp   Where to store the size of the data in the compressed
+ *                    block buffer, the block size if stored uncompressed.
+ */
+static int vdiBlockCompress(PVDIIMAGEDESC pImage, uint32_t *pcbComp)
+{
+    uint32_t cbBlock = getImageBlockSize(&pImage->Header);
+    PRTZIPCOMP pZip = NULL;
+    VDICOMPRESSIO CompIo;
+
+    CompIo.pbBuf  = (uint8_t *)pImage->pvBlockComp;
+    CompIo.cbBuf  = cbBlock - 512;
+    CompIo.offBuf = 0;
+
+    int rc = RTZipCompCreate(&pZip, &CompIo, vdiCompOutHelper, pImage->enmCompType, RTZIPLEVEL_FAST);
+    if (RT_FAILURE(rc))
+        return rc;
+    rc = RTZipCompress(pZip, pImage->pvBlockCache, cbBlock);
+    if (RT_SUCCESS(rc))
+        rc = RTZipCompFinish(pZip);
+    RTZipCompDestroy(pZip);
+
+    if (RT_SUCCESS(rc))
+        *pcbComp = (uint32_t)CompIo.offBuf;
+    else if (rc == VERR_BUFFER_OVERFLOW)
+    {
+        /* Incompressible data. */
+        memcpy(pImage->pvBlockComp, pImage->pvBlockCache, cbBlock);
+        *pcbComp = cbBlock;
+        rc = VINF_SUCCESS;
+    }
+
+    return rc;
+}
+
+/**
+ * Internal: Decompress the compressed block buffer into the block cache.
+ *
+ * @returns VBox status code.
+ * @param   pImage    VDI image instance data.
+ * @param   cbComp    Size of the data in the compressed block buffer.
+ */
+static int vdiBlockDecompress(PVDIIMAGEDESC pImage, uint32_t cbComp)
+{
+    uint32_t cbBlock = getImageBlockSize(&pImage->Header);
+    PRTZIPDECOMP pZip = NULL;
+    size_t cbDecomp = 0;
+    VDICOMPRESSIO CompIo;
+
+    CompIo.pbBuf  = (uint8_t *)pImage->pvBlockComp;
+    CompIo.cbBuf  = cbComp;
+    CompIo.offBuf = 0;
+
+    int rc = RTZipDecompCreate(&pZip, &CompIo, vdiCompInHelper);
+    if (RT_FAILURE(rc))
+        return rc;
+    rc = RTZipDecompress(pZip, pImage->pvBlockCache, cbBlock, &cbDecomp);
+    RTZipDecompDestroy(pZip);
+    if (   RT_SUCCESS(rc)
+        && cbDecomp != cbBlock)
+        rc = VERR_ZIP_CORRUPTED;
+
+    return rc;
+}
+
+/**
+ * Updates the block array after a compressed block was written.
+ *
+ * @returns VBox status code.
+ * @param   pBackendData    The opaque backend data.
+ * @param   pIoCtx          I/O context associated with this request.
+ * @param   pvUser          Opaque user data passed during a read/write request.
+ * @param   rcReq           Status code for the completed request.
+ */
+static DECLCALLBACK(int) vdiBlockCompUpdate(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    int rc = VINF_SUCCESS;
+    PVDIIMAGEDESC pImage = (PVDIIMAGEDESC)pBackendData;
+    PVDIASYNCBLOCKCOMP pBlockComp = (PVDIASYNCBLOCKCOMP)pvUser;
+    unsigned uBlock = pBlockComp->uBlock;
+
+    if (RT_SUCCESS(rcReq))
+    {
+        /* The previous location of the block becomes garbage until the image is compacted. */
+        if (IS_VDI_IMAGE_BLOCK_ALLOCATED(pImage->paBlocks[uBlock]))
+            pImage->cbGarbage += RT_ALIGN_32(pImage->paBlocksComp[uBlock], 512);
+        else
+            setImageBlocksAllocated(&pImage->Header, getImageBlocksAllocated(&pImage->Header) + 1);
+
+        pImage->paBlocks[uBlock]     = pBlockComp->ptrBlock;
+        pImage->paBlocksComp[uBlock] = pBlockComp->cbComp;
+        rc = vdiUpdateBlockInfoAsync(pImage, uBlock, pIoCtx, true /* fUpdateHdr */);
+    }
+    else
+    {
+        /* The cached block content never made it to the disk. */
+        if (pImage->uBlockCache == uBlock)
+            pImage->uBlockCache = ~0U;
+        pImage->cbGarbage += RT_ALIGN_32(pBlockComp->cbComp, 512);
+    }
+
+    RTMemFree(pBlockComp);
+    return rc;
+}
+
+/**
+ * Internal: Read from a block of a compressed image.
+ *
+ * @returns VBox status code.
+ * @param   pImage    VDI image instance data.
+ * @param   uBlock    The allocated block to read from.
+ * @param   offRead   Offset inside the block.
+ * @param   cbToRead  How much to read, doesn't cross the block boundary.
+ * @param   pIoCtx    I/O context associated with this request.
+ */
+static int vdiReadCompressed(PVDIIMAGEDESC pImage, unsigned uBlock, unsigned offRead,
+                             size_t cbToRead, PVDIOCTX pIoCtx)
+{
+    uint32_t cbComp   = pImage->paBlocksComp[uBlock];
+    uint64_t offBlock = VDI_COMP_BLOCK_OFFSET(pImage, pImage->paBlocks[uBlock]);
+    int rc = VINF_SUCCESS;
+
+    if (pImage->uBlockCache != uBlock)
+    {
+        if (cbComp == getImageBlockSize(&pImage->Header))
+        {
+            /* Stored uncompressed, no need to go through the cache. */
+            return vdIfIoIntFileReadUser(pImage->pIfIo, pImage->pStorage, offBlock + offRead,
+                                         pIoCtx, cbToRead);
+        }
+
+        /*
+         * Read the whole compressed block as metadata. If the transfer is still
+         * pending VERR_VD_NOT_ENOUGH_METADATA makes the upper layer restart the
+         * request once the data has arrived.
+         */
+        PVDMETAXFER pMetaXfer;
+        rc = vdIfIoIntFileReadMeta(pImage->pIfIo, pImage->pStorage, offBlock,
+                                   pImage->pvBlockComp, RT_ALIGN_32(cbComp, 512),
+                                   pIoCtx, &pMetaXfer, NULL, NULL);
+        if (RT_FAILURE(rc))
+            return rc;
+        vdIfIoIntMetaXferRelease(pImage->pIfIo, pMetaXfer);
+
+        rc = vdiBlockDecompress(pImage, cbComp);
+        if (RT_FAILURE(rc))
+        {
+            pImage->uBlockCache = ~0U;
+            return vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                             N_("VDI: Compressed block %u is corrupted in '%s'"), uBlock, pImage->pszFilename);
+        }
+        pImage->uBlockCache = uBlock;
+    }
+
+    vdIfIoIntIoCtxCopyTo(pImage->pIfIo, pIoCtx, (uint8_t *)pImage->pvBlockCache + offRead, cbToRead);
+    return rc;
+}
+
+/**
+ * Internal: Write a block of a compressed image. Compressed blocks can only
+ * be replaced as a whole and are appended to the image, the space used by
+ * the previous version is reclaimed when compacting the image.
+ *
+ * @returns VBox status code.
+ * @param   pImage      VDI image instance data.
+ * @param   uBlock      The block to write.
+ * @param   offWrite    Offset inside the block.
+ * @param   cbToWrite   How much to write, doesn't cross the block boundary.
+ * @param   pIoCtx      I/O context associated with this request.
+ * @param   pcbPreRead  How much to read before the range for a full block.
+ * @param   pcbPostRead How much to read after the range for a full block.
+ * @param   fWrite      Write flags.
+ */
+static int vdiWriteCompressed(PVDIIMAGEDESC pImage, unsigned uBlock, unsigned offWrite,
+                              size_t cbToWrite, PVDIOCTX pIoCtx, size_t *pcbPreRead,
+                              size_t *pcbPostRead, unsigned fWrite)
+{
+    uint32_t cbBlock = getImageBlockSize(&pImage->Header);
+    bool fAllocated  = IS_VDI_IMAGE_BLOCK_ALLOCATED(pImage->paBlocks[uBlock]);
+    int rc = VINF_SUCCESS;
+
+    *pcbPreRead  = 0;
+    *pcbPostRead = 0;
+
+    if (   !fAllocated
+        && !(pImage->uOpenFlags & VD_OPEN_FLAGS_HONOR_ZEROES)
+        && pImage->paBlocks[uBlock] == VDI_IMAGE_BLOCK_ZERO
+        && vdIfIoIntIoCtxIsZero(pImage->pIfIo, pIoCtx, cbToWrite, true))
+        return VINF_SUCCESS;
+
+    if (   cbToWrite < cbBlock
+        || (!fAllocated && (fWrite & VD_WRITE_NO_ALLOC)))
+    {
+        /* Let the upper layer assemble the complete block. */
+        *pcbPreRead  = offWrite;
+        *pcbPostRead = cbBlock - cbToWrite - offWrite;
+        return VERR_VD_BLOCK_FREE;
+    }
+
+    Assert(!offWrite);
+    size_t cbCopied = vdIfIoIntIoCtxCopyFrom(pImage->pIfIo, pIoCtx, pImage->pvBlockCache, cbBlock);
+    Assert(cbCopied == cbBlock); NOREF(cbCopied);
+    pImage->uBlockCache = uBlock;
+
+    if (   !(pImage->uOpenFlags & VD_OPEN_FLAGS_HONOR_ZEROES)
+        && !ASMMemIsAll8(pImage->pvBlockCache, cbBlock, 0))
+    {
+        /* Turn the block into a zero block, nothing to write. */
+        if (fAllocated)
+        {
+            pImage->cbGarbage += RT_ALIGN_32(pImage->paBlocksComp[uBlock], 512);
+            pImage->paBlocks[uBlock]     = VDI_IMAGE_BLOCK_ZERO;
+            pImage->paBlocksComp[uBlock] = 0;
+            setImageBlocksAllocated(&pImage->Header, getImageBlocksAllocated(&pImage->Header) - 1);
+            rc = vdiUpdateBlockInfoAsync(pImage, uBlock, pIoCtx, true /* fUpdateHdr */);
+        }
+        else
+            pImage->paBlocks[uBlock] = VDI_IMAGE_BLOCK_ZERO;
+        return rc;
+    }
+
+    uint32_t cbComp = 0;
+    rc = vdiBlockCompress(pImage, &cbComp);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    /* Pad to a full sector and append to the image. */
+    uint32_t cbCompAligned = RT_ALIGN_32(cbComp, 512);
+    memset((uint8_t *)pImage->pvBlockComp + cbComp, 0, cbCompAligned - cbComp);
+
+    uint64_t offBlock = RT_ALIGN_64(pImage->cbImage, 512);
+    uint64_t ptrBlock = (offBlock - pImage->offStartData) >> 9;
+    if (ptrBlock >= VDI_IMAGE_BLOCK_UNALLOCATED)
+        return vdIfError(pImage->pIfError, VERR_DISK_FULL, RT_SRC_POS,
+                         N_("VDI: Compressed image '%s' is full, compact it"), pImage->pszFilename);
+
+    PVDIASYNCBLOCKCOMP pBlockComp = (PVDIASYNCBLOCKCOMP)RTMemAllocZ(sizeof(VDIASYNCBLOCKCOMP));
+    if (!pBlockComp)
+        return VERR_NO_MEMORY;
+
+    pBlockComp->uBlock   = uBlock;
+    pBlockComp->ptrBlock = (VDIIMAGEBLOCKPOINTER)ptrBlock;
+    pBlockComp->cbComp   = cbComp;
+
+    /* Reserve the space now so concurrent writes don't end up at the same place. */
+    pImage->cbImage = offBlock + cbCompAligned;
+
+    rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage, offBlock,
+                                pImage->pvBlockComp, cbCompAligned, pIoCtx,
+                                vdiBlockCompUpdate, pBlockComp);
+    if (rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+        return rc;
+
+    /* A synchronous write failed, the error is not passed on by the update callback. */
+    int rc2 = vdiBlockCompUpdate(pImage, pIoCtx, pBlockComp, rc);
+    return RT_FAILURE(rc) ? rc : rc2;
+}
+
 /** @copydoc VBOXHDDBACKEND::pfnCheckIfValid */
 static int vdiCheckIfValid(const char *pszFilename, PVDINTERFACE pVDIfsDisk,
                            PVDINTERFACE pVDIfsImage, VDTYPE *penmType)
@@ -1421,6 +1906,14 @@ static int vdiCreate(const char *pszFilename, uint64_t cbSize,
         goto out;
     }
 
+    /* Compressed blocks are only supported for dynamic base images. */
+    if (   (uImageFlags & VD_VDI_IMAGE_FLAGS_COMPRESSED)
+        && (uImageFlags & (VD_IMAGE_FLAGS_FIXED | VD_IMAGE_FLAGS_DIFF)))
+    {
+        rc = VERR_VD_INVALID_TYPE;
+        goto out;
+    }
+
     /* Check open flags. All valid flags are supported. */
     if (uOpenFlags & ~VD_OPEN_FLAGS_MASK)
     {
@@ -1590,6 +2083,8 @@ static int vdiRead(void *pBackendData, uint64_t uOffset, size_t cbToRead,
 
         rc = VINF_SUCCESS;
     }
+    else if (VDI_IMAGE_IS_COMPRESSED(pImage))
+        rc = vdiReadCompressed(pImage, uBlock, offRead, cbToRead, pIoCtx);
     else
     {
         /* Block present in image file, read relevant data. */
@@ -1655,6 +2150,15 @@ static int vdiWrite(void *pBackendData, uint64_t uOffset, size_t cbToWrite,
     cbToWrite = RT_MIN(cbToWrite, getImageBlockSize(&pImage->Header) - offWrite);
     Assert(!(cbToWrite % 512));
 
+    if (VDI_IMAGE_IS_COMPRESSED(pImage))
+    {
+        rc = vdiWriteCompressed(pImage, uBlock, offWrite, cbToWrite, pIoCtx,
+                                pcbPreRead, pcbPostRead, fWrite);
+        if (pcbWriteProcess)
+            *pcbWriteProcess = cbToWrite;
+        goto out;
+    }
+
     do
     {
         if (!IS_VDI_IMAGE_BLOCK_ALLOCATED(pImage->paBlocks[uBlock]))
@@ -2362,6 +2866,9 @@ static void vdiDump(void *pBackendData)
                      pImage->cbTotalBlockData,
                      pImage->uShiftOffset2Index,
                      pImage->offStartBlockData);
+    if (VDI_IMAGE_IS_COMPRESSED(pImage))
+        vdIfErrorMessage(pImage->pIfError, "Image:  enmCompType=%d cbGarbage=%llu\n",
+                         pImage->enmCompType, pImage->cbGarbage);
 
     unsigned uBlock, cBlocksNotFree, cBadBlocks, cBlocks = getImageBlocks(&pImage->Header);
     for (uBlock=0, cBlocksNotFree=0, cBadBlocks=0; uBlock<cBlocks; uBlock++)
@@ -2369,7 +2876,8 @@ static void vdiDump(void *pBackendData)
         if (IS_VDI_IMAGE_BLOCK_ALLOCATED(pImage->paBlocks[uBlock]))
         {
             cBlocksNotFree++;
-            if (pImage->paBlocks[uBlock] >= cBlocks)
+            if (   !VDI_IMAGE_IS_COMPRESSED(pImage)
+                && pImage->paBlocks[uBlock] >= cBlocks)
                 cBadBlocks++;
         }
     }
@@ -2385,6 +2893,112 @@ static void vdiDump(void *pBackendData)
     }
 }
 
+/**
+ * Sorts block indices by the position of the block in the image file.
+ */
+static DECLCALLBACK(int) vdiCompBlockCmp(void const *pvElement1, void const *pvElement2, void *pvUser)
+{
+    PVDIIMAGEBLOCKPOINTER paBlocks = (PVDIIMAGEBLOCKPOINTER)pvUser;
+    VDIIMAGEBLOCKPOINTER ptrBlock1 = paBlocks[*(const unsigned *)pvElement1];
+    VDIIMAGEBLOCKPOINTER ptrBlock2 = paBlocks[*(const unsigned *)pvElement2];
+
+    if (ptrBlock1 < ptrBlock2)
+        return -1;
+    if (ptrBlock1 > ptrBlock2)
+        return 1;
+    return 0;
+}
+
+/**
+ * Internal: Compact a compressed image by moving the blocks down into the
+ * space left behind by rewritten blocks and truncating the file.
+ *
+ * A block is only moved if it doesn't overlap its old location and the image
+ * is flushed after copying the data and after updating the pointer, so the
+ * image stays consistent if the operation is interrupted.
+ */
+static int vdiCompactCompressed(PVDIIMAGEDESC pImage, unsigned uPercentStart,
+                                unsigned uPercentSpan, PVDINTERFACEPROGRESS pIfProgress)
+{
+    unsigned cBlocks = getImageBlocks(&pImage->Header);
+    unsigned cBlocksAllocated = 0;
+    int rc = VINF_SUCCESS;
+
+    unsigned *pauBlocks = (unsigned *)RTMemAlloc(sizeof(unsigned) * cBlocks);
+    if (!pauBlocks)
+        return VERR_NO_MEMORY;
+
+    for (unsigned i = 0; i < cBlocks; i++)
+        if (IS_VDI_IMAGE_BLOCK_ALLOCATED(pImage->paBlocks[i]))
+            pauBlocks[cBlocksAllocated++] = i;
+
+    RTSortShell(pauBlocks, cBlocksAllocated, sizeof(unsigned), vdiCompBlockCmp, pImage->paBlocks);
+
+    uint64_t offDst = pImage->offStartData;
+    uint64_t cbGarbage = 0;
+    for (unsigned i = 0; i < cBlocksAllocated; i++)
+    {
+        unsigned uBlock = pauBlocks[i];
+        uint64_t offBlock = VDI_COMP_BLOCK_OFFSET(pImage, pImage->paBlocks[uBlock]);
+        uint32_t cbCompAligned = RT_ALIGN_32(pImage->paBlocksComp[uBlock], 512);
+
+        if (offDst + cbCompAligned <= offBlock)
+        {
+            rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, offBlock,
+                                       pImage->pvBlockComp, cbCompAligned);
+            if (RT_FAILURE(rc))
+                break;
+            rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, offDst,
+                                        pImage->pvBlockComp, cbCompAligned);
+            if (RT_FAILURE(rc))
+                break;
+
+            /*
+             * The copy must be on the disk before the pointer is changed and
+             * the new pointer before a later block overwrites the old location.
+             */
+            rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+            if (RT_FAILURE(rc))
+                break;
+
+            pImage->paBlocks[uBlock] = (VDIIMAGEBLOCKPOINTER)((offDst - pImage->offStartData) >> 9);
+            rc = vdiUpdateBlockInfo(pImage, uBlock);
+            if (RT_SUCCESS(rc))
+                rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+            if (RT_FAILURE(rc))
+                break;
+        }
+        else
+        {
+            /* Not enough room in front of the block, leave it where it is. */
+            cbGarbage += offBlock - offDst;
+            offDst = offBlock;
+        }
+        offDst += cbCompAligned;
+
+        if (pIfProgress && pIfProgress->pfnProgress)
+        {
+            rc = pIfProgress->pfnProgress(pIfProgress->Core.pvUser,
+                                          (uint64_t)i * uPercentSpan / cBlocksAllocated + uPercentStart);
+            if (RT_FAILURE(rc))
+                break;
+        }
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, offDst);
+        if (RT_SUCCESS(rc))
+        {
+            pImage->cbImage   = offDst;
+            pImage->cbGarbage = cbGarbage;
+        }
+    }
+
+    RTMemFree(pauBlocks);
+    return rc;
+}
+
 /** @copydoc VBOXHDDBACKEND::pfnCompact */
 static int vdiCompact(void *pBackendData, unsigned uPercentStart,
                       unsigned uPercentSpan, PVDINTERFACE pVDIfsDisk,
@@ -2416,6 +3030,12 @@ static int vdiCompact(void *pBackendData, unsigned uPercentStart,
         AssertBreakStmt(!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY),
                         rc = VERR_VD_IMAGE_READ_ONLY);
 
+        if (VDI_IMAGE_IS_COMPRESSED(pImage))
+        {
+            rc = vdiCompactCompressed(pImage, uPercentStart, uPercentSpan, pIfProgress);
+            break;
+        }
+
         unsigned cBlocks;
         unsigned cBlocksToMove = 0;
         size_t cbBlock;
@@ -2656,7 +3276,8 @@ static int vdiResize(void *pBackendData, uint64_t cbSize,
      * the user to know what he's doing. */
     if (   cbSize < getImageDiskSize(&pImage->Header)
         || GET_MAJOR_HEADER_VERSION(&pImage->Header) == 0
-        || pImage->uImageFlags & VD_IMAGE_FLAGS_FIXED)
+        || pImage->uImageFlags & VD_IMAGE_FLAGS_FIXED
+        || VDI_IMAGE_IS_COMPRESSED(pImage))
         rc = VERR_NOT_SUPPORTED;
     else if (cbSize > getImageDiskSize(&pImage->Header))
     {
@@ -2890,7 +3511,22 @@ static DECLCALLBACK(int) vdiDiscard(void *pBackendData, PVDIOCTX pIoCtx,
         if (pcbPostAllocated)
             *pcbPostAllocated = 0;
 
-        if (IS_VDI_IMAGE_BLOCK_ALLOCATED(pImage->paBlocks[uBlock]))
+        if (VDI_IMAGE_IS_COMPRESSED(pImage))
+        {
+            /* Compressed blocks can only be dropped as a whole, partial discards are ignored. */
+            if (   IS_VDI_IMAGE_BLOCK_ALLOCATED(pImage->paBlocks[uBlock])
+                && cbDiscard == getImageBlockSize(&pImage->Header))
+            {
+                if (pImage->uBlockCache == uBlock)
+                    pImage->uBlockCache = ~0U;
+                pImage->cbGarbage += RT_ALIGN_32(pImage->paBlocksComp[uBlock], 512);
+                pImage->paBlocks[uBlock]     = VDI_IMAGE_BLOCK_ZERO;
+                pImage->paBlocksComp[uBlock] = 0;
+                setImageBlocksAllocated(&pImage->Header, getImageBlocksAllocated(&pImage->Header) - 1);
+                rc = vdiUpdateBlockInfoAsync(pImage, uBlock, pIoCtx, true /* fUpdateHdr */);
+            }
+        }
+        else if (IS_VDI_IMAGE_BLOCK_ALLOCATED(pImage->paBlocks[uBlock]))
         {
             uint8_t *pbBlockData;
             size_t cbPreAllocated, cbPostAllocated;
@@ -3089,6 +3725,14 @@ static DECLCALLBACK(int) vdiRepair(const char *pszFilename, PVDINTERFACE pVDIfsD
             }
         }
 
+        /* The block array checks below assume fixed size blocks. */
+        if (getImageType(&Hdr) == VDI_IMAGE_TYPE_COMPRESSED)
+        {
+            rc = vdIfError(pIfError, VERR_VD_IMAGE_REPAIR_IMPOSSIBLE, RT_SRC_POS,
+                           N_("VDI: repairing compressed image '%s' is not supported"), pszFilename);
+            break;
+        }
+
         /* Setup image parameters by header. */
         uint64_t offStartBlocks, offStartData;
         size_t cbTotalBlockData;
@@ -3193,6 +3837,260 @@ static DECLCALLBACK(int) vdiRepair(const char *pszFilename, PVDINTERFACE pVDIfsD
     return rc;
 }
 
+/** @copydoc VBOXHDDBACKEND::pfnQueryAllocatedRanges */
+static DECLCALLBACK(int) vdiQueryAllocatedRanges(void *pBackendData, uint64_t uOffset,
+                                                 uint64_t cbRange, PRTRANGE paRanges,
+                                                 unsigned cRanges, unsigned *pcRanges)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu cbRange=%llu paRanges=%#p cRanges=%u pcRanges=%#p\n",
+                 pBackendData, uOffset, cbRange, paRanges, cRanges, pcRanges));
+    PVDIIMAGEDESC pImage = (PVDIIMAGEDESC)pBackendData;
+    int rc = VINF_SUCCESS;
+    unsigned cRangesUsed = 0;
+
+    AssertPtr(pImage);
+
+    uint64_t cbDisk  = getImageDiskSize(&pImage->Header);
+    uint64_t cbBlock = getImageBlockSize(&pImage->Header);
+    uint64_t offEnd  = RT_MIN(uOffset + cbRange, cbDisk);
+    uint64_t offCur  = uOffset;
+    unsigned uBlock  = (unsigned)(uOffset >> pImage->uShiftOffset2Index);
+
+    /* Zero blocks count as allocated, they hide the data of the parent. */
+    while (offCur < offEnd)
+    {
+        uint64_t offBlockEnd = RT_MIN((uint64_t)(uBlock + 1) * cbBlock, offEnd);
+
+        if (   pImage->paBlocks[uBlock] != VDI_IMAGE_BLOCK_FREE
+            && !vdPluginRangeAppend(paRanges, cRanges, &cRangesUsed,
+                                    offCur, (size_t)(offBlockEnd - offCur)))
+        {
+            rc = VERR_BUFFER_OVERFLOW;
+            break;
+        }
+
+        offCur = offBlockEnd;
+        uBlock++;
+    }
+
+    *pcRanges = cRangesUsed;
+
+    LogFlowFunc(("returns %Rrc (cRanges=%u)\n", rc, cRangesUsed));
+    return rc;
+}
+
+/**
+ * Internal: Moves the data of an allocated block into another slot of the image
+ * and updates the block pointer afterwards.
+ *
+ * The data is flushed before the block pointer is written, so the block map
+ * always references valid data if the operation is interrupted.
+ */
+static int vdiDefragMoveBlock(PVDIIMAGEDESC pImage, unsigned *paBlocks2, unsigned uBlock,
+                              unsigned uSlotDst, void *pvBuf)
+{
+    unsigned uSlotSrc = pImage->paBlocks[uBlock];
+    uint64_t offSrc = (uint64_t)uSlotSrc * pImage->cbTotalBlockData + pImage->offStartData;
+    uint64_t offDst = (uint64_t)uSlotDst * pImage->cbTotalBlockData + pImage->offStartData;
+
+    Assert(paBlocks2[uSlotSrc] == uBlock);
+    Assert(paBlocks2[uSlotDst] == VDI_IMAGE_BLOCK_FREE);
+
+    int rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, offSrc,
+                                   pvBuf, pImage->cbTotalBlockData);
+    if (RT_SUCCESS(rc))
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, offDst,
+                                    pvBuf, pImage->cbTotalBlockData);
+    if (RT_SUCCESS(rc))
+        rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+    if (RT_SUCCESS(rc))
+    {
+        pImage->paBlocks[uBlock] = uSlotDst;
+        rc = vdiUpdateBlockInfo(pImage, uBlock);
+        if (RT_SUCCESS(rc))
+        {
+            paBlocks2[uSlotDst] = uBlock;
+            paBlocks2[uSlotSrc] = VDI_IMAGE_BLOCK_FREE;
+            if (pImage->paBlocksRev)
+            {
+                /* The spare slot of a fully allocated image is not covered. */
+                unsigned cBlocks = getImageBlocks(&pImage->Header);
+                if (uSlotDst < cBlocks)
+                    pImage->paBlocksRev[uSlotDst] = uBlock;
+                if (uSlotSrc < cBlocks)
+                    pImage->paBlocksRev[uSlotSrc] = VDI_IMAGE_BLOCK_FREE;
+            }
+        }
+        else
+            pImage->paBlocks[uBlock] = uSlotSrc;
+    }
+
+    return rc;
+}
+
+/** @copydoc VBOXHDDBACKEND::pfnDefragment */
+static int vdiDefragment(void *pBackendData, uint64_t uOffset, uint64_t cbMoveMax,
+                         uint64_t *puOffsetNext, uint64_t *pcbMoved,
+                         PVDINTERFACE pVDIfsDisk, PVDINTERFACE pVDIfsImage,
+                         PVDINTERFACE pVDIfsOperation)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu cbMoveMax=%llu puOffsetNext=%#p pcbMoved=%#p\n",
+                 pBackendData, uOffset, cbMoveMax, puOffsetNext, pcbMoved));
+    PVDIIMAGEDESC pImage = (PVDIIMAGEDESC)pBackendData;
+    int rc = VINF_SUCCESS;
+    unsigned *paBlocks2 = NULL;
+    void *pvBuf = NULL;
+    uint64_t cbMoved = 0;
+
+    AssertPtrReturn(pImage, VERR_INVALID_POINTER);
+    AssertReturn(!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY), VERR_VD_IMAGE_READ_ONLY);
+
+    unsigned cBlocks          = getImageBlocks(&pImage->Header);
+    unsigned cBlocksAllocated = getImageBlocksAllocated(&pImage->Header);
+    unsigned uBlock           = (unsigned)(uOffset >> pImage->uShiftOffset2Index);
+
+    /* Fixed images are laid out in disk order from the start and compressed
+     * blocks have a variable size, nothing to do for both. */
+    if (   (pImage->uImageFlags & VD_IMAGE_FLAGS_FIXED)
+        || VDI_IMAGE_IS_COMPRESSED(pImage)
+        || uBlock >= cBlocks)
+    {
+        *puOffsetNext = getImageDiskSize(&pImage->Header);
+        *pcbMoved     = 0;
+        return VDI_IMAGE_IS_COMPRESSED(pImage) ? VERR_NOT_SUPPORTED : VINF_SUCCESS;
+    }
+
+    do
+    {
+        /*
+         * Build the back resolving table, including one spare slot after the
+         * last allocated block, and determine the slot the first block of the
+         * range has to go to: blocks are stored in ascending disk order, so it
+         * is the number of allocated blocks in front of it.
+         */
+        paBlocks2 = (unsigned *)RTMemAlloc(sizeof(unsigned) * (cBlocksAllocated + 1));
+        pvBuf = RTMemTmpAlloc(pImage->cbTotalBlockData);
+        if (!paBlocks2 || !pvBuf)
+        {
+            rc = VERR_NO_MEMORY;
+            break;
+        }
+
+        for (unsigned i = 0; i < cBlocksAllocated + 1; i++)
+            paBlocks2[i] = VDI_IMAGE_BLOCK_FREE;
+
+        unsigned uSlotNext = 0;
+        for (unsigned i = 0; i < cBlocks; i++)
+        {
+            VDIIMAGEBLOCKPOINTER ptrBlock = pImage->paBlocks[i];
+            if (IS_VDI_IMAGE_BLOCK_ALLOCATED(ptrBlock))
+            {
+                if (   ptrBlock >= cBlocksAllocated
+                    || paBlocks2[ptrBlock] != VDI_IMAGE_BLOCK_FREE)
+                {
+                    rc = vdIfError(pImage->pIfError, VERR_VD_VDI_INVALID_HEADER, RT_SRC_POS,
+                                   N_("VDI: block map of '%s' is inconsistent, repair the image first"),
+                                   pImage->pszFilename);
+                    break;
+                }
+                paBlocks2[ptrBlock] = i;
+                if (i < uBlock)
+                    uSlotNext++;
+            }
+        }
+        if (RT_FAILURE(rc))
+            break;
+
+        /*
+         * Walk the blocks in disk order and move each one into its final slot.
+         * If the slot is occupied the other block goes into the free slot first.
+         * There is always exactly one free slot, which starts out as the spare
+         * one after the end and afterwards is the one left behind by the last
+         * moved block, so each misplaced block costs at most two copies.
+         */
+        unsigned uSlotSpare = cBlocksAllocated;
+        unsigned uSlotFree  = uSlotSpare;
+        bool     fSpareUsed = false;
+
+        for (; uBlock < cBlocks && cbMoved < cbMoveMax; uBlock++)
+        {
+            VDIIMAGEBLOCKPOINTER ptrBlock = pImage->paBlocks[uBlock];
+            if (!IS_VDI_IMAGE_BLOCK_ALLOCATED(ptrBlock))
+                continue;
+
+            unsigned uSlotDst = uSlotNext++;
+            if (ptrBlock == uSlotDst)
+                continue;
+
+            unsigned uBlockOther = paBlocks2[uSlotDst];
+            if (uBlockOther != VDI_IMAGE_BLOCK_FREE)
+            {
+                if (uSlotFree == uSlotSpare && !fSpareUsed)
+                {
+                    /* Account for the spare slot in the header so new blocks
+                     * never overwrite it, even if we get interrupted. */
+                    setImageBlocksAllocated(&pImage->Header, cBlocksAllocated + 1);
+                    rc = vdiUpdateHeader(pImage);
+                    if (RT_FAILURE(rc))
+                        break;
+                    fSpareUsed = true;
+                }
+
+                rc = vdiDefragMoveBlock(pImage, paBlocks2, uBlockOther, uSlotFree, pvBuf);
+                if (RT_FAILURE(rc))
+                    break;
+                cbMoved += pImage->cbTotalBlockData;
+            }
+
+            rc = vdiDefragMoveBlock(pImage, paBlocks2, uBlock, uSlotDst, pvBuf);
+            if (RT_FAILURE(rc))
+                break;
+            cbMoved  += pImage->cbTotalBlockData;
+            uSlotFree = ptrBlock;
+        }
+
+        if (fSpareUsed)
+        {
+            /* Move the block parked in the spare slot back into the image
+             * and give the spare slot up again. */
+            if (   RT_SUCCESS(rc)
+                && paBlocks2[uSlotSpare] != VDI_IMAGE_BLOCK_FREE)
+            {
+                Assert(uSlotFree != uSlotSpare);
+                rc = vdiDefragMoveBlock(pImage, paBlocks2, paBlocks2[uSlotSpare], uSlotFree, pvBuf);
+                if (RT_SUCCESS(rc))
+                    cbMoved += pImage->cbTotalBlockData;
+            }
+
+            if (paBlocks2[uSlotSpare] == VDI_IMAGE_BLOCK_FREE)
+            {
+                int rc2;
+
+                setImageBlocksAllocated(&pImage->Header, cBlocksAllocated);
+                rc2 = vdiUpdateHeader(pImage);
+                if (RT_SUCCESS(rc2))
+                    rc2 = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage,
+                                               (uint64_t)cBlocksAllocated * pImage->cbTotalBlockData
+                                               + pImage->offStartData);
+                if (RT_SUCCESS(rc))
+                    rc = rc2;
+            }
+        }
+    } while (0);
+
+    if (paBlocks2)
+        RTMemFree(paBlocks2);
+    if (pvBuf)
+        RTMemTmpFree(pvBuf);
+
+    *puOffsetNext = RT_MIN((uint64_t)uBlock << pImage->uShiftOffset2Index,
+                           getImageDiskSize(&pImage->Header));
+    *pcbMoved     = cbMoved;
+
+    LogFlowFunc(("returns %Rrc (uOffsetNext=%llu cbMoved=%llu)\n", rc, *puOffsetNext, cbMoved));
+    return rc;
+}
+
 VBOXHDDBACKEND g_VDIBackend =
 {
     /* pszBackendName */
@@ -3289,5 +4187,9 @@ VBOXHDDBACKEND g_VDIBackend =
     /* pfnResize */
     vdiResize,
     /* pfnRepair */
-    vdiRepair
+    vdiRepair,
+    /* pfnQueryAllocatedRanges */
+    vdiQueryAllocatedRanges,
+    /* pfnDefragment */
+    vdiDefragment
 };
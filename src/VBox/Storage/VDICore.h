@@ -30,6 +30,7 @@
 #include <iprt/uuid.h>
 #include <iprt/string.h>
 #include <iprt/asm.h>
+#include <iprt/zip.h>
 
 
 /*******************************************************************************
@@ -279,11 +280,15 @@ typedef enum VDIIMAGETYPE
     VDI_IMAGE_TYPE_UNDO,
     /** Dynamically growing image file for differencing support. */
     VDI_IMAGE_TYPE_DIFF,
+    /** Dynamically growing base image file with compressed blocks. The block
+     * array holds the sector offset of each block relative to the data start
+     * and is followed by an array holding the compressed size of each block. */
+    VDI_IMAGE_TYPE_COMPRESSED,
 
     /** First valid image type value. */
     VDI_IMAGE_TYPE_FIRST  = VDI_IMAGE_TYPE_NORMAL,
     /** Last valid image type value. */
-    VDI_IMAGE_TYPE_LAST   = VDI_IMAGE_TYPE_DIFF
+    VDI_IMAGE_TYPE_LAST   = VDI_IMAGE_TYPE_COMPRESSED
 } VDIIMAGETYPE;
 /** Pointer to VDI image type. */
 typedef VDIIMAGETYPE *PVDIIMAGETYPE;
@@ -555,8 +560,27 @@ typedef struct VDIIMAGEDESC
     PVDINTERFACEIOINT       pIfIo;
     /** Current size of the image (used for range validation when reading). */
     uint64_t                cbImage;
+    /** Compressed images: array of compressed block sizes in bytes. A size equal
+     * to the block size means the block is stored uncompressed. */
+    uint32_t               *paBlocksComp;
+    /** Compressed images: compression method used for new blocks. */
+    RTZIPTYPE               enmCompType;
+    /** Compressed images: number of bytes occupied by superseded blocks. */
+    uint64_t                cbGarbage;
+    /** Compressed images: buffer for the compressed block data. */
+    void                   *pvBlockComp;
+    /** Compressed images: the most recently accessed block in uncompressed form. */
+    void                   *pvBlockCache;
+    /** Compressed images: index of the block in pvBlockCache, ~0 if none. */
+    unsigned                uBlockCache;
 } VDIIMAGEDESC, *PVDIIMAGEDESC;
 
+/** Checks whether the given image uses compressed blocks. */
+#define VDI_IMAGE_IS_COMPRESSED(pImage) ((pImage)->paBlocksComp != NULL)
+/** Converts a compressed block pointer into a file offset. */
+#define VDI_COMP_BLOCK_OFFSET(pImage, ptrBlock) \
+    ((pImage)->offStartData + ((uint64_t)(ptrBlock) << 9))
+
 /**
  * Async block discard states.
  */
@@ -604,6 +628,32 @@ typedef struct VDIASYNCBLOCKALLOC
     unsigned                uBlock;
 } VDIASYNCBLOCKALLOC, *PVDIASYNCBLOCKALLOC;
 
+/**
+ * Async compressed block write state.
+ */
+typedef struct VDIASYNCBLOCKCOMP
+{
+    /** Block index being written. */
+    unsigned                uBlock;
+    /** New block pointer (sector offset relative to the data start). */
+    VDIIMAGEBLOCKPOINTER    ptrBlock;
+    /** Compressed size of the new block data. */
+    uint32_t                cbComp;
+} VDIASYNCBLOCKCOMP, *PVDIASYNCBLOCKCOMP;
+
+/**
+ * State for compressing or decompressing a block from/to memory.
+ */
+typedef struct VDICOMPRESSIO
+{
+    /** The buffer holding the compressed data. */
+    uint8_t                *pbBuf;
+    /** Size of the buffer. */
+    size_t                  cbBuf;
+    /** Current offset into the buffer. */
+    size_t                  offBuf;
+} VDICOMPRESSIO, *PVDICOMPRESSIO;
+
 /**
  * Endianess conversion direction.
  */
@@ -3187,6 +3187,56 @@ static DECLCALLBACK(int) vhdRepair(const char *pszFilename, PVDINTERFACE pVDIfsD
 }
 
 
+/** @copydoc VBOXHDDBACKEND::pfnQueryAllocatedRanges */
+static DECLCALLBACK(int) vhdQueryAllocatedRanges(void *pBackendData, uint64_t uOffset,
+                                                 uint64_t cbRange, PRTRANGE paRanges,
+                                                 unsigned cRanges, unsigned *pcRanges)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu cbRange=%llu paRanges=%#p cRanges=%u pcRanges=%#p\n",
+                 pBackendData, uOffset, cbRange, paRanges, cRanges, pcRanges));
+    PVHDIMAGE pImage = (PVHDIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+    unsigned cRangesUsed = 0;
+
+    AssertPtr(pImage);
+
+    uint64_t offEnd = RT_MIN(uOffset + cbRange, pImage->cbSize);
+    uint64_t offCur = uOffset;
+
+    /*
+     * Allocation is reported per data block, the sector bitmap is not consulted.
+     * Fixed images have no block allocation table and are completely allocated.
+     */
+    while (offCur < offEnd)
+    {
+        uint64_t offBlockEnd = offEnd;
+        bool fAllocated = true;
+
+        if (pImage->pBlockAllocationTable)
+        {
+            uint32_t idxBat = (uint32_t)(offCur / pImage->cbDataBlock);
+
+            offBlockEnd = RT_MIN((uint64_t)(idxBat + 1) * pImage->cbDataBlock, offEnd);
+            fAllocated = pImage->pBlockAllocationTable[idxBat] != ~0U;
+        }
+
+        if (   fAllocated
+            && !vdPluginRangeAppend(paRanges, cRanges, &cRangesUsed,
+                                    offCur, (size_t)(offBlockEnd - offCur)))
+        {
+            rc = VERR_BUFFER_OVERFLOW;
+            break;
+        }
+
+        offCur = offBlockEnd;
+    }
+
+    *pcRanges = cRangesUsed;
+
+    LogFlowFunc(("returns %Rrc (cRanges=%u)\n", rc, cRangesUsed));
+    return rc;
+}
+
 VBOXHDDBACKEND g_VhdBackend =
 {
     /* pszBackendName */
@@ -3284,5 +3334,9 @@ VBOXHDDBACKEND g_VhdBackend =
     /* pfnResize */
     vhdResize,
     /* pfnRepair */
-    vhdRepair
+    vhdRepair,
+    /* pfnQueryAllocatedRanges */
+    vhdQueryAllocatedRanges,
+    /* pfnDefragment */
+    NULL
 };
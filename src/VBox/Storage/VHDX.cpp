@@ -27,6 +27,7 @@
 #include <iprt/assert.h>
 #include <iprt/alloc.h>
 #include <iprt/path.h>
+#include <iprt/string.h>
 #include <iprt/uuid.h>
 #include <iprt/crc.h>
 
@@ -186,6 +187,8 @@ typedef struct VhdxLogEntryHdr *PVhdxLogEntryHdr;
 
 /** VHDX log entry signature ("loge"). */
 #define VHDX_LOG_ENTRY_HEADER_SIGNATURE UINT32_C(0x65676f6c)
+/** Size of a log sector, entries and descriptor areas are aligned to it. */
+#define VHDX_LOG_SECTOR_SIZE            _4K
 
 /**
  * VHDX log zero descriptor.
@@ -451,6 +454,16 @@ typedef struct VhdxParentLocatorHeader *PVhdxParentLocatorHeader;
 
 /** VHDX parent locator type. */
 #define VHDX_PARENT_LOCATOR_TYPE_VHDX "b04aefb7-d19e-4a81-b789-25b8e9445913"
+/** Maximum size of the parent locator metadata item we accept. */
+#define VHDX_PARENT_LOCATOR_SIZE_MAX  _64K
+/** Parent locator key for the data write UUID of the parent. */
+#define VHDX_PARENT_LOCATOR_KEY_LINKAGE       "parent_linkage"
+/** Parent locator key for the path of the parent relative to the child. */
+#define VHDX_PARENT_LOCATOR_KEY_RELATIVE_PATH "relative_path"
+/** Parent locator key for the absolute Win32 path of the parent. */
+#define VHDX_PARENT_LOCATOR_KEY_ABSOLUTE_PATH "absolute_win32_path"
+/** Length of the parent linkage value in characters ("{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}"). */
+#define VHDX_PARENT_LOCATOR_LINKAGE_LENGTH    38
 
 /**
  * VHDX parent locator entry.
@@ -540,13 +553,52 @@ typedef struct VHDXIMAGE
     /** Logical geometry of this image. */
     VDGEOMETRY          LCHSGeometry;
 
+    /** The current header in host endianess. */
+    VhdxHeader          Hdr;
+    /** Offset of the current header in the file. */
+    uint64_t            offHdr;
+    /** Flag whether the header needs to be written. */
+    bool                fHdrDirty;
+
     /** The BAT. */
     PVhdxBatEntry       paBat;
+    /** Number of entries in the BAT, including the sector bitmap entries. */
+    uint32_t            cBatEntries;
+    /** Start offset of the BAT region in the file. */
+    uint64_t            offBat;
     /** Chunk ratio. */
     uint32_t            uChunkRatio;
+    /** File offset where the next payload block is allocated (1MB aligned). */
+    uint64_t            offBlockNext;
+
+    /** UUID of the parent from the parent locator (differencing images only). */
+    RTUUID              UuidParent;
+    /** File offset of the parent linkage value, 0 if not present. */
+    uint64_t            offParentLinkage;
+    /** Flag whether the parent linkage needs to be written. */
+    bool                fParentLinkageDirty;
+    /** Parent filename from the parent locator. */
+    char               *pszParentFilename;
+    /** Part of the sector bitmap for one payload block (differencing images only). */
+    uint8_t            *pbSectorBitmap;
+    /** Payload block the sector bitmap buffer belongs to, UINT32_MAX if none. */
+    uint32_t            idxBlockBitmap;
 
 } VHDXIMAGE, *PVHDXIMAGE;
 
+/**
+ * State for a pending block allocation.
+ */
+typedef struct VHDXBLOCKALLOC
+{
+    /** BAT index of the block. */
+    uint32_t            idxBat;
+    /** File offset of the block. */
+    uint64_t            offBlock;
+} VHDXBLOCKALLOC;
+/** Pointer to a block allocation state. */
+typedef VHDXBLOCKALLOC *PVHDXBLOCKALLOC;
+
 /**
  * Endianess conversion direction.
  */
@@ -652,9 +704,9 @@ DECLINLINE(void) vhdxConvHeaderEndianess(VHDXECONV enmConv, PVhdxHeader pHdrConv
     pHdrConv->u32Signature      = SET_ENDIAN_U32(pHdr->u32Signature);
     pHdrConv->u32Checksum       = SET_ENDIAN_U32(pHdr->u32Checksum);
     pHdrConv->u64SequenceNumber = SET_ENDIAN_U64(pHdr->u64SequenceNumber);
-    vhdxConvUuidEndianess(enmConv, &pHdrConv->UuidFileWrite, &pHdrConv->UuidFileWrite);
-    vhdxConvUuidEndianess(enmConv, &pHdrConv->UuidDataWrite, &pHdrConv->UuidDataWrite);
-    vhdxConvUuidEndianess(enmConv, &pHdrConv->UuidLog, &pHdrConv->UuidLog);
+    vhdxConvUuidEndianess(enmConv, &pHdrConv->UuidFileWrite, &pHdr->UuidFileWrite);
+    vhdxConvUuidEndianess(enmConv, &pHdrConv->UuidDataWrite, &pHdr->UuidDataWrite);
+    vhdxConvUuidEndianess(enmConv, &pHdrConv->UuidLog, &pHdr->UuidLog);
     pHdrConv->u16LogVersion     = SET_ENDIAN_U16(pHdr->u16LogVersion);
     pHdrConv->u16Version        = SET_ENDIAN_U16(pHdr->u16Version);
     pHdrConv->u32LogLength      = SET_ENDIAN_U32(pHdr->u32LogLength);
@@ -721,6 +773,7 @@ DECLINLINE(void) vhdxConvLogEntryHdrEndianess(VHDXECONV enmConv, PVhdxLogEntryHd
     pLogEntryHdrConv->u32Reserved          = SET_ENDIAN_U32(pLogEntryHdr->u32Reserved);
     vhdxConvUuidEndianess(enmConv, &pLogEntryHdrConv->UuidLog, &pLogEntryHdr->UuidLog);
     pLogEntryHdrConv->u64FlushedFileOffset = SET_ENDIAN_U64(pLogEntryHdr->u64FlushedFileOffset);
+    pLogEntryHdrConv->u64LastFileOffset    = SET_ENDIAN_U64(pLogEntryHdr->u64LastFileOffset);
 }
 
 /**
@@ -956,6 +1009,144 @@ DECLINLINE(void) vhdxConvParentLocatorEntryEndianess(VHDXECONV enmConv, PVhdxPar
     pParentLocatorEntryConv->u16ValueLength = SET_ENDIAN_U16(pParentLocatorEntry->u16ValueLength);
 }
 
+/**
+ * Prepares the on disk representation of the current header with an
+ * incremented sequence number.
+ *
+ * @returns Offset of the header location to write to.
+ * @param   pImage    Image instance data.
+ * @param   pHdr      Where to store the header in file endianess.
+ */
+static uint64_t vhdxHeaderPrepare(PVHDXIMAGE pImage, PVhdxHeader pHdr)
+{
+    /*
+     * The header is always written to the inactive location so there is a valid
+     * one if writing fails midway. The new sequence number makes it the current one.
+     */
+    pImage->Hdr.u64SequenceNumber++;
+    pImage->Hdr.u32Checksum = 0;
+
+    memset(pHdr, 0, sizeof(*pHdr));
+    vhdxConvHeaderEndianess(VHDXECONV_H2F, pHdr, &pImage->Hdr);
+    pHdr->u32Checksum = RT_H2LE_U32(RTCrc32C(pHdr, sizeof(*pHdr)));
+
+    pImage->offHdr = pImage->offHdr == VHDX_HEADER1_OFFSET ? VHDX_HEADER2_OFFSET : VHDX_HEADER1_OFFSET;
+    return pImage->offHdr;
+}
+
+/**
+ * Writes the header to the image and flushes it to disk.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ */
+static int vhdxUpdateHeader(PVHDXIMAGE pImage)
+{
+    int rc = VINF_SUCCESS;
+    PVhdxHeader pHdr = (PVhdxHeader)RTMemTmpAlloc(sizeof(VhdxHeader));
+
+    if (pHdr)
+    {
+        uint64_t offHdr = vhdxHeaderPrepare(pImage, pHdr);
+
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, offHdr,
+                                    pHdr, sizeof(VhdxHeader));
+        if (RT_SUCCESS(rc))
+            rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+        if (RT_SUCCESS(rc))
+            pImage->fHdrDirty = false;
+        RTMemTmpFree(pHdr);
+    }
+    else
+        rc = VERR_NO_MEMORY;
+
+    AssertMsgRC(rc, ("vhdxUpdateHeader failed, filename=\"%s\" rc=%Rrc\n", pImage->pszFilename, rc));
+    return rc;
+}
+
+/**
+ * Writes the header to the image - async version.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   pIoCtx    The I/O context the write belongs to.
+ */
+static int vhdxUpdateHeaderAsync(PVHDXIMAGE pImage, PVDIOCTX pIoCtx)
+{
+    int rc = VINF_SUCCESS;
+    PVhdxHeader pHdr = (PVhdxHeader)RTMemTmpAlloc(sizeof(VhdxHeader));
+
+    if (pHdr)
+    {
+        uint64_t offHdr = vhdxHeaderPrepare(pImage, pHdr);
+
+        /* The metadata write takes a copy of the buffer. */
+        rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage, offHdr,
+                                    pHdr, sizeof(VhdxHeader), pIoCtx, NULL, NULL);
+        if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+            pImage->fHdrDirty = false;
+        RTMemTmpFree(pHdr);
+    }
+    else
+        rc = VERR_NO_MEMORY;
+
+    AssertMsg(RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS,
+              ("vhdxUpdateHeaderAsync failed, filename=\"%s\" rc=%Rrc\n", pImage->pszFilename, rc));
+    return rc;
+}
+
+/**
+ * Writes the parent linkage value of the parent locator.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ */
+static int vhdxUpdateParentLinkage(PVHDXIMAGE pImage)
+{
+    RTUTF16 awszLinkage[VHDX_PARENT_LOCATOR_LINKAGE_LENGTH + 1];
+    int rc;
+
+    AssertReturn(pImage->offParentLinkage, VERR_NOT_SUPPORTED);
+
+    /* The value is stored in braces, without terminator. */
+    awszLinkage[0] = '{';
+    rc = RTUuidToUtf16(&pImage->UuidParent, &awszLinkage[1], RT_ELEMENTS(awszLinkage) - 1);
+    if (RT_SUCCESS(rc))
+    {
+        awszLinkage[VHDX_PARENT_LOCATOR_LINKAGE_LENGTH - 1] = '}';
+        for (unsigned i = 0; i < VHDX_PARENT_LOCATOR_LINKAGE_LENGTH; i++)
+            awszLinkage[i] = RT_H2LE_U16(awszLinkage[i]);
+
+        rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, pImage->offParentLinkage,
+                                    awszLinkage, VHDX_PARENT_LOCATOR_LINKAGE_LENGTH * sizeof(RTUTF16));
+        if (RT_SUCCESS(rc))
+            pImage->fParentLinkageDirty = false;
+    }
+
+    return rc;
+}
+
+/**
+ * Internal. Flush image data to disk.
+ */
+static int vhdxFlushImage(PVHDXIMAGE pImage)
+{
+    int rc = VINF_SUCCESS;
+
+    if (   pImage->pStorage
+        && !(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
+    {
+        if (pImage->fParentLinkageDirty)
+            rc = vhdxUpdateParentLinkage(pImage);
+        if (RT_SUCCESS(rc) && pImage->fHdrDirty)
+            rc = vhdxUpdateHeader(pImage);
+        if (RT_SUCCESS(rc))
+            rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+    }
+
+    return rc;
+}
+
 /**
  * Internal. Free all allocated space for representing an image except pImage,
  * and optionally delete the image from disk.
@@ -970,6 +1161,10 @@ static int vhdxFreeImage(PVHDXIMAGE pImage, bool fDelete)
     {
         if (pImage->pStorage)
         {
+            /* No point updating the file that is deleted anyway. */
+            if (!fDelete)
+                vhdxFlushImage(pImage);
+
             rc = vdIfIoIntFileClose(pImage->pIfIo, pImage->pStorage);
             pImage->pStorage = NULL;
         }
@@ -980,6 +1175,18 @@ static int vhdxFreeImage(PVHDXIMAGE pImage, bool fDelete)
             pImage->paBat = NULL;
         }
 
+        if (pImage->pbSectorBitmap)
+        {
+            RTMemFree(pImage->pbSectorBitmap);
+            pImage->pbSectorBitmap = NULL;
+        }
+
+        if (pImage->pszParentFilename)
+        {
+            RTStrFree(pImage->pszParentFilename);
+            pImage->pszParentFilename = NULL;
+        }
+
         if (fDelete && pImage->pszFilename)
             vdIfIoIntFileDelete(pImage->pIfIo, pImage->pszFilename);
     }
@@ -995,27 +1202,23 @@ static int vhdxFreeImage(PVHDXIMAGE pImage, bool fDelete)
  * @returns VBox status code.
  * @param   pImage    Image instance data.
  * @param   pHdr      The header to load.
+ * @param   offHdr    Offset of the header in the file.
  */
-static int vhdxLoadHeader(PVHDXIMAGE pImage, PVhdxHeader pHdr)
+static int vhdxLoadHeader(PVHDXIMAGE pImage, PVhdxHeader pHdr, uint64_t offHdr)
 {
     int rc = VINF_SUCCESS;
 
-    LogFlowFunc(("pImage=%#p pHdr=%#p\n", pImage, pHdr));
+    LogFlowFunc(("pImage=%#p pHdr=%#p offHdr=%llu\n", pImage, pHdr, offHdr));
 
     /*
-     * Most fields in the header are not required because the backend implements
-     * readonly access only so far.
-     * We just have to check that the log is empty, we have to refuse to load the
-     * image otherwsie because replaying the log is not implemented.
+     * Keep a copy of the header, it is required to replay the log and
+     * is rewritten when the image is modified.
      */
     if (pHdr->u16Version == VHDX_HEADER_VHDX_VERSION)
     {
-        /* Check that the log UUID is zero. */
         pImage->uVersion = pHdr->u16Version;
-        if (!RTUuidIsNull(&pHdr->UuidLog))
-            rc = vdIfError(pImage->pIfError, VERR_NOT_SUPPORTED, RT_SRC_POS,
-                           "VHDX: Image \'%s\' has a non empty log which is not supported",
-                           pImage->pszFilename);
+        pImage->Hdr      = *pHdr;
+        pImage->offHdr   = offHdr;
     }
     else
         rc = vdIfError(pImage->pIfError, VERR_NOT_SUPPORTED, RT_SRC_POS,
@@ -1091,7 +1294,8 @@ static int vhdxFindAndLoadCurrentHeader(PVHDXIMAGE pImage)
         if (fHdr1Valid != fHdr2Valid)
         {
             /* Only one header is valid - use it. */
-            rc = vhdxLoadHeader(pImage, fHdr1Valid ? pHdr1 : pHdr2);
+            rc = vhdxLoadHeader(pImage, fHdr1Valid ? pHdr1 : pHdr2,
+                                fHdr1Valid ? VHDX_HEADER1_OFFSET : VHDX_HEADER2_OFFSET);
         }
         else if (!fHdr1Valid && !fHdr2Valid)
         {
@@ -1103,9 +1307,9 @@ static int vhdxFindAndLoadCurrentHeader(PVHDXIMAGE pImage)
         {
             /* Both headers are valid. Use the sequence number to find the current one. */
             if (pHdr1->u64SequenceNumber > pHdr2->u64SequenceNumber)
-                rc = vhdxLoadHeader(pImage, pHdr1);
+                rc = vhdxLoadHeader(pImage, pHdr1, VHDX_HEADER1_OFFSET);
             else
-                rc = vhdxLoadHeader(pImage, pHdr2);
+                rc = vhdxLoadHeader(pImage, pHdr2, VHDX_HEADER2_OFFSET);
         }
     }
     else
@@ -1121,6 +1325,322 @@ static int vhdxFindAndLoadCurrentHeader(PVHDXIMAGE pImage)
     return rc;
 }
 
+/**
+ * Checks whether there is a valid log entry at the given offset of the log.
+ *
+ * @returns true if the entry is valid, false otherwise.
+ * @param   pImage    Image instance data.
+ * @param   pbLog     The log region, stored twice in a row so entries wrapping
+ *                    around the end can be accessed linearly.
+ * @param   cbLog     Size of the log region.
+ * @param   offEntry  Offset of the entry in the log.
+ * @param   pEntryHdr Where to store the entry header in host endianess.
+ */
+static bool vhdxLogEntryIsValid(PVHDXIMAGE pImage, const uint8_t *pbLog, uint32_t cbLog,
+                                uint32_t offEntry, PVhdxLogEntryHdr pEntryHdr)
+{
+    const uint8_t *pbEntry = pbLog + offEntry;
+    VhdxLogEntryHdr EntryHdr;
+
+    memcpy(&EntryHdr, pbEntry, sizeof(EntryHdr));
+    vhdxConvLogEntryHdrEndianess(VHDXECONV_F2H, &EntryHdr, &EntryHdr);
+
+    if (   EntryHdr.u32Signature != VHDX_LOG_ENTRY_HEADER_SIGNATURE
+        || EntryHdr.u32EntryLength < VHDX_LOG_SECTOR_SIZE
+        || EntryHdr.u32EntryLength > cbLog
+        || EntryHdr.u32EntryLength % VHDX_LOG_SECTOR_SIZE
+        || EntryHdr.u32Tail >= cbLog
+        || EntryHdr.u32Tail % VHDX_LOG_SECTOR_SIZE
+        || EntryHdr.u32DescriptorCount > cbLog / sizeof(VhdxLogDataDesc)
+        || RTUuidCompare(&EntryHdr.UuidLog, &pImage->Hdr.UuidLog))
+        return false;
+
+    /* The descriptors are padded to the sector size and followed by the data sectors. */
+    uint32_t cbDescriptors = RT_ALIGN_32(sizeof(VhdxLogEntryHdr) + EntryHdr.u32DescriptorCount * sizeof(VhdxLogDataDesc),
+                                         VHDX_LOG_SECTOR_SIZE);
+    uint32_t cDataSectors = 0;
+
+    if (cbDescriptors > EntryHdr.u32EntryLength)
+        return false;
+
+    for (uint32_t i = 0; i < EntryHdr.u32DescriptorCount; i++)
+    {
+        /* Zero and data descriptors have the same size and share the signature and sequence number location. */
+        VhdxLogDataDesc Desc;
+
+        memcpy(&Desc, pbEntry + sizeof(VhdxLogEntryHdr) + i * sizeof(VhdxLogDataDesc), sizeof(Desc));
+        vhdxConvLogDataDescEndianess(VHDXECONV_F2H, &Desc, &Desc);
+
+        if (Desc.u64SequenceNumber != EntryHdr.u64SequenceNumber)
+            return false;
+
+        if (Desc.u32DataSignature == VHDX_LOG_DATA_DESC_SIGNATURE)
+        {
+            PVhdxLogDataSector pDataSector = (PVhdxLogDataSector)(pbEntry + cbDescriptors + cDataSectors * VHDX_LOG_SECTOR_SIZE);
+
+            if (   cbDescriptors + (cDataSectors + 1) * VHDX_LOG_SECTOR_SIZE > EntryHdr.u32EntryLength
+                || RT_LE2H_U32(pDataSector->u32DataSignature) != VHDX_LOG_DATA_SECTOR_SIGNATURE
+                || RT_LE2H_U32(pDataSector->u32SequenceHigh) != (uint32_t)(EntryHdr.u64SequenceNumber >> 32)
+                || RT_LE2H_U32(pDataSector->u32SequenceLow) != (uint32_t)EntryHdr.u64SequenceNumber)
+                return false;
+            cDataSectors++;
+        }
+        else if (Desc.u32DataSignature != VHDX_LOG_ZERO_DESC_SIGNATURE)
+            return false;
+    }
+
+    if (cbDescriptors + cDataSectors * VHDX_LOG_SECTOR_SIZE != EntryHdr.u32EntryLength)
+        return false;
+
+    /* The checksum covers the complete entry with the checksum field set to zero. */
+    uint32_t const u32Zero = 0;
+    uint32_t u32ChkSum = RTCrc32CStart();
+    u32ChkSum = RTCrc32CProcess(u32ChkSum, pbEntry, RT_OFFSETOF(VhdxLogEntryHdr, u32Checksum));
+    u32ChkSum = RTCrc32CProcess(u32ChkSum, &u32Zero, sizeof(u32Zero));
+    u32ChkSum = RTCrc32CProcess(u32ChkSum, pbEntry + RT_OFFSETOF(VhdxLogEntryHdr, u32EntryLength),
+                                EntryHdr.u32EntryLength - RT_OFFSETOF(VhdxLogEntryHdr, u32EntryLength));
+    if (RTCrc32CFinish(u32ChkSum) != EntryHdr.u32Checksum)
+        return false;
+
+    *pEntryHdr = EntryHdr;
+    return true;
+}
+
+/**
+ * Searches the log for the active sequence, the valid sequence of entries
+ * with the highest sequence number.
+ *
+ * @returns true if an active sequence was found, false if the log is empty.
+ * @param   pImage    Image instance data.
+ * @param   pbLog     The log region, stored twice in a row.
+ * @param   cbLog     Size of the log region.
+ * @param   poffTail  Where to store the offset of the first entry of the sequence.
+ * @param   poffHead  Where to store the offset of the last entry of the sequence.
+ * @param   pHeadHdr  Where to store the header of the last entry in host endianess.
+ */
+static bool vhdxLogFindActiveSequence(PVHDXIMAGE pImage, const uint8_t *pbLog, uint32_t cbLog,
+                                      uint32_t *poffTail, uint32_t *poffHead, PVhdxLogEntryHdr pHeadHdr)
+{
+    bool fFound = false;
+
+    for (uint32_t offStart = 0; offStart < cbLog; offStart += VHDX_LOG_SECTOR_SIZE)
+    {
+        VhdxLogEntryHdr EntryHdr;
+
+        if (!vhdxLogEntryIsValid(pImage, pbLog, cbLog, offStart, &EntryHdr))
+            continue;
+
+        /* Follow the sequence as long as the sequence numbers increment. */
+        uint32_t offHead = offStart;
+        uint32_t cbSeq   = 0;
+        VhdxLogEntryHdr HeadHdr = EntryHdr;
+        for (;;)
+        {
+            uint32_t offNext = (offHead + HeadHdr.u32EntryLength) % cbLog;
+
+            cbSeq += HeadHdr.u32EntryLength;
+            if (   cbSeq >= cbLog
+                || !vhdxLogEntryIsValid(pImage, pbLog, cbLog, offNext, &EntryHdr)
+                || EntryHdr.u64SequenceNumber != HeadHdr.u64SequenceNumber + 1)
+                break;
+
+            offHead = offNext;
+            HeadHdr = EntryHdr;
+        }
+
+        /*
+         * The sequence is only complete if the tail the head entry points to is
+         * part of it. Replaying starts at the tail then.
+         */
+        if (   ((HeadHdr.u32Tail - offStart + cbLog) % cbLog) < cbSeq
+            && (   !fFound
+                || HeadHdr.u64SequenceNumber > pHeadHdr->u64SequenceNumber))
+        {
+            fFound    = true;
+            *poffTail = HeadHdr.u32Tail;
+            *poffHead = offHead;
+            *pHeadHdr = HeadHdr;
+        }
+    }
+
+    return fFound;
+}
+
+/**
+ * Applies the updates of a single log entry to the file.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   pbEntry   The log entry, validated already.
+ * @param   pbBuf     Scratch buffer of VHDX_LOG_SECTOR_SIZE bytes.
+ */
+static int vhdxLogEntryReplay(PVHDXIMAGE pImage, const uint8_t *pbEntry, uint8_t *pbBuf)
+{
+    VhdxLogEntryHdr EntryHdr;
+    int rc = VINF_SUCCESS;
+
+    memcpy(&EntryHdr, pbEntry, sizeof(EntryHdr));
+    vhdxConvLogEntryHdrEndianess(VHDXECONV_F2H, &EntryHdr, &EntryHdr);
+
+    uint32_t cbDescriptors = RT_ALIGN_32(sizeof(VhdxLogEntryHdr) + EntryHdr.u32DescriptorCount * sizeof(VhdxLogDataDesc),
+                                         VHDX_LOG_SECTOR_SIZE);
+    uint32_t cDataSectors = 0;
+
+    LogFlowFunc(("pImage=%#p u64SequenceNumber=%llu cDescriptors=%u\n",
+                 pImage, EntryHdr.u64SequenceNumber, EntryHdr.u32DescriptorCount));
+
+    for (uint32_t i = 0; i < EntryHdr.u32DescriptorCount && RT_SUCCESS(rc); i++)
+    {
+        const uint8_t *pbDesc = pbEntry + sizeof(VhdxLogEntryHdr) + i * sizeof(VhdxLogDataDesc);
+
+        if (RT_LE2H_U32(*(const uint32_t *)pbDesc) == VHDX_LOG_DATA_DESC_SIGNATURE)
+        {
+            PVhdxLogDataDesc pDataDesc = (PVhdxLogDataDesc)pbDesc;
+            PVhdxLogDataSector pDataSector = (PVhdxLogDataSector)(pbEntry + cbDescriptors + cDataSectors * VHDX_LOG_SECTOR_SIZE);
+
+            /*
+             * The first 8 and last 4 bytes of the update are stored in the descriptor
+             * because the data sector uses them for the signature and sequence number.
+             */
+            memcpy(pbBuf, &pDataDesc->u64LeadingBytes, sizeof(pDataDesc->u64LeadingBytes));
+            memcpy(pbBuf + sizeof(pDataDesc->u64LeadingBytes), &pDataSector->u8Data[0], sizeof(pDataSector->u8Data));
+            memcpy(pbBuf + VHDX_LOG_SECTOR_SIZE - sizeof(pDataDesc->u32TrailingBytes),
+                   &pDataDesc->u32TrailingBytes, sizeof(pDataDesc->u32TrailingBytes));
+
+            rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage,
+                                        RT_LE2H_U64(pDataDesc->u64FileOffset),
+                                        pbBuf, VHDX_LOG_SECTOR_SIZE);
+            cDataSectors++;
+        }
+        else
+        {
+            VhdxLogZeroDesc ZeroDesc;
+
+            memcpy(&ZeroDesc, pbDesc, sizeof(ZeroDesc));
+            vhdxConvLogZeroDescEndianess(VHDXECONV_F2H, &ZeroDesc, &ZeroDesc);
+
+            memset(pbBuf, 0, VHDX_LOG_SECTOR_SIZE);
+            while (   ZeroDesc.u64ZeroLength
+                   && RT_SUCCESS(rc))
+            {
+                size_t cbThisWrite = (size_t)RT_MIN(ZeroDesc.u64ZeroLength, VHDX_LOG_SECTOR_SIZE);
+
+                rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pImage->pStorage, ZeroDesc.u64FileOffset,
+                                            pbBuf, cbThisWrite);
+                ZeroDesc.u64FileOffset += cbThisWrite;
+                ZeroDesc.u64ZeroLength -= cbThisWrite;
+            }
+        }
+    }
+
+    LogFlowFunc(("returns rc=%Rrc\n", rc));
+    return rc;
+}
+
+/**
+ * Replays a non empty log and clears it afterwards.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ */
+static int vhdxLogReplay(PVHDXIMAGE pImage)
+{
+    int rc = VINF_SUCCESS;
+    uint32_t cbLog = pImage->Hdr.u32LogLength;
+    uint8_t *pbLog = NULL;
+
+    LogFlowFunc(("pImage=%#p\n", pImage));
+
+    if (RTUuidIsNull(&pImage->Hdr.UuidLog))
+        return VINF_SUCCESS;
+
+    /*
+     * Replaying the log modifies the image, it can't be used without
+     * as the metadata might be inconsistent otherwise.
+     */
+    if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
+        return vdIfError(pImage->pIfError, VERR_NOT_SUPPORTED, RT_SRC_POS,
+                         "VHDX: Image \'%s\' has a non empty log which can only be replayed when opening the image for writing",
+                         pImage->pszFilename);
+
+    if (   pImage->Hdr.u16LogVersion != VHDX_HEADER_LOG_VERSION
+        || !cbLog
+        || cbLog % _1M
+        || pImage->Hdr.u64LogOffset % _1M)
+        return vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                         "VHDX: Invalid log region in image \'%s\'",
+                         pImage->pszFilename);
+
+    /* Store the log twice in a row, entries can wrap around the end of the region. */
+    pbLog = (uint8_t *)RTMemAlloc(2 * (size_t)cbLog + VHDX_LOG_SECTOR_SIZE);
+    if (!pbLog)
+        return vdIfError(pImage->pIfError, VERR_NO_MEMORY, RT_SRC_POS,
+                         "VHDX: Out of memory allocating memory for the log of image \'%s\'",
+                         pImage->pszFilename);
+
+    rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, pImage->Hdr.u64LogOffset,
+                               pbLog, cbLog);
+    if (RT_SUCCESS(rc))
+    {
+        uint8_t *pbBuf = pbLog + 2 * (size_t)cbLog;
+        uint32_t offTail = 0;
+        uint32_t offHead = 0;
+        VhdxLogEntryHdr HeadHdr;
+
+        memcpy(pbLog + cbLog, pbLog, cbLog);
+
+        if (vhdxLogFindActiveSequence(pImage, pbLog, cbLog, &offTail, &offHead, &HeadHdr))
+        {
+            uint64_t cbFile = 0;
+
+            LogRel(("VHDX: Replaying log of image '%s' (tail=%#x head=%#x sequence=%llu)\n",
+                    pImage->pszFilename, offTail, offHead, HeadHdr.u64SequenceNumber));
+
+            rc = vdIfIoIntFileGetSize(pImage->pIfIo, pImage->pStorage, &cbFile);
+            if (   RT_SUCCESS(rc)
+                && cbFile < HeadHdr.u64FlushedFileOffset)
+                rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                               "VHDX: Image \'%s\' is smaller than recorded in the log, the file might be truncated",
+                               pImage->pszFilename);
+
+            uint32_t offEntry = offTail;
+            while (RT_SUCCESS(rc))
+            {
+                rc = vhdxLogEntryReplay(pImage, pbLog + offEntry, pbBuf);
+                if (offEntry == offHead)
+                    break;
+                offEntry = (offEntry + RT_LE2H_U32(((PVhdxLogEntryHdr)(pbLog + offEntry))->u32EntryLength)) % cbLog;
+            }
+
+            if (   RT_SUCCESS(rc)
+                && cbFile < HeadHdr.u64LastFileOffset)
+                rc = vdIfIoIntFileSetSize(pImage->pIfIo, pImage->pStorage, HeadHdr.u64LastFileOffset);
+            if (RT_SUCCESS(rc))
+                rc = vdIfIoIntFileFlushSync(pImage->pIfIo, pImage->pStorage);
+            if (RT_FAILURE(rc))
+                rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                               "VHDX: Replaying the log of image \'%s\' failed",
+                               pImage->pszFilename);
+        }
+
+        /* The log is clean now, mark it as empty. */
+        if (RT_SUCCESS(rc))
+        {
+            RTUuidClear(&pImage->Hdr.UuidLog);
+            rc = vhdxUpdateHeader(pImage);
+        }
+    }
+    else
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                       "VHDX: Reading the log of image \'%s\' failed",
+                       pImage->pszFilename);
+
+    RTMemFree(pbLog);
+
+    LogFlowFunc(("returns rc=%Rrc\n", rc));
+    return rc;
+}
+
 /**
  * Loads the BAT region.
  *
@@ -1155,14 +1675,18 @@ static int vhdxLoadBatRegion(PVHDXIMAGE pImage, uint64_t offRegion,
     if (cDataBlocks % uChunkRatio)
         cSectorBitmapBlocks++;
 
-    cBatEntries = cDataBlocks + (cDataBlocks - 1)/uChunkRatio;
+    /* Differencing images have a sector bitmap entry for the last chunk as well. */
+    if (pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF)
+        cBatEntries = cSectorBitmapBlocks * (uChunkRatio + 1);
+    else
+        cBatEntries = cDataBlocks + (cDataBlocks - 1)/uChunkRatio;
     cbBatEntries = cBatEntries * sizeof(VhdxBatEntry);
 
     if (cbBatEntries <= cbRegion)
     {
         /*
          * Load the complete BAT region first, convert to host endianess and process
-         * it afterwards. The SB entries can be removed because they are not needed yet.
+         * it afterwards. The SB entries are kept so entries can be updated in place.
          */
         paBatEntries = (PVhdxBatEntry)RTMemAlloc(cbBatEntries);
         if (paBatEntries)
@@ -1182,7 +1706,7 @@ static int vhdxLoadBatRegion(PVHDXIMAGE pImage, uint64_t offRegion,
                     {
 /**
  * Disabled the verification because there are images out there with the sector bitmap
- * marked as present. The entry is never accessed and the image is readonly anyway,
+ * marked as present. The entry is only accessed for differencing images,
  * so no harm done.
  */
 #if 0
@@ -1201,7 +1725,8 @@ static int vhdxLoadBatRegion(PVHDXIMAGE pImage, uint64_t offRegion,
                     {
                         /* Payload block. */
                         if (   VHDX_BAT_ENTRY_GET_STATE(paBatEntries[i].u64BatEntry)
-                            == VHDX_BAT_ENTRY_PAYLOAD_BLOCK_PARTIALLY_PRESENT)
+                            == VHDX_BAT_ENTRY_PAYLOAD_BLOCK_PARTIALLY_PRESENT
+                            && !(pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF))
                         {
                             rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
                                            "VHDX: Payload block at entry %u of image \'%s\' marked as partially present, violation of the specification",
@@ -1214,6 +1739,8 @@ static int vhdxLoadBatRegion(PVHDXIMAGE pImage, uint64_t offRegion,
                 if (RT_SUCCESS(rc))
                 {
                     pImage->paBat       = paBatEntries;
+                    pImage->cBatEntries = cBatEntries;
+                    pImage->offBat      = offRegion;
                     pImage->uChunkRatio = uChunkRatio;
                 }
             }
@@ -1269,11 +1796,15 @@ static int vhdxLoadFileParametersMetadata(PVHDXIMAGE pImage, uint64_t offItem, s
             vhdxConvFileParamsEndianess(VHDXECONV_F2H, &FileParameters, &FileParameters);
             pImage->cbBlock = FileParameters.u32BlockSize;
 
-            /* @todo: No support for differencing images yet. */
-            if (FileParameters.u32Flags & VHDX_FILE_PARAMETERS_FLAGS_HAS_PARENT)
-                rc = vdIfError(pImage->pIfError, VERR_NOT_SUPPORTED, RT_SRC_POS,
-                               "VHDX: Image \'%s\' is a differencing image which is not supported yet",
-                               pImage->pszFilename);
+            /* Blocks are allocated in units of 1MB. */
+            if (   pImage->cbBlock < _1M
+                || pImage->cbBlock > 256 * _1M
+                || pImage->cbBlock % _1M)
+                rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                               "VHDX: Invalid block size %zu in image \'%s\'",
+                               pImage->cbBlock, pImage->pszFilename);
+            else if (FileParameters.u32Flags & VHDX_FILE_PARAMETERS_FLAGS_HAS_PARENT)
+                pImage->uImageFlags |= VD_IMAGE_FLAGS_DIFF;
         }
         else
             rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
@@ -1353,6 +1884,11 @@ static int vhdxLoadVDiskLogSectorSizeMetadata(PVHDXIMAGE pImage, uint64_t offIte
             vhdxConvVDiskLogSectSizeEndianess(VHDXECONV_F2H, &VDiskLogSectSize,
                                               &VDiskLogSectSize);
             pImage->cbLogicalSector = VDiskLogSectSize.u32LogicalSectorSize;
+            if (   pImage->cbLogicalSector != 512
+                && pImage->cbLogicalSector != 4096)
+                rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                               "VHDX: Invalid logical sector size %u in image \'%s\'",
+                               pImage->cbLogicalSector, pImage->pszFilename);
         }
         else
             rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
@@ -1364,6 +1900,164 @@ static int vhdxLoadVDiskLogSectorSizeMetadata(PVHDXIMAGE pImage, uint64_t offIte
     return rc;
 }
 
+/**
+ * Checks whether a parent locator key matches the given ASCII string.
+ *
+ * @returns true if the key matches, false otherwise.
+ * @param   pwszKey   The key in file endianess, not terminated.
+ * @param   cwcKey    Number of characters in the key.
+ * @param   pszMatch  The ASCII string to compare with.
+ */
+static bool vhdxParentLocatorKeyIs(PCRTUTF16 pwszKey, size_t cwcKey, const char *pszMatch)
+{
+    if (strlen(pszMatch) != cwcKey)
+        return false;
+
+    for (size_t i = 0; i < cwcKey; i++)
+        if (RT_LE2H_U16(pwszKey[i]) != (RTUTF16)pszMatch[i])
+            return false;
+
+    return true;
+}
+
+/**
+ * Load the parent locator metadata item from the file.
+ *
+ * @returns VBox status code.
+ * @param   pImage    Image instance data.
+ * @param   offItem   File offset where the data is stored.
+ * @param   cbItem    Size of the item in the file.
+ */
+static int vhdxLoadParentLocatorMetadata(PVHDXIMAGE pImage, uint64_t offItem, size_t cbItem)
+{
+    int rc = VINF_SUCCESS;
+    uint8_t *pbItem = NULL;
+
+    LogFlowFunc(("pImage=%#p offItem=%llu cbItem=%zu\n", pImage, offItem, cbItem));
+
+    if (   cbItem < sizeof(VhdxParentLocatorHeader)
+        || cbItem > VHDX_PARENT_LOCATOR_SIZE_MAX)
+        return vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                         "VHDX: Parent locator item has an invalid size (%zu) in image \'%s\'",
+                         cbItem, pImage->pszFilename);
+
+    pbItem = (uint8_t *)RTMemTmpAlloc(cbItem);
+    if (!pbItem)
+        return vdIfError(pImage->pIfError, VERR_NO_MEMORY, RT_SRC_POS,
+                         "VHDX: Out of memory allocating memory for the parent locator of image \'%s\'",
+                         pImage->pszFilename);
+
+    rc = vdIfIoIntFileReadSync(pImage->pIfIo, pImage->pStorage, offItem, pbItem, cbItem);
+    if (RT_SUCCESS(rc))
+    {
+        VhdxParentLocatorHeader ParentLocatorHdr;
+
+        memcpy(&ParentLocatorHdr, pbItem, sizeof(ParentLocatorHdr));
+        vhdxConvParentLocatorHeaderEndianness(VHDXECONV_F2H, &ParentLocatorHdr, &ParentLocatorHdr);
+
+        if (RTUuidCompareStr(&ParentLocatorHdr.UuidLocatorType, VHDX_PARENT_LOCATOR_TYPE_VHDX))
+            rc = vdIfError(pImage->pIfError, VERR_NOT_SUPPORTED, RT_SRC_POS,
+                           "VHDX: Unsupported parent locator type in image \'%s\'",
+                           pImage->pszFilename);
+        else if (  sizeof(VhdxParentLocatorHeader)
+                 + ParentLocatorHdr.u16KeyValueCount * sizeof(VhdxParentLocatorEntry) > cbItem)
+            rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                           "VHDX: Parent locator entries exceed the item size in image \'%s\'",
+                           pImage->pszFilename);
+
+        for (unsigned i = 0; i < ParentLocatorHdr.u16KeyValueCount && RT_SUCCESS(rc); i++)
+        {
+            VhdxParentLocatorEntry ParentLocatorEntry;
+
+            memcpy(&ParentLocatorEntry,
+                   pbItem + sizeof(VhdxParentLocatorHeader) + i * sizeof(VhdxParentLocatorEntry),
+                   sizeof(ParentLocatorEntry));
+            vhdxConvParentLocatorEntryEndianess(VHDXECONV_F2H, &ParentLocatorEntry, &ParentLocatorEntry);
+
+            if (   (uint64_t)ParentLocatorEntry.u32KeyOffset + ParentLocatorEntry.u16KeyLength > cbItem
+                || (uint64_t)ParentLocatorEntry.u32ValueOffset + ParentLocatorEntry.u16ValueLength > cbItem
+                || (ParentLocatorEntry.u32KeyOffset | ParentLocatorEntry.u32ValueOffset) & 1
+                || (ParentLocatorEntry.u16KeyLength | ParentLocatorEntry.u16ValueLength) & 1)
+            {
+                rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                               "VHDX: Parent locator entry %u is invalid in image \'%s\'",
+                               i, pImage->pszFilename);
+                break;
+            }
+
+            /* Keys and values are UTF-16 strings without terminator. */
+            PCRTUTF16 pwszKey   = (PCRTUTF16)(pbItem + ParentLocatorEntry.u32KeyOffset);
+            PCRTUTF16 pwszValue = (PCRTUTF16)(pbItem + ParentLocatorEntry.u32ValueOffset);
+            size_t    cwcKey    = ParentLocatorEntry.u16KeyLength / sizeof(RTUTF16);
+            size_t    cwcValue  = ParentLocatorEntry.u16ValueLength / sizeof(RTUTF16);
+
+            if (vhdxParentLocatorKeyIs(pwszKey, cwcKey, VHDX_PARENT_LOCATOR_KEY_LINKAGE))
+            {
+                RTUTF16 awszLinkage[VHDX_PARENT_LOCATOR_LINKAGE_LENGTH + 1];
+
+                if (cwcValue == VHDX_PARENT_LOCATOR_LINKAGE_LENGTH)
+                {
+                    for (unsigned idx = 0; idx < VHDX_PARENT_LOCATOR_LINKAGE_LENGTH; idx++)
+                        awszLinkage[idx] = RT_LE2H_U16(pwszValue[idx]);
+                    awszLinkage[VHDX_PARENT_LOCATOR_LINKAGE_LENGTH] = '\0';
+                    rc = RTUuidFromUtf16(&pImage->UuidParent, awszLinkage);
+                }
+                else
+                    rc = VERR_INVALID_UUID_FORMAT;
+
+                if (RT_SUCCESS(rc))
+                    pImage->offParentLinkage = offItem + ParentLocatorEntry.u32ValueOffset;
+                else
+                    rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                                   "VHDX: Invalid parent linkage in image \'%s\'",
+                                   pImage->pszFilename);
+            }
+            else if (   cwcValue
+                     && (   vhdxParentLocatorKeyIs(pwszKey, cwcKey, VHDX_PARENT_LOCATOR_KEY_RELATIVE_PATH)
+                         || (   !pImage->pszParentFilename
+                             && vhdxParentLocatorKeyIs(pwszKey, cwcKey, VHDX_PARENT_LOCATOR_KEY_ABSOLUTE_PATH))))
+            {
+                /* The relative path is preferred as it survives moving the image chain. */
+                PRTUTF16 pwszPath = (PRTUTF16)RTMemTmpAlloc(cwcValue * sizeof(RTUTF16));
+                if (pwszPath)
+                {
+                    char *pszPath = NULL;
+
+                    for (size_t idx = 0; idx < cwcValue; idx++)
+                        pwszPath[idx] = RT_LE2H_U16(pwszValue[idx]);
+
+                    rc = RTUtf16ToUtf8Ex(pwszPath, cwcValue, &pszPath, 0, NULL);
+                    if (RT_SUCCESS(rc))
+                    {
+                        if (pImage->pszParentFilename)
+                            RTStrFree(pImage->pszParentFilename);
+                        pImage->pszParentFilename = pszPath;
+                    }
+                    RTMemTmpFree(pwszPath);
+                }
+                else
+                    rc = VERR_NO_MEMORY;
+            }
+            /* Other keys (volume paths) are not used. */
+        }
+
+        if (   RT_SUCCESS(rc)
+            && !pImage->offParentLinkage)
+            rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                           "VHDX: Parent locator of image \'%s\' lacks the parent linkage",
+                           pImage->pszFilename);
+    }
+    else
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS,
+                       "VHDX: Reading the parent locator metadata item from image \'%s\' failed",
+                       pImage->pszFilename);
+
+    RTMemTmpFree(pbItem);
+
+    LogFlowFunc(("returns rc=%Rrc\n", rc));
+    return rc;
+}
+
 /**
  * Loads the metadata region.
  *
@@ -1503,9 +2197,8 @@ static int vhdxLoadMetadataRegion(PVHDXIMAGE pImage, uint64_t offRegion,
                     }
                     case VHDXMETADATAITEM_PARENT_LOCATOR:
                     {
-                        rc = vdIfError(pImage->pIfError, VERR_NOT_SUPPORTED, RT_SRC_POS,
-                                       "VHDX: Image \'%s\' is a differencing image which is not supported yet",
-                                       pImage->pszFilename);
+                        rc = vhdxLoadParentLocatorMetadata(pImage, offMetadataItem,
+                                                           MetadataTblEntry.u32Length);
                         break;
                     }
                     case VHDXMETADATAITEM_UNKNOWN:
@@ -1663,6 +2356,108 @@ static int vhdxLoadRegionTable(PVHDXIMAGE pImage)
     return rc;
 }
 
+/**
+ * Fetches the part of the sector bitmap covering the given payload block
+ * of a differencing image.
+ *
+ * @returns VBox status code.
+ * @retval  VERR_VD_NOT_ENOUGH_METADATA if the bitmap is still being read.
+ * @param   pImage    Image instance data.
+ * @param   pIoCtx    The I/O context requiring the bitmap.
+ * @param   idxBlock  The payload block index.
+ */
+static int vhdxSectorBitmapFetch(PVHDXIMAGE pImage, PVDIOCTX pIoCtx, uint32_t idxBlock)
+{
+    int rc = VINF_SUCCESS;
+
+    if (pImage->idxBlockBitmap != idxBlock)
+    {
+        size_t   cbBitmap = pImage->cbBlock / pImage->cbLogicalSector / 8;
+        uint32_t idxBatSb = (idxBlock / pImage->uChunkRatio) * (pImage->uChunkRatio + 1) + pImage->uChunkRatio;
+        uint64_t uBatEntrySb = pImage->paBat[idxBatSb].u64BatEntry;
+
+        Assert(idxBatSb < pImage->cBatEntries);
+
+        if (VHDX_BAT_ENTRY_GET_STATE(uBatEntrySb) == VHDX_BAT_ENTRY_SB_BLOCK_PRESENT)
+        {
+            PVDMETAXFER pMetaXfer;
+            uint64_t offBitmap =   VHDX_BAT_ENTRY_GET_FILE_OFFSET(uBatEntrySb)
+                                 + (idxBlock % pImage->uChunkRatio) * cbBitmap;
+
+            rc = vdIfIoIntFileReadMeta(pImage->pIfIo, pImage->pStorage, offBitmap,
+                                       pImage->pbSectorBitmap, cbBitmap, pIoCtx,
+                                       &pMetaXfer, NULL, NULL);
+            if (RT_SUCCESS(rc))
+                vdIfIoIntMetaXferRelease(pImage->pIfIo, pMetaXfer);
+        }
+        else
+            memset(pImage->pbSectorBitmap, 0, cbBitmap); /* Nothing present in this image. */
+
+        if (RT_SUCCESS(rc))
+            pImage->idxBlockBitmap = idxBlock;
+    }
+
+    return rc;
+}
+
+/**
+ * Block allocation flush completion callback, updates the BAT entry of the
+ * block after the data reached the disk.
+ */
+static DECLCALLBACK(int) vhdxBlockAllocBatUpdate(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    int rc = VINF_SUCCESS;
+    PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
+    PVHDXBLOCKALLOC pBlockAlloc = (PVHDXBLOCKALLOC)pvUser;
+
+    if (RT_SUCCESS(rcReq))
+    {
+        uint64_t u64BatEntry = pBlockAlloc->offBlock | VHDX_BAT_ENTRY_PAYLOAD_BLOCK_FULLY_PRESENT;
+
+        pImage->paBat[pBlockAlloc->idxBat].u64BatEntry = u64BatEntry;
+
+        u64BatEntry = RT_H2LE_U64(u64BatEntry);
+        rc = vdIfIoIntFileWriteMeta(pImage->pIfIo, pImage->pStorage,
+                                    pImage->offBat + pBlockAlloc->idxBat * sizeof(VhdxBatEntry),
+                                    &u64BatEntry, sizeof(u64BatEntry), pIoCtx, NULL, NULL);
+        AssertMsg(RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS,
+                  ("vhdxBlockAllocBatUpdate failed to update BAT entry %u, filename=\"%s\", rc=%Rrc\n",
+                   pBlockAlloc->idxBat, pImage->pszFilename, rc));
+    }
+    /* else: I/O error don't update the BAT. */
+
+    RTMemFree(pBlockAlloc);
+    return rc;
+}
+
+/**
+ * Block allocation completion callback, flushes the image after the data was
+ * written so the BAT entry can't reach the disk before the data it refers to.
+ */
+static DECLCALLBACK(int) vhdxBlockAllocUpdate(void *pBackendData, PVDIOCTX pIoCtx, void *pvUser, int rcReq)
+{
+    PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
+    PVHDXBLOCKALLOC pBlockAlloc = (PVHDXBLOCKALLOC)pvUser;
+
+    if (RT_FAILURE(rcReq))
+    {
+        /* I/O error, don't update the BAT. */
+        RTMemFree(pBlockAlloc);
+        return VINF_SUCCESS;
+    }
+
+    int rc = vdIfIoIntFileFlush(pImage->pIfIo, pImage->pStorage, pIoCtx,
+                                vhdxBlockAllocBatUpdate, pBlockAlloc);
+    if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+    {
+        int rc2 = vhdxBlockAllocBatUpdate(pImage, pIoCtx, pBlockAlloc, rc);
+        if (RT_SUCCESS(rc))
+            rc = rc2;
+    }
+
+    return rc;
+}
+
 /**
  * Internal: Open an image, constructing all necessary data structures.
  */
@@ -1679,9 +2474,7 @@ static int vhdxOpenImage(PVHDXIMAGE pImage, unsigned uOpenFlags)
     pImage->pIfIo = VDIfIoIntGet(pImage->pVDIfsImage);
     AssertPtrReturn(pImage->pIfIo, VERR_INVALID_PARAMETER);
 
-    /* Refuse write access, it is not implemented so far. */
-    if (!(uOpenFlags & VD_OPEN_FLAGS_READONLY))
-        return VERR_NOT_SUPPORTED;
+    pImage->idxBlockBitmap = UINT32_MAX;
 
     /*
      * Open the image.
@@ -1711,6 +2504,10 @@ static int vhdxOpenImage(PVHDXIMAGE pImage, unsigned uOpenFlags)
                 else
                     rc = vhdxFindAndLoadCurrentHeader(pImage);
 
+                /* The log must be replayed before any other metadata is read. */
+                if (RT_SUCCESS(rc))
+                    rc = vhdxLogReplay(pImage);
+
                 /* Load the region table. */
                 if (RT_SUCCESS(rc))
                     rc = vhdxLoadRegionTable(pImage);
@@ -1720,6 +2517,42 @@ static int vhdxOpenImage(PVHDXIMAGE pImage, unsigned uOpenFlags)
             rc = VERR_VD_GEN_INVALID_HEADER;
     }
 
+    if (   RT_SUCCESS(rc)
+        && (pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF))
+    {
+        if (!pImage->offParentLinkage)
+            rc = vdIfError(pImage->pIfError, VERR_VD_GEN_INVALID_HEADER, RT_SRC_POS,
+                           "VHDX: Differencing image \'%s\' has no parent locator",
+                           pImage->pszFilename);
+        else
+        {
+            /* Buffer for the sector bitmap part of a single payload block. */
+            pImage->pbSectorBitmap = (uint8_t *)RTMemAllocZ(pImage->cbBlock / pImage->cbLogicalSector / 8);
+            if (!pImage->pbSectorBitmap)
+                rc = VERR_NO_MEMORY;
+        }
+    }
+
+    if (   RT_SUCCESS(rc)
+        && !(uOpenFlags & VD_OPEN_FLAGS_READONLY))
+    {
+        /* New blocks are appended to the end of the file, the log might have extended it. */
+        rc = vdIfIoIntFileGetSize(pImage->pIfIo, pImage->pStorage, &cbFile);
+        if (RT_SUCCESS(rc))
+        {
+            pImage->offBlockNext = RT_ALIGN_64(cbFile, _1M);
+
+            /*
+             * The file write UUID must change before the file is modified the first time
+             * after opening it. The data write UUID identifies the image (and is
+             * referenced by differencing images), it is only changed through vhdxSetUuid.
+             */
+            rc = RTUuidCreate(&pImage->Hdr.UuidFileWrite);
+            if (RT_SUCCESS(rc))
+                rc = vhdxUpdateHeader(pImage);
+        }
+    }
+
     if (RT_FAILURE(rc))
         vhdxFreeImage(pImage, false);
 
@@ -1896,12 +2729,10 @@ static int vhdxRead(void *pBackendData, uint64_t uOffset, size_t cbToRead,
         rc = VERR_INVALID_PARAMETER;
     else
     {
-        uint32_t idxBat = (uint32_t)(uOffset / pImage->cbBlock); Assert(idxBat == uOffset / pImage->cbBlock);
+        uint32_t idxBlock = (uint32_t)(uOffset / pImage->cbBlock); Assert(idxBlock == uOffset / pImage->cbBlock);
+        uint32_t idxBat = idxBlock + idxBlock / pImage->uChunkRatio; /* Add interleaving sector bitmap entries. */
         uint32_t offRead = uOffset % pImage->cbBlock;
-        uint64_t uBatEntry;
-
-        idxBat += idxBat / pImage->uChunkRatio; /* Add interleaving sector bitmap entries. */
-        uBatEntry = pImage->paBat[idxBat].u64BatEntry;
+        uint64_t uBatEntry = pImage->paBat[idxBat].u64BatEntry;
 
         cbToRead = RT_MIN(cbToRead, pImage->cbBlock - offRead);
 
@@ -1909,6 +2740,14 @@ static int vhdxRead(void *pBackendData, uint64_t uOffset, size_t cbToRead,
         {
             case VHDX_BAT_ENTRY_PAYLOAD_BLOCK_NOT_PRESENT:
             case VHDX_BAT_ENTRY_PAYLOAD_BLOCK_UNDEFINED:
+            {
+                /* The parent defines the content for differencing images. */
+                if (pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF)
+                    rc = VERR_VD_BLOCK_FREE;
+                else
+                    vdIfIoIntIoCtxSet(pImage->pIfIo, pIoCtx, 0, cbToRead);
+                break;
+            }
             case VHDX_BAT_ENTRY_PAYLOAD_BLOCK_ZERO:
             case VHDX_BAT_ENTRY_PAYLOAD_BLOCK_UNMAPPED:
             {
@@ -1923,6 +2762,35 @@ static int vhdxRead(void *pBackendData, uint64_t uOffset, size_t cbToRead,
                 break;
             }
             case VHDX_BAT_ENTRY_PAYLOAD_BLOCK_PARTIALLY_PRESENT:
+            {
+                /*
+                 * Only possible for differencing images, the sector bitmap tells which
+                 * sectors are stored in this image. Read as much as possible with the
+                 * same state and let the parent deliver the rest.
+                 */
+                rc = vhdxSectorBitmapFetch(pImage, pIoCtx, idxBlock);
+                if (RT_SUCCESS(rc))
+                {
+                    uint32_t iSector = offRead / pImage->cbLogicalSector;
+                    uint32_t iSectorEnd = iSector + 1;
+                    uint32_t cSectorsBlock = (uint32_t)(pImage->cbBlock / pImage->cbLogicalSector);
+                    bool fPresent = ASMBitTest(pImage->pbSectorBitmap, iSector);
+
+                    while (   iSectorEnd < cSectorsBlock
+                           && (uint64_t)iSectorEnd * pImage->cbLogicalSector < offRead + cbToRead
+                           && ASMBitTest(pImage->pbSectorBitmap, iSectorEnd) == fPresent)
+                        iSectorEnd++;
+
+                    cbToRead = RT_MIN(cbToRead, (size_t)iSectorEnd * pImage->cbLogicalSector - offRead);
+                    if (fPresent)
+                        rc = vdIfIoIntFileReadUser(pImage->pIfIo, pImage->pStorage,
+                                                   VHDX_BAT_ENTRY_GET_FILE_OFFSET(uBatEntry) + offRead,
+                                                   pIoCtx, cbToRead);
+                    else
+                        rc = VERR_VD_BLOCK_FREE;
+                }
+                break;
+            }
             default:
                 rc = VERR_INVALID_PARAMETER;
                 break;
@@ -1950,13 +2818,85 @@ static int vhdxWrite(void *pBackendData, uint64_t uOffset,  size_t cbToWrite,
     Assert(uOffset % 512 == 0);
     Assert(cbToWrite % 512 == 0);
 
+    /*
+     * No size check for the end of the write here, the last block of images which
+     * are not a multiple of the block size is filled up to the block size when allocated.
+     */
     if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
         rc = VERR_VD_IMAGE_READ_ONLY;
-    else if (   uOffset + cbToWrite > pImage->cbSize
+    else if (   uOffset >= pImage->cbSize
              || cbToWrite == 0)
         rc = VERR_INVALID_PARAMETER;
     else
-        rc = VERR_NOT_SUPPORTED;
+    {
+        uint32_t idxBlock = (uint32_t)(uOffset / pImage->cbBlock); Assert(idxBlock == uOffset / pImage->cbBlock);
+        uint32_t idxBat = idxBlock + idxBlock / pImage->uChunkRatio; /* Add interleaving sector bitmap entries. */
+        uint32_t offWrite = uOffset % pImage->cbBlock;
+        uint64_t uBatEntry = pImage->paBat[idxBat].u64BatEntry;
+        unsigned uState = VHDX_BAT_ENTRY_GET_STATE(uBatEntry);
+
+        cbToWrite = RT_MIN(cbToWrite, pImage->cbBlock - offWrite);
+
+        if (uState == VHDX_BAT_ENTRY_PAYLOAD_BLOCK_FULLY_PRESENT)
+        {
+            /* Block present in image file, write relevant data. */
+            rc = vdIfIoIntFileWriteUser(pImage->pIfIo, pImage->pStorage,
+                                        VHDX_BAT_ENTRY_GET_FILE_OFFSET(uBatEntry) + offWrite,
+                                        pIoCtx, cbToWrite, NULL, NULL);
+        }
+        else if (   cbToWrite == pImage->cbBlock
+                 && (   !(fWrite & VD_WRITE_NO_ALLOC)
+                     || uState == VHDX_BAT_ENTRY_PAYLOAD_BLOCK_PARTIALLY_PRESENT))
+        {
+            /*
+             * Full block write to a block which is not fully present. Partially present
+             * blocks already have space assigned which is reused, other blocks are
+             * appended to the file. The BAT entry is updated once the data was written.
+             */
+            PVHDXBLOCKALLOC pBlockAlloc = (PVHDXBLOCKALLOC)RTMemAllocZ(sizeof(VHDXBLOCKALLOC));
+            if (pBlockAlloc)
+            {
+                pBlockAlloc->idxBat = idxBat;
+                if (uState == VHDX_BAT_ENTRY_PAYLOAD_BLOCK_PARTIALLY_PRESENT)
+                    pBlockAlloc->offBlock = VHDX_BAT_ENTRY_GET_FILE_OFFSET(uBatEntry);
+                else
+                {
+                    pBlockAlloc->offBlock = pImage->offBlockNext;
+                    pImage->offBlockNext += pImage->cbBlock;
+                }
+
+                *pcbPreRead = 0;
+                *pcbPostRead = 0;
+
+                rc = vdIfIoIntFileWriteUser(pImage->pIfIo, pImage->pStorage,
+                                            pBlockAlloc->offBlock, pIoCtx, cbToWrite,
+                                            vhdxBlockAllocUpdate, pBlockAlloc);
+                if (rc != VERR_VD_ASYNC_IO_IN_PROGRESS)
+                {
+                    if (RT_SUCCESS(rc))
+                        rc = vhdxBlockAllocUpdate(pImage, pIoCtx, pBlockAlloc, rc);
+                    else
+                        RTMemFree(pBlockAlloc);
+                }
+            }
+            else
+                rc = VERR_NO_MEMORY;
+        }
+        else
+        {
+            /*
+             * Trying to do a partial write to a block which is not fully present. Let the
+             * upper layer assemble the full block, it reads the missing parts through
+             * vhdxRead first which takes care of zero and partially present blocks.
+             */
+            *pcbPreRead = offWrite;
+            *pcbPostRead = pImage->cbBlock - cbToWrite - offWrite;
+            rc = VERR_VD_BLOCK_FREE;
+        }
+
+        if (pcbWriteProcess)
+            *pcbWriteProcess = cbToWrite;
+    }
 
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
@@ -1972,7 +2912,13 @@ static int vhdxFlush(void *pBackendData, PVDIOCTX pIoCtx)
     if (pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY)
         rc = VERR_VD_IMAGE_READ_ONLY;
     else
-        rc = VERR_NOT_SUPPORTED;
+    {
+        rc = VINF_SUCCESS;
+        if (pImage->fHdrDirty)
+            rc = vhdxUpdateHeaderAsync(pImage, pIoCtx);
+        if (RT_SUCCESS(rc) || rc == VERR_VD_ASYNC_IO_IN_PROGRESS)
+            rc = vdIfIoIntFileFlush(pImage->pIfIo, pImage->pStorage, pIoCtx, NULL, NULL);
+    }
 
     LogFlowFunc(("returns %Rrc\n", rc));
     return rc;
@@ -2257,7 +3203,10 @@ static int vhdxGetUuid(void *pBackendData, PRTUUID pUuid)
     AssertPtr(pImage);
 
     if (pImage)
-        rc = VERR_NOT_SUPPORTED;
+    {
+        *pUuid = pImage->Hdr.UuidDataWrite;
+        rc = VINF_SUCCESS;
+    }
     else
         rc = VERR_VD_NOT_OPENED;
 
@@ -2278,7 +3227,11 @@ static int vhdxSetUuid(void *pBackendData, PCRTUUID pUuid)
     if (pImage)
     {
         if (!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
-            rc = VERR_NOT_SUPPORTED;
+        {
+            pImage->Hdr.UuidDataWrite = *pUuid;
+            pImage->fHdrDirty = true;
+            rc = VINF_SUCCESS;
+        }
         else
             rc = VERR_VD_IMAGE_READ_ONLY;
     }
@@ -2299,7 +3252,10 @@ static int vhdxGetModificationUuid(void *pBackendData, PRTUUID pUuid)
     AssertPtr(pImage);
 
     if (pImage)
-        rc = VERR_NOT_SUPPORTED;
+    {
+        *pUuid = pImage->Hdr.UuidFileWrite;
+        rc = VINF_SUCCESS;
+    }
     else
         rc = VERR_VD_NOT_OPENED;
 
@@ -2319,7 +3275,11 @@ static int vhdxSetModificationUuid(void *pBackendData, PCRTUUID pUuid)
     if (pImage)
     {
         if (!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
-            rc = VERR_NOT_SUPPORTED;
+        {
+            pImage->Hdr.UuidFileWrite = *pUuid;
+            pImage->fHdrDirty = true;
+            rc = VINF_SUCCESS;
+        }
         else
             rc = VERR_VD_IMAGE_READ_ONLY;
     }
@@ -2340,7 +3300,15 @@ static int vhdxGetParentUuid(void *pBackendData, PRTUUID pUuid)
     AssertPtr(pImage);
 
     if (pImage)
-        rc = VERR_NOT_SUPPORTED;
+    {
+        if (pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF)
+        {
+            *pUuid = pImage->UuidParent;
+            rc = VINF_SUCCESS;
+        }
+        else
+            rc = VERR_NOT_SUPPORTED;
+    }
     else
         rc = VERR_VD_NOT_OPENED;
 
@@ -2360,7 +3328,16 @@ static int vhdxSetParentUuid(void *pBackendData, PCRTUUID pUuid)
     if (pImage)
     {
         if (!(pImage->uOpenFlags & VD_OPEN_FLAGS_READONLY))
-            rc = VERR_NOT_SUPPORTED;
+        {
+            if (pImage->uImageFlags & VD_IMAGE_FLAGS_DIFF)
+            {
+                pImage->UuidParent = *pUuid;
+                pImage->fParentLinkageDirty = true;
+                rc = VINF_SUCCESS;
+            }
+            else
+                rc = VERR_NOT_SUPPORTED;
+        }
         else
             rc = VERR_VD_IMAGE_READ_ONLY;
     }
@@ -2412,6 +3389,33 @@ static int vhdxSetParentModificationUuid(void *pBackendData, PCRTUUID pUuid)
     return rc;
 }
 
+/** @copydoc VBOXHDDBACKEND::pfnGetParentFilename */
+static int vhdxGetParentFilename(void *pBackendData, char **ppszParentFilename)
+{
+    LogFlowFunc(("pBackendData=%#p ppszParentFilename=%#p\n", pBackendData, ppszParentFilename));
+    PVHDXIMAGE pImage = (PVHDXIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+
+    AssertPtr(pImage);
+
+    if (pImage)
+    {
+        if (pImage->pszParentFilename)
+        {
+            *ppszParentFilename = RTStrDup(pImage->pszParentFilename);
+            if (!*ppszParentFilename)
+                rc = VERR_NO_MEMORY;
+        }
+        else
+            rc = VERR_NOT_SUPPORTED;
+    }
+    else
+        rc = VERR_VD_NOT_OPENED;
+
+    LogFlowFunc(("returns %Rrc\n", rc));
+    return rc;
+}
+
 /** @copydoc VBOXHDDBACKEND::pfnDump */
 static void vhdxDump(void *pBackendData)
 {
@@ -2511,7 +3515,7 @@ VBOXHDDBACKEND g_VhdxBackend =
     /* pfnSetParentTimeStamp */
     NULL,
     /* pfnGetParentFilename */
-    NULL,
+    vhdxGetParentFilename,
     /* pfnSetParentFilename */
     NULL,
     /* pfnComposeLocation */
@@ -2523,5 +3527,9 @@ VBOXHDDBACKEND g_VhdxBackend =
     /* pfnResize */
     NULL,
     /* pfnRepair */
+    NULL,
+    /* pfnQueryAllocatedRanges */
+    NULL,
+    /* pfnDefragment */
     NULL
 };
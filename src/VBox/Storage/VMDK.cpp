@@ -31,6 +31,9 @@
 #include <iprt/rand.h>
 #include <iprt/zip.h>
 #include <iprt/asm.h>
+#include <iprt/mp.h>
+#include <iprt/semaphore.h>
+#include <iprt/thread.h>
 
 /*******************************************************************************
 *   Constants And Macros, Structures and Typedefs                              *
@@ -339,6 +342,17 @@ typedef struct VMDKEXTENT
  */
 #define VMDK_GT_CACHELINE_SIZE 128
 
+/**
+ * Maximum number of threads compressing or decompressing grains in parallel
+ * when sequentially writing or reading a streamOptimized image.
+ */
+#define VMDK_ZIP_THREADS_MAX 8
+
+/**
+ * Number of grains which can be queued for (de)compression per thread.
+ */
+#define VMDK_ZIP_JOBS_PER_THREAD 4
+
 
 /**
  * Maximum number of lines in a descriptor file. Not worth the effort of
@@ -401,6 +415,82 @@ typedef struct VMDKGTCACHE
     unsigned            cEntries;
 } VMDKGTCACHE, *PVMDKGTCACHE;
 
+/** Compression job states. */
+#define VMDKZIPJOB_STATE_FREE       0
+#define VMDKZIPJOB_STATE_PENDING    1
+#define VMDKZIPJOB_STATE_BUSY       2
+#define VMDKZIPJOB_STATE_DONE       3
+
+/**
+ * A single grain queued for compression when writing a streamOptimized image
+ * or for decompression when reading one sequentially.
+ */
+typedef struct VMDKZIPJOB
+{
+    /** Job state (VMDKZIPJOB_STATE_*). */
+    volatile uint32_t   uState;
+    /** Status code of the (de)compression. */
+    int                 rc;
+    /** Logical sector of the grain (from/for the marker). */
+    uint64_t            uLBA;
+    /** Grain table cache line of the grain (compression only). */
+    uint32_t            uCacheLine;
+    /** Grain table cache entry of the grain (compression only). */
+    uint32_t            uCacheEntry;
+    /** Size of the compressed data including the marker, when compressing
+     * also including the padding. */
+    uint32_t            cbCompGrain;
+    /** Uncompressed grain data. */
+    void               *pvGrain;
+    /** Compressed grain including the marker. */
+    void               *pvCompGrain;
+} VMDKZIPJOB, *PVMDKZIPJOB;
+
+/**
+ * Compression pipeline for streamOptimized images. Grains are (de)compressed
+ * by a set of worker threads, but written or handed out in stream order by
+ * the thread doing the image I/O, so the result is identical to serial
+ * processing and the image file is still accessed strictly sequentially.
+ */
+typedef struct VMDKZIPPIPE
+{
+    /** Flag whether this pipeline decompresses grains read from the image. */
+    bool                fInflate;
+    /** Size of an uncompressed grain. */
+    size_t              cbGrain;
+    /** Size of the compressed grain buffers. */
+    size_t              cbCompGrainMax;
+    /** Number of jobs in the ring. */
+    unsigned            cJobs;
+    /** The job ring. */
+    PVMDKZIPJOB         paJobs;
+    /** Index of the next job to submit. */
+    unsigned            iJobSubmit;
+    /** Index of the oldest queued job, i.e. the next to write out or hand out. */
+    volatile uint32_t   iJobWrite;
+    /** Number of submitted jobs which are not written/handed out yet. */
+    unsigned            cJobsQueued;
+    /** Event signalled when a job was submitted or on shutdown. */
+    RTSEMEVENT          hEvtWork;
+    /** Event signalled when a job was completed. */
+    RTSEMEVENT          hEvtDone;
+    /** Flag whether the workers should terminate. */
+    volatile bool       fShutdown;
+    /** Number of worker threads. */
+    unsigned            cThreads;
+    /** Worker threads. */
+    RTTHREAD            ahThreads[VMDK_ZIP_THREADS_MAX];
+    /** Buffer memory of all jobs. */
+    void               *pvBuffers;
+    /** Decompression only: sector of the next marker to read. */
+    uint32_t            uStreamSectorAbs;
+    /** Decompression only: flag whether the read ahead hit the end of the
+     * stream or an error. */
+    bool                fStreamEnd;
+    /** Decompression only: status of the read ahead. */
+    int                 rcStream;
+} VMDKZIPPIPE, *PVMDKZIPPIPE;
+
 /**
  * Complete VMDK image data structure. Mainly a collection of extents and a few
  * extra global data fields.
@@ -468,6 +558,10 @@ typedef struct VMDKIMAGE
     size_t          cbDescAlloc;
     /** Parsed descriptor file content. */
     VMDKDESCRIPTOR  Descriptor;
+
+    /** Parallel compression pipeline when creating or sequentially reading
+     * a streamOptimized image, NULL if grains are processed synchronously. */
+    PVMDKZIPPIPE pZipPipe;
 } VMDKIMAGE;
 
 
@@ -671,6 +765,42 @@ static DECLCALLBACK(int) vmdkFileInflateHelper(void *pvUser, void *pvBuf, size_t
 }
 #endif
 
+/**
+ * Internal: inflate a compressed grain (including the marker) into the
+ * given buffer. Does not depend on any image state, so it can be called
+ * from the decompression worker threads.
+ */
+static int vmdkInflateGrain(const void *pvCompGrain, size_t cbCompGrain,
+                            void *pvBuf, size_t cbToRead)
+{
+    int rc;
+    size_t cbActuallyRead;
+
+#ifdef VMDK_USE_BLOCK_DECOMP_API
+    rc = RTZipBlockDecompress(RTZIPTYPE_ZLIB, 0 /*fFlags*/,
+                              pvCompGrain, cbCompGrain, NULL,
+                              pvBuf, cbToRead, &cbActuallyRead);
+#else
+    PRTZIPDECOMP pZip = NULL;
+    VMDKCOMPRESSIO InflateState;
+    InflateState.pImage = NULL;
+    InflateState.iOffset = -1;
+    InflateState.cbCompGrain = cbCompGrain;
+    InflateState.pvCompGrain = (void *)pvCompGrain;
+
+    rc = RTZipDecompCreate(&pZip, &InflateState, vmdkFileInflateHelper);
+    if (RT_FAILURE(rc))
+        return rc;
+    rc = RTZipDecompress(pZip, pvBuf, cbToRead, &cbActuallyRead);
+    RTZipDecompDestroy(pZip);
+#endif /* !VMDK_USE_BLOCK_DECOMP_API */
+    if (RT_FAILURE(rc))
+        return rc;
+    if (cbActuallyRead != cbToRead)
+        rc = VERR_VD_VMDK_INVALID_FORMAT;
+    return rc;
+}
+
 /**
  * Internal: read from a file and inflate the compressed data,
  * distinguishing between async and normal operation
@@ -681,11 +811,8 @@ DECLINLINE(int) vmdkFileInflateSync(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
                                     uint64_t *puLBA, uint32_t *pcbMarkerData)
 {
     int rc;
-#ifndef VMDK_USE_BLOCK_DECOMP_API
-    PRTZIPDECOMP pZip = NULL;
-#endif
     VMDKMARKER *pMarker = (VMDKMARKER *)pExtent->pvCompGrain;
-    size_t cbCompSize, cbActuallyRead;
+    size_t cbCompSize;
 
     if (!pcvMarker)
     {
@@ -731,31 +858,11 @@ DECLINLINE(int) vmdkFileInflateSync(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
                                   + RT_OFFSETOF(VMDKMARKER, uType),
                                   512);
 
-#ifdef VMDK_USE_BLOCK_DECOMP_API
-    rc = RTZipBlockDecompress(RTZIPTYPE_ZLIB, 0 /*fFlags*/,
-                              pExtent->pvCompGrain, cbCompSize + RT_OFFSETOF(VMDKMARKER, uType), NULL,
-                              pvBuf, cbToRead, &cbActuallyRead);
-#else
-    VMDKCOMPRESSIO InflateState;
-    InflateState.pImage = pImage;
-    InflateState.iOffset = -1;
-    InflateState.cbCompGrain = cbCompSize + RT_OFFSETOF(VMDKMARKER, uType);
-    InflateState.pvCompGrain = pExtent->pvCompGrain;
-
-    rc = RTZipDecompCreate(&pZip, &InflateState, vmdkFileInflateHelper);
-    if (RT_FAILURE(rc))
-        return rc;
-    rc = RTZipDecompress(pZip, pvBuf, cbToRead, &cbActuallyRead);
-    RTZipDecompDestroy(pZip);
-#endif /* !VMDK_USE_BLOCK_DECOMP_API */
-    if (RT_FAILURE(rc))
-    {
-        if (rc == VERR_ZIP_CORRUPTED)
-            rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VMDK: Compressed image is corrupted '%s'"), pExtent->pszFullname);
-        return rc;
-    }
-    if (cbActuallyRead != cbToRead)
-        rc = VERR_VD_VMDK_INVALID_FORMAT;
+    rc = vmdkInflateGrain(pExtent->pvCompGrain,
+                          cbCompSize + RT_OFFSETOF(VMDKMARKER, uType),
+                          pvBuf, cbToRead);
+    if (rc == VERR_ZIP_CORRUPTED)
+        rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VMDK: Compressed image is corrupted '%s'"), pExtent->pszFullname);
     return rc;
 }
 
@@ -781,22 +888,22 @@ static DECLCALLBACK(int) vmdkFileDeflateHelper(void *pvUser, const void *pvBuf,
 }
 
 /**
- * Internal: deflate the uncompressed data and write to a file,
- * distinguishing between async and normal operation
+ * Internal: deflate the uncompressed data into the given buffer and prepend
+ * the compressed grain marker. Does not depend on any image state, so it
+ * can be called from the compression worker threads.
  */
-DECLINLINE(int) vmdkFileDeflateSync(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
-                                    uint64_t uOffset, const void *pvBuf,
-                                    size_t cbToWrite, uint64_t uLBA,
-                                    uint32_t *pcbMarkerData)
+static int vmdkDeflateGrain(void *pvCompGrain, size_t cbCompGrain,
+                            const void *pvBuf, size_t cbToWrite,
+                            uint64_t uLBA, uint32_t *pcbMarkerData)
 {
     int rc;
     PRTZIPCOMP pZip = NULL;
     VMDKCOMPRESSIO DeflateState;
 
-    DeflateState.pImage = pImage;
+    DeflateState.pImage = NULL;
     DeflateState.iOffset = -1;
-    DeflateState.cbCompGrain = pExtent->cbCompGrain;
-    DeflateState.pvCompGrain = pExtent->pvCompGrain;
+    DeflateState.cbCompGrain = cbCompGrain;
+    DeflateState.pvCompGrain = pvCompGrain;
 
     rc = RTZipCompCreate(&pZip, &DeflateState, vmdkFileDeflateHelper,
                          RTZIPTYPE_ZLIB, RTZIPLEVEL_DEFAULT);
@@ -816,7 +923,7 @@ DECLINLINE(int) vmdkFileDeflateSync(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
         if (uSize % 512)
         {
             uint32_t uSizeAlign = RT_ALIGN(uSize, 512);
-            memset((uint8_t *)pExtent->pvCompGrain + uSize, '\0',
+            memset((uint8_t *)pvCompGrain + uSize, '\0',
                    uSizeAlign - uSize);
             uSize = uSizeAlign;
         }
@@ -825,18 +932,495 @@ DECLINLINE(int) vmdkFileDeflateSync(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
             *pcbMarkerData = uSize;
 
         /* Compressed grain marker. Data follows immediately. */
-        VMDKMARKER *pMarker = (VMDKMARKER *)pExtent->pvCompGrain;
+        VMDKMARKER *pMarker = (VMDKMARKER *)pvCompGrain;
         pMarker->uSector = RT_H2LE_U64(uLBA);
         pMarker->cbSize = RT_H2LE_U32(  DeflateState.iOffset
                                       - RT_OFFSETOF(VMDKMARKER, uType));
+    }
+    return rc;
+}
+
+/**
+ * Internal: deflate the uncompressed data and write to a file,
+ * distinguishing between async and normal operation
+ */
+DECLINLINE(int) vmdkFileDeflateSync(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
+                                    uint64_t uOffset, const void *pvBuf,
+                                    size_t cbToWrite, uint64_t uLBA,
+                                    uint32_t *pcbMarkerData)
+{
+    uint32_t cbMarkerData = 0;
+    int rc = vmdkDeflateGrain(pExtent->pvCompGrain, pExtent->cbCompGrain,
+                              pvBuf, cbToWrite, uLBA, &cbMarkerData);
+    if (RT_SUCCESS(rc))
+    {
+        if (pcbMarkerData)
+            *pcbMarkerData = cbMarkerData;
         rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pExtent->pFile->pStorage,
-                                    uOffset, pMarker, uSize);
+                                    uOffset, pExtent->pvCompGrain, cbMarkerData);
+    }
+    return rc;
+}
+
+
+/**
+ * Internal: claim the oldest grain waiting for compression, if any.
+ */
+static PVMDKZIPJOB vmdkZipPipeClaimJob(PVMDKZIPPIPE pPipe)
+{
+    uint32_t iJob = ASMAtomicReadU32(&pPipe->iJobWrite);
+    for (unsigned i = 0; i < pPipe->cJobs; i++)
+    {
+        PVMDKZIPJOB pJob = &pPipe->paJobs[(iJob + i) % pPipe->cJobs];
+        if (ASMAtomicCmpXchgU32(&pJob->uState, VMDKZIPJOB_STATE_BUSY,
+                                VMDKZIPJOB_STATE_PENDING))
+            return pJob;
+    }
+    return NULL;
+}
+
+/**
+ * Internal: (de)compression worker thread for streamOptimized images.
+ */
+static DECLCALLBACK(int) vmdkZipPipeWorker(RTTHREAD hThread, void *pvUser)
+{
+    PVMDKZIPPIPE pPipe = (PVMDKZIPPIPE)pvUser;
+
+    NOREF(hThread);
+    while (!ASMAtomicReadBool(&pPipe->fShutdown))
+    {
+        PVMDKZIPJOB pJob = vmdkZipPipeClaimJob(pPipe);
+        if (!pJob)
+        {
+            RTSemEventWait(pPipe->hEvtWork, RT_INDEFINITE_WAIT);
+            continue;
+        }
+
+        /* The work event is auto reset, pass it on in case there is more. */
+        RTSemEventSignal(pPipe->hEvtWork);
+
+        if (pPipe->fInflate)
+            pJob->rc = vmdkInflateGrain(pJob->pvCompGrain, pJob->cbCompGrain,
+                                        pJob->pvGrain, pPipe->cbGrain);
+        else
+        {
+            uint32_t cbCompGrain = 0;
+            pJob->rc = vmdkDeflateGrain(pJob->pvCompGrain, pPipe->cbCompGrainMax,
+                                        pJob->pvGrain, pPipe->cbGrain, pJob->uLBA,
+                                        &cbCompGrain);
+            pJob->cbCompGrain = cbCompGrain;
+        }
+        ASMAtomicWriteU32(&pJob->uState, VMDKZIPJOB_STATE_DONE);
+        RTSemEventSignal(pPipe->hEvtDone);
+    }
+
+    /* Wake up the next worker so that it sees the shutdown request. */
+    RTSemEventSignal(pPipe->hEvtWork);
+    return VINF_SUCCESS;
+}
+
+/**
+ * Internal: stop the compression threads and free the pipeline. Grains
+ * which are not written or handed out yet are discarded.
+ */
+static void vmdkZipPipeDestroy(PVMDKIMAGE pImage)
+{
+    PVMDKZIPPIPE pPipe = pImage->pZipPipe;
+
+    if (!pPipe)
+        return;
+
+    ASMAtomicWriteBool(&pPipe->fShutdown, true);
+    if (pPipe->hEvtWork != NIL_RTSEMEVENT)
+        RTSemEventSignal(pPipe->hEvtWork);
+    for (unsigned i = 0; i < pPipe->cThreads; i++)
+        RTThreadWait(pPipe->ahThreads[i], RT_INDEFINITE_WAIT, NULL);
+    if (pPipe->hEvtWork != NIL_RTSEMEVENT)
+        RTSemEventDestroy(pPipe->hEvtWork);
+    if (pPipe->hEvtDone != NIL_RTSEMEVENT)
+        RTSemEventDestroy(pPipe->hEvtDone);
+    if (pPipe->pvBuffers)
+        RTMemFree(pPipe->pvBuffers);
+    if (pPipe->paJobs)
+        RTMemFree(pPipe->paJobs);
+    RTMemFree(pPipe);
+    pImage->pZipPipe = NULL;
+}
+
+/**
+ * Internal: set up parallel compression for a new streamOptimized image, or
+ * parallel decompression with read ahead for reading one sequentially.
+ * Nothing is done on single CPU hosts, the grains are processed
+ * synchronously then.
+ */
+static int vmdkZipPipeCreate(PVMDKIMAGE pImage, PVMDKEXTENT pExtent, bool fInflate)
+{
+    int rc = VINF_SUCCESS;
+    unsigned cThreads = RT_MIN(RTMpGetOnlineCount(), VMDK_ZIP_THREADS_MAX);
+
+    if (cThreads <= 1)
+        return VINF_SUCCESS;
+
+    PVMDKZIPPIPE pPipe = (PVMDKZIPPIPE)RTMemAllocZ(sizeof(VMDKZIPPIPE));
+    if (!pPipe)
+        return VERR_NO_MEMORY;
+    pPipe->hEvtWork = NIL_RTSEMEVENT;
+    pPipe->hEvtDone = NIL_RTSEMEVENT;
+    pImage->pZipPipe = pPipe;
+
+    do
+    {
+        pPipe->fInflate = fInflate;
+        pPipe->cbGrain = VMDK_SECTOR2BYTE(pExtent->cSectorsPerGrain);
+        /* When compressing same size as the compressed grain buffer of the
+         * extent. Compressed grains read from an image are accepted up to
+         * twice the grain size, see vmdkFileInflateSync. */
+        if (fInflate)
+            pPipe->cbCompGrainMax = RT_ALIGN_Z(2 * pPipe->cbGrain + RT_OFFSETOF(VMDKMARKER, uType), 512);
+        else
+            pPipe->cbCompGrainMax = RT_ALIGN_Z(pPipe->cbGrain + 8 + sizeof(VMDKMARKER), 512);
+        pPipe->cJobs = cThreads * VMDK_ZIP_JOBS_PER_THREAD;
+        pPipe->paJobs = (PVMDKZIPJOB)RTMemAllocZ(pPipe->cJobs * sizeof(VMDKZIPJOB));
+        pPipe->pvBuffers = RTMemAlloc(pPipe->cJobs * (pPipe->cbGrain + pPipe->cbCompGrainMax));
+        if (!pPipe->paJobs || !pPipe->pvBuffers)
+        {
+            rc = VERR_NO_MEMORY;
+            break;
+        }
+
+        uint8_t *pbBuf = (uint8_t *)pPipe->pvBuffers;
+        for (unsigned i = 0; i < pPipe->cJobs; i++)
+        {
+            pPipe->paJobs[i].uState = VMDKZIPJOB_STATE_FREE;
+            pPipe->paJobs[i].pvGrain = pbBuf;
+            pbBuf += pPipe->cbGrain;
+            pPipe->paJobs[i].pvCompGrain = pbBuf;
+            pbBuf += pPipe->cbCompGrainMax;
+        }
+
+        rc = RTSemEventCreate(&pPipe->hEvtWork);
+        if (RT_FAILURE(rc))
+            break;
+        rc = RTSemEventCreate(&pPipe->hEvtDone);
+        if (RT_FAILURE(rc))
+            break;
+
+        for (unsigned i = 0; i < cThreads; i++)
+        {
+            rc = RTThreadCreateF(&pPipe->ahThreads[i], vmdkZipPipeWorker, pPipe, 0,
+                                 RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE, "VMDKZip%u", i);
+            if (RT_FAILURE(rc))
+                break;
+            pPipe->cThreads++;
+        }
+        /* Carry on with fewer threads if at least one could be created. */
+        if (pPipe->cThreads)
+            rc = VINF_SUCCESS;
+    } while (0);
+
+    if (RT_FAILURE(rc))
+        vmdkZipPipeDestroy(pImage);
+
+    LogFlowFunc(("returns %Rrc (cThreads=%u)\n", rc, cThreads));
+    return rc;
+}
+
+/**
+ * Internal: append a compressed grain to a streamOptimized image and enter
+ * it in the grain table buffer.
+ */
+static int vmdkStreamWriteGrain(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
+                                uint32_t uCacheLine, uint32_t uCacheEntry,
+                                const void *pvCompGrain, uint32_t cbCompGrain)
+{
+    uint64_t uFileOffset;
+    uFileOffset = pExtent->uAppendPosition;
+    if (!uFileOffset)
+        return VERR_INTERNAL_ERROR;
+    /* Align to sector, as the previous write could have been any size. */
+    uFileOffset = RT_ALIGN_64(uFileOffset, 512);
+
+    /* Paranoia check: extent type, grain table buffer presence and
+     * grain table buffer space. Also grain table entry must be clear. */
+    if (   pExtent->enmType != VMDKETYPE_HOSTED_SPARSE
+        || !pImage->pGTCache
+        || pExtent->cGTEntries > VMDK_GT_CACHE_SIZE * VMDK_GT_CACHELINE_SIZE
+        || pImage->pGTCache->aGTCache[uCacheLine].aGTData[uCacheEntry])
+        return VERR_INTERNAL_ERROR;
+
+    /* Update grain table entry. */
+    pImage->pGTCache->aGTCache[uCacheLine].aGTData[uCacheEntry] = VMDK_BYTE2SECTOR(uFileOffset);
+
+    int rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pExtent->pFile->pStorage,
+                                    uFileOffset, pvCompGrain, cbCompGrain);
+    if (RT_SUCCESS(rc))
+        pExtent->uAppendPosition = uFileOffset + cbCompGrain;
+    return rc;
+}
+
+/**
+ * Internal: wait for the oldest queued grain to be compressed and write it.
+ */
+static int vmdkStreamDeflateWriteNext(PVMDKIMAGE pImage, PVMDKEXTENT pExtent)
+{
+    PVMDKZIPPIPE pPipe = pImage->pZipPipe;
+    PVMDKZIPJOB pJob = &pPipe->paJobs[pPipe->iJobWrite];
+    int rc;
+
+    Assert(pPipe->cJobsQueued);
+    while (ASMAtomicReadU32(&pJob->uState) != VMDKZIPJOB_STATE_DONE)
+        RTSemEventWait(pPipe->hEvtDone, RT_INDEFINITE_WAIT);
+
+    rc = pJob->rc;
+    if (RT_SUCCESS(rc))
+        rc = vmdkStreamWriteGrain(pImage, pExtent, pJob->uCacheLine,
+                                  pJob->uCacheEntry, pJob->pvCompGrain,
+                                  pJob->cbCompGrain);
+
+    ASMAtomicWriteU32(&pJob->uState, VMDKZIPJOB_STATE_FREE);
+    ASMAtomicWriteU32(&pPipe->iJobWrite, (pPipe->iJobWrite + 1) % pPipe->cJobs);
+    pPipe->cJobsQueued--;
+    return rc;
+}
+
+/**
+ * Internal: write out all grains queued for compression. Must be done
+ * before the grain table buffer is written or the image is closed.
+ */
+static int vmdkStreamDeflateDrain(PVMDKIMAGE pImage, PVMDKEXTENT pExtent)
+{
+    PVMDKZIPPIPE pPipe = pImage->pZipPipe;
+    int rc = VINF_SUCCESS;
+
+    if (!pPipe)
+        return VINF_SUCCESS;
+
+    while (pPipe->cJobsQueued)
+    {
+        int rc2 = vmdkStreamDeflateWriteNext(pImage, pExtent);
+        if (RT_SUCCESS(rc))
+            rc = rc2;
+    }
+    return rc;
+}
+
+/**
+ * Internal: queue a full grain for compression. Grains which are already
+ * compressed are written out, waiting for the oldest one only if the queue
+ * is full.
+ */
+static int vmdkStreamDeflateSubmit(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
+                                   const void *pvGrain, uint64_t uLBA,
+                                   uint32_t uCacheLine, uint32_t uCacheEntry)
+{
+    PVMDKZIPPIPE pPipe = pImage->pZipPipe;
+    int rc = VINF_SUCCESS;
+
+    if (pPipe->cJobsQueued == pPipe->cJobs)
+    {
+        rc = vmdkStreamDeflateWriteNext(pImage, pExtent);
         if (RT_FAILURE(rc))
             return rc;
     }
+
+    PVMDKZIPJOB pJob = &pPipe->paJobs[pPipe->iJobSubmit];
+    Assert(ASMAtomicReadU32(&pJob->uState) == VMDKZIPJOB_STATE_FREE);
+    memcpy(pJob->pvGrain, pvGrain, pPipe->cbGrain);
+    pJob->uLBA = uLBA;
+    pJob->uCacheLine = uCacheLine;
+    pJob->uCacheEntry = uCacheEntry;
+    pJob->cbCompGrain = 0;
+    pJob->rc = VINF_SUCCESS;
+    ASMAtomicWriteU32(&pJob->uState, VMDKZIPJOB_STATE_PENDING);
+    pPipe->iJobSubmit = (pPipe->iJobSubmit + 1) % pPipe->cJobs;
+    pPipe->cJobsQueued++;
+    RTSemEventSignal(pPipe->hEvtWork);
+
+    while (   RT_SUCCESS(rc)
+           && pPipe->cJobsQueued
+           &&    ASMAtomicReadU32(&pPipe->paJobs[pPipe->iJobWrite].uState)
+              == VMDKZIPJOB_STATE_DONE)
+        rc = vmdkStreamDeflateWriteNext(pImage, pExtent);
+
     return rc;
 }
 
+/**
+ * Internal: read ahead in a streamOptimized image, queueing compressed
+ * grains for decompression until the queue is full. Other markers are
+ * skipped. Reaching the end of the stream or an error stops the read
+ * ahead, the status is reported once the queued grains are consumed.
+ */
+static void vmdkStreamInflateFill(PVMDKIMAGE pImage, PVMDKEXTENT pExtent)
+{
+    PVMDKZIPPIPE pPipe = pImage->pZipPipe;
+    unsigned cJobsSubmitted = 0;
+    int rc = VINF_SUCCESS;
+
+    while (   pPipe->cJobsQueued < pPipe->cJobs
+           && !pPipe->fStreamEnd)
+    {
+        uint32_t uGrainSectorAbs = pPipe->uStreamSectorAbs;
+        VMDKMARKER Marker;
+
+        RT_ZERO(Marker);
+        rc = vdIfIoIntFileReadSync(pImage->pIfIo, pExtent->pFile->pStorage,
+                                   VMDK_SECTOR2BYTE(uGrainSectorAbs),
+                                   &Marker, RT_OFFSETOF(VMDKMARKER, uType));
+        if (RT_FAILURE(rc))
+            break;
+        Marker.uSector = RT_LE2H_U64(Marker.uSector);
+        Marker.cbSize = RT_LE2H_U32(Marker.cbSize);
+
+        if (Marker.cbSize == 0)
+        {
+            /* A marker for something else than a compressed grain. */
+            rc = vdIfIoIntFileReadSync(pImage->pIfIo, pExtent->pFile->pStorage,
+                                         VMDK_SECTOR2BYTE(uGrainSectorAbs)
+                                       + RT_OFFSETOF(VMDKMARKER, uType),
+                                       &Marker.uType, sizeof(Marker.uType));
+            if (RT_FAILURE(rc))
+                break;
+            Marker.uType = RT_LE2H_U32(Marker.uType);
+            switch (Marker.uType)
+            {
+                case VMDK_MARKER_EOS:
+                    uGrainSectorAbs++;
+                    /* Read (or mostly skip) to the end of file, see
+                     * vmdkStreamReadSequential. */
+                    vdIfIoIntFileReadSync(pImage->pIfIo, pExtent->pFile->pStorage,
+                                            VMDK_SECTOR2BYTE(uGrainSectorAbs)
+                                          + 511,
+                                          &Marker.uSector, 1);
+                    pPipe->fStreamEnd = true;
+                    break;
+                case VMDK_MARKER_GT:
+                    uGrainSectorAbs += 1 + VMDK_BYTE2SECTOR(pExtent->cGTEntries * sizeof(uint32_t));
+                    break;
+                case VMDK_MARKER_GD:
+                    uGrainSectorAbs += 1 + VMDK_BYTE2SECTOR(RT_ALIGN(pExtent->cGDEntries * sizeof(uint32_t), 512));
+                    break;
+                case VMDK_MARKER_FOOTER:
+                    uGrainSectorAbs += 2;
+                    break;
+                case VMDK_MARKER_UNSPECIFIED:
+                    uGrainSectorAbs += 1;
+                    break;
+                default:
+                    AssertMsgFailed(("VMDK: corrupted marker, type=%#x\n", Marker.uType));
+                    rc = VERR_VD_VMDK_INVALID_STATE;
+                    break;
+            }
+            if (RT_FAILURE(rc))
+                break;
+        }
+        else
+        {
+            /* A compressed grain. Read it into the next job, the marker
+             * must not be read again as the image is only read sequentially. */
+            size_t cbCompGrain = Marker.cbSize + RT_OFFSETOF(VMDKMARKER, uType);
+            if (RT_ALIGN_Z(cbCompGrain, 512) > pPipe->cbCompGrainMax)
+            {
+                rc = VERR_VD_VMDK_INVALID_FORMAT;
+                break;
+            }
+
+            PVMDKZIPJOB pJob = &pPipe->paJobs[pPipe->iJobSubmit];
+            Assert(ASMAtomicReadU32(&pJob->uState) == VMDKZIPJOB_STATE_FREE);
+            VMDKMARKER *pMarker = (VMDKMARKER *)pJob->pvCompGrain;
+            pMarker->uSector = RT_H2LE_U64(Marker.uSector);
+            pMarker->cbSize = RT_H2LE_U32(Marker.cbSize);
+            rc = vdIfIoIntFileReadSync(pImage->pIfIo, pExtent->pFile->pStorage,
+                                       VMDK_SECTOR2BYTE(uGrainSectorAbs) + RT_OFFSETOF(VMDKMARKER, uType),
+                                       (uint8_t *)pJob->pvCompGrain + RT_OFFSETOF(VMDKMARKER, uType),
+                                       RT_ALIGN_Z(cbCompGrain, 512) - RT_OFFSETOF(VMDKMARKER, uType));
+            if (RT_FAILURE(rc))
+                break;
+
+            pJob->uLBA = Marker.uSector;
+            pJob->cbCompGrain = (uint32_t)cbCompGrain;
+            pJob->rc = VINF_SUCCESS;
+            ASMAtomicWriteU32(&pJob->uState, VMDKZIPJOB_STATE_PENDING);
+            pPipe->iJobSubmit = (pPipe->iJobSubmit + 1) % pPipe->cJobs;
+            pPipe->cJobsQueued++;
+            cJobsSubmitted++;
+            uGrainSectorAbs += VMDK_BYTE2SECTOR(RT_ALIGN(cbCompGrain, 512));
+        }
+        pPipe->uStreamSectorAbs = uGrainSectorAbs;
+    }
+
+    if (RT_FAILURE(rc))
+    {
+        pPipe->rcStream = rc;
+        pPipe->fStreamEnd = true;
+    }
+    if (cJobsSubmitted)
+        RTSemEventSignal(pPipe->hEvtWork);
+}
+
+/**
+ * Internal: get the next decompressed grain at or after the given sector
+ * from the read ahead queue into the grain buffer of the extent. Same
+ * semantics as the serial code in vmdkStreamReadSequential.
+ */
+static int vmdkStreamInflateNext(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
+                                 uint64_t uSector)
+{
+    PVMDKZIPPIPE pPipe = pImage->pZipPipe;
+
+    for (;;)
+    {
+        vmdkStreamInflateFill(pImage, pExtent);
+        if (!pPipe->cJobsQueued)
+        {
+            if (RT_FAILURE(pPipe->rcStream))
+            {
+                pExtent->uGrainSectorAbs = 0;
+                return pPipe->rcStream;
+            }
+            /* End of stream. Must set a non-zero value for
+             * pExtent->cbGrainStreamRead or the next read would try to
+             * get more data, and we're at EOF. */
+            pExtent->uGrain = UINT32_MAX;
+            pExtent->cbGrainStreamRead = 1;
+            return VINF_SUCCESS;
+        }
+
+        PVMDKZIPJOB pJob = &pPipe->paJobs[pPipe->iJobWrite];
+        while (ASMAtomicReadU32(&pJob->uState) != VMDKZIPJOB_STATE_DONE)
+            RTSemEventWait(pPipe->hEvtDone, RT_INDEFINITE_WAIT);
+
+        int rc = pJob->rc;
+        uint64_t uLBA = pJob->uLBA;
+        uint32_t cbGrainStreamRead = RT_ALIGN(pJob->cbCompGrain, 512);
+        bool fSkip = uSector > uLBA + pExtent->cSectorsPerGrain;
+        if (RT_SUCCESS(rc) && !fSkip)
+            memcpy(pExtent->pvGrain, pJob->pvGrain, pPipe->cbGrain);
+
+        ASMAtomicWriteU32(&pJob->uState, VMDKZIPJOB_STATE_FREE);
+        ASMAtomicWriteU32(&pPipe->iJobWrite, (pPipe->iJobWrite + 1) % pPipe->cJobs);
+        pPipe->cJobsQueued--;
+
+        if (RT_FAILURE(rc))
+        {
+            pExtent->uGrainSectorAbs = 0;
+            if (rc == VERR_ZIP_CORRUPTED)
+                rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VMDK: Compressed image is corrupted '%s'"), pExtent->pszFullname);
+            return rc;
+        }
+        if (fSkip)
+            continue;
+        if (   pExtent->uGrain
+            && uLBA / pExtent->cSectorsPerGrain <= pExtent->uGrain)
+        {
+            pExtent->uGrainSectorAbs = 0;
+            return VERR_VD_VMDK_INVALID_STATE;
+        }
+        pExtent->uGrain = uLBA / pExtent->cSectorsPerGrain;
+        pExtent->cbGrainStreamRead = cbGrainStreamRead;
+        return VINF_SUCCESS;
+    }
+}
 
 /**
  * Internal: check if all files are closed, prevent leaking resources.
@@ -2707,6 +3291,17 @@ static int vmdkReadMetaExtent(PVMDKIMAGE pImage, PVMDKEXTENT pExtent)
     {
         pExtent->uGrainSectorAbs = pExtent->cOverheadSectors;
         pExtent->cbGrainStreamRead = 0;
+
+        /* Decompress on all host CPUs while reading ahead. Not fatal if
+         * this fails, the grains are decompressed synchronously then. */
+        if (!pImage->pZipPipe)
+        {
+            int rc2 = vmdkZipPipeCreate(pImage, pExtent, true /* fInflate */);
+            if (RT_SUCCESS(rc2) && pImage->pZipPipe)
+                pImage->pZipPipe->uStreamSectorAbs = pExtent->cOverheadSectors;
+            else if (RT_FAILURE(rc2))
+                LogRel(("VMDK: could not set up parallel decompression for '%s' (%Rrc)\n", pImage->pszFilename, rc2));
+        }
     }
 
 out:
@@ -3926,6 +4521,15 @@ static int vmdkCreateStreamImage(PVMDKIMAGE pImage, uint64_t cbSize,
     if (RT_FAILURE(rc))
         return vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VMDK: could not set the image type in '%s'"), pImage->pszFilename);
 
+    /* Compress the grains on all host CPUs. Not fatal if this fails, the
+     * grains are compressed synchronously then. */
+    rc = vmdkZipPipeCreate(pImage, pExtent, false /* fInflate */);
+    if (RT_FAILURE(rc))
+    {
+        LogRel(("VMDK: could not set up parallel compression for '%s' (%Rrc)\n", pImage->pszFilename, rc));
+        rc = VINF_SUCCESS;
+    }
+
     return rc;
 }
 
@@ -4270,73 +4874,86 @@ static int vmdkFreeImage(PVMDKIMAGE pImage, bool fDelete)
             {
                 PVMDKEXTENT pExtent = &pImage->pExtents[0];
                 uint32_t uLastGDEntry = pExtent->uLastGrainAccess / pExtent->cGTEntries;
-                rc = vmdkStreamFlushGT(pImage, pExtent, uLastGDEntry);
-                AssertRC(rc);
-                vmdkStreamClearGT(pImage, pExtent);
-                for (uint32_t i = uLastGDEntry + 1; i < pExtent->cGDEntries; i++)
+                rc = vmdkStreamDeflateDrain(pImage, pExtent);
+                if (RT_FAILURE(rc))
                 {
-                    rc = vmdkStreamFlushGT(pImage, pExtent, i);
-                    AssertRC(rc);
+                    /* The grain tables would point at data which never made it to the
+                     * disk, so leave the stream unterminated instead of finalizing it. */
+                    rc = vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VMDK: cannot write compressed data block in '%s'"), pExtent->pszFullname);
+                    pExtent->uAppendPosition = 0;
                 }
+                else
+                {
+                    rc = vmdkStreamFlushGT(pImage, pExtent, uLastGDEntry);
+                    AssertRC(rc);
+                    vmdkStreamClearGT(pImage, pExtent);
+                    for (uint32_t i = uLastGDEntry + 1; i < pExtent->cGDEntries; i++)
+                    {
+                        rc = vmdkStreamFlushGT(pImage, pExtent, i);
+                        AssertRC(rc);
+                    }
 
-                uint64_t uFileOffset = pExtent->uAppendPosition;
-                if (!uFileOffset)
-                    return VERR_INTERNAL_ERROR;
-                uFileOffset = RT_ALIGN_64(uFileOffset, 512);
-
-                /* From now on it's not safe to append any more data. */
-                pExtent->uAppendPosition = 0;
-
-                /* Grain directory marker. */
-                uint8_t aMarker[512];
-                PVMDKMARKER pMarker = (PVMDKMARKER)&aMarker[0];
-                memset(pMarker, '\0', sizeof(aMarker));
-                pMarker->uSector = VMDK_BYTE2SECTOR(RT_ALIGN_64(RT_H2LE_U64((uint64_t)pExtent->cGDEntries * sizeof(uint32_t)), 512));
-                pMarker->uType = RT_H2LE_U32(VMDK_MARKER_GD);
-                rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pExtent->pFile->pStorage, uFileOffset,
-                                            aMarker, sizeof(aMarker));
-                AssertRC(rc);
-                uFileOffset += 512;
-
-                /* Write grain directory in little endian style. The array will
-                 * not be used after this, so convert in place. */
-                uint32_t *pGDTmp = pExtent->pGD;
-                for (uint32_t i = 0; i < pExtent->cGDEntries; i++, pGDTmp++)
-                    *pGDTmp = RT_H2LE_U32(*pGDTmp);
-                rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pExtent->pFile->pStorage,
-                                            uFileOffset, pExtent->pGD,
-                                            pExtent->cGDEntries * sizeof(uint32_t));
-                AssertRC(rc);
-
-                pExtent->uSectorGD = VMDK_BYTE2SECTOR(uFileOffset);
-                pExtent->uSectorRGD = VMDK_BYTE2SECTOR(uFileOffset);
-                uFileOffset = RT_ALIGN_64(  uFileOffset
-                                          + pExtent->cGDEntries * sizeof(uint32_t),
-                                          512);
-
-                /* Footer marker. */
-                memset(pMarker, '\0', sizeof(aMarker));
-                pMarker->uSector = VMDK_BYTE2SECTOR(512);
-                pMarker->uType = RT_H2LE_U32(VMDK_MARKER_FOOTER);
-                rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pExtent->pFile->pStorage,
-                                            uFileOffset, aMarker, sizeof(aMarker));
-                AssertRC(rc);
+                    uint64_t uFileOffset = pExtent->uAppendPosition;
+                    if (!uFileOffset)
+                        return VERR_INTERNAL_ERROR;
+                    uFileOffset = RT_ALIGN_64(uFileOffset, 512);
+
+                    /* From now on it's not safe to append any more data. */
+                    pExtent->uAppendPosition = 0;
+
+                    /* Grain directory marker. */
+                    uint8_t aMarker[512];
+                    PVMDKMARKER pMarker = (PVMDKMARKER)&aMarker[0];
+                    memset(pMarker, '\0', sizeof(aMarker));
+                    pMarker->uSector = VMDK_BYTE2SECTOR(RT_ALIGN_64(RT_H2LE_U64((uint64_t)pExtent->cGDEntries * sizeof(uint32_t)), 512));
+                    pMarker->uType = RT_H2LE_U32(VMDK_MARKER_GD);
+                    rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pExtent->pFile->pStorage, uFileOffset,
+                                                aMarker, sizeof(aMarker));
+                    AssertRC(rc);
+                    uFileOffset += 512;
+
+                    /* Write grain directory in little endian style. The array will
+                     * not be used after this, so convert in place. */
+                    uint32_t *pGDTmp = pExtent->pGD;
+                    for (uint32_t i = 0; i < pExtent->cGDEntries; i++, pGDTmp++)
+                        *pGDTmp = RT_H2LE_U32(*pGDTmp);
+                    rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pExtent->pFile->pStorage,
+                                                uFileOffset, pExtent->pGD,
+                                                pExtent->cGDEntries * sizeof(uint32_t));
+                    AssertRC(rc);
 
-                uFileOffset += 512;
-                rc = vmdkWriteMetaSparseExtent(pImage, pExtent, uFileOffset, NULL);
-                AssertRC(rc);
+                    pExtent->uSectorGD = VMDK_BYTE2SECTOR(uFileOffset);
+                    pExtent->uSectorRGD = VMDK_BYTE2SECTOR(uFileOffset);
+                    uFileOffset = RT_ALIGN_64(  uFileOffset
+                                              + pExtent->cGDEntries * sizeof(uint32_t),
+                                              512);
+
+                    /* Footer marker. */
+                    memset(pMarker, '\0', sizeof(aMarker));
+                    pMarker->uSector = VMDK_BYTE2SECTOR(512);
+                    pMarker->uType = RT_H2LE_U32(VMDK_MARKER_FOOTER);
+                    rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pExtent->pFile->pStorage,
+                                                uFileOffset, aMarker, sizeof(aMarker));
+                    AssertRC(rc);
 
-                uFileOffset += 512;
-                /* End-of-stream marker. */
-                memset(pMarker, '\0', sizeof(aMarker));
-                rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pExtent->pFile->pStorage,
-                                            uFileOffset, aMarker, sizeof(aMarker));
-                AssertRC(rc);
+                    uFileOffset += 512;
+                    rc = vmdkWriteMetaSparseExtent(pImage, pExtent, uFileOffset, NULL);
+                    AssertRC(rc);
+
+                    uFileOffset += 512;
+                    /* End-of-stream marker. */
+                    memset(pMarker, '\0', sizeof(aMarker));
+                    rc = vdIfIoIntFileWriteSync(pImage->pIfIo, pExtent->pFile->pStorage,
+                                                uFileOffset, aMarker, sizeof(aMarker));
+                    AssertRC(rc);
+                }
             }
         }
         else
             vmdkFlushImage(pImage, NULL);
 
+        vmdkZipPipeDestroy(pImage);
+
         if (pImage->pExtents != NULL)
         {
             for (unsigned i = 0 ; i < pImage->cExtents; i++)
@@ -4616,8 +5233,15 @@ static int vmdkStreamAllocGrain(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
         && vdIfIoIntIoCtxIsZero(pImage->pIfIo, pIoCtx, cbWrite, true /* fAdvance */))
         return VINF_SUCCESS;
 
+    if (!pExtent->uAppendPosition)
+        return VERR_INTERNAL_ERROR;
+
     if (uGDEntry != uLastGDEntry)
     {
+        /* The grain table can only be written when all its grains are. */
+        rc = vmdkStreamDeflateDrain(pImage, pExtent);
+        if (RT_FAILURE(rc))
+            return vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VMDK: cannot write compressed data block in '%s'"), pExtent->pszFullname);
         rc = vmdkStreamFlushGT(pImage, pExtent, uLastGDEntry);
         if (RT_FAILURE(rc))
             return rc;
@@ -4630,24 +5254,6 @@ static int vmdkStreamAllocGrain(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
         }
     }
 
-    uint64_t uFileOffset;
-    uFileOffset = pExtent->uAppendPosition;
-    if (!uFileOffset)
-        return VERR_INTERNAL_ERROR;
-    /* Align to sector, as the previous write could have been any size. */
-    uFileOffset = RT_ALIGN_64(uFileOffset, 512);
-
-    /* Paranoia check: extent type, grain table buffer presence and
-     * grain table buffer space. Also grain table entry must be clear. */
-    if (   pExtent->enmType != VMDKETYPE_HOSTED_SPARSE
-        || !pImage->pGTCache
-        || pExtent->cGTEntries > VMDK_GT_CACHE_SIZE * VMDK_GT_CACHELINE_SIZE
-        || pImage->pGTCache->aGTCache[uCacheLine].aGTData[uCacheEntry])
-        return VERR_INTERNAL_ERROR;
-
-    /* Update grain table entry. */
-    pImage->pGTCache->aGTCache[uCacheLine].aGTData[uCacheEntry] = VMDK_BYTE2SECTOR(uFileOffset);
-
     if (cbWrite != VMDK_SECTOR2BYTE(pExtent->cSectorsPerGrain))
     {
         vdIfIoIntIoCtxCopyFrom(pImage->pIfIo, pIoCtx, pExtent->pvGrain, cbWrite);
@@ -4666,9 +5272,21 @@ static int vmdkStreamAllocGrain(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
         Assert(cbSeg == VMDK_SECTOR2BYTE(pExtent->cSectorsPerGrain));
         pData = Segment.pvSeg;
     }
-    rc = vmdkFileDeflateSync(pImage, pExtent, uFileOffset, pData,
-                             VMDK_SECTOR2BYTE(pExtent->cSectorsPerGrain),
-                             uSector, &cbGrain);
+
+    /* With the compression pipeline the grain is written (and any error
+     * reported) by one of the following writes or when closing the image. */
+    if (pImage->pZipPipe)
+        rc = vmdkStreamDeflateSubmit(pImage, pExtent, pData, uSector,
+                                     uCacheLine, uCacheEntry);
+    else
+    {
+        rc = vmdkDeflateGrain(pExtent->pvCompGrain, pExtent->cbCompGrain, pData,
+                              VMDK_SECTOR2BYTE(pExtent->cSectorsPerGrain),
+                              uSector, &cbGrain);
+        if (RT_SUCCESS(rc))
+            rc = vmdkStreamWriteGrain(pImage, pExtent, uCacheLine, uCacheEntry,
+                                      pExtent->pvCompGrain, cbGrain);
+    }
     if (RT_FAILURE(rc))
     {
         pExtent->uGrainSectorAbs = 0;
@@ -4676,7 +5294,6 @@ static int vmdkStreamAllocGrain(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
         return vdIfError(pImage->pIfError, rc, RT_SRC_POS, N_("VMDK: cannot write compressed data block in '%s'"), pExtent->pszFullname);
     }
     pExtent->uLastGrainAccess = uGrain;
-    pExtent->uAppendPosition += cbGrain;
 
     return rc;
 }
@@ -5053,7 +5670,14 @@ static int vmdkStreamReadSequential(PVMDKIMAGE pImage, PVMDKEXTENT pExtent,
 
     /* Check if we need to read something from the image or if what we have
      * in the buffer is good to fulfill the request. */
-    if (!pExtent->cbGrainStreamRead || uGrain > pExtent->uGrain)
+    if (   pImage->pZipPipe
+        && (!pExtent->cbGrainStreamRead || uGrain > pExtent->uGrain))
+    {
+        rc = vmdkStreamInflateNext(pImage, pExtent, uSector);
+        if (RT_FAILURE(rc))
+            return rc;
+    }
+    else if (!pExtent->cbGrainStreamRead || uGrain > pExtent->uGrain)
     {
         uint32_t uGrainSectorAbs =   pExtent->uGrainSectorAbs
                                    + VMDK_BYTE2SECTOR(pExtent->cbGrainStreamRead);
@@ -6560,6 +7184,85 @@ static void vmdkDump(void *pBackendData)
 
 
 
+/** @copydoc VBOXHDDBACKEND::pfnQueryAllocatedRanges */
+static int vmdkQueryAllocatedRanges(void *pBackendData, uint64_t uOffset,
+                                    uint64_t cbRange, PRTRANGE paRanges,
+                                    unsigned cRanges, unsigned *pcRanges)
+{
+    LogFlowFunc(("pBackendData=%#p uOffset=%llu cbRange=%llu paRanges=%#p cRanges=%u pcRanges=%#p\n",
+                 pBackendData, uOffset, cbRange, paRanges, cRanges, pcRanges));
+    PVMDKIMAGE pImage = (PVMDKIMAGE)pBackendData;
+    int rc = VINF_SUCCESS;
+    unsigned cRangesUsed = 0;
+    uint64_t offExtentStart = 0;
+    uint64_t offEnd = uOffset + cbRange;
+
+    AssertPtr(pImage);
+
+    /*
+     * Sparse extents report allocation per grain directory entry, the grain
+     * tables are not consulted to avoid synchronous metadata reads here.
+     * Everything else, including streamOptimized images where the grain
+     * directory might not be present, is reported as allocated.
+     */
+    for (unsigned i = 0; i < pImage->cExtents && offExtentStart < offEnd; i++)
+    {
+        PVMDKEXTENT pExtent = &pImage->pExtents[i];
+        uint64_t offExtentEnd = offExtentStart + VMDK_SECTOR2BYTE(pExtent->cNominalSectors);
+        uint64_t offCur = RT_MAX(uOffset, offExtentStart);
+        uint64_t offCurEnd = RT_MIN(offEnd, offExtentEnd);
+
+        while (offCur < offCurEnd)
+        {
+            uint64_t offChunkEnd = offCurEnd;
+            bool fAllocated = true;
+
+            if (   (   pExtent->enmType == VMDKETYPE_HOSTED_SPARSE
+#ifdef VBOX_WITH_VMDK_ESX
+                    || pExtent->enmType == VMDKETYPE_ESX_SPARSE
+#endif /* VBOX_WITH_VMDK_ESX */
+                   )
+                && pExtent->pGD
+                && !(pImage->uImageFlags & VD_VMDK_IMAGE_FLAGS_STREAM_OPTIMIZED))
+            {
+                uint64_t uSector  = VMDK_BYTE2SECTOR(offCur - offExtentStart) + pExtent->uSectorOffset;
+                uint64_t uGDIndex = uSector / pExtent->cSectorsPerGDE;
+
+                if (uGDIndex >= pExtent->cGDEntries)
+                {
+                    rc = VERR_OUT_OF_RANGE;
+                    break;
+                }
+
+                offChunkEnd = RT_MIN(  offExtentStart
+                                     + VMDK_SECTOR2BYTE((uGDIndex + 1) * pExtent->cSectorsPerGDE - pExtent->uSectorOffset),
+                                     offCurEnd);
+                fAllocated = pExtent->pGD[uGDIndex] != 0;
+            }
+
+            if (   fAllocated
+                && !vdPluginRangeAppend(paRanges, cRanges, &cRangesUsed,
+                                        offCur, (size_t)(offChunkEnd - offCur)))
+            {
+                rc = VERR_BUFFER_OVERFLOW;
+                break;
+            }
+
+            offCur = offChunkEnd;
+        }
+
+        if (RT_FAILURE(rc))
+            break;
+
+        offExtentStart = offExtentEnd;
+    }
+
+    *pcRanges = cRangesUsed;
+
+    LogFlowFunc(("returns %Rrc (cRanges=%u)\n", rc, cRangesUsed));
+    return rc;
+}
+
 VBOXHDDBACKEND g_VmdkBackend =
 {
     /* pszBackendName */
@@ -6657,5 +7360,9 @@ VBOXHDDBACKEND g_VmdkBackend =
     /* pfnResize */
     NULL,
     /* pfnRepair */
+    NULL,
+    /* pfnQueryAllocatedRanges */
+    vmdkQueryAllocatedRanges,
+    /* pfnDefragment */
     NULL
 };
@@ -0,0 +1,1260 @@
+/* $Id$ */
+/** @file
+ * Testcase for the iSCSI backend, exercising solicited data transfers (R2T)
+ * against an in-process target stub.
+ *
+ * The target stub serves a single session over a loopback TCP connection,
+ * keeps the disk in memory and negotiates small burst and PDU sizes so every
+ * bigger write is split into several R2T sequences.
+ */
+
+/*
+ * Copyright (C) 2013 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#include <VBox/vd.h>
+#include <VBox/err.h>
+#include <VBox/scsi.h>
+#include <iprt/asm.h>
+#include <iprt/mem.h>
+#include <iprt/pipe.h>
+#include <iprt/poll.h>
+#include <iprt/string.h>
+#include <iprt/tcp.h>
+#include <iprt/test.h>
+#include <iprt/thread.h>
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+#define TSTISCSI_DISK_SIZE          (4 * _1M)
+#define TSTISCSI_SECTOR_SIZE        512
+/** First port tried for the target stub. */
+#define TSTISCSI_PORT_FIRST         32600
+/** Number of ports tried for the target stub. */
+#define TSTISCSI_PORT_COUNT         100
+/** Largest data segment the target stub accepts. */
+#define TSTISCSI_DATA_SEGMENT_MAX   _256K
+/** Size of the Data-In PDUs sent by the target stub. */
+#define TSTISCSI_DATA_IN_SIZE       _64K
+/** Number of commands the target stub allows in flight. */
+#define TSTISCSI_CMD_WINDOW         16
+/** Maximum number of outstanding R2Ts per task, as offered by the initiator. */
+#define TSTISCSI_R2T_MAX            8
+
+/* The iSCSI bits used by the target stub, see ISCSI.cpp. */
+#define TSTISCSI_BHS_SIZE           48
+#define TSTISCSI_OP_MASK            0x3f000000
+#define TSTISCSI_OP_NOP_OUT         0x00000000
+#define TSTISCSI_OP_SCSI_CMD        0x01000000
+#define TSTISCSI_OP_LOGIN_REQ       0x03000000
+#define TSTISCSI_OP_DATA_OUT        0x05000000
+#define TSTISCSI_OP_LOGOUT_REQ      0x06000000
+#define TSTISCSI_OP_NOP_IN          0x20000000
+#define TSTISCSI_OP_SCSI_RES        0x21000000
+#define TSTISCSI_OP_LOGIN_RES       0x23000000
+#define TSTISCSI_OP_DATA_IN         0x25000000
+#define TSTISCSI_OP_LOGOUT_RES      0x26000000
+#define TSTISCSI_OP_R2T             0x31000000
+#define TSTISCSI_IMMEDIATE_BIT      0x40000000
+#define TSTISCSI_FINAL_BIT          0x00800000
+#define TSTISCSI_TRANSIT_BIT        0x00800000
+#define TSTISCSI_WRITE_BIT          0x00200000
+#define TSTISCSI_UNDERFLOW_BIT      0x00020000
+#define TSTISCSI_STATUS_BIT         0x00010000
+#define TSTISCSI_CSG_SHIFT          18
+#define TSTISCSI_NSG_SHIFT          16
+#define TSTISCSI_TAG_RSVD           0xffffffff
+
+
+/*******************************************************************************
+*   Structures and Typedefs                                                    *
+*******************************************************************************/
+/**
+ * The login parameters the target stub negotiates.
+ */
+typedef struct TSTISCSIPARAMS
+{
+    /** Name of the subtest. */
+    const char      *pszDesc;
+    /** MaxRecvDataSegmentLength of the target, limits the Data-Out PDUs. */
+    uint32_t        cbMaxRecvDataSegment;
+    /** FirstBurstLength, limits the immediate data. */
+    uint32_t        cbFirstBurst;
+    /** MaxBurstLength, limits the data solicited by a single R2T. */
+    uint32_t        cbMaxBurst;
+    /** MaxOutstandingR2T. */
+    uint32_t        cMaxOutstandingR2T;
+    /** ImmediateData. */
+    bool            fImmediateData;
+} TSTISCSIPARAMS;
+typedef const TSTISCSIPARAMS *PCTSTISCSIPARAMS;
+
+/**
+ * An R2T the target stub waits for Data-Out PDUs on.
+ */
+typedef struct TSTISCSIR2T
+{
+    /** Target transfer tag. */
+    uint32_t        uTtt;
+    /** Buffer offset of the solicited range. */
+    uint32_t        offBuf;
+    /** Size of the solicited range. */
+    uint32_t        cbDesired;
+    /** Number of bytes received so far. */
+    uint32_t        cbRecv;
+    /** DataSN expected for the next Data-Out PDU. */
+    uint32_t        uDataSN;
+} TSTISCSIR2T;
+
+/**
+ * The target stub state.
+ */
+typedef struct TSTISCSITARGET
+{
+    /** The negotiated parameters. */
+    PCTSTISCSIPARAMS pParams;
+    /** The server accepting the connection of the initiator. */
+    PRTTCPSERVER    pServer;
+    /** The port the server listens on. */
+    uint32_t        uPort;
+    /** The thread serving the session. */
+    RTTHREAD        hThread;
+    /** The connection of the initiator. */
+    RTSOCKET        hSocket;
+    /** The disk content. */
+    uint8_t         *pbDisk;
+    /** Buffer for the data segment of received PDUs. */
+    uint8_t         *pbData;
+    /** The next StatSN. */
+    uint32_t        uStatSN;
+    /** The next expected CmdSN. */
+    uint32_t        uExpCmdSN;
+    /** The next target transfer tag. */
+    uint32_t        uTttNext;
+    /** Flag whether the session was logged out. */
+    bool            fLoggedOut;
+    /** Number of writes. */
+    uint32_t        cWrites;
+    /** Number of R2Ts sent. */
+    uint32_t        cR2Ts;
+    /** Highest number of R2Ts outstanding at once. */
+    uint32_t        cR2TsOutstandingMax;
+    /** Number of Data-Out PDUs received. */
+    uint32_t        cDataOut;
+    /** Biggest Data-Out PDU received. */
+    uint32_t        cbDataOutMax;
+    /** Number of SYNCHRONIZE CACHE commands. */
+    uint32_t        cFlushes;
+} TSTISCSITARGET;
+typedef TSTISCSITARGET *PTSTISCSITARGET;
+
+/**
+ * A configuration key of the image.
+ */
+typedef struct TSTISCSICFGKEY
+{
+    const char      *pszKey;
+    const char      *pszValue;
+} TSTISCSICFGKEY;
+typedef const TSTISCSICFGKEY *PCTSTISCSICFGKEY;
+
+/**
+ * Socket data, see DrvVD.cpp.
+ */
+typedef struct VDSOCKETINT
+{
+    /** IPRT socket handle. */
+    RTSOCKET        hSocket;
+    /** Pollset with the wakeup pipe and socket. */
+    RTPOLLSET       hPollSet;
+    /** Pipe endpoint - read (in the pollset). */
+    RTPIPE          hPipeR;
+    /** Pipe endpoint - write. */
+    RTPIPE          hPipeW;
+    /** Flag whether the thread was woken up. */
+    volatile bool   fWokenUp;
+    /** Flag whether the thread is waiting in the select call. */
+    volatile bool   fWaiting;
+    /** Old event mask. */
+    uint32_t        fEventsOld;
+} VDSOCKETINT, *PVDSOCKETINT;
+
+/** Pollset id of the socket. */
+#define VDSOCKET_POLL_ID_SOCKET 0
+/** Pollset id of the pipe. */
+#define VDSOCKET_POLL_ID_PIPE   1
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+static RTTEST g_hTest;
+
+/** The parameter sets tested. */
+static const TSTISCSIPARAMS g_aParams[] =
+{
+    { "R2T with immediate data",             _8K,  _16K, _64K,  4, true  },
+    { "R2T without immediate data",          _32K, _64K, _128K, 2, false },
+    { "R2T with a single outstanding R2T",   _64K, _64K, _256K, 1, true  }
+};
+
+/** The writes done for every parameter set. */
+static const struct
+{
+    uint64_t    off;
+    size_t      cb;
+} g_aWrites[] =
+{
+    { 0,                 _4K                },
+    { _64K + 512,        3 * _64K + 1536    },
+    { _1M,               _1M                },
+    { 2 * _1M + 512,     _1M + _4K          },
+    { 0,                 TSTISCSI_DISK_SIZE }
+};
+
+
+/*******************************************************************************
+*   TCP network stack interface                                                *
+*******************************************************************************/
+
+/** @copydoc VDINTERFACETCPNET::pfnSocketCreate */
+static DECLCALLBACK(int) tstIScsiTcpSocketCreate(uint32_t fFlags, PVDSOCKET pSock)
+{
+    PVDSOCKETINT pSockInt = (PVDSOCKETINT)RTMemAllocZ(sizeof(VDSOCKETINT));
+    if (!pSockInt)
+        return VERR_NO_MEMORY;
+
+    pSockInt->hSocket  = NIL_RTSOCKET;
+    pSockInt->hPollSet = NIL_RTPOLLSET;
+    pSockInt->hPipeR   = NIL_RTPIPE;
+    pSockInt->hPipeW   = NIL_RTPIPE;
+
+    if (!(fFlags & VD_INTERFACETCPNET_CONNECT_EXTENDED_SELECT))
+    {
+        *pSock = pSockInt;
+        return VINF_SUCCESS;
+    }
+
+    int rc = RTPipeCreate(&pSockInt->hPipeR, &pSockInt->hPipeW, 0);
+    if (RT_SUCCESS(rc))
+    {
+        rc = RTPollSetCreate(&pSockInt->hPollSet);
+        if (RT_SUCCESS(rc))
+        {
+            rc = RTPollSetAddPipe(pSockInt->hPollSet, pSockInt->hPipeR,
+                                  RTPOLL_EVT_READ, VDSOCKET_POLL_ID_PIPE);
+            if (RT_SUCCESS(rc))
+            {
+                *pSock = pSockInt;
+                return VINF_SUCCESS;
+            }
+            RTPollSetDestroy(pSockInt->hPollSet);
+        }
+        RTPipeClose(pSockInt->hPipeR);
+        RTPipeClose(pSockInt->hPipeW);
+    }
+
+    RTMemFree(pSockInt);
+    return rc;
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnSocketDestroy */
+static DECLCALLBACK(int) tstIScsiTcpSocketDestroy(VDSOCKET Sock)
+{
+    int rc = VINF_SUCCESS;
+    PVDSOCKETINT pSockInt = (PVDSOCKETINT)Sock;
+
+    if (pSockInt->hPollSet != NIL_RTPOLLSET)
+    {
+        if (pSockInt->hSocket != NIL_RTSOCKET)
+            RTPollSetRemove(pSockInt->hPollSet, VDSOCKET_POLL_ID_SOCKET);
+        RTPollSetRemove(pSockInt->hPollSet, VDSOCKET_POLL_ID_PIPE);
+        RTPollSetDestroy(pSockInt->hPollSet);
+        RTPipeClose(pSockInt->hPipeR);
+        RTPipeClose(pSockInt->hPipeW);
+    }
+
+    if (pSockInt->hSocket != NIL_RTSOCKET)
+        rc = RTTcpClientCloseEx(pSockInt->hSocket, false /*fGracefulShutdown*/);
+
+    RTMemFree(pSockInt);
+    return rc;
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnClientConnect */
+static DECLCALLBACK(int) tstIScsiTcpClientConnect(VDSOCKET Sock, const char *pszAddress, uint32_t uPort)
+{
+    PVDSOCKETINT pSockInt = (PVDSOCKETINT)Sock;
+
+    int rc = RTTcpClientConnect(pszAddress, uPort, &pSockInt->hSocket);
+    if (RT_SUCCESS(rc))
+    {
+        if (pSockInt->hPollSet != NIL_RTPOLLSET)
+        {
+            pSockInt->fEventsOld = VD_INTERFACETCPNET_EVT_READ | VD_INTERFACETCPNET_EVT_WRITE | VD_INTERFACETCPNET_EVT_ERROR;
+            rc = RTPollSetAddSocket(pSockInt->hPollSet, pSockInt->hSocket,
+                                    RTPOLL_EVT_READ | RTPOLL_EVT_WRITE | RTPOLL_EVT_ERROR,
+                                    VDSOCKET_POLL_ID_SOCKET);
+        }
+        if (RT_FAILURE(rc))
+        {
+            RTTcpClientCloseEx(pSockInt->hSocket, false /*fGracefulShutdown*/);
+            pSockInt->hSocket = NIL_RTSOCKET;
+        }
+    }
+
+    return rc;
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnClientClose */
+static DECLCALLBACK(int) tstIScsiTcpClientClose(VDSOCKET Sock)
+{
+    PVDSOCKETINT pSockInt = (PVDSOCKETINT)Sock;
+
+    if (pSockInt->hPollSet != NIL_RTPOLLSET)
+        RTPollSetRemove(pSockInt->hPollSet, VDSOCKET_POLL_ID_SOCKET);
+
+    int rc = RTTcpClientCloseEx(pSockInt->hSocket, false /*fGracefulShutdown*/);
+    pSockInt->hSocket = NIL_RTSOCKET;
+    return rc;
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnIsClientConnected */
+static DECLCALLBACK(bool) tstIScsiTcpIsClientConnected(VDSOCKET Sock)
+{
+    return ((PVDSOCKETINT)Sock)->hSocket != NIL_RTSOCKET;
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnSelectOne */
+static DECLCALLBACK(int) tstIScsiTcpSelectOne(VDSOCKET Sock, RTMSINTERVAL cMillies)
+{
+    return RTTcpSelectOne(((PVDSOCKETINT)Sock)->hSocket, cMillies);
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnRead */
+static DECLCALLBACK(int) tstIScsiTcpRead(VDSOCKET Sock, void *pvBuffer, size_t cbBuffer, size_t *pcbRead)
+{
+    return RTTcpRead(((PVDSOCKETINT)Sock)->hSocket, pvBuffer, cbBuffer, pcbRead);
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnWrite */
+static DECLCALLBACK(int) tstIScsiTcpWrite(VDSOCKET Sock, const void *pvBuffer, size_t cbBuffer)
+{
+    return RTTcpWrite(((PVDSOCKETINT)Sock)->hSocket, pvBuffer, cbBuffer);
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnSgWrite */
+static DECLCALLBACK(int) tstIScsiTcpSgWrite(VDSOCKET Sock, PCRTSGBUF pSgBuf)
+{
+    return RTTcpSgWrite(((PVDSOCKETINT)Sock)->hSocket, pSgBuf);
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnReadNB */
+static DECLCALLBACK(int) tstIScsiTcpReadNB(VDSOCKET Sock, void *pvBuffer, size_t cbBuffer, size_t *pcbRead)
+{
+    return RTTcpReadNB(((PVDSOCKETINT)Sock)->hSocket, pvBuffer, cbBuffer, pcbRead);
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnWriteNB */
+static DECLCALLBACK(int) tstIScsiTcpWriteNB(VDSOCKET Sock, const void *pvBuffer, size_t cbBuffer, size_t *pcbWritten)
+{
+    return RTTcpWriteNB(((PVDSOCKETINT)Sock)->hSocket, pvBuffer, cbBuffer, pcbWritten);
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnSgWriteNB */
+static DECLCALLBACK(int) tstIScsiTcpSgWriteNB(VDSOCKET Sock, PRTSGBUF pSgBuf, size_t *pcbWritten)
+{
+    return RTTcpSgWriteNB(((PVDSOCKETINT)Sock)->hSocket, pSgBuf, pcbWritten);
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnFlush */
+static DECLCALLBACK(int) tstIScsiTcpFlush(VDSOCKET Sock)
+{
+    return RTTcpFlush(((PVDSOCKETINT)Sock)->hSocket);
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnSetSendCoalescing */
+static DECLCALLBACK(int) tstIScsiTcpSetSendCoalescing(VDSOCKET Sock, bool fEnable)
+{
+    return RTTcpSetSendCoalescing(((PVDSOCKETINT)Sock)->hSocket, fEnable);
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnGetLocalAddress */
+static DECLCALLBACK(int) tstIScsiTcpGetLocalAddress(VDSOCKET Sock, PRTNETADDR pAddr)
+{
+    return RTTcpGetLocalAddress(((PVDSOCKETINT)Sock)->hSocket, pAddr);
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnGetPeerAddress */
+static DECLCALLBACK(int) tstIScsiTcpGetPeerAddress(VDSOCKET Sock, PRTNETADDR pAddr)
+{
+    return RTTcpGetPeerAddress(((PVDSOCKETINT)Sock)->hSocket, pAddr);
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnSelectOneEx */
+static DECLCALLBACK(int) tstIScsiTcpSelectOneEx(VDSOCKET Sock, uint32_t fEvents,
+                                                uint32_t *pfEvents, RTMSINTERVAL cMillies)
+{
+    int rc = VINF_SUCCESS;
+    uint32_t id = 0;
+    uint32_t fEventsRecv = 0;
+    PVDSOCKETINT pSockInt = (PVDSOCKETINT)Sock;
+
+    *pfEvents = 0;
+
+    if (   pSockInt->fEventsOld != fEvents
+        && pSockInt->hSocket != NIL_RTSOCKET)
+    {
+        uint32_t fPollEvents = 0;
+
+        if (fEvents & VD_INTERFACETCPNET_EVT_READ)
+            fPollEvents |= RTPOLL_EVT_READ;
+        if (fEvents & VD_INTERFACETCPNET_EVT_WRITE)
+            fPollEvents |= RTPOLL_EVT_WRITE;
+        if (fEvents & VD_INTERFACETCPNET_EVT_ERROR)
+            fPollEvents |= RTPOLL_EVT_ERROR;
+
+        rc = RTPollSetEventsChange(pSockInt->hPollSet, VDSOCKET_POLL_ID_SOCKET, fPollEvents);
+        if (RT_FAILURE(rc))
+            return rc;
+
+        pSockInt->fEventsOld = fEvents;
+    }
+
+    ASMAtomicXchgBool(&pSockInt->fWaiting, true);
+    if (ASMAtomicXchgBool(&pSockInt->fWokenUp, false))
+    {
+        ASMAtomicXchgBool(&pSockInt->fWaiting, false);
+        return VERR_INTERRUPTED;
+    }
+
+    rc = RTPoll(pSockInt->hPollSet, cMillies, &fEventsRecv, &id);
+    ASMAtomicXchgBool(&pSockInt->fWaiting, false);
+
+    if (RT_SUCCESS(rc))
+    {
+        if (id == VDSOCKET_POLL_ID_SOCKET)
+        {
+            if (fEventsRecv & RTPOLL_EVT_READ)
+                *pfEvents |= VD_INTERFACETCPNET_EVT_READ;
+            if (fEventsRecv & RTPOLL_EVT_WRITE)
+                *pfEvents |= VD_INTERFACETCPNET_EVT_WRITE;
+            if (fEventsRecv & RTPOLL_EVT_ERROR)
+                *pfEvents |= VD_INTERFACETCPNET_EVT_ERROR;
+        }
+        else
+        {
+            /* We got interrupted, drain the pipe. */
+            size_t cbRead = 0;
+            uint8_t abBuf[10];
+            RTPipeRead(pSockInt->hPipeR, abBuf, sizeof(abBuf), &cbRead);
+            ASMAtomicXchgBool(&pSockInt->fWokenUp, false);
+            rc = VERR_INTERRUPTED;
+        }
+    }
+
+    return rc;
+}
+
+/** @copydoc VDINTERFACETCPNET::pfnPoke */
+static DECLCALLBACK(int) tstIScsiTcpPoke(VDSOCKET Sock)
+{
+    size_t cbWritten = 0;
+    PVDSOCKETINT pSockInt = (PVDSOCKETINT)Sock;
+
+    ASMAtomicXchgBool(&pSockInt->fWokenUp, true);
+    if (ASMAtomicReadBool(&pSockInt->fWaiting))
+        RTPipeWrite(pSockInt->hPipeW, "", 1, &cbWritten);
+
+    return VINF_SUCCESS;
+}
+
+
+/*******************************************************************************
+*   Configuration interface                                                    *
+*******************************************************************************/
+
+static const char *tstIScsiCfgGet(void *pvUser, const char *pszName)
+{
+    for (PCTSTISCSICFGKEY pKey = (PCTSTISCSICFGKEY)pvUser; pKey->pszKey; pKey++)
+        if (!strcmp(pKey->pszKey, pszName))
+            return pKey->pszValue;
+    return NULL;
+}
+
+/** @copydoc VDINTERFACECONFIG::pfnAreKeysValid */
+static DECLCALLBACK(bool) tstIScsiCfgAreKeysValid(void *pvUser, const char *pszzValid)
+{
+    for (PCTSTISCSICFGKEY pKey = (PCTSTISCSICFGKEY)pvUser; pKey->pszKey; pKey++)
+    {
+        const char *psz = pszzValid;
+        while (*psz && strcmp(psz, pKey->pszKey))
+            psz += strlen(psz) + 1;
+        if (!*psz)
+            return false;
+    }
+    return true;
+}
+
+/** @copydoc VDINTERFACECONFIG::pfnQuerySize */
+static DECLCALLBACK(int) tstIScsiCfgQuerySize(void *pvUser, const char *pszName, size_t *pcbValue)
+{
+    const char *pszValue = tstIScsiCfgGet(pvUser, pszName);
+    if (!pszValue)
+        return VERR_CFGM_VALUE_NOT_FOUND;
+    *pcbValue = strlen(pszValue) + 1;
+    return VINF_SUCCESS;
+}
+
+/** @copydoc VDINTERFACECONFIG::pfnQuery */
+static DECLCALLBACK(int) tstIScsiCfgQuery(void *pvUser, const char *pszName, char *pszValue, size_t cchValue)
+{
+    const char *pszCfg = tstIScsiCfgGet(pvUser, pszName);
+    if (!pszCfg)
+        return VERR_CFGM_VALUE_NOT_FOUND;
+    size_t cbCfg = strlen(pszCfg) + 1;
+    if (cbCfg > cchValue)
+        return VERR_CFGM_NOT_ENOUGH_SPACE;
+    memcpy(pszValue, pszCfg, cbCfg);
+    return VINF_SUCCESS;
+}
+
+
+/*******************************************************************************
+*   iSCSI target stub                                                          *
+*******************************************************************************/
+
+/**
+ * Returns the value of the given key in a login text segment, NULL if not present.
+ */
+static const char *tstIScsiTextGet(const uint8_t *pbText, size_t cbText, const char *pszKey)
+{
+    size_t cchKey = strlen(pszKey);
+    size_t off = 0;
+
+    while (off < cbText)
+    {
+        const char *psz = (const char *)pbText + off;
+        size_t cch = RTStrNLen(psz, cbText - off);
+        if (cch == cbText - off)
+            break; /* Not terminated. */
+        if (cch > cchKey && psz[cchKey] == '=' && !memcmp(psz, pszKey, cchKey))
+            return psz + cchKey + 1;
+        off += cch + 1;
+    }
+
+    return NULL;
+}
+
+/**
+ * Appends a key=value pair to a login text segment.
+ */
+static void tstIScsiTextAdd(char *pszText, size_t cbText, size_t *poff, const char *pszKey, const char *pszValue)
+{
+    *poff += RTStrPrintf(pszText + *poff, cbText - *poff, "%s=%s", pszKey, pszValue) + 1;
+}
+
+/**
+ * Receives a PDU from the initiator, the data segment ends up in pbData.
+ */
+static int tstIScsiTargetRecvPDU(PTSTISCSITARGET pThis, uint32_t *paBHS, uint32_t *pcbData)
+{
+    int rc = RTTcpRead(pThis->hSocket, paBHS, TSTISCSI_BHS_SIZE, NULL);
+    if (RT_FAILURE(rc))
+        return rc;
+
+    uint32_t cbAHS  = (RT_N2H_U32(paBHS[1]) >> 24) * 4;
+    uint32_t cbData = RT_N2H_U32(paBHS[1]) & 0x00ffffff;
+    if (cbAHS || cbData > TSTISCSI_DATA_SEGMENT_MAX)
+    {
+        RTTestFailed(g_hTest, "Received PDU %#x with %u bytes AHS and %u bytes data\n",
+                     RT_N2H_U32(paBHS[0]), cbAHS, cbData);
+        return VERR_PARSE_ERROR;
+    }
+
+    if (cbData)
+        rc = RTTcpRead(pThis->hSocket, pThis->pbData, RT_ALIGN_32(cbData, 4), NULL);
+    *pcbData = cbData;
+    return rc;
+}
+
+/**
+ * Sends a PDU to the initiator, filling in the data segment length and the
+ * command window.
+ */
+static int tstIScsiTargetSendPDU(PTSTISCSITARGET pThis, uint32_t *paBHS, const void *pvData, uint32_t cbData)
+{
+    static const uint8_t s_abPadding[4] = { 0 };
+
+    paBHS[1] = RT_H2N_U32(cbData); /* TotalAHSLength=0 */
+    paBHS[7] = RT_H2N_U32(pThis->uExpCmdSN);
+    paBHS[8] = RT_H2N_U32(pThis->uExpCmdSN + TSTISCSI_CMD_WINDOW - 1);
+
+    int rc = RTTcpWrite(pThis->hSocket, paBHS, TSTISCSI_BHS_SIZE);
+    if (RT_SUCCESS(rc) && cbData)
+        rc = RTTcpWrite(pThis->hSocket, pvData, cbData);
+    if (RT_SUCCESS(rc) && (cbData & 3))
+        rc = RTTcpWrite(pThis->hSocket, s_abPadding, 4 - (cbData & 3));
+    return rc;
+}
+
+/**
+ * Returns the StatSN for a response in network byte order and advances it.
+ */
+static uint32_t tstIScsiTargetNextStatSN(PTSTISCSITARGET pThis)
+{
+    uint32_t uStatSN = pThis->uStatSN++;
+    return RT_H2N_U32(uStatSN);
+}
+
+/**
+ * Checks the CmdSN of a non immediate request and advances the command window.
+ */
+static void tstIScsiTargetCmdSN(PTSTISCSITARGET pThis, const uint32_t *paReqBHS)
+{
+    if (RT_N2H_U32(paReqBHS[6]) != pThis->uExpCmdSN)
+        RTTestFailed(g_hTest, "Received CmdSN %u, expected %u\n", RT_N2H_U32(paReqBHS[6]), pThis->uExpCmdSN);
+    pThis->uExpCmdSN++;
+}
+
+/**
+ * Handles a login request, there is no authentication.
+ */
+static int tstIScsiTargetLogin(PTSTISCSITARGET pThis, const uint32_t *paReqBHS, uint32_t cbData)
+{
+    PCTSTISCSIPARAMS pParams = pThis->pParams;
+    uint32_t uCSG = (RT_N2H_U32(paReqBHS[0]) >> TSTISCSI_CSG_SHIFT) & 3;
+    uint32_t uNSG;
+    char szText[512];
+    size_t cbText = 0;
+
+    /* The first login request sets the command window. */
+    if (pThis->uStatSN == 0)
+    {
+        pThis->uStatSN   = 0x100;
+        pThis->uExpCmdSN = RT_N2H_U32(paReqBHS[6]);
+    }
+
+    if (uCSG == 0)
+    {
+        tstIScsiTextAdd(szText, sizeof(szText), &cbText, "AuthMethod", "None");
+        uNSG = 1;
+    }
+    else
+    {
+        /* The initiator must offer the R2T related parameters. */
+        static const char * const s_apszKeys[] = { "InitialR2T", "MaxBurstLength", "FirstBurstLength", "MaxOutstandingR2T" };
+        for (unsigned i = 0; i < RT_ELEMENTS(s_apszKeys); i++)
+            if (!tstIScsiTextGet(pThis->pbData, cbData, s_apszKeys[i]))
+                RTTestFailed(g_hTest, "The initiator didn't offer %s\n", s_apszKeys[i]);
+
+        char szValue[16];
+        tstIScsiTextAdd(szText, sizeof(szText), &cbText, "HeaderDigest", "None");
+        tstIScsiTextAdd(szText, sizeof(szText), &cbText, "DataDigest", "None");
+        tstIScsiTextAdd(szText, sizeof(szText), &cbText, "MaxConnections", "1");
+        tstIScsiTextAdd(szText, sizeof(szText), &cbText, "InitialR2T", "No");
+        tstIScsiTextAdd(szText, sizeof(szText), &cbText, "ImmediateData", pParams->fImmediateData ? "Yes" : "No");
+        RTStrPrintf(szValue, sizeof(szValue), "%u", pParams->cbMaxRecvDataSegment);
+        tstIScsiTextAdd(szText, sizeof(szText), &cbText, "MaxRecvDataSegmentLength", szValue);
+        RTStrPrintf(szValue, sizeof(szValue), "%u", pParams->cbMaxBurst);
+        tstIScsiTextAdd(szText, sizeof(szText), &cbText, "MaxBurstLength", szValue);
+        RTStrPrintf(szValue, sizeof(szValue), "%u", pParams->cbFirstBurst);
+        tstIScsiTextAdd(szText, sizeof(szText), &cbText, "FirstBurstLength", szValue);
+        RTStrPrintf(szValue, sizeof(szValue), "%u", pParams->cMaxOutstandingR2T);
+        tstIScsiTextAdd(szText, sizeof(szText), &cbText, "MaxOutstandingR2T", szValue);
+        tstIScsiTextAdd(szText, sizeof(szText), &cbText, "DataPDUInOrder", "Yes");
+        tstIScsiTextAdd(szText, sizeof(szText), &cbText, "DataSequenceInOrder", "Yes");
+        tstIScsiTextAdd(szText, sizeof(szText), &cbText, "ErrorRecoveryLevel", "0");
+        uNSG = 3;
+    }
+
+    uint32_t aBHS[12];
+    RT_ZERO(aBHS);
+    aBHS[0] = RT_H2N_U32(  TSTISCSI_OP_LOGIN_RES | TSTISCSI_TRANSIT_BIT
+                         | (uCSG << TSTISCSI_CSG_SHIFT) | (uNSG << TSTISCSI_NSG_SHIFT)); /* Versions 0 */
+    aBHS[2] = paReqBHS[2];
+    aBHS[3] = RT_H2N_U32((RT_N2H_U32(paReqBHS[3]) & 0xffff0000) | 1); /* TSIH=1 */
+    aBHS[4] = paReqBHS[4];
+    aBHS[6] = tstIScsiTargetNextStatSN(pThis);
+    return tstIScsiTargetSendPDU(pThis, aBHS, szText, (uint32_t)cbText);
+}
+
+/**
+ * Completes a SCSI command with a SCSI Response PDU.
+ */
+static int tstIScsiTargetScsiRes(PTSTISCSITARGET pThis, const uint32_t *paReqBHS, uint8_t bStatus, uint8_t bSenseKey, uint8_t uASC)
+{
+    uint8_t abSense[2 + 18];
+    uint32_t cbSense = 0;
+
+    if (bStatus == SCSI_STATUS_CHECK_CONDITION)
+    {
+        RT_ZERO(abSense);
+        abSense[1]      = 18;
+        abSense[2 + 0]  = SCSI_SENSE_RESPONSE_CODE_CURR_FIXED;
+        abSense[2 + 2]  = bSenseKey;
+        abSense[2 + 7]  = 10;
+        abSense[2 + 12] = uASC;
+        cbSense = sizeof(abSense);
+    }
+
+    uint32_t aBHS[12];
+    RT_ZERO(aBHS);
+    aBHS[0] = RT_H2N_U32(TSTISCSI_OP_SCSI_RES | TSTISCSI_FINAL_BIT | bStatus); /* Response=0 */
+    aBHS[4] = paReqBHS[4];
+    aBHS[6] = tstIScsiTargetNextStatSN(pThis);
+    return tstIScsiTargetSendPDU(pThis, aBHS, abSense, cbSense);
+}
+
+/**
+ * Returns data to the initiator with Data-In PDUs, the last one carrying the status.
+ */
+static int tstIScsiTargetDataIn(PTSTISCSITARGET pThis, const uint32_t *paReqBHS, const uint8_t *pbData, uint32_t cbData)
+{
+    uint32_t cbXfer = RT_N2H_U32(paReqBHS[5]);
+    uint32_t cbResidual = 0;
+    uint32_t off = 0;
+    uint32_t uDataSN = 0;
+    int rc;
+
+    if (cbData < cbXfer)
+        cbResidual = cbXfer - cbData;
+    else
+        cbData = cbXfer;
+
+    do
+    {
+        uint32_t cbThis = RT_MIN(cbData - off, TSTISCSI_DATA_IN_SIZE);
+        bool fLast = off + cbThis == cbData;
+        uint32_t aBHS[12];
+
+        RT_ZERO(aBHS);
+        aBHS[0] = RT_H2N_U32(  TSTISCSI_OP_DATA_IN
+                             | (fLast ? TSTISCSI_FINAL_BIT | TSTISCSI_STATUS_BIT : 0)
+                             | (fLast && cbResidual ? TSTISCSI_UNDERFLOW_BIT : 0)
+                             | SCSI_STATUS_OK);
+        aBHS[2]  = paReqBHS[2];
+        aBHS[3]  = paReqBHS[3];
+        aBHS[4]  = paReqBHS[4];
+        aBHS[5]  = RT_H2N_U32(TSTISCSI_TAG_RSVD);
+        aBHS[6]  = fLast ? tstIScsiTargetNextStatSN(pThis) : 0;
+        aBHS[9]  = RT_H2N_U32(uDataSN);
+        aBHS[10] = RT_H2N_U32(off);
+        aBHS[11] = fLast ? RT_H2N_U32(cbResidual) : 0;
+        rc = tstIScsiTargetSendPDU(pThis, aBHS, pbData + off, cbThis);
+        uDataSN++;
+        off += cbThis;
+    } while (RT_SUCCESS(rc) && off < cbData);
+
+    return rc;
+}
+
+/**
+ * Handles a WRITE(10) command, soliciting everything beyond the immediate data
+ * with R2Ts and checking the Data-Out PDUs the initiator answers with.
+ */
+static int tstIScsiTargetWrite(PTSTISCSITARGET pThis, const uint32_t *paReqBHS, uint64_t offDisk,
+                               uint32_t cbWrite, uint32_t cbImmediate)
+{
+    PCTSTISCSIPARAMS pParams = pThis->pParams;
+    uint32_t cbImmediateExpected = 0;
+    int rc = VINF_SUCCESS;
+
+    pThis->cWrites++;
+
+    if (pParams->fImmediateData)
+        cbImmediateExpected = RT_MIN(cbWrite, RT_MIN(pParams->cbFirstBurst, pParams->cbMaxRecvDataSegment));
+    if (cbImmediate != cbImmediateExpected)
+    {
+        RTTestFailed(g_hTest, "Write of %u bytes at %#llx carries %u bytes immediate data, expected %u\n",
+                     cbWrite, offDisk, cbImmediate, cbImmediateExpected);
+        return tstIScsiTargetScsiRes(pThis, paReqBHS, SCSI_STATUS_CHECK_CONDITION, SCSI_SENSE_ILLEGAL_REQUEST,
+                                     SCSI_ASC_INV_FIELD_IN_CMD_PACKET);
+    }
+    memcpy(pThis->pbDisk + offDisk, pThis->pbData, cbImmediate);
+
+    /*
+     * Solicit the rest, keeping as many R2Ts outstanding as negotiated. The
+     * Data-Out PDUs must arrive in the order of the R2Ts as DataPDUInOrder and
+     * DataSequenceInOrder are set.
+     */
+    TSTISCSIR2T aR2Ts[TSTISCSI_R2T_MAX];
+    unsigned    iR2THead = 0;
+    unsigned    cR2Ts    = 0;
+    uint32_t    offNext  = cbImmediate;
+    uint32_t    uR2TSN   = 0;
+
+    while (offNext < cbWrite || cR2Ts)
+    {
+        while (   offNext < cbWrite
+               && cR2Ts < pParams->cMaxOutstandingR2T)
+        {
+            TSTISCSIR2T *pR2T = &aR2Ts[(iR2THead + cR2Ts) % RT_ELEMENTS(aR2Ts)];
+            pR2T->uTtt      = pThis->uTttNext++;
+            pR2T->offBuf    = offNext;
+            pR2T->cbDesired = RT_MIN(cbWrite - offNext, pParams->cbMaxBurst);
+            pR2T->cbRecv    = 0;
+            pR2T->uDataSN   = 0;
+
+            uint32_t aBHS[12];
+            RT_ZERO(aBHS);
+            aBHS[0]  = RT_H2N_U32(TSTISCSI_OP_R2T | TSTISCSI_FINAL_BIT);
+            aBHS[2]  = paReqBHS[2];
+            aBHS[3]  = paReqBHS[3];
+            aBHS[4]  = paReqBHS[4];
+            aBHS[5]  = RT_H2N_U32(pR2T->uTtt);
+            aBHS[6]  = RT_H2N_U32(pThis->uStatSN); /* Not advanced for R2Ts. */
+            aBHS[9]  = RT_H2N_U32(uR2TSN);
+            aBHS[10] = RT_H2N_U32(pR2T->offBuf);
+            aBHS[11] = RT_H2N_U32(pR2T->cbDesired);
+            rc = tstIScsiTargetSendPDU(pThis, aBHS, NULL, 0);
+            if (RT_FAILURE(rc))
+                return rc;
+
+            offNext += pR2T->cbDesired;
+            uR2TSN++;
+            cR2Ts++;
+            pThis->cR2Ts++;
+            pThis->cR2TsOutstandingMax = RT_MAX(pThis->cR2TsOutstandingMax, cR2Ts);
+        }
+
+        uint32_t aBHS[12];
+        uint32_t cbData = 0;
+        rc = tstIScsiTargetRecvPDU(pThis, aBHS, &cbData);
+        if (RT_FAILURE(rc))
+            return rc;
+
+        TSTISCSIR2T *pR2T = &aR2Ts[iR2THead];
+        uint32_t u32Hdr = RT_N2H_U32(aBHS[0]);
+        uint32_t offBuf = RT_N2H_U32(aBHS[10]);
+        if (   (u32Hdr & TSTISCSI_OP_MASK) != TSTISCSI_OP_DATA_OUT
+            || aBHS[4] != paReqBHS[4]
+            || RT_N2H_U32(aBHS[5]) != pR2T->uTtt
+            || RT_N2H_U32(aBHS[9]) != pR2T->uDataSN
+            || offBuf != pR2T->offBuf + pR2T->cbRecv
+            || cbData > pR2T->cbDesired - pR2T->cbRecv
+            || cbData > pParams->cbMaxRecvDataSegment
+            || !(u32Hdr & TSTISCSI_FINAL_BIT) != (pR2T->cbRecv + cbData < pR2T->cbDesired))
+        {
+            RTTestFailed(g_hTest, "Unexpected PDU %#x TTT=%#x DataSN=%u offset=%u length=%u for R2T TTT=%#x DataSN=%u offset=%u length=%u\n",
+                         u32Hdr, RT_N2H_U32(aBHS[5]), RT_N2H_U32(aBHS[9]), offBuf, cbData,
+                         pR2T->uTtt, pR2T->uDataSN, pR2T->offBuf + pR2T->cbRecv, pR2T->cbDesired - pR2T->cbRecv);
+            return VERR_PARSE_ERROR;
+        }
+
+        memcpy(pThis->pbDisk + offDisk + offBuf, pThis->pbData, cbData);
+        pR2T->cbRecv += cbData;
+        pR2T->uDataSN++;
+        pThis->cDataOut++;
+        pThis->cbDataOutMax = RT_MAX(pThis->cbDataOutMax, cbData);
+
+        if (u32Hdr & TSTISCSI_FINAL_BIT)
+        {
+            iR2THead = (iR2THead + 1) % RT_ELEMENTS(aR2Ts);
+            cR2Ts--;
+        }
+    }
+
+    return tstIScsiTargetScsiRes(pThis, paReqBHS, SCSI_STATUS_OK, 0, 0);
+}
+
+/**
+ * Handles a SCSI command.
+ */
+static int tstIScsiTargetScsiCmd(PTSTISCSITARGET pThis, const uint32_t *paReqBHS, uint32_t cbData)
+{
+    const uint8_t *pbCDB = (const uint8_t *)&paReqBHS[8];
+    uint8_t abData[32];
+
+    tstIScsiTargetCmdSN(pThis, paReqBHS);
+
+    if (   cbData
+        && (   !(RT_N2H_U32(paReqBHS[0]) & TSTISCSI_WRITE_BIT)
+            || cbData > pThis->pParams->cbMaxRecvDataSegment))
+    {
+        RTTestFailed(g_hTest, "SCSI command %#x carries %u bytes immediate data\n", pbCDB[0], cbData);
+        return VERR_PARSE_ERROR;
+    }
+
+    RT_ZERO(abData);
+    switch (pbCDB[0])
+    {
+        case SCSI_REPORT_LUNS:
+            abData[3] = 8; /* A single LUN 0. */
+            return tstIScsiTargetDataIn(pThis, paReqBHS, abData, 16);
+        case SCSI_INQUIRY:
+            abData[0] = 0;    /* Direct access block device. */
+            abData[2] = 5;
+            abData[3] = 2;
+            abData[4] = 3;
+            abData[7] = 0x02; /* CmdQue. */
+            return tstIScsiTargetDataIn(pThis, paReqBHS, abData, 8);
+        case SCSI_MODE_SENSE_6:
+            if ((pbCDB[2] & 0x3f) == 0x08)
+            {
+                /* Caching mode page with the write cache enabled. */
+                abData[0] = 4 + 20 - 1;
+                abData[4] = 0x08;
+                abData[5] = 18;
+                abData[6] = 0x04; /* WCE */
+                return tstIScsiTargetDataIn(pThis, paReqBHS, abData, RT_MIN(4 + 20, pbCDB[4]));
+            }
+            abData[0] = 3;
+            return tstIScsiTargetDataIn(pThis, paReqBHS, abData, RT_MIN(4, pbCDB[4]));
+        case SCSI_SERVICE_ACTION_IN_16:
+            if ((pbCDB[1] & 0x1f) != SCSI_SVC_ACTION_IN_READ_CAPACITY_16)
+                break;
+            *(uint64_t *)&abData[0] = RT_H2BE_U64(TSTISCSI_DISK_SIZE / TSTISCSI_SECTOR_SIZE - 1);
+            *(uint32_t *)&abData[8] = RT_H2BE_U32(TSTISCSI_SECTOR_SIZE);
+            return tstIScsiTargetDataIn(pThis, paReqBHS, abData, 12);
+        case SCSI_READ_10:
+        case SCSI_WRITE_10:
+        {
+            uint64_t offDisk = (uint64_t)RT_BE2H_U32(*(const uint32_t *)&pbCDB[2]) * TSTISCSI_SECTOR_SIZE;
+            uint32_t cbXfer  = RT_BE2H_U16(*(const uint16_t *)&pbCDB[7]) * TSTISCSI_SECTOR_SIZE;
+            if (   offDisk + cbXfer > TSTISCSI_DISK_SIZE
+                || cbXfer != RT_N2H_U32(paReqBHS[5]))
+            {
+                RTTestFailed(g_hTest, "Invalid transfer of %u bytes at %#llx\n", cbXfer, offDisk);
+                return tstIScsiTargetScsiRes(pThis, paReqBHS, SCSI_STATUS_CHECK_CONDITION, SCSI_SENSE_ILLEGAL_REQUEST,
+                                             SCSI_ASC_LOGICAL_BLOCK_OOR);
+            }
+            if (pbCDB[0] == SCSI_READ_10)
+                return tstIScsiTargetDataIn(pThis, paReqBHS, pThis->pbDisk + offDisk, cbXfer);
+            return tstIScsiTargetWrite(pThis, paReqBHS, offDisk, cbXfer, cbData);
+        }
+        case SCSI_SYNCHRONIZE_CACHE:
+            pThis->cFlushes++;
+            return tstIScsiTargetScsiRes(pThis, paReqBHS, SCSI_STATUS_OK, 0, 0);
+        default:
+            break;
+    }
+
+    return tstIScsiTargetScsiRes(pThis, paReqBHS, SCSI_STATUS_CHECK_CONDITION, SCSI_SENSE_ILLEGAL_REQUEST,
+                                 SCSI_ASC_ILLEGAL_OPCODE);
+}
+
+/**
+ * Serves the session until the initiator logs out or goes away.
+ */
+static int tstIScsiTargetServe(PTSTISCSITARGET pThis)
+{
+    int rc;
+
+    for (;;)
+    {
+        uint32_t aBHS[12];
+        uint32_t cbData = 0;
+
+        rc = tstIScsiTargetRecvPDU(pThis, aBHS, &cbData);
+        if (RT_FAILURE(rc))
+            break;
+
+        uint32_t aResBHS[12];
+        RT_ZERO(aResBHS);
+        switch (RT_N2H_U32(aBHS[0]) & TSTISCSI_OP_MASK)
+        {
+            case TSTISCSI_OP_LOGIN_REQ:
+                rc = tstIScsiTargetLogin(pThis, aBHS, cbData);
+                break;
+            case TSTISCSI_OP_SCSI_CMD:
+                rc = tstIScsiTargetScsiCmd(pThis, aBHS, cbData);
+                break;
+            case TSTISCSI_OP_NOP_OUT:
+                if (!(RT_N2H_U32(aBHS[0]) & TSTISCSI_IMMEDIATE_BIT))
+                    tstIScsiTargetCmdSN(pThis, aBHS);
+                if (aBHS[4] == TSTISCSI_TAG_RSVD)
+                    break; /* Answer to a NOP-In. */
+                aResBHS[0] = RT_H2N_U32(TSTISCSI_OP_NOP_IN | TSTISCSI_FINAL_BIT);
+                aResBHS[4] = aBHS[4];
+                aResBHS[5] = RT_H2N_U32(TSTISCSI_TAG_RSVD);
+                aResBHS[6] = tstIScsiTargetNextStatSN(pThis);
+                rc = tstIScsiTargetSendPDU(pThis, aResBHS, NULL, 0);
+                break;
+            case TSTISCSI_OP_LOGOUT_REQ:
+                tstIScsiTargetCmdSN(pThis, aBHS);
+                aResBHS[0] = RT_H2N_U32(TSTISCSI_OP_LOGOUT_RES | TSTISCSI_FINAL_BIT);
+                aResBHS[4] = aBHS[4];
+                aResBHS[6] = tstIScsiTargetNextStatSN(pThis);
+                pThis->fLoggedOut = true;
+                return tstIScsiTargetSendPDU(pThis, aResBHS, NULL, 0);
+            default:
+                RTTestFailed(g_hTest, "Received unexpected PDU %#x\n", RT_N2H_U32(aBHS[0]));
+                rc = VERR_PARSE_ERROR;
+        }
+
+        if (RT_FAILURE(rc))
+            break;
+    }
+
+    return rc;
+}
+
+/**
+ * The target stub thread, serves a single session.
+ */
+static DECLCALLBACK(int) tstIScsiTargetThread(RTTHREAD hThread, void *pvUser)
+{
+    PTSTISCSITARGET pThis = (PTSTISCSITARGET)pvUser;
+    RTSOCKET hSocket = NIL_RTSOCKET;
+
+    int rc = RTTcpServerListen2(pThis->pServer, &hSocket);
+
+    /* Refuse the connection attempts of the initiator after the session ended. */
+    RTTcpServerDestroy(pThis->pServer);
+    pThis->pServer = NULL;
+
+    if (RT_SUCCESS(rc))
+    {
+        pThis->hSocket = hSocket;
+        rc = tstIScsiTargetServe(pThis);
+        RTTcpServerDisconnectClient2(hSocket);
+        pThis->hSocket = NIL_RTSOCKET;
+    }
+
+    return rc;
+}
+
+/**
+ * Starts the target stub on the first free port of the range.
+ */
+static int tstIScsiTargetStart(PTSTISCSITARGET pThis, PCTSTISCSIPARAMS pParams)
+{
+    int rc = VERR_NO_MEMORY;
+
+    RT_ZERO(*pThis);
+    pThis->pParams  = pParams;
+    pThis->hThread  = NIL_RTTHREAD;
+    pThis->hSocket  = NIL_RTSOCKET;
+    pThis->uTttNext = 0x1000;
+    pThis->pbDisk   = (uint8_t *)RTMemAllocZ(TSTISCSI_DISK_SIZE);
+    pThis->pbData   = (uint8_t *)RTMemAlloc(TSTISCSI_DATA_SEGMENT_MAX);
+    if (pThis->pbDisk && pThis->pbData)
+    {
+        for (uint32_t i = 0; i < TSTISCSI_PORT_COUNT; i++)
+        {
+            pThis->uPort = TSTISCSI_PORT_FIRST + i;
+            rc = RTTcpServerCreateEx("127.0.0.1", pThis->uPort, &pThis->pServer);
+            if (RT_SUCCESS(rc))
+                break;
+        }
+        if (RT_SUCCESS(rc))
+        {
+            rc = RTThreadCreate(&pThis->hThread, tstIScsiTargetThread, pThis, 0,
+                                RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE, "tstIScsiTgt");
+            if (RT_SUCCESS(rc))
+                return VINF_SUCCESS;
+            RTTcpServerDestroy(pThis->pServer);
+        }
+    }
+
+    RTTestFailed(g_hTest, "Starting the target stub failed rc=%Rrc\n", rc);
+    RTMemFree(pThis->pbDisk);
+    RTMemFree(pThis->pbData);
+    return rc;
+}
+
+/**
+ * Stops the target stub after the initiator closed the image.
+ */
+static void tstIScsiTargetStop(PTSTISCSITARGET pThis)
+{
+    /* Connect once if the initiator didn't get that far, the stub gives up on the closed connection. */
+    RTSOCKET hSocket = NIL_RTSOCKET;
+    if (RT_SUCCESS(RTTcpClientConnect("127.0.0.1", pThis->uPort, &hSocket)))
+        RTTcpClientCloseEx(hSocket, false /*fGracefulShutdown*/);
+
+    int rc = RTThreadWait(pThis->hThread, 60 * 1000, NULL);
+    if (RT_FAILURE(rc))
+        RTTestFailed(g_hTest, "Waiting for the target stub failed rc=%Rrc\n", rc);
+    RTMemFree(pThis->pbData);
+}
+
+
+/*******************************************************************************
+*   Testcases                                                                  *
+*******************************************************************************/
+
+/**
+ * Fills the buffer with a pattern depending on the disk offset.
+ */
+static void tstIScsiPatternFill(uint8_t *pb, size_t cb, uint64_t off, uint8_t bSeed)
+{
+    for (size_t i = 0; i < cb; i++)
+        pb[i] = (uint8_t)((off + i) * 13 + ((off + i) >> 9) + bSeed);
+}
+
+/**
+ * Writes, reads back and flushes the disk with the given parameters
+ * negotiated by the target stub.
+ */
+static void tstIScsiTest(PCTSTISCSIPARAMS pParams, uint8_t *pbRef, uint8_t *pbBuf)
+{
+    RTTestSub(g_hTest, pParams->pszDesc);
+
+    TSTISCSITARGET Target;
+    int rc = tstIScsiTargetStart(&Target, pParams);
+    if (RT_FAILURE(rc))
+        return;
+
+    char szAddress[32];
+    RTStrPrintf(szAddress, sizeof(szAddress), "127.0.0.1:%u", Target.uPort);
+    TSTISCSICFGKEY aKeys[] =
+    {
+        { "TargetName",     "iqn.2013-01.org.virtualbox:tstvdiscsi" },
+        { "InitiatorName",  "iqn.2013-01.org.virtualbox:tstvdiscsi-initiator" },
+        { "TargetAddress",  szAddress },
+        { "LUN",            "0" },
+        { NULL,             NULL }
+    };
+
+    VDINTERFACECONFIG IfConfig;
+    IfConfig.pfnAreKeysValid = tstIScsiCfgAreKeysValid;
+    IfConfig.pfnQuerySize    = tstIScsiCfgQuerySize;
+    IfConfig.pfnQuery        = tstIScsiCfgQuery;
+
+    VDINTERFACETCPNET IfTcpNet;
+    IfTcpNet.pfnSocketCreate      = tstIScsiTcpSocketCreate;
+    IfTcpNet.pfnSocketDestroy     = tstIScsiTcpSocketDestroy;
+    IfTcpNet.pfnClientConnect     = tstIScsiTcpClientConnect;
+    IfTcpNet.pfnClientClose       = tstIScsiTcpClientClose;
+    IfTcpNet.pfnIsClientConnected = tstIScsiTcpIsClientConnected;
+    IfTcpNet.pfnSelectOne         = tstIScsiTcpSelectOne;
+    IfTcpNet.pfnRead              = tstIScsiTcpRead;
+    IfTcpNet.pfnWrite             = tstIScsiTcpWrite;
+    IfTcpNet.pfnSgWrite           = tstIScsiTcpSgWrite;
+    IfTcpNet.pfnReadNB            = tstIScsiTcpReadNB;
+    IfTcpNet.pfnWriteNB           = tstIScsiTcpWriteNB;
+    IfTcpNet.pfnSgWriteNB         = tstIScsiTcpSgWriteNB;
+    IfTcpNet.pfnFlush             = tstIScsiTcpFlush;
+    IfTcpNet.pfnSetSendCoalescing = tstIScsiTcpSetSendCoalescing;
+    IfTcpNet.pfnGetLocalAddress   = tstIScsiTcpGetLocalAddress;
+    IfTcpNet.pfnGetPeerAddress    = tstIScsiTcpGetPeerAddress;
+    IfTcpNet.pfnSelectOneEx       = tstIScsiTcpSelectOneEx;
+    IfTcpNet.pfnPoke              = tstIScsiTcpPoke;
+
+    PVDINTERFACE pVDIfsImage = NULL;
+    rc = VDInterfaceAdd(&IfConfig.Core, "tstVDIScsi_Config", VDINTERFACETYPE_CONFIG,
+                        aKeys, sizeof(VDINTERFACECONFIG), &pVDIfsImage);
+    AssertRC(rc);
+    rc = VDInterfaceAdd(&IfTcpNet.Core, "tstVDIScsi_TcpNet", VDINTERFACETYPE_TCPNET,
+                        NULL, sizeof(VDINTERFACETCPNET), &pVDIfsImage);
+    AssertRC(rc);
+
+    memset(pbRef, 0, TSTISCSI_DISK_SIZE);
+
+    PVBOXHDD pDisk = NULL;
+    rc = VDCreate(NULL, VDTYPE_HDD, &pDisk);
+    if (RT_SUCCESS(rc))
+    {
+        rc = VDOpen(pDisk, "iSCSI", "tstVDIScsi", VD_OPEN_FLAGS_NORMAL, pVDIfsImage);
+        if (RT_SUCCESS(rc))
+        {
+            if (VDGetSize(pDisk, 0) != TSTISCSI_DISK_SIZE)
+                RTTestFailed(g_hTest, "Disk size is %llu, expected %u\n", VDGetSize(pDisk, 0), TSTISCSI_DISK_SIZE);
+
+            for (unsigned i = 0; i < RT_ELEMENTS(g_aWrites) && RT_SUCCESS(rc); i++)
+            {
+                tstIScsiPatternFill(pbRef + g_aWrites[i].off, g_aWrites[i].cb, g_aWrites[i].off, (uint8_t)i);
+                rc = VDWrite(pDisk, g_aWrites[i].off, pbRef + g_aWrites[i].off, g_aWrites[i].cb);
+                if (RT_FAILURE(rc))
+                    RTTestFailed(g_hTest, "Writing %zu bytes at %#llx failed rc=%Rrc\n",
+                                 g_aWrites[i].cb, g_aWrites[i].off, rc);
+            }
+
+            if (RT_SUCCESS(rc))
+            {
+                rc = VDFlush(pDisk);
+                if (RT_FAILURE(rc))
+                    RTTestFailed(g_hTest, "Flushing the disk failed rc=%Rrc\n", rc);
+
+                rc = VDRead(pDisk, 0, pbBuf, TSTISCSI_DISK_SIZE);
+                if (RT_FAILURE(rc))
+                    RTTestFailed(g_hTest, "Reading the disk failed rc=%Rrc\n", rc);
+                else if (memcmp(pbBuf, pbRef, TSTISCSI_DISK_SIZE))
+                    RTTestFailed(g_hTest, "Data read back doesn't match the data written\n");
+            }
+
+            VDClose(pDisk, false /* fDelete */);
+        }
+        else
+            RTTestFailed(g_hTest, "Opening the disk failed rc=%Rrc\n", rc);
+        VDDestroy(pDisk);
+    }
+    else
+        RTTestFailed(g_hTest, "Creating the disk container failed rc=%Rrc\n", rc);
+
+    tstIScsiTargetStop(&Target);
+
+    /*
+     * The stub checked every PDU already, make sure the data landed in the
+     * right place and everything beyond the immediate data was solicited.
+     */
+    if (RT_SUCCESS(rc))
+    {
+        if (memcmp(Target.pbDisk, pbRef, TSTISCSI_DISK_SIZE))
+            RTTestFailed(g_hTest, "The disk of the target stub doesn't match the data written\n");
+        if (!Target.cR2Ts || !Target.cDataOut)
+            RTTestFailed(g_hTest, "The target stub didn't solicit any data (%u R2Ts, %u Data-Out PDUs)\n",
+                         Target.cR2Ts, Target.cDataOut);
+        if (Target.cR2TsOutstandingMax != pParams->cMaxOutstandingR2T)
+            RTTestFailed(g_hTest, "At most %u R2Ts were outstanding, expected %u\n",
+                         Target.cR2TsOutstandingMax, pParams->cMaxOutstandingR2T);
+        if (Target.cbDataOutMax != pParams->cbMaxRecvDataSegment)
+            RTTestFailed(g_hTest, "The biggest Data-Out PDU has %u bytes, expected %u\n",
+                         Target.cbDataOutMax, pParams->cbMaxRecvDataSegment);
+        if (!Target.cFlushes)
+            RTTestFailed(g_hTest, "The target stub didn't see a flush\n");
+        if (!Target.fLoggedOut)
+            RTTestFailed(g_hTest, "The initiator didn't log out\n");
+        RTTestPrintf(g_hTest, RTTESTLVL_ALWAYS, "%u writes, %u R2Ts, %u Data-Out PDUs\n",
+                     Target.cWrites, Target.cR2Ts, Target.cDataOut);
+    }
+    RTMemFree(Target.pbDisk);
+}
+
+int main(int argc, char *argv[])
+{
+    RTEXITCODE rcExit = RTTestInitAndCreate("tstVDIScsi", &g_hTest);
+    if (rcExit != RTEXITCODE_SUCCESS)
+        return rcExit;
+    RTTestBanner(g_hTest);
+
+    int rc = VDInit();
+    if (RT_FAILURE(rc))
+    {
+        RTTestFailed(g_hTest, "Initializing the VD library failed rc=%Rrc\n", rc);
+        return RTTestSummaryAndDestroy(g_hTest);
+    }
+
+    uint8_t *pbRef = (uint8_t *)RTMemAlloc(TSTISCSI_DISK_SIZE);
+    uint8_t *pbBuf = (uint8_t *)RTMemAlloc(TSTISCSI_DISK_SIZE);
+    if (pbRef && pbBuf)
+    {
+        for (unsigned i = 0; i < RT_ELEMENTS(g_aParams); i++)
+            tstIScsiTest(&g_aParams[i], pbRef, pbBuf);
+    }
+    else
+        RTTestFailed(g_hTest, "Out of memory\n");
+    RTMemFree(pbRef);
+    RTMemFree(pbBuf);
+
+    rc = VDShutdown();
+    if (RT_FAILURE(rc))
+        RTTestFailed(g_hTest, "Unloading backends failed! rc=%Rrc\n", rc);
+
+    return RTTestSummaryAndDestroy(g_hTest);
+}
@@ -32,6 +32,8 @@
 #include <iprt/thread.h>
 #include <iprt/rand.h>
 #include <iprt/critsect.h>
+#include <iprt/sort.h>
+#include <iprt/test.h>
 
 #include "VDMemDisk.h"
 #include "VDIoBackend.h"
@@ -115,6 +117,39 @@ typedef struct VDPATTERN
     void          *pvPattern;
 } VDPATTERN, *PVDPATTERN;
 
+/**
+ * Results of the last I/O test run.
+ */
+typedef struct VDIOTESTRESULT
+{
+    /** Flag whether the result is valid. */
+    bool             fValid;
+    /** Number of bytes transfered. */
+    uint64_t         cbIo;
+    /** Number of nanoseconds the test took. */
+    uint64_t         cNsElapsed;
+    /** Number of read requests. */
+    uint64_t         cReqsRead;
+    /** Number of write requests. */
+    uint64_t         cReqsWrite;
+    /** Number of latency samples the values below are based on. */
+    uint32_t         cLatencySamples;
+    /** Minimum request latency in nanoseconds. */
+    uint64_t         cNsLatencyMin;
+    /** Average request latency in nanoseconds. */
+    uint64_t         cNsLatencyAvg;
+    /** Maximum request latency in nanoseconds. */
+    uint64_t         cNsLatencyMax;
+    /** 50th percentile of the request latency in nanoseconds. */
+    uint64_t         cNsLatencyP50;
+    /** 90th percentile of the request latency in nanoseconds. */
+    uint64_t         cNsLatencyP90;
+    /** 99th percentile of the request latency in nanoseconds. */
+    uint64_t         cNsLatencyP99;
+    /** 99.9th percentile of the request latency in nanoseconds. */
+    uint64_t         cNsLatencyP999;
+} VDIOTESTRESULT, *PVDIOTESTRESULT;
+
 /**
  * Global VD test state.
  */
@@ -140,6 +175,10 @@ typedef struct VDTESTGLOB
     PVDIORND         pIoRnd;
     /** Current storage backend to use. */
     char            *pszIoBackend;
+    /** The test handle used for reporting results. */
+    RTTEST           hTest;
+    /** Results of the last I/O test. */
+    VDIOTESTRESULT   IoResultLast;
 } VDTESTGLOB, *PVDTESTGLOB;
 
 /**
@@ -176,6 +215,10 @@ typedef struct VDIOREQ
     void          *pvBufRead;
     /** Opaque user data. */
     void          *pvUser;
+    /** The I/O test the request belongs to. */
+    struct VDIOTEST *pIoTest;
+    /** Timestamp when the request was submitted in nanoseconds. */
+    uint64_t      tsStart;
 } VDIOREQ, *PVDIOREQ;
 
 /**
@@ -199,6 +242,16 @@ typedef struct VDIOTEST
     PVDIORND    pIoRnd;
     /** Pointer to the data pattern to use. */
     PVDPATTERN  pPattern;
+    /** Number of read requests submitted. */
+    uint64_t    cReqsRead;
+    /** Number of write requests submitted. */
+    uint64_t    cReqsWrite;
+    /** Number of entries in the latency array. */
+    uint32_t    cLatencySamplesMax;
+    /** Number of latencies recorded so far, may exceed cLatencySamplesMax. */
+    volatile uint32_t cLatencySamples;
+    /** Request latencies in nanoseconds. */
+    uint64_t   *pau64Latencies;
     /** Data dependent on the I/O mode (sequential or random). */
     union
     {
@@ -223,6 +276,7 @@ static DECLCALLBACK(int) vdScriptHandlerIo(PVDSCRIPTARG paScriptArgs, void *pvUs
 static DECLCALLBACK(int) vdScriptHandlerFlush(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerMerge(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerCompact(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerDefragment(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerDiscard(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerCopy(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerClose(PVDSCRIPTARG paScriptArgs, void *pvUser);
@@ -244,6 +298,8 @@ static DECLCALLBACK(int) vdScriptHandlerShowStatistics(PVDSCRIPTARG paScriptArgs
 static DECLCALLBACK(int) vdScriptHandlerResetStatistics(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerResize(PVDSCRIPTARG paScriptArgs, void *pvUser);
 static DECLCALLBACK(int) vdScriptHandlerSetFileBackend(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerTestSub(PVDSCRIPTARG paScriptArgs, void *pvUser);
+static DECLCALLBACK(int) vdScriptHandlerReportIo(PVDSCRIPTARG paScriptArgs, void *pvUser);
 
 /* create action */
 const VDSCRIPTTYPE g_aArgCreate[] =
@@ -307,6 +363,14 @@ const VDSCRIPTTYPE g_aArgCompact[] =
     VDSCRIPTTYPE_UINT32  /* image */
 };
 
+/* Defragment a disk */
+const VDSCRIPTTYPE g_aArgDefragment[] =
+{
+    VDSCRIPTTYPE_STRING, /* disk */
+    VDSCRIPTTYPE_UINT32, /* image */
+    VDSCRIPTTYPE_UINT64  /* limit */
+};
+
 /* Discard a part of a disk */
 const VDSCRIPTTYPE g_aArgDiscard[] =
 {
@@ -450,6 +514,18 @@ const VDSCRIPTTYPE g_aArgSetFileBackend[] =
     VDSCRIPTTYPE_STRING /* new file backend */
 };
 
+/* Start a new sub test. */
+const VDSCRIPTTYPE g_aArgTestSub[] =
+{
+    VDSCRIPTTYPE_STRING /* name */
+};
+
+/* Report the results of the last I/O test. */
+const VDSCRIPTTYPE g_aArgReportIo[] =
+{
+    VDSCRIPTTYPE_STRING /* name */
+};
+
 const VDSCRIPTCALLBACK g_aScriptActions[] =
 {
     /* pcszFnName                  enmTypeReturn      paArgDesc                          cArgDescs                                      pfnHandler */
@@ -462,6 +538,7 @@ const VDSCRIPTCALLBACK g_aScriptActions[] =
     {"ioreplay",                   VDSCRIPTTYPE_VOID, g_aArgIoLogReplay,                 RT_ELEMENTS(g_aArgIoLogReplay),                vdScriptHandlerIoLogReplay},
     {"merge",                      VDSCRIPTTYPE_VOID, g_aArgMerge,                       RT_ELEMENTS(g_aArgMerge),                      vdScriptHandlerMerge},
     {"compact",                    VDSCRIPTTYPE_VOID, g_aArgCompact,                     RT_ELEMENTS(g_aArgCompact),                    vdScriptHandlerCompact},
+    {"defragment",                 VDSCRIPTTYPE_VOID, g_aArgDefragment,                  RT_ELEMENTS(g_aArgDefragment),                 vdScriptHandlerDefragment},
     {"discard",                    VDSCRIPTTYPE_VOID, g_aArgDiscard,                     RT_ELEMENTS(g_aArgDiscard),                    vdScriptHandlerDiscard},
     {"copy",                       VDSCRIPTTYPE_VOID, g_aArgCopy,                        RT_ELEMENTS(g_aArgCopy),                       vdScriptHandlerCopy},
     {"iorngcreate",                VDSCRIPTTYPE_VOID, g_aArgIoRngCreate,                 RT_ELEMENTS(g_aArgIoRngCreate),                vdScriptHandlerIoRngCreate},
@@ -480,6 +557,8 @@ const VDSCRIPTCALLBACK g_aScriptActions[] =
     {"resetstatistics",            VDSCRIPTTYPE_VOID, g_aArgResetStatistics,             RT_ELEMENTS(g_aArgResetStatistics),            vdScriptHandlerResetStatistics},
     {"resize",                     VDSCRIPTTYPE_VOID, g_aArgResize,                      RT_ELEMENTS(g_aArgResize),                     vdScriptHandlerResize},
     {"setfilebackend",             VDSCRIPTTYPE_VOID, g_aArgSetFileBackend,              RT_ELEMENTS(g_aArgSetFileBackend),             vdScriptHandlerSetFileBackend},
+    {"testsub",                    VDSCRIPTTYPE_VOID, g_aArgTestSub,                     RT_ELEMENTS(g_aArgTestSub),                    vdScriptHandlerTestSub},
+    {"reportio",                   VDSCRIPTTYPE_VOID, g_aArgReportIo,                    RT_ELEMENTS(g_aArgReportIo),                   vdScriptHandlerReportIo},
 };
 
 const unsigned g_cScriptActions = RT_ELEMENTS(g_aScriptActions);
@@ -513,6 +592,8 @@ static void tstVDIoTestDestroy(PVDIOTEST pIoTest);
 static bool tstVDIoTestReqOutstanding(PVDIOREQ pIoReq);
 static int  tstVDIoTestReqInit(PVDIOTEST pIoTest, PVDIOREQ pIoReq, void *pvUser);
 static void tstVDIoTestReqComplete(void *pvUser1, void *pvUser2, int rcReq);
+static void tstVDIoTestReqLatencyRecord(PVDIOREQ pIoReq);
+static void tstVDIoTestResultCalc(PVDIOTEST pIoTest, uint64_t cbIo, uint64_t cNsElapsed, PVDIOTESTRESULT pResult);
 
 static PVDDISK tstVDIoGetDiskByName(PVDTESTGLOB pGlob, const char *pcszDisk);
 static PVDPATTERN tstVDIoGetPatternByName(PVDTESTGLOB pGlob, const char *pcszName);
@@ -797,6 +878,8 @@ static DECLCALLBACK(int) vdScriptHandlerIo(PVDSCRIPTARG paScriptArgs, void *pvUs
                                             AssertMsgFailed(("Invalid\n"));
                                     }
 
+                                    if (RT_SUCCESS(rc))
+                                        tstVDIoTestReqLatencyRecord(&paIoReq[idx]);
                                     ASMAtomicXchgBool(&paIoReq[idx].fOutstanding, false);
                                     if (RT_SUCCESS(rc))
                                         idx++;
@@ -836,6 +919,7 @@ static DECLCALLBACK(int) vdScriptHandlerIo(PVDSCRIPTARG paScriptArgs, void *pvUs
                                     else if (rc == VINF_VD_ASYNC_IO_FINISHED)
                                     {
                                         LogFlow(("Request %d completed\n", idx));
+                                        tstVDIoTestReqLatencyRecord(&paIoReq[idx]);
                                         switch (paIoReq[idx].enmTxDir)
                                         {
                                             case VDIOREQTXDIR_READ:
@@ -924,6 +1008,19 @@ static DECLCALLBACK(int) vdScriptHandlerIo(PVDSCRIPTARG paScriptArgs, void *pvUs
                 uint64_t SpeedKBs = (uint64_t)(cbIo / (NanoTS / 1000000000.0) / 1024);
                 RTPrintf("I/O Test: Throughput %lld kb/s\n", SpeedKBs);
 
+                PVDIOTESTRESULT pResult = &pGlob->IoResultLast;
+                tstVDIoTestResultCalc(&IoTest, cbIo, NanoTS, pResult);
+                if (pResult->cLatencySamples)
+                    RTPrintf("I/O Test: %llu IOPS (%llu reads, %llu writes)\n"
+                             "          latency min/avg/max %llu/%llu/%llu us\n"
+                             "          latency p50/p90/p99/p99.9 %llu/%llu/%llu/%llu us\n",
+                             (pResult->cReqsRead + pResult->cReqsWrite) * RT_NS_1SEC / RT_MAX(NanoTS, 1),
+                             pResult->cReqsRead, pResult->cReqsWrite,
+                             pResult->cNsLatencyMin / RT_NS_1US, pResult->cNsLatencyAvg / RT_NS_1US,
+                             pResult->cNsLatencyMax / RT_NS_1US, pResult->cNsLatencyP50 / RT_NS_1US,
+                             pResult->cNsLatencyP90 / RT_NS_1US, pResult->cNsLatencyP99 / RT_NS_1US,
+                             pResult->cNsLatencyP999 / RT_NS_1US);
+
                 RTSemEventDestroy(EventSem);
                 RTMemFree(paIoReq);
             }
@@ -1036,6 +1133,28 @@ static DECLCALLBACK(int) vdScriptHandlerCompact(PVDSCRIPTARG paScriptArgs, void
     return rc;
 }
 
+static DECLCALLBACK(int) vdScriptHandlerDefragment(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+    const char *pcszDisk = NULL;
+    PVDDISK pDisk = NULL;
+    unsigned nImage = 0;
+    uint64_t cbPerSecMax = 0;
+
+    pcszDisk    = paScriptArgs[0].psz;
+    nImage      = paScriptArgs[1].u32;
+    cbPerSecMax = paScriptArgs[2].u64;
+
+    pDisk = tstVDIoGetDiskByName(pGlob, pcszDisk);
+    if (!pDisk)
+        rc = VERR_NOT_FOUND;
+    else
+        rc = VDDefragment(pDisk->pVD, nImage, cbPerSecMax, NULL);
+
+    return rc;
+}
+
 static DECLCALLBACK(int) vdScriptHandlerDiscard(PVDSCRIPTARG paScriptArgs, void *pvUser)
 {
     int rc = VINF_SUCCESS;
@@ -1290,7 +1409,7 @@ static DECLCALLBACK(int) vdScriptHandlerCopy(PVDSCRIPTARG paScriptArgs, void *pv
          */
         rc = VDCopyEx(pDiskFrom->pVD, nImageFrom, pDiskTo->pVD, pcszBackend, pcszFilename,
                       fMoveByRename, cbSize, nImageFromSame, nImageToSame,
-                      VD_IMAGE_FLAGS_NONE, NULL, VD_OPEN_FLAGS_ASYNC_IO,
+                      0 /* cCopyBufs */, 0 /* cbCopyBuf */, VD_IMAGE_FLAGS_NONE, NULL, VD_OPEN_FLAGS_ASYNC_IO,
                       NULL, pGlob->pInterfacesImages, NULL);
     }
 
@@ -2018,6 +2137,49 @@ static DECLCALLBACK(int) vdScriptHandlerSetFileBackend(PVDSCRIPTARG paScriptArgs
     return rc;
 }
 
+static DECLCALLBACK(int) vdScriptHandlerTestSub(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+
+    return RTTestSub(pGlob->hTest, paScriptArgs[0].psz);
+}
+
+static DECLCALLBACK(int) vdScriptHandlerReportIo(PVDSCRIPTARG paScriptArgs, void *pvUser)
+{
+    int rc = VINF_SUCCESS;
+    PVDTESTGLOB pGlob = (PVDTESTGLOB)pvUser;
+    PVDIOTESTRESULT pResult = &pGlob->IoResultLast;
+    const char *pcszName = paScriptArgs[0].psz;
+
+    if (pResult->fValid)
+    {
+        uint64_t cNsElapsed = RT_MAX(pResult->cNsElapsed, 1);
+        RTTEST hTest = pGlob->hTest;
+
+        RTTestValueF(hTest, (pResult->cReqsRead + pResult->cReqsWrite) * RT_NS_1SEC / cNsElapsed,
+                     RTTESTUNIT_OCCURRENCES_PER_SEC, "%s IOPS", pcszName);
+        RTTestValueF(hTest, (uint64_t)(pResult->cbIo / (cNsElapsed / 1000000000.0) / _1K),
+                     RTTESTUNIT_KILOBYTES_PER_SEC, "%s throughput", pcszName);
+        if (pResult->cLatencySamples)
+        {
+            RTTestValueF(hTest, pResult->cNsLatencyMin,  RTTESTUNIT_NS, "%s latency min", pcszName);
+            RTTestValueF(hTest, pResult->cNsLatencyAvg,  RTTESTUNIT_NS, "%s latency avg", pcszName);
+            RTTestValueF(hTest, pResult->cNsLatencyMax,  RTTESTUNIT_NS, "%s latency max", pcszName);
+            RTTestValueF(hTest, pResult->cNsLatencyP50,  RTTESTUNIT_NS, "%s latency p50", pcszName);
+            RTTestValueF(hTest, pResult->cNsLatencyP90,  RTTESTUNIT_NS, "%s latency p90", pcszName);
+            RTTestValueF(hTest, pResult->cNsLatencyP99,  RTTESTUNIT_NS, "%s latency p99", pcszName);
+            RTTestValueF(hTest, pResult->cNsLatencyP999, RTTESTUNIT_NS, "%s latency p99.9", pcszName);
+        }
+    }
+    else
+    {
+        RTPrintf("No I/O test results to report for '%s'\n", pcszName);
+        rc = VERR_INVALID_STATE;
+    }
+
+    return rc;
+}
+
 static DECLCALLBACK(int) tstVDIoFileOpen(void *pvUser, const char *pszLocation,
                                          uint32_t fOpen,
                                          PFNVDCOMPLETED pfnCompleted,
@@ -2370,6 +2532,21 @@ static int tstVDIoTestInit(PVDIOTEST pIoTest, PVDTESTGLOB pGlob, bool fRandomAcc
     else
         pIoTest->u.offNext = pIoTest->offEnd < pIoTest->offStart ? pIoTest->offStart - cbBlkSize : offStart;
 
+    if (RT_SUCCESS(rc))
+    {
+        /* One latency sample per request. */
+        uint64_t cReqs = cbIo / cbBlkSize + ((cbIo % cbBlkSize) ? 1 : 0);
+
+        pIoTest->cLatencySamplesMax = (uint32_t)RT_MIN(cReqs, UINT32_MAX);
+        pIoTest->pau64Latencies = (uint64_t *)RTMemAlloc(pIoTest->cLatencySamplesMax * sizeof(uint64_t));
+        if (!pIoTest->pau64Latencies)
+        {
+            /* Statistics are optional, the test still works without them. */
+            RTPrintf("Not enough memory for latency statistics, skipping\n");
+            pIoTest->cLatencySamplesMax = 0;
+        }
+    }
+
     return rc;
 }
 
@@ -2377,6 +2554,91 @@ static void tstVDIoTestDestroy(PVDIOTEST pIoTest)
 {
     if (pIoTest->fRandomAccess)
         RTMemFree(pIoTest->u.Rnd.pbMapAccessed);
+    RTMemFree(pIoTest->pau64Latencies);
+}
+
+/**
+ * Records the latency of the given request, called when the request completed.
+ *
+ * @returns nothing.
+ * @param   pIoReq    The completed request.
+ */
+static void tstVDIoTestReqLatencyRecord(PVDIOREQ pIoReq)
+{
+    PVDIOTEST pIoTest = pIoReq->pIoTest;
+    uint64_t cNsLatency = RTTimeNanoTS() - pIoReq->tsStart;
+    uint32_t idxSample = ASMAtomicIncU32(&pIoTest->cLatencySamples) - 1;
+
+    if (idxSample < pIoTest->cLatencySamplesMax)
+        pIoTest->pau64Latencies[idxSample] = cNsLatency;
+}
+
+static DECLCALLBACK(int) tstVDIoTestLatencyCmp(void const *pvElement1, void const *pvElement2, void *pvUser)
+{
+    uint64_t u64Latency1 = *(const uint64_t *)pvElement1;
+    uint64_t u64Latency2 = *(const uint64_t *)pvElement2;
+
+    NOREF(pvUser);
+    if (u64Latency1 < u64Latency2)
+        return -1;
+    if (u64Latency1 > u64Latency2)
+        return 1;
+    return 0;
+}
+
+/**
+ * Returns the given percentile from a sorted latency array.
+ *
+ * @returns Latency in nanoseconds.
+ * @param   pau64Latencies    Sorted latency array.
+ * @param   cLatencies        Number of entries in the array, must not be 0.
+ * @param   uPerMille         The percentile in parts per thousand.
+ */
+static uint64_t tstVDIoTestLatencyPercentile(uint64_t *pau64Latencies, uint32_t cLatencies, unsigned uPerMille)
+{
+    uint64_t idx = (uint64_t)cLatencies * uPerMille / 1000;
+
+    return pau64Latencies[RT_MIN(idx, cLatencies - 1)];
+}
+
+/**
+ * Calculates the results of a finished I/O test.
+ *
+ * @returns nothing.
+ * @param   pIoTest       The I/O test.
+ * @param   cbIo          Number of bytes transfered.
+ * @param   cNsElapsed    Number of nanoseconds the test took.
+ * @param   pResult       Where to store the results.
+ */
+static void tstVDIoTestResultCalc(PVDIOTEST pIoTest, uint64_t cbIo, uint64_t cNsElapsed, PVDIOTESTRESULT pResult)
+{
+    uint32_t cLatencies = RT_MIN(pIoTest->cLatencySamples, pIoTest->cLatencySamplesMax);
+
+    RT_ZERO(*pResult);
+    pResult->fValid          = true;
+    pResult->cbIo            = cbIo;
+    pResult->cNsElapsed      = cNsElapsed;
+    pResult->cReqsRead       = pIoTest->cReqsRead;
+    pResult->cReqsWrite      = pIoTest->cReqsWrite;
+    pResult->cLatencySamples = cLatencies;
+
+    if (cLatencies)
+    {
+        uint64_t *pau64Latencies = pIoTest->pau64Latencies;
+        uint64_t cNsTotal = 0;
+
+        RTSortShell(pau64Latencies, cLatencies, sizeof(uint64_t), tstVDIoTestLatencyCmp, NULL);
+        for (uint32_t i = 0; i < cLatencies; i++)
+            cNsTotal += pau64Latencies[i];
+
+        pResult->cNsLatencyMin  = pau64Latencies[0];
+        pResult->cNsLatencyMax  = pau64Latencies[cLatencies - 1];
+        pResult->cNsLatencyAvg  = cNsTotal / cLatencies;
+        pResult->cNsLatencyP50  = tstVDIoTestLatencyPercentile(pau64Latencies, cLatencies, 500);
+        pResult->cNsLatencyP90  = tstVDIoTestLatencyPercentile(pau64Latencies, cLatencies, 900);
+        pResult->cNsLatencyP99  = tstVDIoTestLatencyPercentile(pau64Latencies, cLatencies, 990);
+        pResult->cNsLatencyP999 = tstVDIoTestLatencyPercentile(pau64Latencies, cLatencies, 999);
+    }
 }
 
 static bool tstVDIoTestRunning(PVDIOTEST pIoTest)
@@ -2410,6 +2672,10 @@ static int tstVDIoTestReqInit(PVDIOTEST pIoTest, PVDIOREQ pIoReq, void *pvUser)
     {
         /* Read or Write? */
         pIoReq->enmTxDir = tstVDIoTestIsTrue(pIoTest, pIoTest->uWriteChance) ? VDIOREQTXDIR_WRITE : VDIOREQTXDIR_READ;
+        if (pIoReq->enmTxDir == VDIOREQTXDIR_WRITE)
+            pIoTest->cReqsWrite++;
+        else
+            pIoTest->cReqsRead++;
         pIoReq->cbReq = RT_MIN(pIoTest->cbBlkIo, pIoTest->cbIo);
         pIoTest->cbIo -= pIoReq->cbReq;
         pIoReq->DataSeg.cbSeg = pIoReq->cbReq;
@@ -2487,7 +2753,9 @@ static int tstVDIoTestReqInit(PVDIOTEST pIoTest, PVDIOREQ pIoReq, void *pvUser)
                 }
             }
             pIoReq->pvUser = pvUser;
+            pIoReq->pIoTest = pIoTest;
             pIoReq->fOutstanding = true;
+            pIoReq->tsStart = RTTimeNanoTS();
         }
     }
     else
@@ -2503,6 +2771,8 @@ static void tstVDIoTestReqComplete(void *pvUser1, void *pvUser2, int rcReq)
     PVDDISK pDisk = (PVDDISK)pIoReq->pvUser;
 
     LogFlow(("Request %d completed\n", pIoReq->idx));
+    if (RT_SUCCESS(rcReq))
+        tstVDIoTestReqLatencyRecord(pIoReq);
 
     if (pDisk->pMemDiskVerify)
     {
@@ -2652,8 +2922,9 @@ static int tstVDIoPatternGetBuffer(PVDPATTERN pPattern, void **ppv, size_t cb)
  * @returns nothing.
  *
  * @param pcszFilename    The script to execute.
+ * @param hTest           The test handle to report results and failures to.
  */
-static void tstVDIoScriptRun(const char *pcszFilename)
+static void tstVDIoScriptRun(const char *pcszFilename, RTTEST hTest)
 {
     int rc = VINF_SUCCESS;
     VDTESTGLOB GlobTest;   /**< Global test data. */
@@ -2664,6 +2935,7 @@ static void tstVDIoScriptRun(const char *pcszFilename)
     RTListInit(&GlobTest.ListFiles);
     RTListInit(&GlobTest.ListDisks);
     RTListInit(&GlobTest.ListPatterns);
+    GlobTest.hTest = hTest;
     GlobTest.pszIoBackend = RTStrDup("memory");
     if (!GlobTest.pszIoBackend)
     {
@@ -2719,19 +2991,23 @@ static void tstVDIoScriptRun(const char *pcszFilename)
                 rc = VDScriptCtxLoadScript(hScriptCtx, pszScript);
                 if (RT_FAILURE(rc))
                 {
-                    RTPrintf("Loading the script failed rc=%Rrc\n", rc);
+                    RTTestFailed(hTest, "Loading the script failed rc=%Rrc\n", rc);
                 }
                 else
+                {
                     rc = VDScriptCtxCallFn(hScriptCtx, "main", NULL, 0);
+                    if (RT_FAILURE(rc))
+                        RTTestFailed(hTest, "Executing the script failed rc=%Rrc\n", rc);
+                }
                 VDScriptCtxDestroy(hScriptCtx);
             }
             VDIoBackendDestroy(GlobTest.pIoBackend);
         }
         else
-            RTPrintf("Creating the I/O backend failed rc=%Rrc\n");
+            RTTestFailed(hTest, "Creating the I/O backend failed rc=%Rrc\n", rc);
     }
     else
-        RTPrintf("Opening script failed rc=%Rrc\n", rc);
+        RTTestFailed(hTest, "Opening script failed rc=%Rrc\n", rc);
 
     RTStrFree(GlobTest.pszIoBackend);
 }
@@ -2742,7 +3018,10 @@ static void tstVDIoScriptRun(const char *pcszFilename)
 static void printUsage(void)
 {
     RTPrintf("Usage:\n"
-             "--script <filename>    Script to execute\n");
+             "--script <filename>    Script to execute\n"
+             "\n"
+             "Results reported by the script are written as XML to the file given\n"
+             "in the IPRT_TEST_FILE environment variable.\n");
 }
 
 static const RTGETOPTDEF g_aOptions[] =
@@ -2752,7 +3031,11 @@ static const RTGETOPTDEF g_aOptions[] =
 
 int main(int argc, char *argv[])
 {
-    RTR3InitExe(argc, &argv, 0);
+    RTTEST hTest;
+    RTEXITCODE rcExit = RTTestInitAndCreate("tstVDIo", &hTest);
+    if (rcExit != RTEXITCODE_SUCCESS)
+        return rcExit;
+
     int rc;
     RTGETOPTUNION ValueUnion;
     RTGETOPTSTATE GetState;
@@ -2761,12 +3044,18 @@ int main(int argc, char *argv[])
     if (argc != 3)
     {
         printUsage();
+        RTTestDestroy(hTest);
         return RTEXITCODE_FAILURE;
     }
 
+    RTTestBanner(hTest);
+
     rc = VDInit();
     if (RT_FAILURE(rc))
-        return RTEXITCODE_FAILURE;
+    {
+        RTTestFailed(hTest, "Initializing the VD library failed rc=%Rrc\n", rc);
+        return RTTestSummaryAndDestroy(hTest);
+    }
 
     RTGetOptInit(&GetState, argc, argv, g_aOptions,
                  RT_ELEMENTS(g_aOptions), 1, RTGETOPTINIT_FLAGS_NO_STD_OPTS);
@@ -2777,7 +3066,7 @@ int main(int argc, char *argv[])
         switch (c)
         {
             case 's':
-                tstVDIoScriptRun(ValueUnion.psz);
+                tstVDIoScriptRun(ValueUnion.psz, hTest);
                 break;
             default:
                 printUsage();
@@ -2786,8 +3075,8 @@ int main(int argc, char *argv[])
 
     rc = VDShutdown();
     if (RT_FAILURE(rc))
-        RTPrintf("tstVDIo: unloading backends failed! rc=%Rrc\n", rc);
+        RTTestFailed(hTest, "Unloading backends failed! rc=%Rrc\n", rc);
 
-    return RTEXITCODE_SUCCESS;
+    return RTTestSummaryAndDestroy(hTest);
 }
 
@@ -0,0 +1,630 @@
+/* $Id$ */
+/** @file
+ * Testcase for writing VHDX images, replaying their log and reading
+ * differencing images.
+ *
+ * The VHDX backend can't create images, so the testcase assembles minimal
+ * images itself.
+ */
+
+/*
+ * Copyright (C) 2013 Oracle Corporation
+ *
+ * This file is part of VirtualBox Open Source Edition (OSE), as
+ * available from http://www.virtualbox.org. This file is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software
+ * Foundation, in version 2 as it comes in the "COPYING" file of the
+ * VirtualBox OSE distribution. VirtualBox OSE is distributed in the
+ * hope that it will be useful, but WITHOUT ANY WARRANTY of any kind.
+ */
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#include <VBox/vd.h>
+#include <VBox/err.h>
+#include <iprt/asm.h>
+#include <iprt/crc.h>
+#include <iprt/file.h>
+#include <iprt/mem.h>
+#include <iprt/string.h>
+#include <iprt/test.h>
+#include <iprt/uuid.h>
+
+
+/*******************************************************************************
+*   Structures and Typedefs                                                    *
+*******************************************************************************/
+/* The on disk structures, see VHDX.cpp. All fields are little endian. */
+#pragma pack(1)
+typedef struct TSTVHDXHDR
+{
+    uint32_t    u32Signature;
+    uint32_t    u32Checksum;
+    uint64_t    u64SequenceNumber;
+    RTUUID      UuidFileWrite;
+    RTUUID      UuidDataWrite;
+    RTUUID      UuidLog;
+    uint16_t    u16LogVersion;
+    uint16_t    u16Version;
+    uint32_t    u32LogLength;
+    uint64_t    u64LogOffset;
+    uint8_t     u8Reserved[4016];
+} TSTVHDXHDR;
+
+typedef struct TSTVHDXREGIONENTRY
+{
+    RTUUID      UuidObject;
+    uint64_t    u64FileOffset;
+    uint32_t    u32Length;
+    uint32_t    u32Flags;
+} TSTVHDXREGIONENTRY;
+
+typedef struct TSTVHDXMETAENTRY
+{
+    RTUUID      UuidItem;
+    uint32_t    u32Offset;
+    uint32_t    u32Length;
+    uint32_t    u32Flags;
+    uint32_t    u32Reserved;
+} TSTVHDXMETAENTRY;
+
+typedef struct TSTVHDXLOGENTRYHDR
+{
+    uint32_t    u32Signature;
+    uint32_t    u32Checksum;
+    uint32_t    u32EntryLength;
+    uint32_t    u32Tail;
+    uint64_t    u64SequenceNumber;
+    uint32_t    u32DescriptorCount;
+    uint32_t    u32Reserved;
+    RTUUID      UuidLog;
+    uint64_t    u64FlushedFileOffset;
+    uint64_t    u64LastFileOffset;
+} TSTVHDXLOGENTRYHDR;
+
+/* Zero descriptors use the same layout with the length in place of the leading bytes. */
+typedef struct TSTVHDXLOGDESC
+{
+    uint32_t    u32Signature;
+    uint32_t    u32TrailingBytes;
+    uint64_t    u64LeadingBytesOrZeroLength;
+    uint64_t    u64FileOffset;
+    uint64_t    u64SequenceNumber;
+} TSTVHDXLOGDESC;
+#pragma pack()
+AssertCompileSize(TSTVHDXHDR, 4096);
+AssertCompileSize(TSTVHDXLOGENTRYHDR, 64);
+AssertCompileSize(TSTVHDXLOGDESC, 32);
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+#define TSTVHDX_DISK_SIZE       (8 * _1M)
+#define TSTVHDX_BLOCK_SIZE      _1M
+#define TSTVHDX_SECTOR_SIZE     512
+/** Sector bitmap bytes per payload block. */
+#define TSTVHDX_BITMAP_SIZE     (TSTVHDX_BLOCK_SIZE / TSTVHDX_SECTOR_SIZE / 8)
+/** Payload blocks covered by a sector bitmap block. */
+#define TSTVHDX_CHUNK_RATIO     ((UINT32_C(1) << 23) * TSTVHDX_SECTOR_SIZE / TSTVHDX_BLOCK_SIZE)
+
+/* The file layout, the payload blocks follow the BAT. */
+#define TSTVHDX_OFF_HDR1        _64K
+#define TSTVHDX_OFF_HDR2        _128K
+#define TSTVHDX_OFF_REGION_TBL  (192 * _1K)
+#define TSTVHDX_OFF_LOG         _1M
+#define TSTVHDX_OFF_METADATA    (2 * _1M)
+#define TSTVHDX_OFF_BAT         (3 * _1M)
+#define TSTVHDX_OFF_PAYLOAD     (4 * _1M)
+
+#define TSTVHDX_BAT_FULLY_PRESENT       UINT64_C(6)
+#define TSTVHDX_BAT_PARTIALLY_PRESENT   UINT64_C(7)
+#define TSTVHDX_BAT_SB_PRESENT          UINT64_C(6)
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+static RTTEST g_hTest;
+
+
+/**
+ * Writes the given buffer to the file, failing the test on errors.
+ */
+static int tstVhdxWriteAt(RTFILE hFile, uint64_t off, const void *pv, size_t cb)
+{
+    int rc = RTFileWriteAt(hFile, off, pv, cb, NULL);
+    if (RT_FAILURE(rc))
+        RTTestFailed(g_hTest, "Writing %zu bytes at %#llx failed rc=%Rrc\n", cb, off, rc);
+    return rc;
+}
+
+/**
+ * Fills a buffer with a pattern depending on the offset and a seed.
+ */
+static void tstVhdxPatternFill(uint8_t *pb, size_t cb, uint64_t off, uint8_t bSeed)
+{
+    for (size_t i = 0; i < cb; i++)
+        pb[i] = (uint8_t)((off + i) / TSTVHDX_SECTOR_SIZE) ^ bSeed;
+}
+
+/**
+ * Adds an UTF-16 string without terminator to a buffer.
+ *
+ * @returns Number of bytes added.
+ */
+static uint16_t tstVhdxAddUtf16(uint8_t *pb, const char *psz)
+{
+    size_t cch = strlen(psz);
+    for (size_t i = 0; i < cch; i++)
+        ((PRTUTF16)pb)[i] = RT_H2LE_U16((RTUTF16)psz[i]);
+    return (uint16_t)(cch * sizeof(RTUTF16));
+}
+
+/**
+ * Assembles a VHDX image with no payload blocks present.
+ *
+ * @returns IPRT status code.
+ * @param   pszFilename     The image to create.
+ * @param   pUuidDataWrite  The data write UUID of the image.
+ * @param   pszParent       The parent image for differencing images, NULL for base images.
+ * @param   pUuidParent     The data write UUID of the parent.
+ * @param   pUuidLog        The log UUID, NULL if the log is empty.
+ * @param   phFile          Where to return the handle of the opened image.
+ */
+static int tstVhdxCreate(const char *pszFilename, PCRTUUID pUuidDataWrite, const char *pszParent,
+                         PCRTUUID pUuidParent, PCRTUUID pUuidLog, PRTFILE phFile)
+{
+    int rc = RTFileOpen(phFile, pszFilename,
+                        RTFILE_O_READWRITE | RTFILE_O_CREATE_REPLACE | RTFILE_O_DENY_NONE);
+    if (RT_FAILURE(rc))
+    {
+        RTTestFailed(g_hTest, "Creating %s failed rc=%Rrc\n", pszFilename, rc);
+        return rc;
+    }
+
+    uint8_t *pb = (uint8_t *)RTMemAllocZ(_64K);
+    RTTESTI_CHECK_RET(pb, VERR_NO_MEMORY);
+
+    rc = RTFileSetSize(*phFile, TSTVHDX_OFF_PAYLOAD);
+
+    /* File identifier. */
+    if (RT_SUCCESS(rc))
+    {
+        memcpy(pb, "vhdxfile", 8);
+        rc = tstVhdxWriteAt(*phFile, 0, pb, 8);
+    }
+
+    /* Both headers, the second one is current. */
+    for (unsigned i = 0; i < 2 && RT_SUCCESS(rc); i++)
+    {
+        TSTVHDXHDR *pHdr = (TSTVHDXHDR *)pb;
+        memset(pb, 0, sizeof(*pHdr));
+        pHdr->u32Signature      = RT_H2LE_U32(UINT32_C(0x64616568));
+        pHdr->u64SequenceNumber = RT_H2LE_U64(i + 1);
+        RTUuidCreate(&pHdr->UuidFileWrite);
+        pHdr->UuidDataWrite     = *pUuidDataWrite;
+        if (pUuidLog)
+            pHdr->UuidLog       = *pUuidLog;
+        pHdr->u16Version        = RT_H2LE_U16(1);
+        pHdr->u32LogLength      = RT_H2LE_U32(_1M);
+        pHdr->u64LogOffset      = RT_H2LE_U64(TSTVHDX_OFF_LOG);
+        pHdr->u32Checksum       = RT_H2LE_U32(RTCrc32C(pHdr, sizeof(*pHdr)));
+        rc = tstVhdxWriteAt(*phFile, i == 0 ? TSTVHDX_OFF_HDR1 : TSTVHDX_OFF_HDR2, pHdr, sizeof(*pHdr));
+    }
+
+    /* Region table with the BAT and metadata regions. */
+    if (RT_SUCCESS(rc))
+    {
+        TSTVHDXREGIONENTRY *paEntries = (TSTVHDXREGIONENTRY *)(pb + 16);
+        memset(pb, 0, _64K);
+        *(uint32_t *)pb       = RT_H2LE_U32(UINT32_C(0x69676572));
+        *(uint32_t *)(pb + 8) = RT_H2LE_U32(2);
+        RTUuidFromStr(&paEntries[0].UuidObject, "2dc27766-f623-4200-9d64-115e9bfd4a08");
+        paEntries[0].u64FileOffset = RT_H2LE_U64(TSTVHDX_OFF_BAT);
+        paEntries[0].u32Length     = RT_H2LE_U32(_1M);
+        paEntries[0].u32Flags      = RT_H2LE_U32(1);
+        RTUuidFromStr(&paEntries[1].UuidObject, "8b7ca206-4790-4b9a-b8fe-575f050f886e");
+        paEntries[1].u64FileOffset = RT_H2LE_U64(TSTVHDX_OFF_METADATA);
+        paEntries[1].u32Length     = RT_H2LE_U32(_1M);
+        paEntries[1].u32Flags      = RT_H2LE_U32(1);
+        *(uint32_t *)(pb + 4) = RT_H2LE_U32(RTCrc32C(pb, _64K));
+        rc = tstVhdxWriteAt(*phFile, TSTVHDX_OFF_REGION_TBL, pb, _64K);
+    }
+
+    /* Metadata table, the items start at 64K into the region. */
+    if (RT_SUCCESS(rc))
+    {
+        static const struct
+        {
+            const char *pszUuid;
+            uint32_t    fFlags;
+            uint32_t    cb;
+        } s_aItems[] =
+        {
+            { "caa16737-fa36-4d43-b3b6-33f0aa44e76b", 4,  8 }, /* File parameters. */
+            { "2fa54224-cd1b-4876-b211-5dbed83bf4b8", 6,  8 }, /* Virtual disk size. */
+            { "beca12ab-b2e6-4523-93ef-c309e000c746", 6, 16 }, /* Page 83 data. */
+            { "8141bf1d-a96f-4709-ba47-f233a8faab5f", 6,  4 }, /* Logical sector size. */
+            { "cda348c7-445d-4471-9cc9-e9885251c556", 6,  4 }, /* Physical sector size. */
+            { "a8d35f2d-b30b-454d-abf7-d3d84834ab0c", 4,  0 }  /* Parent locator. */
+        };
+        TSTVHDXMETAENTRY *paEntries = (TSTVHDXMETAENTRY *)(pb + 32);
+        uint8_t *pbItems = pb + _32K;
+        uint32_t offItem = _64K;
+        unsigned cItems = pszParent ? RT_ELEMENTS(s_aItems) : RT_ELEMENTS(s_aItems) - 1;
+
+        memset(pb, 0, _64K);
+        memcpy(pb, "metadata", 8);
+        *(uint16_t *)(pb + 10) = RT_H2LE_U16((uint16_t)cItems);
+
+        /* The items are assembled in the second half of the buffer. */
+        *(uint32_t *)(pbItems + 0)  = RT_H2LE_U32(TSTVHDX_BLOCK_SIZE);
+        *(uint32_t *)(pbItems + 4)  = RT_H2LE_U32(pszParent ? 2 : 0);
+        *(uint64_t *)(pbItems + 8)  = RT_H2LE_U64(TSTVHDX_DISK_SIZE);
+        RTUuidCreate((PRTUUID)(pbItems + 16));
+        *(uint32_t *)(pbItems + 32) = RT_H2LE_U32(TSTVHDX_SECTOR_SIZE);
+        *(uint32_t *)(pbItems + 36) = RT_H2LE_U32(TSTVHDX_SECTOR_SIZE);
+
+        uint32_t cbLocator = 0;
+        if (pszParent)
+        {
+            /* Parent locator with the linkage and the relative path. */
+            uint8_t *pbLocator = pbItems + 40;
+            char szLinkage[RTUUID_STR_LENGTH + 2];
+
+            szLinkage[0] = '{';
+            RTUuidToStr(pUuidParent, &szLinkage[1], RTUUID_STR_LENGTH);
+            strcat(szLinkage, "}");
+
+            RTUuidFromStr((PRTUUID)pbLocator, "b04aefb7-d19e-4a81-b789-25b8e9445913");
+            *(uint16_t *)(pbLocator + 18) = RT_H2LE_U16(2);
+
+            uint32_t offStr = 20 + 2 * 12;
+            const char *apsz[4] = { "parent_linkage", szLinkage, "relative_path", pszParent };
+            for (unsigned i = 0; i < RT_ELEMENTS(apsz); i++)
+            {
+                uint16_t cbStr = tstVhdxAddUtf16(pbLocator + offStr, apsz[i]);
+                uint8_t *pbEntry = pbLocator + 20 + (i / 2) * 12;
+                *(uint32_t *)(pbEntry + (i % 2) * 4)     = RT_H2LE_U32(offStr);
+                *(uint16_t *)(pbEntry + 8 + (i % 2) * 2) = RT_H2LE_U16(cbStr);
+                offStr += cbStr;
+            }
+            cbLocator = offStr;
+        }
+
+        uint32_t offSrc = 0;
+        for (unsigned i = 0; i < cItems; i++)
+        {
+            uint32_t cbItem = s_aItems[i].cb ? s_aItems[i].cb : cbLocator;
+            RTUuidFromStr(&paEntries[i].UuidItem, s_aItems[i].pszUuid);
+            paEntries[i].u32Offset = RT_H2LE_U32(offItem + offSrc);
+            paEntries[i].u32Length = RT_H2LE_U32(cbItem);
+            paEntries[i].u32Flags  = RT_H2LE_U32(s_aItems[i].fFlags);
+            offSrc += cbItem;
+        }
+
+        rc = tstVhdxWriteAt(*phFile, TSTVHDX_OFF_METADATA, pb, _32K);
+        if (RT_SUCCESS(rc))
+            rc = tstVhdxWriteAt(*phFile, TSTVHDX_OFF_METADATA + offItem, pbItems, offSrc);
+    }
+
+    RTMemFree(pb);
+    if (RT_FAILURE(rc))
+        RTFileClose(*phFile);
+    return rc;
+}
+
+/**
+ * Marks a payload block as present and writes the data for it.
+ */
+static int tstVhdxSetBlock(RTFILE hFile, uint32_t idxBlock, uint64_t uState, const void *pvBlock)
+{
+    uint64_t offBlock = TSTVHDX_OFF_PAYLOAD + (uint64_t)idxBlock * TSTVHDX_BLOCK_SIZE;
+    uint64_t u64BatEntry = RT_H2LE_U64(offBlock | uState);
+
+    int rc = tstVhdxWriteAt(hFile, offBlock, pvBlock, TSTVHDX_BLOCK_SIZE);
+    if (RT_SUCCESS(rc))
+        rc = tstVhdxWriteAt(hFile, TSTVHDX_OFF_BAT + idxBlock * sizeof(uint64_t), &u64BatEntry, sizeof(u64BatEntry));
+    return rc;
+}
+
+/**
+ * Reads the given range from the disk and compares it with the buffer.
+ */
+static void tstVhdxVerify(PVBOXHDD pDisk, uint64_t off, const uint8_t *pbExpected, size_t cb, uint8_t *pbBuf)
+{
+    int rc = VDRead(pDisk, off, pbBuf, cb);
+    if (RT_FAILURE(rc))
+        RTTestFailed(g_hTest, "Reading %zu bytes at %#llx failed rc=%Rrc\n", cb, off, rc);
+    else if (memcmp(pbBuf, pbExpected, cb))
+        RTTestFailed(g_hTest, "Data mismatch reading %zu bytes at %#llx\n", cb, off);
+}
+
+/**
+ * Writes to a base image, flushes and reads the data back after reopening it.
+ */
+static void tstVhdxWrite(uint8_t *pbDisk, uint8_t *pbBuf)
+{
+    RTTestSub(g_hTest, "Write");
+
+    RTUUID Uuid;
+    RTFILE hFile;
+    RTUuidCreate(&Uuid);
+    int rc = tstVhdxCreate("tstVDVhdx-base.vhdx", &Uuid, NULL, NULL, NULL, &hFile);
+    if (RT_FAILURE(rc))
+        return;
+    RTFileClose(hFile);
+
+    PVBOXHDD pDisk;
+    RTTESTI_CHECK_RC_RETV(VDCreate(NULL, VDTYPE_HDD, &pDisk), VINF_SUCCESS);
+    RTTESTI_CHECK_RC(rc = VDOpen(pDisk, "VHDX", "tstVDVhdx-base.vhdx", VD_OPEN_FLAGS_NORMAL, NULL), VINF_SUCCESS);
+    if (RT_SUCCESS(rc))
+    {
+        /* Full blocks, a partial write into an unallocated block and an overwrite. */
+        memset(pbDisk, 0, TSTVHDX_DISK_SIZE);
+        tstVhdxPatternFill(pbDisk, 2 * TSTVHDX_BLOCK_SIZE, 0, 0x11);
+        tstVhdxPatternFill(pbDisk + 5 * TSTVHDX_BLOCK_SIZE + _64K, _4K, 5 * TSTVHDX_BLOCK_SIZE + _64K, 0x22);
+        RTTESTI_CHECK_RC(VDWrite(pDisk, 0, pbDisk, 2 * TSTVHDX_BLOCK_SIZE), VINF_SUCCESS);
+        RTTESTI_CHECK_RC(VDWrite(pDisk, 5 * TSTVHDX_BLOCK_SIZE + _64K, pbDisk + 5 * TSTVHDX_BLOCK_SIZE + _64K, _4K),
+                         VINF_SUCCESS);
+        tstVhdxPatternFill(pbDisk + TSTVHDX_BLOCK_SIZE + _4K, _4K, TSTVHDX_BLOCK_SIZE + _4K, 0x33);
+        RTTESTI_CHECK_RC(VDWrite(pDisk, TSTVHDX_BLOCK_SIZE + _4K, pbDisk + TSTVHDX_BLOCK_SIZE + _4K, _4K), VINF_SUCCESS);
+        RTTESTI_CHECK_RC(VDFlush(pDisk), VINF_SUCCESS);
+        tstVhdxVerify(pDisk, 0, pbDisk, TSTVHDX_DISK_SIZE, pbBuf);
+        VDClose(pDisk, false);
+
+        /* A read-only open succeeds only if the log is still empty. */
+        RTTESTI_CHECK_RC(rc = VDOpen(pDisk, "VHDX", "tstVDVhdx-base.vhdx", VD_OPEN_FLAGS_READONLY, NULL), VINF_SUCCESS);
+        if (RT_SUCCESS(rc))
+        {
+            tstVhdxVerify(pDisk, 0, pbDisk, TSTVHDX_DISK_SIZE, pbBuf);
+            VDClose(pDisk, false);
+        }
+    }
+    VDDestroy(pDisk);
+    RTFileDelete("tstVDVhdx-base.vhdx");
+}
+
+/**
+ * Replays a log entry with a data and a zero descriptor.
+ */
+static void tstVhdxLogReplay(uint8_t *pbDisk, uint8_t *pbBuf)
+{
+    RTTestSub(g_hTest, "Log replay");
+
+    RTUUID Uuid;
+    RTUUID UuidLog;
+    RTFILE hFile;
+    RTUuidCreate(&Uuid);
+    RTUuidCreate(&UuidLog);
+    int rc = tstVhdxCreate("tstVDVhdx-log.vhdx", &Uuid, NULL, NULL, &UuidLog, &hFile);
+    if (RT_FAILURE(rc))
+        return;
+
+    /* The payload of block 0 is on the disk already but the BAT doesn't reference it yet. */
+    memset(pbDisk, 0, TSTVHDX_DISK_SIZE);
+    tstVhdxPatternFill(pbDisk, TSTVHDX_BLOCK_SIZE, 0, 0x44);
+    rc = tstVhdxWriteAt(hFile, TSTVHDX_OFF_PAYLOAD, pbDisk, TSTVHDX_BLOCK_SIZE);
+
+    /*
+     * The log entry updates the first BAT sector and zeroes the start of the block,
+     * the descriptors occupy the first sector and the data the second one.
+     */
+    uint8_t *pbEntry = pbBuf;
+    uint8_t abBatSector[_4K];
+    uint64_t const uSeq = UINT64_C(0x100000002);
+    memset(pbEntry, 0, 2 * _4K);
+    RT_ZERO(abBatSector);
+    *(uint64_t *)&abBatSector[0]              = RT_H2LE_U64(TSTVHDX_OFF_PAYLOAD | TSTVHDX_BAT_FULLY_PRESENT);
+    *(uint32_t *)&abBatSector[_4K - 4]        = RT_H2LE_U32(UINT32_C(0xdeadbeef)); /* Ends up in the trailing bytes. */
+
+    TSTVHDXLOGENTRYHDR *pEntryHdr = (TSTVHDXLOGENTRYHDR *)pbEntry;
+    pEntryHdr->u32Signature         = RT_H2LE_U32(UINT32_C(0x65676f6c));
+    pEntryHdr->u32EntryLength       = RT_H2LE_U32(2 * _4K);
+    pEntryHdr->u32Tail              = 0;
+    pEntryHdr->u64SequenceNumber    = RT_H2LE_U64(uSeq);
+    pEntryHdr->u32DescriptorCount   = RT_H2LE_U32(2);
+    pEntryHdr->UuidLog              = UuidLog;
+    pEntryHdr->u64FlushedFileOffset = RT_H2LE_U64(TSTVHDX_OFF_PAYLOAD + TSTVHDX_BLOCK_SIZE);
+    pEntryHdr->u64LastFileOffset    = RT_H2LE_U64(TSTVHDX_OFF_PAYLOAD + TSTVHDX_BLOCK_SIZE);
+
+    TSTVHDXLOGDESC *paDescs = (TSTVHDXLOGDESC *)(pEntryHdr + 1);
+    paDescs[0].u32Signature                = RT_H2LE_U32(UINT32_C(0x63736564));
+    memcpy(&paDescs[0].u32TrailingBytes, &abBatSector[_4K - 4], 4);
+    memcpy(&paDescs[0].u64LeadingBytesOrZeroLength, &abBatSector[0], 8);
+    paDescs[0].u64FileOffset               = RT_H2LE_U64(TSTVHDX_OFF_BAT);
+    paDescs[0].u64SequenceNumber           = RT_H2LE_U64(uSeq);
+    paDescs[1].u32Signature                = RT_H2LE_U32(UINT32_C(0x6f72657a));
+    paDescs[1].u64LeadingBytesOrZeroLength = RT_H2LE_U64(_4K);
+    paDescs[1].u64FileOffset               = RT_H2LE_U64(TSTVHDX_OFF_PAYLOAD);
+    paDescs[1].u64SequenceNumber           = RT_H2LE_U64(uSeq);
+
+    uint8_t *pbDataSector = pbEntry + _4K;
+    *(uint32_t *)pbDataSector             = RT_H2LE_U32(UINT32_C(0x61746164));
+    *(uint32_t *)(pbDataSector + 4)       = RT_H2LE_U32((uint32_t)(uSeq >> 32));
+    memcpy(pbDataSector + 8, &abBatSector[8], _4K - 12);
+    *(uint32_t *)(pbDataSector + _4K - 4) = RT_H2LE_U32((uint32_t)uSeq);
+
+    pEntryHdr->u32Checksum = RT_H2LE_U32(RTCrc32C(pbEntry, 2 * _4K));
+    if (RT_SUCCESS(rc))
+        rc = tstVhdxWriteAt(hFile, TSTVHDX_OFF_LOG, pbEntry, 2 * _4K);
+    RTFileClose(hFile);
+    if (RT_FAILURE(rc))
+        return;
+
+    memset(pbDisk, 0, _4K);
+
+    PVBOXHDD pDisk;
+    RTTESTI_CHECK_RC_RETV(VDCreate(NULL, VDTYPE_HDD, &pDisk), VINF_SUCCESS);
+
+    /* The log can only be replayed when opening for writing. */
+    rc = VDOpen(pDisk, "VHDX", "tstVDVhdx-log.vhdx", VD_OPEN_FLAGS_READONLY, NULL);
+    if (RT_SUCCESS(rc))
+    {
+        RTTestFailed(g_hTest, "Opening an image with a non empty log read-only succeeded\n");
+        VDClose(pDisk, false);
+    }
+
+    RTTESTI_CHECK_RC(rc = VDOpen(pDisk, "VHDX", "tstVDVhdx-log.vhdx", VD_OPEN_FLAGS_NORMAL, NULL), VINF_SUCCESS);
+    if (RT_SUCCESS(rc))
+    {
+        tstVhdxVerify(pDisk, 0, pbDisk, TSTVHDX_DISK_SIZE, pbBuf);
+        VDClose(pDisk, false);
+
+        /* The leading bytes are checked through the BAT entry already, check the trailing ones too. */
+        uint8_t abSector[_4K];
+        rc = RTFileOpen(&hFile, "tstVDVhdx-log.vhdx", RTFILE_O_READ | RTFILE_O_OPEN | RTFILE_O_DENY_NONE);
+        if (RT_SUCCESS(rc))
+        {
+            RTTESTI_CHECK_RC(RTFileReadAt(hFile, TSTVHDX_OFF_BAT, abSector, sizeof(abSector), NULL), VINF_SUCCESS);
+            RTTESTI_CHECK(!memcmp(abSector, abBatSector, sizeof(abSector)));
+            RTFileClose(hFile);
+        }
+        else
+            RTTestFailed(g_hTest, "Opening the image failed rc=%Rrc\n", rc);
+
+        /* The log is empty now. */
+        RTTESTI_CHECK_RC(rc = VDOpen(pDisk, "VHDX", "tstVDVhdx-log.vhdx", VD_OPEN_FLAGS_READONLY, NULL), VINF_SUCCESS);
+        if (RT_SUCCESS(rc))
+        {
+            tstVhdxVerify(pDisk, 0, pbDisk, TSTVHDX_DISK_SIZE, pbBuf);
+            VDClose(pDisk, false);
+        }
+    }
+    VDDestroy(pDisk);
+    RTFileDelete("tstVDVhdx-log.vhdx");
+}
+
+/**
+ * Reads from a differencing image with partially present blocks and writes to it.
+ */
+static void tstVhdxDiff(uint8_t *pbDisk, uint8_t *pbBuf)
+{
+    RTTestSub(g_hTest, "Differencing image");
+
+    RTUUID UuidParent;
+    RTUUID Uuid;
+    RTFILE hFile;
+    RTUuidCreate(&UuidParent);
+    RTUuidCreate(&Uuid);
+
+    /* The parent has blocks 0 and 3. */
+    memset(pbDisk, 0, TSTVHDX_DISK_SIZE);
+    tstVhdxPatternFill(pbDisk, TSTVHDX_BLOCK_SIZE, 0, 0x55);
+    tstVhdxPatternFill(pbDisk + 3 * TSTVHDX_BLOCK_SIZE, TSTVHDX_BLOCK_SIZE, 3 * TSTVHDX_BLOCK_SIZE, 0x66);
+    int rc = tstVhdxCreate("tstVDVhdx-parent.vhdx", &UuidParent, NULL, NULL, NULL, &hFile);
+    if (RT_FAILURE(rc))
+        return;
+    rc = tstVhdxSetBlock(hFile, 0, TSTVHDX_BAT_FULLY_PRESENT, pbDisk);
+    if (RT_SUCCESS(rc))
+        rc = tstVhdxSetBlock(hFile, 3, TSTVHDX_BAT_FULLY_PRESENT, pbDisk + 3 * TSTVHDX_BLOCK_SIZE);
+    RTFileClose(hFile);
+    if (RT_FAILURE(rc))
+        return;
+
+    /*
+     * The child has the second 4K of block 0 and the first 4K of block 1 which
+     * are partially present. The sector bitmap block follows the payload blocks.
+     */
+    rc = tstVhdxCreate("tstVDVhdx-child.vhdx", &Uuid, "tstVDVhdx-parent.vhdx", &UuidParent, NULL, &hFile);
+    if (RT_FAILURE(rc))
+        return;
+
+    uint8_t *pbBlock = pbBuf;
+    for (uint32_t idxBlock = 0; idxBlock < 2 && RT_SUCCESS(rc); idxBlock++)
+    {
+        uint32_t offData = idxBlock == 0 ? _4K : 0;
+        memset(pbBlock, 0xff, TSTVHDX_BLOCK_SIZE);
+        tstVhdxPatternFill(pbBlock + offData, _4K, idxBlock * TSTVHDX_BLOCK_SIZE + offData, 0x77);
+        memcpy(pbDisk + idxBlock * TSTVHDX_BLOCK_SIZE + offData, pbBlock + offData, _4K);
+        rc = tstVhdxSetBlock(hFile, idxBlock, TSTVHDX_BAT_PARTIALLY_PRESENT, pbBlock);
+    }
+
+    if (RT_SUCCESS(rc))
+    {
+        uint64_t offBitmap = TSTVHDX_OFF_PAYLOAD + 8 * TSTVHDX_BLOCK_SIZE;
+        uint64_t u64BatEntry = RT_H2LE_U64(offBitmap | TSTVHDX_BAT_SB_PRESENT);
+
+        memset(pbBlock, 0, TSTVHDX_BLOCK_SIZE);
+        pbBlock[1] = 0xff;                              /* Block 0, sectors 8-15. */
+        pbBlock[TSTVHDX_BITMAP_SIZE] = 0xff;            /* Block 1, sectors 0-7. */
+        rc = tstVhdxWriteAt(hFile, offBitmap, pbBlock, TSTVHDX_BLOCK_SIZE);
+        if (RT_SUCCESS(rc))
+            rc = tstVhdxWriteAt(hFile, TSTVHDX_OFF_BAT + TSTVHDX_CHUNK_RATIO * sizeof(uint64_t),
+                                &u64BatEntry, sizeof(u64BatEntry));
+    }
+    RTFileClose(hFile);
+    if (RT_FAILURE(rc))
+        return;
+
+    PVBOXHDD pDisk;
+    RTTESTI_CHECK_RC_RETV(VDCreate(NULL, VDTYPE_HDD, &pDisk), VINF_SUCCESS);
+    RTTESTI_CHECK_RC(rc = VDOpen(pDisk, "VHDX", "tstVDVhdx-parent.vhdx", VD_OPEN_FLAGS_READONLY, NULL), VINF_SUCCESS);
+    if (RT_SUCCESS(rc))
+        RTTESTI_CHECK_RC(rc = VDOpen(pDisk, "VHDX", "tstVDVhdx-child.vhdx", VD_OPEN_FLAGS_NORMAL, NULL), VINF_SUCCESS);
+    if (RT_SUCCESS(rc))
+    {
+        RTUUID UuidLinkage;
+        RTTESTI_CHECK_RC(VDGetParentUuid(pDisk, 1, &UuidLinkage), VINF_SUCCESS);
+        RTTESTI_CHECK(!RTUuidCompare(&UuidLinkage, &UuidParent));
+
+        tstVhdxVerify(pDisk, 0, pbDisk, TSTVHDX_DISK_SIZE, pbBuf);
+
+        /* A full block write makes block 0 fully present, the partial one assembles block 3 from the parent. */
+        tstVhdxPatternFill(pbDisk, TSTVHDX_BLOCK_SIZE, 0, 0x88);
+        tstVhdxPatternFill(pbDisk + 3 * TSTVHDX_BLOCK_SIZE + _4K, _4K, 3 * TSTVHDX_BLOCK_SIZE + _4K, 0x99);
+        RTTESTI_CHECK_RC(VDWrite(pDisk, 0, pbDisk, TSTVHDX_BLOCK_SIZE), VINF_SUCCESS);
+        RTTESTI_CHECK_RC(VDWrite(pDisk, 3 * TSTVHDX_BLOCK_SIZE + _4K, pbDisk + 3 * TSTVHDX_BLOCK_SIZE + _4K, _4K),
+                         VINF_SUCCESS);
+        tstVhdxVerify(pDisk, 0, pbDisk, TSTVHDX_DISK_SIZE, pbBuf);
+        VDCloseAll(pDisk);
+
+        RTTESTI_CHECK_RC(rc = VDOpen(pDisk, "VHDX", "tstVDVhdx-parent.vhdx", VD_OPEN_FLAGS_READONLY, NULL), VINF_SUCCESS);
+        if (RT_SUCCESS(rc))
+            RTTESTI_CHECK_RC(rc = VDOpen(pDisk, "VHDX", "tstVDVhdx-child.vhdx", VD_OPEN_FLAGS_READONLY, NULL),
+                             VINF_SUCCESS);
+        if (RT_SUCCESS(rc))
+            tstVhdxVerify(pDisk, 0, pbDisk, TSTVHDX_DISK_SIZE, pbBuf);
+    }
+    VDCloseAll(pDisk);
+    VDDestroy(pDisk);
+    RTFileDelete("tstVDVhdx-child.vhdx");
+    RTFileDelete("tstVDVhdx-parent.vhdx");
+}
+
+int main(int argc, char *argv[])
+{
+    RTEXITCODE rcExit = RTTestInitAndCreate("tstVDVhdx", &g_hTest);
+    if (rcExit != RTEXITCODE_SUCCESS)
+        return rcExit;
+    RTTestBanner(g_hTest);
+
+    int rc = VDInit();
+    if (RT_FAILURE(rc))
+    {
+        RTTestFailed(g_hTest, "Initializing the VD library failed rc=%Rrc\n", rc);
+        return RTTestSummaryAndDestroy(g_hTest);
+    }
+
+    uint8_t *pbDisk = (uint8_t *)RTMemAlloc(TSTVHDX_DISK_SIZE);
+    uint8_t *pbBuf  = (uint8_t *)RTMemAlloc(TSTVHDX_DISK_SIZE);
+    if (pbDisk && pbBuf)
+    {
+        tstVhdxWrite(pbDisk, pbBuf);
+        tstVhdxLogReplay(pbDisk, pbBuf);
+        tstVhdxDiff(pbDisk, pbBuf);
+    }
+    else
+        RTTestFailed(g_hTest, "Out of memory\n");
+    RTMemFree(pbDisk);
+    RTMemFree(pbBuf);
+
+    rc = VDShutdown();
+    if (RT_FAILURE(rc))
+        RTTestFailed(g_hTest, "Unloading backends failed! rc=%Rrc\n", rc);
+
+    return RTTestSummaryAndDestroy(g_hTest);
+}
@@ -51,12 +51,17 @@ static void printUsage(PRTSTREAM pStrm)
                  "                [--srcformat VDI|VMDK|VHD|RAW|..]\n"
                  "                [--dstformat VDI|VMDK|VHD|RAW|..]\n"
                  "                [--variant Standard,Fixed,Split2G,Stream,ESX]\n"
+                 "                [--buffers <number of buffers in flight>]\n"
+                 "                [--buffersize <buffer size in bytes>]\n"
                  "\n"
                  "   info         --filename <filename>\n"
                  "\n"
                  "   compact      --filename <filename>\n"
                  "                [--filesystemaware]\n"
                  "\n"
+                 "   defragment   --filename <filename>\n"
+                 "                [--limit <bytes per second>] (default: unlimited)\n"
+                 "\n"
                  "   createcache  --filename <filename>\n"
                  "                --size <cache size>\n"
                  "\n"
@@ -697,6 +702,8 @@ int handleConvert(HandlerArg *a)
     VDTYPE enmSrcType = VDTYPE_HDD;
     const char *pszDstFormat = NULL;
     const char *pszVariant = NULL;
+    unsigned cCopyBufs = 0;
+    size_t cbCopyBuf = 0;
     PVBOXHDD pSrcDisk = NULL;
     PVBOXHDD pDstDisk = NULL;
     unsigned uImageFlags = VD_IMAGE_FLAGS_NONE;
@@ -715,7 +722,9 @@ int handleConvert(HandlerArg *a)
         { "--stdout", 'P', RTGETOPT_REQ_NOTHING },
         { "--srcformat", 's', RTGETOPT_REQ_STRING },
         { "--dstformat", 'd', RTGETOPT_REQ_STRING },
-        { "--variant", 'v', RTGETOPT_REQ_STRING }
+        { "--variant", 'v', RTGETOPT_REQ_STRING },
+        { "--buffers", 'b', RTGETOPT_REQ_UINT32 },
+        { "--buffersize", 'B', RTGETOPT_REQ_UINT32 }
     };
     int ch;
     RTGETOPTUNION ValueUnion;
@@ -746,6 +755,12 @@ int handleConvert(HandlerArg *a)
             case 'v':   // --variant
                 pszVariant = ValueUnion.psz;
                 break;
+            case 'b':   // --buffers
+                cCopyBufs = ValueUnion.u32;
+                break;
+            case 'B':   // --buffersize
+                cbCopyBuf = ValueUnion.u32;
+                break;
 
             default:
                 ch = RTGetOptPrintError(ch, &ValueUnion);
@@ -891,10 +906,12 @@ int handleConvert(HandlerArg *a)
         RTStrmPrintf(g_pStdErr, "Converting image \"%s\" with size %RU64 bytes (%RU64MB)...\n", pszSrcFilename, cbSize, (cbSize + _1M - 1) / _1M);
 
         /* Create the output image */
-        rc = VDCopy(pSrcDisk, VD_LAST_IMAGE, pDstDisk, pszDstFormat,
-                    pszDstFilename, false, 0, uImageFlags, NULL,
-                    VD_OPEN_FLAGS_NORMAL | VD_OPEN_FLAGS_SEQUENTIAL, NULL,
-                    pIfsImageOutput, NULL);
+        rc = VDCopyEx(pSrcDisk, VD_LAST_IMAGE, pDstDisk, pszDstFormat,
+                      pszDstFilename, false, 0, VD_IMAGE_CONTENT_UNKNOWN,
+                      VD_IMAGE_CONTENT_UNKNOWN, cCopyBufs, cbCopyBuf,
+                      uImageFlags, NULL,
+                      VD_OPEN_FLAGS_NORMAL | VD_OPEN_FLAGS_SEQUENTIAL, NULL,
+                      pIfsImageOutput, NULL);
         if (RT_FAILURE(rc))
         {
             errorRuntime("Error while copying the image: %Rrc\n", rc);
@@ -1243,6 +1260,72 @@ int handleCompact(HandlerArg *a)
 }
 
 
+int handleDefragment(HandlerArg *a)
+{
+    int rc = VINF_SUCCESS;
+    PVBOXHDD pDisk = NULL;
+    const char *pszFilename = NULL;
+    uint64_t cbPerSecMax = 0;
+
+    /* Parse the command line. */
+    static const RTGETOPTDEF s_aOptions[] =
+    {
+        { "--filename", 'f', RTGETOPT_REQ_STRING },
+        { "--limit",    'l', RTGETOPT_REQ_UINT64 }
+    };
+    int ch;
+    RTGETOPTUNION ValueUnion;
+    RTGETOPTSTATE GetState;
+    RTGetOptInit(&GetState, a->argc, a->argv, s_aOptions, RT_ELEMENTS(s_aOptions), 0, 0 /* fFlags */);
+    while ((ch = RTGetOpt(&GetState, &ValueUnion)))
+    {
+        switch (ch)
+        {
+            case 'f':   // --filename
+                pszFilename = ValueUnion.psz;
+                break;
+
+            case 'l':   // --limit
+                cbPerSecMax = ValueUnion.u64;
+                break;
+
+            default:
+                ch = RTGetOptPrintError(ch, &ValueUnion);
+                printUsage(g_pStdErr);
+                return ch;
+        }
+    }
+
+    /* Check for mandatory parameters. */
+    if (!pszFilename)
+        return errorSyntax("Mandatory --filename option missing\n");
+
+    /* just try it */
+    char *pszFormat = NULL;
+    VDTYPE enmType = VDTYPE_INVALID;
+    rc = VDGetFormat(NULL, NULL, pszFilename, &pszFormat, &enmType);
+    if (RT_FAILURE(rc))
+        return errorSyntax("Format autodetect failed: %Rrc\n", rc);
+
+    rc = VDCreate(pVDIfs, enmType, &pDisk);
+    if (RT_FAILURE(rc))
+        return errorRuntime("Error while creating the virtual disk container: %Rrc\n", rc);
+
+    /* Open the image */
+    rc = VDOpen(pDisk, pszFormat, pszFilename, VD_OPEN_FLAGS_NORMAL, NULL);
+    if (RT_FAILURE(rc))
+        return errorRuntime("Error while opening the image: %Rrc\n", rc);
+
+    rc = VDDefragment(pDisk, 0, cbPerSecMax, NULL);
+    if (RT_FAILURE(rc))
+        errorRuntime("Error while defragmenting image: %Rrc\n", rc);
+
+    VDDestroy(pDisk);
+
+    return rc;
+}
+
+
 int handleCreateCache(HandlerArg *a)
 {
     int rc = VINF_SUCCESS;
@@ -1651,6 +1734,7 @@ int main(int argc, char *argv[])
         { "convert",      handleConvert      },
         { "info",         handleInfo         },
         { "compact",      handleCompact      },
+        { "defragment",   handleDefragment   },
         { "createcache",  handleCreateCache  },
         { "createbase",   handleCreateBase   },
         { "repair",       handleRepair       },
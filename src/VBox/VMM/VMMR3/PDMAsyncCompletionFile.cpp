@@ -157,7 +157,8 @@ PPDMACTASKFILE pdmacFileTaskAlloc(PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint)
         ASMAtomicDecU32(&pEndpoint->cTasksCached);
     }
 
-    pTask->pNext = NULL;
+    pTask->pNext       = NULL;
+    pTask->pMergedNext = NULL;
 
     return pTask;
 }
@@ -826,6 +827,7 @@ static int pdmacFileInitialize(PPDMASYNCCOMPLETIONEPCLASS pClassGlobals, PCFGMNO
     {
         pEpClassFile->uBitmaskAlignment   = AioLimits.cbBufferAlignment ? ~((RTR3UINTPTR)AioLimits.cbBufferAlignment - 1) : RTR3UINTPTR_MAX;
         pEpClassFile->cReqsOutstandingMax = AioLimits.cReqsOutstandingMax;
+        pEpClassFile->fAsyncBufferedIo    = RT_BOOL(AioLimits.fFlags & RTFILEAIOLIMITS_F_BUFFERED_IO);
 
         if (pCfgNode)
         {
@@ -852,14 +854,13 @@ static int pdmacFileInitialize(PPDMASYNCCOMPLETIONEPCLASS pClassGlobals, PCFGMNO
 
             LogRel(("AIOMgr: Default file backend is \"%s\"\n", pdmacFileBackendTypeToName(pEpClassFile->enmEpBackendDefault)));
 
-#ifdef RT_OS_LINUX
             if (   pEpClassFile->enmMgrTypeOverride == PDMACEPFILEMGRTYPE_ASYNC
-                && pEpClassFile->enmEpBackendDefault == PDMACFILEEPBACKEND_BUFFERED)
+                && pEpClassFile->enmEpBackendDefault == PDMACFILEEPBACKEND_BUFFERED
+                && !pEpClassFile->fAsyncBufferedIo)
             {
-                LogRel(("AIOMgr: Linux does not support buffered async I/O, changing to non buffered\n"));
+                LogRel(("AIOMgr: Host does not support buffered async I/O, changing to non buffered\n"));
                 pEpClassFile->enmEpBackendDefault = PDMACFILEEPBACKEND_NON_BUFFERED;
             }
-#endif
         }
         else
         {
@@ -973,10 +974,11 @@ static int pdmacFileEpInitialize(PPDMASYNCCOMPLETIONENDPOINT pEndpoint,
                 /* Downgrade to the buffered backend */
                 enmEpBackend = PDMACFILEEPBACKEND_BUFFERED;
 
-#ifdef RT_OS_LINUX
-                fFileFlags &= ~RTFILE_O_ASYNC_IO;
-                enmMgrType   = PDMACEPFILEMGRTYPE_SIMPLE;
-#endif
+                if (!pEpClassFile->fAsyncBufferedIo)
+                {
+                    fFileFlags &= ~RTFILE_O_ASYNC_IO;
+                    enmMgrType   = PDMACEPFILEMGRTYPE_SIMPLE;
+                }
             }
             RTFileClose(hFile);
         }
@@ -998,15 +1000,17 @@ static int pdmacFileEpInitialize(PPDMASYNCCOMPLETIONENDPOINT pEndpoint,
          * without blocking the whole application.
          *
          * On Linux we have the same problem with cifs.
-         * Have to disable async I/O here too because it requires O_DIRECT.
+         * Have to disable async I/O here too unless the host
+         * supports it without O_DIRECT.
          */
         fFileFlags &= ~RTFILE_O_NO_CACHE;
         enmEpBackend = PDMACFILEEPBACKEND_BUFFERED;
 
-#ifdef RT_OS_LINUX
-        fFileFlags &= ~RTFILE_O_ASYNC_IO;
-        enmMgrType   = PDMACEPFILEMGRTYPE_SIMPLE;
-#endif
+        if (!pEpClassFile->fAsyncBufferedIo)
+        {
+            fFileFlags &= ~RTFILE_O_ASYNC_IO;
+            enmMgrType   = PDMACEPFILEMGRTYPE_SIMPLE;
+        }
 
         /* Open again. */
         rc = RTFileOpen(&pEpFile->hFile, pszUri, fFileFlags);
@@ -25,6 +25,7 @@
 #include <iprt/mem.h>
 #include <iprt/string.h>
 #include <iprt/assert.h>
+#include <iprt/time.h>
 #include <VBox/log.h>
 
 #include "PDMAsyncCompletionFileInternal.h"
@@ -33,6 +34,21 @@
 #define PDMACEPFILEMGR_LOAD_UPDATE_PERIOD   1000
 /** Maximum number of requests a manager will handle. */
 #define PDMACEPFILEMGR_REQS_STEP            512
+/** Lower bound for the number of active requests when the limit is reduced. */
+#define PDMACEPFILEMGR_REQS_MIN             64
+/** Upper bound for the number of active requests when the limit is raised. */
+#define PDMACEPFILEMGR_REQS_MAX             _16K
+/** The request limit is raised only if the average latency is below
+ * this multiple of the baseline latency. */
+#define PDMACEPFILEMGR_LATENCY_GROW_FACTOR  2
+/** The request limit is reduced if the average latency exceeds
+ * this multiple of the baseline latency. */
+#define PDMACEPFILEMGR_LATENCY_SHRINK_FACTOR 4
+/** Maximum size of a request created by merging adjacent tasks.
+ * This bounds the latency added to the first task of a merged request. */
+#define PDMACEPFILEMGR_MERGE_SIZE_MAX       _128K
+/** Maximum number of tasks merged into one request. */
+#define PDMACEPFILEMGR_MERGE_TASKS_MAX      32
 
 
 /*******************************************************************************
@@ -53,6 +69,9 @@ static void pdmacFileAioMgrNormalReqCompleteRc(PPDMACEPFILEMGR pAioMgr, RTFILEAI
 int pdmacFileAioMgrNormalInit(PPDMACEPFILEMGR pAioMgr)
 {
     pAioMgr->cRequestsActiveMax = PDMACEPFILEMGR_REQS_STEP;
+    pAioMgr->cRequestsCtxMax    = pAioMgr->cRequestsActiveMax;
+    pAioMgr->cNsLatencyAvg      = 0;
+    pAioMgr->cNsLatencyMin      = 0;
 
     int rc = RTFileAioCtxCreate(&pAioMgr->hAioCtx, RTFILEAIO_UNLIMITED_REQS, 0 /* fFlags */);
     if (rc == VERR_OUT_OF_RANGE)
@@ -320,6 +339,74 @@ static void pdmacFileAioMgrNormalBalanceLoad(PPDMACEPFILEMGR pAioMgr)
 
 #endif /* unused */
 
+/**
+ * Accounts the latency of a completed request.
+ *
+ * @returns nothing.
+ * @param   pAioMgr    The I/O manager.
+ * @param   cNsLatency Time between submission and completion of the request.
+ */
+DECLINLINE(void) pdmacFileAioMgrNormalLatencyUpdate(PPDMACEPFILEMGR pAioMgr, uint64_t cNsLatency)
+{
+    /* Moving average with a weight of 1/8 for the new sample. */
+    if (!pAioMgr->cNsLatencyAvg)
+        pAioMgr->cNsLatencyAvg = cNsLatency;
+    else
+        pAioMgr->cNsLatencyAvg = pAioMgr->cNsLatencyAvg - pAioMgr->cNsLatencyAvg / 8 + cNsLatency / 8;
+
+    if (   !pAioMgr->cNsLatencyMin
+        || pAioMgr->cNsLatencyAvg < pAioMgr->cNsLatencyMin)
+        pAioMgr->cNsLatencyMin = pAioMgr->cNsLatencyAvg;
+}
+
+/**
+ * Calculates the new limit of active requests if the I/O manager ran full.
+ *
+ * As long as the completion latency stays close to the baseline the host can
+ * take more requests and the limit is doubled. If the latency went up already
+ * the host is saturated and queueing more requests would only make every
+ * request slower, so the limit is kept.
+ *
+ * @returns New maximum number of active requests.
+ * @param   pAioMgr    The I/O manager.
+ */
+static uint32_t pdmacFileAioMgrNormalLimitCalc(PPDMACEPFILEMGR pAioMgr)
+{
+    uint32_t cReqsMax = pAioMgr->cRequestsActiveMax;
+
+    /* No completion yet, use the fixed step. */
+    if (!pAioMgr->cNsLatencyMin)
+        return RT_MIN(cReqsMax + PDMACEPFILEMGR_REQS_STEP, PDMACEPFILEMGR_REQS_MAX);
+
+    if (pAioMgr->cNsLatencyAvg <= pAioMgr->cNsLatencyMin * PDMACEPFILEMGR_LATENCY_GROW_FACTOR)
+        cReqsMax = RT_MIN(RT_MAX(cReqsMax * 2, PDMACEPFILEMGR_REQS_MIN), PDMACEPFILEMGR_REQS_MAX);
+
+    return RT_MAX(cReqsMax, pAioMgr->cRequestsActiveMax);
+}
+
+/**
+ * Periodic update of the active request limit, lowers it if the host is
+ * overloaded and lets the latency baseline adapt to changed conditions.
+ *
+ * @returns nothing.
+ * @param   pAioMgr    The I/O manager.
+ */
+static void pdmacFileAioMgrNormalLimitUpdate(PPDMACEPFILEMGR pAioMgr)
+{
+    if (   pAioMgr->cNsLatencyMin
+        && pAioMgr->cNsLatencyAvg > pAioMgr->cNsLatencyMin * PDMACEPFILEMGR_LATENCY_SHRINK_FACTOR
+        && pAioMgr->cRequestsActiveMax > PDMACEPFILEMGR_REQS_MIN)
+    {
+        pAioMgr->cRequestsActiveMax = RT_MAX(pAioMgr->cRequestsActiveMax - pAioMgr->cRequestsActiveMax / 4,
+                                             PDMACEPFILEMGR_REQS_MIN);
+        LogFlow(("AIOMgr: Average latency %llu ns (baseline %llu ns), reduced request limit to %u\n",
+                 pAioMgr->cNsLatencyAvg, pAioMgr->cNsLatencyMin, pAioMgr->cRequestsActiveMax));
+    }
+
+    /* Let the baseline drift up slowly so it follows the host (other load, different storage). */
+    pAioMgr->cNsLatencyMin += pAioMgr->cNsLatencyMin / 16;
+}
+
 /**
  * Increase the maximum number of active requests for the given I/O manager.
  *
@@ -351,7 +438,8 @@ static int pdmacFileAioMgrNormalGrow(PPDMACEPFILEMGR pAioMgr)
 #endif
 
     /* Create the new bigger context. */
-    pAioMgr->cRequestsActiveMax += PDMACEPFILEMGR_REQS_STEP;
+    uint32_t const cRequestsActiveMaxOld = pAioMgr->cRequestsActiveMax;
+    pAioMgr->cRequestsActiveMax = RT_MAX(pdmacFileAioMgrNormalLimitCalc(pAioMgr), pAioMgr->cRequestsCtxMax + 1);
 
     RTFILEAIOCTX hAioCtxNew = NIL_RTFILEAIOCTX;
     int rc = RTFileAioCtxCreate(&hAioCtxNew, RTFILEAIO_UNLIMITED_REQS, 0 /* fFlags */);
@@ -377,8 +465,9 @@ static int pdmacFileAioMgrNormalGrow(PPDMACEPFILEMGR pAioMgr)
                 pahReqNew[iReq] = pAioMgr->pahReqsFree[iReq];
 
             RTMemFree(pAioMgr->pahReqsFree);
-            pAioMgr->pahReqsFree = pahReqNew;
-            pAioMgr->cReqEntries = cReqEntriesNew;
+            pAioMgr->pahReqsFree     = pahReqNew;
+            pAioMgr->cReqEntries     = cReqEntriesNew;
+            pAioMgr->cRequestsCtxMax = pAioMgr->cRequestsActiveMax;
             LogFlowFunc(("I/O manager increased to handle a maximum of %u requests\n",
                          pAioMgr->cRequestsActiveMax));
         }
@@ -401,7 +490,7 @@ static int pdmacFileAioMgrNormalGrow(PPDMACEPFILEMGR pAioMgr)
     if (RT_FAILURE(rc))
     {
         LogFlow(("Increasing size of the I/O manager failed with rc=%Rrc\n", rc));
-        pAioMgr->cRequestsActiveMax -= PDMACEPFILEMGR_REQS_STEP;
+        pAioMgr->cRequestsActiveMax = cRequestsActiveMaxOld;
     }
 
     pAioMgr->enmState = PDMACEPFILEMGRSTATE_RUNNING;
@@ -552,6 +641,13 @@ static int pdmacFileAioMgrNormalReqsEnqueue(PPDMACEPFILEMGR pAioMgr,
     LogFlow(("Enqueuing %d requests. I/O manager has a total of %d active requests now\n", cReqs, pAioMgr->cRequestsActive));
     LogFlow(("Endpoint has a total of %d active requests now\n", pEndpoint->AioMgr.cRequestsActive));
 
+    uint64_t tsNsNow = RTTimeNanoTS();
+    for (unsigned i = 0; i < cReqs; i++)
+    {
+        PPDMACTASKFILE pTask = (PPDMACTASKFILE)RTFileAioReqGetUser(pahReqs[i]);
+        pTask->tsNsSubmit = tsNsNow;
+    }
+
     int rc = RTFileAioCtxSubmit(pAioMgr->hAioCtx, pahReqs, cReqs);
     if (RT_FAILURE(rc))
     {
@@ -967,6 +1063,167 @@ static int pdmacFileAioMgrNormalTaskPrepareNonBuffered(PPDMACEPFILEMGR pAioMgr,
     return rc;
 }
 
+/**
+ * Checks whether the given task can be merged with other tasks into one request.
+ *
+ * @returns true if the task can be merged, false otherwise.
+ * @param   pEndpoint  The endpoint the task belongs to.
+ * @param   pTask      The task to check.
+ */
+DECLINLINE(bool) pdmacFileAioMgrNormalTaskIsMergeable(PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint, PPDMACTASKFILE pTask)
+{
+    if (   pTask->hReq != NIL_RTFILEAIOREQ
+        || (   pTask->enmTransferType != PDMACTASKFILETRANSFER_READ
+            && pTask->enmTransferType != PDMACTASKFILETRANSFER_WRITE)
+        || pTask->DataSeg.cbSeg >= PDMACEPFILEMGR_MERGE_SIZE_MAX)
+        return false;
+
+    /* Unaligned tasks for the non buffered backend need the range lock and prefetch handling. */
+    if (   pEndpoint->enmBackendType == PDMACFILEEPBACKEND_NON_BUFFERED
+        && (   (pTask->Off & (512 - 1))
+            || (pTask->DataSeg.cbSeg & (512 - 1))))
+        return false;
+
+    return true;
+}
+
+/**
+ * Tries to merge the given task with the directly following adjacent tasks of
+ * the same type into one request using a bounce buffer.
+ *
+ * Only tasks which are queued already are considered, a task is never held
+ * back to wait for others. The added latency is limited to copying at most
+ * PDMACEPFILEMGR_MERGE_SIZE_MAX bytes.
+ *
+ * @returns VBox status code.
+ * @param   pAioMgr     The I/O manager.
+ * @param   pEndpoint   The endpoint the tasks belong to.
+ * @param   pTask       The first task.
+ * @param   ppTaskHead  Pointer to the head of the remaining task list,
+ *                      merged tasks are removed from it.
+ * @param   phReq       Where to store the request handle if tasks were merged.
+ *                      Left unchanged if nothing could be merged.
+ */
+static int pdmacFileAioMgrNormalTaskPrepareMerged(PPDMACEPFILEMGR pAioMgr,
+                                                  PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint,
+                                                  PPDMACTASKFILE pTask, PPDMACTASKFILE *ppTaskHead,
+                                                  PRTFILEAIOREQ phReq)
+{
+    /* Range locks and the bandwidth limit work on individual tasks. */
+    if (   pEndpoint->AioMgr.cLockedReqsActive
+        || pEndpoint->Core.pBwMgr
+        || !pdmacFileAioMgrNormalTaskIsMergeable(pEndpoint, pTask))
+        return VINF_SUCCESS;
+
+    PPDMACTASKFILE pTaskNext = *ppTaskHead;
+    size_t         cbMerged  = pTask->DataSeg.cbSeg;
+    unsigned       cTasks    = 1;
+    while (   pTaskNext
+           && cTasks < PDMACEPFILEMGR_MERGE_TASKS_MAX
+           && pTaskNext->enmTransferType == pTask->enmTransferType
+           && pTaskNext->Off == pTask->Off + (RTFOFF)cbMerged
+           && cbMerged + pTaskNext->DataSeg.cbSeg <= PDMACEPFILEMGR_MERGE_SIZE_MAX
+           && pdmacFileAioMgrNormalTaskIsMergeable(pEndpoint, pTaskNext))
+    {
+        cbMerged += pTaskNext->DataSeg.cbSeg;
+        cTasks++;
+        pTaskNext = pTaskNext->pNext;
+    }
+
+    if (cTasks == 1)
+        return VINF_SUCCESS;
+
+    /* Page aligned memory satisfies the host alignment restrictions. */
+    void *pvBuf = RTMemPageAlloc(cbMerged);
+    if (!pvBuf)
+        return VINF_SUCCESS; /* Not fatal, the tasks are processed one by one. */
+
+    LogFlow(("Merging %u tasks starting with %#p into one request (offStart=%RTfoff cbTransfer=%zu)\n",
+             cTasks, pTask, pTask->Off, cbMerged));
+
+    /* Unlink the merged tasks from the list and chain them to the first one. */
+    PPDMACTASKFILE pMergedTail = pTask;
+    while (*ppTaskHead != pTaskNext)
+    {
+        PPDMACTASKFILE pMerged = *ppTaskHead;
+        *ppTaskHead = pMerged->pNext;
+
+        pMerged->pNext          = NULL;
+        pMerged->pMergedNext    = NULL;
+        pMerged->pRangeLock     = NULL;
+        pMerged->fPrefetch      = false;
+        pMerged->cbBounceBuffer = 0;
+        pMergedTail->pMergedNext = pMerged;
+        pMergedTail = pMerged;
+    }
+
+    if (pTask->enmTransferType == PDMACTASKFILETRANSFER_WRITE)
+    {
+        for (PPDMACTASKFILE pCur = pTask; pCur; pCur = pCur->pMergedNext)
+            memcpy((uint8_t *)pvBuf + (pCur->Off - pTask->Off), pCur->DataSeg.pvSeg, pCur->DataSeg.cbSeg);
+    }
+
+    pTask->fPrefetch       = false;
+    pTask->pvBounceBuffer  = pvBuf;
+    pTask->cbBounceBuffer  = cbMerged;
+    pTask->offBounceBuffer = 0;
+
+    /* Get a request handle. */
+    RTFILEAIOREQ hReq = pdmacFileAioMgrNormalRequestAlloc(pAioMgr);
+    AssertMsg(hReq != NIL_RTFILEAIOREQ, ("Out of request handles\n"));
+
+    int rc;
+    if (pTask->enmTransferType == PDMACTASKFILETRANSFER_WRITE)
+    {
+        /* Grow the file if needed. */
+        if (RT_UNLIKELY((uint64_t)(pTask->Off + cbMerged) > pEndpoint->cbFile))
+        {
+            ASMAtomicWriteU64(&pEndpoint->cbFile, pTask->Off + cbMerged);
+            RTFileSetSize(pEndpoint->hFile, pTask->Off + cbMerged);
+        }
+
+        rc = RTFileAioReqPrepareWrite(hReq, pEndpoint->hFile, pTask->Off, pvBuf, cbMerged, pTask);
+    }
+    else
+        rc = RTFileAioReqPrepareRead(hReq, pEndpoint->hFile, pTask->Off, pvBuf, cbMerged, pTask);
+    AssertRC(rc);
+
+    /* No lock is taken because there is no unaligned request active. */
+    rc = pdmacFileAioMgrNormalRangeLock(pAioMgr, pEndpoint, pTask->Off, cbMerged, pTask, true /* fAlignedReq */);
+    AssertRC(rc);
+
+    pTask->hReq = hReq;
+    *phReq = hReq;
+    return rc;
+}
+
+/**
+ * Completes all tasks which were merged into the request of the given task.
+ *
+ * @returns nothing.
+ * @param   pEndpoint  The endpoint the tasks belong to.
+ * @param   pTask      The task owning the request.
+ * @param   rcReq      The status code to complete the tasks with.
+ */
+static void pdmacFileAioMgrNormalMergedTasksComplete(PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint,
+                                                     PPDMACTASKFILE pTask, int rcReq)
+{
+    PPDMACTASKFILE pMerged = pTask->pMergedNext;
+    pTask->pMergedNext = NULL;
+
+    while (pMerged)
+    {
+        PPDMACTASKFILE pNext = pMerged->pMergedNext;
+
+        pMerged->pMergedNext = NULL;
+        LogFlow(("Merged task=%#p completed with %Rrc\n", pMerged, rcReq));
+        pMerged->pfnCompleted(pMerged, pMerged->pvUser, rcReq);
+        pdmacFileTaskFree(pEndpoint, pMerged);
+
+        pMerged = pNext;
+    }
+}
+
 static int pdmacFileAioMgrNormalProcessTaskList(PPDMACTASKFILE pTaskHead,
                                                 PPDMACEPFILEMGR pAioMgr,
                                                 PPDMASYNCCOMPLETIONENDPOINTFILE pEndpoint)
@@ -1050,7 +1307,11 @@ static int pdmacFileAioMgrNormalProcessTaskList(PPDMACTASKFILE pTaskHead,
 
                 if (pCurr->hReq == NIL_RTFILEAIOREQ)
                 {
-                    if (pEndpoint->enmBackendType == PDMACFILEEPBACKEND_BUFFERED)
+                    /* Try to combine it with the adjacent tasks following first. */
+                    rc = pdmacFileAioMgrNormalTaskPrepareMerged(pAioMgr, pEndpoint, pCurr, &pTaskHead, &hReq);
+                    if (hReq != NIL_RTFILEAIOREQ)
+                        LogFlow(("Task %#p was merged with following tasks\n", pCurr));
+                    else if (pEndpoint->enmBackendType == PDMACFILEEPBACKEND_BUFFERED)
                         rc = pdmacFileAioMgrNormalTaskPrepareBuffered(pAioMgr, pEndpoint, pCurr, &hReq);
                     else if (pEndpoint->enmBackendType == PDMACFILEEPBACKEND_NON_BUFFERED)
                         rc = pdmacFileAioMgrNormalTaskPrepareNonBuffered(pAioMgr, pEndpoint, pCurr, &hReq);
@@ -1111,8 +1372,15 @@ static int pdmacFileAioMgrNormalProcessTaskList(PPDMACTASKFILE pTaskHead,
              */
             pdmacFileAioMgrNormalBalanceLoad(pAioMgr);
 #else
-            /* Grow the I/O manager */
-            pAioMgr->enmState = PDMACEPFILEMGRSTATE_GROWING;
+            /*
+             * Raise the limit if the host keeps up. The context needs to be recreated
+             * (by growing the I/O manager) only if it can't take that many requests.
+             */
+            uint32_t cRequestsActiveMaxNew = pdmacFileAioMgrNormalLimitCalc(pAioMgr);
+            if (cRequestsActiveMaxNew > pAioMgr->cRequestsCtxMax)
+                pAioMgr->enmState = PDMACEPFILEMGRSTATE_GROWING;
+            else
+                pAioMgr->cRequestsActiveMax = cRequestsActiveMaxNew;
 #endif
         }
     }
@@ -1388,6 +1656,7 @@ static void pdmacFileAioMgrNormalReqCompleteRc(PPDMACEPFILEMGR pAioMgr, RTFILEAI
 
             if (pTask->cbBounceBuffer)
                 RTMemPageFree(pTask->pvBounceBuffer, pTask->cbBounceBuffer);
+            pTask->cbBounceBuffer = 0;
 
             /*
              * Fatal errors are reported to the guest and non-fatal errors
@@ -1396,8 +1665,17 @@ static void pdmacFileAioMgrNormalReqCompleteRc(PPDMACEPFILEMGR pAioMgr, RTFILEAI
              */
             if (!pdmacFileAioMgrNormalRcIsFatal(rcReq))
             {
-                /* Queue the request on the pending list. */
-                pTask->pNext = pEndpoint->AioMgr.pReqsPendingHead;
+                /* Queue the request on the pending list, merged tasks are split up again. */
+                PPDMACTASKFILE pTaskTail = pTask;
+                while (pTaskTail->pMergedNext)
+                {
+                    pTaskTail->pNext = pTaskTail->pMergedNext;
+                    pTaskTail->pMergedNext = NULL;
+                    pTaskTail = pTaskTail->pNext;
+                }
+                pTaskTail->pNext = pEndpoint->AioMgr.pReqsPendingHead;
+                if (!pTaskTail->pNext)
+                    pEndpoint->AioMgr.pReqsPendingTail = pTaskTail;
                 pEndpoint->AioMgr.pReqsPendingHead = pTask;
 
                 /* Create a new failsafe manager if necessary. */
@@ -1432,6 +1710,7 @@ static void pdmacFileAioMgrNormalReqCompleteRc(PPDMACEPFILEMGR pAioMgr, RTFILEAI
             }
             else
             {
+                pdmacFileAioMgrNormalMergedTasksComplete(pEndpoint, pTask, rcReq);
                 pTask->pfnCompleted(pTask, pTask->pvUser, rcReq);
                 pdmacFileTaskFree(pEndpoint, pTask);
             }
@@ -1474,7 +1753,7 @@ static void pdmacFileAioMgrNormalReqCompleteRc(PPDMACEPFILEMGR pAioMgr, RTFILEAI
                 if (pTask->cbBounceBuffer)
                 {
                     AssertPtr(pTask->pvBounceBuffer);
-                    offStart     = (pTask->Off & ~((RTFOFF)512-1)) + cbTransfered;
+                    offStart     = (pTask->Off - pTask->offBounceBuffer) + cbTransfered;
                     cbToTransfer = pTask->cbBounceBuffer - cbTransfered;
                     pbBuf        = (uint8_t *)pTask->pvBounceBuffer + cbTransfered;
                 }
@@ -1539,10 +1818,18 @@ static void pdmacFileAioMgrNormalReqCompleteRc(PPDMACEPFILEMGR pAioMgr, RTFILEAI
                 if (RT_SUCCESS(rc) && pTask->cbBounceBuffer)
                 {
                     if (pTask->enmTransferType == PDMACTASKFILETRANSFER_READ)
+                    {
                         memcpy(pTask->DataSeg.pvSeg,
                                ((uint8_t *)pTask->pvBounceBuffer) + pTask->offBounceBuffer,
                                pTask->DataSeg.cbSeg);
 
+                        /* Distribute the data to the tasks merged into this request. */
+                        for (PPDMACTASKFILE pMerged = pTask->pMergedNext; pMerged; pMerged = pMerged->pMergedNext)
+                            memcpy(pMerged->DataSeg.pvSeg,
+                                   ((uint8_t *)pTask->pvBounceBuffer) + (pMerged->Off - pTask->Off),
+                                   pMerged->DataSeg.cbSeg);
+                    }
+
                     RTMemPageFree(pTask->pvBounceBuffer, pTask->cbBounceBuffer);
                 }
 
@@ -1558,6 +1845,7 @@ static void pdmacFileAioMgrNormalReqCompleteRc(PPDMACEPFILEMGR pAioMgr, RTFILEAI
 
                 /* Call completion callback */
                 LogFlow(("Task=%#p completed with %Rrc\n", pTask, rcReq));
+                pdmacFileAioMgrNormalMergedTasksComplete(pEndpoint, pTask, rcReq);
                 pTask->pfnCompleted(pTask, pTask->pvUser, rcReq);
                 pdmacFileTaskFree(pEndpoint, pTask);
 
@@ -1665,8 +1953,13 @@ DECLCALLBACK(int) pdmacFileAioMgrNormal(RTTHREAD hThreadSelf, void *pvUser)
 
                 LogFlow(("%d tasks completed\n", cReqsCompleted));
 
+                uint64_t tsNsNow = RTTimeNanoTS();
                 for (uint32_t i = 0; i < cReqsCompleted; i++)
+                {
+                    PPDMACTASKFILE pTask = (PPDMACTASKFILE)RTFileAioReqGetUser(apReqs[i]);
+                    pdmacFileAioMgrNormalLatencyUpdate(pAioMgr, tsNsNow - pTask->tsNsSubmit);
                     pdmacFileAioMgrNormalReqComplete(pAioMgr, apReqs[i]);
+                }
 
                 /* Check for an external blocking event before we go to sleep again. */
                 if (pAioMgr->fBlockingEventPending)
@@ -1691,6 +1984,9 @@ DECLCALLBACK(int) pdmacFileAioMgrNormal(RTTHREAD hThreadSelf, void *pvUser)
                         pEndpointCurr = pEndpointCurr->AioMgr.pEndpointNext;
                     }
 
+                    /* Adjust the request limit to the observed latency. */
+                    pdmacFileAioMgrNormalLimitUpdate(pAioMgr);
+
                     /* Set new update interval */
                     uMillisEnd = RTTimeMilliTS() + PDMACEPFILEMGR_LOAD_UPDATE_PERIOD;
                 }
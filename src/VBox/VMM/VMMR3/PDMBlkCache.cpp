@@ -17,6 +17,12 @@
 
 /** @page pg_pdm_block_cache     PDM Block Cache - The I/O cache
  * This component implements an I/O cache based on the 2Q cache algorithm.
+ *
+ * The cache memory is split into shards, each with its own 2Q lists and lock.
+ * Disk regions are mapped to shards by hashing the offset so concurrent
+ * accesses from different disks and vCPUs don't serialize on a single lock.
+ * Committing dirty entries and evicting data above a shard's high water mark
+ * is done by a worker thread instead of the I/O path.
  */
 
 /*******************************************************************************
@@ -97,17 +103,17 @@ DECLINLINE(void) pdmBlkCacheEntryRef(PPDMBLKCACHEENTRY pEntry)
 }
 
 #ifdef VBOX_STRICT
-static void pdmBlkCacheValidate(PPDMBLKCACHEGLOBAL pCache)
+static void pdmBlkCacheValidate(PPDMBLKCACHESHARD pShard)
 {
     /* Amount of cached data should never exceed the maximum amount. */
-    AssertMsg(pCache->cbCached <= pCache->cbMax,
+    AssertMsg(pShard->cbCached <= pShard->cbMax,
               ("Current amount of cached data exceeds maximum\n"));
 
     /* The amount of cached data in the LRU and FRU list should match cbCached */
-    AssertMsg(pCache->LruRecentlyUsedIn.cbCached + pCache->LruFrequentlyUsed.cbCached == pCache->cbCached,
+    AssertMsg(pShard->LruRecentlyUsedIn.cbCached + pShard->LruFrequentlyUsed.cbCached == pShard->cbCached,
               ("Amount of cached data doesn't match\n"));
 
-    AssertMsg(pCache->LruRecentlyUsedOut.cbCached <= pCache->cbRecentlyUsedOutMax,
+    AssertMsg(pShard->LruRecentlyUsedOut.cbCached <= pShard->cbRecentlyUsedOutMax,
               ("Paged out list exceeds maximum\n"));
 }
 #endif
@@ -115,29 +121,101 @@ static void pdmBlkCacheValidate(PPDMBLKCACHEGLOBAL pCache)
 DECLINLINE(void) pdmBlkCacheLockEnter(PPDMBLKCACHEGLOBAL pCache)
 {
     RTCritSectEnter(&pCache->CritSect);
+}
+
+DECLINLINE(void) pdmBlkCacheLockLeave(PPDMBLKCACHEGLOBAL pCache)
+{
+    RTCritSectLeave(&pCache->CritSect);
+}
+
+DECLINLINE(void) pdmBlkCacheShardLockEnter(PPDMBLKCACHESHARD pShard)
+{
+    RTCritSectEnter(&pShard->CritSect);
 #ifdef VBOX_STRICT
-    pdmBlkCacheValidate(pCache);
+    pdmBlkCacheValidate(pShard);
 #endif
 }
 
-DECLINLINE(void) pdmBlkCacheLockLeave(PPDMBLKCACHEGLOBAL pCache)
+DECLINLINE(void) pdmBlkCacheShardLockLeave(PPDMBLKCACHESHARD pShard)
 {
 #ifdef VBOX_STRICT
-    pdmBlkCacheValidate(pCache);
+    pdmBlkCacheValidate(pShard);
 #endif
-    RTCritSectLeave(&pCache->CritSect);
+    RTCritSectLeave(&pShard->CritSect);
+}
+
+/**
+ * Enters the locks of all shards in ascending order.
+ *
+ * @returns nothing.
+ * @param   pCache    The global cache instance.
+ */
+static void pdmBlkCacheShardLockEnterAll(PPDMBLKCACHEGLOBAL pCache)
+{
+    for (uint32_t i = 0; i < pCache->cShards; i++)
+        pdmBlkCacheShardLockEnter(&pCache->paShards[i]);
+}
+
+/**
+ * Leaves the locks of all shards.
+ *
+ * @returns nothing.
+ * @param   pCache    The global cache instance.
+ */
+static void pdmBlkCacheShardLockLeaveAll(PPDMBLKCACHEGLOBAL pCache)
+{
+    for (uint32_t i = pCache->cShards; i > 0; i--)
+        pdmBlkCacheShardLockLeave(&pCache->paShards[i - 1]);
+}
+
+/**
+ * Returns the shard managing the given disk region of a cache user.
+ *
+ * @returns Pointer to the shard.
+ * @param   pBlkCache    The endpoint cache.
+ * @param   off          Start offset of the region.
+ */
+DECLINLINE(PPDMBLKCACHESHARD) pdmBlkCacheShardGet(PPDMBLKCACHE pBlkCache, uint64_t off)
+{
+    PPDMBLKCACHEGLOBAL pCache = pBlkCache->pCache;
+    uint32_t uHash = (uint32_t)(off >> PDMBLKCACHE_SHARD_REGION_SHIFT) * UINT32_C(0x9e3779b1);
+
+    return &pCache->paShards[(pBlkCache->idxShardFirst + (uHash >> 16)) & (pCache->cShards - 1)];
+}
+
+/**
+ * Wakes up the worker thread.
+ *
+ * @returns nothing.
+ * @param   pCache     The global cache instance.
+ * @param   fCommit    Flag whether the worker should commit all dirty entries.
+ */
+static void pdmBlkCacheWorkerKick(PPDMBLKCACHEGLOBAL pCache, bool fCommit)
+{
+    if (fCommit)
+        ASMAtomicWriteBool(&pCache->fCommitRequested, true);
+
+    if (!ASMAtomicXchgBool(&pCache->fWorkerSignalled, true))
+    {
+        int rc = RTSemEventSignal(pCache->hEvtWorker);
+        AssertRC(rc);
+    }
 }
 
-DECLINLINE(void) pdmBlkCacheSub(PPDMBLKCACHEGLOBAL pCache, uint32_t cbAmount)
+DECLINLINE(void) pdmBlkCacheSub(PPDMBLKCACHESHARD pShard, uint32_t cbAmount)
 {
-    PDMACFILECACHE_IS_CRITSECT_OWNER(pCache);
-    pCache->cbCached -= cbAmount;
+    PDMACFILECACHE_IS_CRITSECT_OWNER(pShard);
+    pShard->cbCached -= cbAmount;
 }
 
-DECLINLINE(void) pdmBlkCacheAdd(PPDMBLKCACHEGLOBAL pCache, uint32_t cbAmount)
+DECLINLINE(void) pdmBlkCacheAdd(PPDMBLKCACHESHARD pShard, uint32_t cbAmount)
 {
-    PDMACFILECACHE_IS_CRITSECT_OWNER(pCache);
-    pCache->cbCached += cbAmount;
+    PDMACFILECACHE_IS_CRITSECT_OWNER(pShard);
+    pShard->cbCached += cbAmount;
+
+    /* Let the worker make room before the I/O path has to evict data itself. */
+    if (pShard->cbCached > pShard->cbHighWater)
+        pdmBlkCacheWorkerKick(pShard->pCache, false /* fCommit */);
 }
 
 DECLINLINE(void) pdmBlkCacheListAdd(PPDMBLKLRULIST pList, uint32_t cbAmount)
@@ -282,7 +360,7 @@ static void pdmBlkCacheEntryAddToList(PPDMBLKLRULIST pList, PPDMBLKCACHEENTRY pE
  * @returns nothing
  * @param   pList    Pointer to the LRU list to destroy.
  *
- * @note The caller must own the critical section of the cache.
+ * @note The caller must own the critical section of the shard.
  */
 static void pdmBlkCacheDestroyList(PPDMBLKLRULIST pList)
 {
@@ -305,7 +383,7 @@ static void pdmBlkCacheDestroyList(PPDMBLKLRULIST pList)
  * moving the entries to one of the given ghosts lists
  *
  * @returns Amount of data which could be freed.
- * @param    pCache           Pointer to the global cache data.
+ * @param    pShard           Pointer to the shard to evict data from.
  * @param    cbData           The amount of the data to free.
  * @param    pListSrc         The source list to evict data from.
  * @param    pGhostListSrc    The ghost list removed entries should be moved to
@@ -318,17 +396,20 @@ static void pdmBlkCacheDestroyList(PPDMBLKLRULIST pList)
  *          may be marked as non evictable if they are used for I/O at the
  *          moment.
  */
-static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData,
+static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHESHARD pShard, size_t cbData,
                                         PPDMBLKLRULIST pListSrc, PPDMBLKLRULIST pGhostListDst,
                                         bool fReuseBuffer, uint8_t **ppbBuffer)
 {
+#ifdef VBOX_WITH_STATISTICS
+    PPDMBLKCACHEGLOBAL pCache = pShard->pCache;
+#endif
     size_t cbEvicted = 0;
 
-    PDMACFILECACHE_IS_CRITSECT_OWNER(pCache);
+    PDMACFILECACHE_IS_CRITSECT_OWNER(pShard);
 
     AssertMsg(cbData > 0, ("Evicting 0 bytes not possible\n"));
     AssertMsg(   !pGhostListDst
-              || (pGhostListDst == &pCache->LruRecentlyUsedOut),
+              || (pGhostListDst == &pShard->LruRecentlyUsedOut),
               ("Destination list must be NULL or the recently used but paged out list\n"));
 
     if (fReuseBuffer)
@@ -372,7 +453,7 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
                 cbEvicted += pCurr->cbData;
 
                 pdmBlkCacheEntryRemoveFromList(pCurr);
-                pdmBlkCacheSub(pCache, pCurr->cbData);
+                pdmBlkCacheSub(pShard, pCurr->cbData);
 
                 if (pGhostListDst)
                 {
@@ -381,7 +462,7 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
                     PPDMBLKCACHEENTRY pGhostEntFree = pGhostListDst->pTail;
 
                     /* We have to remove the last entries from the paged out list. */
-                    while (   pGhostListDst->cbCached + pCurr->cbData > pCache->cbRecentlyUsedOutMax
+                    while (   pGhostListDst->cbCached + pCurr->cbData > pShard->cbRecentlyUsedOutMax
                            && pGhostEntFree)
                     {
                         PPDMBLKCACHEENTRY pFree = pGhostEntFree;
@@ -405,7 +486,7 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
                         RTSemRWReleaseWrite(pBlkCacheFree->SemRWEntries);
                     }
 
-                    if (pGhostListDst->cbCached + pCurr->cbData > pCache->cbRecentlyUsedOutMax)
+                    if (pGhostListDst->cbCached + pCurr->cbData > pShard->cbRecentlyUsedOutMax)
                     {
                         /* Couldn't remove enough entries. Delete */
                         STAM_PROFILE_ADV_START(&pCache->StatTreeRemove, Cache);
@@ -437,17 +518,17 @@ static size_t pdmBlkCacheEvictPagesFrom(PPDMBLKCACHEGLOBAL pCache, size_t cbData
     return cbEvicted;
 }
 
-static bool pdmBlkCacheReclaim(PPDMBLKCACHEGLOBAL pCache, size_t cbData, bool fReuseBuffer, uint8_t **ppbBuffer)
+static bool pdmBlkCacheReclaim(PPDMBLKCACHESHARD pShard, size_t cbData, bool fReuseBuffer, uint8_t **ppbBuffer)
 {
     size_t cbRemoved = 0;
 
-    if ((pCache->cbCached + cbData) < pCache->cbMax)
+    if ((pShard->cbCached + cbData) < pShard->cbMax)
         return true;
-    else if ((pCache->LruRecentlyUsedIn.cbCached + cbData) > pCache->cbRecentlyUsedInMax)
+    else if ((pShard->LruRecentlyUsedIn.cbCached + cbData) > pShard->cbRecentlyUsedInMax)
     {
         /* Try to evict as many bytes as possible from A1in */
-        cbRemoved = pdmBlkCacheEvictPagesFrom(pCache, cbData, &pCache->LruRecentlyUsedIn,
-                                                 &pCache->LruRecentlyUsedOut, fReuseBuffer, ppbBuffer);
+        cbRemoved = pdmBlkCacheEvictPagesFrom(pShard, cbData, &pShard->LruRecentlyUsedIn,
+                                                 &pShard->LruRecentlyUsedOut, fReuseBuffer, ppbBuffer);
 
         /*
          * If it was not possible to remove enough entries
@@ -462,17 +543,17 @@ static bool pdmBlkCacheReclaim(PPDMBLKCACHEGLOBAL pCache, size_t cbData, bool fR
              * we don't need to evict that much data
              */
             if (!cbRemoved)
-                cbRemoved += pdmBlkCacheEvictPagesFrom(pCache, cbData, &pCache->LruFrequentlyUsed,
+                cbRemoved += pdmBlkCacheEvictPagesFrom(pShard, cbData, &pShard->LruFrequentlyUsed,
                                                           NULL, fReuseBuffer, ppbBuffer);
             else
-                cbRemoved += pdmBlkCacheEvictPagesFrom(pCache, cbData - cbRemoved, &pCache->LruFrequentlyUsed,
+                cbRemoved += pdmBlkCacheEvictPagesFrom(pShard, cbData - cbRemoved, &pShard->LruFrequentlyUsed,
                                                           NULL, false, NULL);
         }
     }
     else
     {
         /* We have to remove entries from frequently access list. */
-        cbRemoved = pdmBlkCacheEvictPagesFrom(pCache, cbData, &pCache->LruFrequentlyUsed,
+        cbRemoved = pdmBlkCacheEvictPagesFrom(pShard, cbData, &pShard->LruFrequentlyUsed,
                                                  NULL, fReuseBuffer, ppbBuffer);
     }
 
@@ -480,6 +561,38 @@ static bool pdmBlkCacheReclaim(PPDMBLKCACHEGLOBAL pCache, size_t cbData, bool fR
     return (cbRemoved >= cbData);
 }
 
+/**
+ * Evicts data from the given shard until the amount of cached data drops
+ * below the low water mark. Called from the worker thread.
+ *
+ * @returns nothing.
+ * @param   pShard    The shard to trim.
+ */
+static void pdmBlkCacheShardTrim(PPDMBLKCACHESHARD pShard)
+{
+    pdmBlkCacheShardLockEnter(pShard);
+
+    if (pShard->cbCached > pShard->cbLowWater)
+    {
+        size_t cbEvict   = pShard->cbCached - pShard->cbLowWater;
+        size_t cbEvicted = 0;
+
+        /* Keep the 2Q policy, A1in is trimmed to its share first and moved to the ghost list. */
+        if (pShard->LruRecentlyUsedIn.cbCached > pShard->cbRecentlyUsedInMax)
+            cbEvicted = pdmBlkCacheEvictPagesFrom(pShard,
+                                                  RT_MIN(cbEvict, pShard->LruRecentlyUsedIn.cbCached - pShard->cbRecentlyUsedInMax),
+                                                  &pShard->LruRecentlyUsedIn, &pShard->LruRecentlyUsedOut,
+                                                  false, NULL);
+        if (cbEvicted < cbEvict)
+            cbEvicted += pdmBlkCacheEvictPagesFrom(pShard, cbEvict - cbEvicted, &pShard->LruFrequentlyUsed,
+                                                   NULL, false, NULL);
+
+        LogFlowFunc((": evicted %u bytes, requested %u\n", cbEvicted, cbEvict));
+    }
+
+    pdmBlkCacheShardLockLeave(pShard);
+}
+
 DECLINLINE(int) pdmBlkCacheEnqueue(PPDMBLKCACHE pBlkCache, uint64_t off, size_t cbXfer, PPDMBLKCACHEIOXFER pIoXfer)
 {
     int rc = VINF_SUCCESS;
@@ -797,13 +910,55 @@ static DECLCALLBACK(void) pdmBlkCacheCommitTimerCallback(PVM pVM, PTMTIMER pTime
     PPDMBLKCACHEGLOBAL pCache = (PPDMBLKCACHEGLOBAL)pvUser;
     NOREF(pVM); NOREF(pTimer);
 
-    LogFlowFunc(("Commit interval expired, commiting dirty entries\n"));
+    LogFlowFunc(("Commit interval expired, kicking the worker\n"));
 
     if (   ASMAtomicReadU32(&pCache->cbDirty) > 0
         && !ASMAtomicReadBool(&pCache->fIoErrorVmSuspended))
-        pdmBlkCacheCommitDirtyEntries(pCache);
+        pdmBlkCacheWorkerKick(pCache, true /* fCommit */);
+}
+
+/**
+ * Worker thread committing dirty entries and evicting data from the shards
+ * so neither has to happen on the I/O path.
+ *
+ * @returns VBox status code.
+ * @param   hThreadSelf    Thread handle.
+ * @param   pvUser         The global cache instance.
+ */
+static DECLCALLBACK(int) pdmBlkCacheWorker(RTTHREAD hThreadSelf, void *pvUser)
+{
+    PPDMBLKCACHEGLOBAL pCache = (PPDMBLKCACHEGLOBAL)pvUser;
+    NOREF(hThreadSelf);
+
+    while (!ASMAtomicReadBool(&pCache->fShutdown))
+    {
+        int rc = RTSemEventWait(pCache->hEvtWorker, RT_INDEFINITE_WAIT);
+        AssertRC(rc);
+
+        if (ASMAtomicReadBool(&pCache->fShutdown))
+            break;
+
+        ASMAtomicWriteBool(&pCache->fWorkerSignalled, false);
+
+        /* Commit first, dirty entries can't be evicted. */
+        if (   ASMAtomicXchgBool(&pCache->fCommitRequested, false)
+            && ASMAtomicReadU32(&pCache->cbDirty) > 0
+            && !ASMAtomicReadBool(&pCache->fIoErrorVmSuspended))
+        {
+            LogFlowFunc(("Commiting dirty entries\n"));
+            pdmBlkCacheCommitDirtyEntries(pCache);
+        }
+
+        for (uint32_t i = 0; i < pCache->cShards; i++)
+        {
+            PPDMBLKCACHESHARD pShard = &pCache->paShards[i];
 
-    LogFlowFunc(("Entries committed, going to sleep\n"));
+            if (ASMAtomicReadU32(&pShard->cbCached) > pShard->cbLowWater)
+                pdmBlkCacheShardTrim(pShard);
+        }
+    }
+
+    return VINF_SUCCESS;
 }
 
 static DECLCALLBACK(int) pdmR3BlkCacheSaveExec(PVM pVM, PSSMHANDLE pSSM)
@@ -843,8 +998,8 @@ static DECLCALLBACK(int) pdmR3BlkCacheSaveExec(PVM pVM, PSSMHANDLE pSSM)
             AssertMsg(pEntry->fFlags & PDMBLKCACHE_ENTRY_IS_DIRTY, ("Entry is not dirty\n"));
             AssertMsg(!(pEntry->fFlags & ~PDMBLKCACHE_ENTRY_IS_DIRTY), ("Invalid flags set\n"));
             AssertMsg(!pEntry->pWaitingHead && !pEntry->pWaitingTail, ("There are waiting requests\n"));
-            AssertMsg(   pEntry->pList == &pBlkCacheGlobal->LruRecentlyUsedIn
-                      || pEntry->pList == &pBlkCacheGlobal->LruFrequentlyUsed,
+            AssertMsg(   pEntry->pList == &pEntry->pShard->LruRecentlyUsedIn
+                      || pEntry->pList == &pEntry->pShard->LruFrequentlyUsed,
                       ("Invalid list\n"));
             AssertMsg(pEntry->cbData == pEntry->Core.KeyLast - pEntry->Core.Key + 1,
                       ("Size and range do not match\n"));
@@ -956,8 +1111,10 @@ static DECLCALLBACK(int) pdmR3BlkCacheLoadExec(PVM pVM, PSSMHANDLE pSSM, uint32_
 
             /* Add to the dirty list. */
             pdmBlkCacheAddDirtyEntry(pBlkCache, pEntry);
-            pdmBlkCacheEntryAddToList(&pBlkCacheGlobal->LruRecentlyUsedIn, pEntry);
-            pdmBlkCacheAdd(pBlkCacheGlobal, cbEntry);
+            pdmBlkCacheShardLockEnter(pEntry->pShard);
+            pdmBlkCacheEntryAddToList(&pEntry->pShard->LruRecentlyUsedIn, pEntry);
+            pdmBlkCacheAdd(pEntry->pShard, cbEntry);
+            pdmBlkCacheShardLockLeave(pEntry->pShard);
             pdmBlkCacheEntryRelease(pEntry);
             cEntries--;
         }
@@ -985,6 +1142,46 @@ static DECLCALLBACK(int) pdmR3BlkCacheLoadExec(PVM pVM, PSSMHANDLE pSSM, uint32_
     return rc;
 }
 
+/**
+ * Destroys the shard array of the given cache, the shards must be empty.
+ *
+ * @returns nothing.
+ * @param   pCache    The global cache instance.
+ */
+static void pdmBlkCacheShardsDestroy(PPDMBLKCACHEGLOBAL pCache)
+{
+    for (uint32_t i = 0; i < pCache->cShards; i++)
+        RTCritSectDelete(&pCache->paShards[i].CritSect);
+
+    RTMemFree(pCache->paShards);
+    pCache->paShards = NULL;
+}
+
+/**
+ * Stops the worker thread and destroys the event semaphore it waits on.
+ *
+ * @returns nothing.
+ * @param   pCache    The global cache instance.
+ */
+static void pdmBlkCacheWorkerDestroy(PPDMBLKCACHEGLOBAL pCache)
+{
+    if (pCache->hThreadWorker != NIL_RTTHREAD)
+    {
+        ASMAtomicWriteBool(&pCache->fShutdown, true);
+        RTSemEventSignal(pCache->hEvtWorker);
+
+        int rc = RTThreadWait(pCache->hThreadWorker, RT_INDEFINITE_WAIT, NULL);
+        AssertRC(rc);
+        pCache->hThreadWorker = NIL_RTTHREAD;
+    }
+
+    if (pCache->hEvtWorker != NIL_RTSEMEVENT)
+    {
+        RTSemEventDestroy(pCache->hEvtWorker);
+        pCache->hEvtWorker = NIL_RTSEMEVENT;
+    }
+}
+
 int pdmR3BlkCacheInit(PVM pVM)
 {
     int  rc   = VINF_SUCCESS;
@@ -1005,21 +1202,9 @@ int pdmR3BlkCacheInit(PVM pVM)
     RTListInit(&pBlkCacheGlobal->ListUsers);
     pBlkCacheGlobal->pVM = pVM;
     pBlkCacheGlobal->cRefs = 0;
-    pBlkCacheGlobal->cbCached  = 0;
     pBlkCacheGlobal->fCommitInProgress = false;
-
-    /* Initialize members */
-    pBlkCacheGlobal->LruRecentlyUsedIn.pHead    = NULL;
-    pBlkCacheGlobal->LruRecentlyUsedIn.pTail    = NULL;
-    pBlkCacheGlobal->LruRecentlyUsedIn.cbCached = 0;
-
-    pBlkCacheGlobal->LruRecentlyUsedOut.pHead    = NULL;
-    pBlkCacheGlobal->LruRecentlyUsedOut.pTail    = NULL;
-    pBlkCacheGlobal->LruRecentlyUsedOut.cbCached = 0;
-
-    pBlkCacheGlobal->LruFrequentlyUsed.pHead    = NULL;
-    pBlkCacheGlobal->LruFrequentlyUsed.pTail    = NULL;
-    pBlkCacheGlobal->LruFrequentlyUsed.cbCached = 0;
+    pBlkCacheGlobal->hThreadWorker = NIL_RTTHREAD;
+    pBlkCacheGlobal->hEvtWorker    = NIL_RTSEMEVENT;
 
     do
     {
@@ -1027,16 +1212,59 @@ int pdmR3BlkCacheInit(PVM pVM)
         AssertLogRelRCBreak(rc);
         LogFlowFunc(("Maximum number of bytes cached %u\n", pBlkCacheGlobal->cbMax));
 
-        pBlkCacheGlobal->cbRecentlyUsedInMax  = (pBlkCacheGlobal->cbMax / 100) * 25; /* 25% of the buffer size */
-        pBlkCacheGlobal->cbRecentlyUsedOutMax = (pBlkCacheGlobal->cbMax / 100) * 50; /* 50% of the buffer size */
-        LogFlowFunc(("cbRecentlyUsedInMax=%u cbRecentlyUsedOutMax=%u\n",
-                     pBlkCacheGlobal->cbRecentlyUsedInMax, pBlkCacheGlobal->cbRecentlyUsedOutMax));
+        /*
+         * Use one shard per virtual CPU as long as every shard gets a reasonable
+         * amount of memory, the default cache size results in a single shard.
+         */
+        uint32_t cShardsDef = RT_MAX(1, RT_MIN(pVM->cCpus, pBlkCacheGlobal->cbMax / PDMBLKCACHE_SHARD_SIZE_MIN));
+        uint32_t cShards;
+        rc = CFGMR3QueryU32Def(pCfgBlkCache, "CacheShards", &cShards, cShardsDef);
+        AssertLogRelRCBreak(rc);
+        cShards = RT_MIN(RT_MAX(cShards, 1), PDMBLKCACHE_SHARDS_MAX);
+        while (cShards & (cShards - 1)) /* Round down to a power of two. */
+            cShards &= cShards - 1;
+        pBlkCacheGlobal->cShards = cShards;
 
         /** @todo r=aeichner: Experiment to find optimal default values */
         rc = CFGMR3QueryU32Def(pCfgBlkCache, "CacheCommitIntervalMs", &pBlkCacheGlobal->u32CommitTimeoutMs, 10000 /* 10sec */);
         AssertLogRelRCBreak(rc);
         rc = CFGMR3QueryU32Def(pCfgBlkCache, "CacheCommitThreshold", &pBlkCacheGlobal->cbCommitDirtyThreshold, pBlkCacheGlobal->cbMax / 2);
         AssertLogRelRCBreak(rc);
+
+        pBlkCacheGlobal->paShards = (PPDMBLKCACHESHARD)RTMemAllocZ(pBlkCacheGlobal->cShards * sizeof(PDMBLKCACHESHARD));
+        if (!pBlkCacheGlobal->paShards)
+        {
+            rc = VERR_NO_MEMORY;
+            break;
+        }
+
+        uint32_t i;
+        for (i = 0; i < pBlkCacheGlobal->cShards; i++)
+        {
+            PPDMBLKCACHESHARD pShard = &pBlkCacheGlobal->paShards[i];
+
+            pShard->pCache               = pBlkCacheGlobal;
+            pShard->cbMax                = pBlkCacheGlobal->cbMax / pBlkCacheGlobal->cShards;
+            pShard->cbHighWater          = pShard->cbMax - pShard->cbMax / 16;
+            pShard->cbLowWater           = pShard->cbMax - pShard->cbMax / 8;
+            pShard->cbRecentlyUsedInMax  = (pShard->cbMax / 100) * 25; /* 25% of the buffer size */
+            pShard->cbRecentlyUsedOutMax = (pShard->cbMax / 100) * 50; /* 50% of the buffer size */
+
+            rc = RTCritSectInit(&pShard->CritSect);
+            if (RT_FAILURE(rc))
+                break;
+        }
+
+        if (RT_FAILURE(rc))
+        {
+            while (i-- > 0)
+                RTCritSectDelete(&pBlkCacheGlobal->paShards[i].CritSect);
+            RTMemFree(pBlkCacheGlobal->paShards);
+            break;
+        }
+
+        LogFlowFunc(("cShards=%u cbRecentlyUsedInMax=%u cbRecentlyUsedOutMax=%u\n", pBlkCacheGlobal->cShards,
+                     pBlkCacheGlobal->paShards[0].cbRecentlyUsedInMax, pBlkCacheGlobal->paShards[0].cbRecentlyUsedOutMax));
     } while (0);
 
     if (RT_SUCCESS(rc))
@@ -1046,26 +1274,28 @@ int pdmR3BlkCacheInit(PVM pVM)
                        "/PDM/BlkCache/cbMax",
                        STAMUNIT_BYTES,
                        "Maximum cache size");
-        STAMR3Register(pVM, &pBlkCacheGlobal->cbCached,
-                       STAMTYPE_U32, STAMVISIBILITY_ALWAYS,
-                       "/PDM/BlkCache/cbCached",
-                       STAMUNIT_BYTES,
-                       "Currently used cache");
-        STAMR3Register(pVM, &pBlkCacheGlobal->LruRecentlyUsedIn.cbCached,
-                       STAMTYPE_U32, STAMVISIBILITY_ALWAYS,
-                       "/PDM/BlkCache/cbCachedMruIn",
-                       STAMUNIT_BYTES,
-                       "Number of bytes cached in MRU list");
-        STAMR3Register(pVM, &pBlkCacheGlobal->LruRecentlyUsedOut.cbCached,
-                       STAMTYPE_U32, STAMVISIBILITY_ALWAYS,
-                       "/PDM/BlkCache/cbCachedMruOut",
-                       STAMUNIT_BYTES,
-                       "Number of bytes cached in FRU list");
-        STAMR3Register(pVM, &pBlkCacheGlobal->LruFrequentlyUsed.cbCached,
-                       STAMTYPE_U32, STAMVISIBILITY_ALWAYS,
-                       "/PDM/BlkCache/cbCachedFru",
-                       STAMUNIT_BYTES,
-                       "Number of bytes cached in FRU ghost list");
+
+        for (uint32_t i = 0; i < pBlkCacheGlobal->cShards; i++)
+        {
+            PPDMBLKCACHESHARD pShard = &pBlkCacheGlobal->paShards[i];
+
+            STAMR3RegisterF(pVM, &pShard->cbCached,
+                            STAMTYPE_U32, STAMVISIBILITY_ALWAYS,
+                            STAMUNIT_BYTES, "Currently used cache",
+                            "/PDM/BlkCache/Shard%u/cbCached", i);
+            STAMR3RegisterF(pVM, &pShard->LruRecentlyUsedIn.cbCached,
+                            STAMTYPE_U32, STAMVISIBILITY_ALWAYS,
+                            STAMUNIT_BYTES, "Number of bytes cached in MRU list",
+                            "/PDM/BlkCache/Shard%u/cbCachedMruIn", i);
+            STAMR3RegisterF(pVM, &pShard->LruRecentlyUsedOut.cbCached,
+                            STAMTYPE_U32, STAMVISIBILITY_ALWAYS,
+                            STAMUNIT_BYTES, "Number of bytes cached in FRU list",
+                            "/PDM/BlkCache/Shard%u/cbCachedMruOut", i);
+            STAMR3RegisterF(pVM, &pShard->LruFrequentlyUsed.cbCached,
+                            STAMTYPE_U32, STAMVISIBILITY_ALWAYS,
+                            STAMUNIT_BYTES, "Number of bytes cached in FRU ghost list",
+                            "/PDM/BlkCache/Shard%u/cbCachedFru", i);
+        }
 
 #ifdef VBOX_WITH_STATISTICS
         STAMR3Register(pVM, &pBlkCacheGlobal->cHits,
@@ -1108,12 +1338,20 @@ int pdmR3BlkCacheInit(PVM pVM)
 
         /* Initialize the critical section */
         rc = RTCritSectInit(&pBlkCacheGlobal->CritSect);
+        if (RT_FAILURE(rc))
+            pdmBlkCacheShardsDestroy(pBlkCacheGlobal);
     }
 
     if (RT_SUCCESS(rc))
     {
+        rc = RTSemEventCreate(&pBlkCacheGlobal->hEvtWorker);
+        if (RT_SUCCESS(rc))
+            rc = RTThreadCreate(&pBlkCacheGlobal->hThreadWorker, pdmBlkCacheWorker, pBlkCacheGlobal, 0,
+                                RTTHREADTYPE_IO, RTTHREADFLAGS_WAITABLE, "BlkCacheWrk");
+
         /* Create the commit timer */
-        if (pBlkCacheGlobal->u32CommitTimeoutMs > 0)
+        if (   RT_SUCCESS(rc)
+            && pBlkCacheGlobal->u32CommitTimeoutMs > 0)
             rc = TMR3TimerCreateInternal(pVM, TMCLOCK_REAL,
                                          pdmBlkCacheCommitTimerCallback,
                                          pBlkCacheGlobal,
@@ -1129,7 +1367,8 @@ int pdmR3BlkCacheInit(PVM pVM)
                                        NULL, pdmR3BlkCacheLoadExec, NULL);
             if (RT_SUCCESS(rc))
             {
-                LogRel(("BlkCache: Cache successfully initialised. Cache size is %u bytes\n", pBlkCacheGlobal->cbMax));
+                LogRel(("BlkCache: Cache successfully initialised. Cache size is %u bytes in %u shard(s)\n",
+                        pBlkCacheGlobal->cbMax, pBlkCacheGlobal->cShards));
                 LogRel(("BlkCache: Cache commit interval is %u ms\n", pBlkCacheGlobal->u32CommitTimeoutMs));
                 LogRel(("BlkCache: Cache commit threshold is %u bytes\n", pBlkCacheGlobal->cbCommitDirtyThreshold));
                 pUVM->pdm.s.pBlkCacheGlobal = pBlkCacheGlobal;
@@ -1137,7 +1376,9 @@ int pdmR3BlkCacheInit(PVM pVM)
             }
         }
 
+        pdmBlkCacheWorkerDestroy(pBlkCacheGlobal);
         RTCritSectDelete(&pBlkCacheGlobal->CritSect);
+        pdmBlkCacheShardsDestroy(pBlkCacheGlobal);
     }
 
     if (pBlkCacheGlobal)
@@ -1153,17 +1394,27 @@ void pdmR3BlkCacheTerm(PVM pVM)
 
     if (pBlkCacheGlobal)
     {
+        pdmBlkCacheWorkerDestroy(pBlkCacheGlobal);
+
         /* Make sure no one else uses the cache now */
         pdmBlkCacheLockEnter(pBlkCacheGlobal);
+        pdmBlkCacheShardLockEnterAll(pBlkCacheGlobal);
 
         /* Cleanup deleting all cache entries waiting for in progress entries to finish. */
-        pdmBlkCacheDestroyList(&pBlkCacheGlobal->LruRecentlyUsedIn);
-        pdmBlkCacheDestroyList(&pBlkCacheGlobal->LruRecentlyUsedOut);
-        pdmBlkCacheDestroyList(&pBlkCacheGlobal->LruFrequentlyUsed);
+        for (uint32_t i = 0; i < pBlkCacheGlobal->cShards; i++)
+        {
+            PPDMBLKCACHESHARD pShard = &pBlkCacheGlobal->paShards[i];
 
+            pdmBlkCacheDestroyList(&pShard->LruRecentlyUsedIn);
+            pdmBlkCacheDestroyList(&pShard->LruRecentlyUsedOut);
+            pdmBlkCacheDestroyList(&pShard->LruFrequentlyUsed);
+        }
+
+        pdmBlkCacheShardLockLeaveAll(pBlkCacheGlobal);
         pdmBlkCacheLockLeave(pBlkCacheGlobal);
 
         RTCritSectDelete(&pBlkCacheGlobal->CritSect);
+        pdmBlkCacheShardsDestroy(pBlkCacheGlobal);
         RTMemFree(pBlkCacheGlobal);
         pVM->pUVM->pdm.s.pBlkCacheGlobal = NULL;
     }
@@ -1214,6 +1465,7 @@ static int pdmR3BlkCacheRetain(PVM pVM, PPPDMBLKCACHE ppBlkCache, const char *pc
         {
             pBlkCache->fSuspended = false;
             pBlkCache->pCache = pBlkCacheGlobal;
+            pBlkCache->idxShardFirst = pBlkCacheGlobal->idxShardNext++;
             RTListInit(&pBlkCache->ListDirtyNotCommitted);
 
             rc = RTSpinlockCreate(&pBlkCache->LockList, RTSPINLOCK_FLAGS_INTERRUPT_UNSAFE, "pdmR3BlkCacheRetain");
@@ -1383,12 +1635,12 @@ static int pdmBlkCacheEntryDestroy(PAVLRU64NODECORE pNode, void *pvUser)
         /* Leave the locks to let the I/O thread make progress but reference the entry to prevent eviction. */
         pdmBlkCacheEntryRef(pEntry);
         RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
-        pdmBlkCacheLockLeave(pCache);
+        pdmBlkCacheShardLockLeaveAll(pCache);
 
         RTThreadSleep(250);
 
         /* Re-enter all locks */
-        pdmBlkCacheLockEnter(pCache);
+        pdmBlkCacheShardLockEnterAll(pCache);
         RTSemRWRequestWrite(pBlkCache->SemRWEntries, RT_INDEFINITE_WAIT);
         pdmBlkCacheEntryRelease(pEntry);
     }
@@ -1396,13 +1648,14 @@ static int pdmBlkCacheEntryDestroy(PAVLRU64NODECORE pNode, void *pvUser)
     AssertMsg(!(pEntry->fFlags & PDMBLKCACHE_ENTRY_IO_IN_PROGRESS),
                 ("Entry is dirty and/or still in progress fFlags=%#x\n", pEntry->fFlags));
 
-    bool fUpdateCache =    pEntry->pList == &pCache->LruFrequentlyUsed
-                        || pEntry->pList == &pCache->LruRecentlyUsedIn;
+    PPDMBLKCACHESHARD pShard = pEntry->pShard;
+    bool fUpdateCache =    pEntry->pList == &pShard->LruFrequentlyUsed
+                        || pEntry->pList == &pShard->LruRecentlyUsedIn;
 
     pdmBlkCacheEntryRemoveFromList(pEntry);
 
     if (fUpdateCache)
-        pdmBlkCacheSub(pCache, pEntry->cbData);
+        pdmBlkCacheSub(pShard, pEntry->cbData);
 
     RTMemPageFree(pEntry->pbData, pEntry->cbData);
     RTMemFree(pEntry);
@@ -1430,9 +1683,11 @@ VMMR3DECL(void) PDMR3BlkCacheRelease(PPDMBLKCACHE pBlkCache)
 
     /* Make sure nobody is accessing the cache while we delete the tree. */
     pdmBlkCacheLockEnter(pCache);
+    pdmBlkCacheShardLockEnterAll(pCache);
     RTSemRWRequestWrite(pBlkCache->SemRWEntries, RT_INDEFINITE_WAIT);
     RTAvlrU64Destroy(pBlkCache->pTree, pdmBlkCacheEntryDestroy, pCache);
     RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
+    pdmBlkCacheShardLockLeaveAll(pCache);
 
     RTSpinlockDestroy(pBlkCache->LockList);
 
@@ -1617,6 +1872,7 @@ static PPDMBLKCACHEENTRY pdmBlkCacheEntryAlloc(PPDMBLKCACHE pBlkCache,
     pEntryNew->Core.Key      = off;
     pEntryNew->Core.KeyLast  = off + cbData - 1;
     pEntryNew->pBlkCache     = pBlkCache;
+    pEntryNew->pShard        = pdmBlkCacheShardGet(pBlkCache, off);
     pEntryNew->fFlags        = 0;
     pEntryNew->cRefs         = 1; /* We are using it now. */
     pEntryNew->pList         = NULL;
@@ -1819,12 +2075,12 @@ static PPDMBLKCACHEENTRY pdmBlkCacheEntryCreate(PPDMBLKCACHE pBlkCache,
     *pcbData = pdmBlkCacheEntryBoundariesCalc(pBlkCache, off, (uint32_t)cb, &cbEntry);
     AssertReturn(cb <= UINT32_MAX, NULL);
 
-    PPDMBLKCACHEGLOBAL pCache = pBlkCache->pCache;
-    pdmBlkCacheLockEnter(pCache);
+    PPDMBLKCACHESHARD pShard = pdmBlkCacheShardGet(pBlkCache, off);
+    pdmBlkCacheShardLockEnter(pShard);
 
     PPDMBLKCACHEENTRY pEntryNew = NULL;
     uint8_t          *pbBuffer  = NULL;
-    bool fEnough = pdmBlkCacheReclaim(pCache, cbEntry, true, &pbBuffer);
+    bool fEnough = pdmBlkCacheReclaim(pShard, cbEntry, true, &pbBuffer);
     if (fEnough)
     {
         LogFlow(("Evicted enough bytes (%u requested). Creating new cache entry\n", cbEntry));
@@ -1832,9 +2088,10 @@ static PPDMBLKCACHEENTRY pdmBlkCacheEntryCreate(PPDMBLKCACHE pBlkCache,
         pEntryNew = pdmBlkCacheEntryAlloc(pBlkCache, off, cbEntry, pbBuffer);
         if (RT_LIKELY(pEntryNew))
         {
-            pdmBlkCacheEntryAddToList(&pCache->LruRecentlyUsedIn, pEntryNew);
-            pdmBlkCacheAdd(pCache, cbEntry);
-            pdmBlkCacheLockLeave(pCache);
+            Assert(pEntryNew->pShard == pShard);
+            pdmBlkCacheEntryAddToList(&pShard->LruRecentlyUsedIn, pEntryNew);
+            pdmBlkCacheAdd(pShard, cbEntry);
+            pdmBlkCacheShardLockLeave(pShard);
 
             pdmBlkCacheInsertEntry(pBlkCache, pEntryNew);
 
@@ -1843,10 +2100,10 @@ static PPDMBLKCACHEENTRY pdmBlkCacheEntryCreate(PPDMBLKCACHE pBlkCache,
                       ("Overflow in calculation off=%llu\n", off));
         }
         else
-            pdmBlkCacheLockLeave(pCache);
+            pdmBlkCacheShardLockLeave(pShard);
     }
     else
-        pdmBlkCacheLockLeave(pCache);
+        pdmBlkCacheShardLockLeave(pShard);
 
     return pEntryNew;
 }
@@ -1926,7 +2183,9 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
                                  PCRTSGBUF pcSgBuf, size_t cbRead, void *pvUser)
 {
     int rc = VINF_SUCCESS;
+#ifdef VBOX_WITH_STATISTICS
     PPDMBLKCACHEGLOBAL pCache = pBlkCache->pCache;
+#endif
     PPDMBLKCACHEENTRY  pEntry;
     PPDMBLKCACHEREQ    pReq;
 
@@ -1990,8 +2249,8 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
             STAM_COUNTER_ADD(&pCache->StatRead, cbToRead);
 
             /* Ghost lists contain no data. */
-            if (   (pEntry->pList == &pCache->LruRecentlyUsedIn)
-                || (pEntry->pList == &pCache->LruFrequentlyUsed))
+            if (   (pEntry->pList == &pEntry->pShard->LruRecentlyUsedIn)
+                || (pEntry->pList == &pEntry->pShard->LruFrequentlyUsed))
             {
                 if (pdmBlkCacheEntryFlagIsSetClearAcquireLock(pBlkCache, pEntry,
                                                               PDMBLKCACHE_ENTRY_IO_IN_PROGRESS,
@@ -2009,12 +2268,13 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
                     RTSgBufCopyFromBuf(&SgBuf, pEntry->pbData + offDiff, cbToRead);
                 }
 
-                /* Move this entry to the top position */
-                if (pEntry->pList == &pCache->LruFrequentlyUsed)
+                /* Move this entry to the top position unless it is there already. */
+                if (   pEntry->pList == &pEntry->pShard->LruFrequentlyUsed
+                    && pEntry->pShard->LruFrequentlyUsed.pHead != pEntry)
                 {
-                    pdmBlkCacheLockEnter(pCache);
-                    pdmBlkCacheEntryAddToList(&pCache->LruFrequentlyUsed, pEntry);
-                    pdmBlkCacheLockLeave(pCache);
+                    pdmBlkCacheShardLockEnter(pEntry->pShard);
+                    pdmBlkCacheEntryAddToList(&pEntry->pShard->LruFrequentlyUsed, pEntry);
+                    pdmBlkCacheShardLockLeave(pEntry->pShard);
                 }
                 /* Release the entry */
                 pdmBlkCacheEntryRelease(pEntry);
@@ -2025,16 +2285,16 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
 
                 LogFlow(("Fetching data for ghost entry %#p from file\n", pEntry));
 
-                pdmBlkCacheLockEnter(pCache);
+                pdmBlkCacheShardLockEnter(pEntry->pShard);
                 pdmBlkCacheEntryRemoveFromList(pEntry); /* Remove it before we remove data, otherwise it may get freed when evicting data. */
-                bool fEnough = pdmBlkCacheReclaim(pCache, pEntry->cbData, true, &pbBuffer);
+                bool fEnough = pdmBlkCacheReclaim(pEntry->pShard, pEntry->cbData, true, &pbBuffer);
 
                 /* Move the entry to Am and fetch it to the cache. */
                 if (fEnough)
                 {
-                    pdmBlkCacheEntryAddToList(&pCache->LruFrequentlyUsed, pEntry);
-                    pdmBlkCacheAdd(pCache, pEntry->cbData);
-                    pdmBlkCacheLockLeave(pCache);
+                    pdmBlkCacheEntryAddToList(&pEntry->pShard->LruFrequentlyUsed, pEntry);
+                    pdmBlkCacheAdd(pEntry->pShard, pEntry->cbData);
+                    pdmBlkCacheShardLockLeave(pEntry->pShard);
 
                     if (pbBuffer)
                         pEntry->pbData = pbBuffer;
@@ -2057,7 +2317,7 @@ VMMR3DECL(int) PDMR3BlkCacheRead(PPDMBLKCACHE pBlkCache, uint64_t off,
                     STAM_PROFILE_ADV_STOP(&pCache->StatTreeRemove, Cache);
                     RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
 
-                    pdmBlkCacheLockLeave(pCache);
+                    pdmBlkCacheShardLockLeave(pEntry->pShard);
 
                     RTMemFree(pEntry);
 
@@ -2190,8 +2450,8 @@ VMMR3DECL(int) PDMR3BlkCacheWrite(PPDMBLKCACHE pBlkCache, uint64_t off,
             STAM_COUNTER_ADD(&pCache->StatWritten, cbToWrite);
 
             /* Ghost lists contain no data. */
-            if (   (pEntry->pList == &pCache->LruRecentlyUsedIn)
-                || (pEntry->pList == &pCache->LruFrequentlyUsed))
+            if (   (pEntry->pList == &pEntry->pShard->LruRecentlyUsedIn)
+                || (pEntry->pList == &pEntry->pShard->LruFrequentlyUsed))
             {
                 /* Check if the entry is dirty. */
                 if (pdmBlkCacheEntryFlagIsSetClearAcquireLock(pBlkCache, pEntry,
@@ -2233,18 +2493,18 @@ VMMR3DECL(int) PDMR3BlkCacheWrite(PPDMBLKCACHE pBlkCache, uint64_t off,
                         /* Write as much as we can into the entry and update the file. */
                         RTSgBufCopyToBuf(&SgBuf, pEntry->pbData + offDiff, cbToWrite);
 
-                        bool fCommit = pdmBlkCacheAddDirtyEntry(pBlkCache, pEntry);
-                        if (fCommit)
-                            pdmBlkCacheCommitDirtyEntries(pCache);
+                        if (pdmBlkCacheAddDirtyEntry(pBlkCache, pEntry))
+                            pdmBlkCacheWorkerKick(pCache, true /* fCommit */);
                     }
                 } /* Dirty bit not set */
 
-                /* Move this entry to the top position */
-                if (pEntry->pList == &pCache->LruFrequentlyUsed)
+                /* Move this entry to the top position unless it is there already. */
+                if (   pEntry->pList == &pEntry->pShard->LruFrequentlyUsed
+                    && pEntry->pShard->LruFrequentlyUsed.pHead != pEntry)
                 {
-                    pdmBlkCacheLockEnter(pCache);
-                    pdmBlkCacheEntryAddToList(&pCache->LruFrequentlyUsed, pEntry);
-                    pdmBlkCacheLockLeave(pCache);
+                    pdmBlkCacheShardLockEnter(pEntry->pShard);
+                    pdmBlkCacheEntryAddToList(&pEntry->pShard->LruFrequentlyUsed, pEntry);
+                    pdmBlkCacheShardLockLeave(pEntry->pShard);
                 }
 
                 pdmBlkCacheEntryRelease(pEntry);
@@ -2253,16 +2513,16 @@ VMMR3DECL(int) PDMR3BlkCacheWrite(PPDMBLKCACHE pBlkCache, uint64_t off,
             {
                 uint8_t *pbBuffer = NULL;
 
-                pdmBlkCacheLockEnter(pCache);
+                pdmBlkCacheShardLockEnter(pEntry->pShard);
                 pdmBlkCacheEntryRemoveFromList(pEntry); /* Remove it before we remove data, otherwise it may get freed when evicting data. */
-                bool fEnough = pdmBlkCacheReclaim(pCache, pEntry->cbData, true, &pbBuffer);
+                bool fEnough = pdmBlkCacheReclaim(pEntry->pShard, pEntry->cbData, true, &pbBuffer);
 
                 if (fEnough)
                 {
                     /* Move the entry to Am and fetch it to the cache. */
-                    pdmBlkCacheEntryAddToList(&pCache->LruFrequentlyUsed, pEntry);
-                    pdmBlkCacheAdd(pCache, pEntry->cbData);
-                    pdmBlkCacheLockLeave(pCache);
+                    pdmBlkCacheEntryAddToList(&pEntry->pShard->LruFrequentlyUsed, pEntry);
+                    pdmBlkCacheAdd(pEntry->pShard, pEntry->cbData);
+                    pdmBlkCacheShardLockLeave(pEntry->pShard);
 
                     if (pbBuffer)
                         pEntry->pbData = pbBuffer;
@@ -2287,7 +2547,7 @@ VMMR3DECL(int) PDMR3BlkCacheWrite(PPDMBLKCACHE pBlkCache, uint64_t off,
                     STAM_PROFILE_ADV_STOP(&pCache->StatTreeRemove, Cache);
                     RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
 
-                    pdmBlkCacheLockLeave(pCache);
+                    pdmBlkCacheShardLockLeave(pEntry->pShard);
 
                     RTMemFree(pEntry);
                     pdmBlkCacheRequestPassthrough(pBlkCache, pReq,
@@ -2322,9 +2582,8 @@ VMMR3DECL(int) PDMR3BlkCacheWrite(PPDMBLKCACHE pBlkCache, uint64_t off,
                 {
                     RTSgBufCopyToBuf(&SgBuf, pEntryNew->pbData, cbToWrite);
 
-                    bool fCommit = pdmBlkCacheAddDirtyEntry(pBlkCache, pEntryNew);
-                    if (fCommit)
-                        pdmBlkCacheCommitDirtyEntries(pCache);
+                    if (pdmBlkCacheAddDirtyEntry(pBlkCache, pEntryNew))
+                        pdmBlkCacheWorkerKick(pCache, true /* fCommit */);
                     STAM_COUNTER_ADD(&pCache->StatWritten, cbToWrite);
                 }
                 else
@@ -2396,7 +2655,9 @@ VMMR3DECL(int) PDMR3BlkCacheDiscard(PPDMBLKCACHE pBlkCache, PCRTRANGE paRanges,
                                     unsigned cRanges, void *pvUser)
 {
     int rc = VINF_SUCCESS;
+#ifdef VBOX_WITH_STATISTICS
     PPDMBLKCACHEGLOBAL pCache = pBlkCache->pCache;
+#endif
     PPDMBLKCACHEENTRY pEntry;
     PPDMBLKCACHEREQ pReq;
 
@@ -2439,8 +2700,8 @@ VMMR3DECL(int) PDMR3BlkCacheDiscard(PPDMBLKCACHE pBlkCache, PCRTRANGE paRanges,
                 cbThisDiscard = RT_MIN(pEntry->cbData - offDiff, cbLeft);
 
                 /* Ghost lists contain no data. */
-                if (   (pEntry->pList == &pCache->LruRecentlyUsedIn)
-                    || (pEntry->pList == &pCache->LruFrequentlyUsed))
+                if (   (pEntry->pList == &pEntry->pShard->LruRecentlyUsedIn)
+                    || (pEntry->pList == &pEntry->pShard->LruFrequentlyUsed))
                 {
                     /* Check if the entry is dirty. */
                     if (pdmBlkCacheEntryFlagIsSetClearAcquireLock(pBlkCache, pEntry,
@@ -2450,14 +2711,14 @@ VMMR3DECL(int) PDMR3BlkCacheDiscard(PPDMBLKCACHE pBlkCache, PCRTRANGE paRanges,
                         /* If it is dirty but not yet in progress remove it. */
                         if (!(pEntry->fFlags & PDMBLKCACHE_ENTRY_IO_IN_PROGRESS))
                         {
-                            pdmBlkCacheLockEnter(pCache);
+                            pdmBlkCacheShardLockEnter(pEntry->pShard);
                             pdmBlkCacheEntryRemoveFromList(pEntry);
 
                             STAM_PROFILE_ADV_START(&pCache->StatTreeRemove, Cache);
                             RTAvlrU64Remove(pBlkCache->pTree, pEntry->Core.Key);
                             STAM_PROFILE_ADV_STOP(&pCache->StatTreeRemove, Cache);
 
-                            pdmBlkCacheLockLeave(pCache);
+                            pdmBlkCacheShardLockLeave(pEntry->pShard);
 
                             RTMemFree(pEntry);
                         }
@@ -2496,7 +2757,7 @@ VMMR3DECL(int) PDMR3BlkCacheDiscard(PPDMBLKCACHE pBlkCache, PCRTRANGE paRanges,
                         }
                         else /* I/O in progress flag not set */
                         {
-                            pdmBlkCacheLockEnter(pCache);
+                            pdmBlkCacheShardLockEnter(pEntry->pShard);
                             pdmBlkCacheEntryRemoveFromList(pEntry);
 
                             RTSemRWRequestWrite(pBlkCache->SemRWEntries, RT_INDEFINITE_WAIT);
@@ -2505,7 +2766,7 @@ VMMR3DECL(int) PDMR3BlkCacheDiscard(PPDMBLKCACHE pBlkCache, PCRTRANGE paRanges,
                             STAM_PROFILE_ADV_STOP(&pCache->StatTreeRemove, Cache);
                             RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
 
-                            pdmBlkCacheLockLeave(pCache);
+                            pdmBlkCacheShardLockLeave(pEntry->pShard);
 
                             RTMemFree(pEntry);
                         }
@@ -2513,7 +2774,7 @@ VMMR3DECL(int) PDMR3BlkCacheDiscard(PPDMBLKCACHE pBlkCache, PCRTRANGE paRanges,
                 }
                 else /* Entry is on the ghost list just remove cache entry. */
                 {
-                    pdmBlkCacheLockEnter(pCache);
+                    pdmBlkCacheShardLockEnter(pEntry->pShard);
                     pdmBlkCacheEntryRemoveFromList(pEntry);
 
                     RTSemRWRequestWrite(pBlkCache->SemRWEntries, RT_INDEFINITE_WAIT);
@@ -2522,7 +2783,7 @@ VMMR3DECL(int) PDMR3BlkCacheDiscard(PPDMBLKCACHE pBlkCache, PCRTRANGE paRanges,
                     STAM_PROFILE_ADV_STOP(&pCache->StatTreeRemove, Cache);
                     RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
 
-                    pdmBlkCacheLockLeave(pCache);
+                    pdmBlkCacheShardLockLeave(pEntry->pShard);
 
                     RTMemFree(pEntry);
                 }
@@ -2654,7 +2915,7 @@ static void pdmBlkCacheIoXferCompleteEntry(PPDMBLKCACHE pBlkCache, PPDMBLKCACHEI
     pdmBlkCacheEntryRelease(pEntry);
 
     if (fCommit)
-        pdmBlkCacheCommitDirtyEntries(pCache);
+        pdmBlkCacheWorkerKick(pCache, true /* fCommit */);
 
     /* Complete waiters now. */
     while (pComplete)
@@ -2749,12 +3010,12 @@ VMMR3DECL(int) PDMR3BlkCacheClear(PPDMBLKCACHE pBlkCache)
         pdmBlkCacheCommit(pBlkCache);
 
     /* Make sure nobody is accessing the cache while we delete the tree. */
-    pdmBlkCacheLockEnter(pCache);
+    pdmBlkCacheShardLockEnterAll(pCache);
     RTSemRWRequestWrite(pBlkCache->SemRWEntries, RT_INDEFINITE_WAIT);
     RTAvlrU64Destroy(pBlkCache->pTree, pdmBlkCacheEntryDestroy, pCache);
     RTSemRWReleaseWrite(pBlkCache->SemRWEntries);
 
-    pdmBlkCacheLockLeave(pCache);
+    pdmBlkCacheShardLockLeaveAll(pCache);
     return rc;
 }
 
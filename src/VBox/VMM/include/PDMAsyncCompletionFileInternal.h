@@ -165,6 +165,14 @@ typedef struct PDMACEPFILEMGR
     unsigned                               cRequestsActive;
     /** Number of maximum requests active. */
     uint32_t                               cRequestsActiveMax;
+    /** Number of requests the async I/O context was created for,
+     * cRequestsActiveMax can be raised up to this value without recreating it. */
+    uint32_t                               cRequestsCtxMax;
+    /** Moving average of the request completion latency in nanoseconds. */
+    uint64_t                               cNsLatencyAvg;
+    /** Lowest average completion latency seen so far in nanoseconds,
+     * the baseline for an unsaturated host. */
+    uint64_t                               cNsLatencyMin;
     /** Pointer to an array of free async I/O request handles. */
     RTFILEAIOREQ                          *pahReqsFree;
     /** Index of the next free entry in the cache. */
@@ -269,6 +277,8 @@ typedef struct PDMASYNCCOMPLETIONEPCLASSFILE
     uint32_t                            cReqsOutstandingMax;
     /** Bitmask for checking the alignment of a buffer. */
     RTR3UINTPTR                         uBitmaskAlignment;
+    /** Flag whether the host can do async I/O on files opened without RTFILE_O_NO_CACHE. */
+    bool                                fAsyncBufferedIo;
     /** Flag whether the out of resources warning was printed already. */
     bool                                fOutOfResourcesWarningPrinted;
 #ifdef PDM_ASYNC_COMPLETION_FILE_WITH_DELAY
@@ -494,6 +504,11 @@ typedef struct PDMACTASKFILE
     uint32_t                             offBounceBuffer;
     /** Flag whether this is a prefetch request. */
     bool                                 fPrefetch;
+    /** List of adjacent tasks merged into the request of this task,
+     * their data lives in the bounce buffer of this task. */
+    struct PDMACTASKFILE                *pMergedNext;
+    /** Timestamp when the request was submitted to the host, for latency tracking. */
+    uint64_t                             tsNsSubmit;
     /** Already prepared native I/O request.
      * Used if the request is prepared already but
      * was not queued because the host has not enough
@@ -41,6 +41,8 @@ RT_C_DECLS_BEGIN
 typedef struct PDMBLKLRULIST *PPDMBLKLRULIST;
 /** Pointer to the global cache structure. */
 typedef struct PDMBLKCACHEGLOBAL *PPDMBLKCACHEGLOBAL;
+/** Pointer to a cache shard. */
+typedef struct PDMBLKCACHESHARD *PPDMBLKCACHESHARD;
 /** Pointer to a cache entry waiter structure. */
 typedef struct PDMBLKCACHEWAITER *PPDMBLKCACHEWAITER;
 
@@ -59,6 +61,8 @@ typedef struct PDMBLKCACHEENTRY
     PPDMBLKLRULIST                  pList;
     /** Cache the entry belongs to. */
     PPDMBLKCACHE                    pBlkCache;
+    /** Shard managing the LRU state of the entry. */
+    PPDMBLKCACHESHARD               pShard;
     /** Flags for this entry. Combinations of PDMACFILECACHE_* #defines */
     volatile uint32_t               fFlags;
     /** Reference counter. Prevents eviction of the entry if > 0. */
@@ -96,19 +100,34 @@ typedef struct PDMBLKLRULIST
     uint32_t          cbCached;
 } PDMBLKLRULIST;
 
+/** Maximum number of cache shards. */
+#define PDMBLKCACHE_SHARDS_MAX              16
+/** Minimum amount of cache memory a shard gets assigned by default. */
+#define PDMBLKCACHE_SHARD_SIZE_MIN          _4M
+/** Shift of the disk region size which is mapped to the same shard (1MB). */
+#define PDMBLKCACHE_SHARD_REGION_SHIFT      20
+
 /**
- * Global cache data.
+ * Cache shard.
+ *
+ * The cache budget is split evenly between the shards. Every shard has its
+ * own 2Q LRU lists and lock so accesses to different disks or disk regions
+ * don't serialize on a single critical section.
  */
-typedef struct PDMBLKCACHEGLOBAL
+typedef struct PDMBLKCACHESHARD
 {
-    /** Pointer to the owning VM instance. */
-    PVM                 pVM;
-    /** Maximum size of the cache in bytes. */
+    /** Critical section protecting the shard. */
+    RTCRITSECT          CritSect;
+    /** Pointer to the global cache data. */
+    PPDMBLKCACHEGLOBAL  pCache;
+    /** Maximum size of the shard in bytes. */
     uint32_t            cbMax;
-    /** Current size of the cache in bytes. */
+    /** Current size of the shard in bytes. */
     uint32_t            cbCached;
-    /** Critical section protecting the cache. */
-    RTCRITSECT          CritSect;
+    /** Amount of cached bytes above which the worker thread is woken up to evict entries. */
+    uint32_t            cbHighWater;
+    /** Amount of cached bytes the worker thread evicts down to. */
+    uint32_t            cbLowWater;
     /** Maximum number of bytes cached. */
     uint32_t            cbRecentlyUsedInMax;
     /** Maximum number of bytes in the paged out list .*/
@@ -119,6 +138,25 @@ typedef struct PDMBLKCACHEGLOBAL
     PDMBLKLRULIST       LruRecentlyUsedOut;
     /** List of frequently used cache entries */
     PDMBLKLRULIST       LruFrequentlyUsed;
+} PDMBLKCACHESHARD;
+
+/**
+ * Global cache data.
+ */
+typedef struct PDMBLKCACHEGLOBAL
+{
+    /** Pointer to the owning VM instance. */
+    PVM                 pVM;
+    /** Maximum size of the cache in bytes. */
+    uint32_t            cbMax;
+    /** Number of shards, power of two. */
+    uint32_t            cShards;
+    /** Pointer to the array of shards. */
+    PPDMBLKCACHESHARD   paShards;
+    /** Shard index the next cache user starts at. */
+    uint32_t            idxShardNext;
+    /** Critical section protecting the list of users. */
+    RTCRITSECT          CritSect;
     /** Commit timeout in milli seconds */
     uint32_t            u32CommitTimeoutMs;
     /** Number of dirty bytes needed to start a commit of the data to the disk. */
@@ -129,6 +167,16 @@ typedef struct PDMBLKCACHEGLOBAL
     volatile bool       fIoErrorVmSuspended;
     /** Flag whether a commit is currently in progress. */
     volatile bool       fCommitInProgress;
+    /** Flag whether the worker thread was asked to commit the dirty entries. */
+    volatile bool       fCommitRequested;
+    /** Flag whether the worker thread was signalled already. */
+    volatile bool       fWorkerSignalled;
+    /** Flag whether the worker thread should terminate. */
+    volatile bool       fShutdown;
+    /** Worker thread committing dirty entries and evicting data. */
+    RTTHREAD            hThreadWorker;
+    /** Event semaphore the worker thread waits on. */
+    RTSEMEVENT          hEvtWorker;
     /** Commit interval timer */
     PTMTIMERR3          pTimerCommit;
     /** Number of endpoints using the cache. */
@@ -194,6 +242,8 @@ typedef struct PDMBLKCACHE
     RTLISTANCHOR                  ListDirtyNotCommitted;
     /** Node of the cache user list. */
     RTLISTNODE                    NodeCacheUser;
+    /** Index of the shard the first disk region of this user is mapped to. */
+    uint32_t                      idxShardFirst;
     /** Block cache type. */
     PDMBLKCACHETYPE               enmType;
     /** Type specific data. */